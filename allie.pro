@@ -4,6 +4,7 @@ SUBDIRS += lib version src
 src.depends = lib version
 
 !win32 {
-    SUBDIRS += tests
+    SUBDIRS += tests benchmarks
     tests.depends = lib version
+    benchmarks.depends = lib version
 }
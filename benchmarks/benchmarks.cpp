@@ -0,0 +1,507 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "benchmarks.h"
+
+#include <QtCore>
+
+#include "cache.h"
+#include "game.h"
+#include "history.h"
+#include "movegen.h"
+#include "nn.h"
+#include "options.h"
+#include "search.h"
+#include "tb.h"
+#include "tree.h"
+#include "uciengine.h"
+#include "zobrist.h"
+
+// Opening, middlegame with every kind of move and a sparse endgame
+static const char *s_fens[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 10",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 11"
+};
+static const char *s_fenNames[] = { "start", "kiwipete", "endgame" };
+static const int s_fenCount = 3;
+
+static const int s_batchSize = 256;
+static const quint32 s_treeVisits = 20000;
+static const quint32 s_largeTreeVisits = 10000000; // far beyond the caches of the processor
+static const int s_rounds = 40;
+
+// Kept from being optimized away
+static volatile quint64 s_sink = 0;
+
+static quint32 nextRandom(quint32 *state)
+{
+    // xorshift32 seeded the same every run so every run grows the same tree
+    quint32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+struct CacheItem {
+    bool deinitialize(bool forcedFree)
+    {
+        Q_UNUSED(forcedFree)
+        return true;
+    }
+
+    quint64 id = 0;
+};
+
+inline quint64 fixedHash(const CacheItem &item)
+{
+    return item.id;
+}
+
+inline quint64 isPinned(const CacheItem &item)
+{
+    Q_UNUSED(item)
+    return false;
+}
+
+inline bool shouldMakeUnique(const CacheItem &item)
+{
+    Q_UNUSED(item)
+    return false;
+}
+
+inline void setUniqueFlag(CacheItem &item)
+{
+    Q_UNUSED(item)
+}
+
+inline void grantEvictionCredit(CacheItem &item)
+{
+    Q_UNUSED(item)
+}
+
+inline bool spendEvictionCredit(CacheItem &item)
+{
+    Q_UNUSED(item)
+    return false;
+}
+
+static const quint64 s_cacheSize = 1 << 16;
+
+static quint64 cacheKey(quint64 i)
+{
+    return (i + 1) * 0x9E3779B97F4A7C15ull;
+}
+
+void Benchmarks::initTestCase()
+{
+    Options::globalInstance()->setOption("SyzygyPath",
+        QCoreApplication::applicationDirPath() + QDir::separator() + "../../syzygy/");
+    Options::globalInstance()->setOption("Cache", QLatin1Literal("200000"));
+
+    // The network is only needed by its own benchmarks
+    m_hasNetwork = !Options::globalInstance()->option("WeightsFile").value().isEmpty();
+    if (m_hasNetwork) {
+        UciEngine::resetSharedState();
+    } else {
+        Cache::globalInstance()->reset();
+        TB::globalInstance()->reset();
+    }
+}
+
+void Benchmarks::cleanupTestCase()
+{
+}
+
+void Benchmarks::init()
+{
+    Cache::globalInstance()->reset();
+    History::globalInstance()->clear();
+}
+
+void Benchmarks::cleanup()
+{
+    Options::globalInstance()->setOption("Cache", QLatin1Literal("200000"));
+}
+
+void Benchmarks::startTree(Tree *tree, const QString &fen)
+{
+    History::globalInstance()->addGame(StandaloneGame(fen));
+    Node *root = tree->embodiedRoot();
+    root->setPositionQValue(0.0f);
+    root->setQValueAndVisit();
+    root->generatePotentials();
+    Node::PotentialVector *potentials = root->position()->potentials();
+    for (int i = 0; i < potentials->count(); ++i)
+        (*potentials)[i].setPValue(1.0f / potentials->count());
+}
+
+void Benchmarks::playoutBatch(Tree *tree, int size, QVector<Node*> *batch)
+{
+    int vldMax = SearchSettings::vldMax;
+    int tryPlayoutLimit = SearchSettings::tryPlayoutLimit;
+    bool hardExit = false;
+    Cache *cache = Cache::globalInstance();
+    while (batch->count() < size && cache->used() < cache->size()) {
+        Node *playout = Node::playout(tree->embodiedRoot(), &vldMax, &tryPlayoutLimit, &hardExit, cache);
+        if (!playout)
+            break;
+        batch->append(playout);
+    }
+}
+
+QVector<Node*> Benchmarks::expandBatch(const QVector<Node*> &batch, QVector<Node*> *dirtyLeaves)
+{
+    // Like the search, except that transpositions are taken without their checkmate flag
+    Cache *cache = Cache::globalInstance();
+    QVector<Node*> evaluating;
+    for (Node *playout : batch) {
+        if (playout->isExact()) {
+            playout->backPropagateDirty();
+            dirtyLeaves->append(playout);
+            continue;
+        }
+
+        const quint64 hash = playout->initializePosition(cache);
+        if (playout->checkMoveClockOrThreefold(hash, cache)) {
+            playout->backPropagateGameContextAndDirty();
+            dirtyLeaves->append(playout);
+            continue;
+        }
+
+        if (playout->position()->hasQValue()) {
+            playout->setType(playout->positionType());
+            playout->backPropagateDirty();
+            dirtyLeaves->append(playout);
+            continue;
+        }
+
+        // Checkmates, stalemates and tablebase hits are scored without the network
+        playout->generatePotentials();
+        if (playout->isExact()) {
+            playout->backPropagateDirty();
+            dirtyLeaves->append(playout);
+            continue;
+        }
+
+        evaluating.append(playout);
+    }
+    return evaluating;
+}
+
+void Benchmarks::scoreBatch(const QVector<Node*> &batch, QVector<Node*> *dirtyLeaves, quint32 *random)
+{
+    for (Node *node : batch) {
+        Node::PotentialVector *potentials = node->position()->potentials();
+        for (int i = 0; i < potentials->count(); ++i)
+            (*potentials)[i].setPValue(1.0f / potentials->count());
+        node->setPositionQValue((nextRandom(random) % 1001) / 1000.0f - 0.5f);
+        node->backPropagateDirty();
+        dirtyLeaves->append(node);
+    }
+}
+
+void Benchmarks::growTree(Tree *tree, quint32 visits)
+{
+    quint32 random = 2463534242u;
+    QVector<Node*> batch;
+    QVector<Node*> dirtyLeaves;
+    while (tree->embodiedRoot()->visits() < visits) {
+        batch.clear();
+        playoutBatch(tree, s_batchSize, &batch);
+        if (batch.isEmpty())
+            break;
+        scoreBatch(expandBatch(batch, &dirtyLeaves), &dirtyLeaves, &random);
+        WorkerInfo info;
+        Node::minimaxPaths(dirtyLeaves, &info);
+        dirtyLeaves.clear();
+    }
+}
+
+void Benchmarks::benchmarkSliderAttacks()
+{
+    quint32 random = 2463534242u;
+    QVector<BitBoard> occupancies;
+    for (int i = 0; i < 64; ++i)
+        occupancies.append(BitBoard((quint64(nextRandom(&random)) << 32 | nextRandom(&random))
+            & (quint64(nextRandom(&random)) << 32 | nextRandom(&random))));
+
+    const Movegen *gen = Movegen::globalInstance();
+    quint64 sink = 0;
+    QBENCHMARK {
+        for (const BitBoard &occupied : occupancies) {
+            for (int sq = 0; sq < 64; ++sq) {
+                const Square square(sq);
+                sink ^= gen->rookAttacks(square, occupied).data();
+                sink ^= gen->bishopAttacks(square, occupied).data();
+            }
+        }
+    }
+    s_sink = sink;
+}
+
+void Benchmarks::benchmarkZobristHash()
+{
+    QVector<StandaloneGame> games;
+    for (int i = 0; i < s_fenCount; ++i)
+        games.append(StandaloneGame(s_fens[i]));
+
+    quint64 sink = 0;
+    QBENCHMARK {
+        for (const StandaloneGame &game : games)
+            sink ^= Zobrist::hash(game.position());
+    }
+    s_sink = sink;
+}
+
+void Benchmarks::benchmarkLegalMoves()
+{
+    QVector<StandaloneGame> games;
+    for (int i = 0; i < s_fenCount; ++i)
+        games.append(StandaloneGame(s_fens[i]));
+
+    Move moves[Game::Position::MaximumMoves];
+    quint64 sink = 0;
+    QBENCHMARK {
+        for (const StandaloneGame &game : games)
+            sink += quint64(game.position().legalMoves(moves));
+    }
+    s_sink = sink;
+}
+
+void Benchmarks::benchmarkGeneratePotentials_data()
+{
+    QTest::addColumn<QString>("fen");
+    for (int i = 0; i < s_fenCount; ++i)
+        QTest::newRow(s_fenNames[i]) << QString(s_fens[i]);
+}
+
+void Benchmarks::benchmarkGeneratePotentials()
+{
+    QFETCH(QString, fen);
+    Tree tree;
+    History::globalInstance()->addGame(StandaloneGame(fen));
+    Node *root = tree.embodiedRoot();
+    QVERIFY(root);
+
+    QBENCHMARK {
+        root->position()->potentials()->clear();
+        root->generatePotentials();
+    }
+    QVERIFY(root->hasPotentials());
+}
+
+void Benchmarks::benchmarkEncodePosition()
+{
+    if (!m_hasNetwork)
+        QSKIP("No network weights");
+
+    Tree tree;
+    startTree(&tree, s_fens[1]);
+    growTree(&tree, s_treeVisits);
+    QVector<Node*> batch;
+    QVector<Node*> dirtyLeaves;
+    playoutBatch(&tree, s_batchSize, &batch);
+    const QVector<Node*> evaluating = expandBatch(batch, &dirtyLeaves);
+    QVERIFY(!evaluating.isEmpty());
+
+    Computation *computation = NeuralNet::globalInstance()->acquireNetwork(evaluating.count());
+    QVERIFY(computation);
+    quint64 sink = 0;
+    QBENCHMARK {
+        computation->reset();
+        for (const Node *node : evaluating) {
+            sink ^= computation->encodePosition(node);
+            computation->addEncodedPosition(node);
+        }
+    }
+    s_sink = sink;
+    NeuralNet::globalInstance()->releaseNetwork(computation);
+}
+
+void Benchmarks::benchmarkSetPVals()
+{
+    if (!m_hasNetwork)
+        QSKIP("No network weights");
+
+    Tree tree;
+    startTree(&tree, s_fens[1]);
+    growTree(&tree, s_treeVisits);
+    QVector<Node*> batch;
+    QVector<Node*> dirtyLeaves;
+    playoutBatch(&tree, s_batchSize, &batch);
+    const QVector<Node*> evaluating = expandBatch(batch, &dirtyLeaves);
+    QVERIFY(!evaluating.isEmpty());
+
+    Computation *computation = NeuralNet::globalInstance()->acquireNetwork(evaluating.count());
+    QVERIFY(computation);
+    computation->reset();
+    for (const Node *node : evaluating) {
+        computation->encodePosition(node);
+        computation->addEncodedPosition(node);
+    }
+    computation->evaluate();
+    QCOMPARE(computation->positions(), evaluating.count());
+
+    QBENCHMARK {
+        for (int index = 0; index < evaluating.count(); ++index)
+            computation->setPVals(index, evaluating.at(index));
+    }
+    NeuralNet::globalInstance()->releaseNetwork(computation);
+}
+
+void Benchmarks::benchmarkCacheInsert()
+{
+    // Twice the capacity so half of the inserts evict
+    FixedSizeCache<CacheItem> cache;
+    cache.reset(s_cacheSize);
+    quint64 next = 0;
+    QBENCHMARK {
+        for (quint64 i = 0; i < s_cacheSize; ++i) {
+            const quint64 key = cacheKey(next++ % (2 * s_cacheSize));
+            if (!cache.contains(key))
+                cache.newObject(key)->id = key;
+        }
+    }
+    QVERIFY(cache.used() == s_cacheSize);
+}
+
+void Benchmarks::benchmarkCacheLookup()
+{
+    FixedSizeCache<CacheItem> cache;
+    cache.reset(s_cacheSize);
+    for (quint64 i = 0; i < s_cacheSize; ++i)
+        cache.newObject(cacheKey(i))->id = cacheKey(i);
+
+    quint64 sink = 0;
+    QBENCHMARK {
+        for (quint64 i = 0; i < s_cacheSize; ++i)
+            sink += cache.object(cacheKey(i))->id;
+    }
+    s_sink = sink;
+}
+
+void Benchmarks::benchmarkCacheRelink()
+{
+    // What the tree does when it reaches a position that is already cached, which moves it to the
+    // front of the least recently used order
+    FixedSizeCache<CacheItem> cache;
+    cache.reset(s_cacheSize);
+    for (quint64 i = 0; i < s_cacheSize; ++i)
+        cache.newObject(cacheKey(i))->id = cacheKey(i);
+
+    quint64 sink = 0;
+    QBENCHMARK {
+        for (quint64 i = 0; i < s_cacheSize; ++i) {
+            bool madeUnique = false;
+            sink += cache.objectRelinkOrMakeUnique(cacheKey(i), &madeUnique)->id;
+        }
+    }
+    s_sink = sink;
+}
+
+void Benchmarks::benchmarkPlayout_data()
+{
+    QTest::addColumn<quint32>("visits");
+    QTest::newRow("small") << s_treeVisits;
+    QTest::newRow("large") << s_largeTreeVisits;
+}
+
+void Benchmarks::benchmarkPlayout()
+{
+    // Only the descent is timed, the made up scoring and the backup between batches are not. The
+    // large tree is where the descent mostly waits on memory.
+    QFETCH(quint32, visits);
+    if (visits > s_treeVisits) {
+        Options::globalInstance()->setOption("Cache", QString::number(visits + visits / 4));
+        Cache::globalInstance()->reset();
+    }
+
+    Tree tree;
+    startTree(&tree, s_fens[1]);
+    growTree(&tree, visits);
+
+    quint32 random = 2891336453u;
+    qint64 nsecs = 0;
+    int playouts = 0;
+    QVector<Node*> batch;
+    QVector<Node*> dirtyLeaves;
+    for (int round = 0; round < s_rounds; ++round) {
+        batch.clear();
+        QElapsedTimer timer;
+        timer.start();
+        playoutBatch(&tree, s_batchSize, &batch);
+        nsecs += timer.nsecsElapsed();
+        playouts += batch.count();
+        scoreBatch(expandBatch(batch, &dirtyLeaves), &dirtyLeaves, &random);
+        WorkerInfo info;
+        Node::minimaxPaths(dirtyLeaves, &info);
+        dirtyLeaves.clear();
+    }
+    QVERIFY(playouts);
+    QTest::setBenchmarkResult(qreal(nsecs) / playouts, QTest::WalltimeNanoseconds);
+}
+
+void Benchmarks::benchmarkMinimax_data()
+{
+    QTest::addColumn<bool>("incremental");
+    QTest::newRow("paths") << true;
+    QTest::newRow("full") << false;
+}
+
+void Benchmarks::benchmarkMinimax()
+{
+    // A backup of one batch of dirty leaves of a large tree, the playouts are not timed
+    QFETCH(bool, incremental);
+    Tree tree;
+    startTree(&tree, s_fens[1]);
+    growTree(&tree, s_treeVisits);
+
+    quint32 random = 2891336453u;
+    qint64 nsecs = 0;
+    int rounds = 0;
+    QVector<Node*> batch;
+    QVector<Node*> dirtyLeaves;
+    for (int round = 0; round < s_rounds; ++round) {
+        batch.clear();
+        playoutBatch(&tree, s_batchSize, &batch);
+        if (batch.isEmpty())
+            break;
+        scoreBatch(expandBatch(batch, &dirtyLeaves), &dirtyLeaves, &random);
+
+        QElapsedTimer timer;
+        timer.start();
+        WorkerInfo info;
+        if (incremental) {
+            Node::minimaxPaths(dirtyLeaves, &info);
+        } else {
+            double newScores = 0;
+            quint32 newVisits = 0;
+            Node::minimax(tree.embodiedRoot(), 0 /*depth*/, &info, &newScores, &newVisits);
+        }
+        nsecs += timer.nsecsElapsed();
+        ++rounds;
+        dirtyLeaves.clear();
+    }
+    QVERIFY(rounds);
+    QTest::setBenchmarkResult(qreal(nsecs) / rounds, QTest::WalltimeNanoseconds);
+}
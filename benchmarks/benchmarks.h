@@ -0,0 +1,74 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+#include <QtTest/QtTest>
+
+#include "node.h"
+
+class Tree;
+
+// Speed of the hot paths of the engine one at a time. The function names, and the data tags where
+// there are rows, are kept stable so that results can be compared from release to release.
+class Benchmarks: public QObject {
+    Q_OBJECT
+
+    // helpers go here
+    static void startTree(Tree *tree, const QString &fen);
+    static void playoutBatch(Tree *tree, int size, QVector<Node*> *batch);
+    static QVector<Node*> expandBatch(const QVector<Node*> &batch, QVector<Node*> *dirtyLeaves);
+    static void scoreBatch(const QVector<Node*> &batch, QVector<Node*> *dirtyLeaves, quint32 *random);
+    static void growTree(Tree *tree, quint32 visits);
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void init();
+    void cleanup();
+
+    // Move generation and hashing
+    void benchmarkSliderAttacks();
+    void benchmarkZobristHash();
+    void benchmarkLegalMoves();
+    void benchmarkGeneratePotentials_data();
+    void benchmarkGeneratePotentials();
+
+    // Network input and output, skipped without weights
+    void benchmarkEncodePosition();
+    void benchmarkSetPVals();
+
+    // The position cache
+    void benchmarkCacheInsert();
+    void benchmarkCacheLookup();
+    void benchmarkCacheRelink();
+
+    // The tree, grown with made up scores in place of the network
+    void benchmarkPlayout_data();
+    void benchmarkPlayout();
+    void benchmarkMinimax_data();
+    void benchmarkMinimax();
+
+private:
+    bool m_hasNetwork = false;
+};
+
+#endif // BENCHMARKS_H
@@ -0,0 +1,467 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "analyzeengine.h"
+
+#include <QCoreApplication>
+#include <QDebug>
+
+#include "game.h"
+#include "move.h"
+#include "notation.h"
+#include "options.h"
+
+#include <stdio.h>
+
+#define START_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
+
+AnalyzeSession::AnalyzeSession(int session, quint64 cachePositions, QObject *parent)
+    : QObject(parent),
+    m_session(session),
+    m_cachePositions(cachePositions),
+    m_ioHandler(nullptr),
+    m_engine(nullptr)
+{
+}
+
+AnalyzeSession::~AnalyzeSession()
+{
+    // Before our history and cache go away
+    delete m_engine;
+    m_engine = nullptr;
+    History::setThreadInstance(nullptr);
+    Cache::setThreadInstance(nullptr);
+}
+
+void AnalyzeSession::analyze(const QString &position, int nodes)
+{
+    // Made on our own thread once that is bound to our history and cache, see ServerSession
+    if (!m_engine) {
+        m_cache.reset(m_cachePositions);
+        History::setThreadInstance(&m_history);
+        Cache::setThreadInstance(&m_cache);
+        m_engine = new UciEngine(this, QString() /*debugFile*/);
+        m_engine->setSession(QString() /*outputPrefix*/);
+        m_ioHandler = new UCIIOHandler(this);
+        m_engine->installIOHandler(m_ioHandler);
+        connect(m_ioHandler, &UCIIOHandler::receivedAverages, this, &AnalyzeSession::finished);
+    }
+
+    // Consecutive positions of a game carry on with the tree of the last one
+    m_ioHandler->clear();
+    m_engine->readyRead(QLatin1String("position ") + position);
+    m_engine->readyRead(QString("go nodes %0").arg(nodes));
+}
+
+void AnalyzeSession::quit()
+{
+    if (m_engine)
+        m_engine->readyRead(QLatin1String("quit"));
+}
+
+void AnalyzeSession::finished()
+{
+    emit analyzed(m_session, m_ioHandler->lastBestMove(), m_ioHandler->lastInfo());
+}
+
+AnalyzeEngine::AnalyzeEngine(QObject *parent)
+    : QObject(parent),
+    m_isPgn(false),
+    m_nodes(0),
+    m_index(0),
+    m_games(0),
+    m_busy(0),
+    m_finished(false)
+{
+}
+
+AnalyzeEngine::~AnalyzeEngine()
+{
+}
+
+bool AnalyzeEngine::run()
+{
+    const QString input = Options::globalInstance()->option("AnalyzeInput").value();
+    const QString output = Options::globalInstance()->option("AnalyzeOutput").value();
+    const QString format = Options::globalInstance()->option("AnalyzeFormat").value();
+    m_nodes = Options::globalInstance()->option("AnalyzeNodes").value().toInt();
+    const int concurrency = Options::globalInstance()->option("AnalyzeConcurrency").value().toInt();
+
+    bool opened = false;
+    if (input.isEmpty()) {
+        opened = m_inputFile.open(stdin, QIODevice::ReadOnly | QIODevice::Text);
+    } else {
+        m_inputFile.setFileName(input);
+        opened = m_inputFile.open(QIODevice::ReadOnly | QIODevice::Text);
+    }
+    if (!opened) {
+        qCritical() << "Could not open" << input << "for analysis";
+        return false;
+    }
+
+    if (output.isEmpty()) {
+        opened = m_outputFile.open(stdout, QIODevice::WriteOnly | QIODevice::Text);
+    } else {
+        m_outputFile.setFileName(output);
+        opened = m_outputFile.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate);
+    }
+    if (!opened) {
+        qCritical() << "Could not open" << output << "for the results";
+        return false;
+    }
+
+    m_input.setDevice(&m_inputFile);
+    m_output.setDevice(&m_outputFile);
+    m_isPgn = format == QLatin1String("pgn")
+        || (format == QLatin1String("auto") && input.endsWith(QLatin1String(".pgn"), Qt::CaseInsensitive));
+
+    // Everything the searches share is brought up once before any of them starts, though each
+    // searches in a share of the cache of its own as the caches are not safe for several trees
+    // to grow at once
+    UciEngine::resetSharedState(true /*forSessions*/);
+    const quint64 cachePositions = Cache::positionsFromOptions() / quint64(concurrency);
+
+    for (int i = 0; i < concurrency; ++i) {
+        Session s;
+        s.thread = new QThread;
+        s.thread->setObjectName(QString("analyze %0").arg(i));
+        s.session = new AnalyzeSession(i, cachePositions);
+        s.session->moveToThread(s.thread);
+        connect(s.thread, &QThread::finished, s.session, &QObject::deleteLater);
+        connect(s.session, &AnalyzeSession::analyzed, this, &AnalyzeEngine::analyzed);
+        s.thread->start();
+        m_sessions.append(s);
+    }
+
+    for (int i = 0; i < m_sessions.count(); ++i)
+        dispatch(i);
+    return true;
+}
+
+void AnalyzeEngine::analyzed(int session, const QString &bestMove, const SearchInfo &info)
+{
+    Session &s = m_sessions[session];
+    Q_ASSERT(s.isBusy);
+    s.isBusy = false;
+    --m_busy;
+    write(s.job, bestMove, info);
+    dispatch(session);
+}
+
+void AnalyzeEngine::dispatch(int session)
+{
+    if (m_finished)
+        return;
+
+    Job job;
+    while (nextJob(&job)) {
+        // Nothing to search when there is no legal move
+        if (job.isTerminal) {
+            write(job, QString(), SearchInfo());
+            continue;
+        }
+
+        Session &s = m_sessions[session];
+        s.job = job;
+        s.isBusy = true;
+        ++m_busy;
+        QMetaObject::invokeMethod(s.session, "analyze", Qt::QueuedConnection,
+            Q_ARG(QString, job.position), Q_ARG(int, m_nodes));
+        return;
+    }
+
+    if (!m_busy)
+        finish();
+}
+
+void AnalyzeEngine::finish()
+{
+    m_finished = true;
+    for (const Session &s : m_sessions) {
+        QMetaObject::invokeMethod(s.session, "quit", Qt::BlockingQueuedConnection);
+        s.thread->quit();
+        s.thread->wait();
+        delete s.thread;
+    }
+    m_sessions.clear();
+    m_output.flush();
+    QMetaObject::invokeMethod(QCoreApplication::instance(), "quit", Qt::QueuedConnection);
+}
+
+bool AnalyzeEngine::nextJob(Job *job)
+{
+    while (m_pending.isEmpty()) {
+        if (!(m_isPgn ? readPgn() : readEpd()))
+            return false;
+    }
+    *job = m_pending.dequeue();
+    return true;
+}
+
+static bool readLine(QTextStream *stream, QString *peeked, QString *line)
+{
+    if (!peeked->isNull()) {
+        *line = *peeked;
+        *peeked = QString();
+        return true;
+    }
+    if (stream->atEnd())
+        return false;
+    *line = stream->readLine().trimmed();
+    return true;
+}
+
+static bool isTerminal(const QString &fen)
+{
+    const StandaloneGame game(fen);
+    return !game.position().legalMoveCount();
+}
+
+static QString unquoted(const QString &string)
+{
+    QString s = string.trimmed();
+    if (s.size() >= 2 && s.startsWith('"') && s.endsWith('"'))
+        s = s.mid(1, s.size() - 2);
+    return s;
+}
+
+bool AnalyzeEngine::readEpd()
+{
+    QString line;
+    QString peeked;
+    while (readLine(&m_input, &peeked, &line)) {
+        if (line.isEmpty() || line.startsWith('#'))
+            continue;
+
+        const QStringList fields = line.simplified().split(' ');
+        if (fields.count() < 4) {
+            qWarning() << "Skipping malformed epd" << line;
+            continue;
+        }
+
+        // The move numbers are opcodes in epd but a full fen is taken as well
+        QString halfMoveClock = QLatin1String("0");
+        QString fullMoveNumber = QLatin1String("1");
+        int operationsStart = 4;
+        if (fields.count() >= 6) {
+            bool isHalfMoveClock = false;
+            bool isFullMoveNumber = false;
+            fields.at(4).toInt(&isHalfMoveClock);
+            fields.at(5).toInt(&isFullMoveNumber);
+            if (isHalfMoveClock && isFullMoveNumber) {
+                halfMoveClock = fields.at(4);
+                fullMoveNumber = fields.at(5);
+                operationsStart = 6;
+            }
+        }
+
+        Job job;
+        QString operations;
+        for (int i = operationsStart; i < fields.count(); ++i)
+            operations += fields.at(i) + ' ';
+        const QStringList ops = operations.split(';');
+        for (const QString &op : ops) {
+            const QString trimmed = op.trimmed();
+            const int space = trimmed.indexOf(' ');
+            const QString opcode = space == -1 ? trimmed : trimmed.left(space);
+            const QString operand = space == -1 ? QString() : unquoted(trimmed.mid(space + 1));
+            if (opcode == QLatin1String("id"))
+                job.id = operand;
+            else if (opcode == QLatin1String("hmvc"))
+                halfMoveClock = operand;
+            else if (opcode == QLatin1String("fmvn"))
+                fullMoveNumber = operand;
+        }
+
+        job.index = m_index++;
+        job.fen = fields.at(0) + ' ' + fields.at(1) + ' ' + fields.at(2) + ' ' + fields.at(3) + ' ' + halfMoveClock + ' ' + fullMoveNumber;
+        job.position = QLatin1String("fen ") + job.fen;
+        job.isTerminal = isTerminal(job.fen);
+        m_pending.enqueue(job);
+        return true;
+    }
+    return false;
+}
+
+static bool isGameTermination(const QString &token)
+{
+    return token == QLatin1String("1-0") || token == QLatin1String("0-1")
+        || token == QLatin1String("1/2-1/2") || token == QLatin1String("*");
+}
+
+// The moves of the main line in standard algebraic notation without the comments, variations,
+// move numbers and annotations around them
+static QStringList mainLine(const QString &movetext)
+{
+    QString text;
+    int comment = 0;
+    int variation = 0;
+    for (const QChar c : movetext) {
+        if (c == '{')
+            ++comment;
+        else if (c == '}' && comment)
+            --comment;
+        else if (comment)
+            continue;
+        else if (c == '(')
+            ++variation;
+        else if (c == ')' && variation)
+            --variation;
+        else if (!variation)
+            text.append(c);
+    }
+
+    QStringList moves;
+    for (QString token : text.simplified().split(' ')) {
+        // Move numbers may be glued to the move that follows them
+        int start = 0;
+        while (start < token.size() && (token.at(start).isDigit() || token.at(start) == '.'))
+            ++start;
+        if (start == token.size())
+            continue;
+        if (start && token.at(start - 1) == '.')
+            token = token.mid(start);
+
+        if (token.isEmpty() || token.startsWith('$') || isGameTermination(token))
+            continue;
+
+        while (token.endsWith('!') || token.endsWith('?'))
+            token.chop(1);
+        if (token.endsWith(QLatin1String("e.p.")))
+            token.chop(4);
+        if (token.startsWith(QLatin1String("0-0")))
+            token.replace('0', 'O');
+        moves.append(token);
+    }
+    return moves;
+}
+
+bool AnalyzeEngine::readPgn()
+{
+    // Reads the next game and queues every position of its main line
+    QString fen = QLatin1String(START_FEN);
+    QString movetext;
+    QString line;
+    bool hasGame = false;
+    while (readLine(&m_input, &m_peekedLine, &line)) {
+        if (line.startsWith('%'))
+            continue;
+
+        if (line.startsWith('[')) {
+            // The tags of the next game when this one had no termination
+            if (!movetext.isEmpty()) {
+                m_peekedLine = line;
+                break;
+            }
+            hasGame = true;
+            if (line.startsWith(QLatin1String("[FEN ")))
+                fen = unquoted(line.mid(5, line.lastIndexOf(']') - 5));
+            continue;
+        }
+
+        const int rest = line.indexOf(';');
+        if (rest != -1 && line.indexOf('{') == -1)
+            line.truncate(rest);
+        if (line.isEmpty())
+            continue;
+
+        hasGame = true;
+        movetext += line + ' ';
+        if (isGameTermination(line.mid(line.lastIndexOf(' ') + 1)))
+            break;
+    }
+
+    if (!hasGame)
+        return false;
+
+    const int gameIndex = m_games++;
+    const QStringList moves = mainLine(movetext);
+    StandaloneGame game(fen);
+    QStringList played;
+    for (int ply = 0;; ++ply) {
+        Job job;
+        job.index = m_index++;
+        job.game = gameIndex;
+        job.ply = ply;
+        job.fen = game.stateOfGameToFen();
+        job.position = QLatin1String("fen ") + fen;
+        if (!played.isEmpty())
+            job.position += QLatin1String(" moves ") + played.join(' ');
+        job.isTerminal = !game.position().legalMoveCount();
+        m_pending.enqueue(job);
+
+        if (ply == moves.count())
+            break;
+
+        bool ok = false;
+        const Move move = Notation::stringToMove(moves.at(ply), Chess::Standard, &ok);
+        if (!ok || !game.makeMove(move)) {
+            qWarning() << "Stopping game" << gameIndex << "at illegal move" << moves.at(ply);
+            break;
+        }
+        played.append(Notation::moveToString(game.lastMove(), Chess::Computer));
+    }
+    return true;
+}
+
+QString jsonString(const QString &string)
+{
+    QString s = QLatin1String("\"");
+    for (const QChar c : string) {
+        if (c == '"' || c == '\\')
+            s += QString(QLatin1String("\\")) + c;
+        else if (c.unicode() < 0x20)
+            s += QString("\\u%1").arg(int(c.unicode()), 4, 16, QChar('0'));
+        else
+            s += c;
+    }
+    return s + QLatin1String("\"");
+}
+
+void AnalyzeEngine::write(const Job &job, const QString &bestMove, const SearchInfo &info)
+{
+    QString out;
+    QTextStream stream(&out);
+    stream << "{\"index\":" << job.index;
+    if (!job.id.isEmpty())
+        stream << ",\"id\":" << jsonString(job.id);
+    if (job.game != -1)
+        stream << ",\"game\":" << job.game << ",\"ply\":" << job.ply;
+    stream << ",\"fen\":" << jsonString(job.fen);
+
+    if (job.isTerminal) {
+        stream << ",\"bestmove\":null}";
+    } else {
+        // The score is either "cp <n>" or "mate <n>"
+        const QStringList score = info.score.split(' ');
+        stream << ",\"bestmove\":" << (bestMove.isEmpty() ? QLatin1String("null") : jsonString(bestMove));
+        if (score.count() == 2)
+            stream << ",\"" << score.at(0) << "\":" << score.at(1).toInt();
+        stream << ",\"depth\":" << info.depth
+               << ",\"seldepth\":" << info.seldepth
+               << ",\"nodes\":" << info.nodes
+               << ",\"time\":" << info.time
+               << ",\"pv\":" << jsonString(info.pv)
+               << "}";
+    }
+
+    m_output << out << "\n";
+    m_output.flush();
+}
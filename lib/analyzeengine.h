@@ -0,0 +1,119 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef ANALYZEENGINE_H
+#define ANALYZEENGINE_H
+
+#include <QFile>
+#include <QObject>
+#include <QQueue>
+#include <QTextStream>
+#include <QThread>
+#include <QVector>
+
+#include "benchmarkengine.h"
+#include "cache.h"
+#include "history.h"
+
+QString jsonString(const QString &string); // quoted and escaped for a json document
+
+// One of the searches running at the same time, an engine with its own tree, cache and game
+// history on a thread of its own like a session of the server
+class AnalyzeSession : public QObject {
+    Q_OBJECT
+public:
+    AnalyzeSession(int session, quint64 cachePositions, QObject *parent = nullptr);
+    ~AnalyzeSession() override;
+
+public Q_SLOTS:
+    void analyze(const QString &position, int nodes);
+    void quit();
+
+Q_SIGNALS:
+    void analyzed(int session, const QString &bestMove, const SearchInfo &info);
+
+private Q_SLOTS:
+    void finished();
+
+private:
+    int m_session;
+    quint64 m_cachePositions;
+    History m_history;
+    Cache m_cache;
+    UCIIOHandler *m_ioHandler;
+    UciEngine *m_engine;
+};
+
+// Searches every position of an epd or pgn stream to a node budget and writes one json line per
+// position. Several positions are searched at once so their playouts keep the gpus busy, which
+// means the results come out in the order they finish and carry the index of their position.
+// The memory of the Cache or CacheMB options is split evenly between the searches.
+class AnalyzeEngine : public QObject {
+    Q_OBJECT
+public:
+    AnalyzeEngine(QObject *parent);
+    ~AnalyzeEngine() override;
+
+    bool run(); // false when the input or output could not be opened
+
+private Q_SLOTS:
+    void analyzed(int session, const QString &bestMove, const SearchInfo &info);
+
+private:
+    struct Job {
+        quint64 index = 0;
+        QString id;
+        int game = -1;  // only for positions of a pgn game
+        int ply = 0;
+        QString fen;
+        QString position; // as the uci position command takes it
+        bool isTerminal = false;
+    };
+
+    struct Session {
+        QThread *thread = nullptr;
+        AnalyzeSession *session = nullptr;
+        Job job;
+        bool isBusy = false;
+    };
+
+    bool nextJob(Job *job);
+    bool readEpd();
+    bool readPgn();
+    void dispatch(int session);
+    void write(const Job &job, const QString &bestMove, const SearchInfo &info);
+    void finish();
+
+    QFile m_inputFile;
+    QFile m_outputFile;
+    QTextStream m_input;
+    QTextStream m_output;
+    QString m_peekedLine; // the tags of the next game read ahead
+    bool m_isPgn;
+    int m_nodes;
+    quint64 m_index;
+    int m_games;
+    QQueue<Job> m_pending;
+    QVector<Session> m_sessions;
+    int m_busy;
+    bool m_finished;
+};
+
+#endif // ANALYZEENGINE_H
@@ -20,8 +20,13 @@
 
 #include "benchmarkengine.h"
 
+#include <QtMath>
+
+#include "analyzeengine.h"
 #include "uciengine.h"
 #include "history.h"
+#include "memoryreport.h"
+#include "nn.h"
 #include "tree.h"
 
 // Stockfish positions
@@ -64,23 +69,33 @@ QVector<QString> s_positions = {
 
 BenchmarkEngine::BenchmarkEngine(QObject *parent)
     : QObject(parent),
+    m_warmup(0),
+    m_repeats(1),
+    m_format(Text),
+    m_position(0),
+    m_run(0),
     m_samples(0),
-    m_timeAtLastProgress(0)
+    m_timeAtLastProgress(0),
+    m_cacheHits(0),
+    m_cacheEvictions(0),
+    m_configuration(0)
 {
+    std::fill(m_busyAtStart, m_busyAtStart + Metrics::Devices, 0);
     m_engine = new UciEngine(this, QString() /*debugFile*/);
     m_ioHandler = new UCIIOHandler(this);
     m_engine->installIOHandler(m_ioHandler);
     connect(m_ioHandler, &UCIIOHandler::receivedInfo, this, &BenchmarkEngine::reportInfo);
     connect(m_ioHandler, &UCIIOHandler::receivedAverages, this, &BenchmarkEngine::runNextGame);
 
-    QString fen = Options::globalInstance()->option("BenchmarkFen").value();
-    if (!fen.isEmpty()) {
-        s_positions.clear();
-        s_positions.append(fen);
-    }
-
     m_nodes = Options::globalInstance()->option("BenchmarkNodes").value().toInt();
     m_movetime = Options::globalInstance()->option("BenchmarkMovetime").value().toInt();
+    m_warmup = Options::globalInstance()->option("BenchmarkWarmup").value().toInt();
+    m_repeats = qMax(1, Options::globalInstance()->option("BenchmarkRepeats").value().toInt());
+    const QString format = Options::globalInstance()->option("BenchmarkFormat").value();
+    if (format == QLatin1String("json"))
+        m_format = Json;
+    else if (format == QLatin1String("csv"))
+        m_format = Csv;
 }
 
 BenchmarkEngine::~BenchmarkEngine()
@@ -94,9 +109,179 @@ static int rollingAverage(int oldAvg, int newNumber, int n)
     return qRound(((float(oldAvg) * (n - 1)) + newNumber) / float(n));
 }
 
+// Mean, standard deviation and extremes of one measurement over several searches
+struct Statistics {
+    double mean = 0;
+    double stddev = 0;
+    double min = 0;
+    double max = 0;
+};
+
+template<typename T>
+static Statistics statistics(const QVector<T> &values)
+{
+    Statistics s;
+    if (values.isEmpty())
+        return s;
+
+    s.min = values.first();
+    s.max = values.first();
+    double sum = 0;
+    for (const T &value : values) {
+        sum += value;
+        s.min = qMin(s.min, double(value));
+        s.max = qMax(s.max, double(value));
+    }
+    s.mean = sum / values.count();
+
+    // The sample standard deviation as the searches are a sample of a noisy speed
+    if (values.count() > 1) {
+        double squares = 0;
+        for (const T &value : values)
+            squares += (value - s.mean) * (value - s.mean);
+        s.stddev = qSqrt(squares / (values.count() - 1));
+    }
+    return s;
+}
+
+bool BenchmarkEngine::readPositions(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qCritical() << "Could not open" << fileName << "for benchmarking";
+        return false;
+    }
+
+    // Either full fens or epd whose move numbers, when missing, start the game
+    QTextStream stream(&file);
+    while (!stream.atEnd()) {
+        const QString line = stream.readLine().simplified();
+        if (line.isEmpty() || line.startsWith('#'))
+            continue;
+
+        const QStringList fields = line.split(' ');
+        if (fields.count() < 4) {
+            qWarning() << "Skipping malformed position" << line;
+            continue;
+        }
+
+        QString halfMoveClock = QLatin1String("0");
+        QString fullMoveNumber = QLatin1String("1");
+        if (fields.count() >= 6) {
+            bool isHalfMoveClock = false;
+            bool isFullMoveNumber = false;
+            fields.at(4).toInt(&isHalfMoveClock);
+            fields.at(5).toInt(&isFullMoveNumber);
+            if (isHalfMoveClock && isFullMoveNumber) {
+                halfMoveClock = fields.at(4);
+                fullMoveNumber = fields.at(5);
+            }
+        }
+        m_positions.append(fields.at(0) + ' ' + fields.at(1) + ' ' + fields.at(2) + ' ' + fields.at(3) + ' ' + halfMoveClock + ' ' + fullMoveNumber);
+    }
+
+    if (m_positions.isEmpty()) {
+        qCritical() << "No positions to benchmark in" << fileName;
+        return false;
+    }
+    return true;
+}
+
+bool BenchmarkEngine::readSweep(const QString &sweep)
+{
+    // Every combination of the values, the first option changing slowest
+    m_configurations = { Configuration() };
+    const QStringList options = sweep.split(';', QString::SkipEmptyParts);
+    for (const QString &option : options) {
+        const QStringList nameAndValues = option.trimmed().split('=');
+        const QString name = nameAndValues.first().trimmed();
+        const QStringList values = nameAndValues.count() == 2
+            ? nameAndValues.last().split(',', QString::SkipEmptyParts) : QStringList();
+        if (!Options::globalInstance()->contains(name) || values.isEmpty()) {
+            qCritical() << "Could not sweep" << option << "which wants an option and its values";
+            return false;
+        }
+
+        QVector<Configuration> configurations;
+        for (const Configuration &configuration : m_configurations) {
+            for (const QString &value : values) {
+                Configuration c = configuration;
+                c.options.append(qMakePair(name, value.trimmed()));
+                configurations.append(c);
+            }
+        }
+        m_configurations = configurations;
+    }
+    return true;
+}
+
+void BenchmarkEngine::applyConfiguration()
+{
+    const Configuration &configuration = m_configurations.at(m_configuration);
+    QStringList options;
+    for (const QPair<QString, QString> &option : configuration.options) {
+        m_engine->readyRead(QString("setoption name %0 value %1").arg(option.first, option.second));
+        options.append(option.first + '=' + option.second);
+    }
+
+    // The first searches would otherwise run on the networks of the last configuration as the new
+    // ones load in the background
+    NeuralNet::globalInstance()->switchNetworks(true /*wait*/);
+    NeuralNet::smallInstance()->switchNetworks(true /*wait*/);
+    MemoryReport::resetPeakResident();
+    if (m_format == Text)
+        qCInfo(UciOutput).noquote() << "Configuration:" << options.join(' ') << endl;
+}
+
+bool BenchmarkEngine::run()
+{
+    const QString fen = Options::globalInstance()->option("BenchmarkFen").value();
+    const QString positions = Options::globalInstance()->option("BenchmarkPositions").value();
+    if (!fen.isEmpty())
+        m_positions.append(fen);
+    else if (!positions.isEmpty() && !readPositions(positions))
+        return false;
+    else if (positions.isEmpty())
+        m_positions = s_positions;
+
+    const QString sweep = Options::globalInstance()->option("BenchmarkSweep").value();
+    if (!sweep.isEmpty() && !readSweep(sweep))
+        return false;
+
+    if (m_format != Text) {
+        const QString output = Options::globalInstance()->option("BenchmarkOutput").value();
+        bool opened = false;
+        if (output.isEmpty()) {
+            opened = m_outputFile.open(stdout, QIODevice::WriteOnly | QIODevice::Text);
+        } else {
+            m_outputFile.setFileName(output);
+            opened = m_outputFile.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate);
+        }
+        if (!opened) {
+            qCritical() << "Could not open" << output << "for the results";
+            return false;
+        }
+        m_output.setDevice(&m_outputFile);
+    }
+
+    if (m_format == Csv) {
+        m_output << "position,fen,runs,time,nodes,batch,efficiency";
+        const char *speeds[] = { "nps", "rawnps", "nnnps" };
+        for (const char *speed : speeds)
+            m_output << "," << speed << "_mean," << speed << "_stddev," << speed << "_min," << speed << "_max";
+        m_output << ",cache_hits,cache_evictions,hash_full,peak_memory\n";
+        m_output.flush();
+    }
+
+    if (!m_configurations.isEmpty())
+        applyConfiguration();
+    startSearch();
+    return true;
+}
+
 void BenchmarkEngine::reportInfo(bool isPartial)
 {
-    if (isPartial)
+    if (isPartial || m_format != Text)
         return;
 
     SearchInfo info = m_ioHandler->lastInfo();
@@ -117,70 +302,349 @@ void BenchmarkEngine::reportInfo(bool isPartial)
            << info.rawnps << " rawnps, \t"
            << info.nnnps << " nnnps, \t"
            << info.batchSize << " batch, \t"
-               << efficiency << "% efficiency"
+           << efficiency << " efficiency, \t"
+           << Cache::globalInstance()->positionHits() << " cache hits, \t"
+           << Cache::globalInstance()->positionEvictions() << " cache evictions"
            << endl;
     qCInfo(UciOutput).noquote() << out;
 }
 
+void BenchmarkEngine::recordSample(const SearchInfo &averages)
+{
+    Sample sample;
+    sample.time = averages.time;
+    sample.nodes = averages.nodes;
+    sample.nps = averages.nps;
+    sample.rawnps = averages.rawnps;
+    sample.nnnps = averages.nnnps;
+    sample.batchSize = averages.batchSize;
+    sample.efficiency = averages.workerInfo.nodesVisited / float(averages.workerInfo.nodesEvaluated);
+    sample.cacheHits = Cache::globalInstance()->positionHits();
+    sample.cacheEvictions = Cache::globalInstance()->positionEvictions();
+    sample.hashFull = Cache::globalInstance()->percentFull(History::globalInstance()->currentGame().halfMoveNumber());
+    m_positionSamples.append(sample);
+    m_allSamples.append(sample);
+
+    m_cacheHits += sample.cacheHits;
+    m_cacheEvictions += sample.cacheEvictions;
+    m_totalInfo.time += averages.time;
+    m_totalInfo.nodes += averages.nodes;
+    m_totalInfo.workerInfo.nodesVisited += averages.workerInfo.nodesVisited;
+    m_totalInfo.workerInfo.nodesEvaluated += averages.workerInfo.nodesEvaluated;
+    if (!m_configurations.isEmpty()) {
+        Configuration &configuration = m_configurations[m_configuration];
+        configuration.totals.time += averages.time;
+        configuration.totals.nodes += averages.nodes;
+        configuration.totals.workerInfo.nodesVisited += averages.workerInfo.nodesVisited;
+        configuration.totals.workerInfo.nodesEvaluated += averages.workerInfo.nodesEvaluated;
+        for (int i = 0; i < Metrics::Devices; ++i)
+            configuration.busyNsecs[i] += Metrics::globalInstance()->busyNsecs(i) - m_busyAtStart[i];
+        const qint64 firstBatch = Metrics::globalInstance()->firstBatchNsecs();
+        if (firstBatch != -1) {
+            configuration.firstBatchNsecs += firstBatch;
+            ++configuration.firstBatches;
+        }
+    }
+
+    ++m_samples;
+    int n = m_samples;
+    if (n >= 2) {
+        m_totalInfo.batchSize = rollingAverage(m_totalInfo.batchSize, averages.batchSize, m_samples);
+    } else {
+        m_totalInfo.batchSize = averages.batchSize;
+    }
+}
+
+void BenchmarkEngine::reportSamples(int index, const QString &fen, const QVector<Sample> &samples)
+{
+    QVector<qint64> times;
+    QVector<quint64> nodes;
+    QVector<quint32> batchSizes;
+    QVector<float> efficiencies;
+    QVector<quint32> nps;
+    QVector<quint32> rawnps;
+    QVector<quint32> nnnps;
+    quint64 cacheHits = 0;
+    quint64 cacheEvictions = 0;
+    float hashFull = 0;
+    for (const Sample &sample : samples) {
+        times.append(sample.time);
+        nodes.append(sample.nodes);
+        batchSizes.append(sample.batchSize);
+        efficiencies.append(sample.efficiency);
+        nps.append(sample.nps);
+        rawnps.append(sample.rawnps);
+        nnnps.append(sample.nnnps);
+        cacheHits += sample.cacheHits;
+        cacheEvictions += sample.cacheEvictions;
+        hashFull = qMax(hashFull, sample.hashFull);
+    }
+
+    const Statistics speeds[] = { statistics(nps), statistics(rawnps), statistics(nnnps) };
+    const char *names[] = { "nps", "rawnps", "nnnps" };
+    QString out;
+    QTextStream stream(&out);
+    stream.setRealNumberNotation(QTextStream::FixedNotation);
+    stream.setRealNumberPrecision(2);
+    if (m_format == Text) {
+        // Only worth a line of its own when a position was searched more than once
+        if (index != -1 && samples.count() < 2)
+            return;
+        stream << (index == -1 ? "Speeds" : "Repeats") << " \t" << samples.count() << " runs";
+        for (int i = 0; i < 3; ++i) {
+            stream << ", \t" << qRound(speeds[i].mean) << " " << names[i]
+                   << " (stddev " << qRound(speeds[i].stddev)
+                   << ", min " << qRound(speeds[i].min)
+                   << ", max " << qRound(speeds[i].max) << ")";
+        }
+        stream << endl;
+        stream.flush();
+        qCInfo(UciOutput).noquote() << out;
+        return;
+    }
+
+    if (m_format == Json) {
+        stream << "{\"position\":";
+        if (index == -1)
+            stream << "\"all\"";
+        else
+            stream << index << ",\"fen\":" << jsonString(fen);
+        stream << ",\"runs\":" << samples.count()
+               << ",\"warmup\":" << m_warmup
+               << ",\"time\":" << statistics(times).mean
+               << ",\"nodes\":" << statistics(nodes).mean
+               << ",\"batch\":" << statistics(batchSizes).mean
+               << ",\"efficiency\":" << statistics(efficiencies).mean;
+        for (int i = 0; i < 3; ++i) {
+            stream << ",\"" << names[i] << "\":{"
+                   << "\"mean\":" << speeds[i].mean
+                   << ",\"stddev\":" << speeds[i].stddev
+                   << ",\"min\":" << speeds[i].min
+                   << ",\"max\":" << speeds[i].max << "}";
+        }
+        stream << ",\"cacheHits\":" << cacheHits
+               << ",\"cacheEvictions\":" << cacheEvictions
+               << ",\"hashFull\":" << hashFull
+               << ",\"peakMemory\":" << MemoryReport::peakResident();
+        if (index == -1)
+            stream << ",\"memory\":" << MemoryReport::current().toJson();
+        stream << "}";
+    } else {
+        if (index == -1)
+            stream << "all,";
+        else
+            stream << index << "," << fen;
+        stream << "," << samples.count()
+               << "," << statistics(times).mean
+               << "," << statistics(nodes).mean
+               << "," << statistics(batchSizes).mean
+               << "," << statistics(efficiencies).mean;
+        for (int i = 0; i < 3; ++i) {
+            stream << "," << speeds[i].mean
+                   << "," << speeds[i].stddev
+                   << "," << speeds[i].min
+                   << "," << speeds[i].max;
+        }
+        stream << "," << cacheHits
+               << "," << cacheEvictions
+               << "," << hashFull
+               << "," << MemoryReport::peakResident();
+    }
+    stream.flush();
+    m_output << out << "\n";
+    m_output.flush();
+}
+
+void BenchmarkEngine::reportGrandTotals()
+{
+    if (m_format != Text) {
+        reportSamples(-1, QString(), m_allSamples);
+        return;
+    }
+
+    const float efficiency = m_totalInfo.workerInfo.nodesVisited / float(m_totalInfo.workerInfo.nodesEvaluated);
+    QString out;
+    QTextStream stream(&out);
+    m_totalInfo.calculateSpeeds(m_totalInfo.time);
+    stream << "======================================\n"
+           << "Grand Totals \ttime "
+           << m_totalInfo.time << "ms \t"
+           << m_totalInfo.nodes << " nodes, \t"
+           << m_totalInfo.nps << " nps, \t"
+           << m_totalInfo.rawnps << " rawnps, \t"
+           << m_totalInfo.nnnps << " nnnps, \t"
+           << m_totalInfo.batchSize << " batch, \t"
+           << efficiency << " efficiency, \t"
+           << m_cacheHits << " cache hits, \t"
+           << m_cacheEvictions << " cache evictions, \t"
+           << MemoryReport::peakResident() / (1024 * 1024) << "MB peak memory"
+           << endl;
+    const QStringList memory = MemoryReport::current().toString().split('\n');
+    for (const QString &line : memory)
+        stream << "Memory \t\t" << line << endl;
+#if defined(USE_STAGE_TIMES)
+    stream << "Stage Times \t" << m_stageTimes.toString() << endl;
+#endif
+    stream.flush();
+    qCInfo(UciOutput).noquote() << out;
+    reportSamples(-1, QString(), m_allSamples);
+    qCInfo(UciOutput).noquote() << endl;
+}
+
 void BenchmarkEngine::runNextGame()
 {
     SearchInfo averages = m_ioHandler->averageInfo();
-    if (averages.rawnps != 0) {
+    const bool isWarmup = m_run < m_warmup;
+    if (averages.rawnps != 0 && m_format == Text) {
         const float efficiency = averages.workerInfo.nodesVisited / float(averages.workerInfo.nodesEvaluated);
         QString out;
         QTextStream stream(&out);
-        stream << "Totals \t\ttime "
+        stream << (isWarmup ? "Warmup \t\ttime " : "Totals \t\ttime ")
                << averages.time << "ms \t"
                << averages.nodes << " nodes, \t"
                << averages.nps << " nps, \t"
                << averages.rawnps << " rawnps, \t"
                << averages.nnnps << " nnnps, \t"
                << averages.batchSize << " batch, \t"
-               << efficiency << "% efficiency"
-               << endl << endl;
+               << efficiency << " efficiency, \t"
+               << Cache::globalInstance()->positionHits() << " cache hits, \t"
+               << Cache::globalInstance()->positionEvictions() << " cache evictions"
+               << endl;
+#if defined(USE_STAGE_TIMES)
+        stream << "Stage Times \t" << StageTimes::globalInstance()->toString() << endl;
+#endif
+        stream << endl;
         qCInfo(UciOutput).noquote() << out;
-        m_totalInfo.time += averages.time;
-        m_totalInfo.nodes += averages.nodes;
-        m_totalInfo.workerInfo.nodesVisited += averages.workerInfo.nodesVisited;
-        m_totalInfo.workerInfo.nodesEvaluated += averages.workerInfo.nodesEvaluated;
-        ++m_samples;
-        int n = m_samples;
-        if (n >= 2) {
-            m_totalInfo.batchSize = rollingAverage(m_totalInfo.batchSize, averages.batchSize, m_samples);
-        } else {
-            m_totalInfo.batchSize = averages.batchSize;
-        }
-    } else {
+    } else if (m_format == Text) {
         qCInfo(UciOutput).noquote() << endl;
     }
 
-    if (s_positions.isEmpty()) {
-        const float efficiency = m_totalInfo.workerInfo.nodesVisited / float(m_totalInfo.workerInfo.nodesEvaluated);
-        QString out;
-        QTextStream stream(&out);
-        m_totalInfo.calculateSpeeds(m_totalInfo.time);
-        stream << "======================================\n"
-               << "Grand Totals \ttime "
-               << m_totalInfo.time << "ms \t"
-               << m_totalInfo.nodes << " nodes, \t"
-               << m_totalInfo.nps << " nps, \t"
-               << m_totalInfo.rawnps << " rawnps, \t"
-               << m_totalInfo.nnnps << " nnnps, \t"
-               << m_totalInfo.batchSize << " batch, \t"
-               << efficiency << "% efficiency"
-               << endl << endl;
-        qCInfo(UciOutput).noquote() << out;
+    if (averages.rawnps != 0 && !isWarmup) {
+        recordSample(averages);
+#if defined(USE_STAGE_TIMES)
+        m_stageTimes.add(*StageTimes::globalInstance());
+#endif
+    }
+
+    // Every position is searched through its warmups and repeats before the next
+    if (++m_run == m_warmup + m_repeats) {
+        reportSamples(m_position, m_positions.at(m_position), m_positionSamples);
+        m_positionSamples.clear();
+        m_run = 0;
+        ++m_position;
+    }
+
+    if (m_position == m_positions.count() && !m_configurations.isEmpty()) {
+        m_configurations[m_configuration].peakResident = MemoryReport::peakResident();
+        if (++m_configuration < m_configurations.count()) {
+            m_position = 0;
+            applyConfiguration();
+        }
+    }
+
+    if (m_position == m_positions.count()) {
+        reportGrandTotals();
+        if (!m_configurations.isEmpty())
+            reportScaling();
         m_engine->readyRead("quit");
         return;
     }
 
+    startSearch();
+}
+
+void BenchmarkEngine::reportScaling()
+{
+    // The speedup and the efficiency of the scaling are against the first configuration
+    QStringList header;
+    for (const QPair<QString, QString> &option : m_configurations.first().options)
+        header.append(option.first);
+    header << "nps" << "rawnps" << "nnnps" << "speedup" << "gpu_utilization" << "efficiency"
+           << "first_batch_ms" << "peak_memory_mb";
+
+    QString out;
+    QTextStream stream(&out);
+    stream.setRealNumberNotation(QTextStream::FixedNotation);
+    stream.setRealNumberPrecision(2);
+    if (m_format == Text)
+        stream << "Scaling\n" << header.join('\t') << "\n";
+    else if (m_format == Csv)
+        stream << "\n" << header.join(',') << "\n";
+
+    quint32 baseline = 0;
+    for (Configuration &configuration : m_configurations) {
+        SearchInfo &totals = configuration.totals;
+        totals.calculateSpeeds(totals.time);
+        if (!baseline)
+            baseline = totals.nps;
+
+        // Of the devices that evaluated anything, busy over the time they were searched
+        qint64 busy = 0;
+        int devices = 0;
+        for (int i = 0; i < Metrics::Devices; ++i) {
+            busy += configuration.busyNsecs[i];
+            devices += configuration.busyNsecs[i] > 0;
+        }
+        const double utilization = devices && totals.time
+            ? busy / (devices * totals.time * 1e6) : 0.0;
+        const double efficiency = totals.workerInfo.nodesEvaluated
+            ? totals.workerInfo.nodesVisited / double(totals.workerInfo.nodesEvaluated) : 0.0;
+        const double speedup = baseline ? totals.nps / double(baseline) : 0.0;
+        const double firstBatch = configuration.firstBatches
+            ? configuration.firstBatchNsecs / (configuration.firstBatches * 1e6) : 0.0;
+        const double peakMemory = configuration.peakResident / (1024.0 * 1024.0);
+
+        if (m_format == Json) {
+            stream << "{\"configuration\":{";
+            for (int i = 0; i < configuration.options.count(); ++i) {
+                stream << (i ? "," : "") << jsonString(configuration.options.at(i).first) << ":"
+                       << jsonString(configuration.options.at(i).second);
+            }
+            stream << "},\"nps\":" << totals.nps
+                   << ",\"rawnps\":" << totals.rawnps
+                   << ",\"nnnps\":" << totals.nnnps
+                   << ",\"speedup\":" << speedup
+                   << ",\"gpuUtilization\":" << utilization
+                   << ",\"efficiency\":" << efficiency
+                   << ",\"firstBatchMsecs\":" << firstBatch
+                   << ",\"peakMemory\":" << configuration.peakResident << "}\n";
+            continue;
+        }
+
+        const char separator = m_format == Text ? '\t' : ',';
+        for (const QPair<QString, QString> &option : configuration.options)
+            stream << option.second << separator;
+        stream << totals.nps << separator
+               << totals.rawnps << separator
+               << totals.nnnps << separator
+               << speedup << separator
+               << utilization << separator
+               << efficiency << separator
+               << firstBatch << separator
+               << peakMemory << "\n";
+    }
+    stream.flush();
+
+    if (m_format == Text) {
+        qCInfo(UciOutput).noquote() << out;
+    } else {
+        m_output << out;
+        m_output.flush();
+    }
+}
+
+void BenchmarkEngine::startSearch()
+{
     m_timeAtLastProgress = 0;
     m_ioHandler->clear();
     Options::globalInstance()->setOption("DebugInfo", "true");
 
-    QString fen = s_positions.takeFirst();
-    qCInfo(UciOutput).noquote() << "Position:" << fen << endl;
+    const QString fen = m_positions.at(m_position);
+    if (m_format == Text && !m_run)
+        qCInfo(UciOutput).noquote() << "Position:" << fen << endl;
     m_engine->resetRollingAverage();
+    for (int i = 0; i < Metrics::Devices; ++i)
+        m_busyAtStart[i] = Metrics::globalInstance()->busyNsecs(i);
     m_engine->readyRead("stop");
     m_engine->readyRead("ucinewgame");
     m_engine->readyRead(QString("position fen %0").arg(fen));
@@ -189,8 +653,3 @@ void BenchmarkEngine::runNextGame()
     else
         m_engine->readyRead(QString("go movetime %0").arg(QString::number(m_movetime)));
 }
-
-void BenchmarkEngine::run()
-{
-    runNextGame();
-}
@@ -21,8 +21,12 @@
 #ifndef BENCHMARKENGINE_H
 #define BENCHMARKENGINE_H
 
+#include <QFile>
 #include <QObject>
+#include <QTextStream>
 
+#include "metrics.h"
+#include "stagetimes.h"
 #include "uciengine.h"
 
 class UCIIOHandler : public QObject, public IOHandler
@@ -80,20 +84,74 @@ public:
     BenchmarkEngine(QObject *parent);
     ~BenchmarkEngine();
 
-    void run();
+    bool run();
 
 private Q_SLOTS:
     void reportInfo(bool);
     void runNextGame();
 
 private:
+    enum Format { Text, Json, Csv };
+
+    // What one measured search of a position did
+    struct Sample {
+        qint64 time = 0;
+        quint64 nodes = 0;
+        quint32 nps = 0;
+        quint32 rawnps = 0;
+        quint32 nnnps = 0;
+        quint32 batchSize = 0;
+        float efficiency = 0;
+        quint64 cacheHits = 0;
+        quint64 cacheEvictions = 0;
+        float hashFull = 0;
+    };
+
+    // One combination of the values of the swept options and what its searches measured
+    struct Configuration {
+        QVector<QPair<QString, QString>> options;
+        SearchInfo totals; // of the times and the nodes of its searches
+        qint64 busyNsecs[Metrics::Devices] = {};
+        qint64 firstBatchNsecs = 0;
+        int firstBatches = 0; // searches that evaluated a batch
+        quint64 peakResident = 0;
+    };
+
+    bool readPositions(const QString &fileName);
+    bool readSweep(const QString &sweep);
+    void applyConfiguration();
+    void reportScaling();
+    void startSearch();
+    void recordSample(const SearchInfo &averages);
+    // Writes the samples of one position or, with an index of -1, of every position
+    void reportSamples(int index, const QString &fen, const QVector<Sample> &samples);
+    void reportGrandTotals();
+
     int m_nodes;
     int m_movetime;
+    int m_warmup;
+    int m_repeats;
+    Format m_format;
+    QVector<QString> m_positions;
+    int m_position;
+    int m_run;                          // of the current position, warmups included
+    QVector<Sample> m_positionSamples;
+    QVector<Sample> m_allSamples;
     quint32 m_samples;
     UCIIOHandler *m_ioHandler;
     UciEngine *m_engine;
     quint64 m_timeAtLastProgress;
+    quint64 m_cacheHits;
+    quint64 m_cacheEvictions;
     SearchInfo m_totalInfo;
+    QVector<Configuration> m_configurations; // empty unless sweeping
+    int m_configuration;
+    qint64 m_busyAtStart[Metrics::Devices];
+    QFile m_outputFile;
+    QTextStream m_output;
+#if defined(USE_STAGE_TIMES)
+    StageTimes m_stageTimes;
+#endif
 };
 
 #endif
@@ -20,9 +20,346 @@
 
 #include "cache.h"
 
+#include <QElapsedTimer>
+#include <QFile>
+#include <QThread>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+#include "threadaffinity.h"
+
+#if defined(Q_OS_LINUX)
+#include <sys/mman.h>
+#endif
+
 class MyCache : public Cache { };
 Q_GLOBAL_STATIC(MyCache, CacheInstance)
+static thread_local Cache *s_threadInstance = nullptr;
+
 Cache* Cache::globalInstance()
 {
-    return CacheInstance();
+    return s_threadInstance ? s_threadInstance : CacheInstance();
+}
+
+void Cache::setThreadInstance(Cache *cache)
+{
+    s_threadInstance = cache;
+}
+
+Cache *Cache::threadInstance()
+{
+    return s_threadInstance;
+}
+
+Cache *Cache::s_caches[Cache::MaximumCaches] = {};
+static QMutex s_cachesMutex;
+
+Cache::Cache()
+    : m_index(0)
+{
+    QMutexLocker locker(&s_cachesMutex);
+    int index = 0;
+    while (index < MaximumCaches && s_caches[index])
+        ++index;
+    if (index == MaximumCaches)
+        qFatal("Could not make more than %d caches!", int(MaximumCaches));
+    s_caches[index] = this;
+    m_index = quint16(index);
+}
+
+Cache::~Cache()
+{
+    QMutexLocker locker(&s_cachesMutex);
+    s_caches[m_index] = nullptr;
+}
+
+Cache::Totals Cache::totals()
+{
+    // Under the lock that keeps the caches from going away while they are read
+    QMutexLocker locker(&s_cachesMutex);
+    Totals totals;
+    for (const Cache *cache : s_caches) {
+        if (!cache)
+            continue;
+        totals.size += cache->m_nodeArena.size();
+        totals.used += cache->m_nodeArena.used();
+        totals.positionHits += cache->positionHits();
+        totals.positionEvictions += cache->positionEvictions();
+    }
+    return totals;
+}
+
+int cacheStripe()
+{
+    static std::atomic<int> s_next(0);
+    static thread_local int s_stripe = s_next++;
+    return s_stripe;
+}
+
+#if defined(Q_OS_LINUX)
+static const size_t s_transparentPageSize = 2 * 1024 * 1024;
+
+// Of the explicit huge pages mapped without asking for a size, which may be 1 GB rather than 2 MB
+static size_t hugePageSize()
+{
+    static const size_t s_size = []() {
+        QFile file(QLatin1String("/proc/meminfo"));
+        if (file.open(QIODevice::ReadOnly)) {
+            const QList<QByteArray> lines = file.readAll().split('\n');
+            for (const QByteArray &line : lines) {
+                if (line.startsWith("Hugepagesize:"))
+                    return size_t(line.mid(13).trimmed().split(' ').first().toULongLong() * 1024);
+            }
+        }
+        return s_transparentPageSize;
+    }();
+    return s_size;
+}
+
+static size_t mappedSize(size_t bytes, size_t pageSize)
+{
+    // Explicit huge pages can only be mapped and unmapped in multiples of their size
+    return (bytes + pageSize - 1) / pageSize * pageSize;
+}
+
+// The length each mapping was made with, which depends on the pages it ended up with, so that
+// it is unmapped whole whatever the size the caller frees it with
+static QMutex s_mappingsMutex;
+static QHash<void*, size_t> s_mappings;
+#endif
+
+void *cacheAllocate(size_t bytes, bool largePages, PageKind *kind)
+{
+    if (kind)
+        *kind = RegularPages;
+
+#if defined(Q_OS_LINUX)
+    // Anonymous mappings are zeroed and lazily faulted in so the first touch policy of the kernel
+    // places each page on the NUMA node of the thread using it
+    size_t size = 0;
+    void *memory = MAP_FAILED;
+    if (largePages) {
+        size = mappedSize(bytes, hugePageSize());
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED && kind)
+            *kind = ExplicitHugePages;
+    }
+
+    if (memory == MAP_FAILED) {
+        size = mappedSize(bytes, s_transparentPageSize);
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            qFatal("Could not allocate %zu bytes for the cache!", size);
+#if defined(MADV_HUGEPAGE)
+        if (largePages && !madvise(memory, size, MADV_HUGEPAGE) && kind)
+            *kind = TransparentHugePages;
+#endif
+    }
+
+    QMutexLocker locker(&s_mappingsMutex);
+    s_mappings.insert(memory, size);
+    return memory;
+#else
+    Q_UNUSED(largePages);
+    void *memory = qMallocAligned(bytes, 64);
+    if (!memory)
+        qFatal("Could not allocate %zu bytes for the cache!", bytes);
+    memset(memory, 0, bytes);
+    return memory;
+#endif
+}
+
+void cacheFree(void *memory, size_t bytes)
+{
+    // The size is only for the allocators that need to be told it, mappings know their own
+    Q_UNUSED(bytes);
+    if (!memory)
+        return;
+#if defined(Q_OS_LINUX)
+    size_t size = 0;
+    {
+        QMutexLocker locker(&s_mappingsMutex);
+        Q_ASSERT(s_mappings.contains(memory));
+        size = s_mappings.take(memory);
+    }
+    if (munmap(memory, size))
+        qWarning() << "Could not free" << size << "bytes of the cache:" << strerror(errno);
+#else
+    qFreeAligned(memory);
+#endif
+}
+
+quint64 prefaultRegions(const std::vector<CacheRegion> &regions, int threads,
+    const QString &cpuList, int device)
+{
+    // Handed out in chunks so every thread stays busy until the end whatever size the regions are
+    static const size_t s_chunkBytes = size_t(64) * 1024 * 1024;
+    static const size_t s_pageBytes = 4096;
+    std::vector<CacheRegion> chunks;
+    quint64 bytes = 0;
+    for (const CacheRegion &region : regions) {
+        char *memory = static_cast<char*>(region.memory);
+        for (size_t offset = 0; offset < region.bytes; offset += s_chunkBytes)
+            chunks.push_back(CacheRegion { memory + offset, qMin(s_chunkBytes, region.bytes - offset) });
+        bytes += region.bytes;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < qMax(1, threads); ++i) {
+        workers.emplace_back([&chunks, &next, &cpuList, device, i]() {
+            QThread::currentThread()->setObjectName(QString("cache prefault %0").arg(i));
+            ThreadAffinity::globalInstance()->applyToCurrentThread(cpuList, QString(), device);
+            for (size_t c = next++; c < chunks.size(); c = next++) {
+                // Written back as it is so objects already living in the memory are left alone
+                volatile char *memory = static_cast<char*>(chunks[c].memory);
+                for (size_t offset = 0; offset < chunks[c].bytes; offset += s_pageBytes)
+                    memory[offset] = memory[offset];
+            }
+        });
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+    return bytes;
+}
+
+qint64 Cache::prefault()
+{
+    const int threads = Options::globalInstance()->option("PrefaultThreads").value().toInt();
+    if (threads <= 0)
+        return 0;
+
+    QElapsedTimer timer;
+    timer.start();
+    std::vector<CacheRegion> regions;
+    m_nodeArena.allocateAll(&regions);
+    m_positionCache.allocateAll(&regions);
+
+    // The search thread of the process wide cache works for the first device
+    const quint64 bytes = prefaultRegions(regions, threads,
+        Options::globalInstance()->option("SearchThreadCPUs").value(), 0 /*device*/);
+    const qint64 msecs = timer.elapsed();
+    if (Options::globalInstance()->option("DebugInfo").value() == "true") {
+        qDebug() << "prefaulted" << (bytes >> 20) << "MB of the cache on" << threads
+            << "threads in" << msecs << "ms";
+        if (Options::globalInstance()->option("LargePages").value() == "true") {
+            qDebug() << "nodes are backed by" << pageKindToString(m_nodeArena.slabPageKind())
+                << "and positions by" << pageKindToString(m_positionCache.slabPageKind());
+        }
+    }
+    return msecs;
+}
+
+QString pageKindToString(PageKind kind)
+{
+    switch (kind) {
+    case RegularPages:
+        return QLatin1String("regular pages");
+    case TransparentHugePages:
+        return QLatin1String("transparent huge pages");
+    case ExplicitHugePages:
+        return QLatin1String("explicit huge pages");
+    }
+    Q_UNREACHABLE();
+    return QString();
+}
+
+PotentialPool::PotentialPool()
+    : m_slabUsed(SlabBytes),
+    m_usedBytes(0),
+    m_peakBytes(0),
+    m_largePages(false)
+{
+    for (int i = 0; i < SizeClasses; ++i)
+        m_free[i] = nullptr;
+}
+
+PotentialPool::~PotentialPool()
+{
+    clear();
+}
+
+void PotentialPool::reset(bool largePages)
+{
+    QMutexLocker locker(&m_mutex);
+    clear();
+    m_largePages = largePages;
+}
+
+void PotentialPool::clear()
+{
+    for (char *slab : m_slabs)
+        cacheFree(slab, SlabBytes);
+    m_slabs.clear();
+    m_slabUsed = SlabBytes;
+    m_usedBytes = 0;
+    m_peakBytes = 0;
+    for (int i = 0; i < SizeClasses; ++i)
+        m_free[i] = nullptr;
+}
+
+int PotentialPool::sizeClass(int capacity)
+{
+    Q_ASSERT(capacity > 0 && capacity <= Node::PotentialVector::MaximumCapacity);
+    int c = 0;
+    while ((1 << (c + MinimumShift)) < capacity)
+        ++c;
+    return c;
+}
+
+size_t PotentialPool::blockBytes(int sizeClass)
+{
+    return sizeof(Header) + (size_t(1) << (sizeClass + MinimumShift)) * sizeof(Node::Potential);
+}
+
+PotentialPool::Header *PotentialPool::allocate(int capacity)
+{
+    const int c = sizeClass(capacity);
+    QMutexLocker locker(&m_mutex);
+    Header *header = m_free[c];
+    if (header) {
+        // Free blocks are linked through their first potential
+        m_free[c] = *reinterpret_cast<Header**>(header + 1);
+    } else {
+        const size_t bytes = blockBytes(c);
+        if (m_slabUsed + bytes > SlabBytes) {
+            m_slabs.push_back(static_cast<char*>(cacheAllocate(SlabBytes, m_largePages)));
+            m_slabUsed = 0;
+        }
+        header = reinterpret_cast<Header*>(m_slabs.back() + m_slabUsed);
+        m_slabUsed += bytes;
+    }
+    m_usedBytes += blockBytes(c);
+    m_peakBytes = qMax(m_peakBytes, m_usedBytes);
+
+    header->pool = this;
+    header->count = 0;
+    header->sorted = 0;
+    header->smallValue = 0;
+    header->capacity = quint16(1 << (c + MinimumShift));
+    return header;
+}
+
+void PotentialPool::release(Header *header)
+{
+    Q_ASSERT(header);
+    const int c = sizeClass(header->capacity);
+    QMutexLocker locker(&m_mutex);
+    *reinterpret_cast<Header**>(header + 1) = m_free[c];
+    m_free[c] = header;
+    m_usedBytes -= blockBytes(c);
+}
+
+MemoryUsage PotentialPool::memoryUsage() const
+{
+    QMutexLocker locker(&m_mutex);
+    MemoryUsage usage;
+    usage.reserved = m_slabs.size() * SlabBytes;
+    usage.used = m_usedBytes;
+    usage.peak = m_peakBytes;
+    return usage;
 }
@@ -23,9 +23,17 @@
 
 #include <QtGlobal>
 #include <QtMath>
+#include <QDebug>
 #include <QHash>
-#include <unordered_map>
-
+#include <QMutex>
+#include <cstring>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "memoryreport.h"
 #include "node.h"
 #include "options.h"
 
@@ -44,32 +52,137 @@ extern bool shouldMakeUnique(const T &object);
 template <class T>
 inline void setUniqueFlag(T &object);
 
+template <class T>
+inline void grantEvictionCredit(T &object);
+
+template <class T>
+inline bool spendEvictionCredit(T &object);
+
+template <class T>
+inline void pin(T &object);
+
+template <class T>
+inline void unpin(T &object);
+
+// Least recently used evicts strictly in order of last use. Second chance moves an entry back to
+// the front instead while it still has eviction credit, which positions earn from their visits
+// and from transpositions so that expensive entries outlive bursts of cheap leaves.
+enum EvictionPolicy {
+    LeastRecentlyUsed,
+    SecondChance
+};
+
+// Zeroed, 64 byte aligned memory for the arena and cache. When large pages are requested this
+// tries explicit huge pages first and then transparent huge pages. Pages are not touched here so
+// that they are faulted in, and thus placed on the NUMA node, of the thread that first uses them.
+enum PageKind {
+    RegularPages,
+    TransparentHugePages,
+    ExplicitHugePages
+};
+
+void *cacheAllocate(size_t bytes, bool largePages, PageKind *kind = nullptr);
+void cacheFree(void *memory, size_t bytes);
+QString pageKindToString(PageKind kind);
+
+// Memory of the arena or cache to fault in before the search first uses it
+struct CacheRegion {
+    void *memory;
+    size_t bytes;
+};
+
+// Touches every page of the regions on this many threads pinned to the cpus of the list, so the
+// kernel places them on the NUMA node of those cpus, and returns the bytes touched. Nothing else
+// may use the memory meanwhile.
+quint64 prefaultRegions(const std::vector<CacheRegion> &regions, int threads,
+    const QString &cpuList, int device);
+
+// A small number given to each thread the first time it asks, which spreads the threads over the
+// lock stripes of the arena
+int cacheStripe();
+
 template <class T>
 class FixedSizeArena {
 public:
     FixedSizeArena();
     ~FixedSizeArena();
 
-    void reset(int nodes);
-    void reset();
-    T *newObject();
-    void unlink(T*);
-    int size() const { return m_maxSize; }
-    int used() const { return m_used + 1; }
+    // A concurrent arena can be used by several threads at once, which take and give back objects
+    // through stripes of their own and only now and then through the shared free list
+    void reset(quint64 nodes, bool largePages = false, bool concurrent = false);
+    // Allocates the slabs of every object up front rather than as the arena grows and adds them
+    // to the regions so they can be faulted in ahead of the search
+    void allocateAll(std::vector<CacheRegion> *regions);
+    T *newObject(quint32 *handle = nullptr);
+    void unlink(quint32 handle);
+    // Moves the object at handles[i] to handle i + 1 and rewrites the handles to match, so they
+    // must be every object in use. The objects are moved as bytes and whatever referred to them
+    // has to be fixed up by the caller. Objects are handed out after them again in order.
+    void compact(std::vector<quint32> *handles);
+
+    // Objects never move while searching so they can be referred to by 32-bit handles where zero
+    // is null
+    inline T *object(quint32 handle) const
+    {
+        Q_ASSERT(handle);
+        const quint32 index = handle - 1;
+        return m_slabs[index / SlabSize].objects + index % SlabSize;
+    }
+
+    quint64 size() const { return m_maxSize; }
+    quint64 used() const { return m_used; }
     float percentFull(int halfMoveNumber) const;
+    MemoryUsage memoryUsage() const;
+    PageKind slabPageKind() const; // the smallest pages any slab allocated so far ended up with
+
+    // Handles are 32-bit so this is the most objects an arena can hold
+    static quint64 maximumSize() { return std::numeric_limits<quint32>::max(); }
+    static quint64 bytesPerObject() { return sizeof(T) + sizeof(quint32); }
 
 private:
+    // Objects are carved out of large slabs of contiguous memory rather than allocated one by one
+    enum { SlabSize = 1 << 16 };
+    struct Slab {
+        T *objects;
+        size_t bytes;
+        PageKind kind;
+    };
+
+    // Free handles a thread keeps to itself, taken from the shared list a batch at a time
+    enum { Stripes = 16, StripeBatch = 64 };
+    struct Stripe {
+        QMutex mutex;
+        std::vector<quint32> handles;
+        char padding[64]; // so the locks of neighbouring stripes are not on one line
+    };
+
     void clear();
-    void grow();
-    std::vector<T*> m_arena;
-    int m_used;
-    int m_maxSize;
+    quint32 grow();
+    quint32 take(); // zero when full
+    quint32 takeConcurrently();
+    void clearStripes();
+    Slab newSlab() const; // the next one after those allocated
+
+    // Unlinked objects are pushed here and handed out again before growing so that freeing a
+    // subtree costs time proportional to its size rather than to the size of the arena
+    std::vector<quint32> m_free;
+    std::vector<Slab> m_slabs;
+    Stripe m_stripes[Stripes];
+    QMutex m_mutex; // of the free list and growing when concurrent
+    quint64 m_grown;
+    std::atomic<quint64> m_used;
+    quint64 m_maxSize;
+    bool m_largePages;
+    bool m_concurrent;
 };
 
 template <class T>
 inline FixedSizeArena<T>::FixedSizeArena()
-    : m_used(-1),
-    m_maxSize(0)
+    : m_grown(0),
+    m_used(0),
+    m_maxSize(0),
+    m_largePages(false),
+    m_concurrent(false)
 {
 }
 
@@ -80,13 +193,20 @@ inline FixedSizeArena<T>::~FixedSizeArena()
 }
 
 template <class T>
-inline void FixedSizeArena<T>::reset(int nodes)
+inline void FixedSizeArena<T>::reset(quint64 nodes, bool largePages, bool concurrent)
 {
     clear();
     if (!nodes)
         return;
 
+    Q_ASSERT(nodes <= maximumSize());
     m_maxSize = nodes;
+    m_largePages = largePages;
+    m_concurrent = concurrent;
+    m_free.reserve(size_t(nodes));
+    // The slab table must never reallocate as concurrent tree descents look objects up while
+    // another thread grows the arena
+    m_slabs.reserve(size_t((nodes + SlabSize - 1) / SlabSize));
 #if defined(DEBUG_CACHE)
         quint64 bytes = nodes * sizeof(T);
         qDebug() << "node cache size is" << bytes << "holding" << nodes
@@ -95,49 +215,181 @@ inline void FixedSizeArena<T>::reset(int nodes)
 }
 
 template <class T>
-inline void FixedSizeArena<T>::grow()
+inline typename FixedSizeArena<T>::Slab FixedSizeArena<T>::newSlab() const
+{
+    const quint64 remaining = m_maxSize - quint64(m_slabs.size()) * SlabSize;
+    const size_t count = size_t(qMin(remaining, quint64(SlabSize)));
+    Slab slab;
+    slab.bytes = count * sizeof(T);
+    slab.objects = static_cast<T*>(cacheAllocate(slab.bytes, m_largePages, &slab.kind));
+    return slab;
+}
+
+template <class T>
+inline void FixedSizeArena<T>::allocateAll(std::vector<CacheRegion> *regions)
 {
-    Q_ASSERT(int(m_arena.size()) < m_maxSize);
-    m_arena.push_back(new T);
+    while (quint64(m_slabs.size()) * SlabSize < m_maxSize)
+        m_slabs.push_back(newSlab());
+    for (const Slab &slab : m_slabs)
+        regions->push_back(CacheRegion { slab.objects, slab.bytes });
 }
 
 template <class T>
-inline void FixedSizeArena<T>::reset()
+inline quint32 FixedSizeArena<T>::grow()
 {
-    auto it = std::partition(m_arena.begin(), m_arena.end(),
-        [] (Node *object) {
-            return isPinned(object);
-    });
-    m_used = int(it - m_arena.begin()) - 1;
+    Q_ASSERT(m_grown < m_maxSize);
+    // The slab may have been allocated ahead of time already
+    const size_t slab = size_t(m_grown / SlabSize);
+    if (slab == m_slabs.size())
+        m_slabs.push_back(newSlab());
+
+    new (m_slabs[slab].objects + m_grown % SlabSize) T;
+    return quint32(++m_grown);
 }
 
 template <class T>
 inline void FixedSizeArena<T>::clear()
 {
-    qDeleteAll(m_arena);
-    m_arena.clear();
-    m_used = -1;
+    for (quint64 handle = 1; handle <= m_grown; ++handle)
+        object(quint32(handle))->~T();
+    for (const Slab &slab : m_slabs)
+        cacheFree(slab.objects, slab.bytes);
+    m_free.clear();
+    m_free.shrink_to_fit();
+    m_slabs.clear();
+    clearStripes();
+    m_grown = 0;
+    m_used = 0;
     m_maxSize = 0;
+    m_concurrent = false;
 }
 
 template <class T>
-inline T *FixedSizeArena<T>::newObject()
+inline void FixedSizeArena<T>::clearStripes()
 {
-    if (int(m_arena.size()) < m_maxSize)
-        grow();
+    for (Stripe &stripe : m_stripes) {
+        stripe.handles.clear();
+        stripe.handles.shrink_to_fit();
+    }
+}
+
+template <class T>
+inline quint32 FixedSizeArena<T>::take()
+{
+    if (!m_free.empty()) {
+        const quint32 h = m_free.back();
+        m_free.pop_back();
+        return h;
+    }
+    return m_grown < m_maxSize ? grow() : 0;
+}
+
+template <class T>
+inline quint32 FixedSizeArena<T>::takeConcurrently()
+{
+    {
+        Stripe &stripe = m_stripes[cacheStripe() % Stripes];
+        QMutexLocker locker(&stripe.mutex);
+        if (stripe.handles.empty()) {
+            QMutexLocker sharedLocker(&m_mutex);
+            while (stripe.handles.size() < StripeBatch) {
+                const quint32 h = take();
+                if (!h)
+                    break;
+                stripe.handles.push_back(h);
+            }
+        }
+
+        if (!stripe.handles.empty()) {
+            const quint32 h = stripe.handles.back();
+            stripe.handles.pop_back();
+            return h;
+        }
+    }
+
+    // The shared list ran out, but the other stripes may still hold some
+    for (Stripe &stripe : m_stripes) {
+        QMutexLocker locker(&stripe.mutex);
+        if (!stripe.handles.empty()) {
+            const quint32 h = stripe.handles.back();
+            stripe.handles.pop_back();
+            return h;
+        }
+    }
+    return 0;
+}
+
+template <class T>
+inline T *FixedSizeArena<T>::newObject(quint32 *handle)
+{
+    const quint32 h = m_concurrent ? takeConcurrently() : take();
+    if (!h)
+        return nullptr;
 
-    Q_ASSERT(m_arena.size());
-    const size_t index = size_t(++m_used);
-    Q_ASSERT(index < m_arena.size());
-    return m_arena.at(index);
+    ++m_used;
+    if (handle)
+        *handle = h;
+    return object(h);
 }
 
 template <class T>
-inline void FixedSizeArena<T>::unlink(T *object)
+inline void FixedSizeArena<T>::unlink(quint32 handle)
 {
-    Q_ASSERT(m_arena.size());
-    object->deinitialize(false /*forcedFree*/);
+    Q_ASSERT(m_used);
+    // Which unlinks the children as well, so no lock is held meanwhile
+    object(handle)->deinitialize(false /*forcedFree*/);
     --m_used;
+    if (!m_concurrent) {
+        m_free.push_back(handle);
+        return;
+    }
+
+    Stripe &stripe = m_stripes[cacheStripe() % Stripes];
+    QMutexLocker locker(&stripe.mutex);
+    stripe.handles.push_back(handle);
+    if (stripe.handles.size() >= 2 * StripeBatch) {
+        QMutexLocker sharedLocker(&m_mutex);
+        m_free.insert(m_free.end(), stripe.handles.end() - StripeBatch, stripe.handles.end());
+        stripe.handles.resize(stripe.handles.size() - StripeBatch);
+    }
+}
+
+template <class T>
+inline void FixedSizeArena<T>::compact(std::vector<quint32> *handles)
+{
+    Q_ASSERT(quint64(handles->size()) == m_used);
+
+    // Which of the handles is at each slot, plus one, so that the object a move displaces can be
+    // followed to where it went. A free slot holds a deinitialized object that is moved the same.
+    std::vector<quint32> indexAt(size_t(m_grown + 1), 0);
+    for (size_t i = 0; i < handles->size(); ++i)
+        indexAt[(*handles)[i]] = quint32(i + 1);
+
+    alignas(T) unsigned char swap[sizeof(T)];
+    for (size_t i = 0; i < handles->size(); ++i) {
+        const quint32 from = (*handles)[i];
+        const quint32 to = quint32(i + 1);
+        if (from == to)
+            continue;
+
+        void *a = object(from);
+        void *b = object(to);
+        memcpy(swap, a, sizeof(T));
+        memcpy(a, b, sizeof(T));
+        memcpy(b, swap, sizeof(T));
+
+        if (const quint32 displaced = indexAt[to])
+            (*handles)[displaced - 1] = from;
+        indexAt[from] = indexAt[to];
+        indexAt[to] = quint32(i + 1);
+        (*handles)[i] = to;
+    }
+
+    // The lowest free handle is on the back so new objects land right after the compacted ones
+    clearStripes();
+    m_free.clear();
+    for (quint64 handle = m_grown; handle > m_used; --handle)
+        m_free.push_back(quint32(handle));
 }
 
 template <class T>
@@ -154,7 +406,12 @@ public:
     FixedSizeCache();
     ~FixedSizeCache();
 
-    void reset(int positions);
+    void reset(quint64 positions, bool largePages = false);
+    // Allocates the slabs of every position up front rather than as the cache grows and adds them
+    // along with the table to the regions so they can be faulted in ahead of the search
+    void allocateAll(std::vector<CacheRegion> *regions);
+    PageKind tablePageKind() const { return m_tablePageKind; }
+    PageKind slabPageKind() const; // the smallest pages any slab allocated so far ended up with
     bool contains(quint64 hash) const;
     T *object(quint64 hash);
     T *objectMakeUnique(quint64 hash);
@@ -162,8 +419,19 @@ public:
     T *newObject(quint64 hash, bool makeUnique = false);
     void unlink(quint64 hash);
     float percentFull(int halfMoveNumber) const;
-    int size() const { return m_maxSize; }
-    int used() const { return m_used; }
+    quint64 size() const { return m_maxSize; }
+    quint64 used() const { return m_used.load(std::memory_order_relaxed); }
+    MemoryUsage memoryUsage() const;
+
+    EvictionPolicy evictionPolicy() const { return m_evictionPolicy; }
+    void setEvictionPolicy(EvictionPolicy policy) { m_evictionPolicy = policy; }
+    quint64 hits() const { return m_hits.load(std::memory_order_relaxed); }
+    quint64 evictions() const { return m_evictions.load(std::memory_order_relaxed); }
+
+    // Memory for sizing: each position costs bytesPerObject() plus its share of the table
+    static quint64 bytesPerObject() { return sizeof(ObjectInfo); }
+    static quint64 bytesPerSlot() { return sizeof(HashSlot); }
+    static quint64 tableSlots(quint64 positions);
 
 private:
     struct ObjectInfo {
@@ -176,9 +444,29 @@ private:
         T object;
     };
 
+    // Slots of the open addressing table holding the hash index. Four of these pack a 64 byte
+    // cache line so a probe almost always resolves within the line it starts on.
+    struct HashSlot {
+        quint64 hash;
+        ObjectInfo *info;
+    };
+
+    enum { SlabSize = 1 << 16 };
+    enum { MaximumSpared = 16 }; // bounds the work of a single eviction
+    struct Slab {
+        ObjectInfo *objects;
+        size_t bytes;
+        PageKind kind;
+    };
+
     void clear();
     void grow();
+    Slab newSlab() const; // the next one after those allocated
     void sanityCheck();
+    quint64 homeSlot(quint64 hash) const;
+    ObjectInfo *lookupHash(quint64 hash) const;
+    void insertHash(quint64 hash, ObjectInfo *info);
+    void eraseHash(quint64 hash);
     ObjectInfo* unlinkFromUsed();
     ObjectInfo* unlinkFromUnused();
     void linkToUsed(ObjectInfo &);
@@ -187,10 +475,19 @@ private:
     ObjectInfo *m_first;
     ObjectInfo *m_last;
     ObjectInfo *m_unused;
-    std::unordered_map<quint64, ObjectInfo*> m_cache;
-    int m_size;
-    int m_used;
-    int m_maxSize;
+    HashSlot *m_table;
+    quint64 m_tableMask;
+    int m_tableShift;
+    PageKind m_tablePageKind;
+    std::vector<Slab> m_slabs;
+    quint64 m_size;
+    // Changed under the lock of the shard but read by the metrics without it
+    std::atomic<quint64> m_used;
+    quint64 m_maxSize;
+    std::atomic<quint64> m_hits;
+    std::atomic<quint64> m_evictions;
+    EvictionPolicy m_evictionPolicy;
+    bool m_largePages;
 };
 
 template <class T>
@@ -198,9 +495,17 @@ inline FixedSizeCache<T>::FixedSizeCache()
     : m_first(nullptr),
     m_last(nullptr),
     m_unused(nullptr),
+    m_table(nullptr),
+    m_tableMask(0),
+    m_tableShift(64),
+    m_tablePageKind(RegularPages),
     m_size(0),
     m_used(0),
-    m_maxSize(0)
+    m_maxSize(0),
+    m_hits(0),
+    m_evictions(0),
+    m_evictionPolicy(LeastRecentlyUsed),
+    m_largePages(false)
 {
 }
 
@@ -211,15 +516,38 @@ inline FixedSizeCache<T>::~FixedSizeCache()
 }
 
 template <class T>
-inline void FixedSizeCache<T>::reset(int positions)
+inline quint64 FixedSizeCache<T>::tableSlots(quint64 positions)
+{
+    // A power of two at least twice the number of positions so the load factor never exceeds one
+    // half and probe sequences stay short
+    quint64 tableSize = 4;
+    while (tableSize < positions * 2)
+        tableSize <<= 1;
+    return tableSize;
+}
+
+template <class T>
+inline void FixedSizeCache<T>::reset(quint64 positions, bool largePages)
 {
     clear();
     if (!positions)
         return;
 
     m_maxSize = positions;
+    m_largePages = largePages;
+
+    // Size the table once
+    const quint64 tableSize = tableSlots(positions);
+    int bits = 0;
+    while ((quint64(1) << bits) < tableSize)
+        ++bits;
+    m_tableMask = tableSize - 1;
+    m_tableShift = 64 - bits;
+    m_table = static_cast<HashSlot*>(cacheAllocate(tableSize * sizeof(HashSlot), largePages,
+        &m_tablePageKind));
+
 #if defined(DEBUG_CACHE)
-        quint64 bytes = positions * sizeof(ObjectInfo);
+        quint64 bytes = positions * sizeof(ObjectInfo) + tableSize * sizeof(HashSlot);
         qDebug() << "position cache size is" << bytes << "holding" << m_maxSize
             << "max positions";
 #endif
@@ -229,18 +557,18 @@ inline void FixedSizeCache<T>::reset(int positions)
 template <class T>
 inline void FixedSizeCache<T>::clear()
 {
-    int numberOfDeleted = 0;
+    quint64 numberOfDeleted = 0;
     while (m_first) {
         ObjectInfo *delink = m_first;
         m_first = m_first->next;
-        delete delink;
+        delink->~ObjectInfo();
         ++numberOfDeleted;
     }
 
     while (m_unused) {
         ObjectInfo *delink = m_unused;
         m_unused = m_unused->next;
-        delete delink;
+        delink->~ObjectInfo();
         ++numberOfDeleted;
     }
 
@@ -248,17 +576,54 @@ inline void FixedSizeCache<T>::clear()
     m_first = nullptr;
     m_last = nullptr;
     m_unused = nullptr;
-    m_cache.clear();
+    for (const Slab &slab : m_slabs)
+        cacheFree(slab.objects, slab.bytes);
+    m_slabs.clear();
+    if (m_table)
+        cacheFree(m_table, (m_tableMask + 1) * sizeof(HashSlot));
+    m_table = nullptr;
+    m_tableMask = 0;
+    m_tableShift = 64;
+    m_tablePageKind = RegularPages;
     m_size = 0;
     m_used = 0;
     m_maxSize = 0;
+    m_hits = 0;
+    m_evictions = 0;
+}
+
+template <class T>
+inline typename FixedSizeCache<T>::Slab FixedSizeCache<T>::newSlab() const
+{
+    const quint64 remaining = m_maxSize - quint64(m_slabs.size()) * SlabSize;
+    const size_t count = size_t(qMin(remaining, quint64(SlabSize)));
+    Slab slab;
+    slab.bytes = count * sizeof(ObjectInfo);
+    slab.objects = static_cast<ObjectInfo*>(cacheAllocate(slab.bytes, m_largePages, &slab.kind));
+    return slab;
+}
+
+template <class T>
+inline void FixedSizeCache<T>::allocateAll(std::vector<CacheRegion> *regions)
+{
+    while (quint64(m_slabs.size()) * SlabSize < m_maxSize)
+        m_slabs.push_back(newSlab());
+    for (const Slab &slab : m_slabs)
+        regions->push_back(CacheRegion { slab.objects, slab.bytes });
+    if (m_table)
+        regions->push_back(CacheRegion { m_table, size_t(m_tableMask + 1) * sizeof(HashSlot) });
 }
 
 template <class T>
 inline void FixedSizeCache<T>::grow()
 {
-    Q_ASSERT(int(m_size) < m_maxSize);
-    ObjectInfo *info = new ObjectInfo;
+    Q_ASSERT(m_size < m_maxSize);
+    // The slab may have been allocated ahead of time already
+    const size_t slab = size_t(m_size / SlabSize);
+    if (slab == m_slabs.size())
+        m_slabs.push_back(newSlab());
+
+    ObjectInfo *info = new (m_slabs[slab].objects + m_size % SlabSize) ObjectInfo;
     if (m_unused) {
         info->next = m_unused;
         m_unused->previous = info;
@@ -273,14 +638,14 @@ template <class T>
 inline void FixedSizeCache<T>::sanityCheck()
 {
 #if defined(DEBUG_SANITY)
-    int numberOfUsed = 0;
+    quint64 numberOfUsed = 0;
     ObjectInfo *used = m_first;
     while (used) {
         used = used->next;
         ++numberOfUsed;
     }
 
-    int numberOfUnused = 0;
+    quint64 numberOfUnused = 0;
     ObjectInfo *unused = m_unused;
     while (unused) {
         unused = unused->next;
@@ -292,6 +657,75 @@ inline void FixedSizeCache<T>::sanityCheck()
 #endif
 }
 
+template <class T>
+inline quint64 FixedSizeCache<T>::homeSlot(quint64 hash) const
+{
+    // Fibonacci hashing so that keys with poor low bits still spread over the table
+    return (hash * Q_UINT64_C(0x9E3779B97F4A7C15)) >> m_tableShift;
+}
+
+template <class T>
+inline typename FixedSizeCache<T>::ObjectInfo* FixedSizeCache<T>::lookupHash(quint64 hash) const
+{
+    Q_ASSERT(m_table);
+    quint64 i = homeSlot(hash);
+    forever {
+        const HashSlot &slot = m_table[i];
+        if (!slot.info)
+            return nullptr;
+        if (slot.hash == hash)
+            return slot.info;
+        i = (i + 1) & m_tableMask;
+    }
+}
+
+template <class T>
+inline void FixedSizeCache<T>::insertHash(quint64 hash, ObjectInfo *info)
+{
+    Q_ASSERT(m_table);
+    Q_ASSERT(info);
+    quint64 i = homeSlot(hash);
+    while (m_table[i].info) {
+        Q_ASSERT(m_table[i].hash != hash);
+        i = (i + 1) & m_tableMask;
+    }
+    m_table[i].hash = hash;
+    m_table[i].info = info;
+}
+
+template <class T>
+inline void FixedSizeCache<T>::eraseHash(quint64 hash)
+{
+    Q_ASSERT(m_table);
+    quint64 i = homeSlot(hash);
+    forever {
+        if (!m_table[i].info) {
+            Q_ASSERT(false);
+            return;
+        }
+        if (m_table[i].hash == hash)
+            break;
+        i = (i + 1) & m_tableMask;
+    }
+
+    // Backward shift deletion so we never need tombstones: pull later entries of the probe
+    // sequence into the hole unless doing so would move them before their home slot
+    quint64 j = i;
+    forever {
+        j = (j + 1) & m_tableMask;
+        if (!m_table[j].info)
+            break;
+        const quint64 k = homeSlot(m_table[j].hash);
+        const bool inRange = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+        if (inRange)
+            continue;
+        m_table[i] = m_table[j];
+        i = j;
+    }
+    m_table[i].hash = 0;
+    m_table[i].info = nullptr;
+}
+
 template <class T>
 inline typename FixedSizeCache<T>::ObjectInfo* FixedSizeCache<T>::unlinkFromUsed()
 {
@@ -300,9 +734,19 @@ inline typename FixedSizeCache<T>::ObjectInfo* FixedSizeCache<T>::unlinkFromUsed
 
     Q_ASSERT(m_last);
     ObjectInfo *unpinned = m_last;
-
-    while (unpinned && isPinned(unpinned->object))
-        unpinned = unpinned->previous;
+    int spared = 0;
+
+    while (unpinned) {
+        ObjectInfo *previous = unpinned->previous;
+        if (!isPinned(unpinned->object)) {
+            if (m_evictionPolicy != SecondChance || spared == MaximumSpared
+                || !spendEvictionCredit(unpinned->object))
+                break;
+            relinkToUsed(*unpinned);
+            ++spared;
+        }
+        unpinned = previous;
+    }
 
     // If everything is pinned, then can only return nullptr
     if (!unpinned)
@@ -311,8 +755,7 @@ inline typename FixedSizeCache<T>::ObjectInfo* FixedSizeCache<T>::unlinkFromUsed
     ObjectInfo &info = *unpinned;
 
     // Remove from actual hash
-    Q_ASSERT(m_cache.count(fixedHash(info.object)));
-    m_cache.erase(fixedHash(info.object));
+    eraseHash(fixedHash(info.object));
     info.object.deinitialize(true /*forcedFree*/);
 
     // Update first and last
@@ -338,7 +781,8 @@ inline typename FixedSizeCache<T>::ObjectInfo* FixedSizeCache<T>::unlinkFromUsed
     info.previous = nullptr;
     info.next = nullptr;
 
-    --m_used;
+    m_used.fetch_sub(1, std::memory_order_relaxed);
+    m_evictions.fetch_add(1, std::memory_order_relaxed);
     return &info;
 }
 
@@ -378,7 +822,7 @@ inline void FixedSizeCache<T>::linkToUsed(ObjectInfo &info)
     if (!m_last)
         m_last = m_first;
 
-    ++m_used;
+    m_used.fetch_add(1, std::memory_order_relaxed);
     sanityCheck();
 }
 
@@ -413,9 +857,8 @@ template <class T>
 inline void FixedSizeCache<T>::relinkToUnused(ObjectInfo &info, quint64 hash)
 {
     // Remove from actual hash
-    Q_ASSERT(m_cache.count(hash));
-    Q_ASSERT(fixedHash(info.object) == hash);
-    m_cache.erase(hash);
+    Q_ASSERT(lookupHash(hash) == &info);
+    eraseHash(hash);
     info.object.deinitialize(false /*forcedFree*/);
 
     // Possibly update first and last
@@ -441,24 +884,69 @@ inline void FixedSizeCache<T>::relinkToUnused(ObjectInfo &info, quint64 hash)
         m_unused->previous = &info;
     }
     m_unused = &info;
-    --m_used;
+    m_used.fetch_sub(1, std::memory_order_relaxed);
     sanityCheck();
 }
 
+template <class T>
+inline PageKind FixedSizeArena<T>::slabPageKind() const
+{
+    PageKind kind = m_slabs.empty() ? RegularPages : ExplicitHugePages;
+    for (const Slab &slab : m_slabs)
+        kind = qMin(kind, slab.kind);
+    return kind;
+}
+
+template <class T>
+inline PageKind FixedSizeCache<T>::slabPageKind() const
+{
+    PageKind kind = m_slabs.empty() ? RegularPages : ExplicitHugePages;
+    for (const Slab &slab : m_slabs)
+        kind = qMin(kind, slab.kind);
+    return kind;
+}
+
+template <class T>
+inline MemoryUsage FixedSizeArena<T>::memoryUsage() const
+{
+    // Unlinked objects go back on the free lists to be handed out again, but the slabs they live
+    // in stay until the arena is cleared, so the ones grown so far are the most ever in use
+    MemoryUsage usage;
+    for (const Slab &slab : m_slabs)
+        usage.reserved += slab.bytes;
+    usage.reserved += m_free.capacity() * sizeof(quint32);
+    usage.used = m_used.load() * sizeof(T) + m_free.size() * sizeof(quint32);
+    usage.peak = m_grown * sizeof(T) + m_free.capacity() * sizeof(quint32);
+    return usage;
+}
+
+template <class T>
+inline MemoryUsage FixedSizeCache<T>::memoryUsage() const
+{
+    // Positions are recycled rather than freed so the ones grown so far are the most ever in use
+    const quint64 table = m_table ? (m_tableMask + 1) * sizeof(HashSlot) : 0;
+    MemoryUsage usage;
+    for (const Slab &slab : m_slabs)
+        usage.reserved += slab.bytes;
+    usage.reserved += table;
+    usage.used = m_used * sizeof(ObjectInfo) + table;
+    usage.peak = m_size * sizeof(ObjectInfo) + table;
+    return usage;
+}
+
 template <class T>
 inline bool FixedSizeCache<T>::contains(quint64 hash) const
 {
     Q_ASSERT(m_maxSize);
-    return m_cache.count(hash);
+    return lookupHash(hash);
 }
 
 template <class T>
 inline T *FixedSizeCache<T>::object(quint64 hash)
 {
     Q_ASSERT(m_maxSize);
-    Q_ASSERT(m_cache.count(hash));
-
-    ObjectInfo *info = m_cache.at(hash);
+    ObjectInfo *info = lookupHash(hash);
+    Q_ASSERT(info);
     if (!info)
         return nullptr;
     return &(info->object);
@@ -468,14 +956,13 @@ template <class T>
 inline T *FixedSizeCache<T>::objectMakeUnique(quint64 hash)
 {
     Q_ASSERT(m_maxSize);
-    Q_ASSERT(m_cache.count(hash));
-
-    ObjectInfo *info = m_cache.at(hash);
+    ObjectInfo *info = lookupHash(hash);
+    Q_ASSERT(info);
     if (!info)
         return nullptr;
 
-    m_cache.erase(hash);
-    m_cache.insert({hash ^ reinterpret_cast<quint64>(&(info->object)), info});
+    eraseHash(hash);
+    insertHash(hash ^ reinterpret_cast<quint64>(&(info->object)), info);
     setUniqueFlag(info->object);
     return &(info->object);
 }
@@ -484,20 +971,21 @@ template <class T>
 inline T *FixedSizeCache<T>::objectRelinkOrMakeUnique(quint64 hash, bool *madeUnique)
 {
     Q_ASSERT(m_maxSize);
-    Q_ASSERT(m_cache.count(hash));
-
-    ObjectInfo *info = m_cache.at(hash);
+    ObjectInfo *info = lookupHash(hash);
+    Q_ASSERT(info);
     if (!info)
         return nullptr;
 
     if (shouldMakeUnique(info->object)) {
         // Make unique by using hash ^ address of object, thereby freeing up the hash
         // to be used by something else
-        m_cache.erase(hash);
-        m_cache.insert({hash ^ reinterpret_cast<quint64>(&(info->object)), info});
+        eraseHash(hash);
+        insertHash(hash ^ reinterpret_cast<quint64>(&(info->object)), info);
         setUniqueFlag(info->object);
         *madeUnique = true;
     } else {
+        m_hits.fetch_add(1, std::memory_order_relaxed);
+        grantEvictionCredit(info->object);
         relinkToUsed(*info);
     }
     return &(info->object);
@@ -507,7 +995,7 @@ template <class T>
 inline T *FixedSizeCache<T>::newObject(quint64 hash, bool makeUnique)
 {
     Q_ASSERT(m_maxSize);
-    if (int(m_size) < m_maxSize)
+    if (m_size < m_maxSize)
         grow();
 
     ObjectInfo *info = nullptr;
@@ -525,8 +1013,8 @@ inline T *FixedSizeCache<T>::newObject(quint64 hash, bool makeUnique)
         setUniqueFlag(info->object);
     }
 
-    Q_ASSERT(!m_cache.count(hash));
-    m_cache.insert({hash, info});
+    Q_ASSERT(!lookupHash(hash));
+    insertHash(hash, info);
     linkToUsed(*info);
     return &(info->object);
 }
@@ -535,9 +1023,8 @@ template <class T>
 inline void FixedSizeCache<T>::unlink(quint64 hash)
 {
     Q_ASSERT(m_size);
-    Q_ASSERT(m_cache.count(hash));
-
-    ObjectInfo *info = m_cache.at(hash);
+    ObjectInfo *info = lookupHash(hash);
+    Q_ASSERT(info);
     if (isPinned(info->object))
         return;
     relinkToUnused(*info, hash);
@@ -551,18 +1038,298 @@ inline float FixedSizeCache<T>::percentFull(int halfMoveNumber) const
     return quint64(m_used) / float(size());
 }
 
+// The cache split by the top bits of the hash into shards with an index and a least recently used
+// list of their own, each behind a lock when there are several so that threads creating and
+// relinking positions only contend on the same shard. Unique keys are the hash xored with the
+// address of the object, which leaves the top bits clear, so they stay in the shard of the hash
+// they were made from. A single shard takes no locks and is the plain cache.
+template <class T>
+class ShardedCache {
+public:
+    ShardedCache();
+
+    enum { MaximumShards = 256 };
+    void reset(quint64 positions, int shards = 1, bool largePages = false);
+    void allocateAll(std::vector<CacheRegion> *regions);
+    PageKind tablePageKind() const { return m_shards[0].cache.tablePageKind(); }
+    PageKind slabPageKind() const
+    {
+        PageKind kind = ExplicitHugePages;
+        for (int i = 0; i < m_count; ++i)
+            kind = qMin(kind, m_shards[i].cache.slabPageKind());
+        return kind;
+    }
+    bool contains(quint64 hash) const;
+    T *object(quint64 hash);
+    T *objectMakeUnique(quint64 hash);
+    T *objectRelinkOrMakeUnique(quint64 hash, bool *madeUnique);
+    T *newObject(quint64 hash, bool makeUnique = false);
+    void unlink(quint64 hash);
+    // The object of the hash relinked, or a new one where there is none or it had to be made
+    // unique, pinned before the lock of its shard is let go so that no other thread evicts it
+    T *acquire(quint64 hash, bool makeUnique);
+    void release(T *object); // unpins it under the lock of its shard
+    int shards() const { return m_count; }
+    quint64 size() const;
+    quint64 used() const;
+    MemoryUsage memoryUsage() const;
+
+    void setEvictionPolicy(EvictionPolicy policy);
+    quint64 hits() const;
+    quint64 evictions() const;
+
+private:
+    struct Shard {
+        mutable QMutex mutex;
+        FixedSizeCache<T> cache;
+        char padding[64]; // so the locks of neighbouring shards are not on one line
+    };
+
+    Shard &shardOf(quint64 hash) const
+    {
+        return m_shards[m_count > 1 ? int(hash >> m_shardShift) : 0];
+    }
+    QMutex *lockOf(const Shard &shard) const { return m_count > 1 ? &shard.mutex : nullptr; }
+
+    std::unique_ptr<Shard[]> m_shards;
+    int m_count;
+    int m_shardShift;
+};
+
+template <class T>
+inline ShardedCache<T>::ShardedCache()
+    : m_shards(new Shard[1]),
+    m_count(1),
+    m_shardShift(64)
+{
+}
+
+template <class T>
+inline void ShardedCache<T>::reset(quint64 positions, int shards, bool largePages)
+{
+    // A power of two of them so that they are picked by bits of the hash, each holding its share
+    int bits = 0;
+    while ((1 << (bits + 1)) <= qBound(1, shards, int(MaximumShards)))
+        ++bits;
+    m_count = 1 << bits;
+    m_shardShift = 64 - bits;
+    m_shards.reset(new Shard[size_t(m_count)]);
+    for (int i = 0; i < m_count; ++i) {
+        const quint64 share = positions / quint64(m_count) + (quint64(i) < positions % quint64(m_count) ? 1 : 0);
+        m_shards[i].cache.reset(share, largePages);
+    }
+}
+
+template <class T>
+inline void ShardedCache<T>::allocateAll(std::vector<CacheRegion> *regions)
+{
+    for (int i = 0; i < m_count; ++i)
+        m_shards[i].cache.allocateAll(regions);
+}
+
+template <class T>
+inline bool ShardedCache<T>::contains(quint64 hash) const
+{
+    const Shard &shard = shardOf(hash);
+    QMutexLocker locker(lockOf(shard));
+    return shard.cache.contains(hash);
+}
+
+template <class T>
+inline T *ShardedCache<T>::object(quint64 hash)
+{
+    Shard &shard = shardOf(hash);
+    QMutexLocker locker(lockOf(shard));
+    return shard.cache.object(hash);
+}
+
+template <class T>
+inline T *ShardedCache<T>::objectMakeUnique(quint64 hash)
+{
+    Shard &shard = shardOf(hash);
+    QMutexLocker locker(lockOf(shard));
+    return shard.cache.objectMakeUnique(hash);
+}
+
+template <class T>
+inline T *ShardedCache<T>::objectRelinkOrMakeUnique(quint64 hash, bool *madeUnique)
+{
+    Shard &shard = shardOf(hash);
+    QMutexLocker locker(lockOf(shard));
+    return shard.cache.objectRelinkOrMakeUnique(hash, madeUnique);
+}
+
+template <class T>
+inline T *ShardedCache<T>::newObject(quint64 hash, bool makeUnique)
+{
+    Shard &shard = shardOf(hash);
+    QMutexLocker locker(lockOf(shard));
+    return shard.cache.newObject(hash, makeUnique);
+}
+
+template <class T>
+inline void ShardedCache<T>::unlink(quint64 hash)
+{
+    Shard &shard = shardOf(hash);
+    QMutexLocker locker(lockOf(shard));
+    shard.cache.unlink(hash);
+}
+
+template <class T>
+inline T *ShardedCache<T>::acquire(quint64 hash, bool makeUnique)
+{
+    Shard &shard = shardOf(hash);
+    QMutexLocker locker(lockOf(shard));
+    T *object = nullptr;
+    if (!makeUnique && shard.cache.contains(hash)) {
+        bool madeUnique = false;
+        object = shard.cache.objectRelinkOrMakeUnique(hash, &madeUnique);
+        if (madeUnique)
+            object = nullptr;
+    }
+
+    if (!object)
+        object = shard.cache.newObject(hash, makeUnique);
+    if (object)
+        pin(*object);
+    return object;
+}
+
+template <class T>
+inline void ShardedCache<T>::release(T *object)
+{
+    Shard &shard = shardOf(fixedHash(*object));
+    QMutexLocker locker(lockOf(shard));
+    unpin(*object);
+}
+
+template <class T>
+inline quint64 ShardedCache<T>::size() const
+{
+    quint64 size = 0;
+    for (int i = 0; i < m_count; ++i)
+        size += m_shards[i].cache.size();
+    return size;
+}
+
+template <class T>
+inline quint64 ShardedCache<T>::used() const
+{
+    quint64 used = 0;
+    for (int i = 0; i < m_count; ++i)
+        used += m_shards[i].cache.used();
+    return used;
+}
+
+template <class T>
+inline MemoryUsage ShardedCache<T>::memoryUsage() const
+{
+    MemoryUsage usage;
+    for (int i = 0; i < m_count; ++i)
+        usage += m_shards[i].cache.memoryUsage();
+    return usage;
+}
+
+template <class T>
+inline void ShardedCache<T>::setEvictionPolicy(EvictionPolicy policy)
+{
+    for (int i = 0; i < m_count; ++i)
+        m_shards[i].cache.setEvictionPolicy(policy);
+}
+
+template <class T>
+inline quint64 ShardedCache<T>::hits() const
+{
+    quint64 hits = 0;
+    for (int i = 0; i < m_count; ++i)
+        hits += m_shards[i].cache.hits();
+    return hits;
+}
+
+template <class T>
+inline quint64 ShardedCache<T>::evictions() const
+{
+    quint64 evictions = 0;
+    for (int i = 0; i < m_count; ++i)
+        evictions += m_shards[i].cache.evictions();
+    return evictions;
+}
+
+// Backing store for the potentials of every position. Blocks come in power of two capacities
+// carved from large slabs and are recycled through per size free lists, so expanding a position
+// never touches the heap. Guarded by a mutex as the GPU workers generate potentials concurrently.
+class PotentialPool {
+public:
+    typedef Node::PotentialVector::Header Header;
+
+    PotentialPool();
+    ~PotentialPool();
+
+    void reset(bool largePages = false);
+    Header *allocate(int capacity);
+    void release(Header *header);
+    MemoryUsage memoryUsage() const;
+
+private:
+    enum { MinimumShift = 3, SizeClasses = 6, SlabBytes = 2 * 1024 * 1024 };
+    static int sizeClass(int capacity);
+    static size_t blockBytes(int sizeClass);
+    void clear();
+
+    mutable QMutex m_mutex;
+    Header *m_free[SizeClasses];
+    std::vector<char*> m_slabs;
+    size_t m_slabUsed;
+    quint64 m_usedBytes;
+    quint64 m_peakBytes;
+    bool m_largePages;
+};
+
 class Cache {
 public:
+    Cache();
+    ~Cache();
+
+    // The cache bound to the calling thread, which is the process wide one unless a shard of the
+    // search bound its own
     static Cache *globalInstance();
+    static void setThreadInstance(Cache *cache); // null goes back to the process wide one
+    static Cache *threadInstance(); // the one bound or null for the process wide one
+    // The cache a node lives in, found through the index it keeps rather than the thread's binding
+    // so walking the tree costs no thread local lookup and works on any thread
+    static Cache *of(const Node *node);
 
     void reset();
+    void reset(quint64 positions);
+    // Faults in the nodes and positions on the threads of the PrefaultThreads option, which are
+    // pinned like the search thread, and returns the milliseconds that took
+    qint64 prefault();
     float percentFull(int halfMoveNumber) const;
-    int size() const;
-    int used() const;
+    quint64 size() const;
+    quint64 used() const;
+    // Whether several threads may make and release nodes and positions at once
+    bool isConcurrent() const { return m_positionCache.shards() > 1; }
+    quint64 positionHits() const { return m_positionCache.hits(); }
+    quint64 positionEvictions() const { return m_positionCache.evictions(); }
+    MemoryUsage nodeMemory() const { return m_nodeArena.memoryUsage(); }
+    MemoryUsage positionMemory() const { return m_positionCache.memoryUsage(); }
+    MemoryUsage potentialMemory() const { return m_potentialPool.memoryUsage(); }
+    static quint64 positionsForMemory(quint64 bytes);
+    static quint64 positionsFromOptions(); // of the CacheMB or Cache options
+
+    // Summed over every cache alive, as the sessions and shards each search in one of their own
+    struct Totals {
+        quint64 size = 0;
+        quint64 used = 0;
+        quint64 positionHits = 0;
+        quint64 positionEvictions = 0;
+    };
+    static Totals totals();
 
-    Node *newNode();
-    void unlinkNode(Node *node);
-    void resetNodes();
+    Node *newNode(quint32 *handle = nullptr);
+    Node *node(quint32 handle) const;
+    void unlinkNode(quint32 handle);
+    void compactNodes(std::vector<quint32> *handles);
 
     bool containsNodePosition(quint64 hash) const;
     Node::Position *nodePosition(quint64 hash);
@@ -570,19 +1337,74 @@ public:
     Node::Position *nodePositionRelinkOrMakeUnique(quint64 hash, bool *madeUnique);
     Node::Position *newNodePosition(quint64 hash, bool makeUnique = false);
     void unlinkNodePosition(quint64 hash);
+    // Safe for several threads at once: the position of the hash, transposed into or new and
+    // referenced for the caller in one step, and taking the reference back
+    Node::Position *acquireNodePosition(quint64 hash, bool makeUnique = false);
+    void releaseNodePosition(Node::Position *position);
+
+    PotentialPool *potentialPool() { return &m_potentialPool; }
+    quint16 index() const { return m_index; }
 
 private:
+    enum { MaximumCaches = 1 << 16 }; // as the index a node keeps is 16 bits
+    static Cache *s_caches[MaximumCaches];
+
     friend class MyCache;
     FixedSizeArena<Node> m_nodeArena;
-    FixedSizeCache<Node::Position> m_positionCache;
+    ShardedCache<Node::Position> m_positionCache;
+    PotentialPool m_potentialPool;
+    quint16 m_index;
 };
 
+inline quint64 Cache::positionsForMemory(quint64 bytes)
+{
+    // Every position needs a node, an entry in the position cache and its share of the table
+    typedef FixedSizeCache<Node::Position> PositionCache;
+    const quint64 perPosition = FixedSizeArena<Node>::bytesPerObject() + PositionCache::bytesPerObject();
+    const quint64 slot = PositionCache::bytesPerSlot();
+    quint64 positions = bytes / (perPosition + 2 * slot);
+
+    // The table is rounded up to a power of two so if that overshoots either fit fewer positions
+    // around the same table or fill the next smaller one, whichever holds more
+    const quint64 tableSize = PositionCache::tableSlots(positions);
+    if (positions * perPosition + tableSize * slot > bytes) {
+        const quint64 smallerTable = tableSize / 2;
+        const quint64 sameTable = (bytes - tableSize * slot) / perPosition;
+        positions = qMax(sameTable, qMin(smallerTable / 2, (bytes - smallerTable * slot) / perPosition));
+    }
+    return positions;
+}
+
+inline quint64 Cache::positionsFromOptions()
+{
+    // A memory budget takes precedence over the number of positions
+    const quint64 megabytes = Options::globalInstance()->option("CacheMB").value().toULongLong();
+    return megabytes
+        ? positionsForMemory(megabytes * 1024 * 1024)
+        : Options::globalInstance()->option("Cache").value().toULongLong();
+}
+
 inline void Cache::reset()
 {
-    // Use a minimum of 100,000 positions
-    int positions = qMax(Options::globalInstance()->option("Cache").value().toInt(), 100000);
-    m_nodeArena.reset(positions);
-    m_positionCache.reset(positions);
+    reset(positionsFromOptions());
+}
+
+inline void Cache::reset(quint64 positions)
+{
+    // Use a minimum of 100,000 positions whatever was asked for
+    positions = qBound(quint64(100000), positions, FixedSizeArena<Node>::maximumSize());
+    const bool largePages = Options::globalInstance()->option("LargePages").value() == "true";
+    const int shards = Options::globalInstance()->option("CacheShards").value().toInt();
+    m_nodeArena.reset(positions, largePages, shards > 1 /*concurrent*/);
+    m_positionCache.reset(positions, shards, largePages);
+    m_positionCache.setEvictionPolicy(
+        Options::globalInstance()->option("CacheEviction").value() == QLatin1String("secondchance")
+        ? SecondChance : LeastRecentlyUsed);
+    m_potentialPool.reset(largePages);
+    if (largePages && Options::globalInstance()->option("DebugInfo").value() == "true") {
+        qDebug() << "position table is backed by"
+            << pageKindToString(m_positionCache.tablePageKind());
+    }
 }
 
 inline float Cache::percentFull(int halfMoveNumber) const
@@ -590,31 +1412,44 @@ inline float Cache::percentFull(int halfMoveNumber) const
     return m_nodeArena.percentFull(halfMoveNumber);
 }
 
-inline int Cache::size() const
+inline quint64 Cache::size() const
 {
     Q_ASSERT(m_positionCache.size() == m_nodeArena.size());
     return m_nodeArena.size();
 }
 
-inline int Cache::used() const
+inline quint64 Cache::used() const
 {
     Q_ASSERT(m_positionCache.used() <= m_nodeArena.size());
     return m_nodeArena.used();
 }
 
-inline Node *Cache::newNode()
+inline Cache *Cache::of(const Node *node)
+{
+    return s_caches[node->m_cache];
+}
+
+inline Node *Cache::newNode(quint32 *handle)
+{
+    Node *node = m_nodeArena.newObject(handle);
+    if (node)
+        node->m_cache = m_index;
+    return node;
+}
+
+inline Node *Cache::node(quint32 handle) const
 {
-    return m_nodeArena.newObject();
+    return m_nodeArena.object(handle);
 }
 
-inline void Cache::unlinkNode(Node *node)
+inline void Cache::unlinkNode(quint32 handle)
 {
-    m_nodeArena.unlink(node);
+    m_nodeArena.unlink(handle);
 }
 
-inline void Cache::resetNodes()
+inline void Cache::compactNodes(std::vector<quint32> *handles)
 {
-    m_nodeArena.reset();
+    m_nodeArena.compact(handles);
 }
 
 inline bool Cache::containsNodePosition(quint64 hash) const
@@ -647,4 +1482,26 @@ inline void Cache::unlinkNodePosition(quint64 hash)
     m_positionCache.unlink(hash);
 }
 
+inline Node::Position *Cache::acquireNodePosition(quint64 hash, bool makeUnique)
+{
+    return m_positionCache.acquire(hash, makeUnique);
+}
+
+inline void Cache::releaseNodePosition(Node::Position *position)
+{
+    m_positionCache.release(position);
+}
+
+inline Node *Node::firstChild() const
+{
+    const quint32 handle = m_firstChild.load(std::memory_order_acquire);
+    return handle ? Cache::of(this)->node(handle) : nullptr;
+}
+
+inline Node *Node::nextSibling() const
+{
+    const quint32 handle = m_nextSibling.load(std::memory_order_acquire);
+    return handle ? Cache::of(this)->node(handle) : nullptr;
+}
+
 #endif // CACHE_H
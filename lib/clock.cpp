@@ -39,9 +39,15 @@ Clock::Clock(QObject *parent)
       m_infinite(false),
       m_isExtended(false),
       m_deadline(0),
+      m_hardDeadline(0),
       m_materialScore(0),
       m_halfMoveNumber(0)
 {
+    for (int i = 0; i < Phases; ++i) {
+        for (int j = 0; j < BatchSizes; ++j)
+            m_nps[i][j] = 0;
+    }
+
     m_timeout = new QTimer(this);
     m_timeout->setTimerType(Qt::PreciseTimer);
     m_timeout->setSingleShot(true);
@@ -137,14 +143,21 @@ qint64 Clock::timeToDeadline() const
     return m_deadline - elapsed();
 }
 
+qint64 Clock::timeToHardDeadline() const
+{
+    if (m_infinite)
+        return -1;
+    return m_hardDeadline - elapsed();
+}
+
 bool Clock::lessThanMoveOverhead() const
 {
-    return timeToDeadline() < Options::globalInstance()->option("MoveOverhead").value().toInt();
+    return timeToDeadline() < Options::globalInstance()->settings().moveOverhead;
 }
 
 bool Clock::pastMoveOverhead() const
 {
-    return elapsed() > Options::globalInstance()->option("MoveOverhead").value().toInt();
+    return elapsed() > Options::globalInstance()->settings().moveOverhead;
 }
 
 void Clock::stop()
@@ -168,7 +181,7 @@ void Clock::maybeTimeout()
     }
 
     // Otherwise, try and extend...
-    const qint64 overhead = Options::globalInstance()->option("MoveOverhead").value().toInt();
+    const qint64 overhead = Options::globalInstance()->settings().moveOverhead;
     const qint64 t = time(m_onTheClock);
     const qint64 maximum = qMax(qint64(0), t - overhead);
 
@@ -178,8 +191,69 @@ void Clock::maybeTimeout()
         return;
     }
 
+    // Only for as long as the runner up takes to be overtaken at the speed learned for this phase,
+    // counting on about half of the new visits going to the best move, and not at all when even
+    // the maximum is not enough
+    qint64 extension = maximum - elapsed();
+    const quint32 nps = expectedNps(m_info.batchSize);
+    if (nps && m_info.visitLead < 0) {
+        const qint64 needed = qCeil(-m_info.visitLead * 2 * 1000.0 / nps);
+        if (needed > extension) {
+            emit timeout();
+            return;
+        }
+        extension = needed;
+    }
+
     m_isExtended = true;
-    m_timeout->start(qMax(int(0), int(maximum - elapsed())));
+    m_timeout->start(qMax(int(0), int(extension)));
+}
+
+int Clock::phase() const
+{
+    // The same boundaries as the estimate of the moves left
+    if (m_materialScore < 20)
+        return 2;
+    else if (m_materialScore <= 60)
+        return 1;
+    return 0;
+}
+
+int Clock::batchSizeIndex(quint32 batchSize)
+{
+    int index = 0;
+    while (index < BatchSizes - 1 && (quint32(1) << index) < batchSize)
+        ++index;
+    return index;
+}
+
+void Clock::recordSpeed(quint32 rawnps, quint32 batchSize)
+{
+    if (!rawnps)
+        return;
+
+    // Exponential moving average so the model follows the hardware as the game goes on
+    float &nps = m_nps[phase()][batchSizeIndex(batchSize)];
+    nps = qFuzzyIsNull(nps) ? rawnps : 0.8f * nps + 0.2f * rawnps;
+}
+
+quint32 Clock::expectedNps(quint32 batchSize) const
+{
+    // The closest batch size learned in this phase and only then the same one in another phase
+    const int index = batchSizeIndex(batchSize);
+    const float *speeds = m_nps[phase()];
+    for (int distance = 0; distance < BatchSizes; ++distance) {
+        if (index - distance >= 0 && !qFuzzyIsNull(speeds[index - distance]))
+            return quint32(speeds[index - distance]);
+        if (index + distance < BatchSizes && !qFuzzyIsNull(speeds[index + distance]))
+            return quint32(speeds[index + distance]);
+    }
+
+    for (int i = 0; i < Phases; ++i) {
+        if (!qFuzzyIsNull(m_nps[i][index]))
+            return quint32(m_nps[i][index]);
+    }
+    return 0;
 }
 
 int Clock::expectedHalfMovesTillEOG() const
@@ -202,7 +276,7 @@ void Clock::calculateDeadline(bool isPartial)
         return;
     }
 
-    const qint64 overhead = Options::globalInstance()->option("MoveOverhead").value().toInt();
+    const qint64 overhead = Options::globalInstance()->settings().moveOverhead;
     const qint64 t = time(m_onTheClock);
     const qint64 inc = increment(m_onTheClock);
     const qint64 maximum = t - overhead;
@@ -217,5 +291,10 @@ void Clock::calculateDeadline(bool isPartial)
     else if (t != -1)
         deadline = qMin(maximum, ideal);
     m_deadline = qMax(qint64(0), deadline);
+
+    // What maybeTimeout can extend to, which is nothing with a move time or without a clock
+    m_hardDeadline = m_deadline;
+    if (m_moveTime == -1 && t != -1)
+        m_hardDeadline = qMax(m_deadline, maximum);
     m_timeout->start(qMax(int(0), int(m_deadline - elapsed())));
 }
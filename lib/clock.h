@@ -53,6 +53,8 @@ public:
     bool hasExpired() const;
     qint64 deadline() const { return m_deadline; }
     qint64 timeToDeadline() const;
+    // The latest the search may run when the deadline is extended, -1 when infinite
+    qint64 timeToHardDeadline() const;
 
     float extraBudgetedTime() const { return m_extraBudgetedTime; }
     void setExtraBudgetedTime(float t) { m_extraBudgetedTime = t; }
@@ -69,6 +71,11 @@ public:
     bool isExtended() const { return m_isExtended; }
     void resetExtension() { m_isExtended = false; }
 
+    // The visits a second this hardware reaches, learned from every search for the phase of the
+    // game the material score puts it in and the batch size, and zero until there is a sample
+    void recordSpeed(quint32 rawnps, quint32 batchSize);
+    quint32 expectedNps(quint32 batchSize) const;
+
 Q_SIGNALS:
     void timeout();
 
@@ -76,6 +83,9 @@ private Q_SLOTS:
     void maybeTimeout();
 
 private:
+    enum { Phases = 3, BatchSizes = 12 };
+    int phase() const;
+    static int batchSizeIndex(quint32 batchSize);
     int expectedHalfMovesTillEOG() const;
     void calculateDeadline(bool isPartial);
 
@@ -94,9 +104,11 @@ private:
 
     SearchInfo m_info;
     qint64 m_deadline;
+    qint64 m_hardDeadline;
     int m_materialScore;
     int m_halfMoveNumber;
     Chess::Army m_onTheClock;
+    float m_nps[Phases][BatchSizes]; // averaged by the power of two the batch size rounds up to
     QElapsedTimer m_timer;
     QTimer *m_timeout;
 };
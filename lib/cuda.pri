@@ -70,16 +70,38 @@ INCLUDEPATH += $$PWD
 
 LIBS += -lcudart -lcudnn -lcublas
 
+# Each thread evaluating the network gets its own default stream so the computations of the gpu
+# workers overlap
+DEFINES += CUDA_API_PER_THREAD_DEFAULT_STREAM
+NVCC_FLAGS = --default-stream per-thread
+
+# TensorRT for the UseTensorRT option, configure with CONFIG+=tensorrt
+tensorrt {
+    DEFINES += USE_TENSORRT
+    TENSORRT_DIR = $$(TENSORRT_DIR)
+    !isEmpty(TENSORRT_DIR) {
+        INCLUDEPATH += $${TENSORRT_DIR}/include
+        QMAKE_LIBDIR += $${TENSORRT_DIR}/lib
+    }
+    LIBS += -lnvinfer
+}
+
+# NVTX ranges for profiling with nsys, configure with CONFIG+=nvtx
+nvtx {
+    DEFINES += USE_NVTX
+    LIBS += -lnvToolsExt
+}
+
 # CUDA COMMON
 CUDA_COMMON_SOURCES += $$PWD/neural/cuda/common_kernels.cu
 cuda_common.output = $${OBJECTS_DIR}${QMAKE_FILE_BASE}_cuda.obj
-cuda_common.commands = $$NVCC_EXEC -c -Xcompiler $$join(CUDA_FLAGS,",") $$join(INCLUDEPATH,'" -I "','-I "','"') ${QMAKE_FILE_NAME} -o ${QMAKE_FILE_OUT}
+cuda_common.commands = $$NVCC_EXEC $$NVCC_FLAGS -c -Xcompiler $$join(CUDA_FLAGS,",") $$join(INCLUDEPATH,'" -I "','-I "','"') ${QMAKE_FILE_NAME} -o ${QMAKE_FILE_OUT}
 cuda_common.input = CUDA_COMMON_SOURCES
 
 # CUDA FP 16
 CUDA_FP16_SOURCES += $$PWD/neural/cuda/fp16_kernels.cu
 cuda_fp16.output = $${OBJECTS_DIR}${QMAKE_FILE_BASE}_cuda.obj
-cuda_fp16.commands = $$NVCC_EXEC -arch=compute_70 -code=sm_70 -c -Xcompiler $$join(CUDA_FLAGS,",") $$join(INCLUDEPATH,'" -I "','-I "','"') ${QMAKE_FILE_NAME} -o ${QMAKE_FILE_OUT}
+cuda_fp16.commands = $$NVCC_EXEC $$NVCC_FLAGS -arch=compute_70 -code=sm_70 -c -Xcompiler $$join(CUDA_FLAGS,",") $$join(INCLUDEPATH,'" -I "','-I "','"') ${QMAKE_FILE_NAME} -o ${QMAKE_FILE_OUT}
 cuda_fp16.input = CUDA_FP16_SOURCES
 
 QMAKE_EXTRA_UNIX_COMPILERS += cuda_common cuda_fp16
@@ -0,0 +1,189 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "debuglog.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+
+// Large enough that a burst of search info is written at once
+static const size_t s_bufferSize = 1 << 16;
+// The writer looks at the ring this often even when no one wakes it
+static const unsigned long s_idleMsecs = 100;
+
+Q_GLOBAL_STATIC(DebugLog, s_debugLog)
+DebugLog *DebugLog::globalInstance()
+{
+    return s_debugLog();
+}
+
+DebugLog::DebugLog()
+    : m_enqueuePosition(0),
+    m_dequeuePosition(0),
+    m_enabled(false),
+    m_sleeping(false),
+    m_stop(false),
+    m_file(nullptr),
+    m_written(0)
+{
+    for (int i = 0; i < Capacity; ++i)
+        m_cells[i].sequence.store(quint64(i), std::memory_order_relaxed);
+}
+
+DebugLog::~DebugLog()
+{
+    m_enabled.store(false, std::memory_order_relaxed);
+    if (m_writer.joinable()) {
+        {
+            QMutexLocker locker(&m_mutex);
+            m_stop.store(true, std::memory_order_relaxed);
+            m_condition.wakeOne();
+        }
+        m_writer.join();
+    }
+    if (m_file)
+        fclose(m_file);
+}
+
+void DebugLog::setFilePath(const QString &path)
+{
+    QMutexLocker locker(&m_mutex);
+    Q_ASSERT(!m_file);
+    m_filePath = path;
+}
+
+void DebugLog::setEnabled(bool enabled)
+{
+    QMutexLocker locker(&m_mutex);
+    if (enabled && !m_file) {
+        const QString path = !m_filePath.isEmpty() ? m_filePath :
+            QCoreApplication::applicationDirPath() + QDir::separator() +
+            QCoreApplication::applicationName() + "_debug.log";
+        m_file = fopen(QFile::encodeName(path).constData(), "a");
+        if (!m_file)
+            return;
+
+        setvbuf(m_file, nullptr, _IOFBF, s_bufferSize);
+        const QString header = QString("Output: log pid %0 at %1\n")
+            .arg(QCoreApplication::applicationPid())
+            .arg(QDateTime::currentDateTime().toString());
+        fputs(header.toLocal8Bit().constData(), m_file);
+        m_writer = std::thread([this]() { run(); });
+    }
+    m_enabled.store(enabled && m_file, std::memory_order_relaxed);
+}
+
+bool DebugLog::tryPush(const QByteArray &message)
+{
+    Cell *cell = nullptr;
+    quint64 position = m_enqueuePosition.load(std::memory_order_relaxed);
+    forever {
+        cell = &m_cells[position & (Capacity - 1)];
+        const quint64 sequence = cell->sequence.load(std::memory_order_acquire);
+        const qint64 difference = qint64(sequence) - qint64(position);
+        if (!difference) {
+            if (m_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+        } else if (difference < 0) {
+            return false; // full
+        } else {
+            position = m_enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->message = message;
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+bool DebugLog::tryPop(QByteArray *message)
+{
+    // The writer is the only consumer so the position is never contended
+    const quint64 position = m_dequeuePosition.load(std::memory_order_relaxed);
+    Cell *cell = &m_cells[position & (Capacity - 1)];
+    if (cell->sequence.load(std::memory_order_acquire) != position + 1)
+        return false; // empty or the message is not in yet
+
+    *message = std::move(cell->message);
+    cell->message = QByteArray();
+    m_dequeuePosition.store(position + 1, std::memory_order_relaxed);
+    cell->sequence.store(position + Capacity, std::memory_order_release);
+    return true;
+}
+
+void DebugLog::append(const QByteArray &message)
+{
+    if (!isEnabled())
+        return;
+
+    // The writer drains a full ring without sleeping so this waits on the disk at worst
+    while (!tryPush(message))
+        std::this_thread::yield();
+
+    // Pairs with the fence in run so that either the writer sees the message or we see it sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleeping.load(std::memory_order_relaxed)) {
+        QMutexLocker locker(&m_mutex);
+        m_condition.wakeOne();
+    }
+}
+
+void DebugLog::flush()
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_writer.joinable())
+        return;
+
+    const quint64 target = m_enqueuePosition.load(std::memory_order_acquire);
+    m_condition.wakeOne();
+    while (m_written < target)
+        m_flushed.wait(&m_mutex);
+}
+
+void DebugLog::run()
+{
+    QByteArray message;
+    forever {
+        quint64 written = 0;
+        while (tryPop(&message)) {
+            fwrite(message.constData(), 1, size_t(message.size()), m_file);
+            ++written;
+        }
+        if (written)
+            fflush(m_file);
+
+        QMutexLocker locker(&m_mutex);
+        m_written += written;
+        m_flushed.wakeAll();
+        const bool isEmpty = m_enqueuePosition.load(std::memory_order_relaxed) == m_written;
+        if (m_stop.load(std::memory_order_relaxed) && isEmpty)
+            break;
+        if (!isEmpty)
+            continue; // a message is on its way in
+
+        m_sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_enqueuePosition.load(std::memory_order_relaxed) == m_written)
+            m_condition.wait(&m_mutex, s_idleMsecs);
+        m_sleeping.store(false, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,80 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef DEBUGLOG_H
+#define DEBUGLOG_H
+
+#include <QByteArray>
+#include <QMutex>
+#include <QString>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+// The debug log in the binary directory. Any thread appends its messages to a bounded lock free
+// ring and a thread of its own writes them to a file that stays open and buffered, so the threads
+// of the search never wait on the disk.
+class DebugLog {
+public:
+    enum { Capacity = 4096 }; // a power of two of messages waiting to be written
+
+    DebugLog();
+    ~DebugLog();
+
+    static DebugLog *globalInstance();
+
+    bool isEnabled() const { return m_enabled.load(std::memory_order_relaxed); }
+    void setEnabled(bool enabled); // opens the file the first time it is enabled
+    void setFilePath(const QString &path); // before it is enabled, the binary directory otherwise
+
+    void append(const QByteArray &message); // blocks only while the ring is full
+    void flush(); // returns once everything appended before is in the file
+
+private:
+    void run();
+    bool tryPush(const QByteArray &message);
+    bool tryPop(QByteArray *message);
+
+    struct Cell {
+        std::atomic<quint64> sequence;
+        QByteArray message;
+    };
+
+    Cell m_cells[Capacity];
+    // Padded so producers and the writer do not share a cache line
+    std::atomic<quint64> m_enqueuePosition;
+    char m_enqueuePadding[56];
+    std::atomic<quint64> m_dequeuePosition;
+    char m_dequeuePadding[56];
+    std::atomic<bool> m_enabled;
+    std::atomic<bool> m_sleeping;
+    std::atomic<bool> m_stop;
+    std::thread m_writer;
+    FILE *m_file;
+    QString m_filePath;
+    quint64 m_written;
+    QMutex m_mutex;
+    QWaitCondition m_condition; // wakes the writer
+    QWaitCondition m_flushed; // wakes those waiting on a flush
+};
+
+#endif // DEBUGLOG_H
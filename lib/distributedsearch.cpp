@@ -0,0 +1,253 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "distributedsearch.h"
+
+#include <QDebug>
+
+#include <algorithm>
+
+#include "game.h"
+#include "history.h"
+#include "nnremote.h"
+#include "node.h"
+#include "notation.h"
+
+// The children the servers search are reconsidered at most this often so that they are not moved
+// back and forth while the visits of two children are close
+static const qint64 s_reassignMsecs = 1000;
+
+// The longest a server that can not be reached is waited for, which bounds how long going away
+// waits on a reader still connecting
+static const int s_connectMsecs = 2000;
+
+DistributedSearch::DistributedSearch(const QStringList &addresses)
+    : m_addresses(addresses),
+    m_isActive(false),
+    m_isClosing(false)
+{
+    // Connecting is left to the readers so that a server that can not be reached does not take
+    // from the time of the search that starts us
+    for (const QString &address : addresses) {
+        Server *server = new Server;
+        server->address = address;
+        m_servers.append(server);
+    }
+    for (Server *server : m_servers)
+        server->reader = std::thread([this, server]() { read(server); });
+}
+
+DistributedSearch::~DistributedSearch()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_isActive = false;
+        m_isClosing = true;
+        for (Server *server : m_servers) {
+            send(server, QLatin1String("quit"));
+            NNRemote::shutdownSocket(server->socket);
+        }
+    }
+
+    for (Server *server : m_servers) {
+        if (server->reader.joinable())
+            server->reader.join();
+        NNRemote::closeSocket(server->socket);
+    }
+    qDeleteAll(m_servers);
+}
+
+void DistributedSearch::start(const History *history)
+{
+    // The first game of the history has had its move made already, which leaves the servers only
+    // the position before it short for detecting repetitions
+    const QVector<StandaloneGame> games = history->games();
+    const StandaloneGame first = games.isEmpty() ? StandaloneGame() : games.first();
+    QString position = QLatin1String("position fen ") + first.stateOfGameToFen() + QLatin1String(" moves");
+    for (int i = 1; i < games.count(); ++i)
+        position += QLatin1String(" ") + Notation::moveToString(games.at(i).lastMove(), Chess::Computer);
+
+    QMutexLocker locker(&m_mutex);
+    m_position = position;
+    m_isActive = true;
+    m_assigned.invalidate();
+    for (Server *server : m_servers) {
+        // Whatever is still searching belongs to the last root and is stopped on the first assign
+        server->move.clear();
+        server->nextMove.clear();
+    }
+}
+
+void DistributedSearch::stop()
+{
+    QMutexLocker locker(&m_mutex);
+    m_isActive = false;
+    for (Server *server : m_servers) {
+        server->nextMove.clear();
+        stopSearch(server);
+    }
+}
+
+void DistributedSearch::merge(Node *root)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_isActive)
+        return;
+
+    for (Server *server : m_servers) {
+        if (server->move.isEmpty() || server->nodes <= server->merged)
+            continue;
+
+        for (Node *child = root->firstChild(); child; child = child->nextSibling()) {
+            if (Notation::moveToString(child->game().lastMove(), Chess::Computer) != server->move)
+                continue;
+            if (!child->isExact())
+                child->mergeRemoteVisits(server->nodes - server->merged, server->qValue);
+            break;
+        }
+        server->merged = server->nodes;
+    }
+
+    if (!m_assigned.isValid() || m_assigned.hasExpired(s_reassignMsecs)) {
+        assign(root);
+        m_assigned.restart();
+    }
+}
+
+void DistributedSearch::assign(Node *root)
+{
+    // The servers belong on the most visited children that are still open
+    QVector<Node*> children;
+    for (Node *child = root->firstChild(); child; child = child->nextSibling()) {
+        if (child->visits() && !child->isExact())
+            children.append(child);
+    }
+    std::stable_sort(children.begin(), children.end(), [](const Node *a, const Node *b) {
+        return a->visits() > b->visits();
+    });
+
+    QStringList open;
+    for (int i = 0; i < children.count() && i < m_servers.count(); ++i)
+        open.append(Notation::moveToString(children.at(i)->game().lastMove(), Chess::Computer));
+
+    // Servers that are on or headed for one of those stay put
+    QVector<Server*> free;
+    for (Server *server : m_servers) {
+        if (server->socket == -1)
+            continue;
+        const QString target = server->nextMove.isEmpty() ? server->move : server->nextMove;
+        if (!target.isEmpty() && open.removeOne(target))
+            continue;
+        free.append(server);
+    }
+
+    for (Server *server : free) {
+        server->nextMove = open.isEmpty() ? QString() : open.takeFirst();
+        if (!server->isSearching && !server->nextMove.isEmpty()) {
+            server->move = server->nextMove;
+            server->nextMove.clear();
+            startSearch(server);
+        } else {
+            stopSearch(server);
+        }
+    }
+}
+
+void DistributedSearch::read(Server *server)
+{
+    // Once connected the server is given a child at the next assign
+    const int socket = NNRemote::connectTo(server->address, s_connectMsecs);
+    {
+        QMutexLocker locker(&m_mutex);
+        if (socket == -1)
+            qWarning() << "Could not connect to the search server" << server->address;
+        if (socket == -1 || m_isClosing) {
+            NNRemote::closeSocket(socket);
+            return;
+        }
+        server->socket = socket;
+    }
+
+    QByteArray buffer;
+    QByteArray line;
+    while (NNRemote::receiveLine(socket, &buffer, &line)) {
+        const QList<QByteArray> tokens = line.simplified().split(' ');
+        QMutexLocker locker(&m_mutex);
+        if (tokens.first() == "bestmove") {
+            server->isSearching = false;
+            server->isStopping = false;
+            if (m_isActive && !server->nextMove.isEmpty()) {
+                server->move = server->nextMove;
+                server->nextMove.clear();
+                startSearch(server);
+            }
+            continue;
+        }
+
+        if (tokens.count() < 2 || tokens.at(0) != "info" || tokens.at(1) != "depth"
+            || server->move.isEmpty()) {
+            continue;
+        }
+
+        const int nodes = tokens.indexOf("nodes");
+        const int score = tokens.indexOf("score");
+        if (nodes == -1 || nodes + 1 >= tokens.count() || score == -1 || score + 2 >= tokens.count())
+            continue;
+
+        // The score is of the side to move after the move of the child, the opposite of its value
+        bool ok = false;
+        const int value = tokens.at(score + 2).toInt(&ok);
+        if (!ok)
+            continue;
+        if (tokens.at(score + 1) == "mate")
+            server->qValue = value > 0 ? -1.0f : 1.0f;
+        else
+            server->qValue = -cpToScore(value);
+        server->nodes = qMax(server->nodes, tokens.at(nodes + 1).toUInt());
+    }
+}
+
+void DistributedSearch::send(Server *server, const QString &line)
+{
+    if (server->socket == -1)
+        return;
+    const QByteArray data = line.toLatin1() + '\n';
+    NNRemote::send(server->socket, data.constData(), size_t(data.size()));
+}
+
+void DistributedSearch::startSearch(Server *server)
+{
+    // Every search starts on a fresh tree so the nodes it reports are all its own
+    server->isSearching = true;
+    server->isStopping = false;
+    server->nodes = 0;
+    server->merged = 0;
+    send(server, QLatin1String("ucinewgame"));
+    send(server, m_position + QLatin1String(" ") + server->move);
+    send(server, QLatin1String("go infinite"));
+}
+
+void DistributedSearch::stopSearch(Server *server)
+{
+    if (!server->isSearching || server->isStopping)
+        return;
+    server->isStopping = true;
+    send(server, QLatin1String("stop"));
+}
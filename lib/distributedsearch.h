@@ -0,0 +1,80 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef DISTRIBUTEDSEARCH_H
+#define DISTRIBUTEDSEARCH_H
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QStringList>
+#include <QVector>
+
+#include <thread>
+
+class History;
+class Node;
+
+// Splits the search of the root across search servers on other machines. Every server searches the
+// subtree of one of the most visited children of the root with a tree of its own and reports back
+// over uci, and the visits and the value it reports are merged into that child as the search goes
+// so that minimax and the choice of the best move see them. A server moves on to another child once
+// its own has fallen out of the most visited, so the split follows the root as its visits shift.
+// The servers are connected to in the background and join the split once they are reached.
+class DistributedSearch {
+public:
+    DistributedSearch(const QStringList &addresses); // of the servers as host:port
+    ~DistributedSearch();
+
+    QStringList addresses() const { return m_addresses; }
+
+    void start(const History *history); // the game up to the root of the search
+    void stop();
+    void merge(Node *root); // on the search thread in between batches
+
+private:
+    struct Server {
+        QString address;
+        int socket = -1;
+        std::thread reader;
+        QString move;           // of the child being searched or empty
+        QString nextMove;       // to search once the current search has stopped
+        bool isSearching = false;
+        bool isStopping = false;
+        quint32 nodes = 0;      // reported by the current search
+        quint32 merged = 0;     // of those nodes
+        float qValue = 0.0f;    // of the child as the current search has it
+    };
+
+    void read(Server *server);
+    void send(Server *server, const QString &line);
+    void startSearch(Server *server);
+    void stopSearch(Server *server);
+    void assign(Node *root);
+
+    QStringList m_addresses;
+    QVector<Server*> m_servers;
+    QString m_position; // the position command of the root, which the move of a child completes
+    QElapsedTimer m_assigned;
+    bool m_isActive;
+    bool m_isClosing;   // so a server reached while we go away is let go right away
+    QMutex m_mutex; // the servers are shared with their readers
+};
+
+#endif // DISTRIBUTEDSEARCH_H
@@ -47,38 +47,9 @@ bool Game::Position::hasPieceAt(int index, Chess::Army army) const
 
 PieceType Game::Position::pieceTypeAt(int index) const
 {
-    // From most numerous piece type to least
-    Chess::PieceType type = Pawn;
-    if (BitBoard(board(type) & m_whitePositionBoard).testBit(index)
-        || BitBoard(board(type) & m_blackPositionBoard).testBit(index))
-        return type;
-
-    type = Knight;
-    if (BitBoard(board(type) & m_whitePositionBoard).testBit(index)
-        || BitBoard(board(type) & m_blackPositionBoard).testBit(index))
-        return type;
-
-    type = Bishop;
-    if (BitBoard(board(type) & m_whitePositionBoard).testBit(index)
-        || BitBoard(board(type) & m_blackPositionBoard).testBit(index))
-        return type;
-
-    type = Rook;
-    if (BitBoard(board(type) & m_whitePositionBoard).testBit(index)
-        || BitBoard(board(type) & m_blackPositionBoard).testBit(index))
-        return type;
-
-    type = Queen;
-    if (BitBoard(board(type) & m_whitePositionBoard).testBit(index)
-        || BitBoard(board(type) & m_blackPositionBoard).testBit(index))
-        return type;
-
-    type = King;
-    if (BitBoard(board(type) & m_whitePositionBoard).testBit(index)
-        || BitBoard(board(type) & m_blackPositionBoard).testBit(index))
-        return type;
-
-    return Unknown;
+    return PieceType(int(m_pieceTypeBoards[0].testBit(index))
+        | (int(m_pieceTypeBoards[1].testBit(index)) << 1)
+        | (int(m_pieceTypeBoards[2].testBit(index)) << 2));
 }
 
 bool Game::Position::hasPieceTypeAt(int index, Chess::PieceType piece) const
@@ -86,6 +57,23 @@ bool Game::Position::hasPieceTypeAt(int index, Chess::PieceType piece) const
     return board(piece).testBit(index);
 }
 
+inline void Game::Position::togglePieceAt(int index, Chess::Army army, Chess::PieceType piece, bool bit)
+{
+    BitBoard &armyBoard = army == Chess::White ? m_whitePositionBoard : m_blackPositionBoard;
+    if (bit) {
+        Q_ASSERT(pieceTypeAt(index) == Unknown);
+    } else if (!armyBoard.testBit(index) || pieceTypeAt(index) != piece) {
+        return;
+    }
+
+    m_positionHash ^= Zobrist::pieceKey(index, army, piece);
+    armyBoard.setBit(index, bit);
+    for (int i = 0; i < 3; ++i) {
+        if (int(piece) & (1 << i))
+            m_pieceTypeBoards[i].setBit(index, bit);
+    }
+}
+
 bool Game::Position::makeMove(Move *move)
 {
     bool ok = fillOutMove(activeArmy(), move);
@@ -99,6 +87,14 @@ bool Game::Position::makeMove(Move *move)
 
 void Game::Position::processMove(Chess::Army army, Move *move)
 {
+    // The hash follows along with everything the move changes
+    if (m_enPassantTarget.isValid())
+        m_positionHash ^= Zobrist::enPassantKey(m_enPassantTarget);
+    const bool hadWhiteKingCastle = m_hasWhiteKingCastle;
+    const bool hadBlackKingCastle = m_hasBlackKingCastle;
+    const bool hadWhiteQueenCastle = m_hasWhiteQueenCastle;
+    const bool hadBlackQueenCastle = m_hasBlackQueenCastle;
+
     m_enPassantTarget = Square();
 
     if (army == White) {
@@ -218,6 +214,19 @@ void Game::Position::processMove(Chess::Army army, Move *move)
     }
 
     m_activeArmy = m_activeArmy == White ? Black : White;
+
+    m_positionHash ^= Zobrist::activeArmyKey();
+    if (m_enPassantTarget.isValid())
+        m_positionHash ^= Zobrist::enPassantKey(m_enPassantTarget);
+    if (hadWhiteKingCastle != m_hasWhiteKingCastle)
+        m_positionHash ^= Zobrist::castleKey(White, KingSide);
+    if (hadBlackKingCastle != m_hasBlackKingCastle)
+        m_positionHash ^= Zobrist::castleKey(Black, KingSide);
+    if (hadWhiteQueenCastle != m_hasWhiteQueenCastle)
+        m_positionHash ^= Zobrist::castleKey(White, QueenSide);
+    if (hadBlackQueenCastle != m_hasBlackQueenCastle)
+        m_positionHash ^= Zobrist::castleKey(Black, QueenSide);
+    Q_ASSERT(m_positionHash == Zobrist::hash(*this));
 }
 
 bool Game::Position::fillOutMove(Chess::Army army, Move *move) const
@@ -416,12 +425,9 @@ void Game::Position::setFenOfPosition(const QStringList &list)
 
     m_whitePositionBoard = BitBoard();
     m_blackPositionBoard = BitBoard();
-    m_kingsBoard = BitBoard();
-    m_queensBoard = BitBoard();
-    m_rooksBoard = BitBoard();
-    m_bishopsBoard = BitBoard();
-    m_knightsBoard = BitBoard();
-    m_pawnsBoard = BitBoard();
+    m_pieceTypeBoards[0] = BitBoard();
+    m_pieceTypeBoards[1] = BitBoard();
+    m_pieceTypeBoards[2] = BitBoard();
     m_hasWhiteKingCastle = false;
     m_hasBlackKingCastle = false;
     m_hasWhiteQueenCastle = false;
@@ -512,6 +518,8 @@ void Game::Position::setFenOfPosition(const QStringList &list)
     QString enPassant = list.at(3);
     if (enPassant != QLatin1String("-"))
         m_enPassantTarget = Notation::stringToSquare(enPassant);
+
+    m_positionHash = Zobrist::hash(*this);
 }
 
 QStringList Game::Position::stateOfPositionToFen() const
@@ -677,161 +685,230 @@ BitBoard Game::Position::pawnAttackBoard(Chess::Army army, const Movegen *gen,
     return bits;
 }
 
-void Game::Position::pseudoLegalMoves(Node *parent) const
+bool Game::Position::legalPieceMoves(PieceMoves *pieceMoves, int *count) const
 {
     const Chess::Army army = activeArmy();
+    const Chess::Army enemyArmy = army == White ? Black : White;
     const BitBoard friends = army == White ? m_whitePositionBoard : m_blackPositionBoard;
     const BitBoard enemies = army == Black ? m_whitePositionBoard : m_blackPositionBoard;
+    const BitBoard occupied = friends | enemies;
     const Movegen *gen = Movegen::globalInstance();
-
-    int totalMoves = 0;
-    QVector<QPair<Square, BitBoard>> kingMoves;
-    QVector<QPair<Square, BitBoard>> queenMoves;
-    QVector<QPair<Square, BitBoard>> rookMoves;
-    QVector<QPair<Square, BitBoard>> bishopMoves;
-    QVector<QPair<Square, BitBoard>> knightMoves;
-    QVector<QPair<Square, BitBoard>> pawnMoves;
-    QVector<QPair<Square, BitBoard>> pawnAttacks;
-
+    const Square king = BitBoard(friends & board(King)).first();
+    const BitBoard enemyDiagonals = enemies & (board(Bishop) | board(Queen));
+    const BitBoard enemyLines = enemies & (board(Rook) | board(Queen));
+
+    // The pieces giving check and the squares a move other than the king's has to land on
+    const BitBoard checkers = (gen->bishopAttacks(king, occupied) & enemyDiagonals)
+        | (gen->rookAttacks(king, occupied) & enemyLines)
+        | (gen->knightAttacks(king) & enemies & board(Knight))
+        | (gen->pawnAttacks(army, king) & enemies & board(Pawn));
+    BitBoard targets = ~friends;
+    if (checkers.count() == 1)
+        targets = checkers | gen->between(king, checkers.first());
+    else if (checkers.count() > 1)
+        targets = BitBoard(); // double check so only the king can move
+
+    // A piece of ours standing alone between the king and an enemy slider is pinned to that line
+    BitBoard pinned;
     {
-        const BitBoard pieces(friends & board(King));
-        kingMoves.reserve(pieces.count());
-        BitBoard::Iterator sq = pieces.begin();
-        for (int i = 0; sq != pieces.end(); ++sq, ++i) {
-            Q_ASSERT(i < 1);
-            const BitBoard moves = gen->kingMoves(*sq, friends);
-            totalMoves += moves.count();
-            kingMoves.append(qMakePair(*sq, moves));
+        const BitBoard snipers = (gen->bishopAttacks(king, enemies) & enemyDiagonals)
+            | (gen->rookAttacks(king, enemies) & enemyLines);
+        BitBoard::Iterator sq = snipers.begin();
+        for (; sq != snipers.end(); ++sq) {
+            const BitBoard blockers = gen->between(king, *sq) & occupied;
+            if (blockers.count() == 1 && !BitBoard(blockers & friends).isClear())
+                pinned = pinned | blockers;
         }
     }
 
+    // The squares the enemy attacks with our king off the board so it can't step along a check
+    BitBoard attacked;
     {
-        const BitBoard pieces(friends & board(Queen));
-        queenMoves.reserve(pieces.count());
-        BitBoard::Iterator sq = pieces.begin();
-        for (; sq != pieces.end(); ++sq) {
-            const BitBoard moves = gen->queenMoves(*sq, friends, enemies);
-            totalMoves += moves.count();
-            queenMoves.append(qMakePair(*sq, moves));
-        }
+        const BitBoard withoutKing = occupied & ~BitBoard(king);
+        BitBoard::Iterator sq = enemyDiagonals.begin();
+        for (; sq != enemyDiagonals.end(); ++sq)
+            attacked = attacked | gen->bishopAttacks(*sq, withoutKing);
+        for (sq = enemyLines.begin(); sq != enemyLines.end(); ++sq)
+            attacked = attacked | gen->rookAttacks(*sq, withoutKing);
+        const BitBoard knights = enemies & board(Knight);
+        for (sq = knights.begin(); sq != knights.end(); ++sq)
+            attacked = attacked | gen->knightAttacks(*sq);
+        const BitBoard pawns = enemies & board(Pawn);
+        for (sq = pawns.begin(); sq != pawns.end(); ++sq)
+            attacked = attacked | gen->pawnAttacks(enemyArmy, *sq);
+        attacked = attacked | gen->kingAttacks(BitBoard(enemies & board(King)).first());
     }
 
-    {
-        const BitBoard pieces(friends & board(Rook));
-        rookMoves.reserve(pieces.count());
-        BitBoard::Iterator sq = pieces.begin();
-        for (; sq != pieces.end(); ++sq) {
-            const BitBoard moves = gen->rookMoves(*sq, friends, enemies);
-            totalMoves += moves.count();
-            rookMoves.append(qMakePair(*sq, moves));
+    *count = 0;
+    auto append = [&](Chess::PieceType piece, const Square &start, const BitBoard &moves) {
+        if (moves.isClear())
+            return;
+        Q_ASSERT(*count < MaximumPieceMoves);
+        pieceMoves[(*count)++] = PieceMoves{ piece, start, moves };
+    };
+
+    auto restrict = [&](const Square &start, const BitBoard &moves) {
+        BitBoard result = moves & targets;
+        if (pinned.testBit(start.data()))
+            result = result & gen->line(king, start);
+        return result;
+    };
+
+    append(King, king, gen->kingMoves(king, friends) & ~attacked);
+
+    // Nothing but the king moves out of a double check
+    if (checkers.count() < 2) {
+        {
+            const BitBoard pieces(friends & board(Queen));
+            BitBoard::Iterator sq = pieces.begin();
+            for (; sq != pieces.end(); ++sq)
+                append(Queen, *sq, restrict(*sq, gen->queenMoves(*sq, friends, enemies)));
         }
-    }
 
-    {
-        const BitBoard pieces(friends & board(Bishop));
-        bishopMoves.reserve(pieces.count());
-        BitBoard::Iterator sq = pieces.begin();
-        for (; sq != pieces.end(); ++sq) {
-            const BitBoard moves = gen->bishopMoves(*sq, friends, enemies);
-            totalMoves += moves.count();
-            bishopMoves.append(qMakePair(*sq, moves));
+        {
+            const BitBoard pieces(friends & board(Rook));
+            BitBoard::Iterator sq = pieces.begin();
+            for (; sq != pieces.end(); ++sq)
+                append(Rook, *sq, restrict(*sq, gen->rookMoves(*sq, friends, enemies)));
         }
-    }
 
-    {
-        const BitBoard pieces(friends & board(Knight));
-        knightMoves.reserve(pieces.count());
-        BitBoard::Iterator sq = pieces.begin();
-        for (; sq != pieces.end(); ++sq) {
-            const BitBoard moves = gen->knightMoves(*sq, friends);
-            totalMoves += moves.count();
-            knightMoves.append(qMakePair(*sq, moves));
+        {
+            const BitBoard pieces(friends & board(Bishop));
+            BitBoard::Iterator sq = pieces.begin();
+            for (; sq != pieces.end(); ++sq)
+                append(Bishop, *sq, restrict(*sq, gen->bishopMoves(*sq, friends, enemies)));
         }
-    }
 
-    {
-        const BitBoard pieces(friends & board(Pawn));
-        pawnMoves.reserve(pieces.count());
-        pawnAttacks.reserve(pieces.count());
-        BitBoard::Iterator sq = pieces.begin();
-        BitBoard enemiesPlusEnpassant = enemies;
-        if (m_enPassantTarget.isValid())
-            enemiesPlusEnpassant.setSquare(m_enPassantTarget);
-        for (; sq != pieces.end(); ++sq) {
-            {
-                const BitBoard moves = gen->pawnMoves(army, *sq, friends, enemies);
-                totalMoves += moves.count();
-                pawnMoves.append(qMakePair(*sq, moves));
+        {
+            // A pinned knight can never stay on the line
+            const BitBoard pieces(friends & board(Knight) & ~pinned);
+            BitBoard::Iterator sq = pieces.begin();
+            for (; sq != pieces.end(); ++sq)
+                append(Knight, *sq, gen->knightMoves(*sq, friends) & targets);
+        }
+
+        const BitBoard pawns(friends & board(Pawn));
+        {
+            BitBoard::Iterator sq = pawns.begin();
+            for (; sq != pawns.end(); ++sq) {
+                BitBoard moves = gen->pawnMoves(army, *sq, friends, enemies);
+                const Square forwardOne = Square((*sq).file(), army == White ? (*sq).rank() + 1 : (*sq).rank() - 1);
+                if (occupied.testBit(forwardOne.data()))
+                    moves = BitBoard(); // can't move through another piece
+                append(Pawn, *sq, restrict(*sq, moves));
             }
-            {
-                BitBoard moves = gen->pawnAttacks(army, *sq) & enemiesPlusEnpassant & ~friends;
-                totalMoves += moves.count();
-                pawnAttacks.append(qMakePair(*sq, moves));
+        }
+
+        {
+            BitBoard::Iterator sq = pawns.begin();
+            for (; sq != pawns.end(); ++sq) {
+                BitBoard moves = restrict(*sq, gen->pawnAttacks(army, *sq) & enemies);
+                if (m_enPassantTarget.isValid() && gen->pawnAttacks(army, *sq).testBit(m_enPassantTarget.data())) {
+                    // Taking en passant empties two squares on the rank of our king possibly, so
+                    // just look at the board after the capture
+                    const Square captured = Square(m_enPassantTarget.file(), (*sq).rank());
+                    const BitBoard after = (occupied & ~BitBoard(*sq) & ~BitBoard(captured)) | BitBoard(m_enPassantTarget);
+                    const BitBoard checks = (gen->bishopAttacks(king, after) & enemyDiagonals)
+                        | (gen->rookAttacks(king, after) & enemyLines)
+                        | (gen->knightAttacks(king) & enemies & board(Knight))
+                        | (gen->pawnAttacks(army, king) & enemies & board(Pawn) & ~BitBoard(captured));
+                    if (checks.isClear())
+                        moves.setSquare(m_enPassantTarget);
+                }
+                append(Pawn, *sq, moves);
             }
         }
     }
 
-    // For castle moves
-    totalMoves += 2;
+    // Castles are only possible out of check
+    return checkers.isClear();
+}
 
-    // Reserve conservative estimate for number of children
-    parent->reservePotentials(totalMoves);
+int Game::Position::legalMoves(Move *moves) const
+{
+    PieceMoves pieceMoves[MaximumPieceMoves];
+    int count = 0;
+    const bool canCastle = legalPieceMoves(pieceMoves, &count);
 
-    for (QPair<Square, BitBoard> piece : kingMoves) {
-        BitBoard::Iterator newSq = piece.second.begin();
-        for (; newSq != piece.second.end(); ++newSq)
-            generateMove(King, piece.first, *newSq, parent);
+    const Chess::Army army = activeArmy();
+    const BitBoard enemies = army == Black ? m_whitePositionBoard : m_blackPositionBoard;
+    const BitBoard lastRank(army == White ? 0xFF00000000000000ull : 0x00000000000000FFull);
+    int total = 0;
+    for (int i = 0; i < count; ++i) {
+        const PieceMoves &piece = pieceMoves[i];
+        BitBoard::Iterator newSq = piece.moves.begin();
+        for (; newSq != piece.moves.end(); ++newSq) {
+            Move mv;
+            mv.setPiece(piece.piece);
+            mv.setStart(piece.start);
+            mv.setEnd(*newSq);
+            mv.setCapture(enemies.isSquareOccupied(*newSq));
+            if (piece.piece != Pawn || !lastRank.isSquareOccupied(*newSq)) {
+                moves[total++] = mv;
+            } else {
+                mv.setPromotion(Queen);
+                moves[total++] = mv;
+                mv.setPromotion(Knight);
+                moves[total++] = mv;
+                mv.setPromotion(Rook);
+                moves[total++] = mv;
+                mv.setPromotion(Bishop);
+                moves[total++] = mv;
+            }
+        }
     }
 
-    for (QPair<Square, BitBoard> piece : queenMoves) {
-        BitBoard::Iterator newSq = piece.second.begin();
-        for (; newSq != piece.second.end(); ++newSq)
-            generateMove(Queen, piece.first, *newSq, parent);
+    // Castle moves are checked by playing them as there are at most two
+    if (canCastle) {
+        for (Chess::Castle side : { KingSide, QueenSide }) {
+            if (!isCastleLegal(army, side))
+                continue;
+            const Move mv = castleMove(army, side);
+            if (isLegalCastle(mv))
+                moves[total++] = mv;
+        }
     }
 
-    for (QPair<Square, BitBoard> piece : rookMoves) {
-        BitBoard::Iterator newSq = piece.second.begin();
-        for (; newSq != piece.second.end(); ++newSq)
-            generateMove(Rook, piece.first, *newSq, parent);
-    }
+    Q_ASSERT(total <= MaximumMoves);
+    return total;
+}
 
-    for (QPair<Square, BitBoard> piece : bishopMoves) {
-        BitBoard::Iterator newSq = piece.second.begin();
-        for (; newSq != piece.second.end(); ++newSq)
-            generateMove(Bishop, piece.first, *newSq, parent);
-    }
+int Game::Position::legalMoveCount() const
+{
+    PieceMoves pieceMoves[MaximumPieceMoves];
+    int count = 0;
+    const bool canCastle = legalPieceMoves(pieceMoves, &count);
 
-    for (QPair<Square, BitBoard> piece : knightMoves) {
-        BitBoard::Iterator newSq = piece.second.begin();
-        for (; newSq != piece.second.end(); ++newSq)
-            generateMove(Knight, piece.first, *newSq, parent);
+    const Chess::Army army = activeArmy();
+    const BitBoard lastRank(army == White ? 0xFF00000000000000ull : 0x00000000000000FFull);
+    int total = 0;
+    for (int i = 0; i < count; ++i) {
+        const PieceMoves &piece = pieceMoves[i];
+        total += piece.moves.count();
+        if (piece.piece == Pawn)
+            total += 3 * BitBoard(piece.moves & lastRank).count(); // the other three promotions
     }
 
-    for (QPair<Square, BitBoard> piece : pawnMoves) {
-        BitBoard::Iterator newSq = piece.second.begin();
-        for (; newSq != piece.second.end(); ++newSq) {
-            bool forwardTwo = qAbs((*newSq).rank() - (piece.first).rank()) > 1;
-            Square forwardOne = Square((*newSq).file(), army == White ? (*newSq).rank() - 1 : (*newSq).rank() + 1);
-            if (forwardTwo && BitBoard(friends | enemies).testBit(forwardOne.data()))
-                continue; // can't move through another piece
-            generateMove(Pawn, piece.first, *newSq, parent);
+    if (canCastle) {
+        for (Chess::Castle side : { KingSide, QueenSide }) {
+            if (isCastleLegal(army, side) && isLegalCastle(castleMove(army, side)))
+                ++total;
         }
     }
+    return total;
+}
 
-    for (QPair<Square, BitBoard> piece : pawnAttacks) {
-        BitBoard::Iterator newSq = piece.second.begin();
-        for (; newSq != piece.second.end(); ++newSq)
-            generateMove(Pawn, piece.first, *newSq, parent);
-    }
-
-    // Add castle moves
-    if (isCastleLegal(army, KingSide))
-        generateCastle(army, KingSide, parent);
-    if (isCastleLegal(army, QueenSide))
-        generateCastle(army, QueenSide, parent);
+void Game::Position::legalMoves(Node *parent) const
+{
+    Q_ASSERT(parent);
+    Move moves[MaximumMoves];
+    const int count = legalMoves(moves);
+    parent->reservePotentials(count);
+    for (int i = 0; i < count; ++i)
+        parent->appendPotential(moves[i]);
 }
 
-void Game::Position::generateCastle(Chess::Army army, Chess::Castle castleSide, Node *parent) const
+Move Game::Position::castleMove(Chess::Army army, Chess::Castle castleSide) const
 {
     Move mv;
     mv.setPiece(King);
@@ -845,34 +922,16 @@ void Game::Position::generateCastle(Chess::Army army, Chess::Castle castleSide,
 
     mv.setCastle(true);
     mv.setCastleSide(castleSide);
-    Q_ASSERT(parent);
-    parent->generatePotential(mv);
+    return mv;
 }
 
-void Game::Position::generateMove(Chess::PieceType piece, const Square &start, const Square &end, Node *parent) const
+bool Game::Position::isLegalCastle(const Move &castle) const
 {
-    const Chess::Army army = activeArmy();
-    const bool isPromotion = piece == Pawn && (army == White ? end.rank() == 7 : end.rank() == 0);
-    const bool isCapture = board(army == White ? Black : White).isSquareOccupied(end);
-
-    Move mv;
-    mv.setPiece(piece);
-    mv.setStart(start);
-    mv.setEnd(end);
-    mv.setCapture(isCapture);
-    Q_ASSERT(parent);
-    if (!isPromotion) {
-        parent->generatePotential(mv);
-    } else {
-        mv.setPromotion(Queen);
-        parent->generatePotential(mv);
-        mv.setPromotion(Knight);
-        parent->generatePotential(mv);
-        mv.setPromotion(Rook);
-        parent->generatePotential(mv);
-        mv.setPromotion(Bishop);
-        parent->generatePotential(mv);
-    }
+    Position p = *this; // copy
+    Move mv = castle;
+    if (!p.makeMove(&mv))
+        return false;
+    return !p.isChecked(activeArmy());
 }
 
 bool Game::Position::isChecked(Chess::Army army) const
@@ -1008,29 +1067,22 @@ bool Game::Position::isSamePosition(const Position &other) const
 {
     // FIXME: For purposes of 3-fold it does not matter if the queens rook and kings rook have
     // swapped places, but it does matter for purposes of hash
-    return m_activeArmy == other.m_activeArmy
+    return m_positionHash == other.m_positionHash
+        && m_activeArmy == other.m_activeArmy
         && m_fileOfKingsRook == other.m_fileOfKingsRook
         && m_fileOfQueensRook == other.m_fileOfQueensRook
         && m_enPassantTarget == other.m_enPassantTarget
         && m_whitePositionBoard == other.m_whitePositionBoard
         && m_blackPositionBoard == other.m_blackPositionBoard
-        && m_kingsBoard == other.m_kingsBoard
-        && m_queensBoard == other.m_queensBoard
-        && m_rooksBoard == other.m_rooksBoard
-        && m_bishopsBoard == other.m_bishopsBoard
-        && m_knightsBoard == other.m_knightsBoard
-        && m_pawnsBoard == other.m_pawnsBoard
+        && m_pieceTypeBoards[0] == other.m_pieceTypeBoards[0]
+        && m_pieceTypeBoards[1] == other.m_pieceTypeBoards[1]
+        && m_pieceTypeBoards[2] == other.m_pieceTypeBoards[2]
         && m_hasWhiteKingCastle == other.m_hasWhiteKingCastle
         && m_hasBlackKingCastle == other.m_hasBlackKingCastle
         && m_hasWhiteQueenCastle == other.m_hasWhiteQueenCastle
         && m_hasBlackQueenCastle == other.m_hasBlackQueenCastle;
 }
 
-quint64 Game::Position::positionHash() const
-{
-    return Zobrist::globalInstance()->hash(*this);
-}
-
 int Game::Position::materialScore(Chess::Army army) const
 {
     int score = 0;
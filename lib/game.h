@@ -40,19 +40,15 @@ public:
             m_hasBlackKingCastle(false),
             m_hasWhiteQueenCastle(false),
             m_hasBlackQueenCastle(false),
-            m_activeArmy(Chess::White)
+            m_activeArmy(Chess::White),
+            m_positionHash(0)
         {
         }
 
         inline Position(const Position& other)
             : m_whitePositionBoard(other.m_whitePositionBoard),
               m_blackPositionBoard(other.m_blackPositionBoard),
-              m_kingsBoard(other.m_kingsBoard),
-              m_queensBoard(other.m_queensBoard),
-              m_rooksBoard(other.m_rooksBoard),
-              m_bishopsBoard(other.m_bishopsBoard),
-              m_knightsBoard(other.m_knightsBoard),
-              m_pawnsBoard(other.m_pawnsBoard),
+              m_pieceTypeBoards { other.m_pieceTypeBoards[0], other.m_pieceTypeBoards[1], other.m_pieceTypeBoards[2] },
               m_fileOfKingsRook(other.m_fileOfKingsRook),
               m_fileOfQueensRook(other.m_fileOfQueensRook),
               m_enPassantTarget(other.m_enPassantTarget),
@@ -60,7 +56,8 @@ public:
               m_hasBlackKingCastle(other.m_hasBlackKingCastle),
               m_hasWhiteQueenCastle(other.m_hasWhiteQueenCastle),
               m_hasBlackQueenCastle(other.m_hasBlackQueenCastle),
-              m_activeArmy(other.m_activeArmy)
+              m_activeArmy(other.m_activeArmy),
+              m_positionHash(other.m_positionHash)
         {
         }
 
@@ -94,9 +91,11 @@ public:
         BitBoard pawnAttackBoard(Chess::Army army, const Movegen *gen,
             const BitBoard &friends) const;
 
-        void pseudoLegalMoves(Node *parent) const;
-        void generateCastle(Chess::Army army, Chess::Castle castleSide, Node *parent) const;
-        void generateMove(Chess::PieceType piece, const Square &start, const Square &end, Node *parent) const;
+        // Writes out every legal move and returns how many, never more than MaximumMoves
+        enum { MaximumMoves = 256 };
+        int legalMoves(Move *moves) const;
+        int legalMoveCount() const; // without writing them out
+        void legalMoves(Node *parent) const;
 
         bool isCastleLegal(Chess::Army army, Chess::Castle castle) const;
         bool isCastleAvailable(Chess::Army army, Chess::Castle castle) const;
@@ -105,7 +104,8 @@ public:
         bool operator==(const Position &other) const { return isSamePosition(other); }
         bool operator!=(const Position &other) const { return !isSamePosition(other); }
 
-        quint64 positionHash() const;
+        // Kept up to date by every change to the position
+        quint64 positionHash() const { return m_positionHash; }
 
         int materialScore(Chess::Army army) const;
         bool isDeadPosition() const;
@@ -121,17 +121,24 @@ public:
         bool fillOutStart(Chess::Army army, Move *move) const;
 
         void togglePieceAt(int index, Chess::Army army, Chess::PieceType piece, bool bit);
-        BitBoard *boardPointer(Chess::PieceType piece);
+
+        // The destinations of each piece, at most sixteen pieces with pawns taking a second
+        // entry for their captures
+        struct PieceMoves {
+            Chess::PieceType piece;
+            Square start;
+            BitBoard moves;
+        };
+        enum { MaximumPieceMoves = 32 };
+        bool legalPieceMoves(PieceMoves *pieceMoves, int *count) const; // false when in check
+        Move castleMove(Chess::Army army, Chess::Castle castleSide) const;
+        bool isLegalCastle(const Move &castle) const;
 
     private:
         BitBoard m_whitePositionBoard;
         BitBoard m_blackPositionBoard;
-        BitBoard m_kingsBoard;
-        BitBoard m_queensBoard;
-        BitBoard m_rooksBoard;
-        BitBoard m_bishopsBoard;
-        BitBoard m_knightsBoard;
-        BitBoard m_pawnsBoard;
+        // Each occupied square holds the bits of its Chess::PieceType across these
+        BitBoard m_pieceTypeBoards[3];
         quint8 m_fileOfKingsRook;
         quint8 m_fileOfQueensRook;
         Square m_enPassantTarget;
@@ -140,6 +147,7 @@ public:
         bool m_hasWhiteQueenCastle : 1;
         bool m_hasBlackQueenCastle : 1;
         Chess::Army m_activeArmy;
+        quint64 m_positionHash;
         friend class Game;
         friend class StandaloneGame;
         friend class TB;
@@ -198,13 +206,17 @@ protected:
 
 inline BitBoard Game::Position::board(Chess::PieceType piece) const
 {
+    // Empty squares have no bits set so no piece type matches them
+    const quint64 b0 = m_pieceTypeBoards[0].data();
+    const quint64 b1 = m_pieceTypeBoards[1].data();
+    const quint64 b2 = m_pieceTypeBoards[2].data();
     switch (piece) {
-        case Chess::King: return m_kingsBoard;
-        case Chess::Queen: return m_queensBoard;
-        case Chess::Rook: return m_rooksBoard;
-        case Chess::Bishop: return m_bishopsBoard;
-        case Chess::Knight: return m_knightsBoard;
-        case Chess::Pawn: return m_pawnsBoard;
+        case Chess::King: return BitBoard(b0 & ~b1 & ~b2);
+        case Chess::Queen: return BitBoard(~b0 & b1 & ~b2);
+        case Chess::Rook: return BitBoard(b0 & b1 & ~b2);
+        case Chess::Bishop: return BitBoard(~b0 & ~b1 & b2);
+        case Chess::Knight: return BitBoard(b0 & ~b1 & b2);
+        case Chess::Pawn: return BitBoard(~b0 & b1 & b2);
         case Chess::Unknown:
             Q_UNREACHABLE();
     };
@@ -239,34 +251,6 @@ inline bool Game::Position::isCastleAvailable(Chess::Army army, Chess::Castle ca
     return true;
 }
 
-inline void Game::Position::togglePieceAt(int index, Chess::Army army, Chess::PieceType piece, bool bit)
-{
-    boardPointer(piece)->setBit(index, bit);
-    switch (army) {
-    case Chess::White:
-        m_whitePositionBoard.setBit(index, bit);
-        break;
-    case Chess::Black:
-        m_blackPositionBoard.setBit(index, bit);
-        break;
-    }
-}
-
-inline BitBoard *Game::Position::boardPointer(Chess::PieceType piece)
-{
-    switch (piece) {
-        case Chess::King: return &m_kingsBoard;
-        case Chess::Queen: return &m_queensBoard;
-        case Chess::Rook: return &m_rooksBoard;
-        case Chess::Bishop: return &m_bishopsBoard;
-        case Chess::Knight: return &m_knightsBoard;
-        case Chess::Pawn: return &m_pawnsBoard;
-        case Chess::Unknown:
-            Q_UNREACHABLE();
-    };
-    return nullptr;
-}
-
 class StandaloneGame : public Game {
 public:
     inline StandaloneGame()
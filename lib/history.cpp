@@ -22,28 +22,54 @@
 
 class MyHistory : public History { };
 Q_GLOBAL_STATIC(MyHistory, HistoryInstance)
+static thread_local History *s_threadInstance = nullptr;
+
 History* History::globalInstance()
 {
-    return HistoryInstance();
+    return s_threadInstance ? s_threadInstance : HistoryInstance();
+}
+
+void History::setThreadInstance(History *history)
+{
+    s_threadInstance = history;
 }
 
 void History::addGame(const StandaloneGame &game)
 {
-    qint8 r = 0;
-    const QVector<StandaloneGame> previous = m_history;
-    QVector<StandaloneGame>::const_reverse_iterator it = previous.crbegin();
-    for (; it != previous.crend(); ++it) {
-        if (game.position().isSamePosition((*it).position()))
-            ++r;
+    StandaloneGame g = game;
+    g.setRepetitions(repetitions(game.position(), m_history.count() - 1));
 
-        if (r >= 2)
-            break; // No sense in counting further
+    const int index = m_history.count();
+    m_history.append(g);
+    m_positions[g.position().positionHash()].append(index);
+    if (!g.halfMoveClock())
+        m_resets.append(index);
+}
 
-        if (!(*it).halfMoveClock())
+int History::repetitions(const Game::Position &position, int index, int found) const
+{
+    if (found >= 2 || index < 0)
+        return found;
+
+    // The scan stops after the most recent game at or below index without a half move clock
+    int reset = 0;
+    for (int i = m_resets.count() - 1; i >= 0; --i) {
+        if (m_resets.at(i) <= index) {
+            reset = m_resets.at(i);
             break;
+        }
     }
 
-    StandaloneGame g = game;
-    g.setRepetitions(r);
-    m_history.append(g);
+    // Only the games sharing the hash need a full compare
+    const QVector<int> indices = m_positions.value(position.positionHash());
+    for (int i = indices.count() - 1; i >= 0 && found < 2; --i) {
+        const int j = indices.at(i);
+        if (j > index)
+            continue;
+        if (j < reset)
+            break;
+        if (position.isSamePosition(m_history.at(j).position()))
+            ++found;
+    }
+    return found;
 }
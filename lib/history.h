@@ -22,15 +22,26 @@
 #define HISTORY_H
 
 #include <QtGlobal>
+#include <QHash>
 
 #include "game.h"
 #include "node.h"
 
 class History {
 public:
+    History()
+    {
+    }
+
+    ~History() {}
+
+    // The history bound to the calling thread, which is the process wide one unless a session of
+    // the server bound its own
     static History *globalInstance();
+    static void setThreadInstance(History *history); // null goes back to the process wide one
 
     QVector<StandaloneGame> games() const { return m_history; }
+    int count() const { return m_history.count(); }
 
     StandaloneGame currentGame() const
     {
@@ -44,13 +55,15 @@ public:
     void clear()
     {
         m_history.clear();
+        m_positions.clear();
+        m_resets.clear();
     }
 
-private:
-    History()
-    {
-    }
+    // Counts the earlier occurrences of the position at or below index in the game history,
+    // stopping at the last irreversible move and once the count reaches two
+    int repetitions(const Game::Position &position, int index, int found = 0) const;
 
+private:
     const StandaloneGame &at(int index) const
     {
         Q_ASSERT(index >= 0);
@@ -58,13 +71,9 @@ private:
         return m_history.at(index);
     }
 
-    int count() const
-    {
-        return m_history.count();
-    }
-
-    ~History() {}
     QVector<StandaloneGame> m_history;
+    QHash<quint64, QVector<int>> m_positions;  // position hash to ascending history indices
+    QVector<int> m_resets;                      // indices of games with a zero half move clock
     friend class MyHistory;
     friend class HistoryIterator;
 };
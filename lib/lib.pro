@@ -15,8 +15,8 @@ lessThan(QT_MINOR_VERSION, 9) {
 }
 
 !win32 {
-    QMAKE_CXXFLAGS += -march=native -ffast-math
-    DEFINES += USE_PEXT
+    # A portable baseline, movegen decides on PEXT at runtime
+    QMAKE_CXXFLAGS += -msse4.2 -mpopcnt -ffast-math
 }
 
 DEFINES += TB_NO_HELPER_API
@@ -25,33 +25,58 @@ include(atomic.pri)
 include(zlib.pri)
 PROTOS += $$PWD/proto/net.proto
 include(protobuf.pri)
-include(cuda.pri)
+# Builds without cuda for machines that have no gpu, configure with CONFIG+=cpuonly
+cpuonly {
+    DEFINES += NO_CUDA
+} else {
+    include(cuda.pri)
+}
 
 CONFIG(release, debug|release) {
   CONFIG += optimize_full
 }
 
 HEADERS += \
+    $$PWD/analyzeengine.h \
     $$PWD/benchmarkengine.h \
     $$PWD/bitboard.h \
     $$PWD/cache.h \
     $$PWD/chess.h \
     $$PWD/clock.h \
+    $$PWD/debuglog.h \
+    $$PWD/distributedsearch.h \
     $$PWD/game.h \
     $$PWD/history.h \
+    $$PWD/matesolver.h \
+    $$PWD/memoryreport.h \
+    $$PWD/metrics.h \
     $$PWD/move.h \
     $$PWD/movegen.h \
     $$PWD/nn.h \
+    $$PWD/nnremote.h \
+    $$PWD/nnserver.h \
     $$PWD/node.h \
     $$PWD/notation.h \
     $$PWD/options.h \
+    $$PWD/perftengine.h \
     $$PWD/piece.h \
+    $$PWD/replay.h \
+    $$PWD/rootshards.h \
     $$PWD/search.h \
     $$PWD/searchengine.h \
+    $$PWD/searchserver.h \
+    $$PWD/selectiontrace.h \
+    $$PWD/selfplayengine.h \
+    $$PWD/serverengine.h \
     $$PWD/square.h \
+    $$PWD/stagetimes.h \
     $$PWD/tree.h \
+    $$PWD/treeexport.h \
     $$PWD/tb.h \
+    $$PWD/threadaffinity.h \
+    $$PWD/trace.h \
     $$PWD/uciengine.h \
+    $$PWD/vectormath.h \
     $$PWD/zobrist.h \
     $$PWD/neural/allie_common.h \
     $$PWD/neural/allie_shim.h \
@@ -60,49 +85,73 @@ HEADERS += \
     $$PWD/neural/network_legacy.h \
     $$PWD/neural/nn_policy.h \
     $$PWD/neural/weights_adapter.h \
-    $$PWD/neural/cuda/cuda_common.h \
-    $$PWD/neural/cuda/kernels.h \
-    $$PWD/neural/cuda/layers.h \
+    $$PWD/neural/shared/activation.h \
     $$PWD/neural/shared/policy_map.h \
+    $$PWD/neural/shared/winograd_filter.h \
     $$PWD/fathom/tbconfig.h \
     $$PWD/fathom/tbcore.h \
     $$PWD/fathom/tbprobe.h
 
 SOURCES += \
+    $$PWD/analyzeengine.cpp \
     $$PWD/benchmarkengine.cpp \
     $$PWD/bitboard.cpp \
     $$PWD/cache.cpp \
     $$PWD/clock.cpp \
+    $$PWD/debuglog.cpp \
+    $$PWD/distributedsearch.cpp \
     $$PWD/game.cpp \
     $$PWD/history.cpp \
+    $$PWD/matesolver.cpp \
+    $$PWD/memoryreport.cpp \
+    $$PWD/metrics.cpp \
     $$PWD/move.cpp \
     $$PWD/movegen.cpp \
     $$PWD/nn.cpp \
+    $$PWD/nnremote.cpp \
+    $$PWD/nnserver.cpp \
     $$PWD/node.cpp \
     $$PWD/notation.cpp \
     $$PWD/options.cpp \
+    $$PWD/perftengine.cpp \
     $$PWD/piece.cpp \
+    $$PWD/replay.cpp \
+    $$PWD/rootshards.cpp \
     $$PWD/search.cpp \
     $$PWD/searchengine.cpp \
+    $$PWD/searchserver.cpp \
+    $$PWD/selectiontrace.cpp \
+    $$PWD/selfplayengine.cpp \
+    $$PWD/serverengine.cpp \
     $$PWD/square.cpp \
+    $$PWD/stagetimes.cpp \
     $$PWD/tb.cpp \
+    $$PWD/threadaffinity.cpp \
     $$PWD/tree.cpp \
+    $$PWD/treeexport.cpp \
     $$PWD/uciengine.cpp \
+    $$PWD/vectormath.cpp \
     $$PWD/zobrist.cpp \
     $$PWD/neural/network_legacy.cpp \
     $$PWD/neural/loader.cpp \
     $$PWD/neural/nn_policy.cpp \
     $$PWD/neural/weights_adapter.cpp \
-    $$PWD/neural/cuda/layers.cpp \
-    $$PWD/neural/cuda/nn_cuda.cpp \
+    $$PWD/neural/cpu/nn_cpu.cpp \
+    $$PWD/neural/synthetic/nn_synthetic.cpp \
+    $$PWD/neural/shared/activation.cpp \
+    $$PWD/neural/shared/winograd_filter.cpp \
     $$PWD/fathom/tbprobe.c
 
-!win32 {
+!cpuonly {
 HEADERS += \
-    $$PWD/neural/shared/activation.h \
-    $$PWD/neural/shared/winograd_filter.h \
+    $$PWD/neural/cuda/cuda_common.h \
+    $$PWD/neural/cuda/kernels.h \
+    $$PWD/neural/cuda/layers.h \
 
 SOURCES += \
-    $$PWD/neural/shared/activation.cpp \
-    $$PWD/neural/shared/winograd_filter.cpp \
+    $$PWD/neural/cuda/layers.cpp \
+    $$PWD/neural/cuda/nn_cuda.cpp \
+
+# The TensorRT backend, configure with CONFIG+=tensorrt
+tensorrt: SOURCES += $$PWD/neural/tensorrt/nn_tensorrt.cpp
 }
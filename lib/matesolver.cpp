@@ -0,0 +1,102 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "matesolver.h"
+
+namespace {
+
+// Every line is only ever proven, so one cut short by the budget is left unproven and the result
+// is Unknown rather than wrong
+struct Solver {
+    int budget;
+
+    bool mates(const Game &game, const Game::Position &position, int moves);
+    bool isMated(const Game &game, const Game::Position &position, int moves);
+};
+
+bool Solver::mates(const Game &game, const Game::Position &position, int moves)
+{
+    Move list[Game::Position::MaximumMoves];
+    const int count = position.legalMoves(list);
+    for (int i = 0; i < count; ++i) {
+        if (--budget < 0)
+            return false;
+
+        Game childGame = game;
+        Game::Position child = position; // copy
+        const bool success = childGame.makeMove(list[i], &child);
+        Q_ASSERT(success);
+        Q_UNUSED(success);
+        if (!child.isChecked(child.activeArmy()))
+            continue;
+
+        if (!child.legalMoveCount())
+            return true;
+
+        if (moves > 1 && childGame.halfMoveClock() < 100 && isMated(childGame, child, moves - 1))
+            return true;
+    }
+    return false;
+}
+
+bool Solver::isMated(const Game &game, const Game::Position &position, int moves)
+{
+    Move list[Game::Position::MaximumMoves];
+    const int count = position.legalMoves(list);
+    if (!count)
+        return position.isChecked(position.activeArmy());
+
+    for (int i = 0; i < count; ++i) {
+        if (--budget < 0)
+            return false;
+
+        Game childGame = game;
+        Game::Position child = position; // copy
+        const bool success = childGame.makeMove(list[i], &child);
+        Q_ASSERT(success);
+        Q_UNUSED(success);
+        if (childGame.halfMoveClock() >= 100 || !mates(childGame, child, moves))
+            return false;
+    }
+    return true;
+}
+
+} // namespace
+
+MateSolver::Result MateSolver::solve(const Game &game, const Game::Position &position, int moves,
+    int budget)
+{
+    if (moves <= 0)
+        return Unknown;
+
+    // The side in check is the one more likely to be mated
+    Solver solver = { budget };
+    if (position.isChecked(position.activeArmy())) {
+        if (solver.isMated(game, position, moves))
+            return IsMated;
+        solver.budget = budget;
+        return solver.mates(game, position, moves) ? Mates : Unknown;
+    }
+
+    if (solver.mates(game, position, moves))
+        return Mates;
+    solver.budget = budget;
+    return solver.isMated(game, position, moves) ? IsMated : Unknown;
+}
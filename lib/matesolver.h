@@ -0,0 +1,41 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef MATESOLVER_H
+#define MATESOLVER_H
+
+#include "game.h"
+
+// Proves short forced mates at the leaves of the search so that forcing lines are scored exactly
+// rather than evaluated by the network node by node. The side looking for the mate only tries its
+// checks while the other side tries every reply, which keeps the search small enough to run on
+// every leaf in check or with few replies. Stalemates and the fifty move rule refute a line.
+namespace MateSolver {
+    enum Result {
+        Unknown,
+        Mates,      // the side to move mates
+        IsMated     // the side to move is mated whatever it plays
+    };
+
+    // Within this many moves of the mating side, giving up after visiting about budget positions
+    Result solve(const Game &game, const Game::Position &position, int moves, int budget = 4096);
+}
+
+#endif // MATESOLVER_H
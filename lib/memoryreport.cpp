@@ -0,0 +1,183 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "memoryreport.h"
+
+#include <QFile>
+#include <QTextStream>
+
+#include "cache.h"
+#include "nn.h"
+#include "tb.h"
+
+#if defined(Q_OS_UNIX)
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+static double megabytes(quint64 bytes)
+{
+    return bytes / (1024.0 * 1024.0);
+}
+
+MemoryReport MemoryReport::current()
+{
+    MemoryReport report;
+    const Cache *cache = Cache::globalInstance();
+    report.m_usage[NodeArena] = cache->nodeMemory();
+    report.m_usage[PositionCache] = cache->positionMemory();
+    report.m_usage[Potentials] = cache->potentialMemory();
+    report.m_usage[NNCache] = NeuralNet::globalInstance()->cache()->memoryUsage();
+    NeuralNet::globalInstance()->memoryUsage(&report.m_usage[NNHost], &report.m_usage[NNDevice]);
+    report.m_usage[TBCache] = TB::globalInstance()->cacheMemory();
+    report.m_resident = currentResident();
+    report.m_peakResident = peakResident();
+    return report;
+}
+
+MemoryUsage MemoryReport::total() const
+{
+    MemoryUsage usage;
+    for (int i = 0; i < Components; ++i) {
+        if (i != NNDevice)
+            usage += m_usage[i];
+    }
+    return usage;
+}
+
+quint64 MemoryReport::currentResident()
+{
+#if defined(Q_OS_LINUX)
+    // The second field is the number of resident pages
+    QFile file(QLatin1String("/proc/self/statm"));
+    if (!file.open(QIODevice::ReadOnly))
+        return 0;
+    const QList<QByteArray> fields = file.readAll().split(' ');
+    if (fields.count() < 2)
+        return 0;
+    return fields.at(1).toULongLong() * quint64(sysconf(_SC_PAGESIZE));
+#else
+    return 0;
+#endif
+}
+
+quint64 MemoryReport::peakResident()
+{
+#if defined(Q_OS_LINUX)
+    // The high water mark in the status is the one that can be reset
+    QFile file(QLatin1String("/proc/self/status"));
+    if (file.open(QIODevice::ReadOnly)) {
+        const QList<QByteArray> lines = file.readAll().split('\n');
+        for (const QByteArray &line : lines) {
+            if (line.startsWith("VmHWM:"))
+                return line.mid(6).trimmed().split(' ').first().toULongLong() * 1024;
+        }
+    }
+#endif
+#if defined(Q_OS_UNIX)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+#if defined(Q_OS_MACOS)
+    return quint64(usage.ru_maxrss);
+#else
+    return quint64(usage.ru_maxrss) * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+bool MemoryReport::resetPeakResident()
+{
+#if defined(Q_OS_LINUX)
+    QFile file(QLatin1String("/proc/self/clear_refs"));
+    return file.open(QIODevice::WriteOnly) && file.write("5") == 1;
+#else
+    return false;
+#endif
+}
+
+QString MemoryReport::componentName(Component component)
+{
+    switch (component) {
+    case NodeArena: return QLatin1String("nodes");
+    case PositionCache: return QLatin1String("positions");
+    case Potentials: return QLatin1String("potentials");
+    case NNCache: return QLatin1String("nncache");
+    case NNHost: return QLatin1String("nnhost");
+    case NNDevice: return QLatin1String("nndevice");
+    case TBCache: return QLatin1String("tbcache");
+    case Components: break;
+    }
+    Q_UNREACHABLE();
+    return QString();
+}
+
+QString MemoryReport::toString(Component component) const
+{
+    const MemoryUsage &usage = m_usage[component];
+    QString out;
+    QTextStream stream(&out);
+    stream.setRealNumberNotation(QTextStream::FixedNotation);
+    stream.setRealNumberPrecision(1);
+    stream << componentName(component)
+           << " reserved " << megabytes(usage.reserved) << "MB"
+           << " used " << megabytes(usage.used) << "MB"
+           << " peak " << megabytes(usage.peak) << "MB";
+    stream.flush();
+    return out;
+}
+
+QString MemoryReport::toString() const
+{
+    const MemoryUsage sum = total();
+    QString out;
+    QTextStream stream(&out);
+    stream.setRealNumberNotation(QTextStream::FixedNotation);
+    stream.setRealNumberPrecision(1);
+    stream << "total reserved " << megabytes(sum.reserved) << "MB"
+           << " used " << megabytes(sum.used) << "MB"
+           << " peak " << megabytes(sum.peak) << "MB"
+           << " resident " << megabytes(m_resident) << "MB"
+           << " peak resident " << megabytes(m_peakResident) << "MB";
+    for (int i = 0; i < Components; ++i)
+        stream << "\n" << toString(Component(i));
+    stream.flush();
+    return out;
+}
+
+QString MemoryReport::toJson() const
+{
+    QString out;
+    QTextStream stream(&out);
+    stream << "{\"resident\":" << m_resident
+           << ",\"peakResident\":" << m_peakResident;
+    for (int i = 0; i < Components; ++i) {
+        const MemoryUsage &usage = m_usage[i];
+        stream << ",\"" << componentName(Component(i)) << "\":{"
+               << "\"reserved\":" << usage.reserved
+               << ",\"used\":" << usage.used
+               << ",\"peak\":" << usage.peak << "}";
+    }
+    stream << "}";
+    stream.flush();
+    return out;
+}
@@ -0,0 +1,82 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef MEMORYREPORT_H
+#define MEMORYREPORT_H
+
+#include <QString>
+#include <QtGlobal>
+
+// Bytes held by one component of the engine. Tables that are filled once they are allocated count
+// all of their memory as used and as the peak.
+struct MemoryUsage {
+    quint64 reserved = 0; // taken from the system
+    quint64 used = 0; // of those handed out right now
+    quint64 peak = 0; // most ever handed out since the last reset
+
+    MemoryUsage &operator+=(const MemoryUsage &other)
+    {
+        reserved += other.reserved;
+        used += other.used;
+        peak += other.peak;
+        return *this;
+    }
+};
+
+// A snapshot of where the memory of the engine goes, read without stopping the search so the
+// numbers of a running search are only approximate
+class MemoryReport {
+public:
+    enum Component {
+        NodeArena, // the nodes along with their intrusive lists of children
+        PositionCache,
+        Potentials,
+        NNCache,
+        NNHost, // buffers of the backends in host memory
+        NNDevice, // buffers of the backends in device memory, not counting the weights
+        TBCache,
+        Components
+    };
+
+    static MemoryReport current();
+
+    MemoryUsage usage(Component component) const { return m_usage[component]; }
+    MemoryUsage total() const; // of the components in host memory
+    quint64 residentBytes() const { return m_resident; }
+    quint64 peakResidentBytes() const { return m_peakResident; }
+
+    // The memory of the whole process in bytes or zero where that is not known
+    static quint64 currentResident();
+    static quint64 peakResident();
+    // So that the peak is that of what runs next, false where the system keeps it for good
+    static bool resetPeakResident();
+
+    static QString componentName(Component component);
+    QString toString(Component component) const; // "name reserved used peak" in megabytes
+    QString toString() const; // the total and the process followed by every component
+    QString toJson() const;
+
+private:
+    MemoryUsage m_usage[Components];
+    quint64 m_resident = 0;
+    quint64 m_peakResident = 0;
+};
+
+#endif // MEMORYREPORT_H
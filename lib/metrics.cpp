@@ -0,0 +1,317 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "metrics.h"
+
+#include <QGlobalStatic>
+#include <QTextStream>
+
+#include "cache.h"
+#include "nn.h"
+#include "nnremote.h"
+#include "search.h"
+#include "searchengine.h"
+#include "stagetimes.h"
+#include "tb.h"
+
+// The longest a scraper may take to send its request
+static const int s_receiveTimeoutMsecs = 2000;
+
+Q_GLOBAL_STATIC(Metrics, s_metrics)
+Metrics *Metrics::globalInstance()
+{
+    return s_metrics();
+}
+
+Metrics::Metrics()
+    : m_nps(0),
+    m_rawnps(0),
+    m_nnnps(0),
+    m_refinednnnps(0),
+    m_batchSize(0),
+    m_nodes(0),
+    m_tbHits(0),
+    m_stop(false),
+    m_batchPositions(0),
+    m_searchStart(-1),
+    m_firstBatchNsecs(-1),
+    m_listener(-1)
+{
+    for (int i = 0; i <= BatchBuckets; ++i)
+        m_batchSizes[i] = 0;
+    m_clock.start();
+}
+
+Metrics::~Metrics()
+{
+    if (m_server.joinable()) {
+        m_stop.store(true, std::memory_order_relaxed);
+        NNRemote::shutdownSocket(m_listener);
+        m_server.join();
+    }
+    NNRemote::closeSocket(m_listener);
+}
+
+bool Metrics::listen(quint16 port)
+{
+    if (m_listener != -1)
+        return true;
+
+    m_listener = NNRemote::listenOn(QString() /*every address*/, port);
+    if (m_listener == -1)
+        return false;
+
+    m_server = std::thread([this]() { serve(); });
+    return true;
+}
+
+void Metrics::serve()
+{
+    while (!m_stop.load(std::memory_order_relaxed)) {
+        const int socket = NNRemote::acceptOn(m_listener);
+        if (socket == -1)
+            continue;
+
+        // A scraper that stalls is dropped rather than holding up the ones after it
+        NNRemote::setReceiveTimeout(socket, s_receiveTimeoutMsecs);
+
+        // Only the request line matters but the headers are read so the client sees a clean close
+        QByteArray buffer;
+        QByteArray request;
+        QByteArray line;
+        bool ok = NNRemote::receiveLine(socket, &buffer, &request);
+        while (ok && NNRemote::receiveLine(socket, &buffer, &line) && !line.isEmpty()) {}
+
+        const bool found = ok && (request.startsWith("GET /metrics ") || request.startsWith("GET / "));
+        const QByteArray body = found ? toString().toUtf8() : QByteArray("not found\n");
+        const QByteArray reply = QByteArray(found ? "HTTP/1.0 200 OK\r\n" : "HTTP/1.0 404 Not Found\r\n")
+            + "Content-Type: text/plain; version=0.0.4\r\n"
+            + "Content-Length: " + QByteArray::number(body.size()) + "\r\n"
+            + "Connection: close\r\n\r\n" + body;
+        NNRemote::send(socket, reply.constData(), size_t(reply.size()));
+        NNRemote::closeSocket(socket);
+    }
+}
+
+void Metrics::setSearchInfo(const SearchInfo &info)
+{
+    m_nps.store(info.nps, std::memory_order_relaxed);
+    m_rawnps.store(info.rawnps, std::memory_order_relaxed);
+    m_nnnps.store(info.nnnps, std::memory_order_relaxed);
+    m_refinednnnps.store(info.refinednnnps, std::memory_order_relaxed);
+    m_batchSize.store(info.batchSize, std::memory_order_relaxed);
+    m_nodes.store(info.nodes, std::memory_order_relaxed);
+    m_tbHits.store(info.workerInfo.nodesTBHits, std::memory_order_relaxed);
+}
+
+void Metrics::beginSearch()
+{
+    QMutexLocker locker(&m_mutex);
+    m_searchStart = m_clock.nsecsElapsed();
+    m_firstBatchNsecs = -1;
+}
+
+void Metrics::beginEvaluation(int device)
+{
+    if (device < 0 || device >= Devices)
+        return;
+
+    QMutexLocker locker(&m_mutex);
+    Device &d = m_devices[device];
+    if (!d.inFlight++)
+        d.busySince = m_clock.nsecsElapsed();
+}
+
+void Metrics::endEvaluation(int device, int positions)
+{
+    if (device < 0 || device >= Devices)
+        return;
+
+    QMutexLocker locker(&m_mutex);
+    Device &d = m_devices[device];
+    Q_ASSERT(d.inFlight > 0);
+    if (!--d.inFlight)
+        d.busyNsecs += m_clock.nsecsElapsed() - d.busySince;
+    ++d.batches;
+    d.positions += quint64(positions);
+    if (m_searchStart != -1 && m_firstBatchNsecs == -1)
+        m_firstBatchNsecs = m_clock.nsecsElapsed() - m_searchStart;
+
+    int bucket = 0;
+    while (bucket < BatchBuckets && positions > (1 << bucket))
+        ++bucket;
+    ++m_batchSizes[bucket];
+    m_batchPositions += quint64(positions);
+}
+
+qint64 Metrics::busyNsecs(int device) const
+{
+    if (device < 0 || device >= Devices)
+        return 0;
+
+    QMutexLocker locker(&m_mutex);
+    const Device &d = m_devices[device];
+    return d.busyNsecs + (d.inFlight ? m_clock.nsecsElapsed() - d.busySince : 0);
+}
+
+qint64 Metrics::firstBatchNsecs() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_firstBatchNsecs;
+}
+
+void Metrics::addQueue(const GuardedBatchQueue *queue)
+{
+    QMutexLocker locker(&m_mutex);
+    m_queues.append(queue);
+}
+
+void Metrics::removeQueue(const GuardedBatchQueue *queue)
+{
+    QMutexLocker locker(&m_mutex);
+    m_queues.removeOne(queue);
+}
+
+static void header(QTextStream &stream, const char *name, const char *type, const char *help)
+{
+    stream << "# HELP " << name << " " << help << "\n";
+    stream << "# TYPE " << name << " " << type << "\n";
+}
+
+QString Metrics::toString() const
+{
+    QString string;
+    QTextStream stream(&string);
+
+    header(stream, "allie_nps", "gauge", "Nodes per second of the latest search");
+    stream << "allie_nps " << m_nps.load(std::memory_order_relaxed) << "\n";
+    header(stream, "allie_rawnps", "gauge", "Playouts per second of the latest search");
+    stream << "allie_rawnps " << m_rawnps.load(std::memory_order_relaxed) << "\n";
+    header(stream, "allie_nnnps", "gauge", "Positions evaluated by the network per second of the latest search");
+    stream << "allie_nnnps " << m_nnnps.load(std::memory_order_relaxed) << "\n";
+    header(stream, "allie_refined_nnnps", "gauge", "Positions of the small network evaluated again by the large one per second of the latest search");
+    stream << "allie_refined_nnnps " << m_refinednnnps.load(std::memory_order_relaxed) << "\n";
+    header(stream, "allie_search_batch_size", "gauge", "Average batch size of the latest search");
+    stream << "allie_search_batch_size " << m_batchSize.load(std::memory_order_relaxed) << "\n";
+    header(stream, "allie_search_nodes", "gauge", "Nodes of the latest search");
+    stream << "allie_search_nodes " << m_nodes.load(std::memory_order_relaxed) << "\n";
+    header(stream, "allie_search_tbhits", "gauge", "Tablebase hits of the latest search");
+    stream << "allie_search_tbhits " << m_tbHits.load(std::memory_order_relaxed) << "\n";
+
+    {
+        QMutexLocker locker(&m_mutex);
+        const qint64 now = m_clock.nsecsElapsed();
+
+        if (m_firstBatchNsecs != -1) {
+            header(stream, "allie_search_first_batch_seconds", "gauge", "Seconds from the start of the latest search to its first batch back from the network");
+            stream << "allie_search_first_batch_seconds " << m_firstBatchNsecs / 1e9 << "\n";
+        }
+
+        header(stream, "allie_nn_batch_positions", "histogram", "Positions in each batch sent to the network");
+        quint64 cumulative = 0;
+        for (int i = 0; i < BatchBuckets; ++i) {
+            cumulative += m_batchSizes[i];
+            stream << "allie_nn_batch_positions_bucket{le=\"" << (1 << i) << "\"} " << cumulative << "\n";
+        }
+        cumulative += m_batchSizes[BatchBuckets];
+        stream << "allie_nn_batch_positions_bucket{le=\"+Inf\"} " << cumulative << "\n";
+        stream << "allie_nn_batch_positions_sum " << m_batchPositions << "\n";
+        stream << "allie_nn_batch_positions_count " << cumulative << "\n";
+
+        // Busy time is a counter so that its rate over any window is the busy ratio of the device
+        header(stream, "allie_gpu_busy_seconds_total", "counter", "Seconds with at least one batch evaluating on the device");
+        for (int i = 0; i < Devices; ++i) {
+            const Device &d = m_devices[i];
+            if (!d.batches && !d.inFlight)
+                continue;
+            const qint64 busy = d.busyNsecs + (d.inFlight ? now - d.busySince : 0);
+            stream << "allie_gpu_busy_seconds_total{device=\"" << i << "\"} " << busy / 1e9 << "\n";
+        }
+        header(stream, "allie_gpu_batches_total", "counter", "Batches evaluated on the device");
+        for (int i = 0; i < Devices; ++i) {
+            if (m_devices[i].batches)
+                stream << "allie_gpu_batches_total{device=\"" << i << "\"} " << m_devices[i].batches << "\n";
+        }
+        header(stream, "allie_gpu_positions_total", "counter", "Positions evaluated on the device");
+        for (int i = 0; i < Devices; ++i) {
+            if (m_devices[i].batches)
+                stream << "allie_gpu_positions_total{device=\"" << i << "\"} " << m_devices[i].positions << "\n";
+        }
+
+        int in = 0;
+        int expanded = 0;
+        int out = 0;
+        for (const GuardedBatchQueue *queue : m_queues) {
+            in += queue->inDepth();
+            expanded += queue->expandedDepth();
+            out += queue->outDepth();
+        }
+        header(stream, "allie_queue_depth", "gauge", "Batches waiting in the queues between the search and the network");
+        stream << "allie_queue_depth{queue=\"in\"} " << in << "\n";
+        stream << "allie_queue_depth{queue=\"expanded\"} " << expanded << "\n";
+        stream << "allie_queue_depth{queue=\"out\"} " << out << "\n";
+    }
+
+    // Of every cache in use, where the sessions and shards each search in one of their own
+    const Cache::Totals cache = Cache::totals();
+    header(stream, "allie_cache_positions", "gauge", "Positions the caches hold");
+    stream << "allie_cache_positions " << cache.size << "\n";
+    header(stream, "allie_cache_positions_used", "gauge", "Positions in use in the caches");
+    stream << "allie_cache_positions_used " << cache.used << "\n";
+    header(stream, "allie_cache_position_hits_total", "counter", "Positions found in the caches");
+    stream << "allie_cache_position_hits_total " << cache.positionHits << "\n";
+    header(stream, "allie_cache_position_evictions_total", "counter", "Positions evicted from the caches");
+    stream << "allie_cache_position_evictions_total " << cache.positionEvictions << "\n";
+
+    NeuralNet *nn = NeuralNet::globalInstance();
+    header(stream, "allie_nncache_hits_total", "counter", "Positions found in the nn cache");
+    stream << "allie_nncache_hits_total " << nn->cache()->hits() << "\n";
+    header(stream, "allie_nncache_misses_total", "counter", "Positions not found in the nn cache");
+    stream << "allie_nncache_misses_total " << nn->cache()->misses() << "\n";
+    header(stream, "allie_nnstore_hits_total", "counter", "Positions found in the nn store");
+    stream << "allie_nnstore_hits_total " << nn->store()->hits() << "\n";
+    header(stream, "allie_nnstore_misses_total", "counter", "Positions not found in the nn store");
+    stream << "allie_nnstore_misses_total " << nn->store()->misses() << "\n";
+
+    const TB *tb = TB::globalInstance();
+    header(stream, "allie_tb_cache_hits_total", "counter", "Tablebase probes found in the probe cache");
+    stream << "allie_tb_cache_hits_total " << tb->cacheHits() << "\n";
+    header(stream, "allie_tb_cache_misses_total", "counter", "Tablebase probes not found in the probe cache");
+    stream << "allie_tb_cache_misses_total " << tb->cacheMisses() << "\n";
+
+    // Empty unless the stage timers are compiled in
+    const StageTimes *times = StageTimes::globalInstance();
+    header(stream, "allie_stage_seconds", "summary", "Wall time of each stage of the search pipeline");
+    for (int i = 0; i < StageTimes::Stages; ++i) {
+        const StageTimes::Stage stage = StageTimes::Stage(i);
+        const quint64 count = times->count(stage);
+        if (!count)
+            continue;
+        const char *name = StageTimes::stageName(stage);
+        for (double quantile : { 0.5, 0.95, 0.99 }) {
+            stream << "allie_stage_seconds{stage=\"" << name << "\",quantile=\"" << quantile << "\"} "
+                << times->percentile(stage, quantile) / 1e9 << "\n";
+        }
+        stream << "allie_stage_seconds_count{stage=\"" << name << "\"} " << count << "\n";
+    }
+
+    stream.flush();
+    return string;
+}
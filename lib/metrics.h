@@ -0,0 +1,93 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+
+#include <atomic>
+#include <thread>
+
+class GuardedBatchQueue;
+struct SearchInfo;
+
+// Counters of a long running engine served over http in the prometheus text format, so that
+// throughput can be watched without scraping the uci output. The engine records into it as it
+// goes and the rest is read from the caches, tablebases and queues when it is scraped.
+class Metrics {
+public:
+    enum { Devices = 16, BatchBuckets = 14 }; // batches of up to 8192 positions in powers of two
+
+    Metrics();
+    ~Metrics();
+
+    static Metrics *globalInstance();
+
+    bool listen(quint16 port); // serves GET /metrics on a thread of its own until destroyed
+
+    void setSearchInfo(const SearchInfo &info); // the latest of the search with its speeds
+    void beginSearch(); // starts the clock to the first batch back from the network
+    void beginEvaluation(int device);
+    void endEvaluation(int device, int positions); // of the batch begun on the device
+    qint64 busyNsecs(int device) const; // with at least one batch evaluating on the device
+    qint64 firstBatchNsecs() const; // of the latest search, or -1 before its first batch
+    void addQueue(const GuardedBatchQueue *queue);
+    void removeQueue(const GuardedBatchQueue *queue);
+
+    QString toString() const; // in the prometheus text format
+
+private:
+    void serve();
+
+    struct Device {
+        int inFlight = 0;
+        qint64 busySince = 0;
+        qint64 busyNsecs = 0; // with at least one batch evaluating
+        quint64 batches = 0;
+        quint64 positions = 0;
+    };
+
+    std::atomic<quint32> m_nps;
+    std::atomic<quint32> m_rawnps;
+    std::atomic<quint32> m_nnnps;
+    std::atomic<quint32> m_refinednnnps;
+    std::atomic<quint32> m_batchSize;
+    std::atomic<quint64> m_nodes;
+    std::atomic<quint64> m_tbHits;
+    std::atomic<bool> m_stop;
+
+    mutable QMutex m_mutex;
+    Device m_devices[Devices];
+    quint64 m_batchSizes[BatchBuckets + 1]; // the last for any larger
+    quint64 m_batchPositions;
+    qint64 m_searchStart;
+    qint64 m_firstBatchNsecs;
+    QVector<const GuardedBatchQueue*> m_queues;
+
+    QElapsedTimer m_clock;
+    int m_listener;
+    std::thread m_server;
+};
+
+#endif // METRICS_H
@@ -24,6 +24,10 @@
 #include "bitboard.h"
 #include "chess.h"
 
+#ifdef HAS_PEXT_DISPATCH
+#include <cpuid.h>
+#endif
+
 // Largely from ethereal's magic move generation courtesy of Andrew Grant
 static const quint64 RookMagics[64] = {
     0xA180022080400230ull, 0x0040100040022000ull, 0x0080088020001002ull, 0x0080080280841000ull,
@@ -112,7 +116,7 @@ static BitBoard sliderMoves(const Square &square, const BitBoard &occupied, cons
     return result;
 }
 
-static void initSliderMoves(const Square &square, Magic *table, quint64 magic, const int delta[4][2]) {
+static void initSliderMoves(const Square &square, Magic *table, quint64 magic, const int delta[4][2], bool usePext) {
 
     const quint64 edges = ((RANK_1 | RANK_8) & ~Ranks[square.rank()])
                          | ((FILE_A | FILE_H) & ~Files[square.file()]);
@@ -128,274 +132,111 @@ static void initSliderMoves(const Square &square, Magic *table, quint64 magic, c
         table[sq+1].offset = table[sq].offset + (quint64(1) << BitBoard(table[sq].mask).count());
 
     do {
-        quint64 index = sliderIndex(occupied, &table[sq]);
+        quint64 index = sliderIndex(occupied, &table[sq], usePext);
         table[sq].offset[index] = sliderMoves(square, occupied, delta).data();
         occupied = (occupied - table[sq].mask) & table[sq].mask;
     } while (occupied);
 }
 
-class MyMovegen : public Movegen { };
-Q_GLOBAL_STATIC(MyMovegen, movegenInstance)
-Movegen *Movegen::globalInstance()
+static constexpr quint64 squareBit(int file, int rank)
 {
-    return movegenInstance();
+    return file >= 0 && file < 8 && rank >= 0 && rank < 8 ? quint64(1) << (rank * 8 + file) : 0;
 }
 
-static quint64 s_rookMoves[0x19000];
-static quint64 s_bishopMoves[0x1480];
-
-Movegen::Movegen()
+static constexpr quint64 rayBits(int file, int rank, int df, int dr)
 {
-    m_rookTable[0].offset = s_rookMoves;
-    m_bishopTable[0].offset = s_bishopMoves;
-
-    const int RookDelta[4][2]   = {{-1, 0}, { 0,-1}, { 0, 1}, { 1, 0}};
-    const int BishopDelta[4][2] = {{-1,-1}, {-1, 1}, { 1,-1}, { 1, 1}};
-
-    for (int i = 0; i < 64; i++) {
-        Square sq = BitBoard::indexToSquare(i);
-        Q_ASSERT(sq.data() == i);
-        m_kingMoves[i] = raysForKing(sq);
-
-        // init move tables for sliding pieces
-        initSliderMoves(sq, m_rookTable, RookMagics[i], RookDelta);
-        initSliderMoves(sq, m_bishopTable, BishopMagics[i], BishopDelta);
-
-        m_knightMoves[i] = raysForKnight(sq);
-
-        m_pawnMoves[Chess::White][i] = raysForPawn(Chess::White, sq);
-        m_pawnAttacks[Chess::White][i] = raysForPawnAttack(Chess::White, sq);
-
-        m_pawnMoves[Chess::Black][i] = raysForPawn(Chess::Black, sq);
-        m_pawnAttacks[Chess::Black][i] = raysForPawnAttack(Chess::Black, sq);
-    }
+    quint64 ray = 0;
+    for (int f = file + df, r = rank + dr; squareBit(f, r); f += df, r += dr)
+        ray |= squareBit(f, r);
+    return ray;
 }
 
-Movegen::~Movegen()
+static constexpr LeaperTables generateLeaperTables()
 {
-}
+    LeaperTables t = {};
+    const int KingDelta[8][2]   = {{ 0, 1}, { 1, 1}, { 1, 0}, { 1,-1}, { 0,-1}, {-1,-1}, {-1, 0}, {-1, 1}};
+    const int KnightDelta[8][2] = {{ 1, 2}, { 2, 1}, { 2,-1}, { 1,-2}, {-1,-2}, {-2,-1}, {-2, 1}, {-1, 2}};
+
+    for (int sq = 0; sq < 64; ++sq) {
+        const int f = sq % 8;
+        const int r = sq / 8;
+        for (int i = 0; i < 8; ++i) {
+            t.kingMoves[sq] |= squareBit(f + KingDelta[i][0], r + KingDelta[i][1]);
+            t.knightMoves[sq] |= squareBit(f + KnightDelta[i][0], r + KnightDelta[i][1]);
+        }
 
-BitBoard Movegen::raysForKing(const Square &sq)
-{
-    BitBoard rays;
-    generateRay(North, 1, sq, &rays);
-    generateRay(NorthEast, 1, sq, &rays);
-    generateRay(East, 1, sq, &rays);
-    generateRay(SouthEast, 1, sq, &rays);
-    generateRay(South, 1, sq, &rays);
-    generateRay(SouthWest, 1, sq, &rays);
-    generateRay(West, 1, sq, &rays);
-    generateRay(NorthWest, 1, sq, &rays);
-    return rays;
+        t.pawnMoves[Chess::White][sq] = squareBit(f, r + 1) | (r == 1 ? squareBit(f, r + 2) : 0);
+        t.pawnMoves[Chess::Black][sq] = squareBit(f, r - 1) | (r == 6 ? squareBit(f, r - 2) : 0);
+        t.pawnAttacks[Chess::White][sq] = squareBit(f + 1, r + 1) | squareBit(f - 1, r + 1);
+        t.pawnAttacks[Chess::Black][sq] = squareBit(f + 1, r - 1) | squareBit(f - 1, r - 1);
+
+        // Every square along each of the eight directions is aligned with this one
+        for (int i = 0; i < 8; ++i) {
+            const int df = KingDelta[i][0];
+            const int dr = KingDelta[i][1];
+            const quint64 line = rayBits(f, r, df, dr) | rayBits(f, r, -df, -dr) | squareBit(f, r);
+            quint64 between = 0;
+            for (int bf = f + df, br = r + dr; squareBit(bf, br); bf += df, br += dr) {
+                t.between[sq][br * 8 + bf] = between;
+                t.line[sq][br * 8 + bf] = line;
+                between |= squareBit(bf, br);
+            }
+        }
+    }
+    return t;
 }
 
-BitBoard Movegen::raysForQueen(const Square &sq)
-{
-    BitBoard rays;
-    generateRay(North, 7, sq, &rays);
-    generateRay(NorthEast, 7, sq, &rays);
-    generateRay(East, 7, sq, &rays);
-    generateRay(SouthEast, 7, sq, &rays);
-    generateRay(South, 7, sq, &rays);
-    generateRay(SouthWest, 7, sq, &rays);
-    generateRay(West, 7, sq, &rays);
-    generateRay(NorthWest, 7, sq, &rays);
-    return rays;
-}
+constexpr LeaperTables Movegen::s_leapers = generateLeaperTables();
 
-BitBoard Movegen::raysForRook(const Square &sq)
+class MyMovegen : public Movegen { };
+Q_GLOBAL_STATIC(MyMovegen, movegenInstance)
+Movegen *Movegen::globalInstance()
 {
-    BitBoard rays;
-    generateRay(North, 7, sq, &rays);
-    generateRay(East, 7, sq, &rays);
-    generateRay(South, 7, sq, &rays);
-    generateRay(West, 7, sq, &rays);
-    return rays;
+    return movegenInstance();
 }
 
-BitBoard Movegen::raysForBishop(const Square &sq)
-{
-    BitBoard rays;
-    generateRay(NorthEast, 7, sq, &rays);
-    generateRay(SouthEast, 7, sq, &rays);
-    generateRay(SouthWest, 7, sq, &rays);
-    generateRay(NorthWest, 7, sq, &rays);
-    return rays;
-}
+static quint64 s_rookMoves[0x19000];
+static quint64 s_bishopMoves[0x1480];
 
-BitBoard Movegen::raysForKnight(const Square &sq)
+bool Movegen::hasFastPext()
 {
-    BitBoard rays;
-    int f = sq.file();
-    int r = sq.rank();
-
-    //2 north then 1 east
-    if (r + 2 < 8)
-        generateRay(East, 1, Square(f, r + 2), &rays);
-
-    //2 east then 1 north
-    if (f + 2 < 8)
-        generateRay(North, 1, Square(f + 2, r), &rays);
-
-    //2 east then 1 south
-    if (f + 2 < 8)
-        generateRay(South, 1, Square(f + 2, r), &rays);
-
-    //2 south then 1 east
-    if (r - 2 >= 0)
-        generateRay(East, 1, Square(f, r - 2), &rays);
-
-    //2 south then 1 west
-    if (r - 2 >= 0)
-        generateRay(West, 1, Square(f, r - 2), &rays);
-
-    //2 west then 1 south
-    if (f - 2 >= 0)
-        generateRay(South, 1, Square(f - 2, r), &rays);
-
-    //2 west then 1 north
-    if (f - 2 >= 0)
-        generateRay(North, 1, Square(f - 2, r), &rays);
-
-    //2 north then 1 west
-    if (r + 2 < 8)
-        generateRay(West, 1, Square(f, r + 2), &rays);
-
-    return rays;
+#ifdef HAS_PEXT_DISPATCH
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || !(ebx & bit_BMI2))
+        return false;
+
+    // AMD before Zen 3 implements PEXT in microcode taking hundreds of cycles
+    if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx))
+        return false;
+    const bool isAMD = ebx == 0x68747541 && edx == 0x69746e65 && ecx == 0x444d4163; // AuthenticAMD
+    if (!isAMD)
+        return true;
+
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+    const unsigned int family = ((eax >> 8) & 0xF) + ((eax >> 20) & 0xFF);
+    return family >= 0x19;
+#else
+    return false;
+#endif
 }
 
-BitBoard Movegen::raysForPawn(Chess::Army army, const Square &sq)
+Movegen::Movegen()
+    : m_usePext(hasFastPext())
 {
-    BitBoard rays;
-
-    switch (army) {
-    case Chess::White:
-        {
-            if (sq.rank() == 1) {
-                generateRay(North, 2, sq, &rays);
-            } else {
-                generateRay(North, 1, sq, &rays);
-            }
-            break;
-        }
-    case Chess::Black:
-        {
-            if (sq.rank() == 6) {
-                generateRay(South, 2, sq, &rays);
-            } else {
-                generateRay(South, 1, sq, &rays);
-            }
-            break;
-        }
-    }
+    m_rookTable[0].offset = s_rookMoves;
+    m_bishopTable[0].offset = s_bishopMoves;
 
-    return rays;
-}
+    const int RookDelta[4][2]   = {{-1, 0}, { 0,-1}, { 0, 1}, { 1, 0}};
+    const int BishopDelta[4][2] = {{-1,-1}, {-1, 1}, { 1,-1}, { 1, 1}};
 
-BitBoard Movegen::raysForPawnAttack(Chess::Army army, const Square &sq)
-{
-    BitBoard rays;
-
-    switch (army) {
-    case Chess::White:
-        {
-            generateRay(NorthEast, 1, sq, &rays);
-            generateRay(NorthWest, 1, sq, &rays);
-            break;
-        }
-    case Chess::Black:
-        {
-            generateRay(SouthEast, 1, sq, &rays);
-            generateRay(SouthWest, 1, sq, &rays);
-            break;
-        }
+    // init move tables for sliding pieces, the only ones that depend on the processor
+    for (int i = 0; i < 64; i++) {
+        Square sq = BitBoard::indexToSquare(quint8(i));
+        initSliderMoves(sq, m_rookTable, RookMagics[i], RookDelta, m_usePext);
+        initSliderMoves(sq, m_bishopTable, BishopMagics[i], BishopDelta, m_usePext);
     }
-
-    return rays;
 }
 
-void Movegen::generateRay(Direction direction, int magnitude, const Square &sq, BitBoard *rays)
+Movegen::~Movegen()
 {
-    const int initialFile = sq.file();
-    const int initialRank = sq.rank();
-    int count = 0;
-
-    switch (direction) {
-    case North:
-        {
-            int r = initialRank + 1;
-            for (; r < 8 && count != magnitude; r++, count++) {
-                Square sq(initialFile, r);
-                *rays = *rays | BitBoard(sq);
-            }
-            break;
-        }
-    case NorthEast:
-        {
-            int f = initialFile + 1;
-            int r = initialRank + 1;
-            for (; f < 8 && r < 8 && count != magnitude; f++, r++, count++) {
-                Square sq(f, r);
-                *rays = *rays | BitBoard(sq);
-            }
-            break;
-        }
-    case East:
-        {
-            int f = initialFile + 1;
-            for (; f < 8 && count != magnitude; f++, count++) {
-                Square sq(f, initialRank);
-                *rays = *rays | BitBoard(sq);
-            }
-            break;
-        }
-    case SouthEast:
-        {
-            int f = initialFile + 1;
-            int r = initialRank - 1;
-            for (; f < 8 && r >= 0 && count != magnitude; f++, r--, count++) {
-                Square sq(f, r);
-                *rays = *rays | BitBoard(sq);
-            }
-            break;
-        }
-    case South:
-        {
-            int r = initialRank - 1;
-            for (; r >= 0 && count != magnitude; r--, count++) {
-                Square sq(initialFile, r);
-                *rays = *rays | BitBoard(sq);
-            }
-            break;
-        }
-    case SouthWest:
-        {
-            int f = initialFile - 1;
-            int r = initialRank - 1;
-            for (; f >= 0 && r >= 0 && count != magnitude; f--, r--, count++) {
-                Square sq(f, r);
-                *rays = *rays | BitBoard(sq);
-            }
-            break;
-        }
-    case West:
-        {
-            int f = initialFile - 1;
-            for (; f >= 0 && count != magnitude; f--, count++) {
-                Square sq(f, initialRank);
-                *rays = *rays | BitBoard(sq);
-            }
-            break;
-        }
-    case NorthWest:
-        {
-            int f = initialFile - 1;
-            int r = initialRank + 1;
-            for (; f >= 0 && r < 8 && count != magnitude; f--, r++, count++) {
-                Square sq(f, r);
-                *rays = *rays | BitBoard(sq);
-            }
-            break;
-        }
-    }
 }
@@ -26,8 +26,10 @@
 #include "bitboard.h"
 #include "chess.h"
 
-#ifdef USE_PEXT
-#include <immintrin.h>
+// PEXT is used when the processor has a fast one, which is decided at runtime so that one
+// binary serves both kinds of hardware
+#if defined(Q_PROCESSOR_X86_64) && (defined(Q_CC_GNU) || defined(Q_CC_CLANG))
+#define HAS_PEXT_DISPATCH
 #endif
 
 struct Magic {
@@ -37,96 +39,110 @@ struct Magic {
     quint64 *offset = nullptr;
 };
 
+// The attacks of the pieces that do not slide and the alignments between squares, which the
+// compiler works out so they live in read only data
+struct LeaperTables {
+    quint64 kingMoves[64];
+    quint64 knightMoves[64];
+    quint64 pawnMoves[2][64];
+    quint64 pawnAttacks[2][64];
+    quint64 between[64][64];
+    quint64 line[64][64];
+};
+
 class Movegen {
 public:
     static Movegen *globalInstance();
 
-    inline BitBoard kingMoves(const Square &sq, const BitBoard &friends) const;
-    inline BitBoard kingAttacks(const Square &sq) const;
+    static inline BitBoard kingMoves(const Square &sq, const BitBoard &friends);
+    static inline BitBoard kingAttacks(const Square &sq);
     inline BitBoard queenMoves(const Square &sq, const BitBoard &friends, const BitBoard &enemies) const;
     inline BitBoard rookMoves(const Square &sq, const BitBoard &friends, const BitBoard &enemies) const;
     inline BitBoard rookAttacks(const Square &sq, const BitBoard &occupied) const;
     inline BitBoard bishopMoves(const Square &sq, const BitBoard &friends, const BitBoard &enemies) const;
     inline BitBoard bishopAttacks(const Square &sq, const BitBoard &occupied) const;
-    inline BitBoard knightMoves(const Square &sq, const BitBoard &friends) const;
-    inline BitBoard knightAttacks(const Square &sq) const;
-    inline BitBoard pawnMoves(Chess::Army army, const Square &sq, const BitBoard &friends, const BitBoard &enemies) const;
-    inline BitBoard pawnAttacks(Chess::Army army, const Square &sq) const;
+    static inline BitBoard knightMoves(const Square &sq, const BitBoard &friends);
+    static inline BitBoard knightAttacks(const Square &sq);
+    static inline BitBoard pawnMoves(Chess::Army army, const Square &sq, const BitBoard &friends, const BitBoard &enemies);
+    static inline BitBoard pawnAttacks(Chess::Army army, const Square &sq);
+
+    // Squares strictly between two squares sharing a rank, file or diagonal and the whole line
+    // through them, both clear otherwise
+    static inline BitBoard between(const Square &a, const Square &b);
+    static inline BitBoard line(const Square &a, const Square &b);
+
+    // Whether the slider tables are indexed by PEXT rather than by magic multiplication
+    bool usesPext() const { return m_usePext; }
+    static bool hasFastPext();
 
 private:
     Movegen();
     ~Movegen();
 
-    enum Direction { North, NorthEast, East, SouthEast, South, SouthWest, West, NorthWest };
-    static BitBoard raysForKing(const Square &sq);
-    static BitBoard raysForQueen(const Square &sq);
-    static BitBoard raysForRook(const Square &sq);
-    static BitBoard raysForBishop(const Square &sq);
-    static BitBoard raysForKnight(const Square &sq);
-    static BitBoard raysForPawn(Chess::Army army, const Square &sq);
-    static BitBoard raysForPawnAttack(Chess::Army army, const Square &sq);
-    static void generateRay(Direction direction, int magnitude, const Square &sq, BitBoard *rays);
-
-    BitBoard m_kingMoves[64];
-    BitBoard m_knightMoves[64];
-    BitBoard m_pawnMoves[2][64];
-    BitBoard m_pawnAttacks[2][64];
+    static const LeaperTables s_leapers;
     Magic m_rookTable[64];
     Magic m_bishopTable[64];
+    bool m_usePext;
     friend class MyMovegen;
 };
 
-inline quint64 sliderIndex(const BitBoard &occupied, const Magic *table)
+inline quint64 sliderIndex(const BitBoard &occupied, const Magic *table, bool usePext)
 {
-#ifdef USE_PEXT
-    return _pext_u64(occupied.data(), table->mask);
+#ifdef HAS_PEXT_DISPATCH
+    // Emitted directly so the rest of the build does not need to target BMI2
+    if (usePext) {
+        quint64 index;
+        asm ("pextq %2, %1, %0" : "=r" (index) : "r" (occupied.data()), "r" (table->mask));
+        return index;
+    }
 #else
-    return (((occupied.data() & table->mask) * table->magic) >> table->shift);
+    Q_UNUSED(usePext);
 #endif
+    return (((occupied.data() & table->mask) * table->magic) >> table->shift);
 }
 
-inline BitBoard Movegen::pawnMoves(Chess::Army army, const Square &sq, const BitBoard &friends, const BitBoard &enemies) const
+inline BitBoard Movegen::pawnMoves(Chess::Army army, const Square &sq, const BitBoard &friends, const BitBoard &enemies)
 {
-    return m_pawnMoves[army][sq.data()] & BitBoard(~enemies.data()) & BitBoard(~friends.data());
+    return BitBoard(s_leapers.pawnMoves[army][sq.data()]) & BitBoard(~enemies.data()) & BitBoard(~friends.data());
 }
 
-inline BitBoard Movegen::pawnAttacks(Chess::Army army, const Square &sq) const
+inline BitBoard Movegen::pawnAttacks(Chess::Army army, const Square &sq)
 {
-    return (m_pawnAttacks[army][sq.data()]);
+    return BitBoard(s_leapers.pawnAttacks[army][sq.data()]);
 }
 
-inline BitBoard Movegen::knightMoves(const Square &sq, const BitBoard &friends) const
+inline BitBoard Movegen::knightMoves(const Square &sq, const BitBoard &friends)
 {
-    return m_knightMoves[sq.data()] & BitBoard(~friends.data());
+    return BitBoard(s_leapers.knightMoves[sq.data()]) & BitBoard(~friends.data());
 }
 
-inline BitBoard Movegen::knightAttacks(const Square &sq) const
+inline BitBoard Movegen::knightAttacks(const Square &sq)
 {
-    return m_knightMoves[sq.data()];
+    return BitBoard(s_leapers.knightMoves[sq.data()]);
 }
 
 inline BitBoard Movegen::bishopMoves(const Square &sq, const BitBoard &friends, const BitBoard &enemies) const
 {
     const BitBoard occupied(friends | enemies);
     const BitBoard destinations = ~occupied | enemies;
-    return m_bishopTable[sq.data()].offset[sliderIndex(occupied, &m_bishopTable[sq.data()])] & destinations;
+    return m_bishopTable[sq.data()].offset[sliderIndex(occupied, &m_bishopTable[sq.data()], m_usePext)] & destinations;
 }
 
 inline BitBoard Movegen::bishopAttacks(const Square &sq, const BitBoard &occupied) const
 {
-    return m_bishopTable[sq.data()].offset[sliderIndex(occupied, &m_bishopTable[sq.data()])];
+    return m_bishopTable[sq.data()].offset[sliderIndex(occupied, &m_bishopTable[sq.data()], m_usePext)];
 }
 
 inline BitBoard Movegen::rookMoves(const Square &sq, const BitBoard &friends, const BitBoard &enemies) const
 {
     const BitBoard occupied(friends | enemies);
     const BitBoard destinations = ~occupied | enemies;
-    return m_rookTable[sq.data()].offset[sliderIndex(occupied, &m_rookTable[sq.data()])] & destinations;
+    return m_rookTable[sq.data()].offset[sliderIndex(occupied, &m_rookTable[sq.data()], m_usePext)] & destinations;
 }
 
 inline BitBoard Movegen::rookAttacks(const Square &sq, const BitBoard &occupied) const
 {
-    return m_rookTable[sq.data()].offset[sliderIndex(occupied, &m_rookTable[sq.data()])];
+    return m_rookTable[sq.data()].offset[sliderIndex(occupied, &m_rookTable[sq.data()], m_usePext)];
 }
 
 inline BitBoard Movegen::queenMoves(const Square &sq, const BitBoard &friends, const BitBoard &enemies) const
@@ -134,14 +150,24 @@ inline BitBoard Movegen::queenMoves(const Square &sq, const BitBoard &friends, c
     return bishopMoves(sq, friends, enemies) | rookMoves(sq, friends, enemies);
 }
 
-inline BitBoard Movegen::kingMoves(const Square &sq, const BitBoard &friends) const
+inline BitBoard Movegen::kingMoves(const Square &sq, const BitBoard &friends)
+{
+    return BitBoard(s_leapers.kingMoves[sq.data()]) & BitBoard(~friends.data());
+}
+
+inline BitBoard Movegen::kingAttacks(const Square &sq)
+{
+    return BitBoard(s_leapers.kingMoves[sq.data()]);
+}
+
+inline BitBoard Movegen::between(const Square &a, const Square &b)
 {
-    return m_kingMoves[sq.data()] & BitBoard(~friends.data());
+    return BitBoard(s_leapers.between[a.data()][b.data()]);
 }
 
-inline BitBoard Movegen::kingAttacks(const Square &sq) const
+inline BitBoard Movegen::line(const Square &a, const Square &b)
 {
-    return m_kingMoves[sq.data()];
+    return BitBoard(s_leapers.line[a.data()][b.data()]);
 }
 
 #endif // MOVEGEN_H
@@ -32,8 +32,11 @@
 struct OptionsDict
 {
     int gpuId;
-    int maxBatchSize;
+    int maxBatchSize; // every allocation of the backend is sized for it
+    int computations; // of the network, each with its own tensors and scratch
     bool useCustomWinograd;
+    bool useCudaGraphs;
+    std::string tuningFile; // autotunes where not empty
 };
 
 inline std::vector<std::string> GetFileList(const std::string &dir)
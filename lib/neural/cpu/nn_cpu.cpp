@@ -0,0 +1,626 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018-2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "allie_shim.h"
+#include "neural/loader.h"
+#include "neural/network.h"
+#include "neural/shared/activation.h"
+#include "neural/shared/policy_map.h"
+#include "neural/shared/winograd_filter.h"
+
+// The kernels are compiled for several instruction sets and the loader picks
+// the best the processor has, so that one binary runs everywhere and still
+// gets the full vector width on AVX2 and AVX-512 machines.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define CPU_KERNEL \
+  __attribute__((target_clones("arch=skylake-avx512", "arch=haswell", "default")))
+#else
+#define CPU_KERNEL
+#endif
+
+namespace lczero {
+namespace cpu_kernels {
+
+constexpr int kSquares = 64;
+constexpr int kTiles = 16;  // of 2x2 outputs on the 8x8 board
+constexpr int kWinogradTile = 16;
+
+// C[m x n] = A^T B where A is k x m with a row stride of lda and B is k x n.
+// Blocks of C are accumulated in a buffer small enough for the first level
+// cache and the innermost loop runs along rows of B for the vectorizer.
+CPU_KERNEL void Gemm(int m, int n, int k, const float* a, int lda,
+                     const float* b, float* c) {
+  constexpr int kRows = 4;
+  constexpr int kCols = 64;
+  for (int i0 = 0; i0 < m; i0 += kRows) {
+    const int rows = std::min(kRows, m - i0);
+    for (int j0 = 0; j0 < n; j0 += kCols) {
+      const int cols = std::min(kCols, n - j0);
+      float acc[kRows][kCols] = {};
+      for (int p = 0; p < k; ++p) {
+        const float* brow = b + size_t(p) * n + j0;
+        const float* arow = a + size_t(p) * lda + i0;
+        for (int r = 0; r < rows; ++r) {
+          const float av = arow[r];
+          for (int j = 0; j < cols; ++j) acc[r][j] += av * brow[j];
+        }
+      }
+      for (int r = 0; r < rows; ++r) {
+        memcpy(c + size_t(i0 + r) * n + j0, acc[r], cols * sizeof(float));
+      }
+    }
+  }
+}
+
+// out[batch x outputs] = in[batch x inputs] W^T + biases where W is
+// outputs x inputs.
+CPU_KERNEL void FullyConnected(int batch, int inputs, int outputs,
+                               const float* in, const float* w,
+                               const float* biases, bool relu, float* out) {
+  for (int b = 0; b < batch; ++b) {
+    const float* x = in + size_t(b) * inputs;
+    for (int o = 0; o < outputs; ++o) {
+      const float* row = w + size_t(o) * inputs;
+      float acc = 0.0f;
+      for (int i = 0; i < inputs; ++i) acc += row[i] * x[i];
+      acc += biases[o];
+      out[size_t(b) * outputs + o] = relu && acc < 0.0f ? 0.0f : acc;
+    }
+  }
+}
+
+// The 4x4 input tiles around every 2x2 output tile with one square of zero
+// padding, transformed by B^T d B. V is laid out as [16][channels][tiles].
+CPU_KERNEL void WinogradInput(int batch, int channels, const float* input,
+                              float* v) {
+  const size_t tiles = size_t(batch) * kTiles;
+  for (int b = 0; b < batch; ++b) {
+    for (int c = 0; c < channels; ++c) {
+      const float* plane = input + (size_t(b) * channels + c) * kSquares;
+      for (int ty = 0; ty < 4; ++ty) {
+        for (int tx = 0; tx < 4; ++tx) {
+          float d[4][4];
+          for (int r = 0; r < 4; ++r) {
+            const int y = 2 * ty - 1 + r;
+            for (int s = 0; s < 4; ++s) {
+              const int x = 2 * tx - 1 + s;
+              d[r][s] = y >= 0 && y < 8 && x >= 0 && x < 8 ? plane[y * 8 + x]
+                                                          : 0.0f;
+            }
+          }
+
+          float t[4][4];
+          for (int s = 0; s < 4; ++s) {
+            t[0][s] = d[0][s] - d[2][s];
+            t[1][s] = d[1][s] + d[2][s];
+            t[2][s] = d[2][s] - d[1][s];
+            t[3][s] = d[1][s] - d[3][s];
+          }
+
+          const size_t p = size_t(b) * kTiles + ty * 4 + tx;
+          float* out = v + size_t(c) * tiles + p;
+          const size_t stride = size_t(channels) * tiles;
+          for (int r = 0; r < 4; ++r) {
+            out[(r * 4 + 0) * stride] = t[r][0] - t[r][2];
+            out[(r * 4 + 1) * stride] = t[r][1] + t[r][2];
+            out[(r * 4 + 2) * stride] = t[r][2] - t[r][1];
+            out[(r * 4 + 3) * stride] = t[r][1] - t[r][3];
+          }
+        }
+      }
+    }
+  }
+}
+
+// The 2x2 outputs of every tile, A^T m A, from M laid out as
+// [16][outputs][tiles].
+CPU_KERNEL void WinogradOutput(int batch, int outputs, const float* m,
+                               float* output) {
+  const size_t tiles = size_t(batch) * kTiles;
+  const size_t stride = size_t(outputs) * tiles;
+  for (int b = 0; b < batch; ++b) {
+    for (int o = 0; o < outputs; ++o) {
+      float* plane = output + (size_t(b) * outputs + o) * kSquares;
+      for (int ty = 0; ty < 4; ++ty) {
+        for (int tx = 0; tx < 4; ++tx) {
+          const size_t p = size_t(b) * kTiles + ty * 4 + tx;
+          const float* in = m + size_t(o) * tiles + p;
+          float e[4][4];
+          for (int r = 0; r < 4; ++r) {
+            for (int s = 0; s < 4; ++s) e[r][s] = in[(r * 4 + s) * stride];
+          }
+
+          float t[2][4];
+          for (int s = 0; s < 4; ++s) {
+            t[0][s] = e[0][s] + e[1][s] + e[2][s];
+            t[1][s] = e[1][s] - e[2][s] - e[3][s];
+          }
+
+          for (int r = 0; r < 2; ++r) {
+            float* row = plane + (2 * ty + r) * 8 + 2 * tx;
+            row[0] = t[r][0] + t[r][1] + t[r][2];
+            row[1] = t[r][1] - t[r][2] - t[r][3];
+          }
+        }
+      }
+    }
+  }
+}
+
+}  // namespace cpu_kernels
+
+namespace {
+
+using namespace cpu_kernels;
+
+constexpr int kNumOutputPolicy = 1858;
+
+struct ConvLayer {
+  int inputs = 0;
+  int outputs = 0;
+  std::vector<float> weights;  // winograd U or the transposed 1x1 filter
+  std::vector<float> biases;
+};
+
+ConvLayer MakeConv3(const LegacyWeights::ConvBlock& block, int inputs) {
+  ConvLayer layer;
+  layer.outputs = int(block.biases.size());
+  layer.inputs = inputs;
+  layer.weights = WinogradFilterTransformF(block.weights, layer.outputs,
+                                           layer.inputs);
+  layer.biases = block.biases;
+  return layer;
+}
+
+ConvLayer MakeConv1(const LegacyWeights::ConvBlock& block, int inputs) {
+  ConvLayer layer;
+  layer.outputs = int(block.biases.size());
+  layer.inputs = inputs;
+  layer.weights.resize(block.weights.size());
+  for (int o = 0; o < layer.outputs; ++o) {
+    for (int c = 0; c < inputs; ++c) {
+      layer.weights[size_t(c) * layer.outputs + o] =
+          block.weights[size_t(o) * inputs + c];
+    }
+  }
+  layer.biases = block.biases;
+  return layer;
+}
+
+struct Residual {
+  ConvLayer conv1;
+  ConvLayer conv2;
+  bool has_se = false;
+  int se_channels = 0;
+  LegacyWeights::SEunit se;
+};
+
+// Scratch of one thread running the network on part of a batch.
+struct Workspace {
+  std::vector<float> tensor[3];
+  std::vector<float> v;
+  std::vector<float> m;
+  std::vector<float> fc;
+  std::vector<float> se;
+
+  size_t bytes() const {
+    size_t floats = v.capacity() + m.capacity() + fc.capacity() + se.capacity();
+    for (const auto& t : tensor) floats += t.capacity();
+    return floats * sizeof(float);
+  }
+};
+
+// The inputs of a batch and the results of the network for it.
+struct InputsOutputs {
+  explicit InputsOutputs(int maxBatchSize)
+      : max_batch_size(maxBatchSize),
+        masks(size_t(maxBatchSize) * kInputPlanes),
+        values(size_t(maxBatchSize) * kInputPlanes),
+        policy(size_t(maxBatchSize) * kNumOutputPolicy),
+        q(size_t(maxBatchSize)),
+        d(size_t(maxBatchSize)) {}
+
+  size_t bytes() const {
+    return masks.capacity() * sizeof(uint64_t) +
+           (values.capacity() + policy.capacity() + q.capacity() +
+            d.capacity()) *
+               sizeof(float);
+  }
+
+  int max_batch_size;
+  std::vector<uint64_t> masks;
+  std::vector<float> values;
+  std::vector<float> policy;
+  std::vector<float> q;
+  std::vector<float> d;
+};
+
+class CpuNetwork;
+
+class CpuNetworkComputation : public NetworkComputation {
+ public:
+  explicit CpuNetworkComputation(CpuNetwork* network);
+  ~CpuNetworkComputation() override;
+
+  void AddInput(InputPlanes* input) override {
+    uint64_t* masks;
+    float* values;
+    GetInputSlot(&masks, &values);
+    for (int i = 0; i < kInputPlanes; ++i) {
+      masks[i] = (*input)[size_t(i)].mask;
+      values[i] = (*input)[size_t(i)].value;
+    }
+    CommitInput();
+  }
+
+  bool GetInputSlot(uint64_t** masks, float** values) override {
+    assert(batch_size_ < io_->max_batch_size);
+    *masks = &io_->masks[size_t(batch_size_) * kInputPlanes];
+    *values = &io_->values[size_t(batch_size_) * kInputPlanes];
+    return true;
+  }
+
+  void CommitInput() override { batch_size_++; }
+
+  void ComputeBlocking() override;
+
+  bool Reset() override {
+    batch_size_ = 0;
+    return true;
+  }
+
+  int GetBatchSize() const override { return batch_size_; }
+
+  float GetQVal(int sample) const override { return io_->q[size_t(sample)]; }
+
+  float GetDVal(int sample) const override { return io_->d[size_t(sample)]; }
+
+  float GetPVal(int sample, int move_id) const override {
+    return io_->policy[size_t(sample) * kNumOutputPolicy + move_id];
+  }
+
+ private:
+  InputsOutputs* io_;
+  int batch_size_;
+  CpuNetwork* network_;
+};
+
+class CpuNetwork : public Network {
+ public:
+  CpuNetwork(const ConvertedWeights& file, int threads, int maxBatchSize)
+      : threads_(std::max(1, threads)),
+        max_batch_size_(std::max(1, maxBatchSize)) {
+    const LegacyWeights& weights = file.weights;
+    filters_ = int(weights.input.biases.size());
+    input_ = MakeConv3(weights.input, kInputPlanes);
+    for (const auto& block : weights.residual) {
+      Residual residual;
+      residual.conv1 = MakeConv3(block.conv1, filters_);
+      residual.conv2 = MakeConv3(block.conv2, filters_);
+      residual.has_se = block.has_se;
+      if (block.has_se) {
+        residual.se = block.se;
+        residual.se_channels = int(block.se.b1.size());
+      }
+      residual_.push_back(std::move(residual));
+    }
+
+    conv_policy_ =
+        file.policy == pblczero::NetworkFormat::POLICY_CONVOLUTION;
+    if (conv_policy_) {
+      policy1_ = MakeConv3(weights.policy1, filters_);
+      policy_ = MakeConv3(weights.policy, filters_);
+    } else {
+      policy_ = MakeConv1(weights.policy, filters_);
+      ip_pol_w_ = weights.ip_pol_w;
+      ip_pol_b_ = weights.ip_pol_b;
+    }
+
+    value_ = MakeConv1(weights.value, filters_);
+    ip1_val_w_ = weights.ip1_val_w;
+    ip1_val_b_ = weights.ip1_val_b;
+    ip2_val_w_ = weights.ip2_val_w;
+    ip2_val_b_ = weights.ip2_val_b;
+    wdl_ = file.value == pblczero::NetworkFormat::VALUE_WDL;
+
+    channels_ = std::max({int(kInputPlanes), filters_, policy_.outputs,
+                          value_.outputs});
+  }
+
+  bool isCPU() const override { return true; }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<CpuNetworkComputation>(this);
+  }
+
+  size_t hostMemory() const override {
+    std::lock_guard<std::mutex> lock(lock_);
+    size_t bytes = 0;
+    for (const auto& io : all_io_) bytes += io->bytes();
+    for (const auto& workspace : workspaces_) bytes += workspace->bytes();
+    return bytes;
+  }
+
+  // The computations are created for every batch so their buffers are kept
+  // here and handed out again.
+  InputsOutputs* GetInputsOutputs() {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (free_io_.empty()) {
+      all_io_.emplace_back(new InputsOutputs(max_batch_size_));
+      return all_io_.back().get();
+    }
+    InputsOutputs* io = free_io_.back();
+    free_io_.pop_back();
+    return io;
+  }
+
+  void ReleaseInputsOutputs(InputsOutputs* io) {
+    std::lock_guard<std::mutex> lock(lock_);
+    free_io_.push_back(io);
+  }
+
+  // Splits the batch across the threads, each running the whole network on
+  // its share with a workspace of its own.
+  void Forward(InputsOutputs* io, int batch) {
+    const int threads = std::min(threads_, batch);
+    const int chunk = (batch + threads - 1) / threads;
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; ++t) {
+      const int begin = t * chunk;
+      const int count = std::min(chunk, batch - begin);
+      if (count <= 0) break;
+      workers.emplace_back([this, io, begin, count]() {
+        ForwardChunk(io, begin, count);
+      });
+    }
+    ForwardChunk(io, 0, std::min(chunk, batch));
+    for (auto& worker : workers) worker.join();
+  }
+
+ private:
+  Workspace* AcquireWorkspace() {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (free_workspaces_.empty()) {
+      workspaces_.emplace_back(new Workspace);
+      return workspaces_.back().get();
+    }
+    Workspace* workspace = free_workspaces_.back();
+    free_workspaces_.pop_back();
+    return workspace;
+  }
+
+  void ReleaseWorkspace(Workspace* workspace) {
+    std::lock_guard<std::mutex> lock(lock_);
+    free_workspaces_.push_back(workspace);
+  }
+
+  void Convolve3(Workspace* ws, int batch, const ConvLayer& layer,
+                 const float* input, float* output) const {
+    const int tiles = batch * kTiles;
+    WinogradInput(batch, layer.inputs, input, ws->v.data());
+    for (int e = 0; e < kWinogradTile; ++e) {
+      Gemm(layer.outputs, tiles, layer.inputs,
+           layer.weights.data() + size_t(e) * layer.inputs * layer.outputs,
+           layer.outputs, ws->v.data() + size_t(e) * layer.inputs * tiles,
+           ws->m.data() + size_t(e) * layer.outputs * tiles);
+    }
+    WinogradOutput(batch, layer.outputs, ws->m.data(), output);
+  }
+
+  void Convolve1(int batch, const ConvLayer& layer, const float* input,
+                 float* output) const {
+    for (int b = 0; b < batch; ++b) {
+      Gemm(layer.outputs, kSquares, layer.inputs, layer.weights.data(),
+           layer.outputs, input + size_t(b) * layer.inputs * kSquares,
+           output + size_t(b) * layer.outputs * kSquares);
+    }
+  }
+
+  // relu(sigmoid(gamma) * x + beta + residual) with gamma and beta from two
+  // fully connected layers over the average of every channel, written to
+  // residual.
+  void ApplySE(Workspace* ws, int batch, const Residual& block, const float* x,
+               float* residual) const {
+    const int se = block.se_channels;
+    float* pooled = ws->se.data();
+    float* hidden = pooled + size_t(batch) * filters_;
+    float* gammas = hidden + size_t(batch) * se;
+    for (int b = 0; b < batch; ++b) {
+      for (int c = 0; c < filters_; ++c) {
+        const float* plane = x + (size_t(b) * filters_ + c) * kSquares;
+        float sum = 0.0f;
+        for (int i = 0; i < kSquares; ++i) sum += plane[i];
+        pooled[size_t(b) * filters_ + c] = sum / kSquares;
+      }
+    }
+    FullyConnected(batch, filters_, se, pooled, block.se.w1.data(),
+                   block.se.b1.data(), true, hidden);
+    FullyConnected(batch, se, 2 * filters_, hidden, block.se.w2.data(),
+                   block.se.b2.data(), false, gammas);
+
+    for (int b = 0; b < batch; ++b) {
+      const float* gamma = gammas + size_t(b) * 2 * filters_;
+      const float* beta = gamma + filters_;
+      for (int c = 0; c < filters_; ++c) {
+        const float scale = 1.0f / (1.0f + std::exp(-gamma[c]));
+        const size_t offset = (size_t(b) * filters_ + c) * kSquares;
+        for (int i = 0; i < kSquares; ++i) {
+          const float value =
+              scale * x[offset + i] + beta[c] + residual[offset + i];
+          residual[offset + i] = value > 0.0f ? value : 0.0f;
+        }
+      }
+    }
+  }
+
+  void ForwardChunk(InputsOutputs* io, int begin, int batch) {
+    Workspace* ws = AcquireWorkspace();
+    const size_t tensor = size_t(batch) * channels_ * kSquares;
+    for (auto& t : ws->tensor) t.resize(tensor);
+    ws->v.resize(size_t(kWinogradTile) * channels_ * batch * kTiles);
+    ws->m.resize(size_t(kWinogradTile) * channels_ * batch * kTiles);
+    // Holds the policy logits of a batch, or of one sample for the
+    // convolutional policy, and the outputs of the value head
+    ws->fc.resize(size_t(batch) * kNumOutputPolicy);
+    int se = 0;
+    for (const auto& block : residual_) se = std::max(se, block.se_channels);
+    ws->se.resize(size_t(batch) * (3 * filters_ + se));
+
+    float* x = ws->tensor[0].data();
+    float* y = ws->tensor[1].data();
+    float* z = ws->tensor[2].data();
+
+    // Expand the planes, every set bit being a square holding the value.
+    for (int b = 0; b < batch; ++b) {
+      const uint64_t* masks = &io->masks[size_t(begin + b) * kInputPlanes];
+      const float* values = &io->values[size_t(begin + b) * kInputPlanes];
+      for (int p = 0; p < kInputPlanes; ++p) {
+        float* plane = z + (size_t(b) * kInputPlanes + p) * kSquares;
+        for (int sq = 0; sq < kSquares; ++sq) {
+          plane[sq] = (masks[p] >> sq) & 1 ? values[p] : 0.0f;
+        }
+      }
+    }
+
+    Convolve3(ws, batch, input_, z, x);
+    BiasResidualRelu(batch, filters_, x, input_.biases.data());
+
+    for (const auto& block : residual_) {
+      Convolve3(ws, batch, block.conv1, x, y);
+      BiasResidualRelu(batch, filters_, y, block.conv1.biases.data());
+      Convolve3(ws, batch, block.conv2, y, z);
+      if (block.has_se) {
+        BiasResidualRelu(batch, filters_, z, block.conv2.biases.data(),
+                         nullptr, false);
+        ApplySE(ws, batch, block, z, x);
+      } else {
+        BiasResidualRelu(batch, filters_, z, block.conv2.biases.data(), x);
+        std::swap(x, z);
+      }
+    }
+
+    // Policy head, y and z are free from here on.
+    float* policy = &io->policy[size_t(begin) * kNumOutputPolicy];
+    if (conv_policy_) {
+      Convolve3(ws, batch, policy1_, x, y);
+      BiasResidualRelu(batch, filters_, y, policy1_.biases.data());
+      Convolve3(ws, batch, policy_, y, z);
+      BiasResidualRelu(batch, policy_.outputs, z, policy_.biases.data(),
+                       nullptr, false);
+      for (int b = 0; b < batch; ++b) {
+        float* logits = ws->fc.data();
+        std::fill(logits, logits + kNumOutputPolicy, 0.0f);
+        const float* planes = z + size_t(b) * policy_.outputs * kSquares;
+        for (int i = 0; i < 73 * kSquares; ++i) {
+          const short index = kConvPolicyMap[i];
+          if (index >= 0) logits[index] = planes[i];
+        }
+        SoftmaxActivation(kNumOutputPolicy, logits,
+                          policy + size_t(b) * kNumOutputPolicy);
+      }
+    } else {
+      Convolve1(batch, policy_, x, y);
+      BiasResidualRelu(batch, policy_.outputs, y, policy_.biases.data());
+      const int outputs = int(ip_pol_b_.size());
+      FullyConnected(batch, policy_.outputs * kSquares, outputs, y,
+                     ip_pol_w_.data(), ip_pol_b_.data(), false, ws->fc.data());
+      for (int b = 0; b < batch; ++b) {
+        SoftmaxActivation(outputs, ws->fc.data() + size_t(b) * outputs,
+                          policy + size_t(b) * kNumOutputPolicy);
+      }
+    }
+
+    // Value head.
+    Convolve1(batch, value_, x, y);
+    BiasResidualRelu(batch, value_.outputs, y, value_.biases.data());
+    const int hidden = int(ip1_val_b_.size());
+    FullyConnected(batch, value_.outputs * kSquares, hidden, y,
+                   ip1_val_w_.data(), ip1_val_b_.data(), true, z);
+    const int outputs = int(ip2_val_b_.size());
+    FullyConnected(batch, hidden, outputs, z, ip2_val_w_.data(),
+                   ip2_val_b_.data(), false, ws->fc.data());
+    for (int b = 0; b < batch; ++b) {
+      const float* value = ws->fc.data() + size_t(b) * outputs;
+      if (wdl_) {
+        float wdl[3];
+        SoftmaxActivation(3, value, wdl);
+        io->q[size_t(begin + b)] = wdl[0] - wdl[2];
+        io->d[size_t(begin + b)] = wdl[1];
+      } else {
+        io->q[size_t(begin + b)] = std::tanh(value[0]);
+        io->d[size_t(begin + b)] = 0.0f;
+      }
+    }
+
+    ReleaseWorkspace(ws);
+  }
+
+  int threads_;
+  int max_batch_size_;  // of the buffers of every computation
+  int filters_;
+  int channels_;
+  bool conv_policy_;
+  bool wdl_;
+  ConvLayer input_;
+  std::vector<Residual> residual_;
+  ConvLayer policy1_;
+  ConvLayer policy_;
+  std::vector<float> ip_pol_w_;
+  std::vector<float> ip_pol_b_;
+  ConvLayer value_;
+  std::vector<float> ip1_val_w_;
+  std::vector<float> ip1_val_b_;
+  std::vector<float> ip2_val_w_;
+  std::vector<float> ip2_val_b_;
+
+  mutable std::mutex lock_;
+  std::vector<std::unique_ptr<InputsOutputs>> all_io_;
+  std::vector<InputsOutputs*> free_io_;
+  std::vector<std::unique_ptr<Workspace>> workspaces_;
+  std::vector<Workspace*> free_workspaces_;
+};
+
+CpuNetworkComputation::CpuNetworkComputation(CpuNetwork* network)
+    : io_(network->GetInputsOutputs()), batch_size_(0), network_(network) {}
+
+CpuNetworkComputation::~CpuNetworkComputation() {
+  network_->ReleaseInputsOutputs(io_);
+}
+
+void CpuNetworkComputation::ComputeBlocking() {
+  if (batch_size_) network_->Forward(io_, batch_size_);
+}
+
+}  // namespace
+
+Network* createCpuNetwork(const ConvertedWeights& file, int threads,
+                          int maxBatchSize) {
+  return new CpuNetwork(file, threads, maxBatchSize);
+}
+
+}  // namespace lczero
@@ -390,6 +390,87 @@ __global__ void globalScale_kernel_fp16_nhwc(half* output, const half* input,
   output[tid] = (half)op;
 }
 
+// Each thread holds a board in registers, so larger blocks run out of them.
+constexpr int kMaxFusedSEChannels = 512;
+
+// N blocks.
+// C threads per block, each keeping the 8x8 board of its channel in registers
+// so that the activations are read and written only once. Works for any
+// channel count up to the block size and takes the transposed weights.
+// The kernel assumes K <= C.
+template <typename T, bool nhwc>
+__global__ void SE_Layer_kernel(T* output, const T* skip, const T* input,
+                                const T* w1, const T* b1, const T* w2,
+                                const T* b2, const T* bPrev, int C, int se_K) {
+  const int elementsPerThread = 64;  // 8x8 board
+
+  int n = blockIdx.x;
+  int c = threadIdx.x;
+
+  __shared__ float sharedData[kMaxFusedSEChannels];
+
+  float localData[elementsPerThread];
+  float bias = bPrev ? (float)bPrev[c] : 0.0f;
+
+  // 1. Previous layer bias and global avg (1 avg per thread).
+  float S = 0;
+#pragma unroll
+  for (int i = 0; i < elementsPerThread; i++) {
+    int index = nhwc ? (n * elementsPerThread + i) * C + c
+                     : (n * C + c) * elementsPerThread + i;
+    localData[i] = (float)input[index] + bias;
+    S += localData[i];
+  }
+  sharedData[c] = S / elementsPerThread;
+  __syncthreads();
+
+  // 2. First fully connected layer.
+  if (c < se_K) {
+    S = (float)b1[c];
+    for (int i = 0; i < C; i++) S += sharedData[i] * (float)readw1(i, c);
+  }
+  __syncthreads();
+  if (c < se_K) sharedData[c] = S > 0 ? S : 0;  // relu
+  __syncthreads();
+
+  // 3. Second fully connected layer.
+  S = (float)b2[c];
+  float B = (float)b2[c + C];
+  for (int i = 0; i < se_K; i++) {
+    float val = sharedData[i];
+    S += val * (float)readw2(i, c);
+    B += val * (float)readw2(i, c + C);
+  }
+
+  // Sigmoid (only on the scale part).
+  S = 1.0f / (1.0f + exp(-S));
+
+  // 4. Scale, add skip connection, perform relu, and write to output.
+#pragma unroll
+  for (int i = 0; i < elementsPerThread; i++) {
+    int index = nhwc ? (n * elementsPerThread + i) * C + c
+                     : (n * C + c) * elementsPerThread + i;
+    float val = localData[i] * S + B + (float)skip[index];
+    output[index] = (T)(val > 0 ? val : 0);
+  }
+}
+
+template <typename T>
+bool Se_Fused(int N, int C, int numFc1Out, T* output, const T* skip,
+              const T* input, const T* w1, const T* b1, const T* w2,
+              const T* b2, const T* bPrev, bool nhwc) {
+  if (C > kMaxFusedSEChannels || numFc1Out > C) return false;
+
+  if (nhwc)
+    SE_Layer_kernel<T, true><<<N, C>>>(output, skip, input, w1, b1, w2, b2,
+                                       bPrev, C, numFc1Out);
+  else
+    SE_Layer_kernel<T, false><<<N, C>>>(output, skip, input, w1, b1, w2, b2,
+                                        bPrev, C, numFc1Out);
+  ReportCUDAErrors(cudaGetLastError());
+  return true;
+}
+
 // N blocks.
 // C threads per block.
 // 'HWC' input data processed by thread block.
@@ -540,6 +621,41 @@ void PolicyMap(int N, T* output, const T* input, const short* indices,
   ReportCUDAErrors(cudaGetLastError());
 }
 
+// One block per sample and one thread per legal move.
+__global__ void gatherPolicy_kernel(float* output, const float* policy,
+                                    const uint16_t* indices,
+                                    const float* inverseTemperature,
+                                    int policySize) {
+  __shared__ float sum[kMaxPolicyIndices];
+
+  const int n = blockIdx.x;
+  const int i = threadIdx.x;
+  const uint16_t* sampleIndices = indices + n * kPolicyIndicesStride;
+  // Samples past the batch in a captured graph may hold stale indices
+  const int count = min((int)sampleIndices[0], kMaxPolicyIndices);
+  const int index = i < count ? sampleIndices[i + 1] : policySize;
+
+  float p = 0.0f;
+  if (index < policySize)
+    p = powf(policy[n * policySize + index], *inverseTemperature);
+
+  sum[i] = p;
+  __syncthreads();
+  for (int s = kMaxPolicyIndices / 2; s > 0; s >>= 1) {
+    if (i < s) sum[i] += sum[i + s];
+    __syncthreads();
+  }
+
+  if (i < count) output[n * kMaxPolicyIndices + i] = p / sum[0];
+}
+
+void gatherPolicy(float* output, const float* policy, const uint16_t* indices,
+                  const float* inverseTemperature, int N, int policySize) {
+  gatherPolicy_kernel<<<N, kMaxPolicyIndices>>>(output, policy, indices,
+                                                inverseTemperature, policySize);
+  ReportCUDAErrors(cudaGetLastError());
+}
+
 // Template instantiation.
 template void copyTypeConverted<half, float>(half* op, float* ip, int N);
 template void copyTypeConverted<float, half>(float* op, half* ip, int N);
@@ -580,6 +696,16 @@ template void globalScale<half>(int N, int C, half* output, const half* input,
                                 const half* scaleBias,
                                 const half* prevLayerBias, bool nhwc);
 
+template bool Se_Fused<float>(int N, int C, int numFc1Out, float* output,
+                              const float* skip, const float* input,
+                              const float* w1, const float* b1,
+                              const float* w2, const float* b2,
+                              const float* bPrev, bool nhwc);
+template bool Se_Fused<half>(int N, int C, int numFc1Out, half* output,
+                             const half* skip, const half* input,
+                             const half* w1, const half* b1, const half* w2,
+                             const half* b2, const half* bPrev, bool nhwc);
+
 template void PolicyMap<float>(int N, float* output, const float* input,
                                const short* indices, int inputSize,
                                int usedSize, int outputSize);
@@ -54,6 +54,11 @@ template <typename T>
 void batchNorm(T* output, const T* input, const T* skipInput, int N, int C,
                int H, int W, float* means, float* var_multipliers, bool relu);
 
+// Gathers the policy of the legal moves of each sample raised to the inverse
+// temperature and normalized, see kPolicyIndicesStride for the indices.
+void gatherPolicy(float* output, const float* policy, const uint16_t* indices,
+                  const float* inverseTemperature, int N, int policySize);
+
 // Unpack planes (input to network).
 void expandPlanes_Fp32_NCHW(float* output, const uint64_t* masks,
                             const float* values, int n);
@@ -80,6 +85,13 @@ bool Se_Fp16_NHWC(int N, int C, int numFc1Out, half* output, const half* skip,
                   const half* input, const half* w1, const half* b1,
                   const half* w2, const half* b2, const half* bPrev);
 
+// The same for NCHW or NHWC, fp32 or fp16 and any channel count up to 512,
+// taking the transposed weights. Returns false if the sizes are too large.
+template <typename T>
+bool Se_Fused(int N, int C, int numFc1Out, T* output, const T* skip,
+              const T* input, const T* w1, const T* b1, const T* w2,
+              const T* b2, const T* bPrev, bool nhwc);
+
 template <typename T>
 void PolicyMap(int N, T* output, const T* input, const short* indices,
                int inputSize, int usedSize, int outputSize);
@@ -25,6 +25,7 @@
   Program grant you additional permission to convey the resulting work.
 */
 #include "layers.h"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <vector>
@@ -36,8 +37,10 @@ namespace lczero {
 namespace cudnn_backend {
 
 // Use Single kernel for entire SE operation.
-// Right now supported only for fp16 with nhwc and it's quite a bit faster
-// than using multiple passes. The flag can be set to false for debugging.
+// It reads and writes the activations of the block once rather than in a
+// pass for each of pooling, both fully connected layers and the scale, which
+// matters as the residual tower is bound by memory bandwidth at large batches.
+// The flag can be set to false for debugging.
 static constexpr bool kUseFusedSELayer = true;
 
 template <typename DataType>
@@ -124,7 +127,7 @@ void ConvLayer<DataType>::init() {
     ReportCUDNNErrors(
         cudnnSetConvolutionMathType(conv_desc_, CUDNN_TENSOR_OP_MATH));
 
-  // TODO: dynamic selection of algorithm!
+  // Until SetAlgorithms gives the ones measured fastest on the device.
   if ((C > 32) && (!nhwc_) && (filter_size_ > 1)) {
     conv_algo_ = CUDNN_CONVOLUTION_FWD_ALGO_WINOGRAD_NONFUSED;
   } else {
@@ -166,7 +169,7 @@ ConvLayer<DataType>::ConvLayer(bool nhwc, int C, int H, int W, int filter,
 }
 
 template <>
-void ConvLayer<half>::LoadWeights(float* pfilter, float* pBias, void* scratch) {
+void ConvLayer<half>::LoadWeights(const float* pfilter, const float* pBias, void* scratch) {
   const size_t weight_size =
       sizeof(float) * c_input_ * C * filter_size_ * filter_size_;
   const size_t blas_size = sizeof(float) * C;
@@ -194,7 +197,7 @@ void ConvLayer<half>::LoadWeights(float* pfilter, float* pBias, void* scratch) {
 }
 
 template <>
-void ConvLayer<float>::LoadWeights(float* pfilter, float* pBias,
+void ConvLayer<float>::LoadWeights(const float* pfilter, const float* pBias,
                                    void* /*scratch*/) {
   const size_t weight_size =
       sizeof(float) * c_input_ * C * filter_size_ * filter_size_;
@@ -210,6 +213,68 @@ void ConvLayer<float>::LoadWeights(float* pfilter, float* pBias,
   }
 }
 
+template <typename DataType>
+std::string ConvLayer<DataType>::TuningKey() const {
+  return "conv" + std::to_string(c_input_) + "x" + std::to_string(C) + "k" +
+         std::to_string(filter_size_) + (nhwc_ ? "nhwc" : "nchw") +
+         (use_relu_ ? "relu" : "") + (use_bias_ ? "bias" : "");
+}
+
+template <typename DataType>
+std::vector<int> ConvLayer<DataType>::FindAlgorithms(
+    int max_batch, DataType* output, const DataType* input, void* scratch,
+    size_t scratch_size, cudnnHandle_t cudnn) {
+  const cudnnDataType_t dataType =
+      std::is_same<half, DataType>::value ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT;
+
+  const cudnnTensorFormat_t layout =
+      nhwc_ ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW;
+
+  std::vector<int> algorithms;
+  for (int bucket = 0;; ++bucket) {
+    const int N = std::min(1 << bucket, max_batch);
+    ReportCUDNNErrors(cudnnSetTensor4dDescriptor(out_tensor_desc_, layout,
+                                                 dataType, N, C, H, W));
+    ReportCUDNNErrors(cudnnSetTensor4dDescriptor(
+        in_tensor_desc_, layout, dataType, N, c_input_, H, W));
+
+    // Sorted by time with those failing or needing more workspace last.
+    cudnnConvolutionFwdAlgoPerf_t perf[CUDNN_CONVOLUTION_FWD_ALGO_COUNT];
+    int returned = 0;
+    ReportCUDNNErrors(cudnnFindConvolutionForwardAlgorithmEx(
+        cudnn, in_tensor_desc_, input, filter_desc_, weights, conv_desc_,
+        out_tensor_desc_, output, CUDNN_CONVOLUTION_FWD_ALGO_COUNT, &returned,
+        perf, scratch, scratch_size));
+
+    cudnnConvolutionFwdAlgo_t algo = conv_algo_;
+    for (int i = 0; i < returned; i++) {
+      if (perf[i].status == CUDNN_STATUS_SUCCESS &&
+          perf[i].memory <= scratch_size) {
+        algo = perf[i].algo;
+        break;
+      }
+    }
+    algorithms.push_back((int)algo);
+    if (N == max_batch) break;
+  }
+  return algorithms;
+}
+
+template <typename DataType>
+void ConvLayer<DataType>::SetAlgorithms(const std::vector<int>& algorithms) {
+  bucket_algos_.clear();
+  for (int algo : algorithms)
+    bucket_algos_.push_back((cudnnConvolutionFwdAlgo_t)algo);
+}
+
+template <typename DataType>
+cudnnConvolutionFwdAlgo_t ConvLayer<DataType>::Algorithm(int N) const {
+  if (bucket_algos_.empty()) return conv_algo_;
+  size_t bucket = 0;
+  while (bucket + 1 < bucket_algos_.size() && (1 << bucket) < N) bucket++;
+  return bucket_algos_[bucket];
+}
+
 template <typename DataType>
 void ConvLayer<DataType>::Eval(int N, DataType* output, const DataType* input,
                                const DataType* input2, void* scratch,
@@ -227,12 +292,13 @@ void ConvLayer<DataType>::Eval(int N, DataType* output, const DataType* input,
   ReportCUDNNErrors(cudnnSetTensor4dDescriptor(in_tensor_desc_, layout,
                                                dataType, N, c_input_, H, W));
 
+  const cudnnConvolutionFwdAlgo_t algo = Algorithm(N);
   float alpha = 1.0f, beta = 0.0f;
 
   if (!(use_relu_ || use_bias_ || input2)) {
     ReportCUDNNErrors(cudnnConvolutionForward(
         cudnn, &alpha, in_tensor_desc_, input, filter_desc_, weights,
-        conv_desc_, conv_algo_, scratch, scratch_size, &beta, out_tensor_desc_,
+        conv_desc_, algo, scratch, scratch_size, &beta, out_tensor_desc_,
         output));
   }
 #if CUDNN_MAJOR != 7 || CUDNN_MINOR != 0
@@ -240,7 +306,7 @@ void ConvLayer<DataType>::Eval(int N, DataType* output, const DataType* input,
     // fused bias + sum + relu!
     ReportCUDNNErrors(cudnnConvolutionBiasActivationForward(
         cudnn, &alpha, in_tensor_desc_, input, filter_desc_, weights,
-        conv_desc_, conv_algo_, scratch, scratch_size, &alpha, out_tensor_desc_,
+        conv_desc_, algo, scratch, scratch_size, &alpha, out_tensor_desc_,
         input2, bias_desc_, biases, activation_, out_tensor_desc_, output));
   } else {
     // For some reason cudnn doesn't support just Convolution + Bias with nchw
@@ -249,14 +315,14 @@ void ConvLayer<DataType>::Eval(int N, DataType* output, const DataType* input,
     if ((!nhwc_) && (!use_relu_)) {
       ReportCUDNNErrors(cudnnConvolutionForward(
           cudnn, &alpha, in_tensor_desc_, input, filter_desc_, weights,
-          conv_desc_, conv_algo_, scratch, scratch_size, &beta,
+          conv_desc_, algo, scratch, scratch_size, &beta,
           out_tensor_desc_, output));
       // add bias
       addBias_NCHW(output, output, biases, N, C, H, W);
     } else {
       ReportCUDNNErrors(cudnnConvolutionBiasActivationForward(
           cudnn, &alpha, in_tensor_desc_, input, filter_desc_, weights,
-          conv_desc_, conv_algo_, scratch, scratch_size, &beta,
+          conv_desc_, algo, scratch, scratch_size, &beta,
           out_tensor_desc_, output, bias_desc_, biases, activation_,
           out_tensor_desc_, output));
     }
@@ -265,7 +331,7 @@ void ConvLayer<DataType>::Eval(int N, DataType* output, const DataType* input,
   else {
     ReportCUDNNErrors(cudnnConvolutionForward(
         cudnn, &alpha, in_tensor_desc_, input, filter_desc_, weights,
-        conv_desc_, conv_algo_, scratch, scratch_size,
+        conv_desc_, algo, scratch, scratch_size,
         (input2 == output) ? &alpha : &beta, out_tensor_desc_, output));
     if (input2 && input2 != output) {
       ReportCUDNNErrors(cudnnAddTensor(cudnn, &alpha, out_tensor_desc_, input2,
@@ -306,7 +372,7 @@ SELayer<DataType>::SELayer(BaseLayer<DataType>* ip, int fc1Outputs,
   ReportCUDAErrors(cudaMalloc(&w1_, C * numFc1Out_ * sizeof(DataType)));
   ReportCUDAErrors(cudaMalloc(&w2_, 2 * C * numFc1Out_ * sizeof(DataType)));
 
-  if (kUseFusedSELayer && nhwc_) {
+  if (kUseFusedSELayer) {
     ReportCUDAErrors(cudaMalloc(&w1_t_, C * numFc1Out_ * sizeof(DataType)));
     ReportCUDAErrors(cudaMalloc(&w2_t_, 2 * C * numFc1Out_ * sizeof(DataType)));
   }
@@ -321,14 +387,21 @@ template <typename DataType>
 SELayer<DataType>::~SELayer() {
   ReportCUDAErrors(cudaFree(w1_));
   ReportCUDAErrors(cudaFree(w2_));
+  if (w1_t_) ReportCUDAErrors(cudaFree(w1_t_));
+  if (w2_t_) ReportCUDAErrors(cudaFree(w2_t_));
   ReportCUDAErrors(cudaFree(b1_));
   ReportCUDAErrors(cudaFree(b2_));
   ReportCUDAErrors(cudaFree(bPrev_));
 }
 
+void cpuTranspose(float* op, const float* ip, int rows, int cols) {
+  for (int i = 0; i < rows; i++)
+    for (int j = 0; j < cols; j++) op[j * rows + i] = ip[i * cols + j];
+}
+
 template <>
-void SELayer<float>::LoadWeights(float* w1, float* b1, float* w2, float* b2,
-                                 float* prevLayerBias, void* /*scratch*/) {
+void SELayer<float>::LoadWeights(const float* w1, const float* b1, const float* w2, const float* b2,
+                                 const float* prevLayerBias, void* /*scratch*/) {
   const size_t num_weights1 = C * numFc1Out_;
   const size_t weight_size1 = sizeof(float) * num_weights1;
 
@@ -340,6 +413,17 @@ void SELayer<float>::LoadWeights(float* w1, float* b1, float* w2, float* b2,
   // Weight for the second FC layer.
   ReportCUDAErrors(cudaMemcpy(w2_, w2, weight_size2, cudaMemcpyHostToDevice));
 
+  if (kUseFusedSELayer) {
+    // Transposed copies for the fused SE kernel.
+    std::vector<float> temp(2 * num_weights1);
+    cpuTranspose(temp.data(), w1, numFc1Out_, C);
+    ReportCUDAErrors(
+        cudaMemcpy(w1_t_, temp.data(), weight_size1, cudaMemcpyHostToDevice));
+    cpuTranspose(temp.data(), w2, 2 * C, numFc1Out_);
+    ReportCUDAErrors(
+        cudaMemcpy(w2_t_, temp.data(), weight_size2, cudaMemcpyHostToDevice));
+  }
+
   // Bias for the first FC layer.
   ReportCUDAErrors(
       cudaMemcpy(b1_, b1, numFc1Out_ * sizeof(float), cudaMemcpyHostToDevice));
@@ -355,14 +439,9 @@ void SELayer<float>::LoadWeights(float* w1, float* b1, float* w2, float* b2,
   }
 }
 
-void cpuTranspose(float* op, float* ip, int rows, int cols) {
-  for (int i = 0; i < rows; i++)
-    for (int j = 0; j < cols; j++) op[j * rows + i] = ip[i * cols + j];
-}
-
 template <>
-void SELayer<half>::LoadWeights(float* w1, float* b1, float* w2, float* b2,
-                                float* prevLayerBias, void* scratch) {
+void SELayer<half>::LoadWeights(const float* w1, const float* b1, const float* w2, const float* b2,
+                                const float* prevLayerBias, void* scratch) {
   const size_t num_weights1 = C * numFc1Out_;
   size_t weight_size1 = sizeof(float) * num_weights1;
 
@@ -376,7 +455,7 @@ void SELayer<half>::LoadWeights(float* w1, float* b1, float* w2, float* b2,
   ReportCUDAErrors(
       cudaMemcpy(scratch, w1, weight_size1, cudaMemcpyHostToDevice));
   copyTypeConverted((half*)w1_, (float*)scratch, (int)num_weights1);
-  if (kUseFusedSELayer && nhwc_) {
+  if (kUseFusedSELayer) {
     // transposed copy for fused SE kernel
     cpuTranspose(temp.data(), w1, numFc1Out_, C);
     ReportCUDAErrors(
@@ -388,7 +467,7 @@ void SELayer<half>::LoadWeights(float* w1, float* b1, float* w2, float* b2,
   ReportCUDAErrors(
       cudaMemcpy(scratch, w2, weight_size2, cudaMemcpyHostToDevice));
   copyTypeConverted((half*)w2_, (float*)scratch, (int)num_weights2);
-  if (kUseFusedSELayer && nhwc_) {
+  if (kUseFusedSELayer) {
     cpuTranspose(temp.data(), w2, 2 * C, numFc1Out_);
     ReportCUDAErrors(
         cudaMemcpy(scratch, temp.data(), weight_size2, cudaMemcpyHostToDevice));
@@ -418,6 +497,11 @@ void SELayer<float>::Eval(int N, float* output, const float* input,
                           const float* /*input2*/, void* scratch,
                           size_t scratch_size, cudnnHandle_t /*cudnn*/,
                           cublasHandle_t cublas) {
+  // The output holds the skip connection.
+  if (kUseFusedSELayer && Se_Fused(N, C, numFc1Out_, output, output, input,
+                                   w1_t_, b1_, w2_t_, b2_, bPrev_, false))
+    return;
+
   // Ping-pong between 'op1' and 'op2' (parts of scratch memory).
   float* op1 = (float*)scratch;
   float* op2 = (float*)scratch + scratch_size / sizeof(float) / 2;
@@ -454,6 +538,10 @@ void SELayer<half>::Eval(int N, half* output, const half* input,
     se_done = Se_Fp16_NHWC(N, C, numFc1Out_, output, input2, input, w1_t_, b1_,
                            w2_t_, b2_, bPrev_);
   }
+  if (kUseFusedSELayer && !se_done) {
+    se_done = Se_Fused(N, C, numFc1Out_, output, input2, input, w1_t_, b1_,
+                       w2_t_, b2_, bPrev_, nhwc_);
+  }
   if (!se_done) {
     assert(output == input2);
     // Ping-pong between 'op1' and 'op2' (parts of scratch memory).
@@ -507,7 +595,7 @@ FCLayer<DataType>::FCLayer(BaseLayer<DataType>* ip, int C, int H, int W,
 }
 
 template <>
-void FCLayer<half>::LoadWeights(float* cpuWeight, float* cpuBias,
+void FCLayer<half>::LoadWeights(const float* cpuWeight, const float* cpuBias,
                                 void* scratch) {
   const size_t num_weights =
       C * H * W * input_->GetC() * input_->GetH() * input_->GetW();
@@ -536,7 +624,7 @@ void FCLayer<half>::LoadWeights(float* cpuWeight, float* cpuBias,
 }
 
 template <>
-void FCLayer<float>::LoadWeights(float* cpuWeight, float* cpuBias,
+void FCLayer<float>::LoadWeights(const float* cpuWeight, const float* cpuBias,
                                  void* /*scratch*/) {
   const size_t num_weights =
       C * H * W * input_->GetC() * input_->GetH() * input_->GetW();
@@ -748,8 +836,8 @@ FusedWinogradConvSELayer<DataType>::FusedWinogradConvSELayer(
 }
 
 template <typename DataType>
-void FusedWinogradConvSELayer<DataType>::LoadWeights(float* pfilter,
-                                                     float* pBias,
+void FusedWinogradConvSELayer<DataType>::LoadWeights(const float* pfilter,
+                                                     const float* pBias,
                                                      void* scratch) {
   const size_t weight_size = sizeof(float) * c_input_ * C * 3 * 3;
   const size_t blas_size = sizeof(float) * C;
@@ -775,14 +863,14 @@ void FusedWinogradConvSELayer<DataType>::LoadWeights(float* pfilter,
 }
 
 // TODO: Do this on the GPU to improve network load time!
-static inline void CpuTranspose(float* op, float* ip, size_t rows, size_t cols) {
+static inline void CpuTranspose(float* op, const float* ip, size_t rows, size_t cols) {
   for (size_t i = 0; i < rows; i++)
     for (size_t j = 0; j < cols; j++) op[j * rows + i] = ip[i * cols + j];
 }
 
 template <typename DataType>
-void FusedWinogradConvSELayer<DataType>::LoadSEWeights(float* w1, float* b1,
-                                                       float* w2, float* b2,
+void FusedWinogradConvSELayer<DataType>::LoadSEWeights(const float* w1, const float* b1,
+                                                       const float* w2, const float* b2,
                                                        void* scratch) {
   const size_t num_weights1 = C * se_k_;
   const size_t num_weights2 = num_weights1 * 2;
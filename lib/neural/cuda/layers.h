@@ -29,6 +29,8 @@
 #include <cstddef>
 #include <cublas_v2.h>
 #include <cudnn.h>
+#include <string>
+#include <vector>
 
 namespace lczero {
 namespace cudnn_backend {
@@ -81,17 +83,37 @@ class ConvLayer : public BaseLayer<DataType> {
             bool relu = false, bool bias = false);
 
   ~ConvLayer();
-  void LoadWeights(float* pfilter, float* pBias, void* scratch);
+  void LoadWeights(const float* pfilter, const float* pBias, void* scratch);
   void Eval(int N, DataType* output, const DataType* input,
             const DataType* input2, void* scratch, size_t scratch_size,
             cudnnHandle_t cudnn, cublasHandle_t cublas) override;
 
+  // Whether cudnn may run any of its algorithms for this convolution, the
+  // fused bias without relu only takes implicit precomputed gemm.
+  bool Tunable() const { return use_relu_ || !use_bias_ || !nhwc_; }
+
+  // Identifies the convolutions the same algorithms are fastest for.
+  std::string TuningKey() const;
+
+  // Finds the fastest algorithm that fits in scratch_size at a batch of each
+  // power of two up to max_batch, for which input and output must have room.
+  std::vector<int> FindAlgorithms(int max_batch, DataType* output,
+                                  const DataType* input, void* scratch,
+                                  size_t scratch_size, cudnnHandle_t cudnn);
+
+  // The algorithm of each power of two bucket of the batch size as found
+  // above, the batch sizes past the last run with the algorithm of the last.
+  void SetAlgorithms(const std::vector<int>& algorithms);
+
  private:
   const int c_input_;
   const int filter_size_;
   const bool use_relu_;
   const bool use_bias_;
 
+  std::vector<cudnnConvolutionFwdAlgo_t> bucket_algos_;
+  cudnnConvolutionFwdAlgo_t Algorithm(int N) const;
+
   DataType* biases = nullptr;
   DataType* weights = nullptr;
 
@@ -134,7 +156,7 @@ class FCLayer : public BaseLayer<DataType> {
           bool tanh = false, bool sigmoid = false);
   ~FCLayer();
 
-  void LoadWeights(float* cpuWeight, float* cpuBias, void* scratch);
+  void LoadWeights(const float* cpuWeight, const float* cpuBias, void* scratch);
   void Eval(int N, DataType* output, const DataType* input,
             const DataType* input2, void* scratch, size_t scratch_size,
             cudnnHandle_t cudnn, cublasHandle_t cublas) override;
@@ -181,8 +203,8 @@ class SELayer : public BaseLayer<DataType> {
           bool addPrevLayerBias = false);
   ~SELayer();
 
-  void LoadWeights(float* w1, float* b1, float* w2, float* b2,
-                   float* prevLayerBias, void* scratch);
+  void LoadWeights(const float* w1, const float* b1, const float* w2, const float* b2,
+                   const float* prevLayerBias, void* scratch);
 
   void Eval(int N, DataType* output, const DataType* input,
             const DataType* input2, void* scratch, size_t scratch_size,
@@ -218,8 +240,8 @@ class FusedWinogradConvSELayer : public BaseLayer<DataType> {
                            int se_k, bool use_gemm_ex);
 
   ~FusedWinogradConvSELayer();
-  void LoadWeights(float* pfilter, float* pBias, void* scratch);
-  void LoadSEWeights(float* w1, float* b1, float* w2, float* b2, void *scratch);
+  void LoadWeights(const float* pfilter, const float* pBias, void* scratch);
+  void LoadSEWeights(const float* w1, const float* b1, const float* w2, const float* b2, void *scratch);
   void Eval(int N, DataType* output, const DataType* input,
             const DataType* input2,
             void* scratch, size_t scratch_size,
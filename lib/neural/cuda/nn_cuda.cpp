@@ -26,10 +26,18 @@
 */
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <functional>
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
 #include "cuda_common.h"
 #include "kernels.h"
 #include "layers.h"
@@ -46,6 +54,7 @@
 #include "neural/loader.h"
 #include "neural/network_legacy.h"
 #include "neural/shared/policy_map.h"
+#include "trace.h"
 #endif
 
 //#define DEBUG_RAW_NPS
@@ -85,8 +94,104 @@ void dumpTensor(void *memory, int elements, const char *message, bool fp16 = fal
 }
 #endif
 
+// What the autotuning found, as lines of a key and the chosen values, kept in
+// a file so later startups skip the measurements. Every key begins with what
+// the results depend on besides the shape of the network: the name of the
+// GPU, the versions of the driver and cudnn and the precision. The devices
+// tuning at once each add what they found to the file as it is when they
+// write it.
+class TuningCache {
+ public:
+  TuningCache(const std::string& file, const cudaDeviceProp& deviceProp,
+              bool fp16)
+      : file_(file) {
+    int driver = 0;
+    cudaDriverGetVersion(&driver);
+    std::ostringstream prefix;
+    prefix << deviceProp.name << "/driver" << driver << "/cudnn"
+           << cudnnGetVersion() << (fp16 ? "/fp16/" : "/fp32/");
+    prefix_ = prefix.str();
+    std::replace(prefix_.begin(), prefix_.end(), ' ', '_');
+
+    std::lock_guard<std::mutex> lock(FileMutex());
+    Read(&entries_);
+  }
+
+  ~TuningCache() {
+    if (found_.empty()) return;
+    std::lock_guard<std::mutex> lock(FileMutex());
+    std::map<std::string, std::vector<int>> entries;
+    Read(&entries);
+    for (const auto& entry : found_) entries[entry.first] = entry.second;
+
+    // Replaced whole so a reader never sees half of it.
+    const std::string temp = file_ + ".tmp";
+    {
+      std::ofstream out(temp, std::ios::trunc);
+      for (const auto& entry : entries) {
+        out << entry.first;
+        for (int value : entry.second) out << ' ' << value;
+        out << '\n';
+      }
+      if (!out) return;
+    }
+    std::rename(temp.c_str(), file_.c_str());
+  }
+
+  bool Get(const std::string& key, size_t count,
+           std::vector<int>* values) const {
+    auto it = entries_.find(prefix_ + key);
+    if (it == entries_.end() || it->second.size() != count) return false;
+    *values = it->second;
+    return true;
+  }
+
+  void Set(const std::string& key, const std::vector<int>& values) {
+    entries_[prefix_ + key] = values;
+    found_[prefix_ + key] = values;
+  }
+
+ private:
+  static std::mutex& FileMutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  void Read(std::map<std::string, std::vector<int>>* entries) const {
+    std::ifstream in(file_);
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream fields(line);
+      std::string key;
+      if (!(fields >> key)) continue;
+      std::vector<int> values;
+      int value;
+      while (fields >> value) values.push_back(value);
+      (*entries)[key] = values;
+    }
+  }
+
+  std::string file_;
+  std::string prefix_;
+  std::map<std::string, std::vector<int>> entries_;
+  std::map<std::string, std::vector<int>> found_;  // to be written
+};
+
+// Besides the inputs and outputs each computation has its own tensors, scratch
+// memory and library handles so computations can run on their own streams.
+// The work is enqueued on the per thread default stream of the caller.
 struct InputsOutputs {
-  InputsOutputs(int maxBatchSize, bool wdl) {
+  InputsOutputs(int maxBatchSize, bool wdl, size_t tensorSize,
+                size_t scratchSize, bool tensorCores, int graphs)
+      : graphs_(graphs, nullptr) {
+    host_bytes_ =
+        maxBatchSize * (kInputPlanes * (sizeof(uint64_t) + sizeof(float)) +
+                        (kNumOutputPolicy + (wdl ? 3 : 1) + kMaxPolicyIndices) *
+                            sizeof(float) +
+                        kPolicyIndicesStride * sizeof(uint16_t)) +
+        sizeof(float);
+    device_bytes_ = DeviceBytes(maxBatchSize, tensorSize, scratchSize);
+
     ReportCUDAErrors(cudaHostAlloc(
         &input_masks_mem_, maxBatchSize * kInputPlanes * sizeof(uint64_t),
         cudaHostAllocMapped));
@@ -113,6 +218,52 @@ struct InputsOutputs {
                                    cudaHostAllocMapped));
     ReportCUDAErrors(
         cudaHostGetDevicePointer(&op_value_mem_gpu_, op_value_mem_, 0));
+
+    ReportCUDAErrors(cudaHostAlloc(
+        &policy_indices_mem_,
+        maxBatchSize * kPolicyIndicesStride * sizeof(uint16_t),
+        cudaHostAllocMapped));
+    ReportCUDAErrors(cudaHostGetDevicePointer(&policy_indices_mem_gpu_,
+                                              policy_indices_mem_, 0));
+    memset(policy_indices_mem_, 0,
+           maxBatchSize * kPolicyIndicesStride * sizeof(uint16_t));
+
+    ReportCUDAErrors(cudaHostAlloc(&policy_temperature_mem_, sizeof(float),
+                                   cudaHostAllocMapped));
+    ReportCUDAErrors(cudaHostGetDevicePointer(&policy_temperature_mem_gpu_,
+                                              policy_temperature_mem_, 0));
+    *policy_temperature_mem_ = 1.0f;
+
+    // Written by the kernel straight to the host as only a few entries of
+    // each sample are used.
+    ReportCUDAErrors(cudaHostAlloc(
+        &op_gathered_policy_mem_,
+        maxBatchSize * kMaxPolicyIndices * sizeof(float), cudaHostAllocMapped));
+    ReportCUDAErrors(cudaHostGetDevicePointer(&op_gathered_policy_mem_gpu_,
+                                              op_gathered_policy_mem_, 0));
+
+    for (auto& mem : tensor_mem_) {
+      ReportCUDAErrors(cudaMalloc(&mem, tensorSize));
+      ReportCUDAErrors(cudaMemset(mem, 0, tensorSize));
+    }
+    ReportCUDAErrors(cudaMalloc(&scratch_mem_, scratchSize));
+    scratch_size_ = scratchSize;
+
+    ReportCUDNNErrors(cudnnCreate(&cudnn_));
+    ReportCUDNNErrors(cudnnSetStream(cudnn_, cudaStreamPerThread));
+    ReportCUBLASErrors(cublasCreate(&cublas_));
+    ReportCUBLASErrors(cublasSetStream(cublas_, cudaStreamPerThread));
+    if (tensorCores)
+      ReportCUBLASErrors(cublasSetMathMode(cublas_, CUBLAS_TENSOR_OP_MATH));
+
+    ReportCUDAErrors(
+        cudaEventCreateWithFlags(&done_event_, cudaEventDisableTiming));
+  }
+  // Of the policy output, the three tensors and the scratch on the device.
+  static size_t DeviceBytes(int maxBatchSize, size_t tensorSize,
+                            size_t scratchSize) {
+    return size_t(maxBatchSize) * kNumOutputPolicy * sizeof(float) +
+           3 * tensorSize + scratchSize;
   }
   ~InputsOutputs() {
     ReportCUDAErrors(cudaFreeHost(input_masks_mem_));
@@ -120,6 +271,17 @@ struct InputsOutputs {
     ReportCUDAErrors(cudaFreeHost(op_policy_mem_));
     ReportCUDAErrors(cudaFree(op_policy_mem_gpu_));
     ReportCUDAErrors(cudaFreeHost(op_value_mem_));
+    ReportCUDAErrors(cudaFreeHost(policy_indices_mem_));
+    ReportCUDAErrors(cudaFreeHost(policy_temperature_mem_));
+    ReportCUDAErrors(cudaFreeHost(op_gathered_policy_mem_));
+    for (auto mem : tensor_mem_) ReportCUDAErrors(cudaFree(mem));
+    ReportCUDAErrors(cudaFree(scratch_mem_));
+    cudnnDestroy(cudnn_);
+    cublasDestroy(cublas_);
+    cudaEventDestroy(done_event_);
+    for (auto graph : graphs_) {
+      if (graph) cudaGraphExecDestroy(graph);
+    }
   }
   uint64_t* input_masks_mem_;
   float* input_val_mem_;
@@ -133,6 +295,33 @@ struct InputsOutputs {
 
   // This is a seperate copy.
   float* op_policy_mem_gpu_;
+
+  // The policy of the legal moves is gathered on the device when set.
+  bool gather_policy_ = false;
+  uint16_t* policy_indices_mem_;
+  float* policy_temperature_mem_;
+  float* op_gathered_policy_mem_;
+  uint16_t* policy_indices_mem_gpu_;
+  float* policy_temperature_mem_gpu_;
+  float* op_gathered_policy_mem_gpu_;
+
+  // Memory and handles to run the network.
+  void* tensor_mem_[3];
+  void* scratch_mem_;
+  size_t scratch_size_;
+  cudnnHandle_t cudnn_;
+  cublasHandle_t cublas_;
+
+  // What the above take in pinned host and in device memory.
+  size_t host_bytes_;
+  size_t device_bytes_;
+
+  // Recorded once all the work of an evaluation has been enqueued.
+  cudaEvent_t done_event_;
+
+  // The forward pass captured for each batch size bucket with and without the
+  // policy gather, as the graphs are bound to the memory above.
+  std::vector<cudaGraphExec_t> graphs_;
 };
 
 template <typename DataType>
@@ -160,7 +349,28 @@ class CudnnNetworkComputation : public NetworkComputation {
     batch_size_++;
   }
 
+  bool GetInputSlot(uint64_t** masks, float** values) override {
+    *masks = &inputs_outputs_->input_masks_mem_[batch_size_ * kInputPlanes];
+    *values = &inputs_outputs_->input_val_mem_[batch_size_ * kInputPlanes];
+    return true;
+  }
+
+  void CommitInput() override { batch_size_++; }
+
+  uint16_t* GetPolicyIndicesSlot() override {
+    return &inputs_outputs_
+                ->policy_indices_mem_[batch_size_ * kPolicyIndicesStride];
+  }
+
+  void SetPolicyTemperature(float inverseTemperature) override {
+    inputs_outputs_->gather_policy_ = true;
+    *inputs_outputs_->policy_temperature_mem_ = inverseTemperature;
+  }
+
   void ComputeBlocking() override;
+  void ComputeAsync() override;
+  void WaitForCompletion() override;
+  bool Reset() override;
 
   int GetBatchSize() const override { return batch_size_; }
 
@@ -187,6 +397,10 @@ class CudnnNetworkComputation : public NetworkComputation {
     return inputs_outputs_->op_policy_mem_[sample * kNumOutputPolicy + move_id];
   }
 
+  float GetGatheredPVal(int sample, int i) const override {
+    return inputs_outputs_->op_gathered_policy_mem_[sample * kMaxPolicyIndices + i];
+  }
+
  private:
   // Memory holding inputs, outputs.
   std::unique_ptr<InputsOutputs> inputs_outputs_;
@@ -199,21 +413,24 @@ class CudnnNetworkComputation : public NetworkComputation {
 template <typename DataType>
 class CudnnNetwork : public Network {
  public:
-  CudnnNetwork(const WeightsFile& file, const OptionsDict& options) {
-    LegacyWeights weights(file.weights());
+  CudnnNetwork(const ConvertedWeights& file, const OptionsDict& options) {
+    // Shared by the networks of all devices which only read them
+    const LegacyWeights& weights = file.weights;
 #ifndef DISABLE_FOR_ALLIE
     gpu_id_ = options.GetOrDefault<int>("gpu", 0);
 #else
     gpu_id_ = options.gpuId;
 #endif
 
-    conv_policy_ = file.format().network_format().policy() ==
+    conv_policy_ = file.policy ==
                    pblczero::NetworkFormat::POLICY_CONVOLUTION;
 
 #ifndef DISABLE_FOR_ALLIE
     max_batch_size_ = options.GetOrDefault<int>("max_batch", 1024);
+    use_cuda_graphs_ = options.GetOrDefault<bool>("cuda_graphs", false);
 #else
     max_batch_size_ = options.maxBatchSize;
+    use_cuda_graphs_ = options.useCudaGraphs;
 #endif
 
     int total_gpus;
@@ -277,6 +494,7 @@ class CudnnNetwork : public Network {
 
     if (hasTensorCores)
       ReportCUBLASErrors(cublasSetMathMode(cublas_, CUBLAS_TENSOR_OP_MATH));
+    has_tensor_cores_ = hasTensorCores;
 
     constexpr bool fp16 = std::is_same<half, DataType>::value;
     const int kNumInputPlanes = kInputPlanes;
@@ -357,6 +575,23 @@ class CudnnNetwork : public Network {
       use_custom_winograd_ = options.useCustomWinograd;
 #endif
 
+    const bool use_gemm_ex = deviceProp.major >= 5;
+
+#ifdef DISABLE_FOR_ALLIE
+    // Measured in place of the guesses above where there is room for both,
+    // written to the file once the network is built.
+    std::unique_ptr<TuningCache> tuning;
+    if (!options.tuningFile.empty()) {
+      tuning = std::make_unique<TuningCache>(options.tuningFile, deviceProp,
+                                             fp16);
+      if (transformed_residual_weight_size <= 0.5 * deviceProp.totalGlobalMem)
+        use_custom_winograd_ =
+            CustomWinogradIsFaster(tuning.get(), kNumFilters, use_gemm_ex);
+      else
+        use_custom_winograd_ = false;
+    }
+#endif
+
     if (use_custom_winograd_ &&
         transformed_residual_weight_size > 0.4 * deviceProp.totalGlobalMem) {
 #ifndef DISABLE_FOR_ALLIE
@@ -373,8 +608,6 @@ class CudnnNetwork : public Network {
     // Winograd needs nchw tensor layout.
     if (use_custom_winograd_) nhwc_ = false;
 
-    const bool use_gemm_ex = deviceProp.major >= 5;
-
     // 0. Check for SE.
     has_se_ = false;
     if (weights.residual[0].has_se) {
@@ -579,7 +812,7 @@ class CudnnNetwork : public Network {
                           scratch_mem_);
       network_.emplace_back(std::move(FCVal1));
 
-      wdl_ = file.format().network_format().value() ==
+      wdl_ = file.value ==
              pblczero::NetworkFormat::VALUE_WDL;
       auto fc2_tanh = !wdl_;
 
@@ -610,10 +843,27 @@ class CudnnNetwork : public Network {
       maxSize = std::max(maxSize, layer->GetOutputSize(max_batch_size_));
     }
 
-    for (auto& mem : tensor_mem_) {
-      ReportCUDAErrors(cudaMalloc(&mem, maxSize));
-      ReportCUDAErrors(cudaMemset(mem, 0, maxSize));
-    }
+    // These are allocated for each computation along with its inputs and outputs
+    tensor_size_ = maxSize;
+
+#ifdef DISABLE_FOR_ALLIE
+    // Every computation allocates for the largest batch on its first use, so
+    // a batch size the device can not hold is refused here with the reason
+    // rather than in the middle of a search.
+    size_t freeBytes = 0;
+    size_t totalBytes = 0;
+    ReportCUDAErrors(cudaMemGetInfo(&freeBytes, &totalBytes));
+    const size_t neededBytes =
+        size_t(std::max(1, options.computations)) *
+        InputsOutputs::DeviceBytes(max_batch_size_, tensor_size_, scratch_size_);
+    if (neededBytes > freeBytes)
+      qFatal("A batch size of %d needs %zu MB of gpu %d for %d computations "
+             "but only %zu MB of %zu MB are free, lower MaxBatchSize",
+             max_batch_size_, neededBytes >> 20, gpu_id_, options.computations,
+             freeBytes >> 20, totalBytes >> 20);
+
+    if (tuning) TuneConvolutions(tuning.get());
+#endif
 
     cudnnDestroyFilterDescriptor(wDesc);
     cudnnDestroyConvolutionDescriptor(convDesc);
@@ -625,13 +875,198 @@ class CudnnNetwork : public Network {
 #endif
   }
 
+  // Whether a residual convolution of the custom winograd path took less time
+  // than the same with the fastest cudnn algorithms over a batch of each power
+  // of two, so the large batches that carry most positions weigh the most.
+  bool CustomWinogradIsFaster(TuningCache* tuning, int filters,
+                              bool use_gemm_ex) {
+    const std::string key = "residual" + std::to_string(filters) + "b" +
+                            std::to_string(max_batch_size_) +
+                            (nhwc_ ? "nhwc" : "nchw");
+    std::vector<int> faster;
+    if (tuning->Get(key, 1, &faster)) return faster[0];
+
+    const size_t tensor_size =
+        sizeof(DataType) * max_batch_size_ * filters * 64;
+    // Both halves of the transformed input and output of the custom path.
+    const size_t scratch_size =
+        std::max<size_t>(128 * 1024 * 1024,
+                         2 * sizeof(DataType) * max_batch_size_ * filters *
+                             64 * 36 / 16);
+    DataType* input;
+    DataType* output;
+    void* scratch;
+    ReportCUDAErrors(cudaMalloc(&input, tensor_size));
+    ReportCUDAErrors(cudaMalloc(&output, tensor_size));
+    ReportCUDAErrors(cudaMalloc(&scratch, scratch_size));
+    ReportCUDAErrors(cudaMemset(input, 0, tensor_size));
+
+    // The weights only have to be there, zero is as fast as any others.
+    const std::vector<float> zeros(9 * filters * filters, 0.0f);
+    double custom_ms = 0;
+    double cudnn_ms = 0;
+    {
+      ConvLayer<DataType> conv(nhwc_, filters, 8, 8, 3, filters, true, true);
+      conv.LoadWeights(zeros.data(), zeros.data(), scratch);
+      if (conv.Tunable())
+        conv.SetAlgorithms(conv.FindAlgorithms(
+            max_batch_size_, output, input, scratch, scratch_size, cudnn_));
+
+      // Only gives the layout to the one of the custom path.
+      ConvLayer<DataType> nchw(false, filters, 8, 8, 1, filters);
+      FusedWinogradConvSELayer<DataType> custom(&nchw, filters, 8, 8, filters,
+                                                true, true, true, false, 0,
+                                                use_gemm_ex);
+      custom.LoadWeights(zeros.data(), zeros.data(), scratch);
+
+      for (int bucket = 0; bucket < graphBuckets(); bucket++) {
+        const int N = graphBucketSize(bucket);
+        cudnn_ms += TimeMs([&]() {
+          conv.Eval(N, output, input, output, scratch, scratch_size, cudnn_,
+                    cublas_);
+        });
+        custom_ms += TimeMs([&]() {
+          custom.Eval(N, output, input, output, scratch, scratch_size, cudnn_,
+                      cublas_);
+        });
+      }
+    }
+
+    ReportCUDAErrors(cudaFree(input));
+    ReportCUDAErrors(cudaFree(output));
+    ReportCUDAErrors(cudaFree(scratch));
+
+    const bool custom_faster = custom_ms < cudnn_ms;
+    tuning->Set(key, {custom_faster});
+    return custom_faster;
+  }
+
+  // Gives every cudnn convolution the algorithms found fastest for its shape.
+  void TuneConvolutions(TuningCache* tuning) {
+    void* input = nullptr;
+    void* output = nullptr;
+    for (auto& layer : network_) {
+      auto conv = dynamic_cast<ConvLayer<DataType>*>(layer.get());
+      if (!conv || !conv->Tunable()) continue;
+
+      std::vector<int> algorithms;
+      if (!tuning->Get(conv->TuningKey(), graphBuckets(), &algorithms)) {
+        if (!input) {
+          ReportCUDAErrors(cudaMalloc(&input, tensor_size_));
+          ReportCUDAErrors(cudaMalloc(&output, tensor_size_));
+          ReportCUDAErrors(cudaMemset(input, 0, tensor_size_));
+        }
+        algorithms = conv->FindAlgorithms(
+            max_batch_size_, (DataType*)output, (const DataType*)input,
+            scratch_mem_, scratch_size_, cudnn_);
+        tuning->Set(conv->TuningKey(), algorithms);
+      }
+      conv->SetAlgorithms(algorithms);
+    }
+    if (input) {
+      ReportCUDAErrors(cudaFree(input));
+      ReportCUDAErrors(cudaFree(output));
+    }
+  }
+
+  // Milliseconds a run takes once warmed up.
+  template <typename Run>
+  static double TimeMs(const Run& run) {
+    const int kRuns = 5;
+    run();
+    ReportCUDAErrors(cudaDeviceSynchronize());
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kRuns; i++) run();
+    ReportCUDAErrors(cudaDeviceSynchronize());
+    const auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count() /
+           kRuns;
+  }
+
+  // Enqueues the evaluation on the caller's per thread default stream and
+  // records the done event of the inputs and outputs once it is complete.
   void forwardEval(InputsOutputs* io, int batchSize) {
     std::lock_guard<std::mutex> lock(lock_);
+    TRACE_RANGE("forwardEval");
 
 #ifdef DEBUG_RAW_NPS
     auto t_start = std::chrono::high_resolution_clock::now();
 #endif
 
+    if (use_cuda_graphs_) {
+      // Replay the graph of the smallest bucket holding the batch, the samples
+      // past the batch size are evaluated but ignored
+      int bucket = 0;
+      while (graphBucketSize(bucket) < batchSize) ++bucket;
+      cudaGraphExec_t& graph = io->graphs_[2 * bucket + io->gather_policy_];
+      if (!graph) graph = captureGraph(io, graphBucketSize(bucket));
+      ReportCUDAErrors(cudaGraphLaunch(graph, cudaStreamPerThread));
+    } else {
+      enqueueForward(io, batchSize);
+    }
+    ReportCUDAErrors(cudaEventRecord(io->done_event_, cudaStreamPerThread));
+
+#ifdef DEBUG_RAW_NPS
+    const int reportingCalls = 100;
+    static int numCalls = 0;
+    static int sumBatchSize = 0;
+    static double totalTime = 0;
+
+    sumBatchSize += batchSize;
+    numCalls++;
+
+    auto t_end = std::chrono::high_resolution_clock::now();
+
+    double dt = std::chrono::duration<double>(t_end - t_start).count();
+    totalTime += dt;
+    if (numCalls == reportingCalls) {
+      double avgBatchSize = ((double)sumBatchSize) / numCalls;
+      double nps = sumBatchSize / totalTime;
+      CERR << "Avg batch size: " << avgBatchSize
+           << ", NN eval time: " << totalTime << " seconds per " << sumBatchSize
+           << " evals. NPS: " << nps;
+      sumBatchSize = 0;
+      totalTime = 0;
+      numCalls = 0;
+    }
+#endif
+  }
+
+  // Batch sizes of the graphs are powers of two up to the maximum batch size
+  int graphBucketSize(int bucket) const {
+    return std::min(1 << bucket, max_batch_size_);
+  }
+
+  int graphBuckets() const {
+    int buckets = 1;
+    while (graphBucketSize(buckets - 1) < max_batch_size_) ++buckets;
+    return buckets;
+  }
+
+  cudaGraphExec_t captureGraph(InputsOutputs* io, int batchSize) {
+    cudaGraph_t graph;
+    cudaGraphExec_t graphExec;
+    ReportCUDAErrors(cudaStreamBeginCapture(cudaStreamPerThread,
+                                            cudaStreamCaptureModeThreadLocal));
+    enqueueForward(io, batchSize);
+    ReportCUDAErrors(cudaStreamEndCapture(cudaStreamPerThread, &graph));
+    ReportCUDAErrors(
+        cudaGraphInstantiate(&graphExec, graph, nullptr, nullptr, 0));
+    ReportCUDAErrors(cudaGraphDestroy(graph));
+    return graphExec;
+  }
+
+  // Enqueues the layers of the network on the caller's per thread default
+  // stream.
+  void enqueueForward(InputsOutputs* io, int batchSize) {
+    DataType* tensor_mem[3] = {(DataType*)io->tensor_mem_[0],
+                               (DataType*)io->tensor_mem_[1],
+                               (DataType*)io->tensor_mem_[2]};
+    void* scratch_mem = io->scratch_mem_;
+    const size_t scratch_size = io->scratch_size_;
+    cudnnHandle_t cudnn = io->cudnn_;
+    cublasHandle_t cublas = io->cublas_;
+
     // Expand packed planes to full planes.
     uint64_t* ipDataMasks = io->input_masks_mem_gpu_;
     float* ipDataValues = io->input_val_mem_gpu_;
@@ -639,184 +1074,168 @@ class CudnnNetwork : public Network {
     bool fp16 = std::is_same<half, DataType>::value;
     if (fp16) {
       if (nhwc_)
-        expandPlanes_Fp16_NHWC((half*)(tensor_mem_[0]), ipDataMasks,
+        expandPlanes_Fp16_NHWC((half*)(tensor_mem[0]), ipDataMasks,
                                ipDataValues, batchSize * kInputPlanes);
       else
-        expandPlanes_Fp16_NCHW((half*)(tensor_mem_[0]), ipDataMasks,
+        expandPlanes_Fp16_NCHW((half*)(tensor_mem[0]), ipDataMasks,
                                ipDataValues, batchSize * kInputPlanes);
     } else {
-      expandPlanes_Fp32_NCHW((float*)(tensor_mem_[0]), ipDataMasks,
+      expandPlanes_Fp32_NCHW((float*)(tensor_mem[0]), ipDataMasks,
                              ipDataValues, batchSize * kInputPlanes);
     }
 
     // debug code example
-    // dumpTensor(tensor_mem_[0], 512, "After expand Planes", fp16);
+    // dumpTensor(tensor_mem[0], 512, "After expand Planes", fp16);
 
     float* opPol = io->op_policy_mem_gpu_;
     float* opVal = io->op_value_mem_gpu_;
 
     int l = 0;
     // Input.
-    network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[0], nullptr,
-                        scratch_mem_, scratch_size_, cudnn_,
-                        cublas_);  // input conv
+    network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[0], nullptr,
+                        scratch_mem, scratch_size, cudnn,
+                        cublas);  // input conv
 
     // Residual block.
     for (int block = 0; block < numBlocks_; block++) {
-      network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // conv1
+      TRACE_RANGE("residual block");
+      network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                          scratch_mem, scratch_size, cudnn,
+                          cublas);  // conv1
 
       if (use_custom_winograd_) {
-        network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[0],
-                            tensor_mem_[2], scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // conv2
+        network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[0],
+                            tensor_mem[2], scratch_mem, scratch_size, cudnn,
+                            cublas);  // conv2
       } else {
         // For SE Resnet, skip connection is added after SE (and bias is added
         // as part of SE).
         if (has_se_) {
-          network_[l++]->Eval(batchSize, tensor_mem_[1], tensor_mem_[0],
-                              nullptr, scratch_mem_, scratch_size_, cudnn_,
-                              cublas_);  // conv2
+          network_[l++]->Eval(batchSize, tensor_mem[1], tensor_mem[0],
+                              nullptr, scratch_mem, scratch_size, cudnn,
+                              cublas);  // conv2
         } else {
-          network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[0],
-                              tensor_mem_[2], scratch_mem_, scratch_size_,
-                              cudnn_,
-                              cublas_);  // conv2
+          network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[0],
+                              tensor_mem[2], scratch_mem, scratch_size,
+                              cudnn,
+                              cublas);  // conv2
         }
 
         if (has_se_) {
-          network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[1],
-                              tensor_mem_[2], scratch_mem_, scratch_size_,
-                              cudnn_,
-                              cublas_);  // SE layer
+          network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[1],
+                              tensor_mem[2], scratch_mem, scratch_size,
+                              cudnn,
+                              cublas);  // SE layer
         }
       }
     }
 
     // Policy head.
     if (conv_policy_) {
-      network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // conv1
-
-      network_[l++]->Eval(batchSize, tensor_mem_[1], tensor_mem_[0], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // conv1
-
-      network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[1], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // pol FC
+      TRACE_RANGE("policy head");
+      network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                          scratch_mem, scratch_size, cudnn,
+                          cublas);  // conv1
+
+      network_[l++]->Eval(batchSize, tensor_mem[1], tensor_mem[0], nullptr,
+                          scratch_mem, scratch_size, cudnn,
+                          cublas);  // conv1
+
+      network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[1], nullptr,
+                          scratch_mem, scratch_size, cudnn,
+                          cublas);  // pol FC
       if (fp16) {
         // TODO: consider softmax layer that writes directly to fp32
-        network_[l++]->Eval(batchSize, tensor_mem_[1], tensor_mem_[0], nullptr,
-                            scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // pol softmax
-        copyTypeConverted(opPol, (half*)(tensor_mem_[1]),
+        network_[l++]->Eval(batchSize, tensor_mem[1], tensor_mem[0], nullptr,
+                            scratch_mem, scratch_size, cudnn,
+                            cublas);  // pol softmax
+        copyTypeConverted(opPol, (half*)(tensor_mem[1]),
                           batchSize * kNumOutputPolicy);  // POLICY
       } else {
-        network_[l++]->Eval(batchSize, (DataType*)opPol, tensor_mem_[0],
-                            nullptr, scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // pol softmax  // POLICY
+        network_[l++]->Eval(batchSize, (DataType*)opPol, tensor_mem[0],
+                            nullptr, scratch_mem, scratch_size, cudnn,
+                            cublas);  // pol softmax  // POLICY
       }
     } else {
-      network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // pol conv
-      network_[l++]->Eval(batchSize, tensor_mem_[1], tensor_mem_[0], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // pol FC
+      TRACE_RANGE("policy head");
+      network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                          scratch_mem, scratch_size, cudnn,
+                          cublas);  // pol conv
+      network_[l++]->Eval(batchSize, tensor_mem[1], tensor_mem[0], nullptr,
+                          scratch_mem, scratch_size, cudnn,
+                          cublas);  // pol FC
       if (fp16) {
         // TODO: consider softmax layer that writes directly to fp32.
-        network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[1], nullptr,
-                            scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // pol softmax
-        copyTypeConverted(opPol, (half*)(tensor_mem_[0]),
+        network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[1], nullptr,
+                            scratch_mem, scratch_size, cudnn,
+                            cublas);  // pol softmax
+        copyTypeConverted(opPol, (half*)(tensor_mem[0]),
                           batchSize * kNumOutputPolicy);  // POLICY
       } else {
-        network_[l++]->Eval(batchSize, (DataType*)opPol, tensor_mem_[1],
-                            nullptr, scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // pol softmax  // POLICY
+        network_[l++]->Eval(batchSize, (DataType*)opPol, tensor_mem[1],
+                            nullptr, scratch_mem, scratch_size, cudnn,
+                            cublas);  // pol softmax  // POLICY
       }
     }
 
-    // Copy policy output from device memory to host memory.
-    ReportCUDAErrors(cudaMemcpyAsync(
-        io->op_policy_mem_, io->op_policy_mem_gpu_,
-        sizeof(float) * kNumOutputPolicy * batchSize, cudaMemcpyDeviceToHost));
+    if (io->gather_policy_) {
+      TRACE_RANGE("policy gather");
+      // Only the policy of the legal moves goes back to the host.
+      gatherPolicy(io->op_gathered_policy_mem_gpu_, opPol,
+                   io->policy_indices_mem_gpu_, io->policy_temperature_mem_gpu_,
+                   batchSize, kNumOutputPolicy);
+    } else {
+      // Copy policy output from device memory to host memory.
+      ReportCUDAErrors(cudaMemcpyAsync(
+          io->op_policy_mem_, io->op_policy_mem_gpu_,
+          sizeof(float) * kNumOutputPolicy * batchSize, cudaMemcpyDeviceToHost,
+          cudaStreamPerThread));
+    }
 
     // value head
-    network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                        scratch_mem_, scratch_size_, cudnn_,
-                        cublas_);  // value conv
+    TRACE_RANGE("value head");
+    network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                        scratch_mem, scratch_size, cudnn,
+                        cublas);  // value conv
 
-    network_[l++]->Eval(batchSize, tensor_mem_[1], tensor_mem_[0], nullptr,
-                        scratch_mem_, scratch_size_, cudnn_,
-                        cublas_);  // value FC1
+    network_[l++]->Eval(batchSize, tensor_mem[1], tensor_mem[0], nullptr,
+                        scratch_mem, scratch_size, cudnn,
+                        cublas);  // value FC1
 
     if (wdl_) {
-      network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[1], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // value FC2    // VALUE
+      network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[1], nullptr,
+                          scratch_mem, scratch_size, cudnn,
+                          cublas);  // value FC2    // VALUE
 
       // Value softmax
       if (fp16) {
         // TODO: consider fusing the bias-add of FC2 with format conversion.
-        network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                            scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // value FC2
-        copyTypeConverted(opVal, (half*)(tensor_mem_[0]),
+        network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                            scratch_mem, scratch_size, cudnn,
+                            cublas);  // value FC2
+        copyTypeConverted(opVal, (half*)(tensor_mem[0]),
                           3 * batchSize);  // VALUE
       } else {
-        network_[l++]->Eval(batchSize, (DataType*)opVal, tensor_mem_[2],
-                            nullptr, scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // value FC2    // VALUE
+        network_[l++]->Eval(batchSize, (DataType*)opVal, tensor_mem[2],
+                            nullptr, scratch_mem, scratch_size, cudnn,
+                            cublas);  // value FC2    // VALUE
       }
     } else {
       if (fp16) {
         // TODO: consider fusing the bias-add of FC2 with format conversion.
-        network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[1], nullptr,
-                            scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // value FC2
-        copyTypeConverted(opVal, (half*)(tensor_mem_[2]), batchSize);  // VALUE
+        network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[1], nullptr,
+                            scratch_mem, scratch_size, cudnn,
+                            cublas);  // value FC2
+        copyTypeConverted(opVal, (half*)(tensor_mem[2]), batchSize);  // VALUE
       } else {
-        network_[l++]->Eval(batchSize, (DataType*)opVal, tensor_mem_[1],
-                            nullptr, scratch_mem_, scratch_size_, cudnn_,
-                            cublas_);  // value FC2    // VALUE
+        network_[l++]->Eval(batchSize, (DataType*)opVal, tensor_mem[1],
+                            nullptr, scratch_mem, scratch_size, cudnn,
+                            cublas);  // value FC2    // VALUE
       }
     }
-    ReportCUDAErrors(cudaDeviceSynchronize());
-
-#ifdef DEBUG_RAW_NPS
-    const int reportingCalls = 100;
-    static int numCalls = 0;
-    static int sumBatchSize = 0;
-    static double totalTime = 0;
-
-    sumBatchSize += batchSize;
-    numCalls++;
-
-    auto t_end = std::chrono::high_resolution_clock::now();
-
-    double dt = std::chrono::duration<double>(t_end - t_start).count();
-    totalTime += dt;
-    if (numCalls == reportingCalls) {
-      double avgBatchSize = ((double)sumBatchSize) / numCalls;
-      double nps = sumBatchSize / totalTime;
-      CERR << "Avg batch size: " << avgBatchSize
-           << ", NN eval time: " << totalTime << " seconds per " << sumBatchSize
-           << " evals. NPS: " << nps;
-      sumBatchSize = 0;
-      totalTime = 0;
-      numCalls = 0;
-    }
-#endif
   }
 
   ~CudnnNetwork() {
-    for (auto mem : tensor_mem_) {
-      if (mem) ReportCUDAErrors(cudaFree(mem));
-    }
     if (scratch_mem_) ReportCUDAErrors(cudaFree(scratch_mem_));
     cudnnDestroy(cudnn_);
     cublasDestroy(cublas_);
@@ -831,14 +1250,21 @@ class CudnnNetwork : public Network {
   std::unique_ptr<NetworkComputation> NewComputation() override {
     // Set correct gpu id for this computation (as it might have been called
     // from a different thread).
-    ReportCUDAErrors(cudaSetDevice(gpu_id_));
+    MakeCurrent();
     return std::make_unique<CudnnNetworkComputation<DataType>>(this, wdl_);
   }
 
+  void MakeCurrent() { ReportCUDAErrors(cudaSetDevice(gpu_id_)); }
+
   std::unique_ptr<InputsOutputs> GetInputsOutputs() {
     std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
     if (free_inputs_outputs_.empty()) {
-      return std::make_unique<InputsOutputs>(max_batch_size_, wdl_);
+      auto resource = std::make_unique<InputsOutputs>(
+          max_batch_size_, wdl_, tensor_size_, scratch_size_,
+          has_tensor_cores_, use_cuda_graphs_ ? 2 * graphBuckets() : 0);
+      io_host_bytes_ += resource->host_bytes_;
+      io_device_bytes_ += resource->device_bytes_;
+      return resource;
     } else {
       std::unique_ptr<InputsOutputs> resource =
           std::move(free_inputs_outputs_.front());
@@ -852,10 +1278,22 @@ class CudnnNetwork : public Network {
     free_inputs_outputs_.push_back(std::move(resource));
   }
 
+  size_t hostMemory() const override {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    return io_host_bytes_;
+  }
+
+  size_t deviceMemory() const override {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    return scratch_size_ + io_device_bytes_;
+  }
+
   // Apparently nvcc doesn't see constructor invocations through make_unique.
   // This function invokes constructor just to please complier and silence
   // warning. Is never called (but compiler thinks that it could).
-  void UglyFunctionToSilenceNvccWarning() { InputsOutputs io(0, false); }
+  void UglyFunctionToSilenceNvccWarning() {
+    InputsOutputs io(0, false, 0, 0, false, 0);
+  }
 
  private:
   cudnnHandle_t cudnn_;
@@ -870,8 +1308,12 @@ class CudnnNetwork : public Network {
   bool use_custom_winograd_;  // Custom winograd convolution implementation for
                               // convolutions of the residual tower.
 
-  // Currently only one NN Eval can happen a time (we can fix this if needed
-  // by allocating more memory).
+  bool has_tensor_cores_;
+  bool use_cuda_graphs_;  // Replay captured forward passes.
+
+  // The layers set their descriptors for the batch size at Eval so only one
+  // evaluation can be enqueued at a time. The work itself runs concurrently on
+  // the streams of the computations.
   mutable std::mutex lock_;
 
   int numBlocks_;
@@ -884,12 +1326,14 @@ class CudnnNetwork : public Network {
   BaseLayer<DataType>* policy_out_;
   BaseLayer<DataType>* value_out_;
 
-  DataType* tensor_mem_[3];
+  size_t tensor_size_;
   void* scratch_mem_;
   size_t scratch_size_;
 
   mutable std::mutex inputs_outputs_lock_;
   std::list<std::unique_ptr<InputsOutputs>> free_inputs_outputs_;
+  size_t io_host_bytes_ = 0;  // of every InputsOutputs created
+  size_t io_device_bytes_ = 0;
 
   void showInfo(const cudaDeviceProp& deviceProp) const {
 #ifndef DISABLE_FOR_ALLIE
@@ -996,6 +1440,7 @@ CudnnNetworkComputation<DataType>::CudnnNetworkComputation(
     : wdl_(wdl), network_(network) {
   batch_size_ = 0;
   inputs_outputs_ = network_->GetInputsOutputs();
+  inputs_outputs_->gather_policy_ = false;
 }
 
 template <typename DataType>
@@ -1005,52 +1450,72 @@ CudnnNetworkComputation<DataType>::~CudnnNetworkComputation() {
 
 template <typename DataType>
 void CudnnNetworkComputation<DataType>::ComputeBlocking() {
+  ComputeAsync();
+  WaitForCompletion();
+}
+
+template <typename DataType>
+void CudnnNetworkComputation<DataType>::ComputeAsync() {
   network_->forwardEval(inputs_outputs_.get(), GetBatchSize());
 }
 
 template <typename DataType>
-std::unique_ptr<Network> MakeCudnnNetwork(const WeightsFile& weights,
+void CudnnNetworkComputation<DataType>::WaitForCompletion() {
+  ReportCUDAErrors(cudaEventSynchronize(inputs_outputs_->done_event_));
+}
+
+template <typename DataType>
+bool CudnnNetworkComputation<DataType>::Reset() {
+  // The last batch may have been evaluated from another thread.
+  network_->MakeCurrent();
+  batch_size_ = 0;
+  inputs_outputs_->gather_policy_ = false;
+  return true;
+}
+
+template <typename DataType>
+std::unique_ptr<Network> MakeCudnnNetwork(const ConvertedWeights& weights,
                                           const OptionsDict& options) {
-  if (weights.format().network_format().network() !=
+  if (weights.network !=
           pblczero::NetworkFormat::NETWORK_CLASSICAL_WITH_HEADFORMAT &&
-      weights.format().network_format().network() !=
+      weights.network !=
           pblczero::NetworkFormat::NETWORK_SE_WITH_HEADFORMAT) {
 #ifndef DISABLE_FOR_ALLIE
     throw Exception(
         "Network format " +
-        std::to_string(weights.format().network_format().network()) +
+        std::to_string(weights.network) +
         " is not supported by CuDNN backend.");
 #else
     qDebug() << "Network format " +
-        QString::fromStdString(std::to_string(weights.format().network_format().network())) +
+        QString::fromStdString(std::to_string(weights.network)) +
         " is not supported by CuDNN backend.";
 #endif
   }
-  if (weights.format().network_format().policy() !=
+  if (weights.policy !=
           pblczero::NetworkFormat::POLICY_CLASSICAL &&
-      weights.format().network_format().policy() !=
+      weights.policy !=
           pblczero::NetworkFormat::POLICY_CONVOLUTION) {
 #ifndef DISABLE_FOR_ALLIE
     throw Exception("Policy format " +
-                    std::to_string(weights.format().network_format().policy()) +
+                    std::to_string(weights.policy) +
                     " is not supported by CuDNN backend.");
 #else
     qDebug() << "Policy format " +
-                    QString::fromStdString(std::to_string(weights.format().network_format().policy())) +
+                    QString::fromStdString(std::to_string(weights.policy)) +
                     " is not supported by CuDNN backend.";
 #endif
   }
-  if (weights.format().network_format().value() !=
+  if (weights.value !=
           pblczero::NetworkFormat::VALUE_CLASSICAL &&
-      weights.format().network_format().value() !=
+      weights.value !=
           pblczero::NetworkFormat::VALUE_WDL) {
 #ifndef DISABLE_FOR_ALLIE
     throw Exception("Value format " +
-                    std::to_string(weights.format().network_format().value()) +
+                    std::to_string(weights.value) +
                     " is not supported by CuDNN backend.");
 #else
     qDebug() << "Value format " +
-                    QString::fromStdString(std::to_string(weights.format().network_format().value())) +
+                    QString::fromStdString(std::to_string(weights.value)) +
                     " is not supported by CuDNN backend.";
 #endif
   }
@@ -1061,24 +1526,40 @@ std::unique_ptr<Network> MakeCudnnNetwork(const WeightsFile& weights,
 REGISTER_NETWORK("cudnn", MakeCudnnNetwork<float>, 110)
 REGISTER_NETWORK("cudnn-fp16", MakeCudnnNetwork<half>, 105)
 #else
-Network *createCudaFP16Network(const WeightsFile& file, int id, bool useCustomWinograd)
+Network *createCudaFP16Network(const ConvertedWeights& file, int id, int maxBatchSize,
+    int computations, bool useCustomWinograd, bool useCudaGraphs, const std::string& tuningFile)
 {
     OptionsDict o;
     o.gpuId = id;
-    o.maxBatchSize = 1024;
+    o.maxBatchSize = maxBatchSize;
+    o.computations = computations;
     o.useCustomWinograd = useCustomWinograd;
+    o.useCudaGraphs = useCudaGraphs;
+    o.tuningFile = tuningFile;
     return MakeCudnnNetwork<half>(file, o).release();
 }
 
-Network *createCudaNetwork(const WeightsFile& file, int id, bool useCustomWinograd)
+Network *createCudaNetwork(const ConvertedWeights& file, int id, int maxBatchSize,
+    int computations, bool useCustomWinograd, bool useCudaGraphs, const std::string& tuningFile)
 {
     OptionsDict o;
     o.gpuId = id;
-    o.maxBatchSize = 1024;
+    o.maxBatchSize = maxBatchSize;
+    o.computations = computations;
     o.useCustomWinograd = useCustomWinograd;
+    o.useCudaGraphs = useCudaGraphs;
+    o.tuningFile = tuningFile;
     return MakeCudnnNetwork<float>(file, o).release();
 }
 
+std::string cudaDeviceBusId(int id)
+{
+    char busId[32];
+    if (cudaDeviceGetPCIBusId(busId, sizeof(busId), id) != cudaSuccess)
+        return std::string();
+    return busId;
+}
+
 #endif
 
 }  // namespace lczero
@@ -33,6 +33,7 @@
 #include <algorithm>
 #include <cctype>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 #include <string>
@@ -41,6 +42,9 @@
 
 #include "allie_shim.h"
 
+#include <QFile>
+#include <QFileInfo>
+
 #ifndef DISABLE_FOR_ALLIE
 #include "utils/commandline.h"
 #include "utils/exception.h"
@@ -167,8 +171,167 @@ WeightsFile ParseWeightsProto(const std::string& buffer) {
   return net;
 }
 
+// Cache of converted weights, the header is followed by the vectors of the
+// weights in the order of VisitVectors each as a count and its floats.
+const char kConvertedMagic[8] = {'A', 'L', 'L', 'I', 'E', 'C', 'W', '1'};
+const char* kConvertedSuffix = ".converted";
+
+struct ConvertedHeader {
+  char magic[8];
+  std::uint64_t key;
+  std::int32_t network;
+  std::int32_t policy;
+  std::int32_t value;
+  std::int32_t residuals;
+};
+
+template <typename Weights, typename Visitor>
+void VisitConvBlock(Weights& block, Visitor visit) {
+  visit(block.weights);
+  visit(block.biases);
+  visit(block.bn_gammas);
+  visit(block.bn_betas);
+  visit(block.bn_means);
+  visit(block.bn_stddivs);
+}
+
+template <typename Weights, typename Visitor>
+void VisitVectors(Weights& weights, Visitor visit) {
+  VisitConvBlock(weights.input, visit);
+  for (auto& residual : weights.residual) {
+    VisitConvBlock(residual.conv1, visit);
+    VisitConvBlock(residual.conv2, visit);
+    visit(residual.se.w1);
+    visit(residual.se.b1);
+    visit(residual.se.w2);
+    visit(residual.se.b2);
+  }
+  VisitConvBlock(weights.policy1, visit);
+  VisitConvBlock(weights.policy, visit);
+  visit(weights.ip_pol_w);
+  visit(weights.ip_pol_b);
+  VisitConvBlock(weights.value, visit);
+  visit(weights.ip1_val_w);
+  visit(weights.ip1_val_b);
+  visit(weights.ip2_val_w);
+  visit(weights.ip2_val_b);
+}
+
+bool ReadConvertedWeights(const std::string& filename, std::uint64_t key,
+                          ConvertedWeights* converted) {
+  QFile file(QString::fromStdString(filename));
+  if (!file.open(QIODevice::ReadOnly)) return false;
+  const qint64 size = file.size();
+  if (size < qint64(sizeof(ConvertedHeader))) return false;
+  const uchar* data = file.map(0, size);
+  if (!data) return false;
+
+  ConvertedHeader header;
+  memcpy(&header, data, sizeof(header));
+  bool valid = !memcmp(header.magic, kConvertedMagic, sizeof(kConvertedMagic)) &&
+               header.key == key && header.residuals >= 0;
+  if (valid) {
+    converted->network =
+        pblczero::NetworkFormat::NetworkStructure(header.network);
+    converted->policy = pblczero::NetworkFormat::PolicyFormat(header.policy);
+    converted->value = pblczero::NetworkFormat::ValueFormat(header.value);
+    converted->weights.residual.resize(size_t(header.residuals));
+
+    qint64 offset = sizeof(header);
+    VisitVectors(converted->weights, [&](std::vector<float>& vector) {
+      std::uint64_t count = 0;
+      if (!valid || offset + qint64(sizeof(count)) > size) {
+        valid = false;
+        return;
+      }
+      memcpy(&count, data + offset, sizeof(count));
+      offset += sizeof(count);
+      if (count > std::uint64_t(size - offset) / sizeof(float)) {
+        valid = false;
+        return;
+      }
+      vector.resize(count);
+      memcpy(vector.data(), data + offset, count * sizeof(float));
+      offset += qint64(count * sizeof(float));
+    });
+    for (auto& residual : converted->weights.residual)
+      residual.has_se = !residual.se.w1.empty();
+  }
+  file.unmap(const_cast<uchar*>(data));
+  return valid;
+}
+
+void WriteConvertedWeights(const std::string& filename, std::uint64_t key,
+                           const ConvertedWeights& converted) {
+  // Written under a temporary name so a partial cache is never read
+  QFile file(QString::fromStdString(filename + ".tmp"));
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) return;
+
+  ConvertedHeader header;
+  memcpy(header.magic, kConvertedMagic, sizeof(kConvertedMagic));
+  header.key = key;
+  header.network = converted.network;
+  header.policy = converted.policy;
+  header.value = converted.value;
+  header.residuals = std::int32_t(converted.weights.residual.size());
+  bool ok = file.write(reinterpret_cast<const char*>(&header), sizeof(header)) ==
+            qint64(sizeof(header));
+  VisitVectors(converted.weights, [&](const std::vector<float>& vector) {
+    const std::uint64_t count = vector.size();
+    ok = ok && file.write(reinterpret_cast<const char*>(&count), sizeof(count)) ==
+                   qint64(sizeof(count));
+    ok = ok && file.write(reinterpret_cast<const char*>(vector.data()),
+                          qint64(count * sizeof(float))) ==
+                   qint64(count * sizeof(float));
+  });
+  file.close();
+
+  if (ok) {
+    QFile::remove(QString::fromStdString(filename));
+    ok = file.rename(QString::fromStdString(filename));
+  }
+  if (!ok) file.remove();
+}
+
 }  // namespace
 
+std::uint64_t HashFile(const std::string& filename) {
+  QFile file(QString::fromStdString(filename));
+  if (!file.open(QIODevice::ReadOnly)) return 0;
+  const qint64 size = file.size();
+  const uchar* data = file.map(0, size);
+  if (!data) return 0;
+
+  // FNV-1a over the words of the file, seeded with its size
+  std::uint64_t hash = 0xcbf29ce484222325ull ^ std::uint64_t(size);
+  qint64 i = 0;
+  for (; i + 8 <= size; i += 8) {
+    std::uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3ull;
+  }
+  for (; i < size; ++i) hash = (hash ^ data[i]) * 0x100000001b3ull;
+  file.unmap(const_cast<uchar*>(data));
+  return hash;
+}
+
+ConvertedWeights::ConvertedWeights(const WeightsFile& file)
+    : weights(file.weights()),
+      network(file.format().network_format().network()),
+      policy(file.format().network_format().policy()),
+      value(file.format().network_format().value()) {}
+
+ConvertedWeights LoadConvertedWeights(const std::string& filename) {
+  const std::uint64_t key = HashFile(filename);
+  const std::string cache = filename + kConvertedSuffix;
+  ConvertedWeights converted;
+  if (key && ReadConvertedWeights(cache, key, &converted)) return converted;
+
+  converted = ConvertedWeights(LoadWeightsFromFile(filename));
+  if (key) WriteConvertedWeights(cache, key, converted);
+  return converted;
+}
+
 WeightsFile LoadWeightsFromFile(const std::string& filename) {
   FloatVectors vecs;
   auto buffer = DecompressGzip(filename);
@@ -27,10 +27,12 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
 #include "neural/network.h"
+#include "neural/network_legacy.h"
 #include "proto/net.pb.h"
 
 namespace lczero {
@@ -43,13 +45,64 @@ using WeightsFile = pblczero::Net;
 // Read weights file and fill the weights structure.
 WeightsFile LoadWeightsFromFile(const std::string& filename);
 
+// The weights dequantized and with batch norm folded in, along with the
+// format of the network, as the backends take them.
+struct ConvertedWeights {
+  ConvertedWeights() = default;
+  explicit ConvertedWeights(const WeightsFile& file);
+
+  LegacyWeights weights;
+  pblczero::NetworkFormat::NetworkStructure network;
+  pblczero::NetworkFormat::PolicyFormat policy;
+  pblczero::NetworkFormat::ValueFormat value;
+};
+
+// Reads the converted weights from the cache next to the weights file if it
+// was written for the same contents, otherwise loads and converts the weights
+// file and writes the cache.
+ConvertedWeights LoadConvertedWeights(const std::string& filename);
+
+// Hash of the contents of a file, zero where it can not be read.
+std::uint64_t HashFile(const std::string& filename);
+
 // Tries to find a file which looks like a weights file, and located in
 // directory of binary_name or one of subdirectories. If there are several such
 // files, returns one which has the latest modification date.
 std::string DiscoverWeightsFile();
 
-Network *createCudaFP16Network(const WeightsFile& file, int id, bool useCustomWinograd);
-Network *createCudaNetwork(const WeightsFile& file, int id, bool useCustomWinograd);
+// Where tuningFile is not empty the residual path and the cudnn algorithms are
+// measured on the device, or read from the file where they were before, in
+// place of useCustomWinograd and the defaults. The buffers are sized for
+// batches of up to maxBatchSize and creation fails where the device can not
+// hold those of every one of the computations.
+Network *createCudaFP16Network(const ConvertedWeights& file, int id, int maxBatchSize,
+    int computations, bool useCustomWinograd, bool useCudaGraphs, const std::string& tuningFile);
+Network *createCudaNetwork(const ConvertedWeights& file, int id, int maxBatchSize,
+    int computations, bool useCustomWinograd, bool useCudaGraphs, const std::string& tuningFile);
+// The PCI bus id of the cuda device like "0000:65:00.0", empty where there is no such device.
+std::string cudaDeviceBusId(int id);
 Network *createBlasNetwork(const WeightsFile& file);
+// Runs on the processor with the batch split across this many threads.
+Network *createCpuNetwork(const ConvertedWeights& file, int threads, int maxBatchSize);
+// Needs no weights and returns values and policies hashed from the inputs,
+// taking at least latencyMicroseconds for every batch, to measure the search
+// on machines without a device.
+Network *createSyntheticNetwork(int latencyMicroseconds, int maxBatchSize);
+
+struct TensorRTOptions {
+  enum Precision { kFp32, kFp16, kInt8 };
+  int gpuId = 0;
+  int maxBatchSize = 1024;
+  Precision precision = kFp32;
+  // The engine and the int8 calibration are cached next to this file.
+  std::string weightsFile;
+  // The kInputPlanes masks and values of each position int8 is calibrated on.
+  std::vector<std::uint64_t> calibrationMasks;
+  std::vector<float> calibrationValues;
+};
+// Builds an engine for batches of up to options.maxBatchSize at the precision,
+// or loads the one built before for the same weights, device and settings.
+Network *createTensorRTNetwork(const ConvertedWeights& file,
+                               const TensorRTOptions& options);
 
 }  // namespace lczero
@@ -34,6 +34,11 @@ namespace lczero {
 
 const int kInputPlanes = 112;
 
+// The policy of at most this many legal moves can be gathered on the device.
+// The indices of a sample are its number of moves followed by their nn indices.
+const int kMaxPolicyIndices = 256;
+const int kPolicyIndicesStride = kMaxPolicyIndices + 1;
+
 // All input planes are 64 value vectors, every element of which is either
 // 0 or some value, unique for the plane. Therefore, input is defined as
 // a bitmask showing where to set the value, and the value itself.
@@ -54,8 +59,23 @@ class NetworkComputation {
  public:
   // Adds a sample to the batch.
   virtual void AddInput(InputPlanes *input) = 0;
+  // Returns the kInputPlanes masks and values of the next sample for the caller
+  // to fill in place and CommitInput() adds it to the batch. Returns false if
+  // the backend has no storage of its own and AddInput() must be used.
+  virtual bool GetInputSlot(uint64_t** /*masks*/, float** /*values*/) { return false; }
+  virtual void CommitInput() {}
+  // Returns kPolicyIndicesStride entries for the legal moves of the next
+  // sample, or nullptr if the backend cannot gather the policy on the device.
+  // If used, GetGatheredPVal() returns the policy of these moves raised to
+  // the inverse temperature and normalized.
+  virtual uint16_t* GetPolicyIndicesSlot() { return nullptr; }
+  virtual void SetPolicyTemperature(float /*inverseTemperature*/) {}
   // Do the computation.
   virtual void ComputeBlocking() = 0;
+  // Starts the computation without waiting for it and WaitForCompletion()
+  // blocks until the results are available.
+  virtual void ComputeAsync() { ComputeBlocking(); }
+  virtual void WaitForCompletion() {}
   // Returns how many times AddInput() was called.
   virtual int GetBatchSize() const = 0;
   // Returns Q value of @sample.
@@ -63,6 +83,12 @@ class NetworkComputation {
   virtual float GetDVal(int sample) const = 0;
   // Returns P value @move_id of @sample.
   virtual float GetPVal(int sample, int move_id) const = 0;
+  // Returns the gathered P value of the @i'th legal move of @sample.
+  virtual float GetGatheredPVal(int /*sample*/, int /*i*/) const { return 0.0f; }
+  // Empties the batch so that the computation and the buffers it holds serve
+  // the next one, on the calling thread. Returns false if the backend can not
+  // and a new computation is needed.
+  virtual bool Reset() { return false; }
   virtual ~NetworkComputation() {}
 };
 
@@ -70,6 +96,9 @@ class Network {
  public:
   virtual bool isCPU() const = 0;
   virtual std::unique_ptr<NetworkComputation> NewComputation() = 0;
+  // Bytes of the buffers allocated for the computations, not counting weights.
+  virtual size_t hostMemory() const { return 0; }
+  virtual size_t deviceMemory() const { return 0; }
   virtual ~Network(){};
 };
 
@@ -29,10 +29,12 @@ namespace lczero {
 // to it.
 
 struct LegacyWeights {
+  LegacyWeights() = default;
   explicit LegacyWeights(const pblczero::Weights& weights);
 
   using Vec = std::vector<float>;
   struct ConvBlock {
+    ConvBlock() = default;
     explicit ConvBlock(const pblczero::Weights::ConvBlock& block);
 
     Vec weights;
@@ -44,6 +46,7 @@ struct LegacyWeights {
   };
 
   struct SEunit {
+    SEunit() = default;
     explicit SEunit(const pblczero::Weights::SEunit& se);
     Vec w1;
     Vec b1;
@@ -52,11 +55,12 @@ struct LegacyWeights {
   };
 
   struct Residual {
+    Residual() = default;
     explicit Residual(const pblczero::Weights::Residual& residual);
     ConvBlock conv1;
     ConvBlock conv2;
     SEunit se;
-    bool has_se;
+    bool has_se = false;
   };
 
   // Input convnet.
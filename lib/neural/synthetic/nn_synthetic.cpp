@@ -0,0 +1,151 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018-2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "neural/loader.h"
+#include "neural/network.h"
+
+// Stands in for a real network where only the search is to be measured. The
+// value and the policy of a position are hashed from its input planes so that
+// a search is the same from run to run, and a batch takes as long as it is
+// told to so that the search waits on it the way it would on a device.
+
+namespace lczero {
+namespace {
+
+inline uint64_t Mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
+
+// In [0, 1) from the high bits.
+inline float Unit(uint64_t x) { return float(x >> 40) * (1.0f / float(1 << 24)); }
+
+class SyntheticNetworkComputation : public NetworkComputation {
+ public:
+  SyntheticNetworkComputation(int maxBatchSize,
+                              std::chrono::microseconds latency)
+      : masks_(size_t(maxBatchSize) * kInputPlanes),
+        values_(size_t(maxBatchSize) * kInputPlanes),
+        hashes_(size_t(maxBatchSize)),
+        max_batch_size_(maxBatchSize),
+        batch_size_(0),
+        latency_(latency) {}
+
+  void AddInput(InputPlanes* input) override {
+    uint64_t* masks;
+    float* values;
+    GetInputSlot(&masks, &values);
+    for (int i = 0; i < kInputPlanes; ++i) {
+      masks[i] = (*input)[size_t(i)].mask;
+      values[i] = (*input)[size_t(i)].value;
+    }
+    CommitInput();
+  }
+
+  bool GetInputSlot(uint64_t** masks, float** values) override {
+    assert(batch_size_ < max_batch_size_);
+    *masks = &masks_[size_t(batch_size_) * kInputPlanes];
+    *values = &values_[size_t(batch_size_) * kInputPlanes];
+    return true;
+  }
+
+  void CommitInput() override { batch_size_++; }
+
+  void ComputeBlocking() override {
+    for (int b = 0; b < batch_size_; ++b) {
+      const uint64_t* masks = &masks_[size_t(b) * kInputPlanes];
+      const float* values = &values_[size_t(b) * kInputPlanes];
+      uint64_t hash = 0;
+      for (int i = 0; i < kInputPlanes; ++i) {
+        uint32_t bits;
+        memcpy(&bits, &values[i], sizeof(bits));
+        hash = Mix(hash ^ masks[i] ^ (uint64_t(bits) << 32 | uint64_t(i)));
+      }
+      hashes_[size_t(b)] = hash;
+    }
+    if (latency_.count()) std::this_thread::sleep_for(latency_);
+  }
+
+  bool Reset() override {
+    batch_size_ = 0;
+    return true;
+  }
+
+  int GetBatchSize() const override { return batch_size_; }
+
+  // Modest values either way so that no line looks won or lost.
+  float GetQVal(int sample) const override {
+    return Unit(hashes_[size_t(sample)]) - 0.5f;
+  }
+
+  float GetDVal(int sample) const override {
+    return 0.5f * Unit(Mix(hashes_[size_t(sample)]));
+  }
+
+  // Positive and unnormalized as the search normalizes the legal moves.
+  float GetPVal(int sample, int move_id) const override {
+    return 0.01f + Unit(Mix(hashes_[size_t(sample)] ^ uint64_t(move_id)));
+  }
+
+ private:
+  std::vector<uint64_t> masks_;
+  std::vector<float> values_;
+  std::vector<uint64_t> hashes_;
+  int max_batch_size_;
+  int batch_size_;
+  std::chrono::microseconds latency_;
+};
+
+class SyntheticNetwork : public Network {
+ public:
+  SyntheticNetwork(int latencyMicroseconds, int maxBatchSize)
+      : latency_(std::max(0, latencyMicroseconds)),
+        max_batch_size_(std::max(1, maxBatchSize)) {}
+
+  bool isCPU() const override { return true; }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::unique_ptr<NetworkComputation>(
+        new SyntheticNetworkComputation(max_batch_size_, latency_));
+  }
+
+ private:
+  std::chrono::microseconds latency_;
+  int max_batch_size_;
+};
+
+}  // namespace
+
+Network* createSyntheticNetwork(int latencyMicroseconds, int maxBatchSize) {
+  return new SyntheticNetwork(latencyMicroseconds, maxBatchSize);
+}
+
+}  // namespace lczero
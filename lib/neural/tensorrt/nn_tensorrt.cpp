@@ -0,0 +1,754 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018-2019 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit, the NVIDIA CUDA Deep Neural Network library or NVIDIA TensorRT
+  (or a modified version of those libraries), containing parts covered by
+  the terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+#include <NvInfer.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <QFile>
+
+#include "neural/allie_shim.h"
+#include "neural/cuda/cuda_common.h"
+#include "neural/cuda/kernels.h"
+#include "neural/loader.h"
+#include "neural/network.h"
+#include "neural/shared/policy_map.h"
+
+namespace lczero {
+using namespace cudnn_backend;
+
+namespace {
+
+constexpr int kNumOutputPolicy = 1858;
+constexpr int kCalibrationBatch = 64;
+
+const char* kInputName = "input";
+const char* kPolicyName = "policy";
+const char* kValueName = "value";
+
+class Logger : public nvinfer1::ILogger {
+ public:
+  void log(Severity severity, const char* msg) noexcept override {
+    if (severity <= Severity::kWARNING) qDebug() << "TensorRT:" << msg;
+  }
+};
+
+Logger& TrtLogger() {
+  static Logger logger;
+  return logger;
+}
+
+template <typename T>
+struct TrtDeleter {
+  void operator()(T* object) const { delete object; }
+};
+
+template <typename T>
+using TrtPtr = std::unique_ptr<T, TrtDeleter<T>>;
+
+const char* PrecisionName(TensorRTOptions::Precision precision) {
+  switch (precision) {
+    case TensorRTOptions::kFp16:
+      return "fp16";
+    case TensorRTOptions::kInt8:
+      return "int8";
+    default:
+      return "fp32";
+  }
+}
+
+bool ReadFile(const std::string& filename, std::vector<char>* data) {
+  QFile file(QString::fromStdString(filename));
+  if (!file.open(QIODevice::ReadOnly)) return false;
+  const QByteArray bytes = file.readAll();
+  data->assign(bytes.constData(), bytes.constData() + bytes.size());
+  return !data->empty();
+}
+
+void WriteFile(const std::string& filename, const void* data, size_t size) {
+  // Written under a temporary name so a partial file is never read
+  QFile file(QString::fromStdString(filename + ".tmp"));
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) return;
+  bool ok = file.write(static_cast<const char*>(data), qint64(size)) ==
+            qint64(size);
+  file.close();
+  if (ok) {
+    QFile::remove(QString::fromStdString(filename));
+    ok = file.rename(QString::fromStdString(filename));
+  }
+  if (!ok) file.remove();
+}
+
+// Feeds the encoded positions to the builder a batch at a time so it can pick
+// the int8 ranges of every tensor. The ranges are kept in a file next to the
+// weights as they only depend on the weights and the positions.
+class Calibrator : public nvinfer1::IInt8EntropyCalibrator2 {
+ public:
+  Calibrator(const TensorRTOptions& options, const std::string& cacheFile)
+      : masks_(options.calibrationMasks),
+        values_(options.calibrationValues),
+        cache_file_(cacheFile),
+        next_(0) {
+    const size_t floats = kCalibrationBatch * kInputPlanes * 64;
+    host_.resize(floats);
+    ReportCUDAErrors(cudaMalloc(&device_, floats * sizeof(float)));
+  }
+  ~Calibrator() { cudaFree(device_); }
+
+  // The batch is that of the calibration profile for explicit batch networks
+  int32_t getBatchSize() const noexcept override { return 1; }
+
+  bool getBatch(void* bindings[], const char* names[],
+                int32_t nbBindings) noexcept override {
+    assert(nbBindings == 1 && !strcmp(names[0], kInputName));
+    (void)names;
+    (void)nbBindings;
+    const size_t positions = masks_.size() / kInputPlanes;
+    if (next_ + kCalibrationBatch > positions) return false;
+
+    std::fill(host_.begin(), host_.end(), 0.0f);
+    for (int n = 0; n < kCalibrationBatch; ++n) {
+      for (int p = 0; p < kInputPlanes; ++p) {
+        const size_t plane = (next_ + n) * kInputPlanes + p;
+        float* out = &host_[(n * kInputPlanes + p) * 64];
+        for (int sq = 0; sq < 64; ++sq)
+          if (masks_[plane] & (1ull << sq)) out[sq] = values_[plane];
+      }
+    }
+    next_ += kCalibrationBatch;
+    ReportCUDAErrors(cudaMemcpy(device_, host_.data(),
+                                host_.size() * sizeof(float),
+                                cudaMemcpyHostToDevice));
+    bindings[0] = device_;
+    return true;
+  }
+
+  const void* readCalibrationCache(size_t& length) noexcept override {
+    cache_.clear();
+    if (!ReadFile(cache_file_, &cache_)) return nullptr;
+    length = cache_.size();
+    return cache_.data();
+  }
+
+  void writeCalibrationCache(const void* cache,
+                             size_t length) noexcept override {
+    WriteFile(cache_file_, cache, length);
+  }
+
+ private:
+  const std::vector<uint64_t>& masks_;
+  const std::vector<float>& values_;
+  const std::string cache_file_;
+  std::vector<float> host_;
+  std::vector<char> cache_;
+  void* device_;
+  size_t next_;
+};
+
+// Describes the network with the layers of TensorRT, which fuses and times
+// them for the device. The weights must outlive the build so they are copied
+// into storage the builder owns.
+class NetworkBuilder {
+ public:
+  NetworkBuilder(nvinfer1::INetworkDefinition* network) : network_(network) {}
+
+  nvinfer1::ITensor* Conv(nvinfer1::ITensor* input, int outputs, int size,
+                          const std::vector<float>& weights,
+                          const std::vector<float>& biases, bool relu) {
+    auto conv = network_->addConvolutionNd(*input, outputs,
+                                           nvinfer1::DimsHW{size, size},
+                                           Store(weights), Store(biases));
+    conv->setPaddingNd(nvinfer1::DimsHW{size / 2, size / 2});
+    nvinfer1::ITensor* output = conv->getOutput(0);
+    return relu ? Activation(output, nvinfer1::ActivationType::kRELU) : output;
+  }
+
+  // Fully connected layers are 1x1 convolutions of the flattened input
+  nvinfer1::ITensor* FullyConnected(nvinfer1::ITensor* input, int outputs,
+                                    const std::vector<float>& weights,
+                                    const std::vector<float>& biases,
+                                    bool relu) {
+    return Conv(Reshape(input, nvinfer1::Dims4{0, -1, 1, 1}), outputs, 1,
+                weights, biases, relu);
+  }
+
+  nvinfer1::ITensor* Activation(nvinfer1::ITensor* input,
+                                nvinfer1::ActivationType type) {
+    return network_->addActivation(*input, type)->getOutput(0);
+  }
+
+  nvinfer1::ITensor* Add(nvinfer1::ITensor* a, nvinfer1::ITensor* b,
+                         nvinfer1::ElementWiseOperation op =
+                             nvinfer1::ElementWiseOperation::kSUM) {
+    return network_->addElementWise(*a, *b, op)->getOutput(0);
+  }
+
+  nvinfer1::ITensor* Reshape(nvinfer1::ITensor* input,
+                             const nvinfer1::Dims& dims) {
+    auto shuffle = network_->addShuffle(*input);
+    shuffle->setReshapeDimensions(dims);
+    return shuffle->getOutput(0);
+  }
+
+  nvinfer1::ITensor* SoftMax(nvinfer1::ITensor* input) {
+    auto softmax = network_->addSoftMax(*input);
+    softmax->setAxes(1 << 1);
+    return softmax->getOutput(0);
+  }
+
+  // Scales the channels of the second convolution by the sigmoid of the first
+  // half of the excitation and shifts them by the second half.
+  nvinfer1::ITensor* SqueezeExcite(nvinfer1::ITensor* input,
+                                   nvinfer1::ITensor* skip, int channels,
+                                   const LegacyWeights::SEunit& se) {
+    auto pooled = network_->addReduce(*input, nvinfer1::ReduceOperation::kAVG,
+                                      (1 << 2) | (1 << 3), true)
+                      ->getOutput(0);
+    const int hidden = int(se.b1.size());
+    auto squeezed = Conv(pooled, hidden, 1, se.w1, se.b1, true);
+
+    const size_t half = size_t(channels) * hidden;
+    std::vector<float> w(se.w2.begin(), se.w2.begin() + half);
+    std::vector<float> b(se.b2.begin(), se.b2.begin() + channels);
+    auto gamma = Activation(Conv(squeezed, channels, 1, w, b, false),
+                            nvinfer1::ActivationType::kSIGMOID);
+    w.assign(se.w2.begin() + half, se.w2.end());
+    b.assign(se.b2.begin() + channels, se.b2.end());
+    auto beta = Conv(squeezed, channels, 1, w, b, false);
+
+    auto scaled = Add(input, gamma, nvinfer1::ElementWiseOperation::kPROD);
+    return Activation(Add(Add(scaled, beta), skip),
+                      nvinfer1::ActivationType::kRELU);
+  }
+
+  // The policy map picks the entries of the policy from the planes of the
+  // convolution, as a gather of the inverse of the map.
+  nvinfer1::ITensor* PolicyMap(nvinfer1::ITensor* input) {
+    std::vector<int32_t> indices(kNumOutputPolicy, 0);
+    for (int i = 0; i < 73 * 64; ++i)
+      if (kConvPolicyMap[i] >= 0) indices[kConvPolicyMap[i]] = i;
+    index_storage_.emplace_back(std::move(indices));
+    const auto& stored = index_storage_.back();
+    nvinfer1::Dims dims;
+    dims.nbDims = 1;
+    dims.d[0] = kNumOutputPolicy;
+    auto constant = network_->addConstant(
+        dims, nvinfer1::Weights{nvinfer1::DataType::kINT32, stored.data(),
+                                int64_t(stored.size())});
+    auto flat = Reshape(input, nvinfer1::Dims2{0, -1});
+    return network_->addGather(*flat, *constant->getOutput(0), 1)
+        ->getOutput(0);
+  }
+
+ private:
+  nvinfer1::Weights Store(const std::vector<float>& weights) {
+    float_storage_.emplace_back(weights);
+    const auto& stored = float_storage_.back();
+    return nvinfer1::Weights{nvinfer1::DataType::kFLOAT, stored.data(),
+                             int64_t(stored.size())};
+  }
+
+  nvinfer1::INetworkDefinition* network_;
+  std::deque<std::vector<float>> float_storage_;
+  std::deque<std::vector<int32_t>> index_storage_;
+};
+
+// Each computation has its own execution context, buffers and event so that
+// computations can run at once on the per thread default streams of their
+// callers.
+struct InputsOutputs {
+  InputsOutputs(nvinfer1::ICudaEngine* engine, int maxBatchSize, bool wdl)
+      : context_(engine->createExecutionContext()) {
+    if (!context_) qFatal("TensorRT could not create an execution context");
+    const int values = wdl ? 3 : 1;
+    host_bytes_ =
+        maxBatchSize * (kInputPlanes * (sizeof(uint64_t) + sizeof(float)) +
+                        (kNumOutputPolicy + values + kMaxPolicyIndices) *
+                            sizeof(float) +
+                        kPolicyIndicesStride * sizeof(uint16_t)) +
+        sizeof(float);
+    device_bytes_ = maxBatchSize * (kInputPlanes * 64 + kNumOutputPolicy +
+                                    values) * sizeof(float);
+
+    ReportCUDAErrors(cudaHostAlloc(
+        &input_masks_mem_, maxBatchSize * kInputPlanes * sizeof(uint64_t),
+        cudaHostAllocMapped));
+    ReportCUDAErrors(
+        cudaHostGetDevicePointer(&input_masks_mem_gpu_, input_masks_mem_, 0));
+    ReportCUDAErrors(cudaHostAlloc(&input_val_mem_,
+                                   maxBatchSize * kInputPlanes * sizeof(float),
+                                   cudaHostAllocMapped));
+    ReportCUDAErrors(
+        cudaHostGetDevicePointer(&input_val_mem_gpu_, input_val_mem_, 0));
+    ReportCUDAErrors(cudaMalloc(
+        &input_gpu_, maxBatchSize * kInputPlanes * 64 * sizeof(float)));
+
+    ReportCUDAErrors(cudaHostAlloc(
+        &op_policy_mem_, maxBatchSize * kNumOutputPolicy * sizeof(float), 0));
+    ReportCUDAErrors(cudaMalloc(
+        &op_policy_mem_gpu_, maxBatchSize * kNumOutputPolicy * sizeof(float)));
+    ReportCUDAErrors(
+        cudaHostAlloc(&op_value_mem_, maxBatchSize * values * sizeof(float), 0));
+    ReportCUDAErrors(
+        cudaMalloc(&op_value_mem_gpu_, maxBatchSize * values * sizeof(float)));
+
+    ReportCUDAErrors(cudaHostAlloc(
+        &policy_indices_mem_,
+        maxBatchSize * kPolicyIndicesStride * sizeof(uint16_t),
+        cudaHostAllocMapped));
+    ReportCUDAErrors(cudaHostGetDevicePointer(&policy_indices_mem_gpu_,
+                                              policy_indices_mem_, 0));
+    memset(policy_indices_mem_, 0,
+           maxBatchSize * kPolicyIndicesStride * sizeof(uint16_t));
+    ReportCUDAErrors(cudaHostAlloc(&policy_temperature_mem_, sizeof(float),
+                                   cudaHostAllocMapped));
+    ReportCUDAErrors(cudaHostGetDevicePointer(&policy_temperature_mem_gpu_,
+                                              policy_temperature_mem_, 0));
+    *policy_temperature_mem_ = 1.0f;
+    ReportCUDAErrors(cudaHostAlloc(
+        &op_gathered_policy_mem_,
+        maxBatchSize * kMaxPolicyIndices * sizeof(float), cudaHostAllocMapped));
+    ReportCUDAErrors(cudaHostGetDevicePointer(&op_gathered_policy_mem_gpu_,
+                                              op_gathered_policy_mem_, 0));
+
+    ReportCUDAErrors(
+        cudaEventCreateWithFlags(&done_event_, cudaEventDisableTiming));
+  }
+  ~InputsOutputs() {
+    context_.reset();
+    ReportCUDAErrors(cudaFreeHost(input_masks_mem_));
+    ReportCUDAErrors(cudaFreeHost(input_val_mem_));
+    ReportCUDAErrors(cudaFree(input_gpu_));
+    ReportCUDAErrors(cudaFreeHost(op_policy_mem_));
+    ReportCUDAErrors(cudaFree(op_policy_mem_gpu_));
+    ReportCUDAErrors(cudaFreeHost(op_value_mem_));
+    ReportCUDAErrors(cudaFree(op_value_mem_gpu_));
+    ReportCUDAErrors(cudaFreeHost(policy_indices_mem_));
+    ReportCUDAErrors(cudaFreeHost(policy_temperature_mem_));
+    ReportCUDAErrors(cudaFreeHost(op_gathered_policy_mem_));
+    cudaEventDestroy(done_event_);
+  }
+
+  TrtPtr<nvinfer1::IExecutionContext> context_;
+
+  uint64_t* input_masks_mem_;
+  float* input_val_mem_;
+  uint64_t* input_masks_mem_gpu_;
+  float* input_val_mem_gpu_;
+  // The planes expanded on the device as the engine takes them.
+  float* input_gpu_;
+
+  float* op_policy_mem_;
+  float* op_value_mem_;
+  float* op_policy_mem_gpu_;
+  float* op_value_mem_gpu_;
+
+  // The policy of the legal moves is gathered on the device when set.
+  bool gather_policy_ = false;
+  uint16_t* policy_indices_mem_;
+  float* policy_temperature_mem_;
+  float* op_gathered_policy_mem_;
+  uint16_t* policy_indices_mem_gpu_;
+  float* policy_temperature_mem_gpu_;
+  float* op_gathered_policy_mem_gpu_;
+
+  size_t host_bytes_;
+  size_t device_bytes_;
+
+  cudaEvent_t done_event_;
+};
+
+class TensorRTNetwork;
+
+class TensorRTNetworkComputation : public NetworkComputation {
+ public:
+  TensorRTNetworkComputation(TensorRTNetwork* network, bool wdl);
+  ~TensorRTNetworkComputation();
+
+  void AddInput(InputPlanes* input) override {
+    const auto iter_mask =
+        &inputs_outputs_->input_masks_mem_[batch_size_ * kInputPlanes];
+    const auto iter_val =
+        &inputs_outputs_->input_val_mem_[batch_size_ * kInputPlanes];
+    int i = 0;
+    for (const auto& plane : *input) {
+      iter_mask[i] = plane.mask;
+      iter_val[i] = plane.value;
+      i++;
+    }
+    batch_size_++;
+  }
+
+  bool GetInputSlot(uint64_t** masks, float** values) override {
+    *masks = &inputs_outputs_->input_masks_mem_[batch_size_ * kInputPlanes];
+    *values = &inputs_outputs_->input_val_mem_[batch_size_ * kInputPlanes];
+    return true;
+  }
+
+  void CommitInput() override { batch_size_++; }
+
+  uint16_t* GetPolicyIndicesSlot() override {
+    return &inputs_outputs_
+                ->policy_indices_mem_[batch_size_ * kPolicyIndicesStride];
+  }
+
+  void SetPolicyTemperature(float inverseTemperature) override {
+    inputs_outputs_->gather_policy_ = true;
+    *inputs_outputs_->policy_temperature_mem_ = inverseTemperature;
+  }
+
+  void ComputeBlocking() override {
+    ComputeAsync();
+    WaitForCompletion();
+  }
+  void ComputeAsync() override;
+  void WaitForCompletion() override {
+    ReportCUDAErrors(cudaEventSynchronize(inputs_outputs_->done_event_));
+  }
+  bool Reset() override;
+
+  int GetBatchSize() const override { return batch_size_; }
+
+  float GetQVal(int sample) const override {
+    if (wdl_) {
+      auto w = inputs_outputs_->op_value_mem_[3 * sample + 0];
+      auto l = inputs_outputs_->op_value_mem_[3 * sample + 2];
+      return w - l;
+    }
+    return inputs_outputs_->op_value_mem_[sample];
+  }
+
+  float GetDVal(int sample) const override {
+    return wdl_ ? inputs_outputs_->op_value_mem_[3 * sample + 1] : 0.0f;
+  }
+
+  float GetPVal(int sample, int move_id) const override {
+    return inputs_outputs_->op_policy_mem_[sample * kNumOutputPolicy + move_id];
+  }
+
+  float GetGatheredPVal(int sample, int i) const override {
+    return inputs_outputs_
+        ->op_gathered_policy_mem_[sample * kMaxPolicyIndices + i];
+  }
+
+ private:
+  std::unique_ptr<InputsOutputs> inputs_outputs_;
+  int batch_size_;
+  bool wdl_;
+  TensorRTNetwork* network_;
+};
+
+class TensorRTNetwork : public Network {
+ public:
+  TensorRTNetwork(const ConvertedWeights& file, const TensorRTOptions& options)
+      : gpu_id_(options.gpuId),
+        max_batch_size_(std::max(1, options.maxBatchSize)),
+        wdl_(file.value == pblczero::NetworkFormat::VALUE_WDL) {
+    int total_gpus;
+    ReportCUDAErrors(cudaGetDeviceCount(&total_gpus));
+    if (gpu_id_ >= total_gpus) qFatal("Invalid GPU Id: %d", gpu_id_);
+    ReportCUDAErrors(cudaSetDevice(gpu_id_));
+
+    cudaDeviceProp deviceProp = {};
+    cudaGetDeviceProperties(&deviceProp, gpu_id_);
+
+    // The ranges of int8 come from the positions or from the calibration of
+    // them kept before.
+    const uint64_t key = HashFile(options.weightsFile);
+    char suffix[128];
+    snprintf(suffix, sizeof(suffix), ".%016llx.calibration",
+             (unsigned long long)key);
+    const std::string calibration_file = options.weightsFile + suffix;
+    TensorRTOptions::Precision precision = options.precision;
+    if (precision == TensorRTOptions::kInt8 &&
+        options.calibrationMasks.size() / kInputPlanes < kCalibrationBatch &&
+        !QFile::exists(QString::fromStdString(calibration_file))) {
+      qDebug() << "TensorRT: int8 needs at least" << kCalibrationBatch
+               << "calibration positions, building fp16";
+      precision = TensorRTOptions::kFp16;
+    }
+
+    // The engine is only good for the weights, precision, largest batch,
+    // device and version of TensorRT it was built with so all of those name
+    // its cache file.
+    snprintf(suffix, sizeof(suffix), ".%016llx.%s.b%d.sm%d%d.trt%d.engine",
+             (unsigned long long)key, PrecisionName(precision),
+             max_batch_size_, deviceProp.major, deviceProp.minor,
+             getInferLibVersion());
+    const std::string engine_file = options.weightsFile + suffix;
+
+    runtime_.reset(nvinfer1::createInferRuntime(TrtLogger()));
+    std::vector<char> plan;
+    if (key && ReadFile(engine_file, &plan))
+      engine_.reset(runtime_->deserializeCudaEngine(plan.data(), plan.size()));
+
+    if (!engine_) {
+      qDebug() << "TensorRT: building the" << PrecisionName(precision)
+               << "engine for batches up to" << max_batch_size_
+               << "which takes a while the first time";
+      TrtPtr<nvinfer1::IHostMemory> serialized(
+          Build(file, options, precision, calibration_file));
+      if (!serialized) qFatal("TensorRT could not build the network");
+      if (key) WriteFile(engine_file, serialized->data(), serialized->size());
+      engine_.reset(runtime_->deserializeCudaEngine(serialized->data(),
+                                                    serialized->size()));
+      if (!engine_) qFatal("TensorRT could not load the network it built");
+    }
+  }
+
+  bool isCPU() const override { return false; }
+
+  void forwardEval(InputsOutputs* io, int batchSize) {
+    if (!batchSize) {
+      ReportCUDAErrors(cudaEventRecord(io->done_event_, cudaStreamPerThread));
+      return;
+    }
+    // The buffers are sized for the batches the engine was built for
+    assert(batchSize <= max_batch_size_);
+
+    expandPlanes_Fp32_NCHW(io->input_gpu_, io->input_masks_mem_gpu_,
+                           io->input_val_mem_gpu_, batchSize * kInputPlanes);
+    const int values = wdl_ ? 3 : 1;
+    auto context = io->context_.get();
+    context->setTensorAddress(kInputName, io->input_gpu_);
+    context->setTensorAddress(kPolicyName, io->op_policy_mem_gpu_);
+    context->setTensorAddress(kValueName, io->op_value_mem_gpu_);
+    context->setInputShape(kInputName,
+                           nvinfer1::Dims4{batchSize, kInputPlanes, 8, 8});
+    if (!context->enqueueV3(cudaStreamPerThread))
+      qFatal("TensorRT could not run the network");
+
+    if (io->gather_policy_) {
+      // Only the policy of the legal moves goes back to the host.
+      gatherPolicy(io->op_gathered_policy_mem_gpu_, io->op_policy_mem_gpu_,
+                   io->policy_indices_mem_gpu_, io->policy_temperature_mem_gpu_,
+                   batchSize, kNumOutputPolicy);
+    } else {
+      ReportCUDAErrors(cudaMemcpyAsync(
+          io->op_policy_mem_, io->op_policy_mem_gpu_,
+          sizeof(float) * kNumOutputPolicy * batchSize, cudaMemcpyDeviceToHost,
+          cudaStreamPerThread));
+    }
+    ReportCUDAErrors(cudaMemcpyAsync(
+        io->op_value_mem_, io->op_value_mem_gpu_,
+        sizeof(float) * values * batchSize, cudaMemcpyDeviceToHost,
+        cudaStreamPerThread));
+    ReportCUDAErrors(cudaEventRecord(io->done_event_, cudaStreamPerThread));
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    MakeCurrent();
+    return std::make_unique<TensorRTNetworkComputation>(this, wdl_);
+  }
+
+  void MakeCurrent() { ReportCUDAErrors(cudaSetDevice(gpu_id_)); }
+
+  std::unique_ptr<InputsOutputs> GetInputsOutputs() {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    if (free_inputs_outputs_.empty()) {
+      auto io = std::make_unique<InputsOutputs>(engine_.get(),
+                                                max_batch_size_, wdl_);
+      io_host_bytes_ += io->host_bytes_;
+      io_device_bytes_ += io->device_bytes_;
+      return io;
+    }
+    std::unique_ptr<InputsOutputs> resource =
+        std::move(free_inputs_outputs_.front());
+    free_inputs_outputs_.pop_front();
+    return resource;
+  }
+
+  void ReleaseInputsOutputs(std::unique_ptr<InputsOutputs> resource) {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    free_inputs_outputs_.push_back(std::move(resource));
+  }
+
+  size_t hostMemory() const override {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    return io_host_bytes_;
+  }
+
+  size_t deviceMemory() const override {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    return io_device_bytes_ + engine_->getDeviceMemorySize();
+  }
+
+ private:
+  nvinfer1::IHostMemory* Build(const ConvertedWeights& file,
+                               const TensorRTOptions& options,
+                               TensorRTOptions::Precision precision,
+                               const std::string& calibrationFile) {
+    const LegacyWeights& weights = file.weights;
+    const int filters = int(weights.input.biases.size());
+
+    TrtPtr<nvinfer1::IBuilder> builder(
+        nvinfer1::createInferBuilder(TrtLogger()));
+    TrtPtr<nvinfer1::INetworkDefinition> network(builder->createNetworkV2(
+        1U << uint32_t(
+            nvinfer1::NetworkDefinitionCreationFlag::kEXPLICIT_BATCH)));
+    NetworkBuilder b(network.get());
+
+    auto input = network->addInput(kInputName, nvinfer1::DataType::kFLOAT,
+                                   nvinfer1::Dims4{-1, kInputPlanes, 8, 8});
+    auto flow = b.Conv(input, filters, 3, weights.input.weights,
+                       weights.input.biases, true);
+    for (const auto& residual : weights.residual) {
+      auto conv1 = b.Conv(flow, filters, 3, residual.conv1.weights,
+                          residual.conv1.biases, true);
+      auto conv2 = b.Conv(conv1, filters, 3, residual.conv2.weights,
+                          residual.conv2.biases, false);
+      flow = residual.has_se
+                 ? b.SqueezeExcite(conv2, flow, filters, residual.se)
+                 : b.Activation(b.Add(conv2, flow),
+                                nvinfer1::ActivationType::kRELU);
+    }
+
+    nvinfer1::ITensor* policy;
+    if (file.policy == pblczero::NetworkFormat::POLICY_CONVOLUTION) {
+      auto conv1 = b.Conv(flow, filters, 3, weights.policy1.weights,
+                          weights.policy1.biases, true);
+      auto conv2 = b.Conv(conv1, int(weights.policy.biases.size()), 3,
+                          weights.policy.weights, weights.policy.biases, false);
+      policy = b.PolicyMap(conv2);
+    } else {
+      auto conv = b.Conv(flow, int(weights.policy.biases.size()), 1,
+                         weights.policy.weights, weights.policy.biases, true);
+      policy = b.Reshape(b.FullyConnected(conv, int(weights.ip_pol_b.size()),
+                                          weights.ip_pol_w, weights.ip_pol_b,
+                                          false),
+                         nvinfer1::Dims2{0, -1});
+    }
+    policy = b.SoftMax(policy);
+
+    auto conv = b.Conv(flow, int(weights.value.biases.size()), 1,
+                       weights.value.weights, weights.value.biases, true);
+    auto fc1 = b.FullyConnected(conv, int(weights.ip1_val_b.size()),
+                                weights.ip1_val_w, weights.ip1_val_b, true);
+    auto fc2 = b.Reshape(
+        b.FullyConnected(fc1, int(weights.ip2_val_b.size()), weights.ip2_val_w,
+                         weights.ip2_val_b, false),
+        nvinfer1::Dims2{0, -1});
+    auto value = wdl_ ? b.SoftMax(fc2)
+                      : b.Activation(fc2, nvinfer1::ActivationType::kTANH);
+
+    policy->setName(kPolicyName);
+    value->setName(kValueName);
+    network->markOutput(*policy);
+    network->markOutput(*value);
+    policy->setType(nvinfer1::DataType::kFLOAT);
+    value->setType(nvinfer1::DataType::kFLOAT);
+
+    TrtPtr<nvinfer1::IBuilderConfig> config(builder->createBuilderConfig());
+    auto profile = builder->createOptimizationProfile();
+    profile->setDimensions(kInputName, nvinfer1::OptProfileSelector::kMIN,
+                           nvinfer1::Dims4{1, kInputPlanes, 8, 8});
+    profile->setDimensions(
+        kInputName, nvinfer1::OptProfileSelector::kOPT,
+        nvinfer1::Dims4{std::max(1, max_batch_size_ / 2), kInputPlanes, 8, 8});
+    profile->setDimensions(kInputName, nvinfer1::OptProfileSelector::kMAX,
+                           nvinfer1::Dims4{max_batch_size_, kInputPlanes, 8, 8});
+    config->addOptimizationProfile(profile);
+
+    std::unique_ptr<Calibrator> calibrator;
+    if (precision != TensorRTOptions::kFp32)
+      config->setFlag(nvinfer1::BuilderFlag::kFP16);
+    if (precision == TensorRTOptions::kInt8) {
+      calibrator = std::make_unique<Calibrator>(options, calibrationFile);
+      auto calibration = builder->createOptimizationProfile();
+      for (auto selector : {nvinfer1::OptProfileSelector::kMIN,
+                            nvinfer1::OptProfileSelector::kOPT,
+                            nvinfer1::OptProfileSelector::kMAX}) {
+        calibration->setDimensions(
+            kInputName, selector,
+            nvinfer1::Dims4{kCalibrationBatch, kInputPlanes, 8, 8});
+      }
+      config->setFlag(nvinfer1::BuilderFlag::kINT8);
+      config->setInt8Calibrator(calibrator.get());
+      config->setCalibrationProfile(calibration);
+    }
+
+    return builder->buildSerializedNetwork(*network, *config);
+  }
+
+  int gpu_id_;
+  int max_batch_size_;
+  bool wdl_;
+
+  TrtPtr<nvinfer1::IRuntime> runtime_;
+  TrtPtr<nvinfer1::ICudaEngine> engine_;
+
+  mutable std::mutex inputs_outputs_lock_;
+  std::list<std::unique_ptr<InputsOutputs>> free_inputs_outputs_;
+  size_t io_host_bytes_ = 0;
+  size_t io_device_bytes_ = 0;
+};
+
+TensorRTNetworkComputation::TensorRTNetworkComputation(
+    TensorRTNetwork* network, bool wdl)
+    : inputs_outputs_(network->GetInputsOutputs()),
+      batch_size_(0),
+      wdl_(wdl),
+      network_(network) {
+  inputs_outputs_->gather_policy_ = false;
+}
+
+TensorRTNetworkComputation::~TensorRTNetworkComputation() {
+  network_->ReleaseInputsOutputs(std::move(inputs_outputs_));
+}
+
+void TensorRTNetworkComputation::ComputeAsync() {
+  network_->forwardEval(inputs_outputs_.get(), batch_size_);
+}
+
+bool TensorRTNetworkComputation::Reset() {
+  // The last batch may have been evaluated from another thread.
+  network_->MakeCurrent();
+  batch_size_ = 0;
+  inputs_outputs_->gather_policy_ = false;
+  return true;
+}
+
+}  // namespace
+
+Network* createTensorRTNetwork(const ConvertedWeights& file,
+                               const TensorRTOptions& options) {
+  if (file.network !=
+          pblczero::NetworkFormat::NETWORK_CLASSICAL_WITH_HEADFORMAT &&
+      file.network != pblczero::NetworkFormat::NETWORK_SE_WITH_HEADFORMAT) {
+    qDebug() << "Network format" << int(file.network)
+             << "is not supported by the TensorRT backend.";
+  }
+  return new TensorRTNetwork(file, options);
+}
+
+}  // namespace lczero
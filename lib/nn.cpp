@@ -20,20 +20,34 @@
 
 #include "nn.h"
 
+#include <QCryptographicHash>
 #include <QDebug>
 #include <QFileInfo>
 #include <QGlobalStatic>
 
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <thread>
+
 #include "bitboard.h"
 #include "chess.h"
 #include "game.h"
 #include "history.h"
+#include "metrics.h"
 #include "neural/loader.h"
 #include "neural/nn_policy.h"
+#include "nnremote.h"
 #include "node.h"
 #include "notation.h"
 #include "options.h"
-#include "fastapprox/fastpow.h"
+#include "stagetimes.h"
+#include "vectormath.h"
+
+// The backends take at least a root together with every one of its children in one batch
+static const int s_minimumBatchSize = 256;
+// For every gpu so that one computation can be filled while the other evaluates
+static const int s_computationsPerGPU = 2;
 
 using namespace Chess;
 using namespace lczero;
@@ -45,8 +59,23 @@ const int s_moveHistory = 8;
 const int s_planesPerPos = 13;
 const int s_planeBase = s_planesPerPos * s_moveHistory;
 
+// The masks and values of the planes for one position, which either point into the backend's own
+// input buffers or into storage held by the computation
+struct InputSlot {
+    uint64_t *masks;
+    float *values;
+
+    void clear(int begin, int end)
+    {
+        std::fill(masks + begin, masks + end, uint64_t(0));
+        std::fill(values + begin, values + end, 1.0f);
+    }
+    void setAll(int i) { masks[i] = ~0ull; }
+    void fill(int i, float value) { masks[i] = ~0ull; values[i] = value; }
+};
+
 inline void encodeGame(int i, const Game &g, const Game::Position &p,
-    InputPlanes *result, Chess::Army us, Chess::Army them, bool nextMoveIsBlack)
+    InputSlot *result, Chess::Army us, Chess::Army them, bool nextMoveIsBlack)
 {
     BitBoard ours = us == White ? p.board(White) : p.board(Black);
     BitBoard theirs = them == White ? p.board(White) : p.board(Black);
@@ -69,28 +98,44 @@ inline void encodeGame(int i, const Game &g, const Game::Position &p,
         kings.mirror();
     }
 
-    const size_t base = size_t(i * s_planesPerPos);
+    uint64_t *masks = result->masks + i * s_planesPerPos;
 
-    (*result)[base + 0].mask = (ours & pawns).data();
-    (*result)[base + 1].mask = (ours & knights).data();
-    (*result)[base + 2].mask = (ours & bishops).data();
-    (*result)[base + 3].mask = (ours & rooks).data();
-    (*result)[base + 4].mask = (ours & queens).data();
-    (*result)[base + 5].mask = (ours & kings).data();
+    masks[0] = (ours & pawns).data();
+    masks[1] = (ours & knights).data();
+    masks[2] = (ours & bishops).data();
+    masks[3] = (ours & rooks).data();
+    masks[4] = (ours & queens).data();
+    masks[5] = (ours & kings).data();
 
-    (*result)[base + 6].mask = (theirs & pawns).data();
-    (*result)[base + 7].mask = (theirs & knights).data();
-    (*result)[base + 8].mask = (theirs & bishops).data();
-    (*result)[base + 9].mask = (theirs & rooks).data();
-    (*result)[base + 10].mask = (theirs & queens).data();
-    (*result)[base + 11].mask = (theirs & kings).data();
+    masks[6] = (theirs & pawns).data();
+    masks[7] = (theirs & knights).data();
+    masks[8] = (theirs & bishops).data();
+    masks[9] = (theirs & rooks).data();
+    masks[10] = (theirs & queens).data();
+    masks[11] = (theirs & kings).data();
     if (g.repetitions() >= 1)
-        (*result)[base + 12].SetAll();
+        masks[12] = ~0ull;
 
     // FIXME: Encode enpassant target
 }
 
-inline void gameToInputPlanes(const Node *node, std::vector<InputPlane> *result)
+inline void encodeAuxiliary(const Game &game, const Game::Position &position,
+    InputSlot *result, Chess::Army us, Chess::Army them)
+{
+    if (position.isCastleAvailable(us, QueenSide)) result->setAll(s_planeBase + 0);
+    if (position.isCastleAvailable(us, KingSide)) result->setAll(s_planeBase + 1);
+    if (position.isCastleAvailable(them, QueenSide)) result->setAll(s_planeBase + 2);
+    if (position.isCastleAvailable(them, KingSide)) result->setAll(s_planeBase + 3);
+    if (us == Chess::Black) result->setAll(s_planeBase + 4);
+    result->fill(s_planeBase + 5, game.halfMoveClock());
+    // Plane s_planeBase + 6 used to be movecount plane, now it's all zeros.
+    // Plane s_planeBase + 7 is all ones to help NN find board edges.
+    result->setAll(s_planeBase + 7);
+}
+
+// If reuseHistory is set the slot holds the encoding of a sibling of this node and only the
+// planes for the node itself and the auxiliary planes are encoded, as the history is shared
+inline void gameToInputPlanes(const Node *node, InputSlot *result, bool reuseHistory)
 {
     const Game &game = node->game();
     const Game::Position &position = node->position()->position();
@@ -100,6 +145,15 @@ inline void gameToInputPlanes(const Node *node, std::vector<InputPlane> *result)
     const Chess::Army us = nextMoveIsBlack ? Black : White;
     const Chess::Army them = nextMoveIsBlack ? White : Black;
 
+    if (reuseHistory) {
+        result->clear(0, s_planesPerPos);
+        result->clear(s_planeBase, kInputPlanes);
+        encodeGame(0, game, position, result, us, them, nextMoveIsBlack);
+        encodeAuxiliary(game, position, result, us, them);
+        return;
+    }
+
+    result->clear(0, kInputPlanes);
     HistoryIterator it = HistoryIterator::begin(node);
     int gamesEncoded = 0;
     Game lastGameEncoded = game;
@@ -121,18 +175,42 @@ inline void gameToInputPlanes(const Node *node, std::vector<InputPlane> *result)
         }
     }
 
-    if (position.isCastleAvailable(us, QueenSide)) (*result)[s_planeBase + 0].SetAll();
-    if (position.isCastleAvailable(us, KingSide)) (*result)[s_planeBase + 1].SetAll();
-    if (position.isCastleAvailable(them, QueenSide)) (*result)[s_planeBase + 2].SetAll();
-    if (position.isCastleAvailable(them, KingSide)) (*result)[s_planeBase + 3].SetAll();
-    if (us == Chess::Black) (*result)[s_planeBase + 4].SetAll();
-    (*result)[s_planeBase + 5].Fill(game.halfMoveClock());
-    // Plane s_planeBase + 6 used to be movecount plane, now it's all zeros.
-    // Plane s_planeBase + 7 is all ones to help NN find board edges.
-    (*result)[s_planeBase + 7].SetAll();
+    encodeAuxiliary(game, position, result, us, them);
 }
 
-static WeightsFile s_weights;
+// A position set up from a fen has no history so it is repeated in its place
+static void fenToInputPlanes(const StandaloneGame &game, InputSlot *result)
+{
+    const Game::Position &position = game.position();
+    const bool nextMoveIsBlack = position.activeArmy() == Black;
+    const Chess::Army us = nextMoveIsBlack ? Black : White;
+    const Chess::Army them = nextMoveIsBlack ? White : Black;
+
+    result->clear(0, kInputPlanes);
+    for (int i = 0; i < s_moveHistory; ++i)
+        encodeGame(i, game, position, result, us, them, nextMoveIsBlack);
+    encodeAuxiliary(game, position, result, us, them);
+}
+
+static void loadCalibrationPositions(const QString &fileName, TensorRTOptions *options)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qWarning() << "Could not open the int8 calibration file" << fileName;
+        return;
+    }
+
+    while (!file.atEnd()) {
+        const QString fen = QString::fromUtf8(file.readLine()).trimmed();
+        if (fen.isEmpty() || fen.startsWith('#'))
+            continue;
+        const size_t offset = options->calibrationMasks.size();
+        options->calibrationMasks.resize(offset + kInputPlanes);
+        options->calibrationValues.resize(offset + kInputPlanes);
+        InputSlot slot = { &options->calibrationMasks[offset], &options->calibrationValues[offset] };
+        fenToInputPlanes(StandaloneGame(fen), &slot);
+    }
+}
 
 class MyNeuralNet : public NeuralNet { };
 Q_GLOBAL_STATIC(MyNeuralNet, nnInstance)
@@ -141,84 +219,501 @@ NeuralNet *NeuralNet::globalInstance()
     return nnInstance();
 }
 
+class MySmallNeuralNet : public NeuralNet {
+public:
+    MySmallNeuralNet() { m_isSmall = true; }
+};
+Q_GLOBAL_STATIC(MySmallNeuralNet, smallNNInstance)
+NeuralNet *NeuralNet::smallInstance()
+{
+    return smallNNInstance();
+}
+
 NeuralNet::NeuralNet()
-    : m_weightsValid(false),
-    m_usingFP16(false),
-    m_usingCustomWinograd(false)
+    : m_bindingGeneration(0),
+    m_processorBatch(0),
+    m_bindingRevoked(false),
+    m_loaded(false),
+    m_isSmall(false)
 {
+    std::fill(m_evaluationNsecs, m_evaluationNsecs + EvaluationBuckets, 0);
+    m_clock.start();
+}
+
+static int evaluationBucket(int positions)
+{
+    int bucket = 0;
+    while ((1 << bucket) < positions)
+        ++bucket;
+    return bucket;
+}
+
+qint64 NeuralNet::evaluationNsecs(int positions)
+{
+    return m_evaluationNsecs[qMin(evaluationBucket(positions), int(EvaluationBuckets) - 1)].load(
+        std::memory_order_relaxed);
 }
 
 NeuralNet::~NeuralNet()
 {
-    qDeleteAll(m_availableNetworks);
+    finishLoading();
+    qDeleteAll(m_pendingNetworks);
+    qDeleteAll(m_retiredNetworks);
+    qDeleteAll(m_networks);
 }
 
-Network *NeuralNet::createNewGPUNetwork(int id, bool useFP16, bool useCustomWinograd) const
+NeuralNet::Config NeuralNet::currentConfig() const
 {
-    Q_ASSERT(m_weightsValid);
-    if (!m_weightsValid)
-        qFatal("Could not load NN weights!");
+    Config config;
+    config.weightsFile = m_weightsFile;
+    config.server = Options::globalInstance()->option("NNServer").value();
+    config.serverComputations = Options::globalInstance()->option("NNServerComputations").value().toInt();
+    config.gpuCores = Options::globalInstance()->option("GPUCores").value().toInt();
+    config.precision = Options::globalInstance()->option("Precision").value();
+    config.useTensorRT = Options::globalInstance()->option("UseTensorRT").value() == "true";
+    // Every backend sizes its buffers for this and TensorRT builds its engine for it
+    config.maxBatchSize = qMax(s_minimumBatchSize,
+        Options::globalInstance()->option("MaxBatchSize").value().toInt());
+    if (config.useTensorRT && config.precision == QLatin1String("int8")) {
+        // The cuda backend does not calibrate
+        config.calibrationFile = Options::globalInstance()->option("Int8CalibrationFile").value();
+    }
+    config.useCustomWinograd = Options::globalInstance()->option("UseCustomWinograd").value() == "true";
+    config.autotune = Options::globalInstance()->option("Autotune").value() == "true";
+    config.useCudaGraphs = Options::globalInstance()->option("UseCudaGraphs").value() == "true";
+    config.useCPU = Options::globalInstance()->option("UseCPU").value() == "true";
+    config.cpuThreads = Options::globalInstance()->option("CPUThreads").value().toInt();
+    if (!config.cpuThreads)
+        config.cpuThreads = int(qMax(1u, std::thread::hardware_concurrency()));
+    if (!config.useCPU)
+        config.hybridCPUBatch = Options::globalInstance()->option("HybridCPUBatch").value().toInt();
+    config.synthetic = Options::globalInstance()->option("SyntheticNetwork").value() == "true";
+    config.syntheticLatency = Options::globalInstance()->option("SyntheticLatency").value().toInt();
+    return config;
+}
+
+Network *NeuralNet::createNewGPUNetwork(const ConvertedWeights &weights, int id,
+    const Config &config, const TensorRTOptions &tensorRT)
+{
+    if (config.useCPU)
+        return createCpuNetwork(weights, config.cpuThreads, config.maxBatchSize);
+#if defined(NO_CUDA)
+    Q_UNUSED(id);
+    Q_UNUSED(tensorRT);
+    qFatal("Built without cuda so the network can only run with UseCPU");
+    return nullptr;
+#else
+    if (config.useTensorRT) {
+#if defined(USE_TENSORRT)
+        TensorRTOptions options = tensorRT;
+        options.gpuId = id;
+        return createTensorRTNetwork(weights, options);
+#else
+        qWarning() << "Built without TensorRT so the network runs on the cuda backend";
+#endif
+    }
+
+    // Kept next to the weights as the converted weights are
+    const std::string tuningFile = config.autotune
+        ? config.weightsFile.toStdString() + ".tuning" : std::string();
 
-    if (useFP16)
-        return createCudaFP16Network(s_weights, id, useCustomWinograd);
+    // Only TensorRT calibrates the ranges of int8 so the cuda backend runs it as fp16
+    if (config.precision != QLatin1String("fp32"))
+        return createCudaFP16Network(weights, id, config.maxBatchSize, s_computationsPerGPU,
+            config.useCustomWinograd, config.useCudaGraphs, tuningFile);
     else
-        return createCudaNetwork(s_weights, id, useCustomWinograd);
+        return createCudaNetwork(weights, id, config.maxBatchSize, s_computationsPerGPU,
+            config.useCustomWinograd, config.useCudaGraphs, tuningFile);
+#endif
+}
+
+QVector<Computation*> NeuralNet::createNetworks(const Config &config)
+{
+    // The server holds the weights and every computation keeps a connection of its own to it so
+    // that their batches are in flight at once and hide the round trips
+    if (!config.server.isEmpty()) {
+        QSharedPointer<lczero::Network> network(createRemoteNetwork(config.server));
+        QVector<Computation*> computations;
+        for (int i = 0; i < config.serverComputations; ++i)
+            computations.append(new Computation(network));
+        return computations;
+    }
+
+    // As many devices and computations as the gpus would have so the search runs as it would on
+    // them, but each evaluates in no time beyond its latency
+    if (config.synthetic) {
+        QVector<Computation*> computations;
+        for (int device = 0; device < qMax(1, config.gpuCores); ++device) {
+            QSharedPointer<lczero::Network> network(
+                createSyntheticNetwork(config.syntheticLatency, config.maxBatchSize));
+            for (int i = 0; i < s_computationsPerGPU; ++i)
+                computations.append(new Computation(network, device));
+        }
+        return computations;
+    }
+
+    // The converted weights are only needed until every device has uploaded its copy
+    const ConvertedWeights weights = LoadConvertedWeights(config.weightsFile.toStdString());
+
+    // Bring up the devices concurrently as each creates its handles, allocates its workspace and
+    // uploads the weights. The processor is one device already using every thread it is given.
+    const int devices = config.useCPU ? 1 : config.gpuCores;
+
+    // Shared by the devices, each of which builds its own engine
+    TensorRTOptions tensorRT;
+    if (config.useTensorRT) {
+        tensorRT.maxBatchSize = config.maxBatchSize;
+        tensorRT.weightsFile = config.weightsFile.toStdString();
+        if (config.precision == QLatin1String("int8")) {
+            tensorRT.precision = TensorRTOptions::kInt8;
+            if (!config.calibrationFile.isEmpty())
+                loadCalibrationPositions(config.calibrationFile, &tensorRT);
+        } else if (config.precision == QLatin1String("fp16")) {
+            tensorRT.precision = TensorRTOptions::kFp16;
+        }
+    }
+
+    // The processor next to the gpus is the device after theirs
+    const bool hybrid = config.hybridCPUBatch > 0;
+    std::vector<lczero::Network*> networks(size_t(devices + hybrid), nullptr);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < devices; ++i) {
+        threads.emplace_back([i, &networks, &weights, &config, &tensorRT]() {
+            networks[size_t(i)] = createNewGPUNetwork(weights, i, config, tensorRT);
+        });
+    }
+    if (hybrid) {
+        threads.emplace_back([devices, &networks, &weights, &config]() {
+            networks[size_t(devices)] = createCpuNetwork(weights, config.cpuThreads, config.maxBatchSize);
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+
+    QVector<Computation*> computations;
+    for (int device = 0; device < devices; ++device) {
+        QSharedPointer<lczero::Network> network(networks[size_t(device)]);
+        const int count = config.useCPU ? 1 : s_computationsPerGPU;
+        for (int i = 0; i < count; ++i)
+            computations.append(new Computation(network, device));
+    }
+    if (hybrid) {
+        QSharedPointer<lczero::Network> network(networks[size_t(devices)]);
+        Computation *computation = new Computation(network, devices);
+        computation->m_processorBatch = config.hybridCPUBatch;
+        computations.append(computation);
+    }
+    return computations;
 }
 
 void NeuralNet::reset()
 {
-    Q_ASSERT(m_weightsValid);
-    const int numberOfGPUCores = Options::globalInstance()->option("GPUCores").value().toInt();
-    const bool useFP16 = Options::globalInstance()->option("UseFP16").value() == "true";
-    const bool useCustomWinograd = Options::globalInstance()->option("UseCustomWinograd").value() == "true";
-    if (numberOfGPUCores == m_availableNetworks.count()
-        && useFP16 == m_usingFP16
-        && useCustomWinograd == m_usingCustomWinograd)
+    m_cache.reset(Options::globalInstance()->option("NNCacheSize").value().toULongLong());
+    loadNetworks();
+
+    // Networks of other weights loading in the background open the store once they serve
+    if (!m_loader.joinable())
+        openStore();
+}
+
+void NeuralNet::openStore()
+{
+    const QString fileName = Options::globalInstance()->option("NNStoreFile").value();
+    if (fileName.isEmpty() || m_isSmall || m_config.synthetic) {
+        m_store.close();
+        return;
+    }
+
+    const int plies = Options::globalInstance()->option("NNStorePlies").value().toInt();
+    if (!m_store.open(fileName, m_config.weightsFile, plies))
+        qWarning() << "Could not open the nn store" << fileName << "for" << m_config.weightsFile;
+}
+
+void NeuralNet::loadNetworks()
+{
+    Q_ASSERT(!m_weightsFile.isEmpty());
+    const Config config = currentConfig();
+    if (m_loader.joinable()) {
+        if (config == m_pendingConfig)
+            return; // Already loading
+
+        // Loading can't be interrupted so wait for it and throw the result away
+        finishLoading();
+        qDeleteAll(m_pendingNetworks);
+        m_pendingNetworks.clear();
+    }
+
+    if (config == m_config)
         return; // Nothing to do
 
-    m_usingFP16 = useFP16;
-    m_usingCustomWinograd = useCustomWinograd;
-    qDeleteAll(m_availableNetworks);
-    m_availableNetworks.clear();
-    for (int i = 0; i < numberOfGPUCores; ++i) {
-        QSharedPointer<lczero::Network> network(createNewGPUNetwork(i, m_usingFP16, m_usingCustomWinograd));
-        m_availableNetworks.append(new Computation(network));
-        m_availableNetworks.append(new Computation(network));
+    // Nothing is serving yet so we return, and thus answer isready, once the networks are up
+    if (m_networks.isEmpty()) {
+        installNetworks(createNetworks(config));
+        m_config = config;
+        return;
     }
+
+    m_pendingConfig = config;
+    m_loaded = false;
+    m_loader = std::thread([this, config]() {
+        m_pendingNetworks = createNetworks(config);
+        m_loaded = true;
+    });
+}
+
+void NeuralNet::switchNetworks(bool wait)
+{
+    if (!m_loader.joinable() || (!m_loaded && !wait))
+        return;
+
+    finishLoading();
+    installNetworks(m_pendingNetworks);
+    m_config = m_pendingConfig;
+    m_pendingNetworks.clear();
+
+    // The cached results belong to the old network
+    m_cache.reset(Options::globalInstance()->option("NNCacheSize").value().toULongLong());
+    openStore();
+}
+
+void NeuralNet::unload()
+{
+    finishLoading();
+    qDeleteAll(m_pendingNetworks);
+    m_pendingNetworks.clear();
+    installNetworks(QVector<Computation*>());
+    m_config = Config();
+    m_pendingConfig = Config();
+    m_weightsFile.clear();
+    m_cache.reset(0);
+}
+
+void NeuralNet::finishLoading()
+{
+    if (m_loader.joinable())
+        m_loader.join();
+}
+
+void NeuralNet::installNetworks(const QVector<Computation*> &networks)
+{
+    QMutexLocker locker(&m_mutex);
+
+    // The device memory of an old network is freed along with the last of its computations, so
+    // the ones still in flight are deleted when they are released
+    for (Computation *network : m_networks) {
+        if (m_availableNetworks.contains(network))
+            delete network;
+        else
+            m_retiredNetworks.append(network);
+    }
+    m_networks = networks;
+    m_availableNetworks = networks;
+    int processorBatch = 0;
+    for (const Computation *network : networks)
+        processorBatch = qMax(processorBatch, network->m_processorBatch);
+    m_processorBatch.store(processorBatch, std::memory_order_relaxed);
+    std::fill(m_evaluationNsecs, m_evaluationNsecs + EvaluationBuckets, 0);
+
+    // The threads holding bound computations of the old networks see that they are no longer
+    // bound and give them back to be deleted
+    m_boundNetworks.clear();
+    m_bindingRevoked = false;
+    ++m_bindingGeneration;
+    m_condition.wakeAll();
 }
 
 void NeuralNet::setWeights(const QString &pathToWeights)
 {
-    QFileInfo info(pathToWeights);
-    if (info.exists()) {
-        s_weights = LoadWeightsFromFile(pathToWeights.toStdString());
-        m_weightsValid = true;
-    } else {
+    // The synthetic network needs no weights but is still told apart from no network at all
+    if (Options::globalInstance()->option("SyntheticNetwork").value() == "true")
+        m_weightsFile = pathToWeights.isEmpty() ? QString("synthetic") : pathToWeights;
+    else if (QFileInfo::exists(pathToWeights))
+        m_weightsFile = pathToWeights;
+    else
         qFatal("Could not load NN weights!");
-    }
 }
 
-Computation *NeuralNet::acquireNetwork()
+Computation *NeuralNet::acquireNetwork(int positions)
 {
     QMutexLocker locker(&m_mutex);
-    while (m_availableNetworks.isEmpty())
+    forever {
+        if (Computation *processor = takeProcessor(positions))
+            return processor;
+
+        // Computations that have not been measured yet are expected to take no time so every
+        // device gets tried
+        const qint64 now = m_clock.nsecsElapsed();
+        Computation *best = nullptr;
+        qint64 bestFinish = std::numeric_limits<qint64>::max();
+        for (Computation *network : m_networks) {
+            if (m_boundNetworks.contains(network))
+                continue;
+            const bool isAvailable = m_availableNetworks.contains(network);
+            // Larger batches are evaluated on the processor only while every gpu is slower to get
+            // to them, and never queue up behind it
+            if (network->m_processorBatch && !isAvailable)
+                continue;
+            const qint64 start = isAvailable ? now : qMax(now, network->m_busyUntil);
+            const qint64 finish = start + qint64(network->m_nsecsPerPosition * positions);
+            if (finish < bestFinish || (finish == bestFinish && isAvailable)) {
+                best = network;
+                bestFinish = finish;
+            }
+        }
+
+        if (best && m_availableNetworks.removeOne(best)) {
+            best->m_busyUntil = bestFinish;
+            return best;
+        }
+
+        // Threads that bound computations give them back rather than keep us waiting, and the
+        // networks are shared batch by batch until the next ones are installed
+        if (!m_boundNetworks.isEmpty() && !m_bindingRevoked) {
+            m_bindingRevoked = true;
+            ++m_bindingGeneration;
+        }
+
         m_condition.wait(locker.mutex());
-    return m_availableNetworks.takeFirst();
+    }
+}
+
+Computation *NeuralNet::takeProcessor(int positions)
+{
+    // Small batches would pay the launch and the transfers of a gpu for little work
+    if (positions >= m_processorBatch.load(std::memory_order_relaxed))
+        return nullptr;
+
+    for (Computation *network : m_availableNetworks) {
+        if (network->m_processorBatch && positions < network->m_processorBatch) {
+            m_availableNetworks.removeOne(network);
+            return network;
+        }
+    }
+    return nullptr;
+}
+
+Computation *NeuralNet::acquireProcessor(int positions)
+{
+    if (positions >= m_processorBatch.load(std::memory_order_relaxed))
+        return nullptr;
+
+    QMutexLocker locker(&m_mutex);
+    return takeProcessor(positions);
+}
+
+Computation *NeuralNet::bindNetwork(int device)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_bindingRevoked)
+        return nullptr;
+
+    // The processor and the nn server are one device for every thread
+    bool hasDevice = false;
+    for (const Computation *network : m_networks)
+        hasDevice = hasDevice || network->m_device == device;
+
+    // The processor next to the gpus is shared batch by batch as it takes the small ones of all
+    for (Computation *network : m_availableNetworks) {
+        if ((hasDevice && network->m_device != device) || network->m_processorBatch)
+            continue;
+        m_availableNetworks.removeOne(network);
+        m_boundNetworks.append(network);
+        network->m_bindingGeneration = m_bindingGeneration;
+        return network;
+    }
+    return nullptr;
+}
+
+void NeuralNet::unbindNetwork(Computation *network)
+{
+    QMutexLocker locker(&m_mutex);
+    m_boundNetworks.removeOne(network);
+    if (m_retiredNetworks.removeOne(network)) {
+        delete network;
+        return;
+    }
+
+    m_availableNetworks.append(network);
+    m_condition.wakeAll();
+}
+
+void NeuralNet::recordEvaluation(Computation *network)
+{
+    if (network->m_positions > 0 && network->m_evaluationNsecs > 0) {
+        // Exponential moving average so the estimate follows changes in clock speed
+        const double sample = double(network->m_evaluationNsecs) / network->m_positions;
+        if (qFuzzyIsNull(network->m_nsecsPerPosition))
+            network->m_nsecsPerPosition = sample;
+        else
+            network->m_nsecsPerPosition = 0.9 * network->m_nsecsPerPosition + 0.1 * sample;
+
+        // Threads that race here lose one of their samples, which the average does not miss
+        const int bucket = qMin(evaluationBucket(network->m_positions), int(EvaluationBuckets) - 1);
+        const qint64 nsecs = m_evaluationNsecs[bucket].load(std::memory_order_relaxed);
+        m_evaluationNsecs[bucket].store(nsecs ? (9 * nsecs + network->m_evaluationNsecs) / 10
+            : network->m_evaluationNsecs, std::memory_order_relaxed);
+    }
+    network->m_evaluationNsecs = 0;
+}
+
+void NeuralNet::memoryUsage(MemoryUsage *host, MemoryUsage *device)
+{
+    // The buffers are allocated once and kept so all of them count as used. Computations share
+    // their network so every network is only counted once.
+    QMutexLocker locker(&m_mutex);
+    *host = MemoryUsage();
+    *device = MemoryUsage();
+    QVector<const lczero::Network*> counted;
+    for (const QVector<Computation*> &computations : { m_networks, m_retiredNetworks }) {
+        for (const Computation *computation : computations) {
+            host->reserved += computation->hostMemory();
+            const lczero::Network *network = computation->network();
+            if (!network || counted.contains(network))
+                continue;
+            counted.append(network);
+            host->reserved += network->hostMemory();
+            device->reserved += network->deviceMemory();
+        }
+    }
+    host->used = host->peak = host->reserved;
+    device->used = device->peak = device->reserved;
 }
 
 void NeuralNet::releaseNetwork(Computation *network)
 {
     QMutexLocker locker(&m_mutex);
+    if (m_retiredNetworks.removeOne(network)) {
+        delete network;
+        return;
+    }
+
+    recordEvaluation(network);
+    network->m_busyUntil = 0;
     m_availableNetworks.append(network);
     m_condition.wakeAll();
 }
 
-Computation::Computation(QSharedPointer<lczero::Network> network)
+Computation::Computation(QSharedPointer<lczero::Network> network, int device)
     : m_positions(0),
+    m_device(device),
     m_network(network),
-    m_computation(nullptr)
+    m_computation(nullptr),
+    m_usingInputSlot(false),
+    m_gatheringPolicy(false),
+    m_policyTemperatureInverse(SearchSettings::policySoftmaxTempInverse),
+    m_lastEncodedParent(nullptr),
+    m_lastEncodedMasks(nullptr),
+    m_lastEncodedValues(nullptr),
+    m_historyKey(0),
+    m_evaluationNsecs(0),
+    m_nsecsPerPosition(0),
+    m_busyUntil(0),
+    m_bindingGeneration(0),
+    m_processorBatch(0)
 {
-    m_inputPlanes.resize(s_planeBase + s_moveHistory);
+    m_inputPlanes.resize(kInputPlanes);
+    m_inputMasks.resize(kInputPlanes);
+    m_inputValues.resize(kInputPlanes);
 }
 
 Computation::~Computation()
@@ -228,39 +723,200 @@ Computation::~Computation()
 
 void Computation::reset()
 {
-    clear();
-    m_computation = m_network->NewComputation().release();
+    // The backend computation and the buffers it holds are kept from batch to batch where the
+    // backend can empty them
+    m_positions = 0;
+    m_lastEncodedParent = nullptr;
+    m_lastEncodedMasks = nullptr;
+    m_lastEncodedValues = nullptr;
+    if (!m_computation || !m_computation->Reset()) {
+        delete m_computation;
+        m_computation = m_network->NewComputation().release();
+    }
+    setPolicyTemperature(SearchSettings::policySoftmaxTempInverse);
+}
+
+void Computation::setPolicyTemperature(float inverseTemperature)
+{
+    Q_ASSERT(m_computation);
+    m_policyTemperatureInverse = inverseTemperature;
+    m_computation->SetPolicyTemperature(inverseTemperature);
+}
+
+static inline quint64 mixKey(quint64 key)
+{
+    // Finalizer of splitmix64
+    key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ull;
+    key = (key ^ (key >> 27)) * 0x94D049BB133111EBull;
+    return key ^ (key >> 31);
+}
+
+static inline quint64 mixPlane(quint64 key, quint64 mask, float value)
+{
+    quint32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    key = mixKey(key ^ mask);
+    return mixKey(key ^ bits);
 }
 
-int Computation::addPositionToEvaluate(const Node *node)
+quint64 Computation::encodePosition(const Node *node)
 {
-    m_inputPlanes.clear();
-    m_inputPlanes.resize(s_planeBase + s_moveHistory);
-    gameToInputPlanes(node, &m_inputPlanes);
     Q_ASSERT(m_computation);
-    m_computation->AddInput(&m_inputPlanes);
+
+    // Encode straight into the backend's input buffers for the next sample when it has them
+    InputSlot slot;
+    m_usingInputSlot = m_computation->GetInputSlot(&slot.masks, &slot.values);
+    if (!m_usingInputSlot) {
+        slot.masks = m_inputMasks.data();
+        slot.values = m_inputValues.data();
+    }
+
+    // Siblings share everything but the planes of the first position and the auxiliary planes
+    // so reuse those along with their part of the key when the last node encoded was a sibling
+    const bool reuseHistory = m_lastEncodedParent && node->parent() == m_lastEncodedParent;
+    if (reuseHistory && slot.masks != m_lastEncodedMasks) {
+        const int count = s_planeBase - s_planesPerPos;
+        memcpy(slot.masks + s_planesPerPos, m_lastEncodedMasks + s_planesPerPos, count * sizeof(uint64_t));
+        memcpy(slot.values + s_planesPerPos, m_lastEncodedValues + s_planesPerPos, count * sizeof(float));
+    }
+    gameToInputPlanes(node, &slot, reuseHistory);
+    m_lastEncodedParent = node->parent();
+    m_lastEncodedMasks = slot.masks;
+    m_lastEncodedValues = slot.values;
+
+    if (!reuseHistory) {
+        m_historyKey = 0;
+        for (int i = s_planesPerPos; i < s_planeBase; ++i)
+            m_historyKey = mixPlane(m_historyKey, slot.masks[i], slot.values[i]);
+    }
+
+    // The planes do not encode the enpassant target so mix in the position hash which does
+    quint64 key = mixKey(m_historyKey ^ node->position()->position().positionHash());
+    for (int i = 0; i < s_planesPerPos; ++i)
+        key = mixPlane(key, slot.masks[i], slot.values[i]);
+    for (int i = s_planeBase; i < kInputPlanes; ++i)
+        key = mixPlane(key, slot.masks[i], slot.values[i]);
+    return key;
+}
+
+int Computation::addEncodedPosition(const Node *node)
+{
+    Q_ASSERT(m_computation);
+
+    // Hand the nn indices of the legal moves to backends that gather their policy on the device
+    quint16 *indices = m_computation->GetPolicyIndicesSlot();
+    m_gatheringPolicy = indices;
+    if (indices) {
+        const Chess::Army activeArmy = node->position()->position().activeArmy();
+        const Node::PotentialVector *potentials = node->position()->potentials();
+        Q_ASSERT(potentials->count() <= kMaxPolicyIndices);
+        indices[0] = quint16(potentials->count());
+        for (int i = 0; i < potentials->count(); ++i) {
+            Move mv = potentials->at(i).move();
+            if (activeArmy == Chess::Black)
+                mv.mirror(); // nn index expects the board to be flipped
+            indices[i + 1] = moveToNNIndex(mv);
+        }
+    }
+
+    if (m_usingInputSlot) {
+        m_computation->CommitInput();
+    } else {
+        for (int i = 0; i < kInputPlanes; ++i) {
+            m_inputPlanes[size_t(i)].mask = m_inputMasks[size_t(i)];
+            m_inputPlanes[size_t(i)].value = m_inputValues[size_t(i)];
+        }
+        m_computation->AddInput(&m_inputPlanes);
+    }
+    return m_positions++;
+}
+
+int Computation::addInputPlanes(const quint64 *masks, const float *values, const quint16 *policyIndices)
+{
+    Q_ASSERT(m_computation);
+    Q_ASSERT(policyIndices[0] <= kMaxPolicyIndices);
+
+    quint16 *indices = m_computation->GetPolicyIndicesSlot();
+    m_gatheringPolicy = indices;
+    if (indices)
+        memcpy(indices, policyIndices, (policyIndices[0] + 1) * sizeof(quint16));
+
+    InputSlot slot;
+    if (m_computation->GetInputSlot(&slot.masks, &slot.values)) {
+        memcpy(slot.masks, masks, kInputPlanes * sizeof(uint64_t));
+        memcpy(slot.values, values, kInputPlanes * sizeof(float));
+        m_computation->CommitInput();
+    } else {
+        for (int i = 0; i < kInputPlanes; ++i) {
+            m_inputPlanes[size_t(i)].mask = masks[i];
+            m_inputPlanes[size_t(i)].value = values[i];
+        }
+        m_computation->AddInput(&m_inputPlanes);
+    }
     return m_positions++;
 }
 
+void Computation::gatheredPVals(int index, const quint16 *policyIndices, float *pValues) const
+{
+    Q_ASSERT(m_computation);
+    Q_ASSERT(index < m_positions);
+    const int moves = policyIndices[0];
+#if !defined(USE_UNIFORM_BACKEND)
+    if (m_gatheringPolicy) {
+        for (int i = 0; i < moves; ++i)
+            pValues[i] = m_computation->GetGatheredPVal(index, i);
+        return;
+    }
+#endif
+
+#if !defined(USE_UNIFORM_BACKEND)
+    for (int i = 0; i < moves; ++i)
+        pValues[i] = m_computation->GetPVal(index, policyIndices[i + 1]);
+    const float total = VectorMath::powAndSum(pValues, moves, m_policyTemperatureInverse);
+#else
+    for (int i = 0; i < moves; ++i)
+        pValues[i] = 1.0f;
+    const float total = float(moves);
+#endif
+    VectorMath::scale(pValues, moves, total > 0.0f ? 1.0f / total : 1.0f);
+}
+
 void Computation::evaluate()
 {
+    TIME_STAGE(Evaluate);
+
     if (!m_computation) {
         qCritical() << "Cannot evaluation position because NN is not valid!";
         return;
     }
 
 #if !defined(USE_UNIFORM_BACKEND)
+    QElapsedTimer timer;
+    timer.start();
+    Metrics::globalInstance()->beginEvaluation(m_device);
     m_computation->ComputeBlocking();
+    Metrics::globalInstance()->endEvaluation(m_device, m_positions);
+    m_evaluationNsecs = timer.nsecsElapsed();
 #endif
 }
 
 void Computation::clear()
 {
     m_positions = 0;
+    m_lastEncodedParent = nullptr;
+    m_lastEncodedMasks = nullptr;
+    m_lastEncodedValues = nullptr;
     delete m_computation;
     m_computation = nullptr;
 }
 
+quint64 Computation::hostMemory() const
+{
+    return m_inputPlanes.capacity() * sizeof(lczero::InputPlane)
+        + m_inputMasks.capacity() * sizeof(uint64_t)
+        + m_inputValues.capacity() * sizeof(float);
+}
+
 float Computation::qVal(int index) const
 {
     Q_ASSERT(m_computation);
@@ -274,40 +930,296 @@ float Computation::qVal(int index) const
 
 void Computation::setPVals(int index, Node *node) const
 {
+    TIME_STAGE(SetPVals);
+
 #if defined(USE_FAST_UNIFORM_POLICY)
-    QVector<Node::Potential> *potentials = node->position()->potentials();
+    Node::PotentialVector *potentials = node->position()->potentials();
     for (int i = 0; i < potentials->count(); ++i)
         (&(*potentials)[i])->setPValue(1.0f);
 #else
     Q_ASSERT(m_computation);
     Q_ASSERT(index < m_positions);
     Q_ASSERT(node);
-    Q_ASSERT(node->hasPotentials());
+    Q_ASSERT(!node->position()->potentials()->isEmpty()); // a refined node may have made them all
+    const Node::PotentialVector *potentials = node->position()->potentials();
+#if !defined(USE_UNIFORM_BACKEND)
+    if (m_gatheringPolicy) {
+        // The backend already raised the policy to the temperature and normalized it
+        for (int i = 0; i < potentials->size(); ++i) {
+            const Node::Potential *potential = &(*potentials)[i];
+            const_cast<Node::Potential*>(potential)->setPValue(m_computation->GetGatheredPVal(index, i));
+        }
+        return;
+    }
+#endif
+
+    // The policy of every move is gathered so the temperature and the normalization each run as
+    // one pass over an array
     const Chess::Army activeArmy = node->position()->position().activeArmy();
-    const QVector<Node::Potential> *potentials = node->position()->potentials();
-    float total = 0;
-    for (int i = 0; i < potentials->size(); ++i) {
-        // We get a non-const reference to the actual value and change it in place
-        const Node::Potential *potential = &(*potentials)[i];
-        Move mv = potential->move();
+    const int count = potentials->size();
+    Q_ASSERT(count <= kMaxPolicyIndices);
+    alignas(32) float pValues[kMaxPolicyIndices];
+    for (int i = 0; i < count; ++i) {
+        Move mv = (*potentials)[i].move();
         if (activeArmy == Chess::Black)
             mv.mirror(); // nn index expects the board to be flipped
 #if !defined(USE_UNIFORM_BACKEND)
-        const float p = fastpow(m_computation->GetPVal(index, moveToNNIndex(mv)), SearchSettings::policySoftmaxTempInverse);
+        pValues[i] = m_computation->GetPVal(index, moveToNNIndex(mv));
 #else
-        float fakePolicy = 1.0f;
         moveToNNIndex(mv);
-        const float p = fastpow(fakePolicy, SearchSettings::policySoftmaxTempInverse);
+        pValues[i] = 1.0f;
 #endif
-        total += p;
-        const_cast<Node::Potential*>(potential)->setPValue(p);
     }
 
-    const float scale = 1.0f / total;
-    for (int i = 0; i < potentials->size(); ++i) {
+    const float total = VectorMath::powAndSum(pValues, count, SearchSettings::policySoftmaxTempInverse);
+    VectorMath::scale(pValues, count, 1.0f / total);
+    for (int i = 0; i < count; ++i) {
         // We get a non-const reference to the actual value and change it in place
         const Node::Potential *potential = &(*potentials)[i];
-        const_cast<Node::Potential*>(potential)->setPValue(scale * potential->pValue());
+        const_cast<Node::Potential*>(potential)->setPValue(pValues[i]);
     }
 #endif
 }
+
+NNCache::NNCache()
+    : m_mask(0),
+    m_hits(0),
+    m_misses(0)
+{
+}
+
+void NNCache::reset(quint64 entries)
+{
+    QMutexLocker locker(&m_mutex);
+    m_entries.clear();
+    m_entries.shrink_to_fit();
+    m_mask = 0;
+    m_hits = 0;
+    m_misses = 0;
+    if (!entries)
+        return;
+
+    // Round down to a power of two so a key maps to its entry with a mask
+    quint64 size = 1;
+    while (size * 2 <= entries)
+        size *= 2;
+    m_entries.resize(size_t(size)); // zeroed so every key is empty
+    m_mask = size - 1;
+}
+
+MemoryUsage NNCache::memoryUsage() const
+{
+    QMutexLocker locker(&m_mutex);
+    MemoryUsage usage;
+    usage.reserved = m_entries.capacity() * sizeof(Entry);
+    usage.used = usage.reserved;
+    usage.peak = usage.reserved;
+    return usage;
+}
+
+bool NNCache::fetch(quint64 key, Node *node)
+{
+    Node::PotentialVector *potentials = node->position()->potentials();
+    QMutexLocker locker(&m_mutex);
+    if (m_entries.empty())
+        return false;
+
+    const Entry &entry = m_entries[size_t(key & m_mask)];
+    if (!key || entry.key != key || entry.count != potentials->count()) {
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    m_hits.fetch_add(1, std::memory_order_relaxed);
+    node->setPositionQValue(entry.qValue);
+    for (int i = 0; i < potentials->count(); ++i)
+        (*potentials)[i].setPValue(entry.policy[i] / 65535.0f);
+    return true;
+}
+
+void NNCache::store(quint64 key, const Node *node)
+{
+    const Node::PotentialVector *potentials = node->position()->potentials();
+    if (!key || potentials->count() > MaximumMoves)
+        return;
+
+    QMutexLocker locker(&m_mutex);
+    if (m_entries.empty())
+        return;
+
+    Entry &entry = m_entries[size_t(key & m_mask)];
+    entry.key = key;
+    entry.qValue = node->positionQValue();
+    entry.count = quint16(potentials->count());
+    for (int i = 0; i < potentials->count(); ++i)
+        entry.policy[i] = quint16(qRound(qBound(0.0f, potentials->at(i).pValue(), 1.0f) * 65535.0f));
+}
+
+NNStore::NNStore()
+    : m_map(nullptr),
+    m_mappedRecords(0),
+    m_records(0),
+    m_maximumPlies(0),
+    m_hits(0),
+    m_misses(0)
+{
+}
+
+NNStore::~NNStore()
+{
+    close();
+}
+
+quint64 NNStore::weightsFingerprint(const QString &weightsFile)
+{
+    // The size and both ends of the file tell weights apart without reading all of them
+    QFile file(weightsFile);
+    if (!file.open(QIODevice::ReadOnly))
+        return 0;
+
+    const qint64 chunk = 1024 * 1024;
+    const qint64 size = file.size();
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    hash.addData(reinterpret_cast<const char*>(&size), sizeof(size));
+    hash.addData(file.read(chunk));
+    if (size > chunk) {
+        file.seek(qMax(chunk, size - chunk));
+        hash.addData(file.read(chunk));
+    }
+
+    quint64 fingerprint = 0;
+    memcpy(&fingerprint, hash.result().constData(), sizeof(fingerprint));
+    return fingerprint;
+}
+
+bool NNStore::open(const QString &fileName, const QString &weightsFile, int maximumPlies)
+{
+    const quint64 weights = weightsFingerprint(weightsFile);
+
+    QMutexLocker locker(&m_mutex);
+    m_maximumPlies = maximumPlies;
+    if (m_file.isOpen() && m_file.fileName() == fileName
+        && reinterpret_cast<const Header*>(m_map)->weights == weights) {
+        return true; // already open for these weights
+    }
+
+    closeLocked();
+    m_file.setFileName(fileName);
+    if (!weights || !m_file.open(QIODevice::ReadWrite | QIODevice::Unbuffered))
+        return false;
+
+    if (m_file.size() < qint64(sizeof(Header))) {
+        Header header;
+        header.magic = Magic;
+        header.version = Version;
+        header.weights = weights;
+        m_file.resize(0);
+        if (m_file.write(reinterpret_cast<const char*>(&header), sizeof(Header)) != sizeof(Header)) {
+            closeLocked();
+            return false;
+        }
+    }
+
+    // A record cut short by a crash is dropped and written over by the next one
+    m_records = quint32((m_file.size() - qint64(sizeof(Header))) / qint64(sizeof(Record)));
+    m_file.resize(qint64(sizeof(Header)) + qint64(m_records) * qint64(sizeof(Record)));
+    m_map = m_file.map(0, m_file.size());
+    const Header *header = reinterpret_cast<const Header*>(m_map);
+    if (!header || header->magic != Magic || header->version != Version || header->weights != weights) {
+        closeLocked();
+        return false;
+    }
+
+    m_mappedRecords = m_records;
+    m_index.reserve(int(m_records));
+    const Record *records = reinterpret_cast<const Record*>(m_map + sizeof(Header));
+    for (quint32 i = 0; i < m_records; ++i)
+        m_index.insert(records[i].key, i);
+    m_hits = 0;
+    m_misses = 0;
+    return true;
+}
+
+void NNStore::close()
+{
+    QMutexLocker locker(&m_mutex);
+    closeLocked();
+}
+
+void NNStore::closeLocked()
+{
+    if (m_map)
+        m_file.unmap(m_map);
+    m_map = nullptr;
+    m_mappedRecords = 0;
+    m_records = 0;
+    m_index.clear();
+    if (m_file.isOpen())
+        m_file.close();
+}
+
+quint64 NNStore::count() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_records;
+}
+
+const NNStore::Record *NNStore::record(quint32 index)
+{
+    if (index >= m_mappedRecords) {
+        uchar *map = m_file.map(0, m_file.size());
+        if (!map)
+            return nullptr;
+        m_file.unmap(m_map);
+        m_map = map;
+        m_mappedRecords = m_records;
+    }
+    return reinterpret_cast<const Record*>(m_map + sizeof(Header)) + index;
+}
+
+bool NNStore::fetch(quint64 key, Node *node)
+{
+    Node::PotentialVector *potentials = node->position()->potentials();
+    QMutexLocker locker(&m_mutex);
+    if (!m_file.isOpen())
+        return false;
+
+    const auto it = m_index.constFind(key);
+    const Record *entry = it != m_index.constEnd() ? record(it.value()) : nullptr;
+    if (!key || !entry || entry->count != potentials->count()) {
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    m_hits.fetch_add(1, std::memory_order_relaxed);
+    node->setPositionQValue(entry->qValue);
+    for (int i = 0; i < potentials->count(); ++i)
+        (*potentials)[i].setPValue(entry->policy[i] / 65535.0f);
+    return true;
+}
+
+void NNStore::store(quint64 key, const Node *node)
+{
+    const Node::PotentialVector *potentials = node->position()->potentials();
+    if (!key || potentials->count() > MaximumMoves)
+        return;
+
+    QMutexLocker locker(&m_mutex);
+    if (!m_file.isOpen() || node->game().halfMoveNumber() - 2 > m_maximumPlies
+        || m_index.contains(key)) {
+        return;
+    }
+
+    Record entry;
+    memset(&entry, 0, sizeof(Record));
+    entry.key = key;
+    entry.qValue = node->positionQValue();
+    entry.count = quint16(potentials->count());
+    for (int i = 0; i < potentials->count(); ++i)
+        entry.policy[i] = quint16(qRound(qBound(0.0f, potentials->at(i).pValue(), 1.0f) * 65535.0f));
+
+    m_file.seek(m_file.size());
+    if (m_file.write(reinterpret_cast<const char*>(&entry), sizeof(Record)) != sizeof(Record))
+        return;
+    m_index.insert(key, m_records++);
+}
@@ -21,21 +21,29 @@
 #ifndef NN_H
 #define NN_H
 
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
 #include <QMutex>
 #include <QWaitCondition>
 
+#include <atomic>
+#include <thread>
+
 #include "game.h"
+#include "memoryreport.h"
 #include "node.h"
 
 #include "neural/network.h"
 
 class Computation {
 public:
-    Computation(QSharedPointer<lczero::Network> network);
+    Computation(QSharedPointer<lczero::Network> network, int device = 0); // the device for metrics
     ~Computation();
 
     void reset();
-    int addPositionToEvaluate(const Node *node);
+    quint64 encodePosition(const Node *node); // returns the key for the nn cache
+    int addEncodedPosition(const Node *node);
     int positions() const { return m_positions; }
     void evaluate();
     void clear();
@@ -43,35 +51,246 @@ public:
     float qVal(int index) const;
     void setPVals(int index, Node *node) const;
 
+    // For the nn server, which receives the samples already encoded along with the nn indices of
+    // their legal moves, and answers with the policy of those moves raised to the temperature and
+    // normalized
+    void setPolicyTemperature(float inverseTemperature);
+    int addInputPlanes(const quint64 *masks, const float *values, const quint16 *policyIndices);
+    void gatheredPVals(int index, const quint16 *policyIndices, float *pValues) const;
+
+    // The input buffers of this computation and the buffers of the backend its network allocated
+    quint64 hostMemory() const;
+    const lczero::Network *network() const { return m_network.data(); }
+    int device() const { return m_device; }
+
 private:
     int m_positions;
+    int m_device;
     QSharedPointer<lczero::Network> m_network;
     lczero::NetworkComputation *m_computation;
-    std::vector<lczero::InputPlane> m_inputPlanes;
+    std::vector<lczero::InputPlane> m_inputPlanes; // only used if the backend has no input slots
+    std::vector<uint64_t> m_inputMasks;
+    std::vector<float> m_inputValues;
+    bool m_usingInputSlot;
+    bool m_gatheringPolicy;
+    float m_policyTemperatureInverse;
+    const Node *m_lastEncodedParent; // these are only valid for the lifetime of the batch
+    const uint64_t *m_lastEncodedMasks;
+    const float *m_lastEncodedValues;
+    quint64 m_historyKey;
+
+    // Throughput of the computation measured by evaluate and used by the scheduler of NeuralNet
+    qint64 m_evaluationNsecs;
+    double m_nsecsPerPosition; // zero until measured
+    qint64 m_busyUntil; // estimated by the scheduler while acquired
+    quint32 m_bindingGeneration; // of the NeuralNet when bound
+    int m_processorBatch; // of the processor next to the gpus taking batches smaller than this
+    friend class NeuralNet;
+};
+
+// Fixed size cache of network results keyed by a hash of the encoded input planes, which covers
+// the move history and the fifty move counter. Each entry holds the value and the policy of every
+// legal move in the order the potentials are generated. Direct mapped and always replacing.
+class NNCache {
+public:
+    NNCache();
+
+    void reset(quint64 entries);
+    bool fetch(quint64 key, Node *node); // applies a cached result to the node if there is one
+    void store(quint64 key, const Node *node);
+    quint64 hits() const { return m_hits.load(std::memory_order_relaxed); }
+    quint64 misses() const { return m_misses.load(std::memory_order_relaxed); }
+    MemoryUsage memoryUsage() const;
+
+private:
+    enum { MaximumMoves = 64 };
+    struct Entry {
+        quint64 key;
+        float qValue;
+        quint16 count;
+        quint16 policy[MaximumMoves];
+    };
+
+    mutable QMutex m_mutex;
+    std::vector<Entry> m_entries;
+    quint64 m_mask;
+    std::atomic<quint64> m_hits; // changed under the mutex but read by the metrics without it
+    std::atomic<quint64> m_misses;
 };
 
+// Network results of the positions near the start of the game kept on disk across runs, keyed
+// like the nn cache. The file is only ever appended to and is memory mapped for reading. It is
+// tied to the weights that wrote it, so that openings seen before need no network at all.
+class NNStore {
+public:
+    NNStore();
+    ~NNStore();
+
+    // False and closed where the file can not be opened or was written by other weights
+    bool open(const QString &fileName, const QString &weightsFile, int maximumPlies);
+    void close();
+    bool isOpen() const { return m_file.isOpen(); }
+
+    bool fetch(quint64 key, Node *node); // applies a stored result to the node if there is one
+    void store(quint64 key, const Node *node); // if near enough to the start and not yet stored
+    quint64 count() const;
+    quint64 hits() const { return m_hits.load(std::memory_order_relaxed); }
+    quint64 misses() const { return m_misses.load(std::memory_order_relaxed); }
+
+private:
+    enum { Magic = 0x414c4e53 /* ALNS */, Version = 1, MaximumMoves = 64 };
+    struct Header {
+        quint32 magic;
+        quint32 version;
+        quint64 weights;
+    };
+    struct Record {
+        quint64 key;
+        float qValue;
+        quint16 count;
+        quint16 policy[MaximumMoves];
+        quint16 padding;
+    };
+
+    static quint64 weightsFingerprint(const QString &weightsFile);
+    void closeLocked();
+    const Record *record(quint32 index); // maps the records appended since the last call
+
+    mutable QMutex m_mutex;
+    QFile m_file;
+    uchar *m_map;
+    quint32 m_mappedRecords;
+    quint32 m_records;
+    QHash<quint64, quint32> m_index; // of every record by key
+    int m_maximumPlies;
+    std::atomic<quint64> m_hits; // changed under the mutex but read by the metrics without it
+    std::atomic<quint64> m_misses;
+};
+
+namespace lczero {
+struct ConvertedWeights;
+struct TensorRTOptions;
+}
+
 class NeuralNet {
 public:
     static NeuralNet *globalInstance();
+    // The optional small network of SmallWeightsFile for the leaves, with the gpu options of the
+    // large one. It has a cache of its own and never a store.
+    static NeuralNet *smallInstance();
 
+    // The first call loads the networks and blocks. Afterwards a change of the weights or of the
+    // gpu options is loaded in the background while the current networks keep serving.
     void reset();
+    void loadNetworks(); // like reset but leaves the cache alone
+    // Installs networks that have finished loading in the background, or waits for those still
+    // loading when asked to. Only call between searches.
+    void switchNetworks(bool wait = false);
+    NNCache *cache() { return &m_cache; }
+    NNStore *store() { return &m_store; }
     void setWeights(const QString &pathToWeights);
-    Computation *acquireNetwork(); // will block until a network is ready
+    bool isLoaded() const { return !m_config.weightsFile.isEmpty(); }
+    void unload(); // frees the networks and the cache until the next reset
+    // Hands out the computation expected to finish evaluating this many positions first, which
+    // can mean waiting for a busy but much faster one. Will block until a network is ready.
+    Computation *acquireNetwork(int positions);
+    // An idle computation of the processor for a batch small enough to go to it in place of the
+    // gpus, or null. Does not block, so a thread with a computation bound to it can ask first.
+    Computation *acquireProcessor(int positions);
     void releaseNetwork(Computation*); // must be called when you are done
+    // Takes a computation of the device out of the pool for the calling thread alone, which then
+    // evaluates batch after batch on it without the scheduler or its lock. Null where none of the
+    // device is free or since a thread had to wait for a network, and the thread acquires them
+    // batch by batch instead.
+    Computation *bindNetwork(int device);
+    void unbindNetwork(Computation *computation); // gives it back to the pool
+    // Lock free check before each batch of a bound computation, false once the networks were
+    // switched or the threads acquiring them need it back
+    quint32 bindingGeneration() const { return m_bindingGeneration.load(std::memory_order_acquire); }
+    bool isBound(const Computation *computation) const
+    { return computation->m_bindingGeneration == bindingGeneration(); }
+    void recordEvaluation(Computation *computation); // after each batch of a bound computation
+    // Measured time of a forward pass for batches of up to this power of two, zero if none ran yet
+    qint64 evaluationNsecs(int positions);
+    // What the computations and their backends hold in host and in device memory
+    void memoryUsage(MemoryUsage *host, MemoryUsage *device);
 
 private:
+    struct Config {
+        QString weightsFile;
+        QString server; // evaluates on an nn server in place of the gpus where not empty
+        int serverComputations = 0;
+        int gpuCores = 0;
+        QString precision;
+        bool useTensorRT = false;
+        int maxBatchSize = 0; // of the buffers of every backend and the TensorRT engine
+        QString calibrationFile;
+        bool useCustomWinograd = false;
+        bool autotune = false;
+        bool useCudaGraphs = false;
+        bool useCPU = false;
+        int cpuThreads = 0;
+        int hybridCPUBatch = 0; // smaller batches go to the processor next to the gpus
+        bool synthetic = false; // hashed evaluations in place of the weights
+        int syntheticLatency = 0; // microseconds of every synthetic batch
+
+        bool operator==(const Config &other) const
+        {
+            return weightsFile == other.weightsFile
+                && server == other.server
+                && serverComputations == other.serverComputations
+                && gpuCores == other.gpuCores
+                && precision == other.precision
+                && useTensorRT == other.useTensorRT
+                && maxBatchSize == other.maxBatchSize
+                && calibrationFile == other.calibrationFile
+                && useCustomWinograd == other.useCustomWinograd
+                && autotune == other.autotune
+                && useCudaGraphs == other.useCudaGraphs
+                && useCPU == other.useCPU
+                && cpuThreads == other.cpuThreads
+                && hybridCPUBatch == other.hybridCPUBatch
+                && synthetic == other.synthetic
+                && syntheticLatency == other.syntheticLatency;
+        }
+    };
+
     NeuralNet();
     ~NeuralNet();
-    lczero::Network *createNewGPUNetwork(int id, bool fp16, bool useCustomWinograd) const;
+    Config currentConfig() const;
+    static QVector<Computation*> createNetworks(const Config &config);
+    static lczero::Network *createNewGPUNetwork(const lczero::ConvertedWeights &weights, int id,
+        const Config &config, const lczero::TensorRTOptions &tensorRT);
+    Computation *takeProcessor(int positions); // with the mutex held
+    void finishLoading();
+    void openStore(); // of the weights serving now
+    void installNetworks(const QVector<Computation*> &networks);
 
+    QVector<Computation*> m_networks;
     QVector<Computation*> m_availableNetworks;
+    QVector<Computation*> m_retiredNetworks; // in flight and deleted once released
+    QVector<Computation*> m_boundNetworks;
+    std::atomic<quint32> m_bindingGeneration;
+    std::atomic<int> m_processorBatch; // zero without a processor next to the gpus
+    bool m_bindingRevoked; // until the next networks are installed
+    enum { EvaluationBuckets = 17 };
+    // By the power of two the batch size rounds up to, and written by bound threads without a lock
+    std::atomic<qint64> m_evaluationNsecs[EvaluationBuckets];
+    QElapsedTimer m_clock;
+    NNCache m_cache;
+    NNStore m_store;
     QMutex m_mutex;
     QWaitCondition m_condition;
-    bool m_weightsValid;
-    bool m_usingFP16;
-    bool m_usingCustomWinograd;
+    QString m_weightsFile;
+    Config m_config;
+    Config m_pendingConfig;
+    QVector<Computation*> m_pendingNetworks;
+    std::thread m_loader;
+    std::atomic<bool> m_loaded;
+    bool m_isSmall;
     friend class Computation;
     friend class MyNeuralNet;
+    friend class MySmallNeuralNet;
 };
 
 #endif // NN_H
@@ -0,0 +1,540 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "nnremote.h"
+
+#include <QDebug>
+#include <QMutex>
+#include <QVector>
+
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#if !defined(Q_OS_WIN)
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+using namespace lczero;
+
+void NNRemote::encodeSample(const quint64 *masks, const float *values, const quint16 *policyIndices,
+    QByteArray *out)
+{
+    // Most planes of a position are empty so only the ones with bits set are sent
+    quint64 planes[2] = { 0, 0 };
+    for (int i = 0; i < kInputPlanes; ++i) {
+        if (masks[i])
+            planes[i / 64] |= quint64(1) << (i % 64);
+    }
+
+    const quint16 moves = policyIndices[0];
+    out->append(reinterpret_cast<const char*>(policyIndices), int((moves + 1) * sizeof(quint16)));
+    out->append(reinterpret_cast<const char*>(planes), sizeof(planes));
+    for (int i = 0; i < kInputPlanes; ++i) {
+        if (!masks[i])
+            continue;
+        out->append(reinterpret_cast<const char*>(&masks[i]), sizeof(quint64));
+        out->append(reinterpret_cast<const char*>(&values[i]), sizeof(float));
+    }
+}
+
+bool NNRemote::decodeSample(const char **data, const char *end, quint64 *masks, float *values,
+    quint16 *policyIndices)
+{
+    const char *p = *data;
+    const auto take = [&](void *to, size_t size) {
+        if (size_t(end - p) < size)
+            return false;
+        memcpy(to, p, size);
+        p += size;
+        return true;
+    };
+
+    quint16 moves = 0;
+    if (!take(&moves, sizeof(moves)) || moves > kMaxPolicyIndices)
+        return false;
+    policyIndices[0] = moves;
+    if (!take(policyIndices + 1, moves * sizeof(quint16)))
+        return false;
+
+    quint64 planes[2] = { 0, 0 };
+    if (!take(planes, sizeof(planes)))
+        return false;
+    for (int i = 0; i < kInputPlanes; ++i) {
+        masks[i] = 0;
+        values[i] = 1.0f;
+        if (!(planes[i / 64] & (quint64(1) << (i % 64))))
+            continue;
+        if (!take(&masks[i], sizeof(quint64)) || !take(&values[i], sizeof(float)))
+            return false;
+    }
+
+    *data = p;
+    return true;
+}
+
+#if !defined(Q_OS_WIN)
+// Connects without waiting longer than the timeout and leaves the socket blocking again
+static bool connectWithin(int s, const addrinfo *address, int timeoutMsecs)
+{
+    const int flags = fcntl(s, F_GETFL, 0);
+    fcntl(s, F_SETFL, flags | O_NONBLOCK);
+    bool connected = ::connect(s, address->ai_addr, address->ai_addrlen) == 0;
+    if (!connected && errno == EINPROGRESS) {
+        pollfd writable;
+        writable.fd = s;
+        writable.events = POLLOUT;
+        writable.revents = 0;
+        int error = 0;
+        socklen_t length = sizeof(error);
+        connected = poll(&writable, 1, timeoutMsecs) == 1
+            && getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && !error;
+    }
+    fcntl(s, F_SETFL, flags);
+    return connected;
+}
+
+int NNRemote::connectTo(const QString &address, int timeoutMsecs)
+{
+    const int colon = address.lastIndexOf(':');
+    if (colon == -1)
+        return -1;
+    const QByteArray host = address.left(colon).toLatin1();
+    const QByteArray port = address.mid(colon + 1).toLatin1();
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addresses = nullptr;
+    if (getaddrinfo(host.constData(), port.constData(), &hints, &addresses) != 0)
+        return -1;
+
+    int s = -1;
+    for (addrinfo *a = addresses; a; a = a->ai_next) {
+        s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (s == -1)
+            continue;
+        if (timeoutMsecs == -1 ? ::connect(s, a->ai_addr, a->ai_addrlen) == 0
+                               : connectWithin(s, a, timeoutMsecs)) {
+            break;
+        }
+        ::close(s);
+        s = -1;
+    }
+    freeaddrinfo(addresses);
+    if (s == -1)
+        return -1;
+
+    // Requests are written whole so there is nothing to gain by holding them back
+    const int noDelay = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return s;
+}
+
+int NNRemote::listenOn(const QString &host, quint16 port)
+{
+    // Without a host the wildcard address of ipv6 takes the connections of ipv4 as well
+    const QByteArray name = host.toLatin1();
+    const QByteArray service = QByteArray::number(port);
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = host.isEmpty() ? AF_INET6 : AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    addrinfo *addresses = nullptr;
+    if (getaddrinfo(host.isEmpty() ? nullptr : name.constData(), service.constData(), &hints,
+            &addresses) != 0) {
+        return -1;
+    }
+
+    int s = -1;
+    for (addrinfo *a = addresses; a; a = a->ai_next) {
+        s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (s == -1)
+            continue;
+
+        const int reuse = 1;
+        const int v6Only = 0;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (a->ai_family == AF_INET6)
+            setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof(v6Only));
+        if (bind(s, a->ai_addr, a->ai_addrlen) == 0 && listen(s, 64) == 0)
+            break;
+        ::close(s);
+        s = -1;
+    }
+    freeaddrinfo(addresses);
+    return s;
+}
+
+int NNRemote::acceptOn(int listener)
+{
+    const int s = accept(listener, nullptr, nullptr);
+    if (s == -1) {
+        // Out of descriptors or memory fails again right away until a connection closes
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return -1;
+    }
+    const int noDelay = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return s;
+}
+
+bool NNRemote::send(int socket, const void *data, size_t size)
+{
+    const char *p = static_cast<const char*>(data);
+    while (size) {
+        const ssize_t sent = ::send(socket, p, size, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return false;
+        p += sent;
+        size -= size_t(sent);
+    }
+    return true;
+}
+
+bool NNRemote::receive(int socket, void *data, size_t size)
+{
+    char *p = static_cast<char*>(data);
+    while (size) {
+        const ssize_t received = ::recv(socket, p, size, 0);
+        if (received <= 0)
+            return false;
+        p += received;
+        size -= size_t(received);
+    }
+    return true;
+}
+
+bool NNRemote::receiveLine(int socket, QByteArray *buffer, QByteArray *line)
+{
+    char data[4096];
+    forever {
+        const int newline = buffer->indexOf('\n');
+        if (newline != -1) {
+            *line = buffer->left(newline);
+            buffer->remove(0, newline + 1);
+            if (line->endsWith('\r'))
+                line->chop(1);
+            return true;
+        }
+        if (buffer->size() > MaximumLine)
+            return false;
+        const ssize_t received = ::recv(socket, data, sizeof(data), 0);
+        if (received <= 0)
+            return false;
+        buffer->append(data, int(received));
+    }
+}
+
+void NNRemote::setReceiveTimeout(int socket, int msecs)
+{
+    timeval timeout;
+    timeout.tv_sec = msecs / 1000;
+    timeout.tv_usec = (msecs % 1000) * 1000;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+void NNRemote::shutdownSocket(int socket)
+{
+    if (socket != -1)
+        ::shutdown(socket, SHUT_RDWR);
+}
+
+void NNRemote::closeSocket(int socket)
+{
+    if (socket != -1)
+        ::close(socket);
+}
+#else
+int NNRemote::connectTo(const QString &, int) { return -1; }
+int NNRemote::listenOn(const QString &, quint16) { return -1; }
+int NNRemote::acceptOn(int) { return -1; }
+bool NNRemote::send(int, const void *, size_t) { return false; }
+bool NNRemote::receive(int, void *, size_t) { return false; }
+bool NNRemote::receiveLine(int, QByteArray *, QByteArray *) { return false; }
+void NNRemote::setReceiveTimeout(int, int) {}
+void NNRemote::shutdownSocket(int) {}
+void NNRemote::closeSocket(int) {}
+#endif
+
+bool NNRemote::handshake(int socket)
+{
+    const quint32 ours[2] = { Magic, Version };
+    quint32 theirs[2] = { 0, 0 };
+    return send(socket, ours, sizeof(ours))
+        && receive(socket, theirs, sizeof(theirs))
+        && theirs[0] == ours[0] && theirs[1] == ours[1];
+}
+
+class RemoteNetwork;
+
+// The socket of one connection to the server and the buffers of the batch going over it
+struct RemoteConnection {
+    int socket = -1;
+    std::vector<uint64_t> masks;
+    std::vector<float> values;
+    std::vector<uint16_t> policyIndices;
+    std::vector<float> qValues;
+    std::vector<float> pValues; // kMaxPolicyIndices per sample
+    QByteArray request;
+    QByteArray reply;
+
+    RemoteConnection()
+    {
+        masks.resize(NNRemote::MaximumBatch * kInputPlanes);
+        values.resize(NNRemote::MaximumBatch * kInputPlanes);
+        policyIndices.resize(NNRemote::MaximumBatch * kPolicyIndicesStride);
+        qValues.resize(NNRemote::MaximumBatch);
+        pValues.resize(NNRemote::MaximumBatch * kMaxPolicyIndices);
+    }
+
+    ~RemoteConnection() { NNRemote::closeSocket(socket); }
+
+    size_t memory() const
+    {
+        return masks.capacity() * sizeof(uint64_t)
+            + values.capacity() * sizeof(float)
+            + policyIndices.capacity() * sizeof(uint16_t)
+            + qValues.capacity() * sizeof(float)
+            + pValues.capacity() * sizeof(float)
+            + size_t(request.capacity() + reply.capacity());
+    }
+};
+
+class RemoteNetwork : public Network {
+public:
+    RemoteNetwork(const QString &address) : m_address(address) {}
+
+    bool isCPU() const override { return false; }
+    std::unique_ptr<NetworkComputation> NewComputation() override;
+
+    size_t hostMemory() const override
+    {
+        QMutexLocker locker(&m_mutex);
+        size_t memory = 0;
+        for (const auto &connection : m_connections)
+            memory += connection->memory();
+        return memory;
+    }
+
+    RemoteConnection *acquireConnection()
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_idle.isEmpty()) {
+            m_connections.emplace_back(new RemoteConnection);
+            return m_connections.back().get();
+        }
+        return m_idle.takeLast();
+    }
+
+    void releaseConnection(RemoteConnection *connection)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_idle.append(connection);
+    }
+
+    // Opens the socket of the connection where it is not yet or no longer connected
+    bool connect(RemoteConnection *connection)
+    {
+        if (connection->socket != -1)
+            return true;
+        connection->socket = NNRemote::connectTo(m_address);
+        if (connection->socket != -1 && NNRemote::handshake(connection->socket))
+            return true;
+        NNRemote::closeSocket(connection->socket);
+        connection->socket = -1;
+        return false;
+    }
+
+    QString address() const { return m_address; }
+
+private:
+    QString m_address;
+    mutable QMutex m_mutex;
+    std::vector<std::unique_ptr<RemoteConnection>> m_connections;
+    QVector<RemoteConnection*> m_idle;
+};
+
+class RemoteNetworkComputation : public NetworkComputation {
+public:
+    RemoteNetworkComputation(RemoteNetwork *network)
+        : m_network(network),
+        m_connection(network->acquireConnection()),
+        m_batchSize(0),
+        m_policyTemperatureInverse(1.0f)
+    {
+    }
+
+    ~RemoteNetworkComputation() override
+    {
+        m_network->releaseConnection(m_connection);
+    }
+
+    void AddInput(InputPlanes *input) override
+    {
+        uint64_t *masks;
+        float *values;
+        GetInputSlot(&masks, &values);
+        for (int i = 0; i < kInputPlanes; ++i) {
+            masks[i] = (*input)[size_t(i)].mask;
+            values[i] = (*input)[size_t(i)].value;
+        }
+        CommitInput();
+    }
+
+    bool GetInputSlot(uint64_t **masks, float **values) override
+    {
+        Q_ASSERT(m_batchSize < NNRemote::MaximumBatch);
+        *masks = &m_connection->masks[size_t(m_batchSize * kInputPlanes)];
+        *values = &m_connection->values[size_t(m_batchSize * kInputPlanes)];
+        return true;
+    }
+
+    void CommitInput() override { ++m_batchSize; }
+
+    // The server always gathers the policy so that only that of the legal moves comes back
+    uint16_t *GetPolicyIndicesSlot() override
+    {
+        return &m_connection->policyIndices[size_t(m_batchSize * kPolicyIndicesStride)];
+    }
+
+    void SetPolicyTemperature(float inverseTemperature) override
+    {
+        m_policyTemperatureInverse = inverseTemperature;
+    }
+
+    void ComputeBlocking() override
+    {
+        ComputeAsync();
+        WaitForCompletion();
+    }
+
+    void ComputeAsync() override
+    {
+        QByteArray &request = m_connection->request;
+        request.resize(sizeof(NNRemote::RequestHeader));
+        for (int i = 0; i < m_batchSize; ++i) {
+            NNRemote::encodeSample(&m_connection->masks[size_t(i * kInputPlanes)],
+                &m_connection->values[size_t(i * kInputPlanes)],
+                &m_connection->policyIndices[size_t(i * kPolicyIndicesStride)], &request);
+        }
+
+        NNRemote::RequestHeader header;
+        header.bytes = quint32(request.size() - int(sizeof(NNRemote::RequestHeader)));
+        header.count = quint32(m_batchSize);
+        header.policyTemperatureInverse = m_policyTemperatureInverse;
+        memcpy(request.data(), &header, sizeof(header));
+        m_sent = sendRequest();
+    }
+
+    void WaitForCompletion() override
+    {
+        // A server that went away is given one more try on a fresh connection
+        if (m_sent && receiveReply())
+            return;
+        NNRemote::closeSocket(m_connection->socket);
+        m_connection->socket = -1;
+        if (!sendRequest() || !receiveReply())
+            qFatal("Lost the connection to the nn server at %s", m_network->address().toLatin1().constData());
+    }
+
+    bool Reset() override
+    {
+        m_batchSize = 0;
+        m_sent = false;
+        return true;
+    }
+
+    int GetBatchSize() const override { return m_batchSize; }
+    float GetQVal(int sample) const override { return m_connection->qValues[size_t(sample)]; }
+    float GetDVal(int) const override { return 0.0f; }
+    float GetPVal(int, int) const override { return 0.0f; }
+
+    float GetGatheredPVal(int sample, int i) const override
+    {
+        return m_connection->pValues[size_t(sample * kMaxPolicyIndices + i)];
+    }
+
+private:
+    bool sendRequest()
+    {
+        return m_network->connect(m_connection)
+            && NNRemote::send(m_connection->socket, m_connection->request.constData(),
+                size_t(m_connection->request.size()));
+    }
+
+    bool receiveReply()
+    {
+        NNRemote::ReplyHeader header;
+        if (!NNRemote::receive(m_connection->socket, &header, sizeof(header)))
+            return false;
+
+        QByteArray &reply = m_connection->reply;
+        reply.resize(int(header.bytes));
+        if (!NNRemote::receive(m_connection->socket, reply.data(), header.bytes))
+            return false;
+
+        const char *p = reply.constData();
+        const char *end = p + reply.size();
+        for (int i = 0; i < m_batchSize; ++i) {
+            const quint16 moves = m_connection->policyIndices[size_t(i * kPolicyIndicesStride)];
+            if (size_t(end - p) < sizeof(float) + moves * sizeof(quint16))
+                return false;
+            memcpy(&m_connection->qValues[size_t(i)], p, sizeof(float));
+            p += sizeof(float);
+            float *pValues = &m_connection->pValues[size_t(i * kMaxPolicyIndices)];
+            for (int m = 0; m < moves; ++m, p += sizeof(quint16)) {
+                quint16 policy;
+                memcpy(&policy, p, sizeof(policy));
+                pValues[m] = policy / 65535.0f;
+            }
+        }
+        return true;
+    }
+
+    RemoteNetwork *m_network;
+    RemoteConnection *m_connection;
+    int m_batchSize;
+    float m_policyTemperatureInverse;
+    bool m_sent = false;
+};
+
+std::unique_ptr<NetworkComputation> RemoteNetwork::NewComputation()
+{
+    return std::make_unique<RemoteNetworkComputation>(this);
+}
+
+Network *createRemoteNetwork(const QString &address)
+{
+    return new RemoteNetwork(address);
+}
@@ -0,0 +1,74 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef NNREMOTE_H
+#define NNREMOTE_H
+
+#include <QByteArray>
+#include <QString>
+
+#include "neural/network.h"
+
+// The protocol between engines and the nn server. After a handshake of the magic and the version
+// each way, every request is a header followed by its samples and is answered by a header followed
+// by the value and the policy of the legal moves of every sample. Both ends are expected to share
+// the byte order. A sample holds the number of legal moves and their nn indices, a bitmap of the
+// input planes that have any bits set and then the mask and the value of each of those planes.
+namespace NNRemote {
+    enum { Magic = 0x414c4e52 /* ALNR */, Version = 1, MaximumBatch = 1024 };
+
+    struct RequestHeader {
+        quint32 bytes;    // of the samples that follow
+        quint32 count;
+        float policyTemperatureInverse;
+    };
+
+    struct ReplyHeader {
+        quint32 bytes;    // of the results that follow, a value and a quantized policy per move
+    };
+
+    void encodeSample(const quint64 *masks, const float *values, const quint16 *policyIndices,
+        QByteArray *out);
+    // False where the data is cut short or malformed
+    bool decodeSample(const char **data, const char *end, quint64 *masks, float *values,
+        quint16 *policyIndices);
+
+    // Blocking sockets, which are -1 where they could not be opened
+    // Of host:port, giving up on every address after the timeout where it is not -1
+    int connectTo(const QString &address, int timeoutMsecs = -1);
+    int listenOn(const QString &host, quint16 port); // every address where the host is empty
+    int acceptOn(int listener); // waits a little before failing so a loop on it does not spin
+    bool send(int socket, const void *data, size_t size);
+    bool receive(int socket, void *data, size_t size);
+    // The next line without its newline, where buffer keeps what was read past it for next time.
+    // False where the connection closed or the line grew past the most a line may have.
+    enum { MaximumLine = 64 * 1024 };
+    bool receiveLine(int socket, QByteArray *buffer, QByteArray *line);
+    void setReceiveTimeout(int socket, int msecs); // after which a receive on it fails
+    void shutdownSocket(int socket); // wakes up a thread blocked on it
+    void closeSocket(int socket);
+    bool handshake(int socket); // both ends send theirs first and check the other
+}
+
+// A network whose computations are evaluated by an nn server, each computation taking a connection
+// of its own for as long as it lives so that many can be in flight at once
+lczero::Network *createRemoteNetwork(const QString &address);
+
+#endif // NNREMOTE_H
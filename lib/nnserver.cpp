@@ -0,0 +1,216 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "nnserver.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+
+#include <cstring>
+#include <thread>
+
+#include "nn.h"
+#include "nnremote.h"
+#include "options.h"
+#include "search.h"
+
+using namespace lczero;
+
+// No sample can take more than its legal moves, the bitmap and every plane
+static const quint32 s_maximumSampleBytes = (kPolicyIndicesStride + 8) * sizeof(quint16)
+    + kInputPlanes * (sizeof(quint64) + sizeof(float));
+
+NNServer::NNServer()
+    : m_pendingPositions(0),
+    m_target(Options::globalInstance()->option("NNServerBatchSize").value().toInt()),
+    m_waitMsecs(Options::globalInstance()->option("NNServerWaitMsecs").value().toInt()),
+    m_listener(-1)
+{
+}
+
+NNServer::~NNServer()
+{
+    NNRemote::closeSocket(m_listener);
+}
+
+bool NNServer::run()
+{
+    if (!Options::globalInstance()->option("NNServer").value().isEmpty()) {
+        qWarning() << "The nn server can not itself evaluate on another nn server";
+        return false;
+    }
+
+    // The requests of the clients are combined into batches of up to the largest one they send
+    if (Options::globalInstance()->option("MaxBatchSize").value().toInt() < NNRemote::MaximumBatch)
+        Options::globalInstance()->setOption("MaxBatchSize", QString::number(NNRemote::MaximumBatch));
+
+    SearchSettings::weightsFile = Options::globalInstance()->option("WeightsFile").value();
+    NeuralNet::globalInstance()->setWeights(SearchSettings::weightsFile);
+    NeuralNet::globalInstance()->reset();
+
+    const quint16 port = quint16(Options::globalInstance()->option("NNServerPort").value().toUInt());
+    m_listener = NNRemote::listenOn(QString() /*every address*/, port);
+    if (m_listener == -1) {
+        qWarning() << "The nn server could not listen on port" << port;
+        return false;
+    }
+
+    fprintf(stderr, "nn server listening on port %d\n", port);
+    forever {
+        const int socket = NNRemote::acceptOn(m_listener);
+        if (socket == -1)
+            continue;
+        std::thread([this, socket]() { serve(socket); }).detach();
+    }
+}
+
+void NNServer::serve(int socket)
+{
+    Request request;
+    request.masks.resize(NNRemote::MaximumBatch * kInputPlanes);
+    request.values.resize(NNRemote::MaximumBatch * kInputPlanes);
+    request.policyIndices.resize(NNRemote::MaximumBatch * kPolicyIndicesStride);
+
+    QByteArray samples;
+    bool ok = NNRemote::handshake(socket);
+    while (ok) {
+        NNRemote::RequestHeader header;
+        if (!NNRemote::receive(socket, &header, sizeof(header))
+            || header.count > NNRemote::MaximumBatch
+            || header.bytes > header.count * s_maximumSampleBytes) {
+            break;
+        }
+
+        samples.resize(int(header.bytes));
+        if (!NNRemote::receive(socket, samples.data(), header.bytes))
+            break;
+
+        // Decoded here so that the connections share the work rather than the evaluating thread
+        const char *data = samples.constData();
+        const char *end = data + samples.size();
+        for (quint32 i = 0; i < header.count && ok; ++i) {
+            ok = NNRemote::decodeSample(&data, end, &request.masks[i * kInputPlanes],
+                &request.values[i * kInputPlanes], &request.policyIndices[i * kPolicyIndicesStride]);
+        }
+        if (!ok)
+            break;
+
+        request.count = int(header.count);
+        request.policyTemperatureInverse = header.policyTemperatureInverse;
+        request.isTaken = false;
+        request.isDone = false;
+        submit(&request);
+        ok = NNRemote::send(socket, request.reply.constData(), size_t(request.reply.size()));
+    }
+    NNRemote::closeSocket(socket);
+}
+
+QVector<NNServer::Request*> NNServer::take()
+{
+    // Oldest first and never more than a batch, but always at least one. A batch is evaluated at
+    // one policy temperature so requests at another wait for the next.
+    QVector<Request*> taken;
+    int positions = 0;
+    for (int i = 0; i < m_pending.count();) {
+        Request *request = m_pending.at(i);
+        if (!taken.isEmpty()
+            && (positions + request->count > NNRemote::MaximumBatch
+                || !qFuzzyCompare(request->policyTemperatureInverse, taken.first()->policyTemperatureInverse))) {
+            ++i;
+            continue;
+        }
+        m_pending.removeAt(i);
+        request->isTaken = true;
+        taken.append(request);
+        positions += request->count;
+    }
+    m_pendingPositions -= positions;
+    return taken;
+}
+
+void NNServer::submit(Request *request)
+{
+    QMutexLocker locker(&m_mutex);
+    m_pending.append(request);
+    m_pendingPositions += request->count;
+    QElapsedTimer timer;
+    timer.start();
+    while (!request->isDone) {
+        const qint64 waited = timer.elapsed();
+        if (!request->isTaken && (m_pendingPositions >= m_target || waited >= m_waitMsecs)) {
+            const QVector<Request*> taken = take();
+            locker.unlock();
+            evaluate(taken);
+            locker.relock();
+
+            for (Request *r : taken)
+                r->isDone = true;
+            m_condition.wakeAll();
+            continue;
+        }
+
+        if (request->isTaken)
+            m_condition.wait(&m_mutex);
+        else
+            m_condition.wait(&m_mutex, (unsigned long)(m_waitMsecs - waited));
+    }
+}
+
+void NNServer::evaluate(const QVector<Request*> &requests)
+{
+    int positions = 0;
+    for (const Request *request : requests)
+        positions += request->count;
+
+    Computation *computation = NeuralNet::globalInstance()->acquireNetwork(positions);
+    computation->reset();
+    computation->setPolicyTemperature(requests.first()->policyTemperatureInverse);
+    for (const Request *request : requests) {
+        for (int i = 0; i < request->count; ++i) {
+            computation->addInputPlanes(&request->masks[size_t(i * kInputPlanes)],
+                &request->values[size_t(i * kInputPlanes)],
+                &request->policyIndices[size_t(i * kPolicyIndicesStride)]);
+        }
+    }
+    computation->evaluate();
+
+    // The values as the network gives them and the policy quantized like the nn cache keeps it
+    float pValues[kMaxPolicyIndices];
+    int index = 0;
+    for (Request *request : requests) {
+        QByteArray &reply = request->reply;
+        reply.resize(sizeof(NNRemote::ReplyHeader));
+        for (int i = 0; i < request->count; ++i, ++index) {
+            const quint16 *policyIndices = &request->policyIndices[size_t(i * kPolicyIndicesStride)];
+            const float qValue = computation->qVal(index);
+            computation->gatheredPVals(index, policyIndices, pValues);
+            reply.append(reinterpret_cast<const char*>(&qValue), sizeof(float));
+            for (int m = 0; m < policyIndices[0]; ++m) {
+                const quint16 policy = quint16(qRound(qBound(0.0f, pValues[m], 1.0f) * 65535.0f));
+                reply.append(reinterpret_cast<const char*>(&policy), sizeof(quint16));
+            }
+        }
+
+        NNRemote::ReplyHeader header;
+        header.bytes = quint32(reply.size() - int(sizeof(NNRemote::ReplyHeader)));
+        memcpy(reply.data(), &header, sizeof(header));
+    }
+    NeuralNet::globalInstance()->releaseNetwork(computation);
+}
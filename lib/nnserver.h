@@ -0,0 +1,68 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef NNSERVER_H
+#define NNSERVER_H
+
+#include <QByteArray>
+#include <QMutex>
+#include <QVector>
+#include <QWaitCondition>
+
+#include <vector>
+
+// Evaluates the positions of engines on other machines with the local networks. Every connection
+// is served by a thread of its own and the requests of all of them are evaluated together the way
+// the batch combiner does for searches in one process: whichever thread finds enough positions
+// waiting, or has waited long enough, evaluates all of them while the others sleep.
+class NNServer {
+public:
+    NNServer();
+    ~NNServer();
+
+    bool run(); // serves until killed and is false where it could not listen
+
+private:
+    struct Request {
+        int count = 0;
+        float policyTemperatureInverse = 1.0f;
+        std::vector<quint64> masks;
+        std::vector<float> values;
+        std::vector<quint16> policyIndices;
+        QByteArray reply;
+        bool isTaken = false;
+        bool isDone = false;
+    };
+
+    void serve(int socket);
+    void submit(Request *request); // returns once the request has been evaluated
+    QVector<Request*> take();
+    void evaluate(const QVector<Request*> &requests);
+
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+    QVector<Request*> m_pending;
+    int m_pendingPositions;
+    int m_target;
+    int m_waitMsecs;
+    int m_listener;
+};
+
+#endif // NNSERVER_H
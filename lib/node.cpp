@@ -20,11 +20,25 @@
 
 #include "node.h"
 
+#include <QHash>
+
+#include <algorithm>
+#include <vector>
+
 #include "cache.h"
 #include "history.h"
+#include "matesolver.h"
 #include "notation.h"
 #include "neural/nn_policy.h"
+#include "stagetimes.h"
 #include "tb.h"
+#include "vectormath.h"
+
+// No chess position has more than 218 legal moves and the potential index is a byte
+static const int s_maxChildren = 256;
+
+// Trimming returns nodes to the arena, which the threads of a concurrent minimax share
+static QMutex s_trimMutex;
 
 int scoreToCP(float score)
 {
@@ -50,7 +64,9 @@ Node::Position::Position()
     m_qValue = -2.0f;
     m_visits = 0;
     m_refs = 0;
+    m_evictionCredit = 0;
     m_isUnique = false;
+    m_isSpeculative = false;
     m_type = NonTerminal;
 }
 
@@ -58,6 +74,80 @@ Node::Position::~Position()
 {
 }
 
+quint16 Node::Potential::packMove(const Move &move)
+{
+    quint16 packed = quint16(move.start().data() | (move.end().data() << 6));
+    switch (move.promotion()) {
+    case Chess::Knight: packed |= IsPromotionMask; break;
+    case Chess::Bishop: packed |= IsPromotionMask | 0x1000; break;
+    case Chess::Rook:   packed |= IsPromotionMask | 0x2000; break;
+    case Chess::Queen:  packed |= IsPromotionMask | 0x3000; break;
+    default: break;
+    }
+    if (move.isCastle())
+        packed |= CastleMask;
+    return packed;
+}
+
+Move Node::Potential::unpackMove(quint16 move)
+{
+    // The piece, the capture and en passant are filled in from the position the move is made on
+    Move mv;
+    if (!move)
+        return mv;
+
+    const Square start(quint8(move & StartMask));
+    const Square end(quint8((move & EndMask) >> 6));
+    mv.setStart(start);
+    mv.setEnd(end);
+    if (move & IsPromotionMask) {
+        static const Chess::PieceType promotions[] = { Chess::Knight, Chess::Bishop, Chess::Rook, Chess::Queen };
+        mv.setPromotion(promotions[(move & PromotionMask) >> 12]);
+    }
+    if (move & CastleMask) {
+        // Castles are king takes rook so the side is where the rook stands
+        mv.setPiece(Chess::King);
+        mv.setCastle(true);
+        mv.setCastleSide(start.file() < end.file() ? Chess::KingSide : Chess::QueenSide);
+    }
+    return mv;
+}
+
+void Node::PotentialVector::removeAt(int i)
+{
+    Q_ASSERT(i >= 0 && i < count());
+    Potential *d = data();
+    std::copy(d + i + 1, d + count(), d + i);
+    if (i < m_header->sorted)
+        --m_header->sorted;
+    --m_header->count;
+}
+
+void Node::PotentialVector::reserve(int capacity, PotentialPool *pool)
+{
+    capacity = qMin(capacity, int(MaximumCapacity));
+    if (capacity <= this->capacity())
+        return;
+
+    Q_ASSERT(m_header || pool);
+    Header *header = (m_header ? m_header->pool : pool)->allocate(capacity);
+    if (m_header) {
+        std::copy(begin(), end(), reinterpret_cast<Potential*>(header + 1));
+        header->count = m_header->count;
+        header->sorted = m_header->sorted;
+        header->smallValue = m_header->smallValue;
+        m_header->pool->release(m_header);
+    }
+    m_header = header;
+}
+
+void Node::PotentialVector::clear()
+{
+    if (m_header)
+        m_header->pool->release(m_header);
+    m_header = nullptr;
+}
+
 void Node::Position::initialize(const Game::Position &position)
 {
     m_position = position;
@@ -81,7 +171,9 @@ void Node::Position::deinitialize(bool forcedFree)
     m_qValue = -2.0f;
     m_visits = 0;
     m_refs = 0;
+    m_evictionCredit = 0;
     m_isUnique = false;
+    m_isSpeculative = false;
     m_type = NonTerminal;
 #if defined(DEBUG_CHURN)
     QString string;
@@ -92,27 +184,10 @@ void Node::Position::deinitialize(bool forcedFree)
 #endif
 }
 
-Node::Position *Node::Position::relinkOrMakeUnique(quint64 positionHash, Cache *cache, bool *madeUnique)
-{
-    if (!cache->containsNodePosition(positionHash))
-        return nullptr;
-
-    // Update the reference for this position in LRU hash
-    Node::Position *p = cache->nodePositionRelinkOrMakeUnique(positionHash, madeUnique);
-#if defined(DEBUG_CHURN)
-    if (*madeUnique) {
-        QString string;
-        QTextStream stream(&string);
-        stream << "relk p ";
-        stream << positionHash;
-        qDebug().noquote() << string;
-    }
-#endif
-    return p;
-}
-
 Node::Node()
+    : m_cache(Cache::globalInstance()->index())
 {
+    // Those made by a cache are given its index when handed out, this is for those on their own
     initialize(nullptr, Game());
 }
 
@@ -134,7 +209,8 @@ void Node::initialize(Node *parent, const Game &game)
     m_parent = parent;
     m_position = nullptr;
     m_potentialIndex = 0;
-    m_children.clear();
+    m_firstChild.store(0, std::memory_order_relaxed); // not reachable until appended
+    m_nextSibling.store(0, std::memory_order_relaxed);
     m_visited = 0;
     m_virtualLoss = 0;
     m_qValue = -2.0f;
@@ -144,6 +220,7 @@ void Node::initialize(Node *parent, const Game &game)
     m_gameCycles = 0;
     m_type = NonTerminal;
     m_context = NoContext;
+    m_bestChild = NoBestChild;
     m_isDirty = false;
 }
 
@@ -160,22 +237,12 @@ quint64 Node::initializePosition(Cache *cache)
     // Get a node position from hashpositions
     quint64 childPositionHash = childPosition.positionHash();
 
-    if (SearchSettings::featuresOff.testFlag(SearchSettings::Transpositions)) {
-        m_position = cache->newNodePosition(childPositionHash, true /*makeUnique*/);
-        if (!m_position)
-            qFatal("Fatal error: we have run out of positions in memory!");
-    } else {
-        bool madeUnique = false;
-        m_position = Node::Position::relinkOrMakeUnique(childPositionHash, cache, &madeUnique);
-        if (!m_position || madeUnique) {
-            m_position = cache->newNodePosition(childPositionHash);
-            if (!m_position)
-                qFatal("Fatal error: we have run out of positions in memory!");
-        }
-    }
-
-    Q_ASSERT(m_position);
-    m_position->ref();
+    // The transposition is looked up, or a new position made, and referenced in one step so that
+    // threads expanding at once never evict or make unique what another one just took
+    const bool makeUnique = SearchSettings::featuresOff.testFlag(SearchSettings::Transpositions);
+    m_position = cache->acquireNodePosition(childPositionHash, makeUnique);
+    if (!m_position)
+        qFatal("Fatal error: we have run out of positions in memory!");
     m_position->initialize(childPosition);
 
 #if defined(DEBUG_CHURN)
@@ -210,11 +277,11 @@ void Node::setPosition(Node::Position *position)
 
 void Node::deinitialize(bool forcedFree)
 {
-    Cache *cache = Cache::globalInstance();
+    Cache *cache = Cache::of(this);
     if (Node *parent = this->parent()) {
         // Remove ourself from parent's child list
         if (forcedFree)
-            parent->m_children.removeAll(this);
+            parent->removeChild(this);
 
 #if defined(DEBUG_CHURN)
         QString string;
@@ -226,11 +293,15 @@ void Node::deinitialize(bool forcedFree)
     }
 
     // Unlink all children as we do not want to leave them parentless
-    for (int i = 0; i < m_children.count(); ++i)
-        cache->unlinkNode(m_children.at(i));
+    quint32 handle = m_firstChild;
+    while (handle) {
+        const quint32 next = cache->node(handle)->m_nextSibling;
+        cache->unlinkNode(handle);
+        handle = next;
+    }
 
     if (m_position)
-        m_position->unref();
+        cache->releaseNodePosition(m_position);
 
 #if defined(DEBUG_CHURN)
     QString string;
@@ -247,7 +318,9 @@ void Node::deinitialize(bool forcedFree)
     m_position = nullptr;
     m_isDirty = false;
     m_context = NoContext;
-    m_children.clear();
+    m_bestChild = NoBestChild;
+    m_firstChild = 0;
+    m_nextSibling = 0;
 }
 
 void Node::unwindFromPosition(quint64 hash, Cache *cache)
@@ -270,11 +343,108 @@ Node *Node::bestChild() const
 {
     if (!hasChildren())
         return nullptr;
-    QVector<Node*> children = m_children;
-    sortByScore(children, true /*partialSortFirstOnly*/);
-    return children.first();
+
+    if (m_bestChild != NoBestChild) {
+        Node *child = firstChild();
+        for (int i = 0; i < m_bestChild && child; ++i)
+            child = child->nextSibling();
+        if (child)
+            return child;
+    }
+
+    // Same as the first after sorting by score
+    Node *best = firstChild();
+    for (Node *child = best->nextSibling(); child; child = child->nextSibling()) {
+        if (greaterThan(child, best))
+            best = child;
+    }
+    return best;
+}
+
+void Node::updateBestChild()
+{
+    const Node *best = nullptr;
+    int bestIndex = NoBestChild;
+    int index = 0;
+    for (const Node *child = firstChild(); child; child = child->nextSibling(), ++index) {
+        if (!best || greaterThan(child, best)) {
+            best = child;
+            bestIndex = index;
+        }
+    }
+    m_bestChild = quint8(qMin(bestIndex, int(NoBestChild)));
+}
+
+int Node::childCount() const
+{
+    int c = 0;
+    for (const Node *child = firstChild(); child; child = child->nextSibling())
+        ++c;
+    return c;
+}
+
+QVector<Node*> Node::children() const
+{
+    QVector<Node*> children;
+    for (Node *child = firstChild(); child; child = child->nextSibling())
+        children.append(child);
+    return children;
+}
+
+void Node::appendChild(Node *child, quint32 handle)
+{
+    Q_ASSERT(handle);
+    Q_ASSERT(child->parent() == this);
+    Q_ASSERT(!child->m_nextSibling.load(std::memory_order_relaxed));
+
+    // Concurrent descents walk the list without locking so the child has to be complete first
+    if (!m_firstChild.load(std::memory_order_relaxed)) {
+        m_firstChild.store(handle, std::memory_order_release);
+        return;
+    }
+
+    Node *last = firstChild();
+    while (last->m_nextSibling.load(std::memory_order_relaxed))
+        last = last->nextSibling();
+    last->m_nextSibling.store(handle, std::memory_order_release);
+}
+
+void Node::removeChild(Node *child)
+{
+    std::atomic<quint32> *link = &m_firstChild;
+    while (const quint32 handle = link->load(std::memory_order_relaxed)) {
+        Node *n = Cache::of(this)->node(handle);
+        if (n == child) {
+            link->store(n->m_nextSibling.load(std::memory_order_relaxed), std::memory_order_release);
+            n->m_nextSibling.store(0, std::memory_order_relaxed);
+            m_bestChild = NoBestChild;
+            return;
+        }
+        link = &n->m_nextSibling;
+    }
+    Q_UNREACHABLE();
+}
+
+int Node::count() const
+{
+    int c = isRootNode() ? 0 : 1; // me, myself, and I
+    for (const Node *child = firstChild(); child; child = child->nextSibling())
+        c += child->count();
+    return c;
+}
+
+void Node::setAsRootNode()
+{
+    // Need to remove ourself from our parent's children
+    if (m_parent)
+        m_parent->removeChild(this);
+
+    // Now we have no parent
+    m_parent = nullptr;
+    setType(NonTerminal);
 }
 
+template <typename Policy>
 void Node::scoreMiniMax(float score, bool isMinimaxExact, bool isExact, double newScores, quint32 newVisits)
 {
     Q_ASSERT(m_position);
@@ -308,16 +478,22 @@ void Node::scoreMiniMax(float score, bool isMinimaxExact, bool isExact, double n
         Q_ASSERT(minimaxType != MinimaxLoss || qFuzzyCompare(m_qValue, -1.0f));
         Q_ASSERT(minimaxType != MinimaxDraw || qFuzzyCompare(m_qValue, 0.0f));
     } else {
-        if (Q_LIKELY(!SearchSettings::featuresOff.testFlag(SearchSettings::Minimax))) {
+        if (Policy::minimax) {
             m_qValue = qBound(-1.f, float(m_visited * m_qValue + score + newScores) / float(m_visited + newVisits + 1), 1.f);
         } else
             m_qValue = qBound(-1.f, float(m_visited * m_qValue + newScores) / float(m_visited + newVisits), 1.f);
 
         // Update the position for any new transpositions to use the best score available which
-        // includes the subtree if it has no game context
+        // includes the subtree if it has no game context. In the transposition graph mode that is
+        // the score of whichever transposition has the most visits, which the position counts.
         if (m_context == NoContext && !isRootNode()) {
             Q_ASSERT(!m_position->isExact());
-            setPositionQValue(m_qValue);
+            if (!Policy::transpositionGraph) {
+                setPositionQValue(m_qValue);
+            } else if (m_visited + newVisits >= m_position->visits()) {
+                setPositionQValue(m_qValue);
+                m_position->setVisits(m_visited + newVisits);
+            }
         }
 
         // Change back to regular position if we've switched away from minimax exact
@@ -330,6 +506,34 @@ void Node::scoreMiniMax(float score, bool isMinimaxExact, bool isExact, double n
 void Node::incrementVisited(quint32 increment)
 {
     m_visited += increment;
+    updateUCoeff();
+    m_virtualLoss = 0;
+    m_isDirty = false;
+}
+
+void Node::mergeRemoteVisits(quint32 visits, float qValue)
+{
+    Q_ASSERT(m_parent);
+    Q_ASSERT(!isExact());
+    if (!visits)
+        return;
+
+    // Unlike a playout this leaves alone the virtual loss of the batches still in flight
+    m_qValue = qBound(-1.f, float((double(m_visited) * m_qValue + double(visits) * qValue)
+        / double(m_visited + visits)), 1.f);
+    m_visited += visits;
+    updateUCoeff();
+
+    Node *parent = m_parent;
+    parent->m_qValue = qBound(-1.f, float((double(parent->m_visited) * parent->m_qValue
+        - double(visits) * qValue) / double(parent->m_visited + visits)), 1.f);
+    parent->m_visited += visits;
+    parent->updateUCoeff();
+    parent->updateBestChild();
+}
+
+void Node::updateUCoeff()
+{
     const quint32 N = qMax(quint32(1), m_visited);
 #if defined(USE_CPUCT_SCALING)
     // From Deepmind's A0 paper
@@ -339,8 +543,6 @@ void Node::incrementVisited(quint32 increment)
     const float growth = 0.0f;
 #endif
     m_uCoeff = (SearchSettings::cpuctInit + growth) * float(qSqrt(N));
-    m_virtualLoss = 0;
-    m_isDirty = false;
 }
 
 void Node::setQValueAndVisit()
@@ -369,6 +571,14 @@ void Node::backPropagateDirty()
     }
 }
 
+void Node::abandonPlayout()
+{
+    Q_ASSERT(!m_visited);
+    Q_ASSERT(!m_isDirty);
+    for (Node *node = this; node; node = node->parent())
+        node->m_virtualLoss = 0;
+}
+
 void Node::backPropagateGameContextAndDirty()
 {
     Q_ASSERT(hasContext(GameContextDrawInTree));
@@ -399,6 +609,51 @@ void Node::backPropagateGameCycleAndDirty()
     }
 }
 
+void Node::refineEvaluation(float qValue)
+{
+    Q_ASSERT(m_position);
+    PotentialVector *potentials = m_position->potentials();
+    Q_ASSERT(potentials->hasSmallValue());
+    float correction = qValue - potentials->smallValue();
+    potentials->clearSmallValue();
+
+    m_policySum = 0;
+    for (Node *child = firstChild(); child; child = child->nextSibling()) {
+        const Potential move(child->m_game.lastMove());
+        for (const Potential &potential : *potentials) {
+            if (potential == move) {
+                child->setPValue(potential.pValue());
+                break;
+            }
+        }
+        if (child->m_visited)
+            m_policySum += child->pValue();
+    }
+
+    // The moves made into children keep their place and the rest are ordered again as needed
+    potentials->setSorted(qMin(int(m_potentialIndex), potentials->sorted()));
+
+    // The value of a node with a game context is not the one of its position so only the policy
+    // is taken there. Otherwise the averages are corrected as if the first visit had the new value.
+    if (m_context != NoContext || isMinimaxExact()) {
+        updateBestChild();
+        return;
+    }
+
+    if (!m_visited)
+        setPositionQValue(qValue);
+    for (Node *node = this; node; node = node->parent(), correction = -correction) {
+        if (node->m_visited && !node->isMinimaxExact()) {
+            node->m_qValue = qBound(-1.f, node->m_qValue + correction / float(node->m_visited), 1.f);
+            if (node->m_context == NoContext && !node->isRootNode()
+                && (!SearchSettings::transpositionGraph || node->m_visited >= node->m_position->visits())) {
+                node->setPositionQValue(node->m_qValue);
+            }
+        }
+        node->updateBestChild();
+    }
+}
+
 QVector<Game> Node::previousMoves(bool fullHistory) const
 {
     // This is slow because we build up a vector by prepending it
@@ -418,25 +673,36 @@ QVector<Game> Node::previousMoves(bool fullHistory) const
 
 void Node::principalVariation(int *depth, bool *isCheckMate, QTextStream *stream) const
 {
-    if (!isRootNode() && !hasPValue()) {
-        *isCheckMate = this->isCheckMate();
-        return;
+    Move moves[128];
+    const int count = principalVariation(moves, 128, depth, isCheckMate);
+    for (int i = 0; i < count; ++i) {
+        if (i)
+            *stream << QStringLiteral(" ");
+        *stream << Notation::moveToString(moves[i], Chess::Computer);
     }
+}
 
-    *depth += 1;
+int Node::principalVariation(Move *moves, int maximum, int *depth, bool *isCheckMate) const
+{
+    int count = 0;
+    for (const Node *node = this;;) {
+        if (!node->isRootNode() && !node->hasPValue()) {
+            *isCheckMate = node->isCheckMate();
+            break;
+        }
 
-    const Node *bestChild = this->bestChild();
-    if (!bestChild) {
-        *isCheckMate = this->isCheckMate();
-        *stream << Notation::moveToString(m_game.lastMove(), Chess::Computer);
-        return;
-    }
+        *depth += 1;
+        if (!node->isRootNode() && count < maximum)
+            moves[count++] = node->m_game.lastMove();
 
-    if (!isRootNode()) {
-        *stream << Notation::moveToString(m_game.lastMove(), Chess::Computer) << QStringLiteral(" ");
+        const Node *bestChild = node->bestChild();
+        if (!bestChild) {
+            *isCheckMate = node->isCheckMate();
+            break;
+        }
+        node = bestChild;
     }
-
-    bestChild->principalVariation(depth, isCheckMate, stream);
+    return count;
 }
 
 int Node::repetitions() const
@@ -444,19 +710,30 @@ int Node::repetitions() const
     if (m_game.repetitions() != -1)
         return m_game.repetitions();
 
-    qint8 r = 0;
-    HistoryIterator it = HistoryIterator::begin(this);
-    ++it; // advance past this position
-    for (; it != HistoryIterator::end(); ++it) {
-        if (m_position->position().isSamePosition(it.position()))
+    // Walk this path back to the last irreversible move; only every other ply has our side to
+    // move and isSamePosition rejects on the hash before comparing the boards
+    const Game::Position &position = m_position->position();
+    int r = 0;
+    bool reachedReset = !m_game.halfMoveClock();
+    const Node *node = this;
+    for (int ply = 1; !reachedReset && node->m_parent; ++ply) {
+        node = node->m_parent;
+        if (!(ply & 1) && position.isSamePosition(node->m_position->position()))
             ++r;
 
         if (r >= 2)
             break; // No sense in counting further
 
-        if (!it.game().halfMoveClock())
-            break;
+        if (!node->m_game.halfMoveClock())
+            reachedReset = true;
+    }
+
+    // Then continue into the game history which is indexed by hash
+    if (r < 2 && !reachedReset) {
+        History *history = History::globalInstance();
+        r = history->repetitions(position, history->count() - 2, r);
     }
+
     Node *thisNode = const_cast<Node*>(this);
     thisNode->m_game.setRepetitions(r);
     thisNode->m_gameCycles = r + (m_parent ? m_parent->gameCycles() : 0);
@@ -475,8 +752,27 @@ bool Node::isMoveClock() const
     return m_game.halfMoveClock() >= 100;
 }
 
+// Calls the function with the policy of the current settings
+template <typename Function>
+static auto withSearchPolicy(const Function &function) -> decltype(function(SearchPolicy<true, false>()))
+{
+    const bool minimax = !SearchSettings::featuresOff.testFlag(SearchSettings::Minimax);
+    if (SearchSettings::transpositionGraph)
+        return minimax ? function(SearchPolicy<true, true>()) : function(SearchPolicy<false, true>());
+    return minimax ? function(SearchPolicy<true, false>()) : function(SearchPolicy<false, false>());
+}
+
 float Node::minimax(Node *node, quint32 depth, WorkerInfo *info, double *newScores,
     quint32 *newVisits)
+{
+    return withSearchPolicy([&](auto policy) {
+        return minimaxWith<decltype(policy)>(node, depth, info, newScores, newVisits);
+    });
+}
+
+template <typename Policy>
+float Node::minimaxWith(Node *node, quint32 depth, WorkerInfo *info, double *newScores,
+    quint32 *newVisits)
 {
     Q_ASSERT(node);
     Q_ASSERT(node->positionHasQValue());
@@ -510,7 +806,10 @@ float Node::minimax(Node *node, quint32 depth, WorkerInfo *info, double *newScor
             ++(info->nodesTBHits);
         // If this node has children and was proven to be an exact node, then it is possible that
         // recently leafs have been made to we must trim the tree of any leafs
-        trimUnscoredFromTree(node);
+        {
+            QMutexLocker locker(&s_trimMutex);
+            trimUnscoredFromTree(node);
+        }
         node->setQValueAndVisit();
         *newScores += node->positionQValue();
         ++(*newVisits);
@@ -536,10 +835,7 @@ float Node::minimax(Node *node, quint32 depth, WorkerInfo *info, double *newScor
     bool allChildrenAreScored = true;
     double newScoresForChildren = 0;
     quint32 newVisitsForChildren = 0;
-    for (int index = 0; index < node->m_children.count(); ++index) {
-        Node *child = node->m_children.at(index);
-        Q_ASSERT(child);
-
+    for (Node *child = node->firstChild(); child; child = child->nextSibling()) {
         // If the child is not visited and is not marked dirty then it has not been scored yet, so
         // just continue
         if (!child->m_visited && !child->m_isDirty) {
@@ -548,7 +844,8 @@ float Node::minimax(Node *node, quint32 depth, WorkerInfo *info, double *newScor
         }
 
         Q_ASSERT(child->positionHasQValue());
-        float score = minimax(child, depth + 1, info, &newScoresForChildren, &newVisitsForChildren);
+        minimaxWith<Policy>(child, depth + 1, info, &newScoresForChildren, &newVisitsForChildren);
+        const float score = child->sharedQValue<Policy>();
         allAreExact = child->isExact() ? allAreExact : false;
 
         // Check if we have a new best child
@@ -570,13 +867,260 @@ float Node::minimax(Node *node, quint32 depth, WorkerInfo *info, double *newScor
     // Score the node based on minimax of children
     *newVisits += newVisitsForChildren;
     *newScores += -newScoresForChildren;
-    node->scoreMiniMax(-best, bestIsMinimaxExact, shouldPropagateExact, -newScoresForChildren, newVisitsForChildren);
+    node->scoreMiniMax<Policy>(-best, bestIsMinimaxExact, shouldPropagateExact, -newScoresForChildren, newVisitsForChildren);
+    node->updateBestChild();
 
     // Record info
     ++(info->nodesSearched);
     return node->qValue();
 }
 
+void Node::minimaxPaths(const QVector<Node*> &leaves, WorkerInfo *info)
+{
+    withSearchPolicy([&](auto policy) { minimaxPathsWith<decltype(policy)>(leaves, info); });
+}
+
+template <typename Policy>
+void Node::minimaxPathsWith(const QVector<Node*> &leaves, WorkerInfo *info)
+{
+    // The nodes on the paths from the leaves up to the root are gathered once each. A parent is
+    // always gathered before its children, so going backwards scores all children first.
+    struct Entry {
+        Node *node;
+        int parent;             // -1 for the root
+        quint32 depth;
+        bool isReachable;       // whether the recursive pass would get here
+        double newScores;       // what the children contributed
+        quint32 newVisits;
+    };
+
+    QVector<Entry> entries;
+    QHash<const Node*, int> indexes;
+    QVector<Node*> path;
+    for (Node *leaf : leaves) {
+        path.clear();
+        Node *n = leaf;
+        while (n && !indexes.contains(n)) {
+            path.append(n);
+            n = n->parent();
+        }
+
+        int parent = n ? indexes.value(n) : -1;
+        for (int i = path.count() - 1; i >= 0; --i) {
+            Entry entry;
+            entry.node = path.at(i);
+            entry.parent = parent;
+            entry.newScores = 0;
+            entry.newVisits = 0;
+            if (parent == -1) {
+                entry.depth = 0;
+                entry.isReachable = true;
+            } else {
+                const Entry &p = entries.at(parent);
+                entry.depth = p.depth + 1;
+                entry.isReachable = p.isReachable && p.node->m_isDirty && !p.node->isExact()
+                    && (entry.node->m_visited || entry.node->m_isDirty);
+            }
+            parent = entries.count();
+            indexes.insert(entry.node, parent);
+            entries.append(entry);
+        }
+    }
+
+    for (int i = entries.count() - 1; i >= 0; --i) {
+        const Entry &entry = entries.at(i);
+        if (!entry.isReachable)
+            continue;
+
+        Node *node = entry.node;
+        double newScores = 0;
+        quint32 newVisits = 0;
+        if (!node->m_visited || (node->isExact() && node->m_isDirty)) {
+            // Leaves are scored without recursing
+            minimaxWith<Policy>(node, entry.depth, info, &newScores, &newVisits);
+        } else if (!node->isExact() && node->m_isDirty) {
+            // The children are already backed up so their values are just read
+            backUpFromChildren<Policy>(node, entry.newScores, entry.newVisits, info);
+            newVisits = entry.newVisits;
+            newScores = -entry.newScores;
+        }
+
+        if (entry.parent != -1) {
+            Entry &parent = entries[entry.parent];
+            parent.newScores += newScores;
+            parent.newVisits += newVisits;
+        }
+    }
+}
+
+template <typename Policy>
+void Node::backUpFromChildren(Node *node, double newScores, quint32 newVisits, WorkerInfo *info)
+{
+    Q_ASSERT(node->hasChildren());
+    float best = -2.0f;
+    bool allAreExact = true;
+    bool bestIsExact = false;
+    bool bestIsMinimaxExact = false;
+    bool allChildrenAreScored = true;
+    for (Node *child = node->firstChild(); child; child = child->nextSibling()) {
+        if (!child->m_visited && !child->m_isDirty) {
+            allChildrenAreScored = false;
+            continue;
+        }
+
+        Q_ASSERT(!child->m_isDirty);
+        const float score = child->sharedQValue<Policy>();
+        allAreExact = child->isExact() ? allAreExact : false;
+        if (score > best) {
+            bestIsExact = child->isExact();
+            bestIsMinimaxExact = child->isMinimaxExact();
+            best = score;
+        }
+    }
+
+    const bool shouldPropagateExact =
+        ((bestIsExact && best > 0) ||
+         (allAreExact && allChildrenAreScored && !node->hasPotentials()))
+        && !node->isRootNode();
+
+    node->scoreMiniMax<Policy>(-best, bestIsMinimaxExact, shouldPropagateExact, -newScores, newVisits);
+    node->updateBestChild();
+    ++(info->nodesSearched);
+}
+
+float Node::minimaxConcurrently(Node *root, WorkerInfo *info, double *newScores,
+    quint32 *newVisits, quint32 splitVisits, const Runner &run)
+{
+    return withSearchPolicy([&](auto policy) {
+        return minimaxConcurrentlyWith<decltype(policy)>(root, info, newScores, newVisits,
+            splitVisits, run);
+    });
+}
+
+template <typename Policy>
+float Node::minimaxConcurrentlyWith(Node *root, WorkerInfo *info, double *newScores,
+    quint32 *newVisits, quint32 splitVisits, const Runner &run)
+{
+    // The nodes the recursive pass would go through with at least splitVisits visits are split,
+    // which is done here after their children, and every dirty child of theirs that is not split
+    // is a subtree a thread backs up on its own. A parent always comes before its children.
+    struct Entry {
+        Node *node;
+        int parent;             // -1 for the root
+        quint32 depth;
+        bool isSplit;
+        double childScores;     // what the children contributed
+        quint32 childVisits;
+        double newScores;       // and what this contributes to its parent
+        quint32 newVisits;
+    };
+
+    auto isSplit = [splitVisits](const Node *node) {
+        return node->m_visited >= splitVisits && node->m_isDirty && !node->isExact();
+    };
+
+    // Nothing guards the positions the transpositions share. In the transposition graph mode
+    // every child is scored by its position, so the subtrees are never backed up concurrently.
+    if (Policy::transpositionGraph || !isSplit(root))
+        return minimaxWith<Policy>(root, 0, info, newScores, newVisits);
+
+    std::vector<Entry> entries;
+    std::vector<int> tasks;
+    quint64 taskVisits = 0;
+    entries.push_back(Entry { root, -1, 0, true, 0, 0, 0, 0 });
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (!entries[i].isSplit)
+            continue;
+
+        // Children that are not dirty add nothing and are only read when their parent is scored
+        const quint32 depth = entries[i].depth + 1;
+        for (Node *child = entries[i].node->firstChild(); child; child = child->nextSibling()) {
+            if (!child->m_isDirty)
+                continue;
+
+            Q_ASSERT(child->positionHasQValue());
+            const bool split = isSplit(child);
+            if (!split) {
+                tasks.push_back(int(entries.size()));
+                taskVisits += child->m_visited + 1;
+            }
+            entries.push_back(Entry { child, int(i), depth, split, 0, 0, 0, 0 });
+        }
+    }
+
+    // A subtree has at most one more dirty node than it has visits, so where they add up to less
+    // than a split the threads would only be woken for nothing
+    if (tasks.size() < 2 || taskVisits < splitVisits)
+        return minimaxWith<Policy>(root, 0, info, newScores, newVisits);
+
+    // Otherwise only the dirty nodes read and write their positions, so the subtrees go to the
+    // threads only where no two of them back up the same position
+    QHash<const Position*, size_t> owners;
+    std::vector<Node*> stack;
+    for (size_t t = 0; t < tasks.size(); ++t) {
+        stack.push_back(entries[size_t(tasks[t])].node);
+        while (!stack.empty()) {
+            Node *node = stack.back();
+            stack.pop_back();
+            if (!node->m_isDirty)
+                continue;
+
+            if (node->m_position->refs() > 1) {
+                const auto owner = owners.constFind(node->m_position);
+                if (owner == owners.constEnd())
+                    owners.insert(node->m_position, t);
+                else if (owner.value() != t)
+                    return minimaxWith<Policy>(root, 0, info, newScores, newVisits);
+            }
+            for (Node *child = node->firstChild(); child; child = child->nextSibling())
+                stack.push_back(child);
+        }
+    }
+
+    // The largest go first so that no thread is left with a big one at the end
+    std::sort(tasks.begin(), tasks.end(), [&entries](int a, int b) {
+        return entries[size_t(a)].node->m_visited > entries[size_t(b)].node->m_visited;
+    });
+
+    std::atomic<size_t> next(0);
+    QMutex infoMutex;
+    run([&]() {
+        WorkerInfo local;
+        for (size_t t = next++; t < tasks.size(); t = next++) {
+            Entry &entry = entries[size_t(tasks[t])];
+            minimaxWith<Policy>(entry.node, entry.depth, &local, &entry.newScores, &entry.newVisits);
+        }
+
+        QMutexLocker locker(&infoMutex);
+        info->sumDepths += local.sumDepths;
+        info->maxDepth = qMax(info->maxDepth, local.maxDepth);
+        info->nodesSearched += local.nodesSearched;
+        info->nodesEvaluated += local.nodesEvaluated;
+        info->nodesVisited += local.nodesVisited;
+        info->nodesCacheHits += local.nodesCacheHits;
+        info->nodesTBHits += local.nodesTBHits;
+    });
+
+    for (size_t i = entries.size(); i-- > 0;) {
+        Entry &entry = entries[i];
+        if (entry.isSplit) {
+            backUpFromChildren<Policy>(entry.node, entry.childScores, entry.childVisits, info);
+            entry.newScores = -entry.childScores;
+            entry.newVisits = entry.childVisits;
+        }
+
+        if (entry.parent != -1) {
+            Entry &parent = entries[size_t(entry.parent)];
+            parent.childScores += entry.newScores;
+            parent.childVisits += entry.newVisits;
+        }
+    }
+
+    *newScores += entries.front().newScores;
+    *newVisits += entries.front().newVisits;
+    return root->qValue();
+}
+
 void Node::validateTree(const Node *node)
 {
     // Goes through the entire tree and verifies that everything that should have a score has one
@@ -588,9 +1132,7 @@ void Node::validateTree(const Node *node)
     Q_ASSERT(node->position()->refs());
     Q_ASSERT(node->position()->visits());
     quint32 childVisits = 0;
-    for (int index = 0; index < node->m_children.count(); ++index) {
-        Node *child = node->m_children.at(index);
-        Q_ASSERT(child);
+    for (const Node *child = node->firstChild(); child; child = child->nextSibling()) {
         Q_ASSERT(child->parent() == node);
 
         // If the child is not visited and is not marked dirty then it has not been scored yet, so
@@ -602,7 +1144,8 @@ void Node::validateTree(const Node *node)
         childVisits += child->m_visited;
     }
 
-    Q_ASSERT(node->isRootNode() || node->isExact() || node->m_visited == childVisits + 1);
+    // Pruned nodes keep the visits of the subtree they lost
+    Q_ASSERT(node->isRootNode() || node->isExact() || node->m_visited >= childVisits + 1);
 }
 
 void Node::trimUnscoredFromTree(Node *node)
@@ -611,85 +1154,222 @@ void Node::trimUnscoredFromTree(Node *node)
     if (!node->isDirty())
         return;
 
-    QMutableVectorIterator<Node*> it(node->m_children);
-    while (it.hasNext()) {
-        Node *child = it.next();
+    Cache *cache = Cache::of(node);
+    std::atomic<quint32> *link = &node->m_firstChild;
+    while (const quint32 handle = link->load(std::memory_order_relaxed)) {
+        Node *child = cache->node(handle);
         // If this child has not been scored and dirty, then it should be trimmed
         if (!child->m_visited && child->isDirty()) {
-            Q_ASSERT(child->m_children.isEmpty());
+            Q_ASSERT(!child->hasChildren());
             --node->m_potentialIndex;
-            if (child->m_position)
-                child->m_position->unref(); // Unpins the position
-            it.remove();                    // deletes ourself from our parent
-            child->m_position = nullptr;    // unpins the node
-            child->m_parent = nullptr;      // make sure to nullify our parent
+            link->store(child->m_nextSibling.load(std::memory_order_relaxed),
+                std::memory_order_release); // deletes ourself from our parent
+            cache->unlinkNode(handle);      // unpins the position and frees the node
         } else {
             trimUnscoredFromTree(child);
+            link = &child->m_nextSibling;
         }
     }
 
     node->m_isDirty = false;
 }
 
-Node *Node::playout(Node *root, int *vldMax, int *tryPlayoutLimit, bool *hardExit, Cache *cache)
+quint64 Node::pruneTree(Node *root, quint64 target, qint64 msecs)
+{
+    // Collapse subtrees hanging off the principal variation starting with those that have the
+    // fewest visits and lowest policy, relaxing both limits each pass until enough nodes have been
+    // returned to the arena or we run out of time
+    QElapsedTimer timer;
+    timer.start();
+    Cache *cache = Cache::of(root);
+    const quint64 usedBefore = cache->used();
+    quint32 maxVisits = 1;
+    float maxPolicy = 0.01f;
+    while (cache->used() > target && !timer.hasExpired(msecs) && maxVisits < root->m_visited) {
+        pruneFromTree(root, true /*isPrincipalVariation*/, maxVisits, maxPolicy, timer, msecs);
+        maxVisits *= 2;
+        maxPolicy = qMin(1.0f, maxPolicy * 2);
+    }
+    return usedBefore - cache->used();
+}
+
+void Node::pruneFromTree(Node *node, bool isPrincipalVariation, quint32 maxVisits,
+    float maxPolicy, const QElapsedTimer &timer, qint64 msecs)
+{
+    const Node *best = isPrincipalVariation ? node->bestChild() : nullptr;
+    for (Node *child = node->firstChild(); child; child = child->nextSibling()) {
+        if (timer.hasExpired(msecs))
+            return;
+
+        // Leaves have nothing to give back and dirty subtrees are waiting to be minimaxed
+        if (!child->hasChildren() || child->m_isDirty)
+            continue;
+
+        if (child == best)
+            pruneFromTree(child, true /*isPrincipalVariation*/, maxVisits, maxPolicy, timer, msecs);
+        else if (child->m_visited <= maxVisits && child->pValue() <= maxPolicy)
+            child->collapse();
+        else
+            pruneFromTree(child, false /*isPrincipalVariation*/, maxVisits, maxPolicy, timer, msecs);
+    }
+}
+
+void Node::collapse()
+{
+    // Free the subtree below us while keeping our own score and visits so that the search can
+    // expand our potentials again as if for the first time
+    Cache *cache = Cache::of(this);
+    quint32 handle = m_firstChild;
+    m_firstChild = 0;
+    m_bestChild = NoBestChild;
+    while (handle) {
+        const quint32 next = cache->node(handle)->m_nextSibling;
+        cache->unlinkNode(handle);
+        handle = next;
+    }
+    m_potentialIndex = 0;
+    m_policySum = 0;
+}
+
+Node *Node::playout(Node *root, int *vldMax, int *tryPlayoutLimit, bool *hardExit, Cache *cache,
+    QMutex *expansionMutex)
+{
+    return withSearchPolicy([&](auto policy) {
+        return playoutWith<decltype(policy)>(root, vldMax, tryPlayoutLimit, hardExit, cache,
+            expansionMutex);
+    });
+}
+
+template <typename Policy>
+inline int Node::scoreChildren(Node *n, Cache *cache, Node::Playout *firstPlayout,
+    Node::Playout *secondPlayout, float *secondBestScore)
+{
+    Q_ASSERT(n->hasChildren() || n->hasPotentials());
+    Q_ASSERT(!n->isExact());
+
+    // The potentials are only looked at after the children so their load overlaps the scan
+    prefetchLine(n->m_position->m_potentials.data() + n->m_potentialIndex);
+
+    float bestScore = -std::numeric_limits<float>::max();
+    *secondBestScore = -std::numeric_limits<float>::max();
+    float uCoeff = n->uCoeff();
+    float parentQValueDefault = n->qValueDefault();
+
+    // First look at the actual children. The statistics are gathered into contiguous arrays so
+    // the scoring below is a single branch free pass over as many lanes as the processor has.
+    int childCount = 0;
+    Node *children[s_maxChildren];
+    alignas(32) float qValues[s_maxChildren];
+    alignas(32) float pValues[s_maxChildren];
+    alignas(32) float denominators[s_maxChildren];
+    alignas(32) float scores[s_maxChildren];
+    for (quint32 handle = n->m_firstChild.load(std::memory_order_acquire); handle; ++childCount) {
+        Q_ASSERT(childCount < s_maxChildren);
+        Node *child = cache->node(handle);
+        handle = child->m_nextSibling.load(std::memory_order_acquire);
+        if (handle)
+            prefetchLine(cache->node(handle));
+        children[childCount] = child;
+        qValues[childCount] = child->sharedQValue<Policy>();
+        pValues[childCount] = child->m_pValue;
+        denominators[childCount] = float(child->visits() + child->virtualLoss() + 1);
+    }
+
+    VectorMath::uctScores(qValues, pValues, denominators, childCount, uCoeff, scores);
+
+    for (int i = 0; i < childCount; ++i) {
+        Node *child = children[i];
+        const float score = scores[i];
+        Q_ASSERT(score > -std::numeric_limits<float>::max());
+        if (score > bestScore) {
+            *secondPlayout = *firstPlayout;
+            *secondBestScore = bestScore;
+            *firstPlayout = Node::Playout(child);
+            bestScore = score;
+        } else if (score > *secondBestScore) {
+            *secondPlayout = Node::Playout(child);
+            *secondBestScore = score;
+        }
+    }
+
+    Q_ASSERT(firstPlayout->isNull() || !(*firstPlayout == *secondPlayout));
+
+    // Then look at the next two potential children as the ones at and after the index have been sorted by pval
+    const int potentialIndex = n->m_potentialIndex;
+    for (int i = potentialIndex; i < n->m_position->m_potentials.count() && i < potentialIndex + 2; ++i) {
+        // We get a non-const reference to the actual value
+        Node::Potential *potential = &n->m_position->m_potentials[i];
+        float score = Node::uctFormula(parentQValueDefault, uCoeff * potential->pValue());
+        Q_ASSERT(score > -std::numeric_limits<float>::max());
+        if (score > bestScore) {
+            *secondPlayout = *firstPlayout;
+            *secondBestScore = bestScore;
+            *firstPlayout = Node::Playout(potential);
+            bestScore = score;
+        } else if (score > *secondBestScore) {
+            *secondPlayout = Node::Playout(potential);
+            *secondBestScore = score;
+        }
+    }
+
+    Q_ASSERT(!firstPlayout->isNull());
+    return potentialIndex;
+}
+
+bool Node::collide(Node *n, bool alreadyPlayingOut, int vld, int *vldMax, int *tryPlayoutLimit)
+{
+    const qint64 increment = alreadyPlayingOut ? vld : 1;
+    if (alreadyPlayingOut) {
+        if (increment > 1) {
+            Node *parent = n->parent();
+            while (parent) {
+                parent->m_virtualLoss.fetch_add(quint32(increment - 1), std::memory_order_relaxed);
+                parent = parent->parent();
+            }
+        }
+    } else {
+        n->m_virtualLoss.fetch_add(quint32(increment), std::memory_order_relaxed);
+    }
+
+    // We've already calculated virtualLossDistance or we are not extendable, so decrement the try
+    // and vld limits and check if we should exit
+    --(*tryPlayoutLimit);
+#if defined(DEBUG_PLAYOUT)
+    qDebug() << "decreasing try for" << n->toString() << *tryPlayoutLimit;
+#endif
+    if (*tryPlayoutLimit <= 0)
+        return false;
+
+    *vldMax -= increment;
+#if defined(DEBUG_PLAYOUT)
+    qDebug() << "decreasing vldMax for" << n->toString() << *vldMax;
+#endif
+    return *vldMax > 0;
+}
+
+template <typename Policy>
+Node *Node::playoutWith(Node *root, int *vldMax, int *tryPlayoutLimit, bool *hardExit,
+    Cache *cache, QMutex *expansionMutex)
 {
+    TIME_STAGE(Playout);
+
 start_playout:
     int vld = *vldMax;
     Node *n = root;
     forever {
-        Q_ASSERT(n->hasChildren() || n->hasPotentials());
-        Q_ASSERT(!n->isExact());
-
         Node::Playout firstPlayout;
         Node::Playout secondPlayout;
-        float bestScore = -std::numeric_limits<float>::max();
-        float secondBestScore = -std::numeric_limits<float>::max();
-        float uCoeff = n->uCoeff();
-        float parentQValueDefault = n->qValueDefault();
-
-        // First look at the actual children
-        for (int i = 0; i < n->m_children.count(); ++i) {
-            Node *child = n->m_children.at(i);
-            float score = Node::uctFormula(child->qValue(), child->uValue(uCoeff));
-            Q_ASSERT(score > -std::numeric_limits<float>::max());
-            if (score > bestScore) {
-                secondPlayout = firstPlayout;
-                secondBestScore = bestScore;
-                firstPlayout = Node::Playout(child);
-                bestScore = score;
-            } else if (score > secondBestScore) {
-                secondPlayout = Node::Playout(child);
-                secondBestScore = score;
-            }
-        }
-
-        Q_ASSERT(firstPlayout.isNull() || !(firstPlayout == secondPlayout));
-
-        // Then look at the next two potential children as they have now been sorted by pval
-        for (int i = n->m_potentialIndex; i < n->m_position->m_potentials.count() && i < n->m_potentialIndex + 2; ++i) {
-            // We get a non-const reference to the actual value
-            Node::Potential *potential = &n->m_position->m_potentials[i];
-            float score = Node::uctFormula(parentQValueDefault, uCoeff * potential->pValue());
-            Q_ASSERT(score > -std::numeric_limits<float>::max());
-            if (score > bestScore) {
-                secondPlayout = firstPlayout;
-                secondBestScore = bestScore;
-                firstPlayout = Node::Playout(potential);
-                bestScore = score;
-            } else if (score > secondBestScore) {
-                secondPlayout = Node::Playout(potential);
-                secondBestScore = score;
-            }
-        }
+        float secondBestScore;
+        const int potentialIndex = scoreChildren<Policy>(n, cache, &firstPlayout, &secondPlayout,
+            &secondBestScore);
 
         // Update the top two finishers to avoid them being pruned and calculate vld
-        Q_ASSERT(!firstPlayout.isNull());
         if (!secondPlayout.isNull()) {
             const int vldNew
                 = virtualLossDistance(
                     secondBestScore,
-                    uCoeff,
-                    firstPlayout.qValue(parentQValueDefault),
+                    n->uCoeff(),
+                    firstPlayout.qValue(n->qValueDefault()),
                     firstPlayout.pValue(),
                     int(firstPlayout.visits() + firstPlayout.virtualLoss()));
             if (!vld)
@@ -701,64 +1381,130 @@ start_playout:
         // Retrieve the actual first node
         NodeGenerationError error = NoError;
         if (firstPlayout.isPotential()) {
-            // Expand the potential node, then this is our playout node
-            n = n->generateNextChild(cache, &error);
-            if (n) {
-                ++n->m_virtualLoss;
-            } else {
+            // Expand the potential node, then this is our playout node. Another thread may have
+            // expanded it in the meantime in which case we score this node again.
+            QMutexLocker locker(expansionMutex);
+            if (n->m_potentialIndex != potentialIndex)
+                continue;
+            n = n->generateNextChild(cache, &error, 1 /*virtualLoss*/);
+            if (!n) {
                 Q_ASSERT(error == OutOfMemory);
                 *hardExit = true;
             }
             break;
         } else {
             n = firstPlayout.node();
+            // The node itself was read while scoring it, but what the next step reads of its
+            // position and of its first child is started now while the virtual loss is updated
+            prefetchLine(n->m_position);
+            if (const quint32 handle = n->m_firstChild.load(std::memory_order_relaxed))
+                prefetchLine(cache->node(handle));
         }
 
         // If this is an exact node with no virtualloss, then this is our playout node
-        if (n->isExact() && !n->virtualLoss()) {
-            ++n->m_virtualLoss;
+        quint32 noVirtualLoss = 0;
+        if (n->isExact() && n->m_virtualLoss.compare_exchange_strong(noVirtualLoss, 1))
             break;
-        }
 
-        // Otherwise, increase virtual loss
+        // Otherwise, increase virtual loss unless we collided and have to start over
         const bool alreadyPlayingOut = n->isAlreadyPlayingOut();
-        const qint64 increment = alreadyPlayingOut ? vld : 1;
-        if (alreadyPlayingOut) {
-            if (increment > 1) {
-                Node *parent = n->parent();
-                while (parent) {
-                    parent->m_virtualLoss += increment - 1;
-                    parent = parent->parent();
-                }
-            }
-        } else {
-            n->m_virtualLoss += increment;
-        }
-
-        // If we've already calculated virtualLossDistance or we are not extendable,
-        // then decrement the try and vld limits and check if we should exit
         if (alreadyPlayingOut || n->isExact()) {
-            --(*tryPlayoutLimit);
-#if defined(DEBUG_PLAYOUT)
-            qDebug() << "decreasing try for" << n->toString() << *tryPlayoutLimit;
-#endif
-            if (*tryPlayoutLimit <= 0)
-                return nullptr;
-
-            *vldMax -= increment;
-#if defined(DEBUG_PLAYOUT)
-            qDebug() << "decreasing vldMax for" << n->toString() << *vldMax;
-#endif
-            if (*vldMax <= 0)
+            if (!collide(n, alreadyPlayingOut, vld, vldMax, tryPlayoutLimit))
                 return nullptr;
-
             goto start_playout;
         }
+        n->m_virtualLoss.fetch_add(1, std::memory_order_relaxed);
     }
 
     return n;
 }
 
+int Node::playouts(Node *root, int budget, int *vldMax, int *tryPlayoutLimit, bool *hardExit,
+    Cache *cache, QVector<Node*> *playouts)
+{
+    return withSearchPolicy([&](auto policy) {
+        TIME_STAGE(Playout);
+
+        // A collision gives the rest of the budget back to the root like a playout starts over
+        int collected = 0;
+        while (collected < budget && *tryPlayoutLimit > 0 && *vldMax > 0 && !*hardExit) {
+            collected += playoutsWith<decltype(policy)>(root, budget - collected, *vldMax, vldMax,
+                tryPlayoutLimit, hardExit, cache, playouts);
+        }
+        return collected;
+    });
+}
+
+template <typename Policy>
+int Node::playoutsWith(Node *n, int budget, int vld, int *vldMax, int *tryPlayoutLimit,
+    bool *hardExit, Cache *cache, QVector<Node*> *playouts)
+{
+    // Each pass hands the best the share of the budget it can take before the second best would
+    // overtake it, which is its virtual loss distance, and scores again with that virtual loss on.
+    // The nodes above are scored once for all the playouts below them rather than once each.
+    int collected = 0;
+    while (collected < budget) {
+        Node::Playout firstPlayout;
+        Node::Playout secondPlayout;
+        float secondBestScore;
+        scoreChildren<Policy>(n, cache, &firstPlayout, &secondPlayout, &secondBestScore);
+
+        int share = budget - collected;
+        int childVld = vld;
+        if (!secondPlayout.isNull()) {
+            const int vldNew
+                = virtualLossDistance(
+                    secondBestScore,
+                    n->uCoeff(),
+                    firstPlayout.qValue(n->qValueDefault()),
+                    firstPlayout.pValue(),
+                    int(firstPlayout.visits() + firstPlayout.virtualLoss()));
+            childVld = vld ? qMin(vld, vldNew) : vldNew;
+            share = qBound(1, vldNew, share);
+        }
+
+        // A new child takes a single playout and the next potential moves up to be scored
+        if (firstPlayout.isPotential()) {
+            NodeGenerationError error = NoError;
+            Node *child = n->generateNextChild(cache, &error, 1 /*virtualLoss*/);
+            if (!child) {
+                Q_ASSERT(error == OutOfMemory);
+                *hardExit = true;
+                break;
+            }
+            playouts->append(child);
+            ++collected;
+            continue;
+        }
+
+        Node *child = firstPlayout.node();
+        quint32 noVirtualLoss = 0;
+        if (child->isExact() && child->m_virtualLoss.compare_exchange_strong(noVirtualLoss, 1)) {
+            playouts->append(child);
+            ++collected;
+            continue;
+        }
+
+        // The virtual loss that steers the rest away is on the nodes above so they score again
+        const bool alreadyPlayingOut = child->isAlreadyPlayingOut();
+        if (alreadyPlayingOut || child->isExact()) {
+            collide(child, alreadyPlayingOut, childVld, vldMax, tryPlayoutLimit);
+            break;
+        }
+
+        // The whole share is on as virtual loss while below and what it did not use is given back
+        child->m_virtualLoss.fetch_add(quint32(share), std::memory_order_relaxed);
+        const int below = playoutsWith<Policy>(child, share, childVld, vldMax, tryPlayoutLimit,
+            hardExit, cache, playouts);
+        if (below < share)
+            child->m_virtualLoss.fetch_sub(quint32(share - below), std::memory_order_relaxed);
+        collected += below;
+        if (*tryPlayoutLimit <= 0 || *vldMax <= 0 || *hardExit)
+            break;
+    }
+    return collected;
+}
+
 bool Node::isNoisy() const
 {
     const Move mv = m_game.lastMove();
@@ -775,8 +1521,7 @@ bool Node::checkAndGenerateDTZ(int *dtz)
 
     // See if the child already exists
     Node *child = nullptr;
-    for (int i = 0; i < m_children.count(); ++i) {
-        Node *ch = (m_children)[i];
+    for (Node *ch = firstChild(); ch; ch = ch->nextSibling()) {
         if (ch->game().lastMove() == move)
             child = ch;
     }
@@ -784,8 +1529,9 @@ bool Node::checkAndGenerateDTZ(int *dtz)
     // If not, then create it
     if (!child) {
         NodeGenerationError error = NoError;
-        child = Node::generateNode(move, 0.0f, this, Cache::globalInstance(), &error);
-        child->initializePosition(Cache::globalInstance());
+        Cache *cache = Cache::of(this);
+        child = Node::generateNode(move, 0.0f, this, cache, &error);
+        child->initializePosition(cache);
     }
 
     Q_ASSERT(child);
@@ -823,7 +1569,7 @@ bool Node::checkAndGenerateDTZ(int *dtz)
 
 bool Node::checkMoveClockOrThreefold(quint64 hash, Cache *cache)
 {
-    Q_ASSERT(m_children.isEmpty());
+    Q_ASSERT(!hasChildren());
     // Check if this is drawn by rules
     if (Q_UNLIKELY(isMoveClock())) {
         // This can never have a shared position as it depends upon information not found in the
@@ -853,7 +1599,7 @@ bool Node::checkMoveClockOrThreefold(quint64 hash, Cache *cache)
 
 void Node::generatePotentials()
 {
-    Q_ASSERT(m_children.isEmpty());
+    Q_ASSERT(!hasChildren());
 
     // Check if this is drawn by rules
     if (Q_UNLIKELY(m_position->position().isDeadPosition()) && !isRootNode()) {
@@ -881,7 +1627,33 @@ void Node::generatePotentials()
     Q_ASSERT(m_position->potentials()->isEmpty());
     Q_ASSERT(m_position->refs() == 1);
 
-    m_position->position().pseudoLegalMoves(this);
+    // The moves are generated once for both the solver's test and the potentials
+    const Game::Position &position = m_position->position();
+    Move moves[Game::Position::MaximumMoves];
+    const int count = position.legalMoves(moves);
+
+    // Forcing lines close to a mate are proven here rather than evaluated by the network node by
+    // node, though not where the fifty move rule could come first
+    if (SearchSettings::mateSolverMoves && !isRootNode()
+        && m_game.halfMoveClock() + 2 * SearchSettings::mateSolverMoves < 100) {
+        if (count && (count <= SearchSettings::mateSolverReplies
+            || position.isChecked(position.activeArmy()))) {
+            switch (MateSolver::solve(m_game, position, SearchSettings::mateSolverMoves)) {
+            case MateSolver::Unknown:
+                break;
+            case MateSolver::Mates:
+                setTypeAndScore(SolvedLoss, -1.0f);
+                return;
+            case MateSolver::IsMated:
+                setTypeAndScore(SolvedWin, 1.0f);
+                return;
+            }
+        }
+    }
+
+    reservePotentials(count);
+    for (int i = 0; i < count; ++i)
+        appendPotential(moves[i]);
 
     // Override the NN in case of checkmates or stalemates
     if (!hasPotentials()) {
@@ -903,8 +1675,7 @@ void Node::generatePotentials()
 void Node::reservePotentials(int totalSize)
 {
     Q_ASSERT(m_position);
-    m_children.reserve(totalSize);
-    m_position->m_potentials.reserve(totalSize);
+    m_position->m_potentials.reserve(totalSize, Cache::of(this)->potentialPool());
 }
 
 Node::Potential *Node::generatePotential(const Move &move)
@@ -919,25 +1690,40 @@ Node::Potential *Node::generatePotential(const Move &move)
     if (g.isChecked(m_position->position().activeArmy(), &p))
         return nullptr; // illegal
 
+    return appendPotential(move);
+}
+
+Node::Potential *Node::appendPotential(const Move &move)
+{
+    Q_ASSERT(move.isValid());
+    Q_ASSERT(m_position);
+    if (!m_position->m_potentials.capacity())
+        reservePotentials(1);
     m_position->m_potentials.append(Potential(move));
     return &(m_position->m_potentials.last());
 }
 
-Node *Node::generateNextChild(Cache *cache, NodeGenerationError *error)
+Node *Node::generateNextChild(Cache *cache, NodeGenerationError *error, quint32 virtualLoss)
 {
     Q_ASSERT(hasPotentials());
-    Node::Potential potential = m_position->m_potentials.at(m_potentialIndex);
-    Node *child = Node::generateNode(potential.move(), potential.pValue(), this, cache, error);
+    // Playouts look at the two potentials after the index, so order one more before advancing
+    // it; anything a concurrent playout may be reading is already in place and is not moved
+    const int index = m_potentialIndex;
+    Node::sortByPVals(m_position->m_potentials, index + 3);
+    Node::Potential potential = m_position->m_potentials.at(index);
+    Node *child = Node::generateNode(potential.move(), potential.pValue(), this, cache, error, virtualLoss);
     if (!child)
         return nullptr;
     ++m_potentialIndex;
     return child;
 }
 
-Node *Node::generateNode(const Move &childMove, float childPValue, Node *parent, Cache *cache, NodeGenerationError *error)
+Node *Node::generateNode(const Move &childMove, float childPValue, Node *parent, Cache *cache, NodeGenerationError *error,
+    quint32 virtualLoss)
 {
     // Get a new node from hash
-    Node *child = cache->newNode();
+    quint32 handle = 0;
+    Node *child = cache->newNode(&handle);
     if (!child) {
         Q_ASSERT(error);
         *error = OutOfMemory;
@@ -950,7 +1736,8 @@ Node *Node::generateNode(const Move &childMove, float childPValue, Node *parent,
     child->initialize(parent, childGame);
     child->setPValue(childPValue);
     child->setQValue(parent->qValueDefault());
-    parent->m_children.append(child);
+    child->m_virtualLoss = virtualLoss; // before other threads can see it
+    parent->appendChild(child, handle);
     return child;
 }
 
@@ -960,7 +1747,7 @@ const Node *Node::findSuccessor(const QVector<QString> &child) const
     for (QString c : child) {
 
         bool found = false;
-        for (const Node *node : n->m_children) {
+        for (const Node *node = n->firstChild(); node; node = node->nextSibling()) {
             if (node->m_game.toString(Chess::Computer) == c) {
                 n = node;
                 found = true;
@@ -1012,6 +1799,8 @@ QString Node::typeToString() const
     case TBWin:             return QStringLiteral("TW");
     case TBLoss:            return QStringLiteral("TL");
     case TBDraw:            return QStringLiteral("TD");
+    case SolvedWin:         return QStringLiteral("SW");
+    case SolvedLoss:        return QStringLiteral("SL");
     case PropagateWin:      return QStringLiteral("PW");
     case PropagateLoss:     return QStringLiteral("PL");
     case PropagateDraw:     return QStringLiteral("PD");
@@ -1052,7 +1841,7 @@ QString Node::printTree(int topDepth, int depth, bool printPotentials) const
         << qSetFieldWidth(4) << " cp: " << qSetFieldWidth(2) << right << scoreToCP(qValue());
 
     if (d < depth) {
-        QVector<Node*> children = *this->children();
+        QVector<Node*> children = this->children();
         if (!children.isEmpty()) {
             Node::sortByScore(children, false /*partialSortFirstOnly*/);
             for (const Node *child : children)
@@ -21,11 +21,15 @@
 #ifndef NODE_H
 #define NODE_H
 
+#include <QElapsedTimer>
 #include <QString>
 #include <QVector>
 #include <QtMath>
 #include <QMutex>
 
+#include <atomic>
+#include <functional>
+
 #include "fastapprox/fastlog.h"
 #include "game.h"
 #include "move.h"
@@ -40,41 +44,146 @@
 //#define DEBUG_CHURN
 
 class Cache;
+class PotentialPool;
+
+// The settings a search holds fixed that the playout and the backup would otherwise test at every
+// node. Each combination is instantiated and the one of the current settings is picked once per
+// pass over the tree.
+template <bool Minimax, bool TranspositionGraph>
+struct SearchPolicy {
+    static constexpr bool minimax = Minimax;
+    static constexpr bool transpositionGraph = TranspositionGraph;
+};
 
 extern int scoreToCP(float score);
 extern float cpToScore(int cp);
 
+// Starts loading the line at address ahead of when it is read, which hides some of the misses of
+// walking a tree far larger than the caches of the processor
+inline void prefetchLine(const void *address)
+{
+#if defined(Q_CC_GNU) || defined(Q_CC_CLANG)
+    __builtin_prefetch(address);
+#else
+    Q_UNUSED(address);
+#endif
+}
+
 class Node {
 public:
     class Playout;
+    // A legal move not yet made into a child, packed into 32 bits so that twice as many fit in a
+    // cache line while a playout scans them. The move keeps only what the position cannot fill
+    // back in when the child is made, the squares, the promotion and whether it castles, and the
+    // policy is quantized to 16 bits with zero left for not having one.
     class Potential {
     public:
         Potential()
+            : m_move(0),
+            m_pValue(0)
         {
-            m_pValue = -2.0f;
-            Q_ASSERT(!m_move.isValid());
         }
 
         Potential(const Move &move)
+            : m_move(packMove(move)),
+            m_pValue(0)
         {
-            m_pValue = -2.0f;
-            m_move = move;
-            Q_ASSERT(m_move.isValid());
+            Q_ASSERT(move.isValid());
         }
 
-        inline bool hasPValue() const { return !qFuzzyCompare(m_pValue, -2.0f); }
-        inline float pValue() const { return m_pValue; }
-        inline void setPValue(float pValue) { m_pValue = pValue; }
-        inline Move move() const { return m_move; }
-        inline bool isValid() const { return m_move.isValid(); }
+        inline bool hasPValue() const { return m_pValue; }
+        inline float pValue() const { return m_pValue ? float(m_pValue - 1) * (1.0f / 65534.0f) : -2.0f; }
+        inline void setPValue(float pValue)
+        {
+            m_pValue = quint16(qRound(qBound(0.0f, pValue, 1.0f) * 65534.0f) + 1);
+        }
+        inline Move move() const { return unpackMove(m_move); }
+        inline bool isValid() const { return m_move; }
 
-        inline QString toString() const { return Notation::moveToString(m_move, Chess::Computer); }
+        inline QString toString() const { return Notation::moveToString(move(), Chess::Computer); }
         bool operator==(const Potential &other) const { return m_move == other.m_move; }
 
+        // The 16 bits a potential keeps of a move, also used by the tree export
+        static quint16 packMove(const Move &move);
+        static Move unpackMove(quint16 move);
+
     private:
+        enum Masks : quint16 {
+            StartMask       = 0x003F,
+            EndMask         = 0x0FC0,
+            PromotionMask   = 0x3000, // knight, bishop, rook or queen
+            IsPromotionMask = 0x4000,
+            CastleMask      = 0x8000
+        };
+
         friend class Node::Playout;
-        Move m_move;
-        float m_pValue;
+        quint16 m_move;
+        quint16 m_pValue;
+    };
+
+    // A flat array of potentials living in a block handed out by the cache's potential pool
+    // rather than on the heap. The count and capacity sit in a header just before the data so the
+    // vector itself is a single pointer, along with the pool the block came from so that growing
+    // and clearing go back to it. Memory is only returned to the pool by clear(). The header
+    // also records how long a prefix has been put in policy order, the rest is left as generated,
+    // and the value of the small network while its evaluation waits to be refined by the large one.
+    class PotentialVector {
+    public:
+        enum { MaximumCapacity = 256 }; // at most 218 legal moves in any chess position
+
+        struct Header {
+            PotentialPool *pool;
+            quint16 count;
+            quint16 capacity;
+            quint16 sorted;
+            quint16 smallValue; // quantized with zero left for none
+        };
+
+        PotentialVector() : m_header(nullptr) {}
+
+        inline bool isEmpty() const { return !count(); }
+        inline int count() const { return m_header ? m_header->count : 0; }
+        inline int size() const { return count(); }
+        inline int capacity() const { return m_header ? m_header->capacity : 0; }
+        inline int sorted() const { return m_header ? m_header->sorted : 0; }
+        inline void setSorted(int sorted) { Q_ASSERT(m_header && sorted <= count()); m_header->sorted = quint16(sorted); }
+        inline bool hasSmallValue() const { return m_header && m_header->smallValue; }
+        inline float smallValue() const { Q_ASSERT(hasSmallValue()); return float(m_header->smallValue - 1) * (2.0f / 65534.0f) - 1.0f; }
+        inline void setSmallValue(float qValue)
+        {
+            Q_ASSERT(m_header);
+            m_header->smallValue = quint16(qRound((qBound(-1.0f, qValue, 1.0f) + 1.0f) * 32767.0f) + 1);
+        }
+        inline void clearSmallValue() { if (m_header) m_header->smallValue = 0; }
+
+        inline Potential *data() { return m_header ? reinterpret_cast<Potential*>(m_header + 1) : nullptr; }
+        inline const Potential *data() const { return m_header ? reinterpret_cast<const Potential*>(m_header + 1) : nullptr; }
+        inline Potential *begin() { return data(); }
+        inline Potential *end() { return data() + count(); }
+        inline const Potential *begin() const { return data(); }
+        inline const Potential *end() const { return data() + count(); }
+
+        inline Potential &operator[](int i) { Q_ASSERT(i >= 0 && i < count()); return data()[i]; }
+        inline const Potential &operator[](int i) const { Q_ASSERT(i >= 0 && i < count()); return data()[i]; }
+        inline const Potential &at(int i) const { return (*this)[i]; }
+        inline Potential &last() { Q_ASSERT(!isEmpty()); return data()[count() - 1]; }
+
+        inline void append(const Potential &potential)
+        {
+            Q_ASSERT(m_header); // reserved from a pool first
+            if (count() == capacity())
+                reserve(count() + 1);
+            data()[m_header->count++] = potential;
+        }
+
+        void removeAt(int i);
+        // The pool is only needed for the first block, later ones come from the pool of the last
+        void reserve(int capacity, PotentialPool *pool = nullptr);
+        void clear();
+
+    private:
+        Q_DISABLE_COPY(PotentialVector)
+        Header *m_header;
     };
 
     class Playout {
@@ -109,7 +218,7 @@ public:
         inline float pValue() const
         {
             if (m_isPotential)
-                return m_potential->m_pValue;
+                return m_potential->pValue();
             return m_node->m_pValue;
         }
 
@@ -155,6 +264,8 @@ public:
         TBWin,
         TBLoss,
         TBDraw,
+        SolvedWin,          // proven by MateSolver
+        SolvedLoss,
         PropagateWin        = 50, // Proven exact
         PropagateLoss,
         PropagateDraw,
@@ -167,6 +278,8 @@ public:
         GameCycleInTree        = 0x2
     };
 
+    enum { NoBestChild = 0xFF };
+
     class Position {
     public:
         Position();
@@ -174,10 +287,9 @@ public:
 
         void initialize(const Game::Position &position);
         void deinitialize(bool forcedFree);
-        static Node::Position *relinkOrMakeUnique(quint64 positionHash, Cache *cache, bool *madeUnique);
         inline bool hasPotentials() const { return !m_potentials.isEmpty(); }
-        inline QVector<Potential> *potentials() { return &m_potentials; }
-        inline const QVector<Potential> *potentials() const { return &m_potentials; }
+        inline PotentialVector *potentials() { return &m_potentials; }
+        inline const PotentialVector *potentials() const { return &m_potentials; }
         inline const Game::Position &position() const { return m_position; }
         inline quint64 positionHash() const
         {
@@ -201,15 +313,30 @@ public:
             // FIXME: This is to keep the change introducing refcounts as a non-functional change
             // to tree search. Previously, when a position had no more nodes using it, then this
             // would effectively be set to zero.
-            if (!m_refs)
+            if (!m_refs) {
+                // Remember how heavily the position was visited for the eviction policy
+                quint8 credit = 0;
+                while (credit < MaximumEvictionCredit && (m_visits >> (credit + 1)))
+                    ++credit;
+                m_evictionCredit = qMax(m_evictionCredit, credit);
                 m_visits = 0;
+            }
         }
         inline quint32 refs() const { return m_refs; }
 
+        // Second chances the position cache grants before evicting us
+        enum { MaximumEvictionCredit = 7 };
+        inline quint8 evictionCredit() const { return m_evictionCredit; }
+        inline void setEvictionCredit(quint8 credit) { m_evictionCredit = credit; }
+
         // Indicates whether the position can ever be used by transpositions
         inline bool isUnique() const { return m_isUnique; }
         inline void setUnique(bool b) { m_isUnique = b; }
 
+        // Indicates whether the position was evaluated ahead of any playout reaching it
+        inline bool isSpeculative() const { return m_isSpeculative; }
+        inline void setSpeculative(bool b) { m_isSpeculative = b; }
+
         inline Type type() const { return m_type; }
         inline void setType(Type type) { m_type = type; }
 
@@ -221,24 +348,46 @@ public:
         }
 
     private:
-        Game::Position m_position;          // 72
-        QVector<Potential> m_potentials;    // 8
+        Game::Position m_position;          // 56
+        PotentialVector m_potentials;       // 8
         float m_qValue;                     // 4
         quint32 m_visits;                   // 4
         quint32 m_refs;                     // 4
         Type m_type;                        // 1
-        bool m_isUnique : 1;                // 1
+        quint8 m_evictionCredit;            // 1
+        // Bytes of their own as the cache sets the first under its shard lock while the search
+        // clears the second under its own
+        bool m_isUnique;                    // 1
+        bool m_isSpeculative;               // 1
         friend class Node;
         friend class Tests;
+        friend class Tree;
     };
 
     Node();
     ~Node();
 
-    static Node *playout(Node *root, int *vldMax, int *tryPlayoutLimit, bool *hardExit, Cache *hash);
+    // When several threads descend the tree at once they pass the mutex guarding expansion
+    static Node *playout(Node *root, int *vldMax, int *tryPlayoutLimit, bool *hardExit, Cache *hash,
+        QMutex *expansionMutex = nullptr);
+    // Up to budget playouts in one descent that splits it among the children by their ranking and
+    // virtual loss distance. Appends them and returns how many there were, which is fewer where
+    // the limits ran out. Not for several threads at once.
+    static int playouts(Node *root, int budget, int *vldMax, int *tryPlayoutLimit, bool *hardExit,
+        Cache *hash, QVector<Node*> *playouts);
     static float minimax(Node *, quint32 depth, WorkerInfo *info, double *newScores, quint32 *newVisits);
+    // Runs the job on every thread of a pool, the caller included, and returns once all are done
+    typedef std::function<void(const std::function<void()> &job)> Runner;
+    // Same as minimax from the root, but the dirty subtrees under nodes of at least splitVisits
+    // visits are backed up on the threads of the runner. Serial where there is too little to share,
+    // in the transposition graph mode and where two of the subtrees back up the same position.
+    static float minimaxConcurrently(Node *root, WorkerInfo *info, double *newScores,
+        quint32 *newVisits, quint32 splitVisits, const Runner &run);
+    // Same as a minimax pass from the root but only visits the paths from these leaves up
+    static void minimaxPaths(const QVector<Node*> &leaves, WorkerInfo *info);
     static void validateTree(const Node *);
     static void trimUnscoredFromTree(Node *);
+    static quint64 pruneTree(Node *root, quint64 target, qint64 msecs);
     static float uctFormula(float qValue, float uValue);
     static int virtualLossDistance(float swec, float uCoeff, float q, float p, int currentVisits);
 
@@ -266,19 +415,26 @@ public:
     quint16 virtualLoss() const;
 
     // parents and children
+    // The best child is cached by minimax so reading it off a backed up node does not sort
     Node *bestChild() const;
     bool hasPotentials() const;
 
-    inline bool hasChildren() const { return !m_children.isEmpty(); }
-    inline QVector<Node*> *children() { return &m_children; }
-    inline const QVector<Node*> *children() const { return &m_children; }
+    // Children are kept as an intrusive list of arena handles in the order they were generated
+    inline bool hasChildren() const { return m_firstChild.load(std::memory_order_acquire); }
+    Node *firstChild() const;
+    Node *nextSibling() const;
+    int childCount() const;
+    QVector<Node*> children() const; // copy
 
+    template <typename Policy>
     void scoreMiniMax(float score, bool shouldMinimaxExact, bool isExact, double newScores, quint32 increment);
     bool isAlreadyPlayingOut() const;
 
     int count() const;
 
     void incrementVisited(quint32 increment);
+    // Folds the visits and the value of a search of our subtree run elsewhere into us and our parent
+    void mergeRemoteVisits(quint32 visits, float qValue);
 
     // child generation
     enum NodeGenerationError {
@@ -293,8 +449,10 @@ public:
     void generatePotentials();
     void reservePotentials(int totalSize);
     Node::Potential *generatePotential(const Move &move);
-    Node *generateNextChild(Cache *cache, NodeGenerationError *error);
-    static Node *generateNode(const Move &move, float, Node *parent, Cache *cache, NodeGenerationError *error);
+    Node::Potential *appendPotential(const Move &move); // for moves already known to be legal
+    Node *generateNextChild(Cache *cache, NodeGenerationError *error, quint32 virtualLoss = 0);
+    static Node *generateNode(const Move &move, float, Node *parent, Cache *cache, NodeGenerationError *error,
+        quint32 virtualLoss = 0);
 
     // children
     const Node *findSuccessor(const QVector<QString> &child) const;
@@ -308,6 +466,13 @@ public:
     void backPropagateDirty();
     void backPropagateGameContextAndDirty();
     void backPropagateGameCycleAndDirty();
+    // Of a playout taken back unevaluated once no other is in flight, which leaves us unscored
+    // like a child just made and takes the virtual losses off our ancestors
+    void abandonPlayout();
+    // Takes the evaluation of the large network, whose policy is already on the potentials, in
+    // place of the one of the small network. The children made so far get the new policy and our
+    // first visit counts with the new value in our average and in those of our ancestors.
+    void refineEvaluation(float qValue);
 
     QVector<Game> previousMoves(bool fullHistory) const; // slow
 
@@ -318,7 +483,9 @@ public:
 
     Node *parent() const;
 
-    void principalVariation(int *depth, bool *isCheckMate, QTextStream *stream) const; // recursive
+    void principalVariation(int *depth, bool *isCheckMate, QTextStream *stream) const;
+    // Writes out at most maximum moves of the principal variation and returns how many
+    int principalVariation(Move *moves, int maximum, int *depth, bool *isCheckMate) const;
 
     QString toFen() const;
     QString toString(Chess::NotationType = Chess::Computer) const;
@@ -335,13 +502,18 @@ public:
 
     static bool greaterThan(const Node *a, const Node *b);
     static void sortByScore(QVector<Node*> &nodes, bool partialSortFirstOnlyy);
-    static void sortByPVals(QVector<Node::Potential> &potentials);
+    static void sortByPVals(Node::PotentialVector &potentials, int upTo);
 
     Node::Position *position() const;
 
     float qValueDefault() const;
     float qValue() const;
     void setQValue(float qValue);
+    // In the transposition graph mode the value of the position where a transposition has seen
+    // more of the subtree than this node, otherwise our own
+    float sharedQValue() const;
+    template <typename Policy>
+    float sharedQValue() const;
     void setInitialQValueFromPosition();
 
     Type positionType() const;
@@ -358,25 +530,67 @@ public:
     float uValue(const float uCoeff) const;
 
 private:
+    void appendChild(Node *child, quint32 handle);
+    void removeChild(Node *child);
+    void collapse();
+    void updateBestChild();
+    void updateUCoeff();
+    static void pruneFromTree(Node *node, bool isPrincipalVariation, quint32 maxVisits,
+        float maxPolicy, const QElapsedTimer &timer, qint64 msecs);
+
+    // What playout, minimax and minimaxPaths run with the policy of the current settings
+    template <typename Policy>
+    static Node *playoutWith(Node *root, int *vldMax, int *tryPlayoutLimit, bool *hardExit,
+        Cache *cache, QMutex *expansionMutex);
+    template <typename Policy>
+    static int playoutsWith(Node *n, int budget, int vld, int *vldMax, int *tryPlayoutLimit,
+        bool *hardExit, Cache *cache, QVector<Node*> *playouts);
+    // The two best of the children and of the next two potentials, returning the potential index
+    // they were scored at
+    template <typename Policy>
+    static int scoreChildren(Node *n, Cache *cache, Playout *firstPlayout, Playout *secondPlayout,
+        float *secondBestScore);
+    // Counts a descent that ran into a playout already under way, or an exact node, and adds the
+    // virtual loss that steers the next ones away. False once the limits ran out.
+    static bool collide(Node *n, bool alreadyPlayingOut, int vld, int *vldMax, int *tryPlayoutLimit);
+    template <typename Policy>
+    static float minimaxWith(Node *, quint32 depth, WorkerInfo *info, double *newScores,
+        quint32 *newVisits);
+    template <typename Policy>
+    static void minimaxPathsWith(const QVector<Node*> &leaves, WorkerInfo *info);
+    template <typename Policy>
+    static float minimaxConcurrentlyWith(Node *root, WorkerInfo *info, double *newScores,
+        quint32 *newVisits, quint32 splitVisits, const Runner &run);
+    // Scores a dirty node from its children once they are all backed up and what they contributed
+    template <typename Policy>
+    static void backUpFromChildren(Node *node, double newScores, quint32 newVisits, WorkerInfo *info);
+
     Game m_game;                        // 8
     Node *m_parent;                     // 8
     Node::Position *m_position;         // 8
-    QVector<Node*> m_children;          // 8
+    // Published with release once the child is complete so lock free descents load them with
+    // acquire
+    std::atomic<quint32> m_firstChild;  // 4
+    std::atomic<quint32> m_nextSibling; // 4
     quint32 m_visited;                  // 4
-    quint32 m_virtualLoss;              // 4
+    std::atomic<quint32> m_virtualLoss; // 4
     float m_qValue;                     // 4
     float m_pValue;                     // 4
     float m_policySum;                  // 4
     float m_uCoeff;                     // 4
-    quint8 m_potentialIndex;            // 1
+    std::atomic<quint8> m_potentialIndex; // 1
     quint8 m_gameCycles;                // 1
+    quint16 m_cache;                    // 2 index of the cache the node lives in
     Type m_type;                        // 1
     Context m_context;                  // 1
+    quint8 m_bestChild;                 // 1 index into the children or NoBestChild
     bool m_isDirty: 1;                  // 1
+    friend class Cache;
     friend class SearchWorker;
     friend class SearchEngine;
     friend class Tests;
     friend class Tree;
+    friend class TreeExport;
 };
 
 inline int Node::treeDepth() const
@@ -384,9 +598,7 @@ inline int Node::treeDepth() const
     int d = 0;
     const Node *n = this;
     while (n && n->hasChildren()) {
-        QVector<Node*> children = n->m_children;
-        sortByScore(children, true /*partialSortFirstOnly*/);
-        n = children.first();
+        n = n->bestChild();
         ++d;
     }
     return d;
@@ -448,14 +660,6 @@ inline bool Node::isDirty() const
     return m_isDirty;
 }
 
-inline int Node::count() const
-{
-    int c = isRootNode() ? 0 : 1; // me, myself, and I
-    for (Node *n : m_children)
-        c += n->count();
-    return c;
-}
-
 inline float Node::uCoeff() const
 {
     return m_uCoeff;
@@ -498,17 +702,6 @@ inline bool Node::isRootNode() const
     return m_parent == nullptr;
 }
 
-inline void Node::setAsRootNode()
-{
-    // Need to remove ourself from our parent's children
-    if (m_parent)
-        m_parent->m_children.removeAll(this);
-
-    // Now we have no parent
-    m_parent = nullptr;
-    setType(NonTerminal);
-}
-
 inline Node *Node::parent() const
 {
     return m_parent;
@@ -537,12 +730,24 @@ inline void Node::sortByScore(QVector<Node*> &nodes, bool partialSortFirstOnly)
     }
 }
 
-inline void Node::sortByPVals(QVector<Node::Potential> &potentials)
+inline void Node::sortByPVals(Node::PotentialVector &potentials, int upTo)
 {
-    std::stable_sort(potentials.begin(), potentials.end(),
-        [](const Node::Potential &a, const Node::Potential &b) {
-        return a.pValue() > b.pValue();
-    });
+    // Extends the ordered prefix to upTo by stable selection, pulling the first of the highest
+    // remaining pvals forward each time. The order matches a full stable sort however far it is
+    // taken, so search stays deterministic while the tail that is never visited is never ordered.
+    Node::Potential *data = potentials.data();
+    const int count = potentials.count();
+    upTo = qMin(upTo, count);
+    for (int i = potentials.sorted(); i < upTo; ++i) {
+        int best = i;
+        for (int j = i + 1; j < count; ++j) {
+            if (data[j].pValue() > data[best].pValue())
+                best = j;
+        }
+        std::rotate(data + i, data + best, data + best + 1);
+    }
+    if (upTo > potentials.sorted())
+        potentials.setSorted(upTo);
 }
 
 inline Node::Position *Node::position() const
@@ -569,6 +774,23 @@ inline void Node::setQValue(float qValue)
     m_qValue = qValue;
 }
 
+inline float Node::sharedQValue() const
+{
+    return SearchSettings::transpositionGraph ? sharedQValue<SearchPolicy<true, true>>() : m_qValue;
+}
+
+template <typename Policy>
+inline float Node::sharedQValue() const
+{
+    // Exact nodes and those with a game context in the tree, a cycle or a draw by rule, have a
+    // value that depends on the path so they never take that of a transposition
+    if (!Policy::transpositionGraph || !m_position || m_position->isUnique()
+        || m_context != NoContext || isExact() || m_position->visits() <= m_visited) {
+        return m_qValue;
+    }
+    return m_position->qValue();
+}
+
 inline float qValueWithGameCyclePenalty(float qValue, quint8 gameCycles)
 {
     return qValue * powf(0.5f, gameCycles);
@@ -684,11 +906,6 @@ inline bool isPinned(const Node::Position &position)
     return position.refs();
 }
 
-inline bool isPinned(Node *node)
-{
-    return node->position();
-}
-
 inline bool shouldMakeUnique(const Node::Position &position)
 {
     // This function determines whether a position should be made unique when transpositions
@@ -705,6 +922,31 @@ inline void setUniqueFlag(Node::Position &position)
     position.setUnique(true);
 }
 
+inline void grantEvictionCredit(Node::Position &position)
+{
+    // Every transposition into the position earns it another second chance
+    if (position.evictionCredit() < Node::Position::MaximumEvictionCredit)
+        position.setEvictionCredit(position.evictionCredit() + 1);
+}
+
+inline bool spendEvictionCredit(Node::Position &position)
+{
+    if (!position.evictionCredit())
+        return false;
+    position.setEvictionCredit(position.evictionCredit() - 1);
+    return true;
+}
+
+inline void pin(Node::Position &position)
+{
+    position.ref();
+}
+
+inline void unpin(Node::Position &position)
+{
+    position.unref();
+}
+
 QDebug operator<<(QDebug debug, const Node &node);
 
 #endif // NODE_H
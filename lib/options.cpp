@@ -21,7 +21,11 @@
 #include "options.h"
 #include "neural/loader.h"
 
+#include <QDebug>
+
 #include "cache.h"
+#include "debuglog.h"
+#include "metrics.h"
 #include "node.h"
 #include "nn.h"
 #include "tb.h"
@@ -34,11 +38,14 @@ Options* Options::globalInstance()
 }
 
 Options::Options()
+    : m_settings(new OptionSettings)
 {
 }
 
 Options::~Options()
 {
+    qDeleteAll(m_retiredSettings);
+    delete m_settings.load();
 }
 
 void Options::addRegularOptions()
@@ -88,6 +95,18 @@ void Options::addRegularOptions()
     debugLog.m_description = QLatin1String("Output a debug log in binary directory");
     insertOption(debugLog);
 
+    UciOption metricsPort;
+    metricsPort.m_name = QLatin1Literal("MetricsPort");
+    metricsPort.m_type = UciOption::Spin;
+    metricsPort.m_default = QLatin1Literal("0");
+    metricsPort.m_value = metricsPort.m_default;
+    metricsPort.m_valueType = QLatin1String("integer");
+    metricsPort.m_min = QLatin1Literal("0");
+    metricsPort.m_max = QLatin1Literal("65535");
+    metricsPort.m_description = QLatin1String("The tcp port serving prometheus metrics over http at"
+                                              " /metrics, where 0 serves none");
+    insertOption(metricsPort);
+
     UciOption debugInfo;
     debugInfo.m_name = QLatin1Literal("DebugInfo");
     debugInfo.m_type = UciOption::Check;
@@ -140,10 +159,149 @@ void Options::addRegularOptions()
     cache.m_value = cache.m_default;
     cache.m_valueType = QLatin1String("integer");
     cache.m_min = QLatin1Literal("100000");
-    cache.m_max = QString::number(999999999);
+    cache.m_max = QString::number(std::numeric_limits<quint32>::max());
     cache.m_description = QLatin1String("Maximum number of chess positions stored in memory");
     insertOption(cache);
 
+    UciOption cacheMB;
+    cacheMB.m_name = QLatin1Literal("CacheMB");
+    cacheMB.m_type = UciOption::Spin;
+    cacheMB.m_default = QLatin1Literal("0");
+    cacheMB.m_value = cacheMB.m_default;
+    cacheMB.m_valueType = QLatin1String("integer");
+    cacheMB.m_min = QLatin1Literal("0");
+    cacheMB.m_max = QString::number(4 * 1024 * 1024);
+    cacheMB.m_description = QLatin1String("Megabytes of memory for the node and position caches"
+                                          " which when non zero overrides the Cache option");
+    insertOption(cacheMB);
+
+    UciOption cacheEviction;
+    cacheEviction.m_name = QLatin1Literal("CacheEviction");
+    cacheEviction.m_type = UciOption::Combo;
+    cacheEviction.m_default = QLatin1Literal("lru");
+    cacheEviction.m_value = cacheEviction.m_default;
+    cacheEviction.m_var = { QLatin1String("lru"), QLatin1String("secondchance") };
+    cacheEviction.m_description = QLatin1String("Eviction policy of the position cache where"
+                                                " secondchance favors heavily visited and"
+                                                " transposed positions");
+    insertOption(cacheEviction);
+
+    UciOption cacheShards;
+    cacheShards.m_name = QLatin1Literal("CacheShards");
+    cacheShards.m_type = UciOption::Spin;
+    cacheShards.m_default = QLatin1Literal("1");
+    cacheShards.m_value = cacheShards.m_default;
+    cacheShards.m_valueType = QLatin1String("integer");
+    cacheShards.m_min = QLatin1Literal("1");
+    cacheShards.m_max = QLatin1Literal("256");
+    cacheShards.m_description = QLatin1String("Number of shards of the position cache, rounded down to a"
+                                              " power of two, each with a lock of its own so that"
+                                              " threads can expand the tree at once. One takes no locks");
+    insertOption(cacheShards);
+
+    UciOption largePages;
+    largePages.m_name = QLatin1Literal("LargePages");
+    largePages.m_type = UciOption::Check;
+    largePages.m_default = QLatin1Literal("false");
+    largePages.m_value = largePages.m_default;
+    largePages.m_valueType = QLatin1String("boolean");
+    largePages.m_description = QLatin1String("Back the node and position caches with huge pages"
+                                             " when the operating system provides them");
+    insertOption(largePages);
+
+    UciOption prefaultThreads;
+    prefaultThreads.m_name = QLatin1Literal("PrefaultThreads");
+    prefaultThreads.m_type = UciOption::Spin;
+    prefaultThreads.m_default = QLatin1Literal("4");
+    prefaultThreads.m_value = prefaultThreads.m_default;
+    prefaultThreads.m_valueType = QLatin1String("integer");
+    prefaultThreads.m_min = QLatin1Literal("0");
+    prefaultThreads.m_max = QLatin1Literal("256");
+    prefaultThreads.m_description = QLatin1String("Threads faulting in the node and position caches"
+                                                  " on a new game while the network loads, where 0"
+                                                  " leaves that to the search");
+    insertOption(prefaultThreads);
+
+    UciOption gpuWorkers;
+    gpuWorkers.m_name = QLatin1Literal("GPUWorkers");
+    gpuWorkers.m_type = UciOption::Spin;
+    gpuWorkers.m_default = QLatin1Literal("0");
+    gpuWorkers.m_value = gpuWorkers.m_default;
+    gpuWorkers.m_valueType = QLatin1String("integer");
+    gpuWorkers.m_min = QLatin1Literal("0");
+    gpuWorkers.m_max = QLatin1Literal("512");
+    gpuWorkers.m_description = QLatin1String("Number of threads feeding the GPUs where 0 means two"
+                                             " for every GPU core");
+    insertOption(gpuWorkers);
+
+    UciOption gpuWorkerCPUs;
+    gpuWorkerCPUs.m_name = QLatin1Literal("GPUWorkerCPUs");
+    gpuWorkerCPUs.m_type = UciOption::String;
+    gpuWorkerCPUs.m_default = QLatin1Literal("");
+    gpuWorkerCPUs.m_value = gpuWorkerCPUs.m_default;
+    gpuWorkerCPUs.m_valueType = QLatin1String("string");
+    gpuWorkerCPUs.m_description = QLatin1String("CPUs the GPU workers are pinned to as a list like 0-3,8,"
+                                                " or gpu for those of the NUMA node of the GPU each"
+                                                " worker is assigned, where empty leaves them unpinned");
+    insertOption(gpuWorkerCPUs);
+
+    UciOption gpuWorkerPriority;
+    gpuWorkerPriority.m_name = QLatin1Literal("GPUWorkerPriority");
+    gpuWorkerPriority.m_type = UciOption::Combo;
+    gpuWorkerPriority.m_default = QLatin1Literal("inherit");
+    gpuWorkerPriority.m_value = gpuWorkerPriority.m_default;
+    gpuWorkerPriority.m_var = { QLatin1String("inherit"), QLatin1String("idle"), QLatin1String("lowest"),
+        QLatin1String("low"), QLatin1String("normal"), QLatin1String("high"), QLatin1String("highest"),
+        QLatin1String("timecritical") };
+    gpuWorkerPriority.m_description = QLatin1String("Scheduling priority of the GPU workers");
+    insertOption(gpuWorkerPriority);
+
+    UciOption searchThreadCPUs;
+    searchThreadCPUs.m_name = QLatin1Literal("SearchThreadCPUs");
+    searchThreadCPUs.m_type = UciOption::String;
+    searchThreadCPUs.m_default = QLatin1Literal("");
+    searchThreadCPUs.m_value = searchThreadCPUs.m_default;
+    searchThreadCPUs.m_valueType = QLatin1String("string");
+    searchThreadCPUs.m_description = QLatin1String("CPUs the search thread is pinned to as a list like 0-3,8,"
+                                                   " or gpu for those of the NUMA node of the first GPU,"
+                                                   " where empty leaves it unpinned");
+    insertOption(searchThreadCPUs);
+
+    UciOption searchThreadPriority;
+    searchThreadPriority.m_name = QLatin1Literal("SearchThreadPriority");
+    searchThreadPriority.m_type = UciOption::Combo;
+    searchThreadPriority.m_default = QLatin1Literal("timecritical");
+    searchThreadPriority.m_value = searchThreadPriority.m_default;
+    searchThreadPriority.m_var = { QLatin1String("inherit"), QLatin1String("idle"), QLatin1String("lowest"),
+        QLatin1String("low"), QLatin1String("normal"), QLatin1String("high"), QLatin1String("highest"),
+        QLatin1String("timecritical") };
+    searchThreadPriority.m_description = QLatin1String("Scheduling priority of the search thread");
+    insertOption(searchThreadPriority);
+
+    UciOption expansionThreads;
+    expansionThreads.m_name = QLatin1Literal("ExpansionThreads");
+    expansionThreads.m_type = UciOption::Spin;
+    expansionThreads.m_default = QLatin1Literal("0");
+    expansionThreads.m_value = expansionThreads.m_default;
+    expansionThreads.m_valueType = QLatin1String("integer");
+    expansionThreads.m_min = QLatin1Literal("0");
+    expansionThreads.m_max = QLatin1Literal("64");
+    expansionThreads.m_description = QLatin1String("Number of threads generating moves for batches"
+                                                   " ahead of the GPU workers where 0 leaves it to them");
+    insertOption(expansionThreads);
+
+    UciOption batchesInFlight;
+    batchesInFlight.m_name = QLatin1Literal("BatchesInFlight");
+    batchesInFlight.m_type = UciOption::Spin;
+    batchesInFlight.m_default = QLatin1Literal("0");
+    batchesInFlight.m_value = batchesInFlight.m_default;
+    batchesInFlight.m_valueType = QLatin1String("integer");
+    batchesInFlight.m_min = QLatin1Literal("0");
+    batchesInFlight.m_max = QLatin1Literal("512");
+    batchesInFlight.m_description = QLatin1String("Number of batches being filled or evaluated at once"
+                                                  " where 0 picks it from the measured latencies");
+    insertOption(batchesInFlight);
+
     UciOption maxBatchSize;
     maxBatchSize.m_name = QLatin1Literal("MaxBatchSize");
     maxBatchSize.m_type = UciOption::Spin;
@@ -152,9 +310,20 @@ void Options::addRegularOptions()
     maxBatchSize.m_value = maxBatchSize.m_default;
     maxBatchSize.m_min = QLatin1Literal("0");
     maxBatchSize.m_max = QLatin1Literal("65536");
-    maxBatchSize.m_description = QLatin1String("Largest batch to send to GPU");
+    maxBatchSize.m_description = QLatin1String("Largest batch to send to GPU, which the backend"
+                                              " allocates its buffers for");
     insertOption(maxBatchSize);
 
+    UciOption adaptiveBatchSize;
+    adaptiveBatchSize.m_name = QLatin1Literal("AdaptiveBatchSize");
+    adaptiveBatchSize.m_type = UciOption::Check;
+    adaptiveBatchSize.m_default = QLatin1Literal("false");
+    adaptiveBatchSize.m_value = adaptiveBatchSize.m_default;
+    adaptiveBatchSize.m_valueType = QLatin1String("boolean");
+    adaptiveBatchSize.m_description = QLatin1String("Pick the batch size from the measured GPU"
+                                                    " latency, collisions and the time left");
+    insertOption(adaptiveBatchSize);
+
     UciOption moveOverhead;
     moveOverhead.m_name = QLatin1Literal("MoveOverhead");
     moveOverhead.m_type = UciOption::Spin;
@@ -166,6 +335,53 @@ void Options::addRegularOptions()
     moveOverhead.m_description = QLatin1String("Overhead to avoid timing out");
     insertOption(moveOverhead);
 
+    UciOption infoInterval;
+    infoInterval.m_name = QLatin1Literal("InfoInterval");
+    infoInterval.m_type = UciOption::Spin;
+    infoInterval.m_default = QLatin1Literal("100");
+    infoInterval.m_value = infoInterval.m_default;
+    infoInterval.m_valueType = QLatin1String("integer");
+    infoInterval.m_min = QLatin1Literal("0");
+    infoInterval.m_max = QLatin1Literal("5000");
+    infoInterval.m_description = QLatin1String("Milliseconds between info lines apart from new best"
+                                               " moves where 0 reports every update");
+    insertOption(infoInterval);
+
+    UciOption nnCacheSize;
+    nnCacheSize.m_name = QLatin1Literal("NNCacheSize");
+    nnCacheSize.m_type = UciOption::Spin;
+    nnCacheSize.m_default = QLatin1Literal("262144");
+    nnCacheSize.m_value = nnCacheSize.m_default;
+    nnCacheSize.m_valueType = QLatin1String("integer");
+    nnCacheSize.m_min = QLatin1Literal("0");
+    nnCacheSize.m_max = QString::number(std::numeric_limits<quint32>::max());
+    nnCacheSize.m_description = QLatin1String("Number of network results to cache which is rounded"
+                                              " down to a power of two where zero disables it");
+    insertOption(nnCacheSize);
+
+    UciOption nnStoreFile;
+    nnStoreFile.m_name = QLatin1Literal("NNStoreFile");
+    nnStoreFile.m_type = UciOption::String;
+    nnStoreFile.m_default = QLatin1Literal("");
+    nnStoreFile.m_value = nnStoreFile.m_default;
+    nnStoreFile.m_valueType = QLatin1String("filepath");
+    nnStoreFile.m_description = QLatin1String("File keeping the network results of the opening across"
+                                              " runs for the weights that wrote it where empty"
+                                              " disables it");
+    insertOption(nnStoreFile);
+
+    UciOption nnStorePlies;
+    nnStorePlies.m_name = QLatin1Literal("NNStorePlies");
+    nnStorePlies.m_type = UciOption::Spin;
+    nnStorePlies.m_default = QLatin1Literal("24");
+    nnStorePlies.m_value = nnStorePlies.m_default;
+    nnStorePlies.m_valueType = QLatin1String("integer");
+    nnStorePlies.m_min = QLatin1Literal("0");
+    nnStorePlies.m_max = QLatin1Literal("1000");
+    nnStorePlies.m_description = QLatin1String("Positions at most this many plies into the game have"
+                                               " their network results added to the nn store");
+    insertOption(nnStorePlies);
+
     UciOption GPUCores;
     GPUCores.m_name = QLatin1Literal("GPUCores");
     GPUCores.m_type = UciOption::Spin;
@@ -177,6 +393,38 @@ void Options::addRegularOptions()
     GPUCores.m_description = QLatin1String("Number of GPU cards to use");
     insertOption(GPUCores);
 
+    UciOption nnServer;
+    nnServer.m_name = QLatin1Literal("NNServer");
+    nnServer.m_type = UciOption::String;
+    nnServer.m_default = QLatin1Literal("");
+    nnServer.m_value = nnServer.m_default;
+    nnServer.m_valueType = QLatin1String("string");
+    nnServer.m_description = QLatin1String("Address as host:port of an nn server to evaluate positions"
+                                           " on in place of the local GPU cards where empty uses them");
+    insertOption(nnServer);
+
+    UciOption nnServerComputations;
+    nnServerComputations.m_name = QLatin1Literal("NNServerComputations");
+    nnServerComputations.m_type = UciOption::Spin;
+    nnServerComputations.m_default = QLatin1Literal("4");
+    nnServerComputations.m_value = nnServerComputations.m_default;
+    nnServerComputations.m_valueType = QLatin1String("integer");
+    nnServerComputations.m_min = QLatin1Literal("1");
+    nnServerComputations.m_max = QLatin1Literal("64");
+    nnServerComputations.m_description = QLatin1String("Number of batches that can be in flight to the"
+                                                       " nn server at once");
+    insertOption(nnServerComputations);
+
+    UciOption searchServers;
+    searchServers.m_name = QLatin1Literal("SearchServers");
+    searchServers.m_type = UciOption::String;
+    searchServers.m_default = QLatin1Literal("");
+    searchServers.m_value = searchServers.m_default;
+    searchServers.m_valueType = QLatin1String("string");
+    searchServers.m_description = QLatin1String("Comma separated addresses as host:port of search servers"
+                                                " to split the most visited children of the root across");
+    insertOption(searchServers);
+
     UciOption openingTimeFactor;
     openingTimeFactor.m_name = QLatin1Literal("OpeningTimeFactor");
     openingTimeFactor.m_type =  UciOption::String;
@@ -208,6 +456,94 @@ void Options::addRegularOptions()
     policySoftmaxTemp.m_description = QLatin1String("The policy softmax temp for moves.");
     insertOption(policySoftmaxTemp);
 
+    UciOption pruneWhenFull;
+    pruneWhenFull.m_name = QLatin1Literal("PruneWhenFull");
+    pruneWhenFull.m_type = UciOption::Check;
+    pruneWhenFull.m_default = QLatin1Literal("false");
+    pruneWhenFull.m_value = pruneWhenFull.m_default;
+    pruneWhenFull.m_valueType = QLatin1String("boolean");
+    pruneWhenFull.m_description = QLatin1String("Prune low visit subtrees away from the pv when the"
+                                                " node cache fills up instead of stopping the search");
+    insertOption(pruneWhenFull);
+
+    UciOption incrementalBackup;
+    incrementalBackup.m_name = QLatin1Literal("IncrementalBackup");
+    incrementalBackup.m_type = UciOption::Check;
+    incrementalBackup.m_default = QLatin1Literal("false");
+    incrementalBackup.m_value = incrementalBackup.m_default;
+    incrementalBackup.m_valueType = QLatin1String("boolean");
+    incrementalBackup.m_description = QLatin1String("Back up only the paths from the evaluated nodes to"
+                                                    " the root instead of walking the dirty tree");
+    insertOption(incrementalBackup);
+
+    UciOption transpositionGraph;
+    transpositionGraph.m_name = QLatin1Literal("TranspositionGraph");
+    transpositionGraph.m_type = UciOption::Check;
+    transpositionGraph.m_default = QLatin1Literal("false");
+    transpositionGraph.m_value = transpositionGraph.m_default;
+    transpositionGraph.m_valueType = QLatin1String("boolean");
+    transpositionGraph.m_description = QLatin1String("Select and back up transposed nodes with the value"
+                                                     " of whichever transposition has searched the"
+                                                     " position the most");
+    insertOption(transpositionGraph);
+
+    UciOption speculativeFill;
+    speculativeFill.m_name = QLatin1Literal("SpeculativeFill");
+    speculativeFill.m_type = UciOption::Check;
+    speculativeFill.m_default = QLatin1Literal("false");
+    speculativeFill.m_value = speculativeFill.m_default;
+    speculativeFill.m_valueType = QLatin1String("boolean");
+    speculativeFill.m_description = QLatin1String("Top up a batch the playouts left short with the moves"
+                                                  " near the principal variation they would make next,"
+                                                  " whose evaluations wait in the cache for them");
+    insertOption(speculativeFill);
+
+    UciOption batchedSelection;
+    batchedSelection.m_name = QLatin1Literal("BatchedSelection");
+    batchedSelection.m_type = UciOption::Check;
+    batchedSelection.m_default = QLatin1Literal("false");
+    batchedSelection.m_value = batchedSelection.m_default;
+    batchedSelection.m_valueType = QLatin1String("boolean");
+    batchedSelection.m_description = QLatin1String("Gather the playouts of a batch in descents that split it"
+                                                   " among the children by their virtual loss distance"
+                                                   " rather than descending from the root for each");
+    insertOption(batchedSelection);
+
+    UciOption treeCompaction;
+    treeCompaction.m_name = QLatin1Literal("TreeCompaction");
+    treeCompaction.m_type = UciOption::Check;
+    treeCompaction.m_default = QLatin1Literal("false");
+    treeCompaction.m_value = treeCompaction.m_default;
+    treeCompaction.m_valueType = QLatin1String("boolean");
+    treeCompaction.m_description = QLatin1String("Move the tree reused from the last move to the front of"
+                                                 " the node cache breadth first before searching on");
+    insertOption(treeCompaction);
+
+    UciOption mateSolverMoves;
+    mateSolverMoves.m_name = QLatin1Literal("MateSolverMoves");
+    mateSolverMoves.m_type = UciOption::Spin;
+    mateSolverMoves.m_default = QString::number(SearchSettings::mateSolverMoves);
+    mateSolverMoves.m_value = mateSolverMoves.m_default;
+    mateSolverMoves.m_valueType = QLatin1String("integer");
+    mateSolverMoves.m_min = QLatin1Literal("0");
+    mateSolverMoves.m_max = QLatin1Literal("4");
+    mateSolverMoves.m_description = QLatin1String("Prove mates by checks within this many moves at new leaves"
+                                                  " in check or with few replies, scoring them without the"
+                                                  " network. Zero turns the solver off");
+    insertOption(mateSolverMoves);
+
+    UciOption mateSolverReplies;
+    mateSolverReplies.m_name = QLatin1Literal("MateSolverReplies");
+    mateSolverReplies.m_type = UciOption::Spin;
+    mateSolverReplies.m_default = QString::number(SearchSettings::mateSolverReplies);
+    mateSolverReplies.m_value = mateSolverReplies.m_default;
+    mateSolverReplies.m_valueType = QLatin1String("integer");
+    mateSolverReplies.m_min = QLatin1Literal("0");
+    mateSolverReplies.m_max = QLatin1Literal("256");
+    mateSolverReplies.m_description = QLatin1String("Leaves with at most this many legal moves are given to"
+                                                    " the mate solver along with those in check");
+    insertOption(mateSolverReplies);
+
     UciOption tb;
     tb.m_name = QLatin1Literal("SyzygyPath");
     tb.m_type = UciOption::String;
@@ -217,6 +553,29 @@ void Options::addRegularOptions()
     tb.m_description = QLatin1String("Path to the syzygy tablebase");
     insertOption(tb);
 
+    UciOption tbCacheSize;
+    tbCacheSize.m_name = QLatin1Literal("TBCacheSize");
+    tbCacheSize.m_type = UciOption::Spin;
+    tbCacheSize.m_default = QLatin1Literal("1048576");
+    tbCacheSize.m_value = tbCacheSize.m_default;
+    tbCacheSize.m_valueType = QLatin1String("integer");
+    tbCacheSize.m_min = QLatin1Literal("0");
+    tbCacheSize.m_max = QString::number(std::numeric_limits<quint32>::max());
+    tbCacheSize.m_description = QLatin1String("Number of tablebase probe results to cache which is"
+                                              " rounded down to a power of two where zero disables it");
+    insertOption(tbCacheSize);
+
+    UciOption tbPreload;
+    tbPreload.m_name = QLatin1Literal("SyzygyPreload");
+    tbPreload.m_type = UciOption::Combo;
+    tbPreload.m_default = QLatin1Literal("off");
+    tbPreload.m_value = tbPreload.m_default;
+    tbPreload.m_var = { QLatin1String("off"), QLatin1String("willneed"), QLatin1String("lock") };
+    tbPreload.m_description = QLatin1String("Whether to read the wdl tables reachable from the root"
+                                            " into memory ahead of the probes where lock also"
+                                            " keeps them there");
+    insertOption(tbPreload);
+
     UciOption tryPlayoutLimit;
     tryPlayoutLimit.m_name = QLatin1Literal("TryPlayoutLimit");
     tryPlayoutLimit.m_type = UciOption::Spin;
@@ -230,6 +589,55 @@ void Options::addRegularOptions()
                                                   " giving up.");
     insertOption(tryPlayoutLimit);
 
+    UciOption searchShards;
+    searchShards.m_name = QLatin1Literal("SearchShards");
+    searchShards.m_type = UciOption::Spin;
+    searchShards.m_default = QLatin1Literal("1");
+    searchShards.m_value = searchShards.m_default;
+    searchShards.m_valueType = QLatin1String("integer");
+    searchShards.m_min = QLatin1Literal("1");
+    searchShards.m_max = QLatin1Literal("8");
+    searchShards.m_description = QLatin1String("Number of search workers with their own gpu workers and"
+                                               " cache to split the most visited children of the root"
+                                               " across, one for every numa node");
+    insertOption(searchShards);
+
+    UciOption searchThreads;
+    searchThreads.m_name = QLatin1Literal("SearchThreads");
+    searchThreads.m_type = UciOption::Spin;
+    searchThreads.m_default = QString::number(SearchSettings::searchThreads);
+    searchThreads.m_value = searchThreads.m_default;
+    searchThreads.m_valueType = QLatin1String("integer");
+    searchThreads.m_min = QLatin1Literal("1");
+    searchThreads.m_max = QLatin1Literal("64");
+    searchThreads.m_description = QLatin1String("Number of threads descending the tree to fill each"
+                                                " batch");
+    insertOption(searchThreads);
+
+    UciOption minimaxThreads;
+    minimaxThreads.m_name = QLatin1Literal("MinimaxThreads");
+    minimaxThreads.m_type = UciOption::Spin;
+    minimaxThreads.m_default = QString::number(SearchSettings::minimaxThreads);
+    minimaxThreads.m_value = minimaxThreads.m_default;
+    minimaxThreads.m_valueType = QLatin1String("integer");
+    minimaxThreads.m_min = QLatin1Literal("1");
+    minimaxThreads.m_max = QLatin1Literal("64");
+    minimaxThreads.m_description = QLatin1String("Number of threads backing up the large dirty subtrees"
+                                                 " a minimax pass over the whole tree finds, such as after"
+                                                 " the tree was reused");
+    insertOption(minimaxThreads);
+
+    UciOption selectionTrace;
+    selectionTrace.m_name = QLatin1Literal("SelectionTrace");
+    selectionTrace.m_type = UciOption::String;
+    selectionTrace.m_default = QLatin1Literal("");
+    selectionTrace.m_value = selectionTrace.m_default;
+    selectionTrace.m_valueType = QLatin1String("filepath");
+    selectionTrace.m_description = QLatin1String("Append how every batch of every search was filled"
+                                                 " to this binary trace, read back with the trace"
+                                                 " mode");
+    insertOption(selectionTrace);
+
     UciOption ninesixty;
     ninesixty.m_name = QLatin1Literal("UCI_Chess960");
     ninesixty.m_type = UciOption::Check;
@@ -239,14 +647,35 @@ void Options::addRegularOptions()
     ninesixty.m_description = QLatin1String("Play Chess960");
     insertOption(ninesixty);
 
-    UciOption useHalfFloatingPoint;
-    useHalfFloatingPoint.m_name = QLatin1Literal("UseFP16");
-    useHalfFloatingPoint.m_type = UciOption::Check;
-    useHalfFloatingPoint.m_default = QLatin1Literal("false");
-    useHalfFloatingPoint.m_value = useHalfFloatingPoint.m_default;
-    useHalfFloatingPoint.m_valueType = QLatin1String("boolean");
-    useHalfFloatingPoint.m_description = QLatin1String("Use half floating point on GPU");
-    insertOption(useHalfFloatingPoint);
+    UciOption precision;
+    precision.m_name = QLatin1Literal("Precision");
+    precision.m_type = UciOption::Combo;
+    precision.m_default = QLatin1Literal("fp32");
+    precision.m_value = precision.m_default;
+    precision.m_var = { QLatin1String("fp32"), QLatin1String("fp16"), QLatin1String("int8") };
+    precision.m_description = QLatin1String("Floating point precision of the network on GPU where"
+                                            " int8 needs UseTensorRT and otherwise runs as fp16");
+    insertOption(precision);
+
+    UciOption useTensorRT;
+    useTensorRT.m_name = QLatin1Literal("UseTensorRT");
+    useTensorRT.m_type = UciOption::Check;
+    useTensorRT.m_default = QLatin1Literal("false");
+    useTensorRT.m_value = useTensorRT.m_default;
+    useTensorRT.m_valueType = QLatin1String("boolean");
+    useTensorRT.m_description = QLatin1String("Run the network as a TensorRT engine which is built for"
+                                              " MaxBatchSize and cached next to the weights");
+    insertOption(useTensorRT);
+
+    UciOption int8CalibrationFile;
+    int8CalibrationFile.m_name = QLatin1Literal("Int8CalibrationFile");
+    int8CalibrationFile.m_type = UciOption::String;
+    int8CalibrationFile.m_default = QLatin1Literal("");
+    int8CalibrationFile.m_value = int8CalibrationFile.m_default;
+    int8CalibrationFile.m_valueType = QLatin1String("filepath");
+    int8CalibrationFile.m_description = QLatin1String("File of positions as fen, one per line, that the"
+                                                      " ranges of int8 precision are calibrated on");
+    insertOption(int8CalibrationFile);
 
     UciOption useCustomWinograd;
     useCustomWinograd.m_name = QLatin1Literal("UseCustomWinograd");
@@ -257,6 +686,88 @@ void Options::addRegularOptions()
     useCustomWinograd.m_description = QLatin1String("Use custom winograd algorithm on GPU");
     insertOption(useCustomWinograd);
 
+    UciOption autotune;
+    autotune.m_name = QLatin1Literal("Autotune");
+    autotune.m_type = UciOption::Check;
+    autotune.m_default = QLatin1Literal("true");
+    autotune.m_value = autotune.m_default;
+    autotune.m_valueType = QLatin1String("boolean");
+    autotune.m_description = QLatin1String("Measure whether the custom winograd algorithm and which cudnn"
+                                           " algorithms are fastest on the GPU in place of UseCustomWinograd,"
+                                           " cached in a file next to the weights");
+    insertOption(autotune);
+
+    UciOption useCudaGraphs;
+    useCudaGraphs.m_name = QLatin1Literal("UseCudaGraphs");
+    useCudaGraphs.m_type = UciOption::Check;
+    useCudaGraphs.m_default = QLatin1Literal("true");
+    useCudaGraphs.m_value = useCudaGraphs.m_default;
+    useCudaGraphs.m_valueType = QLatin1String("boolean");
+    useCudaGraphs.m_description = QLatin1String("Replay the network as cuda graphs captured for power of two batch sizes");
+    insertOption(useCudaGraphs);
+
+    UciOption useCPU;
+    useCPU.m_name = QLatin1Literal("UseCPU");
+    useCPU.m_type = UciOption::Check;
+#if defined(NO_CUDA)
+    useCPU.m_default = QLatin1Literal("true");
+#else
+    useCPU.m_default = QLatin1Literal("false");
+#endif
+    useCPU.m_value = useCPU.m_default;
+    useCPU.m_valueType = QLatin1String("boolean");
+    useCPU.m_description = QLatin1String("Evaluate the network on the processor in place of the GPU cards");
+    insertOption(useCPU);
+
+    UciOption cpuThreads;
+    cpuThreads.m_name = QLatin1Literal("CPUThreads");
+    cpuThreads.m_type = UciOption::Spin;
+    cpuThreads.m_default = QLatin1Literal("0");
+    cpuThreads.m_value = cpuThreads.m_default;
+    cpuThreads.m_valueType = QLatin1String("integer");
+    cpuThreads.m_min = QLatin1Literal("0");
+    cpuThreads.m_max = QLatin1Literal("256");
+    cpuThreads.m_description = QLatin1String("Number of threads a batch is split across on the processor"
+                                             " where zero uses every core");
+    insertOption(cpuThreads);
+
+    UciOption hybridCPUBatch;
+    hybridCPUBatch.m_name = QLatin1Literal("HybridCPUBatch");
+    hybridCPUBatch.m_type = UciOption::Spin;
+    hybridCPUBatch.m_default = QLatin1Literal("0");
+    hybridCPUBatch.m_value = hybridCPUBatch.m_default;
+    hybridCPUBatch.m_valueType = QLatin1String("integer");
+    hybridCPUBatch.m_min = QLatin1Literal("0");
+    hybridCPUBatch.m_max = QLatin1Literal("1024");
+    hybridCPUBatch.m_description = QLatin1String("Batches of fewer positions than this are evaluated on the"
+                                                 " processor with CPUThreads next to the GPU cards, as are"
+                                                 " larger ones it would finish before any busy card. Zero"
+                                                 " leaves every batch to the cards");
+    insertOption(hybridCPUBatch);
+
+    UciOption syntheticNetwork;
+    syntheticNetwork.m_name = QLatin1Literal("SyntheticNetwork");
+    syntheticNetwork.m_type = UciOption::Check;
+    syntheticNetwork.m_default = QLatin1Literal("false");
+    syntheticNetwork.m_value = syntheticNetwork.m_default;
+    syntheticNetwork.m_valueType = QLatin1String("boolean");
+    syntheticNetwork.m_description = QLatin1String("Evaluate with values and policies hashed from the positions"
+                                                   " in place of the weights, to measure the search alone"
+                                                   " without any GPU cards");
+    insertOption(syntheticNetwork);
+
+    UciOption syntheticLatency;
+    syntheticLatency.m_name = QLatin1Literal("SyntheticLatency");
+    syntheticLatency.m_type = UciOption::Spin;
+    syntheticLatency.m_default = QLatin1Literal("0");
+    syntheticLatency.m_value = syntheticLatency.m_default;
+    syntheticLatency.m_valueType = QLatin1String("integer");
+    syntheticLatency.m_min = QLatin1Literal("0");
+    syntheticLatency.m_max = QLatin1Literal("1000000");
+    syntheticLatency.m_description = QLatin1String("Microseconds every batch of the synthetic network takes"
+                                                   " to stand in for the time of the GPU cards");
+    insertOption(syntheticLatency);
+
     UciOption weightsFile;
     weightsFile.m_name = QLatin1Literal("WeightsFile");
     weightsFile.m_type = UciOption::String;
@@ -265,6 +776,32 @@ void Options::addRegularOptions()
     weightsFile.m_valueType = QLatin1String("filepath");
     weightsFile.m_description = QLatin1String("Provides a weights file to use");
     insertOption(weightsFile);
+
+    UciOption smallWeightsFile;
+    smallWeightsFile.m_name = QLatin1Literal("SmallWeightsFile");
+    smallWeightsFile.m_type = UciOption::String;
+    smallWeightsFile.m_default = QString();
+    smallWeightsFile.m_value = smallWeightsFile.m_default;
+    smallWeightsFile.m_valueType = QLatin1String("filepath");
+    smallWeightsFile.m_description = QLatin1String("Provides the weights of a small network that evaluates"
+                                                   " the leaves in place of the one of WeightsFile, which"
+                                                   " evaluates them again once they matter");
+    insertOption(smallWeightsFile);
+
+    UciOption smallNetVisits;
+    smallNetVisits.m_name = QLatin1Literal("SmallNetVisits");
+    smallNetVisits.m_type = UciOption::Spin;
+    smallNetVisits.m_default = QString::number(SearchSettings::smallNetVisits);
+    smallNetVisits.m_value = smallNetVisits.m_default;
+    smallNetVisits.m_valueType = QLatin1String("integer");
+    smallNetVisits.m_min = QLatin1Literal("1");
+    smallNetVisits.m_max = QLatin1Literal("1000000");
+    smallNetVisits.m_description = QLatin1String("Visits at which a node the small network evaluated is"
+                                                 " evaluated again by the one of WeightsFile, as is any"
+                                                 " node of the principal variation");
+    insertOption(smallNetVisits);
+
+    publishSettings();
 }
 
 void Options::addBenchmarkOptions()
@@ -295,26 +832,304 @@ void Options::addBenchmarkOptions()
     nodes.m_valueType = QLatin1String("integer");
     nodes.m_description = QLatin1String("Benchmark search for a specific amount of nodes");
     insertOption(nodes);
+
+    UciOption positions;
+    positions.m_name = QLatin1Literal("BenchmarkPositions");
+    positions.m_type = UciOption::String;
+    positions.m_default = QLatin1String("");
+    positions.m_value = positions.m_default;
+    positions.m_valueType = QLatin1String("filepath");
+    positions.m_description = QLatin1String("A file of fen or epd lines to benchmark in place of the"
+                                            " built in positions");
+    insertOption(positions);
+
+    UciOption warmup;
+    warmup.m_name = QLatin1Literal("BenchmarkWarmup");
+    warmup.m_type = UciOption::Spin;
+    warmup.m_default = QLatin1String("0");
+    warmup.m_value = warmup.m_default;
+    warmup.m_valueType = QLatin1String("integer");
+    warmup.m_min = QLatin1Literal("0");
+    warmup.m_max = QLatin1Literal("100");
+    warmup.m_description = QLatin1String("Searches of each position that are run but not measured");
+    insertOption(warmup);
+
+    UciOption repeats;
+    repeats.m_name = QLatin1Literal("BenchmarkRepeats");
+    repeats.m_type = UciOption::Spin;
+    repeats.m_default = QLatin1String("1");
+    repeats.m_value = repeats.m_default;
+    repeats.m_valueType = QLatin1String("integer");
+    repeats.m_min = QLatin1Literal("1");
+    repeats.m_max = QLatin1Literal("1000");
+    repeats.m_description = QLatin1String("Measured searches of each position");
+    insertOption(repeats);
+
+    UciOption format;
+    format.m_name = QLatin1Literal("BenchmarkFormat");
+    format.m_type = UciOption::Combo;
+    format.m_default = QLatin1Literal("text");
+    format.m_value = format.m_default;
+    format.m_var = { QLatin1String("text"), QLatin1String("json"), QLatin1String("csv") };
+    format.m_description = QLatin1String("The format of the results where json writes one line per"
+                                         " position and one for the totals");
+    insertOption(format);
+
+    UciOption output;
+    output.m_name = QLatin1Literal("BenchmarkOutput");
+    output.m_type = UciOption::String;
+    output.m_default = QLatin1String("");
+    output.m_value = output.m_default;
+    output.m_valueType = QLatin1String("filepath");
+    output.m_description = QLatin1String("The file of json or csv results where empty writes stdout");
+    insertOption(output);
+
+    UciOption sweep;
+    sweep.m_name = QLatin1Literal("BenchmarkSweep");
+    sweep.m_type = UciOption::String;
+    sweep.m_default = QLatin1String("");
+    sweep.m_value = sweep.m_default;
+    sweep.m_valueType = QLatin1String("string");
+    sweep.m_description = QLatin1String("Options and the values to sweep them over like"
+                                        " GPUCores=1,2;MaxBatchSize=256,512, where every combination"
+                                        " searches every position and a scaling table ends the run");
+    insertOption(sweep);
+}
+
+void Options::addReplayOptions()
+{
+    UciOption nodes;
+    nodes.m_name = QLatin1Literal("ReplayNodes");
+    nodes.m_type = UciOption::Check;
+    nodes.m_default = QLatin1Literal("true");
+    nodes.m_value = nodes.m_default;
+    nodes.m_valueType = QLatin1String("boolean");
+    nodes.m_description = QLatin1String("Replay every logged search for the nodes it searched rather"
+                                        " than its time limits");
+    insertOption(nodes);
+
+    UciOption output;
+    output.m_name = QLatin1Literal("ReplayOutput");
+    output.m_type = UciOption::String;
+    output.m_default = QLatin1String("");
+    output.m_value = output.m_default;
+    output.m_valueType = QLatin1String("filepath");
+    output.m_description = QLatin1String("The file of csv results per move where empty only writes"
+                                         " the summary to stderr");
+    insertOption(output);
+
+    UciOption baseline;
+    baseline.m_name = QLatin1Literal("ReplayBaseline");
+    baseline.m_type = UciOption::String;
+    baseline.m_default = QLatin1String("");
+    baseline.m_value = baseline.m_default;
+    baseline.m_valueType = QLatin1String("filepath");
+    baseline.m_description = QLatin1String("The csv results of an earlier replay to compare against in"
+                                           " place of the speeds in the log");
+    insertOption(baseline);
+}
+
+void Options::addServerOptions()
+{
+    UciOption sessions;
+    sessions.m_name = QLatin1Literal("ServerSessions");
+    sessions.m_type = UciOption::Spin;
+    sessions.m_default = QLatin1String("8");
+    sessions.m_value = sessions.m_default;
+    sessions.m_valueType = QLatin1String("integer");
+    sessions.m_min = QLatin1Literal("1");
+    sessions.m_max = QLatin1Literal("256");
+    sessions.m_description = QLatin1String("How many sessions may be open at once, each searching in"
+                                           " that share of the cache");
+    insertOption(sessions);
+}
+
+void Options::addNNServerOptions()
+{
+    UciOption port;
+    port.m_name = QLatin1Literal("NNServerPort");
+    port.m_type = UciOption::Spin;
+    port.m_default = QLatin1Literal("9190");
+    port.m_value = port.m_default;
+    port.m_valueType = QLatin1String("integer");
+    port.m_min = QLatin1Literal("1");
+    port.m_max = QLatin1Literal("65535");
+    port.m_description = QLatin1String("The tcp port the nn server listens on for engines");
+    insertOption(port);
+
+    UciOption batchSize;
+    batchSize.m_name = QLatin1Literal("NNServerBatchSize");
+    batchSize.m_type = UciOption::Spin;
+    batchSize.m_default = QLatin1Literal("512");
+    batchSize.m_value = batchSize.m_default;
+    batchSize.m_valueType = QLatin1String("integer");
+    batchSize.m_min = QLatin1Literal("1");
+    batchSize.m_max = QLatin1Literal("1024");
+    batchSize.m_description = QLatin1String("Positions the nn server gathers from all engines before it"
+                                            " evaluates them as one batch");
+    insertOption(batchSize);
+
+    UciOption wait;
+    wait.m_name = QLatin1Literal("NNServerWaitMsecs");
+    wait.m_type = UciOption::Spin;
+    wait.m_default = QLatin1Literal("2");
+    wait.m_value = wait.m_default;
+    wait.m_valueType = QLatin1String("integer");
+    wait.m_min = QLatin1Literal("0");
+    wait.m_max = QLatin1Literal("100");
+    wait.m_description = QLatin1String("Longest the nn server holds a request back while gathering a"
+                                       " batch");
+    insertOption(wait);
+}
+
+void Options::addSearchServerOptions()
+{
+    UciOption port;
+    port.m_name = QLatin1Literal("SearchServerPort");
+    port.m_type = UciOption::Spin;
+    port.m_default = QLatin1Literal("9191");
+    port.m_value = port.m_default;
+    port.m_valueType = QLatin1String("integer");
+    port.m_min = QLatin1Literal("1");
+    port.m_max = QLatin1Literal("65535");
+    port.m_description = QLatin1String("The tcp port the search server listens on for engines");
+    insertOption(port);
+
+    UciOption address;
+    address.m_name = QLatin1Literal("SearchServerAddress");
+    address.m_type = UciOption::String;
+    address.m_default = QLatin1Literal("127.0.0.1");
+    address.m_value = address.m_default;
+    address.m_valueType = QLatin1String("string");
+    address.m_description = QLatin1String("The address the search server listens on, which is only"
+                                          " this machine unless set to one other machines reach");
+    insertOption(address);
+
+    UciOption sessions;
+    sessions.m_name = QLatin1Literal("SearchServerSessions");
+    sessions.m_type = UciOption::Spin;
+    sessions.m_default = QLatin1String("4");
+    sessions.m_value = sessions.m_default;
+    sessions.m_valueType = QLatin1String("integer");
+    sessions.m_min = QLatin1Literal("1");
+    sessions.m_max = QLatin1Literal("256");
+    sessions.m_description = QLatin1String("How many connections the search server serves at once,"
+                                           " each searching in that share of the cache");
+    insertOption(sessions);
+}
+
+void Options::addPerftOptions()
+{
+    UciOption fen;
+    fen.m_name = QLatin1Literal("PerftFen");
+    fen.m_type = UciOption::String;
+    fen.m_default = QLatin1String("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+    fen.m_value = fen.m_default;
+    fen.m_valueType = QLatin1String("string");
+    fen.m_description = QLatin1String("Perft the move generator from a specific fen");
+    insertOption(fen);
+
+    UciOption depth;
+    depth.m_name = QLatin1Literal("PerftDepth");
+    depth.m_type = UciOption::Spin;
+    depth.m_default = QLatin1String("6");
+    depth.m_value = depth.m_default;
+    depth.m_valueType = QLatin1String("integer");
+    depth.m_min = QLatin1Literal("1");
+    depth.m_max = QLatin1Literal("16");
+    depth.m_description = QLatin1String("Perft to a specific depth");
+    insertOption(depth);
+
+    UciOption threads;
+    threads.m_name = QLatin1Literal("PerftThreads");
+    threads.m_type = UciOption::Spin;
+    threads.m_default = QLatin1String("0");
+    threads.m_value = threads.m_default;
+    threads.m_valueType = QLatin1String("integer");
+    threads.m_min = QLatin1Literal("0");
+    threads.m_max = QLatin1Literal("256");
+    threads.m_description = QLatin1String("Threads to split the root moves across where zero"
+                                          " uses one per core");
+    insertOption(threads);
+
+    UciOption hash;
+    hash.m_name = QLatin1Literal("PerftHashMB");
+    hash.m_type = UciOption::Spin;
+    hash.m_default = QLatin1String("0");
+    hash.m_value = hash.m_default;
+    hash.m_valueType = QLatin1String("integer");
+    hash.m_min = QLatin1Literal("0");
+    hash.m_max = QLatin1Literal("65536");
+    hash.m_description = QLatin1String("Size of the table caching subtree counts where zero"
+                                       " counts every node");
+    insertOption(hash);
 }
 
 bool Options::contains(const QString &name) const
 {
+    QMutexLocker locker(&m_mutex);
     return m_options.contains(name);
 }
 
 UciOption Options::option(const QString &name) const
 {
-    Q_ASSERT(contains(name));
+    QMutexLocker locker(&m_mutex);
+    Q_ASSERT(m_options.contains(name));
     return m_options.value(name);
 }
 
 void Options::setOption(const QString &name, const QString &value)
 {
     // FIXME: Need some validation!
-    Q_ASSERT(contains(name));
-    UciOption o = m_options.value(name);
-    o.setValue(value);
-    m_options.insert(name, o);
+    {
+        QMutexLocker locker(&m_mutex);
+        Q_ASSERT(m_options.contains(name));
+        UciOption o = m_options.value(name);
+        o.setValue(value);
+        m_options.insert(name, o);
+        publishSettings();
+    }
+
+    // The log is asked on every message so it keeps its own copy
+    if (name == QLatin1String("DebugLog"))
+        DebugLog::globalInstance()->setEnabled(value == QLatin1String("true"));
+
+    // Once started the endpoint stays up for the life of the process
+    if (name == QLatin1String("MetricsPort") && value.toUInt()) {
+        if (!Metrics::globalInstance()->listen(quint16(value.toUInt())))
+            qWarning() << "Could not serve metrics on port" << value;
+    }
+}
+
+void Options::publishSettings()
+{
+    // Only the regular options are held so there is nothing to publish before they are added
+    if (!m_options.contains(QLatin1String("MoveOverhead")))
+        return;
+
+    auto value = [this](const char *name) { return m_options.value(QLatin1String(name)).value(); };
+    OptionSettings *settings = new OptionSettings;
+    settings->moveOverhead = value("MoveOverhead").toLongLong();
+    settings->infoInterval = value("InfoInterval").toInt();
+    settings->cpuctF = value("CpuctF").toFloat();
+    settings->cpuctInit = value("CpuctInit").toFloat();
+    settings->cpuctBase = value("CpuctBase").toFloat();
+    settings->featuresOff = SearchSettings::stringToFeatures(value("FeaturesOff"));
+    settings->fpuReduction = value("ReduceFPU").toFloat();
+    settings->policySoftmaxTemp = value("PolicySoftmaxTemp").toFloat();
+    settings->tryPlayoutLimit = value("TryPlayoutLimit").toInt();
+    settings->searchThreads = value("SearchThreads").toInt();
+    settings->minimaxThreads = value("MinimaxThreads").toInt();
+    settings->smallNetVisits = value("SmallNetVisits").toInt();
+    settings->mateSolverMoves = value("MateSolverMoves").toInt();
+    settings->mateSolverReplies = value("MateSolverReplies").toInt();
+    settings->incrementalBackup = value("IncrementalBackup") == QLatin1String("true");
+    settings->adaptiveBatchSize = value("AdaptiveBatchSize") == QLatin1String("true");
+    settings->transpositionGraph = value("TranspositionGraph") == QLatin1String("true");
+    settings->speculativeFill = value("SpeculativeFill") == QLatin1String("true");
+    settings->batchedSelection = value("BatchedSelection") == QLatin1String("true");
+    settings->treeCompaction = value("TreeCompaction") == QLatin1String("true");
+    m_retiredSettings.append(m_settings.exchange(settings, std::memory_order_acq_rel));
 }
 
 void Options::insertOption(const UciOption &option)
@@ -327,3 +1142,147 @@ QVector<UciOption> Options::options() const
 {
     return m_optionsInOrder;
 }
+
+void Options::addAnalyzeOptions()
+{
+    UciOption input;
+    input.m_name = QLatin1Literal("AnalyzeInput");
+    input.m_type = UciOption::String;
+    input.m_default = QLatin1String("");
+    input.m_value = input.m_default;
+    input.m_valueType = QLatin1String("filepath");
+    input.m_description = QLatin1String("The epd or pgn file to analyze where empty reads stdin");
+    insertOption(input);
+
+    UciOption output;
+    output.m_name = QLatin1Literal("AnalyzeOutput");
+    output.m_type = UciOption::String;
+    output.m_default = QLatin1String("");
+    output.m_value = output.m_default;
+    output.m_valueType = QLatin1String("filepath");
+    output.m_description = QLatin1String("The file the results are written to as json lines where"
+                                         " empty writes stdout");
+    insertOption(output);
+
+    UciOption format;
+    format.m_name = QLatin1Literal("AnalyzeFormat");
+    format.m_type = UciOption::Combo;
+    format.m_default = QLatin1Literal("auto");
+    format.m_value = format.m_default;
+    format.m_var = { QLatin1String("auto"), QLatin1String("epd"), QLatin1String("pgn") };
+    format.m_description = QLatin1String("The format of the input where auto takes a .pgn suffix for"
+                                         " pgn and anything else for epd");
+    insertOption(format);
+
+    UciOption nodes;
+    nodes.m_name = QLatin1Literal("AnalyzeNodes");
+    nodes.m_type = UciOption::Spin;
+    nodes.m_default = QLatin1String("800");
+    nodes.m_value = nodes.m_default;
+    nodes.m_valueType = QLatin1String("integer");
+    nodes.m_min = QLatin1Literal("1");
+    nodes.m_max = QLatin1Literal("1000000000");
+    nodes.m_description = QLatin1String("Search each position for a specific amount of nodes");
+    insertOption(nodes);
+
+    UciOption concurrency;
+    concurrency.m_name = QLatin1Literal("AnalyzeConcurrency");
+    concurrency.m_type = UciOption::Spin;
+    concurrency.m_default = QLatin1String("8");
+    concurrency.m_value = concurrency.m_default;
+    concurrency.m_valueType = QLatin1String("integer");
+    concurrency.m_min = QLatin1Literal("1");
+    concurrency.m_max = QLatin1Literal("256");
+    concurrency.m_description = QLatin1String("How many positions are searched at the same time");
+    insertOption(concurrency);
+}
+
+void Options::addSelfPlayOptions()
+{
+    UciOption games;
+    games.m_name = QLatin1Literal("SelfPlayGames");
+    games.m_type = UciOption::Spin;
+    games.m_default = QLatin1String("1000");
+    games.m_value = games.m_default;
+    games.m_valueType = QLatin1String("integer");
+    games.m_min = QLatin1Literal("1");
+    games.m_max = QLatin1Literal("100000000");
+    games.m_description = QLatin1String("How many games to play");
+    insertOption(games);
+
+    UciOption concurrency;
+    concurrency.m_name = QLatin1Literal("SelfPlayConcurrency");
+    concurrency.m_type = UciOption::Spin;
+    concurrency.m_default = QLatin1String("256");
+    concurrency.m_value = concurrency.m_default;
+    concurrency.m_valueType = QLatin1String("integer");
+    concurrency.m_min = QLatin1Literal("1");
+    concurrency.m_max = QLatin1Literal("4096");
+    concurrency.m_description = QLatin1String("How many games are played at the same time");
+    insertOption(concurrency);
+
+    UciOption nodes;
+    nodes.m_name = QLatin1Literal("SelfPlayNodes");
+    nodes.m_type = UciOption::Spin;
+    nodes.m_default = QLatin1String("400");
+    nodes.m_value = nodes.m_default;
+    nodes.m_valueType = QLatin1String("integer");
+    nodes.m_min = QLatin1Literal("1");
+    nodes.m_max = QLatin1Literal("1000000000");
+    nodes.m_description = QLatin1String("Search each move for a specific amount of nodes");
+    insertOption(nodes);
+
+    UciOption randomPlies;
+    randomPlies.m_name = QLatin1Literal("SelfPlayRandomPlies");
+    randomPlies.m_type = UciOption::Spin;
+    randomPlies.m_default = QLatin1String("6");
+    randomPlies.m_value = randomPlies.m_default;
+    randomPlies.m_valueType = QLatin1String("integer");
+    randomPlies.m_min = QLatin1Literal("0");
+    randomPlies.m_max = QLatin1Literal("100");
+    randomPlies.m_description = QLatin1String("How many uniformly random moves start each game");
+    insertOption(randomPlies);
+
+    UciOption maxPlies;
+    maxPlies.m_name = QLatin1Literal("SelfPlayMaxPlies");
+    maxPlies.m_type = UciOption::Spin;
+    maxPlies.m_default = QLatin1String("450");
+    maxPlies.m_value = maxPlies.m_default;
+    maxPlies.m_valueType = QLatin1String("integer");
+    maxPlies.m_min = QLatin1Literal("1");
+    maxPlies.m_max = QLatin1Literal("10000");
+    maxPlies.m_description = QLatin1String("Games reaching this many plies are adjudicated as a draw");
+    insertOption(maxPlies);
+
+    UciOption combinedBatch;
+    combinedBatch.m_name = QLatin1Literal("SelfPlayCombinedBatch");
+    combinedBatch.m_type = UciOption::Spin;
+    combinedBatch.m_default = QLatin1String("256");
+    combinedBatch.m_value = combinedBatch.m_default;
+    combinedBatch.m_valueType = QLatin1String("integer");
+    combinedBatch.m_min = QLatin1Literal("0");
+    combinedBatch.m_max = QLatin1Literal("65536");
+    combinedBatch.m_description = QLatin1String("How many positions of all the games are gathered for one"
+                                                " evaluation where 0 evaluates each game on its own");
+    insertOption(combinedBatch);
+
+    UciOption openings;
+    openings.m_name = QLatin1Literal("SelfPlayOpenings");
+    openings.m_type = UciOption::String;
+    openings.m_default = QLatin1String("");
+    openings.m_value = openings.m_default;
+    openings.m_valueType = QLatin1String("filepath");
+    openings.m_description = QLatin1String("A file of fens or epds the games start from in turn where"
+                                           " empty starts from the initial position");
+    insertOption(openings);
+
+    UciOption output;
+    output.m_name = QLatin1Literal("SelfPlayOutput");
+    output.m_type = UciOption::String;
+    output.m_default = QLatin1String("");
+    output.m_value = output.m_default;
+    output.m_valueType = QLatin1String("filepath");
+    output.m_description = QLatin1String("The file the games are appended to as json lines where empty"
+                                         " writes stdout");
+    insertOption(output);
+}
@@ -21,10 +21,39 @@
 #ifndef OPTIONS_H
 #define OPTIONS_H
 
+#include <QMutex>
 #include <QtGlobal>
 
+#include <atomic>
+
+#include "search.h"
 #include "uciengine.h"
 
+// The options read on every search and every tick of the clock, typed once when they are set so
+// that reading them takes no lock and makes no strings
+struct OptionSettings {
+    qint64 moveOverhead = 0;
+    int infoInterval = 0;
+    float cpuctF = 0.0f;
+    float cpuctInit = 0.0f;
+    float cpuctBase = 0.0f;
+    SearchSettings::Features featuresOff;
+    float fpuReduction = 0.0f;
+    float policySoftmaxTemp = 1.0f;
+    int tryPlayoutLimit = 0;
+    int searchThreads = 0;
+    int minimaxThreads = 0;
+    int smallNetVisits = 0;
+    int mateSolverMoves = 0;
+    int mateSolverReplies = 0;
+    bool incrementalBackup = false;
+    bool adaptiveBatchSize = false;
+    bool transpositionGraph = false;
+    bool speculativeFill = false;
+    bool batchedSelection = false;
+    bool treeCompaction = false;
+};
+
 class Options {
 public:
     static Options *globalInstance();
@@ -33,15 +62,29 @@ public:
     UciOption option(const QString &name) const;
     void setOption(const QString &name, const QString &value);
     QVector<UciOption> options() const;
+    // Published anew whenever an option is set, with those handed out before kept for the life
+    // of the process so a reader holding one never sees it go
+    const OptionSettings &settings() const { return *m_settings.load(std::memory_order_acquire); }
     void addRegularOptions();
     void addBenchmarkOptions();
+    void addReplayOptions();
+    void addServerOptions();
+    void addNNServerOptions();
+    void addSearchServerOptions();
+    void addPerftOptions();
+    void addAnalyzeOptions();
+    void addSelfPlayOptions();
 
 private:
     Options();
     ~Options();
     void insertOption(const UciOption &option);
+    void publishSettings(); // with the mutex held or before any other thread reads the options
     QVector<UciOption> m_optionsInOrder;
     QMap<QString, UciOption> m_options;
+    mutable QMutex m_mutex; // the values are read by threads loading in the background
+    std::atomic<const OptionSettings*> m_settings;
+    QVector<const OptionSettings*> m_retiredSettings;
     friend class MyOptions;
 };
 
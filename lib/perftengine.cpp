@@ -0,0 +1,152 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "perftengine.h"
+
+#include <QElapsedTimer>
+#include <QTextStream>
+
+#include <thread>
+#include <vector>
+
+#include "notation.h"
+#include "options.h"
+#include "search.h"
+#include "uciengine.h"
+
+PerftEngine::PerftEngine()
+    : m_tableMask(0)
+{
+    m_fen = Options::globalInstance()->option("PerftFen").value();
+    m_depth = Options::globalInstance()->option("PerftDepth").value().toInt();
+    m_threads = Options::globalInstance()->option("PerftThreads").value().toInt();
+    if (m_threads <= 0)
+        m_threads = int(qMax(1u, std::thread::hardware_concurrency()));
+    SearchSettings::chess960 = Options::globalInstance()->option("UCI_Chess960").value() == "true";
+
+    // Round down to a power of two so the hash can be masked into an index
+    const quint64 bytes = quint64(Options::globalInstance()->option("PerftHashMB").value().toInt()) * 1024 * 1024;
+    quint64 entries = 1;
+    while (entries * 2 * sizeof(Entry) <= bytes)
+        entries *= 2;
+    if (entries * sizeof(Entry) <= bytes) {
+        m_table.reset(new Entry[entries]());
+        m_tableMask = entries - 1;
+    }
+}
+
+PerftEngine::~PerftEngine()
+{
+}
+
+bool PerftEngine::probe(quint64 key, quint64 *nodes) const
+{
+    const Entry &entry = m_table[key & m_tableMask];
+    const quint64 n = entry.nodes.load(std::memory_order_relaxed);
+    if ((entry.check.load(std::memory_order_relaxed) ^ n) != key)
+        return false;
+    *nodes = n;
+    return true;
+}
+
+void PerftEngine::store(quint64 key, quint64 nodes)
+{
+    Entry &entry = m_table[key & m_tableMask];
+    entry.check.store(key ^ nodes, std::memory_order_relaxed);
+    entry.nodes.store(nodes, std::memory_order_relaxed);
+}
+
+quint64 PerftEngine::perft(const Game &game, const Game::Position &position, int depth)
+{
+    if (depth <= 0)
+        return 1;
+
+    if (depth == 1)
+        return quint64(position.legalMoveCount());
+
+    // The same position at a different depth has a different count
+    const quint64 key = position.positionHash() ^ (quint64(depth) * 0x9E3779B97F4A7C15ull);
+    quint64 nodes = 0;
+    if (m_table && probe(key, &nodes))
+        return nodes;
+
+    Move moves[Game::Position::MaximumMoves];
+    const int count = position.legalMoves(moves);
+    for (int i = 0; i < count; ++i) {
+        Game childGame = game;
+        Game::Position childPosition = position; // copy
+        const bool success = childGame.makeMove(moves[i], &childPosition);
+        Q_ASSERT(success);
+        Q_UNUSED(success);
+        nodes += perft(childGame, childPosition, depth - 1);
+    }
+
+    if (m_table)
+        store(key, nodes);
+    return nodes;
+}
+
+void PerftEngine::run()
+{
+    const StandaloneGame root(m_fen);
+    qCInfo(UciOutput).noquote() << "Perft" << root.stateOfGameToFen() << "depth" << m_depth
+        << "threads" << m_threads << "hash" << (m_table ? m_tableMask + 1 : 0) << "entries";
+
+    Move moves[Game::Position::MaximumMoves];
+    const int count = root.position().legalMoves(moves);
+    QVector<quint64> results(count, 0);
+    quint64 *counts = results.data(); // detached once here rather than from every thread
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // Each thread takes the next root move until there are none left
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        for (int i = next++; i < count; i = next++) {
+            Game childGame = root;
+            Game::Position childPosition = root.position(); // copy
+            childGame.makeMove(moves[i], &childPosition);
+            counts[i] = perft(childGame, childPosition, m_depth - 1);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < qMin(m_threads, count); ++i)
+        threads.emplace_back(work);
+    work();
+    for (std::thread &thread : threads)
+        thread.join();
+
+    const qint64 msecs = qMax(qint64(1), timer.elapsed());
+    quint64 total = 0;
+    for (int i = 0; i < count; ++i) {
+        qCInfo(UciOutput).noquote() << Notation::moveToString(moves[i], Chess::Computer) + ":" << results[i];
+        total += results[i];
+    }
+
+    QString out;
+    QTextStream stream(&out);
+    stream << "Perft \t\ttime "
+           << msecs << "ms, \t"
+           << total << " nodes, \t"
+           << quint64(total * 1000 / quint64(msecs)) << " nps";
+    qCInfo(UciOutput).noquote() << out;
+}
@@ -0,0 +1,61 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef PERFTENGINE_H
+#define PERFTENGINE_H
+
+#include <QtGlobal>
+#include <QVector>
+
+#include <atomic>
+#include <memory>
+
+#include "game.h"
+
+// Counts the leaves of the move tree to measure the speed of the move generator. The root moves
+// are split across threads, the last ply is counted in bulk and subtrees can be cached by hash.
+class PerftEngine {
+public:
+    PerftEngine();
+    ~PerftEngine();
+
+    void run();
+
+    // Thread safe once the engine is constructed
+    quint64 perft(const Game &game, const Game::Position &position, int depth);
+
+private:
+    // Checked by xor so that a torn write from another thread reads as a miss
+    struct Entry {
+        std::atomic<quint64> check;
+        std::atomic<quint64> nodes;
+    };
+
+    bool probe(quint64 key, quint64 *nodes) const;
+    void store(quint64 key, quint64 nodes);
+
+    QString m_fen;
+    int m_depth;
+    int m_threads;
+    std::unique_ptr<Entry[]> m_table;
+    quint64 m_tableMask;
+};
+
+#endif // PERFTENGINE_H
@@ -0,0 +1,240 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "replay.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QTextStream>
+
+#include <cstdio>
+
+#include "options.h"
+
+bool ReplayMove::readOutput(const QString &line)
+{
+    const QStringList tokens = line.split(' ', QString::SkipEmptyParts);
+    if (tokens.isEmpty())
+        return true;
+    if (tokens.first() == QLatin1String("bestmove"))
+        return false;
+    if (tokens.first() != QLatin1String("info") || tokens.count() < 3)
+        return true;
+
+    if (tokens.at(1) == QLatin1String("string")) {
+        if (tokens.at(2) == QLatin1String("stageTimes"))
+            stageTimes = line.section(' ', 3, -1, QString::SectionSkipEmpty);
+        return true;
+    }
+
+    // The averages are over the whole game rather than this search
+    if (tokens.at(1) == QLatin1String("averages"))
+        return true;
+
+    for (int i = 1; i < tokens.count() - 1; ++i) {
+        const QString &key = tokens.at(i);
+        const QString &value = tokens.at(i + 1);
+        if (key == QLatin1String("nodes"))
+            nodes = value.toULongLong();
+        else if (key == QLatin1String("time"))
+            time = value.toLongLong();
+        else if (key == QLatin1String("nps"))
+            nps = value.toUInt();
+        else if (key == QLatin1String("batchSize"))
+            batchSize = value.toUInt();
+        else if (key == QLatin1String("pv"))
+            break; // the rest are moves
+    }
+    return true;
+}
+
+Replay::Replay()
+    : m_outputFile(Options::globalInstance()->option("ReplayOutput").value()),
+    m_baselineFile(Options::globalInstance()->option("ReplayBaseline").value()),
+    m_searching(false),
+    m_finished(false)
+{
+}
+
+bool Replay::rewriteGo(QString *go, QQueue<QString> *lines, QString *waitingOnOutput)
+{
+    // Look ahead through the output of the logged search for the nodes it ended up with, where
+    // the only input it may have had is to stop it or to end its ponder
+    ReplayMove logged;
+    logged.go = *go;
+    int taken = 0;
+    bool foundBestMove = false;
+    for (const QString &entry : *lines) {
+        ++taken;
+        if (entry.startsWith(QLatin1String("Input: "))) {
+            const QString input = entry.mid(7);
+            if (input != QLatin1String("stop") && input != QLatin1String("ponderhit"))
+                return false;
+            continue;
+        }
+
+        const QString line = entry.startsWith(QLatin1String("Output: ")) ? entry.mid(8) : entry;
+        if (!logged.readOutput(line.trimmed())) {
+            foundBestMove = true;
+            break;
+        }
+    }
+
+    if (!foundBestMove || !logged.nodes)
+        return false;
+
+    while (taken--)
+        lines->dequeue();
+
+    QString rewritten = QString("go nodes %0").arg(logged.nodes);
+    const int searchMoves = go->indexOf(QLatin1String(" searchmoves "));
+    if (searchMoves != -1)
+        rewritten.append(go->mid(searchMoves));
+    *go = rewritten;
+    *waitingOnOutput = QLatin1String("bestmove");
+
+    m_logged.append(logged);
+    m_current = ReplayMove();
+    m_current.go = logged.go;
+    m_searching = true;
+    return true;
+}
+
+void Replay::readOutput(const QString &output)
+{
+    if (!m_searching)
+        return;
+
+    const QStringList lines = output.split('\n', QString::SkipEmptyParts);
+    for (const QString &line : lines) {
+        if (m_current.readOutput(line))
+            continue;
+        m_replayed.append(m_current);
+        m_searching = false;
+        break;
+    }
+}
+
+void Replay::finish()
+{
+    if (m_finished)
+        return;
+    m_finished = true;
+
+    if (!m_outputFile.isEmpty()) {
+        QFile file(m_outputFile);
+        if (file.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate)) {
+            QTextStream stream(&file);
+            stream << "move,go,nodes,time,nps,batchSize,loggedTime,loggedNps,stageTimes" << endl;
+            for (int i = 0; i < m_replayed.count(); ++i) {
+                const ReplayMove &move = m_replayed.at(i);
+                const ReplayMove &logged = m_logged.at(i);
+                stream << i + 1 << ","
+                       << move.go << ","
+                       << move.nodes << ","
+                       << move.time << ","
+                       << move.nps << ","
+                       << move.batchSize << ","
+                       << logged.time << ","
+                       << logged.nps << ","
+                       << move.stageTimes << endl;
+            }
+        } else {
+            qWarning() << "Could not write the replay results to" << m_outputFile;
+        }
+    }
+
+    QVector<ReplayMove> baseline = m_logged;
+    if (!m_baselineFile.isEmpty()) {
+        baseline.clear();
+        if (!readResults(m_baselineFile, &baseline))
+            qWarning() << "Could not read the replay baseline" << m_baselineFile;
+    }
+
+    fprintf(stderr, "replay %s\n", compare(m_replayed, baseline).toLatin1().constData());
+}
+
+bool Replay::readResults(const QString &fileName, QVector<ReplayMove> *moves)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+
+    QTextStream stream(&file);
+    stream.readLine(); // the header
+    while (!stream.atEnd()) {
+        const QStringList fields = stream.readLine().split(',');
+        if (fields.count() < 6)
+            return false;
+        ReplayMove move;
+        move.go = fields.at(1);
+        move.nodes = fields.at(2).toULongLong();
+        move.time = fields.at(3).toLongLong();
+        move.nps = fields.at(4).toUInt();
+        move.batchSize = fields.at(5).toUInt();
+        if (fields.count() > 8)
+            move.stageTimes = fields.at(8);
+        moves->append(move);
+    }
+    return true;
+}
+
+QString Replay::compare(const QVector<ReplayMove> &moves, const QVector<ReplayMove> &baseline)
+{
+    const int n = qMin(moves.count(), baseline.count());
+    quint64 nodes = 0;
+    qint64 time = 0;
+    quint64 baselineNodes = 0;
+    qint64 baselineTime = 0;
+    int slowest = -1;
+    double slowestRatio = 0;
+    for (int i = 0; i < n; ++i) {
+        const ReplayMove &move = moves.at(i);
+        const ReplayMove &base = baseline.at(i);
+        nodes += move.nodes;
+        time += move.time;
+        baselineNodes += base.nodes;
+        baselineTime += base.time;
+        if (!move.nps || !base.nps)
+            continue;
+        const double ratio = double(move.nps) / base.nps;
+        if (slowest == -1 || ratio < slowestRatio) {
+            slowest = i;
+            slowestRatio = ratio;
+        }
+    }
+
+    const double nps = nodes * 1000.0 / qMax(qint64(1), time);
+    const double baselineNps = baselineNodes * 1000.0 / qMax(qint64(1), baselineTime);
+    QString out;
+    QTextStream stream(&out);
+    stream << "moves " << n
+           << " nodes " << nodes
+           << " time " << time
+           << " nps " << qRound64(nps)
+           << " baseline nodes " << baselineNodes
+           << " time " << baselineTime
+           << " nps " << qRound64(baselineNps)
+           << " speedup " << (baselineNps > 0 ? nps / baselineNps : 0.0);
+    if (slowest != -1)
+        stream << " slowest move " << slowest + 1 << " at " << slowestRatio;
+    stream.flush();
+    return out;
+}
@@ -0,0 +1,68 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <QQueue>
+#include <QString>
+#include <QVector>
+
+// The speed of one search as the uci output reports it
+struct ReplayMove {
+    QString go;
+    quint64 nodes = 0;
+    qint64 time = 0; // msecs
+    quint32 nps = 0;
+    quint32 batchSize = 0;
+    QString stageTimes;
+
+    // Takes what an info line of the search tells, false once the line is its bestmove
+    bool readOutput(const QString &line);
+};
+
+// Replays the searches of a debug log deterministically by turning each go into one for the
+// nodes the logged search ended up with, and records the speed of every move against the log or
+// against the results of an earlier replay
+class Replay {
+public:
+    Replay(); // from the replay options
+
+    // Rewrites a logged go and takes the lines of the log up to and including its bestmove, which
+    // is then the output to wait on. False where the log does not tell how many nodes it searched.
+    bool rewriteGo(QString *go, QQueue<QString> *lines, QString *waitingOnOutput);
+    void readOutput(const QString &output);
+    void finish(); // writes the results and the comparison once the log is done
+
+    static bool readResults(const QString &fileName, QVector<ReplayMove> *moves);
+    // Totals of both and the ratio of the speeds over the moves they share
+    static QString compare(const QVector<ReplayMove> &moves, const QVector<ReplayMove> &baseline);
+
+private:
+    QString m_outputFile;
+    QString m_baselineFile;
+    QVector<ReplayMove> m_logged;
+    QVector<ReplayMove> m_replayed;
+    ReplayMove m_current;
+    bool m_searching; // a rewritten go whose bestmove has not come yet
+    bool m_finished;
+};
+
+#endif // REPLAY_H
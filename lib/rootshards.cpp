@@ -0,0 +1,241 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "rootshards.h"
+
+#include <algorithm>
+
+#include "cache.h"
+#include "history.h"
+#include "node.h"
+#include "searchengine.h"
+#include "tree.h"
+
+// The children the shards search are reconsidered at most this often so that they are not moved
+// back and forth while the visits of two children are close
+static const qint64 s_reassignMsecs = 1000;
+
+// Binds the history and cache of a shard to the calling thread for as long as it lives, so the
+// tree of a stopped shard can be worked on from the main search worker
+class ShardBinding {
+public:
+    ShardBinding(History *history, Cache *cache)
+        : m_history(History::globalInstance()),
+        m_cache(Cache::globalInstance())
+    {
+        History::setThreadInstance(history);
+        Cache::setThreadInstance(cache);
+    }
+
+    ~ShardBinding()
+    {
+        History::setThreadInstance(m_history);
+        Cache::setThreadInstance(m_cache);
+    }
+
+private:
+    History *m_history;
+    Cache *m_cache;
+};
+
+RootShards::RootShards(int shards)
+    : m_isActive(false)
+{
+    // Every shard, the main search worker with the process wide cache included, searches in an
+    // equal share of the cache the options size
+    const quint64 positions = Cache::positionsFromOptions() / quint64(shards);
+    for (int i = 1; i < shards; ++i) {
+        Shard *shard = new Shard;
+        shard->history = new History;
+        shard->cache = new Cache;
+        shard->cache->reset(positions);
+        shard->tree = new Tree;
+        shard->worker = new WorkerThread(shard->history, shard->cache);
+        shard->worker->worker->setShard(i, shards);
+        shard->worker->thread.setObjectName(QString("search shard %0").arg(i));
+        shard->worker->thread.start();
+
+        // Both of these are called on the thread of the shard
+        SearchWorker *worker = shard->worker->worker;
+        QObject::connect(worker, &SearchWorker::searchWorkerStopped, [this, shard]() {
+            QMutexLocker locker(&m_mutex);
+            shard->isSearching = false;
+            shard->isStopping = false;
+            m_stopped.wakeAll();
+        });
+        QObject::connect(worker, &SearchWorker::requestStop, [worker](int, bool isEarlyExit) {
+            if (!isEarlyExit)
+                worker->stopSearch();
+        });
+        m_shards.append(shard);
+    }
+}
+
+RootShards::~RootShards()
+{
+    stop();
+    for (Shard *shard : m_shards) {
+        delete shard->worker;
+        {
+            ShardBinding binding(shard->history, shard->cache);
+            delete shard->tree;
+        }
+        delete shard->cache;
+        delete shard->history;
+    }
+    qDeleteAll(m_shards);
+}
+
+void RootShards::start(const History *history)
+{
+    QMutexLocker locker(&m_mutex);
+    m_games = history->games();
+    m_isActive = !m_games.isEmpty();
+    m_assigned.invalidate();
+    for (Shard *shard : m_shards) {
+        shard->move = Move();
+        shard->nextMove = Move();
+    }
+}
+
+void RootShards::stop()
+{
+    QMutexLocker locker(&m_mutex);
+    m_isActive = false;
+    for (Shard *shard : m_shards) {
+        shard->nextMove = Move();
+        stopSearch(shard);
+    }
+
+    // The trees of the shards are only touched again once their searches are done with them
+    for (Shard *shard : m_shards) {
+        while (shard->isSearching)
+            m_stopped.wait(&m_mutex);
+    }
+}
+
+void RootShards::merge(Node *root)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_isActive)
+        return;
+
+    for (Shard *shard : m_shards) {
+        // The root of a shard is the child it searches so its value is that of the child
+        const quint32 visits = shard->worker->worker->rootVisits();
+        if (!shard->move.isValid() || visits <= shard->merged)
+            continue;
+
+        for (Node *child = root->firstChild(); child; child = child->nextSibling()) {
+            if (!(child->game().lastMove() == shard->move))
+                continue;
+            if (!child->isExact())
+                child->mergeRemoteVisits(visits - shard->merged, shard->worker->worker->rootQValue());
+            break;
+        }
+        shard->merged = visits;
+    }
+
+    // Shards that have stopped go on to the child they were moved to
+    for (Shard *shard : m_shards) {
+        if (!shard->isSearching && shard->nextMove.isValid()) {
+            shard->move = shard->nextMove;
+            shard->nextMove = Move();
+            startSearch(shard);
+        }
+    }
+
+    if (!m_assigned.isValid() || m_assigned.hasExpired(s_reassignMsecs)) {
+        assign(root);
+        m_assigned.restart();
+    }
+}
+
+void RootShards::assign(Node *root)
+{
+    // The shards belong on the most visited children that are still open
+    QVector<Node*> children;
+    for (Node *child = root->firstChild(); child; child = child->nextSibling()) {
+        if (child->visits() && !child->isExact())
+            children.append(child);
+    }
+    std::stable_sort(children.begin(), children.end(), [](const Node *a, const Node *b) {
+        return a->visits() > b->visits();
+    });
+
+    QVector<Move> open;
+    for (int i = 0; i < children.count() && i < m_shards.count(); ++i)
+        open.append(children.at(i)->game().lastMove());
+
+    // Shards that are on or headed for one of those stay put, but one that stopped by itself with
+    // its tree full is started over
+    QVector<Shard*> free;
+    for (Shard *shard : m_shards) {
+        const Move target = shard->nextMove.isValid() ? shard->nextMove
+            : shard->isSearching ? shard->move : Move();
+        if (target.isValid() && open.removeOne(target))
+            continue;
+        free.append(shard);
+    }
+
+    for (Shard *shard : free) {
+        shard->nextMove = open.isEmpty() ? Move() : open.takeFirst();
+        if (!shard->isSearching && shard->nextMove.isValid()) {
+            shard->move = shard->nextMove;
+            shard->nextMove = Move();
+            startSearch(shard);
+        } else {
+            stopSearch(shard);
+        }
+    }
+}
+
+void RootShards::startSearch(Shard *shard)
+{
+    // The shard is stopped so its history and tree are ours to set up for the child, and every
+    // search starts on a fresh tree so the visits of its root are all its own
+    {
+        ShardBinding binding(shard->history, shard->cache);
+        shard->history->clear();
+        for (const StandaloneGame &game : m_games)
+            shard->history->addGame(game);
+        StandaloneGame game = m_games.last();
+        game.makeMove(shard->move);
+        shard->history->addGame(game);
+        shard->tree->clearRoot(false /*resumeIfPossible*/);
+    }
+
+    shard->isSearching = true;
+    shard->isStopping = false;
+    shard->merged = 0;
+    shard->worker->worker->clearRootInfo();
+
+    Search search;
+    search.infinite = true;
+    emit shard->worker->startWorker(shard->tree, ++shard->searchId, search, SearchInfo());
+}
+
+void RootShards::stopSearch(Shard *shard)
+{
+    if (!shard->isSearching || shard->isStopping)
+        return;
+    shard->isStopping = true;
+    shard->worker->worker->stopSearch();
+}
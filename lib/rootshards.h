@@ -0,0 +1,80 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef ROOTSHARDS_H
+#define ROOTSHARDS_H
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QVector>
+#include <QWaitCondition>
+
+#include "game.h"
+
+class Cache;
+class History;
+class Node;
+class Tree;
+class WorkerThread;
+
+// Splits the search of the root across more search workers in this process, one for every numa
+// node of the machine. Every shard has a search worker with gpu workers of its own on its share of
+// the devices, and a tree in a cache of its own so that the nodes it makes are first touched by its
+// own threads and stay on their numa node. A shard searches the subtree of one of the most visited
+// children of the root and its visits and value are merged into that child as the search goes, so
+// the tree of the main search worker holds the root, its first plies and the combined result.
+class RootShards {
+public:
+    RootShards(int shards); // counting the main search worker
+    ~RootShards();
+
+    int count() const { return m_shards.count() + 1; }
+
+    void start(const History *history); // the game up to the root of the search
+    void stop(); // returns once every shard has stopped
+    void merge(Node *root); // on the search thread in between batches
+
+private:
+    struct Shard {
+        History *history = nullptr;
+        Cache *cache = nullptr;
+        Tree *tree = nullptr;
+        WorkerThread *worker = nullptr;
+        Move move;              // of the child being searched or invalid
+        Move nextMove;          // to search once the current search has stopped
+        bool isSearching = false;
+        bool isStopping = false;
+        int searchId = 0;
+        quint32 merged = 0;     // of the visits of the root of the shard
+    };
+
+    void startSearch(Shard *shard);
+    void stopSearch(Shard *shard);
+    void assign(Node *root);
+
+    QVector<Shard*> m_shards;
+    QVector<StandaloneGame> m_games; // up to the root of the search
+    QElapsedTimer m_assigned;
+    bool m_isActive;
+    QMutex m_mutex; // the state of the shards is shared with their threads stopping
+    QWaitCondition m_stopped;
+};
+
+#endif // ROOTSHARDS_H
@@ -33,9 +33,21 @@ float SearchSettings::openingTimeFactor = 2.15f;
 float SearchSettings::earlyExitFactor = 0.72f;
 int SearchSettings::tryPlayoutLimit = 136;
 int SearchSettings::vldMax = 10000;
+int SearchSettings::searchThreads = 1;
+int SearchSettings::minimaxThreads = 1;
+int SearchSettings::smallNetVisits = 16;
+int SearchSettings::mateSolverMoves = 0;
+int SearchSettings::mateSolverReplies = 4;
 QString SearchSettings::weightsFile = QString();
 bool SearchSettings::debugInfo = true;
 bool SearchSettings::chess960 = false;
+bool SearchSettings::pruneWhenFull = false;
+bool SearchSettings::incrementalBackup = false;
+bool SearchSettings::adaptiveBatchSize = false;
+bool SearchSettings::transpositionGraph = false;
+bool SearchSettings::speculativeFill = false;
+bool SearchSettings::batchedSelection = false;
+bool SearchSettings::treeCompaction = false;
 SearchSettings::Features SearchSettings::featuresOff = SearchSettings::None;
 
 SearchSettings::Features SearchSettings::stringToFeatures(const QString &string)
@@ -79,6 +91,7 @@ void SearchInfo::calculateSpeeds(qint64 t)
     nps = qRound(qreal(nodes) / qMax(qint64(1), t) * 1000.0);
     rawnps = qRound(qreal(workerInfo.nodesVisited) / qMax(qint64(1), t) * 1000.0);
     nnnps = qRound(qreal(workerInfo.nodesEvaluated) / qMax(qint64(1), t) * 1000.0);
+    refinednnnps = qRound(qreal(workerInfo.nodesRefined) / qMax(qint64(1), t) * 1000.0);
 }
 
 SearchInfo SearchInfo::nodeAndBatchDiff(const SearchInfo &a, const SearchInfo &b)
@@ -92,6 +105,17 @@ SearchInfo SearchInfo::nodeAndBatchDiff(const SearchInfo &a, const SearchInfo &b
     diff.workerInfo.numberOfBatches = a.workerInfo.numberOfBatches - b.workerInfo.numberOfBatches;
     diff.workerInfo.nodesCacheHits = a.workerInfo.nodesCacheHits - b.workerInfo.nodesCacheHits;
     diff.workerInfo.nodesTBHits = a.workerInfo.nodesTBHits - b.workerInfo.nodesTBHits;
+    diff.workerInfo.nodesPruned = a.workerInfo.nodesPruned - b.workerInfo.nodesPruned;
+    diff.workerInfo.nodesExactOrCached = a.workerInfo.nodesExactOrCached - b.workerInfo.nodesExactOrCached;
+    diff.workerInfo.nodesRefined = a.workerInfo.nodesRefined - b.workerInfo.nodesRefined;
+    diff.workerInfo.nodesSpeculated = a.workerInfo.nodesSpeculated - b.workerInfo.nodesSpeculated;
+    diff.workerInfo.nodesSpeculatedUsed = a.workerInfo.nodesSpeculatedUsed - b.workerInfo.nodesSpeculatedUsed;
+    diff.workerInfo.nodesAbandoned = a.workerInfo.nodesAbandoned - b.workerInfo.nodesAbandoned;
+    diff.workerInfo.playoutCollisions = a.workerInfo.playoutCollisions - b.workerInfo.playoutCollisions;
+    diff.workerInfo.batchesTryExhausted = a.workerInfo.batchesTryExhausted - b.workerInfo.batchesTryExhausted;
+    diff.workerInfo.batchesVldExhausted = a.workerInfo.batchesVldExhausted - b.workerInfo.batchesVldExhausted;
+    diff.workerInfo.batchTarget = a.workerInfo.batchTarget - b.workerInfo.batchTarget;
+    diff.workerInfo.batchFilled = a.workerInfo.batchFilled - b.workerInfo.batchFilled;
     return diff;
 }
 
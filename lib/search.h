@@ -61,9 +61,21 @@ struct SearchSettings {
     static float earlyExitFactor;
     static int tryPlayoutLimit;
     static int vldMax;
+    static int searchThreads;
+    static int minimaxThreads;
+    static int smallNetVisits;
+    static int mateSolverMoves;
+    static int mateSolverReplies;
     static QString weightsFile;
     static bool debugInfo;
     static bool chess960;
+    static bool pruneWhenFull;
+    static bool incrementalBackup;
+    static bool adaptiveBatchSize;
+    static bool transpositionGraph;
+    static bool speculativeFill;
+    static bool batchedSelection;
+    static bool treeCompaction;
     static Features featuresOff;
 
     static Features stringToFeatures(const QString&);
@@ -81,10 +93,21 @@ struct WorkerInfo {
     quint32 numberOfBatches = 0;
     quint64 nodesCacheHits = 0;
     quint64 nodesTBHits = 0;
+    quint64 nodesPruned = 0;
+    quint64 nodesExactOrCached = 0;     // playouts backed up without the network
+    quint64 nodesRefined = 0;           // evaluated again by the large network
+    quint64 nodesSpeculated = 0;        // evaluated ahead to fill a batch the playouts left short
+    quint64 nodesSpeculatedUsed = 0;    // of those that a playout reached later
+    quint64 nodesAbandoned = 0;         // left unscored as their batch was not started at the stop
+    quint64 playoutCollisions = 0;      // descents that ran into a node already playing out
+    quint32 batchesTryExhausted = 0;    // filled short as the try playout limit ran out
+    quint32 batchesVldExhausted = 0;    // filled short as the virtual loss distance ran out
+    quint64 batchTarget = 0;            // positions asked for over all the batches filled
+    quint64 batchFilled = 0;            // positions sent to the network over those
+    quint32 batchSizeSetpoint = 0;
     quint32 searchId = 0;
     bool hasTarget = false;
     bool targetReached = false;
-    QString threadId;
 };
 
 struct SearchInfo {
@@ -98,11 +121,13 @@ struct SearchInfo {
     QString pv;
     quint32 rawnps = 0;
     quint32 nnnps = 0;
+    quint32 refinednnnps = 0;
     QString bestMove;
     QString ponderMove;
     bool isResume = false;
     bool isDTZ = false;
     bool bestIsMostVisited = true;
+    qint64 visitLead = 0; // of the best move over the runner up, counting the visits reused
     WorkerInfo workerInfo;
     quint32 games = 0;
 
@@ -110,4 +135,26 @@ struct SearchInfo {
     static SearchInfo nodeAndBatchDiff(const SearchInfo &a, const SearchInfo &b);
 };
 
+// What the search thread reports written without allocating, so that it can be published through
+// a lock free slot and turned into a SearchInfo by whichever thread reads it
+struct InfoSnapshot {
+    enum { MaximumPv = 64 };
+    quint32 depth = 0;
+    quint32 seldepth = 0;
+    quint64 nodes = 0;
+    float score = 0;
+    int pvDepth = 0;
+    int pvLength = 0;
+    quint64 updates = 0; // the ones not partial so far, so a reader can tell it missed one
+    qint64 visitLead = 0;
+    bool isCheckMate = false;
+    bool isResume = false;
+    bool bestIsMostVisited = true;
+    bool hasPonderMove = false;
+    Move bestMove;
+    Move ponderMove;
+    Move pv[MaximumPv];
+    WorkerInfo workerInfo;
+};
+
 #endif // SEARCH_H
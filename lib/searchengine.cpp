@@ -20,44 +20,139 @@
 
 #include "searchengine.h"
 
+#include <QHash>
+#include <QSet>
 #include <QtMath>
 
+#include <chrono>
+#include <cstring>
+#include <type_traits>
+
 #include "cache.h"
 #include "game.h"
+#include "history.h"
+#include "metrics.h"
 #include "move.h"
 #include "node.h"
 #include "nn.h"
 #include "notation.h"
 #include "options.h"
+#include "stagetimes.h"
+#include "tb.h"
+#include "threadaffinity.h"
+#include "trace.h"
 #include "tree.h"
 
 //#define DEBUG_EVAL
 //#define DEBUG_VALIDATE_TREE
 //#define USE_DUMMY_NODES
 
-void actualFetchFromNN(Batch *batch)
+// With PruneWhenFull the tree is pruned back to the low water mark once the node cache reaches the
+// high water mark, spending at most this many milliseconds doing so
+static const float s_pruneHighWater = 0.95f;
+static const float s_pruneLowWater = 0.85f;
+static const qint64 s_pruneMsecs = 50;
+
+static qint64 steadyNsecs()
 {
-    Computation *computation = NeuralNet::globalInstance()->acquireNetwork();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// How long a batch waits for those of other searches to join it before going on its own
+static const qint64 s_combineWaitMsecs = 2;
+
+// The small network where one is loaded, whose results the large one refines once they matter
+static NeuralNet *leafNetwork()
+{
+    NeuralNet *small = NeuralNet::smallInstance();
+    return small->isLoaded() ? small : NeuralNet::globalInstance();
+}
+
+// Each batch is encoded with the game history it belongs to, or that of the caller when null. The
+// caller may have a computation of the leaf network bound to it, or else one is acquired.
+static void fetchFromNN(const QVector<Batch*> &batches, const QVector<History*> &histories,
+    Computation *bound)
+{
+    int positions = 0;
+    for (const Batch *batch : batches)
+        positions += batch->count();
+
+    NeuralNet *nn = leafNetwork();
+    const bool isSmall = nn != NeuralNet::globalInstance();
+    // Small batches go to an idle processor next to the gpus even where a computation is bound
+    Computation *computation = bound ? nn->acquireProcessor(positions) : nullptr;
+    const bool isBound = bound && !computation;
+    if (!computation)
+        computation = bound ? bound : nn->acquireNetwork(positions);
     Q_ASSERT(computation);
     computation->reset();
-    for (int index = 0; index < batch->count(); ++index) {
-        Node *node = batch->at(index);
-        computation->addPositionToEvaluate(node);
+
+    // Only positions neither the nn cache nor the nn store have seen go to the network. The
+    // results of the large network are taken over those of the small one wherever there are any.
+    NNCache *cache = NeuralNet::globalInstance()->cache();
+    NNStore *store = NeuralNet::globalInstance()->store();
+    NNCache *smallCache = isSmall ? nn->cache() : nullptr;
+    History *history = History::globalInstance();
+    Batch evaluating;
+    QVector<quint64> keys;
+    evaluating.reserve(positions);
+    keys.reserve(positions);
+
+    // Identical inputs within the batches are evaluated once and the others take their result
+    QHash<quint64, int> evaluatingIndex;
+    QVector<QPair<Node*, int>> duplicates;
+    for (int i = 0; i < batches.count(); ++i) {
+        if (histories.at(i))
+            History::setThreadInstance(histories.at(i));
+        TIME_STAGE(Encode);
+        const Batch *batch = batches.at(i);
+        for (int index = 0; index < batch->count(); ++index) {
+            Node *node = batch->at(index);
+            const quint64 key = computation->encodePosition(node);
+            if (cache->fetch(key, node))
+                continue;
+            if (store->fetch(key, node)) {
+                cache->store(key, node);
+                continue;
+            }
+            if (smallCache && smallCache->fetch(key, node)) {
+                if (node->hasPotentials())
+                    node->position()->potentials()->setSmallValue(node->positionQValue());
+                continue;
+            }
+            const auto evaluated = evaluatingIndex.constFind(key);
+            if (evaluated != evaluatingIndex.constEnd()) {
+                duplicates.append(qMakePair(node, evaluated.value()));
+                continue;
+            }
+            evaluatingIndex.insert(key, evaluating.count());
+            computation->addEncodedPosition(node);
+            evaluating.append(node);
+            keys.append(key);
+        }
+    }
+    History::setThreadInstance(history);
+
+    if (evaluating.isEmpty()) {
+        if (!isBound)
+            nn->releaseNetwork(computation);
+        return;
     }
 
 #if defined(DEBUG_EVAL)
-    qDebug() << "fetching batch of size" << batch->count() << QThread::currentThread()->objectName();
+    qDebug() << "fetching batch of size" << evaluating.count() << QThread::currentThread()->objectName();
 #endif
     computation->evaluate();
 
-    Q_ASSERT(computation->positions() == batch->count());
-    if (computation->positions() != batch->count()) {
+    Q_ASSERT(computation->positions() == evaluating.count());
+    if (computation->positions() != evaluating.count()) {
         qCritical() << "NN index mismatch!";
         return;
     }
 
-    for (int index = 0; index < batch->count(); ++index) {
-        Node *node = batch->at(index);
+    for (int index = 0; index < evaluating.count(); ++index) {
+        Node *node = evaluating.at(index);
         Q_ASSERT(node->hasPotentials());
         node->setPositionQValue(-computation->qVal(index));
         if (node->hasPotentials()) {
@@ -65,134 +160,572 @@ void actualFetchFromNN(Batch *batch)
             Q_ASSERT(node->position()->refs() == 1);
             computation->setPVals(index, node);
         }
+        if (isSmall) {
+            // Neither the cache nor the store of the large network take what the small one says
+            if (node->hasPotentials())
+                node->position()->potentials()->setSmallValue(node->positionQValue());
+            smallCache->store(keys.at(index), node);
+            continue;
+        }
+        cache->store(keys.at(index), node);
+        store->store(keys.at(index), node);
+    }
+
+    for (const QPair<Node*, int> &duplicate : duplicates) {
+        Node *node = duplicate.first;
+        node->setPositionQValue(-computation->qVal(duplicate.second));
+        if (node->hasPotentials())
+            computation->setPVals(duplicate.second, node);
+        if (isSmall && node->hasPotentials())
+            node->position()->potentials()->setSmallValue(node->positionQValue());
+    }
+    if (isBound)
+        nn->recordEvaluation(computation);
+    else
+        nn->releaseNetwork(computation);
+}
+
+void actualFetchFromNN(Batch *batch, Computation *bound = nullptr)
+{
+    if (BatchCombiner::globalInstance()->isEnabled())
+        BatchCombiner::globalInstance()->fetch(batch, bound);
+    else
+        fetchFromNN(QVector<Batch*>() << batch, QVector<History*>() << nullptr, bound);
+}
+
+Q_GLOBAL_STATIC(BatchCombiner, s_batchCombiner)
+BatchCombiner *BatchCombiner::globalInstance()
+{
+    return s_batchCombiner();
+}
+
+void BatchCombiner::setTarget(int positions, int maximum)
+{
+    QMutexLocker locker(&m_mutex);
+    m_maximum = qMax(1, maximum);
+    m_target = qMin(positions, m_maximum);
+}
+
+QVector<BatchCombiner::Submission*> BatchCombiner::take()
+{
+    // Oldest first and never more than the networks take, but always at least one
+    QVector<Submission*> taken;
+    int positions = 0;
+    while (!m_pending.isEmpty()) {
+        Submission *submission = m_pending.first();
+        const int count = submission->batch->count();
+        if (!taken.isEmpty() && positions + count > m_maximum)
+            break;
+        m_pending.removeFirst();
+        submission->isTaken = true;
+        taken.append(submission);
+        positions += count;
     }
-    NeuralNet::globalInstance()->releaseNetwork(computation);
+    m_pendingPositions -= positions;
+    return taken;
 }
 
-void actualMinimaxTree(Tree *tree, WorkerInfo *info)
+void BatchCombiner::fetch(Batch *batch, Computation *bound)
 {
+    Submission submission { batch, History::globalInstance(), false /*isTaken*/, false /*isDone*/ };
+
+    QMutexLocker locker(&m_mutex);
+    m_pending.append(&submission);
+    m_pendingPositions += batch->count();
+    QElapsedTimer timer;
+    timer.start();
+    while (!submission.isDone) {
+        const qint64 waited = timer.elapsed();
+        if (!submission.isTaken && (m_pendingPositions >= m_target || waited >= s_combineWaitMsecs)) {
+            const QVector<Submission*> taken = take();
+            QVector<Batch*> batches;
+            QVector<History*> histories;
+            for (const Submission *s : taken) {
+                batches.append(s->batch);
+                histories.append(s->history);
+            }
+
+            locker.unlock();
+            fetchFromNN(batches, histories, bound);
+            locker.relock();
+
+            for (Submission *s : taken)
+                s->isDone = true;
+            m_condition.wakeAll();
+            continue;
+        }
+
+        // The searches in flight rarely all line up so a full batch is not waited on for long
+        if (submission.isTaken)
+            m_condition.wait(&m_mutex);
+        else
+            m_condition.wait(&m_mutex, (unsigned long)(s_combineWaitMsecs - waited));
+    }
+}
+
+// Subtrees with fewer visits are backed up by a single thread of a concurrent minimax
+static const quint32 s_minimaxSplitVisits = 1 << 14;
+
+void actualMinimaxTree(Tree *tree, Batch *dirtyLeaves, WorkerInfo *info, PlayoutPool *pool)
+{
+    TIME_STAGE(Minimax);
+
     // Gather minimax scores;
     double newScores = 0;
     quint32 newVisits = 0;
     const quint64 originalEvaluated = info->nodesEvaluated;
-    Node::minimax(tree->embodiedRoot(), 0 /*depth*/, info, &newScores, &newVisits);
+    if (SearchSettings::incrementalBackup) {
+        Node::minimaxPaths(*dirtyLeaves, info);
+    } else if (SearchSettings::minimaxThreads > 1) {
+        Node::minimaxConcurrently(tree->embodiedRoot(), info, &newScores, &newVisits,
+            s_minimaxSplitVisits, [pool](const std::function<void()> &job) {
+                pool->run(SearchSettings::minimaxThreads, job);
+            });
+    } else {
+        Node::minimax(tree->embodiedRoot(), 0 /*depth*/, info, &newScores, &newVisits);
+    }
+    dirtyLeaves->clear();
 #if defined(DEBUG_VALIDATE_TREE)
     Node::validateTree(tree->embodiedRoot());
 #endif
     info->numberOfBatches += info->nodesEvaluated > originalEvaluated ? 1 : 0;
 }
 
-void actualMinimaxBatch(Batch *batch, Tree *tree, WorkerInfo *info)
+void actualMinimaxBatch(Batch *batch, Tree *tree, Batch *dirtyLeaves, WorkerInfo *info,
+    PlayoutPool *pool)
 {
     for (int index = 0; index < batch->count(); ++index) {
         Node *node = batch->at(index);
         node->backPropagateDirty();
     }
+    dirtyLeaves->append(*batch);
+
+    actualMinimaxTree(tree, dirtyLeaves, info, pool);
+}
+
+// Tries before parking, the second half of them yielding the processor
+static const int s_spinsBeforeParking = 256;
+
+BatchRing::BatchRing()
+    : m_enqueuePosition(0),
+    m_dequeuePosition(0),
+    m_sleepers(0)
+{
+    for (int i = 0; i < Capacity; ++i) {
+        m_cells[i].sequence.store(quint64(i), std::memory_order_relaxed);
+        m_cells[i].batch = nullptr;
+    }
+}
 
-    actualMinimaxTree(tree, info);
+bool BatchRing::tryPush(Batch *batch)
+{
+    Cell *cell = nullptr;
+    quint64 position = m_enqueuePosition.load(std::memory_order_relaxed);
+    forever {
+        cell = &m_cells[position & (Capacity - 1)];
+        const quint64 sequence = cell->sequence.load(std::memory_order_acquire);
+        const qint64 difference = qint64(sequence) - qint64(position);
+        if (!difference) {
+            if (m_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+        } else if (difference < 0) {
+            return false; // full
+        } else {
+            position = m_enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->batch = batch;
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+Batch *BatchRing::tryPop()
+{
+    Cell *cell = nullptr;
+    quint64 position = m_dequeuePosition.load(std::memory_order_relaxed);
+    forever {
+        cell = &m_cells[position & (Capacity - 1)];
+        const quint64 sequence = cell->sequence.load(std::memory_order_acquire);
+        const qint64 difference = qint64(sequence) - qint64(position + 1);
+        if (!difference) {
+            if (m_dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+        } else if (difference < 0) {
+            return nullptr; // empty
+        } else {
+            position = m_dequeuePosition.load(std::memory_order_relaxed);
+        }
+    }
+
+    Batch *batch = cell->batch;
+    cell->sequence.store(position + Capacity, std::memory_order_release);
+    return batch;
+}
+
+void BatchRing::push(Batch *batch)
+{
+    // There are never more batches than the capacity so this does not actually loop
+    while (!tryPush(batch))
+        std::this_thread::yield();
+
+    // Pairs with the fence in pop so that either the sleeper sees the batch or we see the sleeper
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleepers.load(std::memory_order_relaxed)) {
+        QMutexLocker locker(&m_mutex);
+        m_condition.wakeOne();
+    }
+}
+
+Batch *BatchRing::pop(const std::atomic<bool> *stop)
+{
+    for (int i = 0; i < s_spinsBeforeParking; ++i) {
+        if (stop && *stop)
+            return nullptr;
+        if (Batch *batch = tryPop())
+            return batch;
+        if (i >= s_spinsBeforeParking / 2)
+            std::this_thread::yield();
+    }
+
+    QMutexLocker locker(&m_mutex);
+    m_sleepers.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    Batch *batch = nullptr;
+    while (!(stop && *stop) && !(batch = tryPop()))
+        m_condition.wait(locker.mutex());
+    m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+    return batch;
+}
+
+void BatchRing::wakeAll()
+{
+    QMutexLocker locker(&m_mutex);
+    m_condition.wakeAll();
+}
+
+int BatchRing::count() const
+{
+    // Read the dequeue side first so that the difference never goes negative for long
+    const quint64 dequeued = m_dequeuePosition.load(std::memory_order_relaxed);
+    const quint64 enqueued = m_enqueuePosition.load(std::memory_order_relaxed);
+    return enqueued > dequeued ? int(enqueued - dequeued) : 0;
+}
+
+static_assert(std::is_trivially_copyable<InfoSnapshot>::value, "the info slot copies snapshots as bytes");
+
+void InfoSlot::publish(const InfoSnapshot &snapshot)
+{
+    const quint64 sequence = m_sequence.load(std::memory_order_relaxed);
+    m_sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&m_snapshot, &snapshot, sizeof(InfoSnapshot));
+    m_sequence.store(sequence + 2, std::memory_order_release);
+}
+
+bool InfoSlot::read(InfoSnapshot *snapshot, quint64 *sequence) const
+{
+    forever {
+        const quint64 before = m_sequence.load(std::memory_order_acquire);
+        if (before == *sequence)
+            return false;
+        if (before & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        memcpy(snapshot, &m_snapshot, sizeof(InfoSnapshot));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_sequence.load(std::memory_order_relaxed) == before) {
+            *sequence = before;
+            return true;
+        }
+    }
 }
 
 Batch *GuardedBatchQueue::acquireIn()
 {
-    QMutexLocker locker(&m_inMutex);
-    while (m_inQueue.isEmpty() && !m_stop)
-        m_inCondition.wait(locker.mutex());
-    if (m_stop)
-        return nullptr;
-    return m_inQueue.takeFirst();
+    TIME_STAGE(QueueWait);
+    return m_inQueue.pop(&m_stop);
 }
 
 void GuardedBatchQueue::releaseIn(Batch *batch)
 {
-    QMutexLocker locker(&m_inMutex);
-    m_inQueue.append(batch);
-    m_inCondition.wakeOne();
+    m_inQueue.push(batch);
+}
+
+Batch *GuardedBatchQueue::takeBackIn()
+{
+    return m_inQueue.tryPop();
+}
+
+Batch *GuardedBatchQueue::acquireExpanded()
+{
+    TIME_STAGE(QueueWait);
+    return m_expandedQueue.pop(&m_stop);
+}
+
+void GuardedBatchQueue::releaseExpanded(Batch *batch)
+{
+    m_expandedQueue.push(batch);
 }
 
 Batch *GuardedBatchQueue::acquireOut()
 {
-    QMutexLocker locker(&m_outMutex);
-    while (m_outQueue.isEmpty())
-        m_outCondition.wait(locker.mutex());
-    return m_outQueue.takeFirst();
+    TIME_STAGE(QueueWait);
+    return m_outQueue.pop();
 }
 
 void GuardedBatchQueue::releaseOut(Batch *batch)
 {
-    QMutexLocker locker(&m_outMutex);
-    m_outQueue.append(batch);
-    m_outCondition.wakeOne();
+    m_outQueue.push(batch);
 }
 
 void GuardedBatchQueue::stop()
 {
-    QMutexLocker locker(&m_inMutex);
     m_stop = true;
-    m_inCondition.wakeAll();
+    m_inQueue.wakeAll();
+    m_expandedQueue.wakeAll();
 }
 
-GPUWorker::GPUWorker(GuardedBatchQueue *queue, int maximumBatchSize,
+PlayoutPool::~PlayoutPool()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stop = true;
+        m_startCondition.wakeAll();
+    }
+    for (std::thread &thread : m_threads)
+        thread.join();
+}
+
+void PlayoutPool::run(int threads, const std::function<void()> &job)
+{
+    const int helpers = threads - 1;
+    {
+        QMutexLocker locker(&m_mutex);
+        while (int(m_threads.size()) < helpers)
+            m_threads.emplace_back(&PlayoutPool::work, this);
+        m_job = job;
+        m_history = History::globalInstance();
+        m_cache = Cache::globalInstance();
+        m_wanted = helpers;
+        m_running = helpers;
+        ++m_generation;
+        m_startCondition.wakeAll();
+    }
+
+    job();
+
+    QMutexLocker locker(&m_mutex);
+    while (m_running)
+        m_doneCondition.wait(locker.mutex());
+    m_job = nullptr;
+}
+
+void PlayoutPool::work()
+{
+    quint64 generation = 0;
+    QMutexLocker locker(&m_mutex);
+    forever {
+        while (!m_stop && (generation == m_generation || !m_wanted))
+            m_startCondition.wait(locker.mutex());
+        if (m_stop)
+            return;
+
+        generation = m_generation;
+        --m_wanted;
+        const std::function<void()> job = m_job;
+        History::setThreadInstance(m_history);
+        Cache::setThreadInstance(m_cache);
+        locker.unlock();
+        job();
+        locker.relock();
+        if (!--m_running)
+            m_doneCondition.wakeOne();
+    }
+}
+
+static void generatePotentials(Batch *batch)
+{
+    TIME_STAGE(GeneratePotentials);
+    for (int index = 0; index < batch->count(); ++index)
+        batch->at(index)->generatePotentials();
+}
+
+ExpansionWorker::ExpansionWorker(GuardedBatchQueue *queue, History *history, Cache *cache,
     QObject *parent)
     : QThread(parent),
-    m_queue(queue)
+    m_queue(queue),
+    m_history(history),
+    m_cache(cache)
 {
-    m_batchForEvaluating.reserve(maximumBatchSize);
 }
 
-GPUWorker::~GPUWorker()
+ExpansionWorker::~ExpansionWorker()
 {
 }
 
-void GPUWorker::run()
+void ExpansionWorker::run()
 {
+    History::setThreadInstance(m_history);
+    Cache::setThreadInstance(m_cache);
     forever {
         Batch *batch = m_queue->acquireIn(); // will block until a batch is ready
         if (!batch)
             return;
 
-        // Clear our internal queue
-        m_batchForEvaluating.clear();
+        generatePotentials(batch);
+        m_queue->releaseExpanded(batch);
+    }
+}
+
+GPUWorker::GPUWorker(GuardedBatchQueue *queue, int maximumBatchSize, int device, History *history,
+    Cache *cache, QObject *parent)
+    : QThread(parent),
+    m_queue(queue),
+    m_device(device),
+    m_network(nullptr),
+    m_computation(nullptr),
+    m_bindingGeneration(0),
+    m_history(history),
+    m_cache(cache),
+    m_nsecsPerBatch(0),
+    m_batches(0)
+{
+    m_batchForEvaluating.reserve(maximumBatchSize);
+}
 
-        // Generate potentials
-        for (int index = 0; index < batch->count(); ++index) {
-            Node *node = batch->at(index);
-            node->generatePotentials();
-            if (!node->isExact())
-                m_batchForEvaluating.append(node);
+GPUWorker::~GPUWorker()
+{
+}
+
+Computation *GPUWorker::boundComputation()
+{
+    // Checked before every batch without a lock as the networks can be switched between searches
+    // and the threads that acquire them batch by batch can ask for the bound ones back
+    NeuralNet *nn = leafNetwork();
+    if (m_computation && (nn != m_network || !nn->isBound(m_computation)))
+        unbind();
+    if (!m_computation && (nn != m_network || m_bindingGeneration != nn->bindingGeneration())) {
+        m_network = nn;
+        m_bindingGeneration = nn->bindingGeneration();
+        m_computation = nn->bindNetwork(m_device);
+    }
+    return m_computation;
+}
+
+void GPUWorker::unbind()
+{
+    // The networks are deleted along with their computations when the process exits first
+    if (m_computation && NeuralNet::globalInstance() && NeuralNet::smallInstance())
+        m_network->unbindNetwork(m_computation);
+    m_computation = nullptr;
+}
+
+void GPUWorker::run()
+{
+    History::setThreadInstance(m_history);
+    Cache::setThreadInstance(m_cache);
+    ThreadAffinity::globalInstance()->applyToCurrentThread(
+        Options::globalInstance()->option("GPUWorkerCPUs").value(),
+        Options::globalInstance()->option("GPUWorkerPriority").value(), m_device);
+    forever {
+        // Without an expansion stage we generate the potentials ourselves
+        const bool isExpanded = m_queue->hasExpansionStage();
+        Batch *batch = isExpanded ? m_queue->acquireExpanded() : m_queue->acquireIn(); // will block until a batch is ready
+        if (!batch) {
+            unbind();
+            return;
         }
 
-        actualFetchFromNN(&m_batchForEvaluating);
+        QElapsedTimer timer;
+        timer.start();
+        ++m_batches;
+
+        {
+            TRACE_BATCH("prepare", m_batches, batch->count());
+            if (!isExpanded)
+                generatePotentials(batch);
+
+            // Clear our internal queue
+            m_batchForEvaluating.clear();
+            for (int index = 0; index < batch->count(); ++index) {
+                Node *node = batch->at(index);
+                if (!node->isExact())
+                    m_batchForEvaluating.append(node);
+            }
+        }
+
+        {
+            TRACE_BATCH("evaluate", m_batches, m_batchForEvaluating.count());
+            actualFetchFromNN(&m_batchForEvaluating, boundComputation());
+        }
 
-        for (int index = 0; index < m_batchForEvaluating.count(); ++index) {
-            Node *node = m_batchForEvaluating.at(index);
-            Node::sortByPVals(*node->position()->potentials());
+        {
+            TRACE_BATCH("sort", m_batches, m_batchForEvaluating.count());
+            for (int index = 0; index < m_batchForEvaluating.count(); ++index) {
+                Node *node = m_batchForEvaluating.at(index);
+                TIME_STAGE(SetPVals);
+                Node::sortByPVals(*node->position()->potentials(), 2); // what the next playout reads
+            }
         }
 
+        const qint64 nsecs = timer.nsecsElapsed();
+        const qint64 average = m_nsecsPerBatch;
+        m_nsecsPerBatch = average ? (9 * average + nsecs) / 10 : nsecs;
         m_queue->releaseOut(batch);
     }
 }
 
-SearchWorker::SearchWorker(QObject *parent)
+SearchWorker::SearchWorker(History *history, Cache *cache, QObject *parent)
     : QObject(parent),
       m_totalPlayouts(0),
       m_moveNode(nullptr),
       m_searchId(0),
       m_currentBatchSize(0),
       m_estimatedNodes(std::numeric_limits<quint32>::max()),
+      m_softDeadline(std::numeric_limits<qint64>::max()),
+      m_hardDeadline(std::numeric_limits<qint64>::max()),
+      m_infoInterval(0),
       m_tree(nullptr),
+      m_history(history),
+      m_cache(cache),
+      m_batchCount(0),
+      m_batchesInFlight(0),
+      m_selectionNsecs(0),
+      m_playoutBatches(0),
+      m_minimaxBatches(0),
+      m_distributed(nullptr),
+      m_rootShards(nullptr),
+      m_shardIndex(0),
+      m_shardCount(1),
+      m_rootVisits(0),
+      m_rootQValue(0.0f),
+      m_pruneExhausted(false),
       m_stop(true)
 {
+    Metrics::globalInstance()->addQueue(&m_queue);
 }
 
 SearchWorker::~SearchWorker()
 {
+    // The metrics may already be gone when the process exits
+    if (Metrics *metrics = Metrics::globalInstance())
+        metrics->removeQueue(&m_queue);
     m_queue.stop(); // blocks and sets the queue to stop all workers
+    for (ExpansionWorker *w : m_expansionWorkers)
+        w->wait();
+    qDeleteAll(m_expansionWorkers);
+    m_expansionWorkers.clear();
     for (GPUWorker *w : m_gpuWorkers)
         w->wait();
     qDeleteAll(m_gpuWorkers);
     m_gpuWorkers.clear();
     qDeleteAll(m_batchPool);
     m_batchPool.clear();
+    delete m_distributed;
+    delete m_rootShards;
 }
 
 void SearchWorker::stopSearch()
@@ -202,6 +735,27 @@ void SearchWorker::stopSearch()
 
 void SearchWorker::startSearch(Tree *tree, int searchId, const Search &s, const SearchInfo &info)
 {
+    // Every search is of the game in the history of the engine that started it
+    History::setThreadInstance(m_history);
+    Cache::setThreadInstance(m_cache);
+
+    // The main search worker splits the root into as many shards as asked for, keeping them for
+    // as long as their number stays the same
+    if (!m_cache) {
+        const int shards = Options::globalInstance()->option("SearchShards").value().toInt();
+        if (!m_rootShards || m_rootShards->count() != shards) {
+            delete m_rootShards;
+            m_rootShards = shards > 1 ? new RootShards(shards) : nullptr;
+        }
+        if (m_gpuWorkers.isEmpty())
+            m_shardCount = qMax(1, shards);
+    }
+
+    const QVector<int> devices = shardDevices();
+    ThreadAffinity::globalInstance()->applyToCurrentThread(
+        Options::globalInstance()->option("SearchThreadCPUs").value(),
+        Options::globalInstance()->option("SearchThreadPriority").value(), devices.first());
+
     // Reset state
     m_tree = tree;
     m_searchId = searchId;
@@ -209,31 +763,84 @@ void SearchWorker::startSearch(Tree *tree, int searchId, const Search &s, const
     m_search = s;
     m_currentInfo = info;
     m_currentInfo.workerInfo.searchId = searchId;
+    m_snapshot = InfoSnapshot();
+    m_infoInterval = Options::globalInstance()->settings().infoInterval;
+#if defined(USE_STAGE_TIMES)
+    StageTimes::globalInstance()->reset();
+#endif
     Node *root = m_tree->embodiedRoot();
     const Node *best = root->bestChild();
     m_moveNode = best;
     m_estimatedNodes = std::numeric_limits<quint32>::max();
+    m_pruneExhausted = false;
+    m_dirtyLeaves.clear();
     m_stop = false;
 
+    // Every search appends the batches it fills to the selection trace if one is asked for
+    const QString traceFile = Options::globalInstance()->option("SelectionTrace").value();
+    if (!traceFile.isEmpty()) {
+        if (m_selectionTrace.open(traceFile))
+            m_selectionTrace.beginSearch(quint32(searchId), root->toFen());
+        else
+            qWarning() << "Could not open the selection trace" << traceFile;
+    }
+
     if (m_gpuWorkers.isEmpty()) {
-        // Start as many gpu worker threads as we have available networks and create a batch pool
-        // to satisfy those workers
+        // Start the gpu worker threads, by default two for every network of our shard so one can
+        // encode while the other evaluates, and create a batch pool to satisfy those workers
         const int maximumBatchSize = Options::globalInstance()->option("MaxBatchSize").value().toInt();
-        const int numberOfGPUCores = Options::globalInstance()->option("GPUCores").value().toInt() * 2;
+        int numberOfWorkers = Options::globalInstance()->option("GPUWorkers").value().toInt();
+        if (!numberOfWorkers)
+            numberOfWorkers = devices.count() * 2;
+        m_batchesInFlight = Options::globalInstance()->option("BatchesInFlight").value().toInt();
         m_queue.setMaximumBatchSize(maximumBatchSize);
-        for (int i = 0; i < numberOfGPUCores; ++i) {
-            GPUWorker *worker = new GPUWorker(&m_queue, maximumBatchSize);
+        for (int i = 0; i < numberOfWorkers; ++i) {
+            GPUWorker *worker = new GPUWorker(&m_queue, maximumBatchSize, devices.at(i % devices.count()),
+                m_history, m_cache);
             worker->setObjectName(QString("gpuworker %0").arg(i));
             worker->start();
             m_gpuWorkers.append(worker);
-            Batch *batch = new Batch;
-            batch->reserve(maximumBatchSize);
-            m_batchPool.append(batch);
         }
+
+        // Optionally generate potentials and probe tablebases in a stage of its own so the gpu
+        // workers only encode and evaluate
+        const int numberOfExpansionWorkers = Options::globalInstance()->option("ExpansionThreads").value().toInt();
+        m_queue.setExpansionStage(numberOfExpansionWorkers > 0);
+        for (int i = 0; i < numberOfExpansionWorkers; ++i) {
+            ExpansionWorker *worker = new ExpansionWorker(&m_queue, m_history, m_cache);
+            worker->setObjectName(QString("expansionworker %0").arg(i));
+            worker->start();
+            m_expansionWorkers.append(worker);
+        }
+    }
+
+    // Until the stages have been measured the automatic depth keeps one batch in reserve
+    const int batchCount = targetBatchCount();
+    while (m_batchCount < batchCount) {
+        Batch *batch = new Batch;
+        batch->reserve(m_queue.maximumBatchSize());
+        m_batchPool.append(batch);
+        ++m_batchCount;
     }
 
     m_currentBatchSize = m_queue.maximumBatchSize();
 
+    // Split the root across the search servers if there are any, keeping the connections for as
+    // long as the servers stay the same
+    QStringList servers;
+    for (const QString &server : Options::globalInstance()->option("SearchServers").value().split(',')) {
+        if (!server.trimmed().isEmpty())
+            servers.append(server.trimmed());
+    }
+    if (!m_distributed || m_distributed->addresses() != servers) {
+        delete m_distributed;
+        m_distributed = servers.isEmpty() ? nullptr : new DistributedSearch(servers);
+    }
+    if (m_distributed)
+        m_distributed->start(m_history);
+    if (m_rootShards)
+        m_rootShards->start(m_history);
+
     // Start the info timer
     m_timer.restart();
 
@@ -243,20 +850,134 @@ void SearchWorker::startSearch(Tree *tree, int searchId, const Search &s, const
 
 void SearchWorker::minimaxBatch(Batch *batch, Tree *tree)
 {
-    actualMinimaxBatch(batch, tree, &m_currentInfo.workerInfo);
+    ++m_minimaxBatches;
+    finishSpeculation(batch);
+    TRACE_BATCH("minimax", m_minimaxBatches, batch->count());
+    actualMinimaxBatch(batch, tree, &m_dirtyLeaves, &m_currentInfo.workerInfo, &m_playoutPool);
+    if (NeuralNet::smallInstance()->isLoaded())
+        refineEvaluations(batch);
     processWorkerInfo();
 }
 
+void SearchWorker::refineEvaluations(const Batch *batch)
+{
+    // Visits only grew on the paths of the batch so those are where a node can have just reached
+    // enough of them, while the principal variation is looked at in full as its best child changes
+    QVector<Node*> refining;
+    QSet<const Node*> seen;
+    auto consider = [&](Node *node, bool isPrincipalVariation) {
+        const Node::Position *position = node->position();
+        if (position && position->potentials()->hasSmallValue() && position->refs() == 1
+            && !node->isExact() && node->visits()
+            && (isPrincipalVariation || node->visits() >= quint32(SearchSettings::smallNetVisits))
+            && !refining.contains(node)) {
+            refining.append(node);
+        }
+    };
+    for (int index = 0; index < batch->count(); ++index) {
+        for (Node *node = batch->at(index); node && !seen.contains(node); node = node->parent()) {
+            seen.insert(node);
+            consider(node, false /*isPrincipalVariation*/);
+        }
+    }
+    for (Node *node = m_tree->embodiedRoot(); node; node = node->bestChild())
+        consider(node, true /*isPrincipalVariation*/);
+    if (refining.isEmpty())
+        return;
+
+    // On the search thread so the tree holds still, and past the caches whose policy has to be in
+    // the order the potentials were generated
+    NeuralNet *nn = NeuralNet::globalInstance();
+    const int maximum = qMax(1, m_queue.maximumBatchSize());
+    for (int first = 0; first < refining.count(); first += maximum) {
+        const int count = qMin(maximum, refining.count() - first);
+        Computation *computation = nn->acquireNetwork(count);
+        computation->reset();
+        for (int index = first; index < first + count; ++index) {
+            computation->encodePosition(refining.at(index));
+            computation->addEncodedPosition(refining.at(index));
+        }
+        computation->evaluate();
+        for (int index = 0; index < count; ++index) {
+            Node *node = refining.at(first + index);
+            computation->setPVals(index, node);
+            node->refineEvaluation(-computation->qVal(index));
+        }
+        nn->releaseNetwork(computation);
+    }
+    m_currentInfo.workerInfo.nodesRefined += quint64(refining.count());
+}
+
 void SearchWorker::waitForFetched()
 {
-    Q_ASSERT(m_batchPool.count() != m_gpuWorkers.count());
+    Q_ASSERT(m_batchPool.count() != m_batchCount);
     Batch *batch = m_queue.acquireOut(); // blocks
     Q_ASSERT(batch);
     minimaxBatch(batch, m_tree);
-    m_batchPool.append(batch);
+
+    // Follow the pipeline depth as the measured latencies change
+    const int batchCount = targetBatchCount();
+    if (m_batchCount > batchCount && !m_batchPool.isEmpty()) {
+        delete batch;
+        --m_batchCount;
+    } else {
+        m_batchPool.append(batch);
+    }
+    if (m_batchCount < batchCount) {
+        Batch *extra = new Batch;
+        extra->reserve(m_queue.maximumBatchSize());
+        m_batchPool.append(extra);
+        ++m_batchCount;
+    }
     Q_ASSERT(!m_batchPool.isEmpty());
 }
 
+void SearchWorker::abandonQueuedBatches()
+{
+    // Nothing has been done with a batch still in the queue but choosing its playouts, so rather
+    // than wait behind the ones being evaluated it goes back to the pool with the playouts left
+    // unscored, to be chosen again by the next search if the tree is kept
+    QVector<Batch*> abandoned;
+    while (Batch *batch = m_queue.takeBackIn()) {
+        finishSpeculation(batch);
+        abandoned.append(batch);
+    }
+    if (abandoned.isEmpty())
+        return;
+
+    // Their virtual losses can only come off once every other batch is back, as those share
+    // the ancestors and the minimax of their results takes the rest off
+    while (m_batchPool.count() + abandoned.count() != m_batchCount)
+        waitForFetched();
+    for (Batch *batch : abandoned) {
+        for (Node *node : *batch)
+            node->abandonPlayout();
+        m_currentInfo.workerInfo.nodesAbandoned += quint64(batch->count());
+        batch->clear();
+        m_batchPool.append(batch);
+    }
+    processWorkerInfo();
+}
+
+int SearchWorker::targetBatchCount() const
+{
+    const int workers = m_gpuWorkers.count();
+    if (m_batchesInFlight)
+        return qMin(m_batchesInFlight, int(BatchRing::Capacity));
+
+    // While the workers go through one batch each we fill this many, so that many have to be
+    // ready for no worker to ever wait on us. Beyond every worker being busy a deeper pipeline
+    // only leaves more playouts chosen without knowing the results in flight.
+    qint64 nsecsPerBatch = 0;
+    for (const GPUWorker *worker : m_gpuWorkers)
+        nsecsPerBatch += worker->nsecsPerBatch();
+    nsecsPerBatch /= qMax(1, workers);
+    int spare = 1;
+    if (nsecsPerBatch > 0 && m_selectionNsecs > 0)
+        spare = qBound(1, int((m_selectionNsecs * workers + nsecsPerBatch - 1) / nsecsPerBatch), workers);
+    return qMin(workers + spare, int(BatchRing::Capacity));
+}
+
 void SearchWorker::fetchFromNN(Batch *batch, bool sync)
 {
     Q_ASSERT(!batch->isEmpty());
@@ -273,7 +994,8 @@ void SearchWorker::fetchFromNN(Batch *batch, bool sync)
 
         for (int index = 0; index < batchForEvaluating.count(); ++index) {
             Node *node = batchForEvaluating.at(index);
-            Node::sortByPVals(*node->position()->potentials());
+            TIME_STAGE(SetPVals);
+            Node::sortByPVals(*node->position()->potentials(), 2); // what the next playout reads
         }
 
         minimaxBatch(batch, m_tree);
@@ -284,13 +1006,51 @@ void SearchWorker::fetchFromNN(Batch *batch, bool sync)
     }
 }
 
+void SearchWorker::pruneTreeIfFull()
+{
+    Cache *cache = Cache::globalInstance();
+    const quint64 highWater = quint64(cache->size() * double(s_pruneHighWater));
+    if (m_pruneExhausted || cache->used() < highWater)
+        return;
+
+    // Nodes out with the gpu workers must not be freed so wait for every batch to come back
+    while (m_batchPool.count() != m_batchCount)
+        waitForFetched();
+    actualMinimaxTree(m_tree, &m_dirtyLeaves, &m_currentInfo.workerInfo, &m_playoutPool);
+
+    const quint64 target = quint64(cache->size() * double(s_pruneLowWater));
+    m_currentInfo.workerInfo.nodesPruned += Node::pruneTree(m_tree->embodiedRoot(), target, s_pruneMsecs);
+
+    // If we could not get back below the high water mark then stop trying, rather than draining
+    // the gpu workers on every batch, and let the search exit once the cache is full
+    if (cache->used() >= highWater)
+        m_pruneExhausted = true;
+}
+
 bool SearchWorker::fillOutTree()
 {
+    if (SearchSettings::pruneWhenFull)
+        pruneTreeIfFull();
+
     Q_ASSERT(!m_batchPool.isEmpty());
     Batch *batch = m_batchPool.takeFirst();
     batch->clear();
     bool hardExit = false;
+    QElapsedTimer timer;
+    timer.start();
+    m_selection = SelectionRecord();
+    m_selection.target = quint32(m_currentBatchSize);
     bool didWork = playoutNodes(batch, &hardExit);
+    const qint64 nsecs = timer.nsecsElapsed();
+    if (!batch->isEmpty())
+        m_selectionNsecs = m_selectionNsecs ? (9 * m_selectionNsecs + nsecs) / 10 : nsecs;
+    m_selection.filled = quint32(batch->count());
+    m_selection.nsecs = nsecs;
+    recordSelection();
+    if (SearchSettings::speculativeFill && !hardExit && !batch->isEmpty()
+        && (m_selection.exit == SelectionRecord::TryLimit || m_selection.exit == SelectionRecord::VldLimit)) {
+        speculate(batch, int(m_selection.target));
+    }
     if (batch->isEmpty() || SearchSettings::featuresOff.testFlag(SearchSettings::Threading))
         m_batchPool.append(batch);
     if (!batch->isEmpty() || didWork)
@@ -300,18 +1060,49 @@ bool SearchWorker::fillOutTree()
     return hardExit;
 }
 
+bool SearchWorker::isPastDeadline() const
+{
+    const qint64 soft = m_softDeadline;
+    const qint64 hard = m_hardDeadline;
+    if (soft == std::numeric_limits<qint64>::max() && hard == std::numeric_limits<qint64>::max())
+        return false;
+
+    // Like the clock the soft deadline is only extended while the best move is not the most visited
+    const qint64 now = steadyNsecs();
+    return now >= hard || (now >= soft && m_currentInfo.bestIsMostVisited);
+}
+
+QVector<int> SearchWorker::shardDevices() const
+{
+    // Every shard takes a consecutive range of the devices, as those usually hang off the same
+    // socket, and shards share one where there are fewer devices than shards
+    const int devices = qMax(1, Options::globalInstance()->option("GPUCores").value().toInt());
+    QVector<int> ours;
+    for (int device = m_shardIndex * devices / m_shardCount;
+         device < (m_shardIndex + 1) * devices / m_shardCount; ++device) {
+        ours.append(device);
+    }
+    if (ours.isEmpty())
+        ours.append(m_shardIndex * devices / m_shardCount);
+    return ours;
+}
+
 void SearchWorker::fetchAndMinimax(Batch *batch, bool sync)
 {
     if (!batch->isEmpty()) {
         fetchFromNN(batch, sync);
     } else {
-        actualMinimaxTree(m_tree, &m_currentInfo.workerInfo);
+        ++m_minimaxBatches;
+        TRACE_BATCH("minimax", m_minimaxBatches, 0);
+        actualMinimaxTree(m_tree, &m_dirtyLeaves, &m_currentInfo.workerInfo, &m_playoutPool);
         processWorkerInfo();
     }
 }
 
 bool SearchWorker::handlePlayout(Node *playout, Cache *cache)
 {
+    TIME_STAGE(HandlePlayout);
+
 #if defined(DEBUG_PLAYOUT)
     qDebug() << "adding regular playout" << playout->toString();
 #endif
@@ -323,16 +1114,23 @@ bool SearchWorker::handlePlayout(Node *playout, Cache *cache)
 #if defined(DEBUG_PLAYOUT)
         qDebug() << "adding exact playout" << playout->toString();
 #endif
+        ++m_selection.exact;
         playout->backPropagateDirty();
+        m_dirtyLeaves.append(playout);
         return false;
     }
 
-    // If we don't have a position, we must initialize it
+    // If we don't have a position, we must initialize it, though the children of a fresh root
+    // already were when they were evaluated along with it
     quint64 hash = playout->initializePosition(cache);
+    if (!hash)
+        hash = playout->position()->position().positionHash();
 
     // Check if we have found a draw by move clock or threefold
     if (playout->checkMoveClockOrThreefold(hash, cache)) {
+        ++m_selection.exact;
         playout->backPropagateGameContextAndDirty();
+        m_dirtyLeaves.append(playout);
         return false;
     }
 
@@ -348,23 +1146,48 @@ bool SearchWorker::handlePlayout(Node *playout, Cache *cache)
 #if defined(DEBUG_PLAYOUT)
         qDebug() << "found cached playout" << playout->toString();
 #endif
+        ++m_selection.cached;
+        if (playout->position()->isSpeculative()) {
+            playout->position()->setSpeculative(false);
+            ++m_currentInfo.workerInfo.nodesSpeculatedUsed;
+        }
         if (playout->repetitions()) {
             playout->setContext(Node::GameCycleInTree);
             playout->backPropagateGameCycleAndDirty();
         } else
             playout->backPropagateDirty();
+        m_dirtyLeaves.append(playout);
         return false;
     }
 
     return true; // Otherwise we should fetch from NN
 }
 
+// Why a descent came back without a playout
+static SelectionRecord::Exit playoutExit(bool outOfMemory, int tryPlayoutLimit)
+{
+    if (outOfMemory)
+        return SelectionRecord::OutOfNodes;
+    if (tryPlayoutLimit <= 0)
+        return SelectionRecord::TryLimit;
+    return SelectionRecord::VldLimit;
+}
+
 bool SearchWorker::playoutNodes(Batch *batch, bool *hardExit)
 {
+    ++m_playoutBatches;
+    TRACE_BATCH("playout", m_playoutBatches, m_currentBatchSize);
+
 #if defined(DEBUG_PLAYOUT)
     qDebug() << "begin playout filling" << m_currentBatchSize;
 #endif
 
+    if (SearchSettings::searchThreads > 1 && !SearchSettings::featuresOff.testFlag(SearchSettings::Threading)) {
+        const bool didWork = playoutNodesConcurrently(batch, hardExit);
+        adjustBatchSize(batch->count());
+        return didWork;
+    }
+
     bool didWork = false;
     int exactOrCached = 0;
     int vldMax = SearchSettings::vldMax;
@@ -374,29 +1197,64 @@ bool SearchWorker::playoutNodes(Batch *batch, bool *hardExit)
         // Check if the we are out of nodes
         if (hash->used() == hash->size() || m_totalPlayouts == m_search.nodes) {
             *hardExit = true;
+            m_selection.exit = SelectionRecord::OutOfNodes;
             break;
         }
 
         if (exactOrCached >= m_currentBatchSize) {
-            actualMinimaxTree(m_tree, &m_currentInfo.workerInfo);
             processWorkerInfo();
             exactOrCached = 0;
             // I have not seen an infinite loop here, but I guess it is theoretically possible for
             // some position in the wild, so add an extra check here just in case.
-            if (m_stop)
+            if (m_stop) {
+                m_selection.exit = SelectionRecord::Stopped;
+                break;
+            }
+        }
+
+        if (SearchSettings::batchedSelection) {
+            qint64 budget = m_currentBatchSize - batch->count();
+            if (m_search.nodes > 0)
+                budget = qMin(budget, m_search.nodes - m_totalPlayouts);
+            m_playouts.clear();
+            Node::playouts(m_tree->embodiedRoot(), int(budget), &vldMax, &tryPlayoutLimit, hardExit,
+                hash, &m_playouts);
+            if (m_playouts.isEmpty()) {
+                m_selection.exit = playoutExit(*hardExit, tryPlayoutLimit);
                 break;
+            }
+
+            didWork = true;
+            for (Node *playout : m_playouts) {
+                Q_ASSERT(playout->m_virtualLoss == 1);
+                ++m_totalPlayouts;
+                if (!handlePlayout(playout, hash)) {
+                    ++exactOrCached;
+                    continue;
+                }
+
+                Q_ASSERT(!batch->contains(playout));
+                batch->append(playout);
+            }
+
+            if (!m_dirtyLeaves.isEmpty())
+                backUpExactOrCached();
+            continue;
         }
 
         Node *playout = Node::playout(m_tree->embodiedRoot(), &vldMax, &tryPlayoutLimit, hardExit, hash);
         Q_ASSERT(!playout || playout->m_virtualLoss == 1);
-        if (!playout)
+        if (!playout) {
+            m_selection.exit = playoutExit(*hardExit, tryPlayoutLimit);
             break;
+        }
 
         didWork = true;
         ++m_totalPlayouts;
 
         bool shouldFetchFromNN = handlePlayout(playout, hash);
         if (!shouldFetchFromNN) {
+            backUpExactOrCached();
             ++exactOrCached;
             continue;
         }
@@ -405,18 +1263,268 @@ bool SearchWorker::playoutNodes(Batch *batch, bool *hardExit)
         batch->append(playout);
     }
 
+    m_selection.collisions = quint32(SearchSettings::tryPlayoutLimit - tryPlayoutLimit);
+    m_selection.vldSpent = quint32(SearchSettings::vldMax - vldMax);
+
 #if defined(DEBUG_PLAYOUT)
     qDebug() << "end playout return" << batch->count();
 #endif
 
-    // Dynamically adjust batchsize based on how well we are meeting the current batchsize target
-    if (batch->count() < m_currentBatchSize)
-        m_currentBatchSize = qMax(1, m_currentBatchSize - 1);
-    else if (batch->count() == m_currentBatchSize)
-        m_currentBatchSize = qMin(m_queue.maximumBatchSize(), m_currentBatchSize + 1);
+    adjustBatchSize(batch->count());
     return didWork;
 }
 
+bool SearchWorker::playoutNodesConcurrently(Batch *batch, bool *hardExit)
+{
+    // Every thread descends the tree on its own, only expansion, handling the playout and adding
+    // it to the batch are serialized. The minimax pass only ever runs after all of them are done.
+    QMutex mutex;
+    std::atomic<int> claimed(0); // batch slots held by descents under way
+    std::atomic<bool> exit(false);
+    SelectionRecord::Exit reason = SelectionRecord::Filled; // the first one to stop short
+    bool didWork = false;
+    int exactOrCached = 0;
+    const int batchSize = m_currentBatchSize;
+    Node *root = m_tree->embodiedRoot();
+    Cache *hash = Cache::globalInstance();
+    m_playoutPool.run(SearchSettings::searchThreads, [&]() {
+        int vldMax = SearchSettings::vldMax;
+        int tryPlayoutLimit = SearchSettings::tryPlayoutLimit;
+        while (!exit && !m_stop) {
+            if (claimed.fetch_add(1) >= batchSize) {
+                --claimed;
+                break;
+            }
+
+            bool outOfMemory = false;
+            Node *playout = Node::playout(root, &vldMax, &tryPlayoutLimit, &outOfMemory, hash, &mutex);
+
+            // A sharded cache makes the position of the playout outside the lock
+            if (playout && hash->isConcurrent())
+                playout->initializePosition(hash);
+
+            QMutexLocker locker(&mutex);
+            if (outOfMemory) {
+                *hardExit = true;
+                exit = true;
+            }
+
+            if (!playout) {
+                if (reason == SelectionRecord::Filled)
+                    reason = playoutExit(outOfMemory, tryPlayoutLimit);
+                --claimed;
+                break;
+            }
+
+            didWork = true;
+            ++m_totalPlayouts;
+
+            if (handlePlayout(playout, hash)) {
+                Q_ASSERT(!batch->contains(playout));
+                batch->append(playout);
+            } else {
+                --claimed;
+                ++m_currentInfo.workerInfo.nodesExactOrCached;
+                if (++exactOrCached >= batchSize) {
+                    if (reason == SelectionRecord::Filled)
+                        reason = SelectionRecord::ExactOrCachedLimit;
+                    exit = true; // let the caller report before going on
+                }
+            }
+
+            if (hash->used() == hash->size() || m_totalPlayouts == m_search.nodes) {
+                if (reason == SelectionRecord::Filled)
+                    reason = SelectionRecord::OutOfNodes;
+                *hardExit = true;
+                exit = true;
+            }
+        }
+
+        QMutexLocker locker(&mutex);
+        m_selection.collisions += quint32(SearchSettings::tryPlayoutLimit - tryPlayoutLimit);
+        m_selection.vldSpent += quint32(SearchSettings::vldMax - vldMax);
+    });
+
+    if (batch->count() < batchSize)
+        m_selection.exit = reason == SelectionRecord::Filled && m_stop ? SelectionRecord::Stopped : reason;
+
+    // Nothing reads the tree anymore so the exact and cached playouts can be backed up
+    if (!m_dirtyLeaves.isEmpty()) {
+        Node::minimaxPaths(m_dirtyLeaves, &m_currentInfo.workerInfo);
+        m_dirtyLeaves.clear();
+    }
+
+    return didWork;
+}
+
+void SearchWorker::recordSelection()
+{
+    WorkerInfo &info = m_currentInfo.workerInfo;
+    info.playoutCollisions += m_selection.collisions;
+    if (m_selection.exit == SelectionRecord::TryLimit)
+        ++info.batchesTryExhausted;
+    else if (m_selection.exit == SelectionRecord::VldLimit)
+        ++info.batchesVldExhausted;
+    info.batchTarget += m_selection.target;
+    info.batchFilled += m_selection.filled;
+    m_selectionTrace.record(m_selection);
+}
+
+void SearchWorker::speculate(Batch *batch, int target)
+{
+    // The collisions left the network idle for part of the batch, so it evaluates what the
+    // playouts would make next: the two potentials they weigh after the index of the nodes on the
+    // principal variation and of their visited children. The results wait in the position cache,
+    // like those of a transposition, for the playout that makes the child.
+    Cache *hash = Cache::globalInstance();
+    Batch speculative;
+    bool isFull = false;
+    auto speculateFrom = [&](Node *node) {
+        if (node->isExact() || !node->m_visited || !node->hasPotentials())
+            return;
+        Node::PotentialVector *potentials = node->m_position->potentials();
+        const int index = node->m_potentialIndex;
+        Node::sortByPVals(*potentials, index + 2);
+        for (int i = index; i < qMin(index + 2, potentials->count()) && batch->count() < target; ++i) {
+            if (Node *child = speculativeNode(node, potentials->at(i), hash, &isFull)) {
+                batch->append(child);
+                speculative.append(child);
+            }
+        }
+    };
+    for (Node *node = m_tree->embodiedRoot(); node && !isFull && batch->count() < target;
+         node = node->bestChild()) {
+        speculateFrom(node);
+        for (Node *child = node->firstChild(); child && !isFull && batch->count() < target;
+             child = child->nextSibling()) {
+            speculateFrom(child);
+        }
+    }
+
+    if (speculative.isEmpty())
+        return;
+    m_currentInfo.workerInfo.nodesSpeculated += quint64(speculative.count());
+    m_speculative.insert(batch, speculative);
+}
+
+Node *SearchWorker::speculativeNode(Node *parent, const Node::Potential &potential, Cache *hash,
+    bool *isFull)
+{
+    Game game = parent->m_game;
+    game.storeMove(potential.move());
+    Game::Position position = parent->m_position->position(); // copy
+    const bool success = game.makeMove(game.lastMove(), &position);
+    Q_ASSERT(success);
+
+    // A position the cache has is scored already or is on its way to the network
+    const quint64 positionHash = position.positionHash();
+    if (hash->containsNodePosition(positionHash))
+        return nullptr;
+
+    Node::Position *childPosition = hash->newNodePosition(positionHash);
+    if (!childPosition) {
+        *isFull = true;
+        return nullptr;
+    }
+    childPosition->initialize(position);
+
+    // Of no tree but with the parent whose history the network is given, and expanded along with
+    // the playouts of the batch
+    Node *child = new Node;
+    child->initialize(parent, game);
+    child->setPosition(childPosition);
+    return child;
+}
+
+void SearchWorker::finishSpeculation(Batch *batch)
+{
+    const auto it = m_speculative.find(batch);
+    if (it == m_speculative.end())
+        return;
+
+    // A playout reaching the position while it was in flight made its own unique and this one is
+    // left to the cache, scored but for no node, like one of a subtree that was pruned
+    const Batch &speculative = it.value();
+    Q_ASSERT(batch->count() >= speculative.count());
+    batch->resize(batch->count() - speculative.count());
+    Cache *hash = Cache::globalInstance();
+    for (Node *node : speculative) {
+        Node::Position *position = node->m_position;
+        position->unref();
+        if (position->hasQValue())
+            position->setSpeculative(true);
+        else
+            hash->unlinkNodePosition(position->positionHash());
+        delete node;
+    }
+    m_speculative.erase(it);
+}
+
+void SearchWorker::backUpExactOrCached()
+{
+    // These need no network so they are backed up right away along their ancestors, which are
+    // the only dirty nodes in the tree
+    Q_ASSERT(!m_dirtyLeaves.isEmpty());
+    m_currentInfo.workerInfo.nodesExactOrCached += m_dirtyLeaves.count();
+    Node::minimaxPaths(m_dirtyLeaves, &m_currentInfo.workerInfo);
+    m_dirtyLeaves.clear();
+}
+
+void SearchWorker::adjustBatchSize(int count)
+{
+    if (!SearchSettings::adaptiveBatchSize) {
+        // Dynamically adjust batchsize based on how well we are meeting the current batchsize target
+        if (count < m_currentBatchSize)
+            m_currentBatchSize = qMax(1, m_currentBatchSize - 1);
+        else if (count == m_currentBatchSize)
+            m_currentBatchSize = qMin(m_queue.maximumBatchSize(), m_currentBatchSize + 1);
+        return;
+    }
+
+    // Aim for the smallest power of two that gets nearly the best measured throughput out of the
+    // network, as every playout in a batch is picked without knowing the others' results. While
+    // throughput keeps improving with size the next larger unmeasured size gets tried.
+    const int maximum = qMax(1, m_queue.maximumBatchSize());
+    NeuralNet *nn = leafNetwork();
+    QVector<QPair<int, double>> rates;
+    double bestRate = 0;
+    int target = 0;
+    for (int size = 1;; size = qMin(size * 2, maximum)) {
+        const qint64 nsecs = nn->evaluationNsecs(size);
+        if (!nsecs) {
+            if (rates.isEmpty() || rates.last().second >= bestRate)
+                target = size;
+            break;
+        }
+        const double rate = double(size) / nsecs;
+        rates.append(qMakePair(size, rate));
+        bestRate = qMax(bestRate, rate);
+        if (size == maximum)
+            break;
+    }
+    if (!target) {
+        for (const QPair<int, double> &rate : rates) {
+            if (rate.second >= 0.95 * bestRate) {
+                target = rate.first;
+                break;
+            }
+        }
+    }
+
+    // A batch cut short by collisions shows how many playouts the tree has to offer before they
+    // start to pile up on each other so head towards that
+    if (count < m_currentBatchSize)
+        target = qMin(target, qMax(1, (count + m_currentBatchSize) / 2));
+
+    // Near the end of the move do not have more playouts in flight than there is time left for
+    const quint32 estimatedNodes = m_estimatedNodes;
+    if (estimatedNodes != std::numeric_limits<quint32>::max())
+        target = qMin(target, qMax(1, int(estimatedNodes / quint32(qMax(1, m_batchCount)))));
+
+    m_currentBatchSize = qBound(1, target, maximum);
+    m_currentInfo.workerInfo.batchSizeSetpoint = quint32(m_currentBatchSize);
+}
+
 void SearchWorker::ensureRootAndChildrenScored()
 {
     Cache *hash = Cache::globalInstance();
@@ -432,7 +1540,13 @@ void SearchWorker::ensureRootAndChildrenScored()
                 nodes.append(root);
             ++m_totalPlayouts;
         }
-        fetchAndMinimax(&nodes, true /*sync*/);
+
+        // Without a tree to reuse the children of root are evaluated along with it as their moves
+        // are known before its policy is
+        if (!nodes.isEmpty() && m_search.searchMoves.isEmpty())
+            fetchRootWithChildren(root, hash);
+        else
+            fetchAndMinimax(&nodes, true /*sync*/);
     }
 
     {
@@ -444,14 +1558,15 @@ void SearchWorker::ensureRootAndChildrenScored()
         // Filter the root children if necessary
         if (!m_search.searchMoves.isEmpty()) {
             float total = 0;
-            QVector<Node::Potential> *potentials = root->position()->potentials();
-            QMutableVectorIterator<Node::Potential> it(*potentials);
-            while (it.hasNext()) {
-                Node::Potential p = it.next();
-                if (!m_search.searchMoves.contains(Notation::moveToString(p.move(), Chess::Computer)))
-                    it.remove();
-                else
+            Node::PotentialVector *potentials = root->position()->potentials();
+            for (int i = 0; i < potentials->count();) {
+                const Node::Potential p = potentials->at(i);
+                if (!m_search.searchMoves.contains(Notation::moveToString(p.move(), Chess::Computer))) {
+                    potentials->removeAt(i);
+                } else {
                     total += p.pValue();
+                    ++i;
+                }
             }
 
             // Rescale the pVals if necessary
@@ -488,6 +1603,71 @@ void SearchWorker::ensureRootAndChildrenScored()
     }
 }
 
+void SearchWorker::fetchRootWithChildren(Node *root, Cache *hash)
+{
+    // The children are made and their positions evaluated in the same batch as root, so the
+    // search starts after one trip to the network rather than two. They are played out as usual
+    // once root has been scored, by which time their positions are cached.
+    root->generatePotentials();
+    Batch evaluating;
+    if (!root->isExact())
+        evaluating.append(root);
+
+    QVector<Node*> children;
+    while (!root->isExact() && root->m_potentialIndex < root->m_position->potentials()->count()) {
+        Node::NodeGenerationError error = Node::NoError;
+        Node *child = root->generateNextChild(hash, &error);
+        if (!child)
+            break;
+        child->m_virtualLoss += 1;
+        children.append(child);
+
+        // Draws by rule and transpositions already evaluated or being shared are left to their
+        // playouts
+        child->initializePosition(hash);
+        Node::Position *position = child->position();
+        if (child->isMoveClock() || child->isThreeFold() || position->hasQValue()
+            || position->hasPotentials() || position->isUnique() || position->refs() != 1) {
+            continue;
+        }
+        child->generatePotentials();
+        if (!child->isExact())
+            evaluating.append(child);
+    }
+
+    if (!evaluating.isEmpty())
+        actualFetchFromNN(&evaluating);
+    for (Node *node : evaluating) {
+        TIME_STAGE(SetPVals);
+        Node::sortByPVals(*node->position()->potentials(), 2); // what the next playout reads
+    }
+
+    // The children were made before root had a policy so they take theirs from it now
+    const Node::PotentialVector *potentials = root->position()->potentials();
+    for (Node *child : children) {
+        const Node::Potential move(child->game().lastMove());
+        for (const Node::Potential &potential : *potentials) {
+            if (potential == move) {
+                child->setPValue(potential.pValue());
+                break;
+            }
+        }
+    }
+
+    Batch rootBatch;
+    rootBatch.append(root);
+    minimaxBatch(&rootBatch, m_tree);
+
+    Batch nodes;
+    for (Node *child : children) {
+        bool shouldFetchFromNN = handlePlayout(child, hash);
+        if (shouldFetchFromNN)
+            nodes.append(child);
+        ++m_totalPlayouts;
+    }
+    fetchAndMinimax(&nodes, true /*sync*/);
+}
+
 void SearchWorker::search()
 {
     ensureRootAndChildrenScored();
@@ -496,18 +1676,40 @@ void SearchWorker::search()
     while (!m_stop) {
         // Fill out the tree
         bool hardExit = fillOutTree();
-        if (hardExit)
+        if (m_distributed)
+            m_distributed->merge(m_tree->embodiedRoot());
+        if (m_rootShards)
+            m_rootShards->merge(m_tree->embodiedRoot());
+        if (hardExit) {
             emit requestStop(m_searchId, false /*isEarlyExit*/);
+        } else if (isPastDeadline()) {
+            // Stop right here rather than wait on the timer of the clock in the event loop of the
+            // engine, which only has to send the best move then
+            m_stop = true;
+            emit infoAvailable();
+            emit requestStop(m_searchId, false /*isEarlyExit*/);
+        }
     }
 
     // Notify stop
-    while (m_batchPool.count() != m_gpuWorkers.count())
+    abandonQueuedBatches();
+    while (m_batchPool.count() != m_batchCount)
         waitForFetched();
 
+    // The leaves are not kept across searches as the tree can change in between
+    if (!m_dirtyLeaves.isEmpty())
+        actualMinimaxTree(m_tree, &m_dirtyLeaves, &m_currentInfo.workerInfo, &m_playoutPool);
+
 #if defined(DEBUG_VALIDATE_TREE)
     Tree::validateTree(m_tree->embodiedRoot(), nullptr);
 #endif
 
+    if (m_distributed)
+        m_distributed->stop();
+    if (m_rootShards)
+        m_rootShards->stop();
+
+    m_selectionTrace.close();
     emit searchWorkerStopped();
 }
 
@@ -536,8 +1738,12 @@ void SearchWorker::processWorkerInfo()
     // Update our node info
     m_currentInfo.nodes = qMax(quint64(1), m_currentInfo.workerInfo.nodesSearched);
 
-    // See if root has a best child
+    // What the main search worker merges when this is a shard of its root
     Node *root = m_tree->embodiedRoot();
+    m_rootVisits = root->visits();
+    m_rootQValue = root->qValue();
+
+    // See if root has a best child
     const Node *best = root->bestChild();
     if (!best)
         return;
@@ -559,9 +1765,8 @@ void SearchWorker::processWorkerInfo()
     // If we've set a target, make sure that root is not completely played out, otherwise set
     // target reached flag to true
     if (m_currentInfo.workerInfo.hasTarget && !root->hasPotentials()) {
-        QVector<Node*> children = *root->children();
         bool allAreExact = true;
-        for (Node *node : children)
+        for (const Node *node = root->firstChild(); node; node = node->nextSibling())
             allAreExact = node->isExact() ? allAreExact : false;
         if (allAreExact) {
             m_currentInfo.workerInfo.targetReached = true;
@@ -582,63 +1787,71 @@ void SearchWorker::processWorkerInfo()
     // Check for an early exit
     bool shouldEarlyExit = false;
     Q_ASSERT(root->hasChildren());
-    const bool onlyOneLegalMove = (!root->hasPotentials() && root->children()->count() == 1);
+    const bool onlyOneLegalMove = (!root->hasPotentials() && root->childCount() == 1);
     if (onlyOneLegalMove && m_search.searchMoves.count() != 1) {
         shouldEarlyExit = true;
         m_currentInfo.bestIsMostVisited = true;
     } else {
-        QVector<Node*> children = *root->children();
-        if (children.count() > 1) {
-            // Sort top two by score
-            std::partial_sort(children.begin(), children.begin() + 2, children.end(),
-                [](const Node *a, const Node *b) {
-                return Node::greaterThan(a, b);
-            });
-            const Node *firstChild = children.at(0);
-            const Node *secondChild = children.at(1);
+        // The runner up is the best of the rest
+        const Node *secondChild = nullptr;
+        for (const Node *child = root->firstChild(); child; child = child->nextSibling()) {
+            if (child != best && (!secondChild || Node::greaterThan(child, secondChild)))
+                secondChild = child;
+        }
+        if (secondChild) {
+            const Node *firstChild = best;
             const qint64 diff = qint64(firstChild->m_visited) - qint64(secondChild->m_visited);
             const bool bestIsMostVisited = diff >= 0 || qFuzzyCompare(firstChild->qValue(), secondChild->qValue());
             shouldEarlyExit = bestIsMostVisited && diff >= m_estimatedNodes * SearchSettings::earlyExitFactor;
             m_currentInfo.bestIsMostVisited = bestIsMostVisited;
+            m_currentInfo.visitLead = diff;
         } else {
             m_currentInfo.bestIsMostVisited = true;
+            m_currentInfo.visitLead = best->m_visited;
             isPartial = true;
         }
     }
 
     const quint64 msecs = m_timer.nsecsElapsed() / 1000000;
     if (!isPartial || msecs >= 2500) {
-        if (hasNewMove) {
-            // Record a new best move
-            m_moveNode = best;
-            m_currentInfo.bestMove = Notation::moveToString(best->m_game.lastMove(), Chess::Computer);
-
-            // Record a ponder move
-            if (const Node *ponder = best->bestChild())
-                m_currentInfo.ponderMove = Notation::moveToString(ponder->m_game.lastMove(), Chess::Computer);
-            else
-                m_currentInfo.ponderMove = QString();
-        }
-
-        // Record a pv and score
-        float score = best->qValue();
-        int pvDepth = 0;
-        bool isCheckMate = false;
-        m_currentInfo.pv = QString();
-        QTextStream stream(&m_currentInfo.pv);
-        root->principalVariation(&pvDepth, &isCheckMate, &stream);
-        m_currentInfo.score = mateDistanceOrScore(score, pvDepth, isCheckMate);
+        m_moveNode = best;
+
+        // Record the moves, pv and score as they are and leave the formatting to the engine
+        m_snapshot.depth = m_currentInfo.depth;
+        m_snapshot.seldepth = m_currentInfo.seldepth;
+        m_snapshot.nodes = m_currentInfo.nodes;
+        m_snapshot.isResume = m_currentInfo.isResume;
+        m_snapshot.bestIsMostVisited = m_currentInfo.bestIsMostVisited;
+        m_snapshot.visitLead = m_currentInfo.visitLead;
+        m_snapshot.workerInfo = m_currentInfo.workerInfo;
+        m_snapshot.bestMove = best->m_game.lastMove();
+        const Node *ponder = best->bestChild();
+        m_snapshot.hasPonderMove = ponder;
+        if (ponder)
+            m_snapshot.ponderMove = ponder->m_game.lastMove();
+        m_snapshot.score = best->qValue();
+        m_snapshot.pvDepth = 0;
+        m_snapshot.isCheckMate = false;
+        m_snapshot.pvLength = root->principalVariation(m_snapshot.pv, InfoSnapshot::MaximumPv,
+            &m_snapshot.pvDepth, &m_snapshot.isCheckMate);
+        if (!isPartial)
+            ++m_snapshot.updates;
+        m_infoSlot.publish(m_snapshot);
         m_timer.restart();
-        emit sendInfo(m_currentInfo, isPartial);
+
+        // A new best move or a reached target is acted upon right away while the rest waits for
+        // the timer of the engine
+        if (hasNewMove || m_currentInfo.workerInfo.targetReached || m_infoInterval <= 0)
+            emit infoAvailable();
     }
 
     if (!SearchSettings::featuresOff.testFlag(SearchSettings::EarlyExit) && shouldEarlyExit)
         emit requestStop(m_searchId, true /*isEarlyExit*/);
 }
 
-WorkerThread::WorkerThread()
+WorkerThread::WorkerThread(History *history, Cache *cache)
 {
-    worker = new SearchWorker;
+    worker = new SearchWorker(history, cache);
     worker->moveToThread(&thread);
     QObject::connect(&thread, &QThread::finished,
                      worker, &SearchWorker::deleteLater);
@@ -656,11 +1869,17 @@ WorkerThread::~WorkerThread()
 SearchEngine::SearchEngine(QObject *parent)
     : QObject(parent),
     m_tree(new Tree),
+    m_history(History::globalInstance()),
     m_searchId(0),
     m_startedWorker(false),
     m_worker(nullptr),
-    m_stop(true)
+    m_infoTimer(new QTimer(this)),
+    m_infoSequence(0),
+    m_infoUpdates(0),
+    m_stop(true),
+    m_pondering(false)
 {
+    connect(m_infoTimer, &QTimer::timeout, this, &SearchEngine::reportInfo);
     qRegisterMetaType<Search>("Search");
     qRegisterMetaType<SearchInfo>("SearchInfo");
     qRegisterMetaType<WorkerInfo>("WorkerInfo");
@@ -691,6 +1910,17 @@ void SearchEngine::setEstimatedNodes(quint32 nodes)
     m_worker->worker->setEstimatedNodes(nodes);
 }
 
+void SearchEngine::setDeadline(qint64 soft, qint64 hard)
+{
+    if (!m_worker)
+        return;
+
+    const qint64 none = std::numeric_limits<qint64>::max();
+    const qint64 now = steadyNsecs();
+    m_worker->worker->setDeadline(soft < 0 ? none : now + soft * 1000000,
+        hard < 0 ? none : now + hard * 1000000);
+}
+
 void SearchEngine::reset()
 {
     QMutexLocker locker(&m_mutex);
@@ -699,18 +1929,18 @@ void SearchEngine::reset()
     // Reset the tree which assumes the cache has already been reset
     m_tree->reset();
 
-    // Reset the search worker
+    // Reset the search worker, which searches in the cache of the session where it has one
     delete m_worker;
-    m_worker = new WorkerThread;
+    m_worker = new WorkerThread(m_history, Cache::threadInstance());
+    m_infoSequence = 0;
     m_worker->thread.setObjectName("search main");
-    m_worker->thread.start();
-    m_worker->thread.setPriority(QThread::TimeCriticalPriority);
+    m_worker->thread.start(); // which takes its priority and cpus when a search starts
     // The search stopped *has* to be direct connection as the main thread will block
     // waiting for it to ensure that we only have one search going on at a time
     connect(m_worker->worker, &SearchWorker::searchWorkerStopped,
             this, &SearchEngine::searchWorkerStopped, Qt::DirectConnection);
-    connect(m_worker->worker, &SearchWorker::sendInfo,
-            this, &SearchEngine::receivedSearchInfo);
+    connect(m_worker->worker, &SearchWorker::infoAvailable,
+            this, &SearchEngine::reportInfo);
     connect(m_worker->worker, &SearchWorker::requestStop,
             this, &SearchEngine::receivedRequestStop);
 }
@@ -721,26 +1951,47 @@ void SearchEngine::startSearch(const Search &search)
     Q_ASSERT(m_stop);
 
     // Set the search parameters
-    SearchSettings::cpuctF = Options::globalInstance()->option("CpuctF").value().toFloat();
-    SearchSettings::cpuctInit = Options::globalInstance()->option("CpuctInit").value().toFloat();
-    SearchSettings::cpuctBase = Options::globalInstance()->option("CpuctBase").value().toFloat();
-    SearchSettings::featuresOff = SearchSettings::stringToFeatures(Options::globalInstance()->option("FeaturesOff").value());
-    SearchSettings::fpuReduction = Options::globalInstance()->option("ReduceFPU").value().toFloat();
-    SearchSettings::policySoftmaxTemp = Options::globalInstance()->option("PolicySoftmaxTemp").value().toFloat();
+    const OptionSettings &settings = Options::globalInstance()->settings();
+    SearchSettings::cpuctF = settings.cpuctF;
+    SearchSettings::cpuctInit = settings.cpuctInit;
+    SearchSettings::cpuctBase = settings.cpuctBase;
+    SearchSettings::featuresOff = settings.featuresOff;
+    SearchSettings::fpuReduction = settings.fpuReduction;
+    SearchSettings::policySoftmaxTemp = settings.policySoftmaxTemp;
     SearchSettings::policySoftmaxTempInverse = 1 / SearchSettings::policySoftmaxTemp;
-    SearchSettings::tryPlayoutLimit = Options::globalInstance()->option("TryPlayoutLimit").value().toInt();
-
-    // Remove the old root if it exists
-    m_tree->clearRoot(!SearchSettings::featuresOff.testFlag(SearchSettings::TreeReuse));
+    SearchSettings::tryPlayoutLimit = settings.tryPlayoutLimit;
+    SearchSettings::searchThreads = settings.searchThreads;
+    SearchSettings::minimaxThreads = settings.minimaxThreads;
+    SearchSettings::smallNetVisits = settings.smallNetVisits;
+    SearchSettings::mateSolverMoves = settings.mateSolverMoves;
+    SearchSettings::mateSolverReplies = settings.mateSolverReplies;
+    SearchSettings::incrementalBackup = settings.incrementalBackup;
+    SearchSettings::adaptiveBatchSize = settings.adaptiveBatchSize;
+    SearchSettings::transpositionGraph = settings.transpositionGraph;
+    SearchSettings::speculativeFill = settings.speculativeFill;
+    SearchSettings::batchedSelection = settings.batchedSelection;
+    SearchSettings::treeCompaction = settings.treeCompaction;
+
+    // Remove the old root if it exists, but while pondering hold on to the replies we did not
+    // ponder on so a miss only throws away the pondered branch
+    m_tree->clearRoot(!SearchSettings::featuresOff.testFlag(SearchSettings::TreeReuse), m_pondering);
+
+    // What was reused is scattered over the arena, so move it to the front before anything refers
+    // to its nodes again
+    if (SearchSettings::treeCompaction)
+        m_tree->compact();
 
     m_startedWorker = false;
     m_stop = false;
 
     bool onlyLegalMove = false;
+    Metrics::globalInstance()->beginSearch();
 
     Node *root = m_tree->embodiedRoot();
     Q_ASSERT(root);
 
+    TB::globalInstance()->preload(root->position()->position());
+
     // Check the DTZ and if found just use it and stop the search
     int dtz = 0;
     SearchInfo info;
@@ -774,7 +2025,7 @@ void SearchEngine::startSearch(const Search &search)
             info.ponderMove = Notation::moveToString(ponder->m_game.lastMove(), Chess::Computer);
         else
             info.ponderMove = QString();
-        onlyLegalMove = !root->hasPotentials() && root->children()->count() == 1;
+        onlyLegalMove = !root->hasPotentials() && root->childCount() == 1;
         int pvDepth = 0;
         bool isCheckMate = false;
         info.pv = QString();
@@ -791,6 +2042,10 @@ void SearchEngine::startSearch(const Search &search)
         // We check if we've already been requested to stop as the sendInfo above and a very low
         // clock might have already stopped the search before the worker can even get started
         Q_ASSERT(m_worker);
+        m_infoUpdates = 0;
+        const int infoInterval = Options::globalInstance()->settings().infoInterval;
+        if (infoInterval > 0)
+            m_infoTimer->start(infoInterval);
         m_worker->startWorker(m_tree, m_searchId, search, info);
         m_startedWorker = true;
     }
@@ -803,6 +2058,7 @@ void SearchEngine::stopSearch()
 
     // Now, increment the searchId to guard against stale info
     ++m_searchId;
+    m_infoTimer->stop();
 
     if (!m_startedWorker)
         return;
@@ -814,6 +2070,20 @@ void SearchEngine::stopSearch()
         m_condition.wait(locker.mutex());
 }
 
+void SearchEngine::startPonder()
+{
+    QMutexLocker locker(&m_mutex);
+    Q_ASSERT(m_stop); // pondering is decided before the search starts
+    m_pondering = true;
+}
+
+void SearchEngine::stopPonder()
+{
+    // On a hit the search simply carries on now under the clock and on a miss it is stopped and
+    // the next search resumes from the parked siblings
+    m_pondering = false;
+}
+
 void SearchEngine::searchWorkerStopped()
 {
     QMutexLocker locker(&m_mutex);
@@ -821,14 +2091,44 @@ void SearchEngine::searchWorkerStopped()
     m_condition.wakeAll();
 }
 
-void SearchEngine::receivedSearchInfo(const SearchInfo &info, bool isPartial)
+static SearchInfo snapshotToInfo(const InfoSnapshot &snapshot)
+{
+    SearchInfo info;
+    info.depth = snapshot.depth;
+    info.seldepth = snapshot.seldepth;
+    info.nodes = snapshot.nodes;
+    info.isResume = snapshot.isResume;
+    info.bestIsMostVisited = snapshot.bestIsMostVisited;
+    info.visitLead = snapshot.visitLead;
+    info.workerInfo = snapshot.workerInfo;
+    info.bestMove = Notation::moveToString(snapshot.bestMove, Chess::Computer);
+    if (snapshot.hasPonderMove)
+        info.ponderMove = Notation::moveToString(snapshot.ponderMove, Chess::Computer);
+    for (int i = 0; i < snapshot.pvLength; ++i) {
+        if (i)
+            info.pv += QLatin1String(" ");
+        info.pv += Notation::moveToString(snapshot.pv[i], Chess::Computer);
+    }
+    info.score = mateDistanceOrScore(snapshot.score, snapshot.pvDepth, snapshot.isCheckMate);
+    return info;
+}
+
+void SearchEngine::reportInfo()
 {
     // It is possible this could have been queued before we were asked to stop
     // so ignore if so
-    if (m_stop || info.workerInfo.searchId != m_searchId)
+    if (m_stop || !m_worker)
+        return;
+
+    InfoSnapshot snapshot;
+    if (!m_worker->worker->infoSlot()->read(&snapshot, &m_infoSequence)
+        || snapshot.workerInfo.searchId != m_searchId)
         return;
 
-    emit sendInfo(info, isPartial);
+    // Partial unless the worker had something that was not since the last report
+    const bool isPartial = snapshot.updates == m_infoUpdates;
+    m_infoUpdates = snapshot.updates;
+    emit sendInfo(snapshotToInfo(snapshot), isPartial);
 }
 
 void SearchEngine::receivedRequestStop(quint32 searchId, bool isEarlyExit)
@@ -25,25 +25,120 @@
 #include <QDebug>
 #include <QElapsedTimer>
 #include <QFuture>
+#include <QHash>
 #include <QSemaphore>
 #include <QThread>
+#include <QTimer>
 #include <QMutex>
 #include <QWaitCondition>
 
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "distributedsearch.h"
+#include "rootshards.h"
 #include "search.h"
+#include "selectiontrace.h"
 
 class Cache;
 class Computation;
+class History;
+class NeuralNet;
 class Node;
 class Tree;
 
 typedef QVector<Node*> Batch;
 typedef QVector<Batch*> BatchQueue;
 
+// Bounded lock free ring of batches after Dmitry Vyukov's MPMC queue. Waiting spins for a while
+// and only then parks, so a quick handoff never has to go through the kernel.
+class BatchRing {
+public:
+    enum { Capacity = 512 }; // a power of two holding every batch of the largest pool
+
+    BatchRing();
+
+    void push(Batch *batch);
+    Batch *pop(const std::atomic<bool> *stop = nullptr); // null once stopped
+    void wakeAll();
+    int count() const; // of the batches waiting, which may be stale by the time it returns
+
+private:
+    bool tryPush(Batch *batch);
+    Batch *tryPop();
+
+    struct Cell {
+        std::atomic<quint64> sequence;
+        Batch *batch;
+    };
+
+    Cell m_cells[Capacity];
+    // Padded so producers and consumers do not share a cache line
+    std::atomic<quint64> m_enqueuePosition;
+    char m_enqueuePadding[56];
+    std::atomic<quint64> m_dequeuePosition;
+    char m_dequeuePadding[56];
+    std::atomic<int> m_sleepers;
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+};
+
+// Holds the latest info of a search for a single writer and any number of readers, as a sequence
+// lock where the sequence is odd while a write is in progress and readers retry across one
+class InfoSlot {
+public:
+    void publish(const InfoSnapshot &snapshot);
+    // False when nothing was published since the sequence, which is then moved to the snapshot read
+    bool read(InfoSnapshot *snapshot, quint64 *sequence) const;
+
+private:
+    std::atomic<quint64> m_sequence { 0 };
+    InfoSnapshot m_snapshot;
+};
+
+// Evaluates the batches of several searches running at the same time as one computation, so that
+// many small searches such as self play games still fill the gpus. Whichever thread finds enough
+// positions waiting, or has waited long enough, evaluates all of them while the others sleep.
+class BatchCombiner {
+public:
+    static BatchCombiner *globalInstance();
+
+    bool isEnabled() const { return m_target > 0; }
+    void setTarget(int positions, int maximum); // zero turns combining off
+
+    // Returns once the batch has been evaluated, on the computation bound to the caller where it
+    // is the one that evaluates the combined batches
+    void fetch(Batch *batch, Computation *bound = nullptr);
+
+private:
+    struct Submission {
+        Batch *batch;
+        History *history; // of the search so its positions are encoded with the right game
+        bool isTaken;
+        bool isDone;
+    };
+
+    QVector<Submission*> take();
+
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+    QVector<Submission*> m_pending;
+    int m_pendingPositions = 0;
+    int m_target = 0;
+    int m_maximum = 0;
+};
+
 class GuardedBatchQueue {
 public:
     Batch *acquireIn();
     void releaseIn(Batch *batch);
+    Batch *takeBackIn(); // one no worker has started yet, or null
+
+    // With an expansion stage the batches have their potentials generated on the way in
+    Batch *acquireExpanded();
+    void releaseExpanded(Batch *batch);
 
     Batch *acquireOut();
     void releaseOut(Batch *batch);
@@ -52,49 +147,121 @@ public:
     int maximumBatchSize() const { return m_maximumBatchSize; }
     void setMaximumBatchSize(int maximumBatchSize) { m_maximumBatchSize = maximumBatchSize; }
 
+    bool hasExpansionStage() const { return m_hasExpansionStage; }
+    void setExpansionStage(bool hasExpansionStage) { m_hasExpansionStage = hasExpansionStage; }
+
+    int inDepth() const { return m_inQueue.count(); }
+    int expandedDepth() const { return m_expandedQueue.count(); }
+    int outDepth() const { return m_outQueue.count(); }
+
 private:
     int m_maximumBatchSize = 0;
-    bool m_stop = false;
-    BatchQueue m_inQueue;
-    BatchQueue m_outQueue;
-    QMutex m_inMutex;
-    QMutex m_outMutex;
-    QWaitCondition m_inCondition;
-    QWaitCondition m_outCondition;
+    bool m_hasExpansionStage = false;
+    std::atomic<bool> m_stop { false };
+    BatchRing m_inQueue;        // one search worker to many expansion or gpu workers
+    BatchRing m_expandedQueue;  // many expansion workers to many gpu workers
+    BatchRing m_outQueue;       // many gpu workers to one search worker
+};
+
+class ExpansionWorker : public QThread {
+    Q_OBJECT
+public:
+    ExpansionWorker(GuardedBatchQueue *queue, History *history, Cache *cache,
+        QObject *parent = nullptr);
+    ~ExpansionWorker();
+
+    void run() override;
+
+private:
+    GuardedBatchQueue *m_queue;
+    History *m_history;
+    Cache *m_cache; // of the shard or session or null for the process wide one
 };
 
 class GPUWorker : public QThread {
     Q_OBJECT
 public:
-    GPUWorker(GuardedBatchQueue *queue, int maximumBatchSize,
+    // Pinned near the device whose computation the worker binds, or takes any network batch by
+    // batch where none of the device is left to bind
+    GPUWorker(GuardedBatchQueue *queue, int maximumBatchSize, int device, History *history, Cache *cache,
         QObject *parent = nullptr);
     ~GPUWorker();
 
     void run() override;
 
+    // Average time spent generating, encoding and evaluating one batch
+    qint64 nsecsPerBatch() const { return m_nsecsPerBatch; }
+
 private:
+    Computation *boundComputation(); // for the next batch or null
+    void unbind();
+
     Batch m_batchForEvaluating;
     GuardedBatchQueue *m_queue;
+    int m_device;
+    NeuralNet *m_network; // the leaf network last bound or tried
+    Computation *m_computation; // bound to the worker
+    quint32 m_bindingGeneration; // of the network when last tried
+    History *m_history;
+    Cache *m_cache;
+    std::atomic<qint64> m_nsecsPerBatch;
+    quint64 m_batches; // evaluated, to tag the trace ranges
+};
+
+// Helper threads that descend the tree alongside the search worker to fill a batch
+class PlayoutPool {
+public:
+    ~PlayoutPool();
+
+    // Runs the job on this many threads, counting the caller, and returns once all are done
+    void run(int threads, const std::function<void()> &job);
+
+private:
+    void work();
+
+    std::vector<std::thread> m_threads;
+    std::function<void()> m_job;
+    History *m_history = nullptr; // of the caller so the helpers see the same game
+    Cache *m_cache = nullptr;     // and the same tree
+    QMutex m_mutex;
+    QWaitCondition m_startCondition;
+    QWaitCondition m_doneCondition;
+    quint64 m_generation = 0;
+    int m_wanted = 0;
+    int m_running = 0;
+    bool m_stop = false;
 };
 
 class SearchWorker : public QObject {
     Q_OBJECT
 public:
-    SearchWorker(QObject *parent = nullptr);
+    // A shard of the root or a session searches with a cache of its own where the main search
+    // worker uses the process wide one, and only that one splits the root into shards
+    SearchWorker(History *history, Cache *cache = nullptr, QObject *parent = nullptr);
     ~SearchWorker();
 
+    // Before the first search, which of how many shards of the root this worker is, deciding the
+    // devices its gpu workers and it are pinned with
+    void setShard(int index, int count) { m_shardIndex = index; m_shardCount = count; }
+
     // These are thread safe
     void stopSearch();
+    quint32 rootVisits() const { return m_rootVisits; }
+    float rootQValue() const { return m_rootQValue; }
+    void clearRootInfo() { m_rootVisits = 0; m_rootQValue = 0.0f; } // while stopped
     quint32 estimatedNodes() const { return m_estimatedNodes; }
     void setEstimatedNodes(quint32 nodes) { m_estimatedNodes = nodes; }
-
+    const InfoSlot *infoSlot() const { return &m_infoSlot; }
+    // On the steady clock in nanoseconds, the search stops by itself once past the hard deadline
+    // or past the soft one with the best move being the most visited
+    void setDeadline(qint64 soft, qint64 hard) { m_softDeadline = soft; m_hardDeadline = hard; }
 
 public Q_SLOTS:
     void startSearch(Tree *tree, int searchId, const Search &search,
         const SearchInfo &info);
 
 Q_SIGNALS:
-    void sendInfo(const SearchInfo &info, bool isPartial);
+    void infoAvailable(); // what the engine acts on was published and should be read right away
     void searchWorkerStopped();
     void requestStop(int searchId, bool);
 
@@ -103,15 +270,29 @@ private Q_SLOTS:
 
 private:
     void minimaxBatch(Batch *batch, Tree *tree);
+    void refineEvaluations(const Batch *batch); // of the small network with the large one
     void waitForFetched();
+    void abandonQueuedBatches();
     void fetchFromNN(Batch *batch, bool sync);
     void fetchAndMinimax(Batch *batch, bool sync);
     bool fillOutTree();
+    void pruneTreeIfFull();
+    bool isPastDeadline() const;
+    QVector<int> shardDevices() const;
 
     // Playout methods
     bool handlePlayout(Node *playout, Cache *cache);
+    void backUpExactOrCached();
     bool playoutNodes(Batch *batch, bool *hardExit);
+    bool playoutNodesConcurrently(Batch *batch, bool *hardExit);
+    void adjustBatchSize(int count);
+    void recordSelection(); // of the batch just filled
+    void speculate(Batch *batch, int target);
+    Node *speculativeNode(Node *parent, const Node::Potential &potential, Cache *hash, bool *isFull);
+    void finishSpeculation(Batch *batch);
+    int targetBatchCount() const;
     void ensureRootAndChildrenScored();
+    void fetchRootWithChildren(Node *root, Cache *hash);
 
     // Reporting info
     void processWorkerInfo();
@@ -123,18 +304,44 @@ private:
     int m_searchId;
     int m_currentBatchSize;
     std::atomic<quint32> m_estimatedNodes;
+    std::atomic<qint64> m_softDeadline;
+    std::atomic<qint64> m_hardDeadline;
     SearchInfo m_currentInfo;
+    InfoSnapshot m_snapshot;
+    InfoSlot m_infoSlot;
+    int m_infoInterval;
     Tree *m_tree;
+    History *m_history;
+    Cache *m_cache;
     QVector<GPUWorker*> m_gpuWorkers;
+    QVector<ExpansionWorker*> m_expansionWorkers;
     GuardedBatchQueue m_queue;
     BatchQueue m_batchPool;
+    int m_batchCount;                   // in the pool or in flight
+    int m_batchesInFlight;              // zero picks the depth from the measured latencies
+    qint64 m_selectionNsecs;            // average time filling a batch
+    quint64 m_playoutBatches;           // filled and minimaxed, to tag the trace ranges
+    quint64 m_minimaxBatches;
+    Batch m_dirtyLeaves; // marked dirty since the last minimax pass
+    QHash<const Batch*, Batch> m_speculative; // the nodes of no tree at the end of a batch in flight
+    QVector<Node*> m_playouts; // of the latest batched descent
+    SelectionRecord m_selection;        // of the batch being filled
+    SelectionTrace m_selectionTrace;
+    PlayoutPool m_playoutPool;
+    DistributedSearch *m_distributed;   // where the root is split across search servers
+    RootShards *m_rootShards;           // where the root is split across numa nodes
+    int m_shardIndex;
+    int m_shardCount;
+    std::atomic<quint32> m_rootVisits;  // as of the last batch
+    std::atomic<float> m_rootQValue;
+    bool m_pruneExhausted;
     std::atomic<bool> m_stop;
 };
 
 class WorkerThread : public QObject {
     Q_OBJECT
 public:
-    WorkerThread();
+    WorkerThread(History *history, Cache *cache = nullptr);
     ~WorkerThread();
     SearchWorker *worker;
     QThread thread;
@@ -152,8 +359,11 @@ public:
 
     quint32 estimatedNodes() const;
     void setEstimatedNodes(quint32 nodes);
+    // Milliseconds from now as the clock has them where -1 means none
+    void setDeadline(qint64 soft, qint64 hard);
 
     bool isStopped() const { return m_stop; }
+    bool isPondering() const { return m_pondering; }
     Tree *tree() const { return m_tree; }
 
 public Q_SLOTS:
@@ -161,11 +371,11 @@ public Q_SLOTS:
     void startSearch(const Search &s);
     void stopSearch();
     void searchWorkerStopped();
-    void receivedSearchInfo(const SearchInfo &info, bool isPartial);
+    void reportInfo();
     void receivedRequestStop(quint32 searchId, bool);
     void printTree(const QVector<QString> &node, int depth, bool printPotentials) const;
-    void startPonder() {}
-    void stopPonder() {}
+    void startPonder();
+    void stopPonder();
 
 Q_SIGNALS:
     void sendInfo(const SearchInfo &info, bool isPartial);
@@ -175,12 +385,17 @@ private:
     void resetSearch(const Search &search);
 
     Tree *m_tree;
+    History *m_history; // the one bound to the thread that made us, which our threads bind
     quint32 m_searchId;
     bool m_startedWorker;
     WorkerThread* m_worker;
+    QTimer *m_infoTimer; // formats what the worker published at most every InfoInterval
+    quint64 m_infoSequence;
+    quint64 m_infoUpdates;
     QMutex m_mutex;
     QWaitCondition m_condition;
     std::atomic<bool> m_stop;
+    bool m_pondering;
 };
 
 #endif // SEARCHENGINE_H
@@ -0,0 +1,154 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "searchserver.h"
+
+#include <QDebug>
+#include <QThread>
+
+#include <thread>
+
+#include "nnremote.h"
+#include "options.h"
+
+SearchServerSession::SearchServerSession(int socket, quint64 cachePositions, QObject *parent)
+    : QObject(parent),
+    m_socket(socket),
+    m_cachePositions(cachePositions),
+    m_engine(nullptr)
+{
+}
+
+SearchServerSession::~SearchServerSession()
+{
+    // Before our history and cache go away
+    delete m_engine;
+    m_engine = nullptr;
+    History::setThreadInstance(nullptr);
+    Cache::setThreadInstance(nullptr);
+}
+
+void SearchServerSession::readyRead(const QString &line)
+{
+    // The engine is made on our own thread once that is bound to our history and cache so that
+    // it and the threads it starts all see our game and grow only our tree
+    if (!m_engine) {
+        m_cache.reset(m_cachePositions);
+        History::setThreadInstance(&m_history);
+        Cache::setThreadInstance(&m_cache);
+        m_engine = new UciEngine(this, QString() /*debugFile*/);
+        m_engine->setSession(QString());
+        m_engine->installIOHandler(&m_quiet);
+        connect(m_engine, &UciEngine::sendOutput, this, &SearchServerSession::write, Qt::DirectConnection);
+    }
+    m_engine->readyRead(line);
+}
+
+void SearchServerSession::write(const QString &output)
+{
+    QMutexLocker locker(&m_mutex);
+    const QByteArray data = output.toLatin1();
+    NNRemote::send(m_socket, data.constData(), size_t(data.size()));
+}
+
+SearchServer::SearchServer(QObject *parent)
+    : QObject(parent),
+    m_listener(-1),
+    m_maximumSessions(1),
+    m_cachePositions(0),
+    m_sessions(0)
+{
+}
+
+SearchServer::~SearchServer()
+{
+    NNRemote::closeSocket(m_listener);
+}
+
+bool SearchServer::run()
+{
+    if (!Options::globalInstance()->option("SearchServers").value().isEmpty()) {
+        qWarning() << "The search server can not itself split its searches across search servers";
+        return false;
+    }
+
+    const QString address = Options::globalInstance()->option("SearchServerAddress").value();
+    const quint16 port = quint16(Options::globalInstance()->option("SearchServerPort").value().toUInt());
+    m_listener = NNRemote::listenOn(address, port);
+    if (m_listener == -1) {
+        qWarning() << "The search server could not listen on" << address << "port" << port;
+        return false;
+    }
+
+    // Everything the sessions share is brought up once before any of them starts
+    UciEngine::resetSharedState(true /*forSessions*/);
+    m_maximumSessions = qMax(1, Options::globalInstance()->option("SearchServerSessions").value().toInt());
+    m_cachePositions = Cache::positionsFromOptions() / quint64(m_maximumSessions);
+
+    fprintf(stderr, "search server listening on %s port %d\n", qPrintable(address), port);
+    std::thread([this]() {
+        forever {
+            const int socket = NNRemote::acceptOn(m_listener);
+            if (socket == -1)
+                continue;
+
+            // The sessions split the cache between them so one past the most would go beyond it
+            if (m_sessions.fetch_add(1) >= m_maximumSessions) {
+                --m_sessions;
+                const QByteArray refusal("info string too many sessions are open\n");
+                NNRemote::send(socket, refusal.constData(), size_t(refusal.size()));
+                NNRemote::closeSocket(socket);
+                continue;
+            }
+            std::thread([this, socket]() { serve(socket); --m_sessions; }).detach();
+        }
+    }).detach();
+    return true;
+}
+
+void SearchServer::serve(int socket)
+{
+    QThread *thread = new QThread;
+    thread->setObjectName(QString("search session %0").arg(socket));
+    SearchServerSession *session = new SearchServerSession(socket, m_cachePositions);
+    session->moveToThread(thread);
+    connect(thread, &QThread::finished, session, &QObject::deleteLater);
+    thread->start();
+
+    QByteArray buffer;
+    QByteArray line;
+    while (NNRemote::receiveLine(socket, &buffer, &line)) {
+        const QString command = QString::fromLatin1(line).trimmed();
+        if (command == QLatin1String("quit"))
+            break;
+        if (!command.isEmpty()) {
+            QMetaObject::invokeMethod(session, "readyRead", Qt::QueuedConnection,
+                Q_ARG(QString, command));
+        }
+    }
+
+    // Waits for the session to stop searching before its thread and with it the session go away
+    QMetaObject::invokeMethod(session, "readyRead", Qt::BlockingQueuedConnection,
+        Q_ARG(QString, QLatin1String("quit")));
+    thread->quit();
+    thread->wait();
+    delete thread;
+    NNRemote::closeSocket(socket);
+}
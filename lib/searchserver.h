@@ -0,0 +1,80 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef SEARCHSERVER_H
+#define SEARCHSERVER_H
+
+#include <QMutex>
+#include <QObject>
+
+#include <atomic>
+
+#include "cache.h"
+#include "history.h"
+#include "uciengine.h"
+
+// One uci engine of the search server with its own tree, cache and game history, living on a
+// thread of its own and writing its output to the connection it serves rather than the standard
+// output
+class SearchServerSession : public QObject {
+    Q_OBJECT
+public:
+    SearchServerSession(int socket, quint64 cachePositions, QObject *parent = nullptr);
+    ~SearchServerSession() override;
+
+public Q_SLOTS:
+    void readyRead(const QString &line);
+
+private:
+    void write(const QString &output);
+
+    int m_socket;
+    quint64 m_cachePositions;
+    History m_history;
+    Cache m_cache;
+    IOHandler m_quiet;
+    UciEngine *m_engine;
+    QMutex m_mutex;
+};
+
+// Searches the subtrees a distributed search on another machine hands out. Every connection is a
+// session of its own that takes uci commands line by line like the sessions of the server mode do,
+// sharing the networks and the tablebases with the others. Up to SearchServerSessions are served
+// at once, each searching in that share of the cache, and connections past them are closed right
+// away. It listens on the SearchServerAddress, which is only this machine unless set otherwise,
+// and the sessions can not read or write files. Options are only taken from the command line.
+class SearchServer : public QObject {
+    Q_OBJECT
+public:
+    SearchServer(QObject *parent);
+    ~SearchServer() override;
+
+    bool run(); // false where it could not listen, otherwise serves from the event loop until killed
+
+private:
+    void serve(int socket);
+
+    int m_listener;
+    int m_maximumSessions;
+    quint64 m_cachePositions;
+    std::atomic<int> m_sessions;
+};
+
+#endif // SEARCHSERVER_H
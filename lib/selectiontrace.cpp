@@ -0,0 +1,194 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "selectiontrace.h"
+
+#include <QTextStream>
+
+#include <algorithm>
+
+const char *SelectionRecord::exitName(Exit exit)
+{
+    switch (exit) {
+    case Filled: return "filled";
+    case TryLimit: return "trylimit";
+    case VldLimit: return "vldlimit";
+    case OutOfNodes: return "outofnodes";
+    case ExactOrCachedLimit: return "exactorcached";
+    case Stopped: return "stopped";
+    }
+    Q_UNREACHABLE();
+    return "";
+}
+
+QString SelectionSearch::summary() const
+{
+    quint64 target = 0;
+    quint64 filled = 0;
+    quint64 collisions = 0;
+    quint64 vldSpent = 0;
+    quint64 exact = 0;
+    quint64 cached = 0;
+    int exits[SelectionRecord::Stopped + 1] = {};
+    QVector<qint64> nsecs;
+    nsecs.reserve(batches.count());
+    for (const SelectionRecord &record : batches) {
+        target += record.target;
+        filled += record.filled;
+        collisions += record.collisions;
+        vldSpent += record.vldSpent;
+        exact += record.exact;
+        cached += record.cached;
+        ++exits[record.exit];
+        nsecs.append(record.nsecs);
+    }
+    std::sort(nsecs.begin(), nsecs.end());
+    const auto percentile = [&](double fraction) {
+        return nsecs.isEmpty() ? qint64(0) : nsecs.at(qMin(nsecs.count() - 1, int(fraction * nsecs.count())));
+    };
+
+    QString out;
+    QTextStream stream(&out);
+    stream << "search " << searchId
+           << " fen " << fen
+           << " batches " << batches.count()
+           << " target " << target
+           << " filled " << filled
+           << " fill " << (target ? float(filled) / target : 0.0f)
+           << " collisions " << collisions
+           << " vldSpent " << vldSpent
+           << " exact " << exact
+           << " cached " << cached
+           << " fillNsecs p50 " << percentile(0.5)
+           << " p95 " << percentile(0.95)
+           << " p99 " << percentile(0.99)
+           << " exits";
+    for (int i = 0; i <= SelectionRecord::Stopped; ++i) {
+        if (exits[i])
+            stream << " " << SelectionRecord::exitName(SelectionRecord::Exit(i)) << " " << exits[i];
+    }
+    stream.flush();
+    return out;
+}
+
+bool SelectionTrace::open(const QString &fileName)
+{
+    close();
+    m_file.setFileName(fileName);
+    if (!m_file.open(QIODevice::ReadWrite | QIODevice::Append))
+        return false;
+
+    m_stream.setDevice(&m_file);
+    m_stream.setVersion(QDataStream::Qt_5_0);
+    if (m_file.size() == 0) {
+        m_stream << quint32(Magic) << quint32(Version);
+        return true;
+    }
+
+    // Only ever append to a trace of the same version
+    QDataStream header(&m_file);
+    header.setVersion(QDataStream::Qt_5_0);
+    m_file.seek(0);
+    quint32 magic = 0;
+    quint32 version = 0;
+    header >> magic >> version;
+    m_file.seek(m_file.size());
+    if (magic != Magic || version != Version) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void SelectionTrace::close()
+{
+    if (!m_file.isOpen())
+        return;
+    m_stream.setDevice(nullptr);
+    m_file.close();
+}
+
+void SelectionTrace::beginSearch(quint32 searchId, const QString &fen)
+{
+    if (!isOpen())
+        return;
+    m_stream << quint8(SearchTag) << searchId << fen;
+}
+
+void SelectionTrace::record(const SelectionRecord &record)
+{
+    if (!isOpen())
+        return;
+    m_stream << quint8(BatchTag)
+             << record.target
+             << record.filled
+             << record.collisions
+             << record.vldSpent
+             << record.exact
+             << record.cached
+             << record.nsecs
+             << quint8(record.exit);
+}
+
+bool SelectionTrace::read(const QString &fileName, QVector<SelectionSearch> *searches)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    quint32 magic = 0;
+    quint32 version = 0;
+    stream >> magic >> version;
+    if (magic != Magic || version != Version)
+        return false;
+
+    while (!stream.atEnd()) {
+        quint8 tag = 0;
+        stream >> tag;
+        if (tag == SearchTag) {
+            SelectionSearch search;
+            stream >> search.searchId >> search.fen;
+            searches->append(search);
+        } else if (tag == BatchTag && !searches->isEmpty()) {
+            SelectionRecord record;
+            quint8 exit = 0;
+            stream >> record.target
+                   >> record.filled
+                   >> record.collisions
+                   >> record.vldSpent
+                   >> record.exact
+                   >> record.cached
+                   >> record.nsecs
+                   >> exit;
+            if (exit > SelectionRecord::Stopped)
+                return false;
+            record.exit = SelectionRecord::Exit(exit);
+            searches->last().batches.append(record);
+        } else {
+            return false;
+        }
+
+        if (stream.status() != QDataStream::Ok)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef SELECTIONTRACE_H
+#define SELECTIONTRACE_H
+
+#include <QDataStream>
+#include <QFile>
+#include <QString>
+#include <QVector>
+#include <QtGlobal>
+
+// How filling one batch with playouts went
+struct SelectionRecord {
+    // Why the filling stopped
+    enum Exit : quint8 {
+        Filled,
+        TryLimit,           // too many descents ran into nodes already playing out
+        VldLimit,           // the virtual loss distance budget was spent
+        OutOfNodes,         // the cache is full or the node limit of the search was reached
+        ExactOrCachedLimit, // a batch worth of playouts needed no network
+        Stopped
+    };
+
+    quint32 target = 0;     // positions asked for
+    quint32 filled = 0;     // positions sent to the network
+    quint32 collisions = 0; // descents that ran into a node already playing out or exact
+    quint32 vldSpent = 0;   // of the virtual loss distance budget
+    quint32 exact = 0;      // playouts of exact nodes including draws by rule
+    quint32 cached = 0;     // playouts of transpositions that were already scored
+    qint64 nsecs = 0;       // to fill the batch
+    Exit exit = Filled;
+
+    float fillRatio() const { return target ? float(filled) / target : 0.0f; }
+    static const char *exitName(Exit exit);
+};
+
+// The batches of one search as read back from a trace
+struct SelectionSearch {
+    quint32 searchId = 0;
+    QString fen; // of the root
+    QVector<SelectionRecord> batches;
+
+    // Totals, the fill ratio, fill times and how often each exit was taken
+    QString summary() const;
+};
+
+// A compact binary trace of every batch filled, appended to a file search after search so that
+// undersized batches on specific positions can be looked into offline
+class SelectionTrace {
+public:
+    bool isOpen() const { return m_file.isOpen(); }
+    bool open(const QString &fileName); // appends if the file is already a trace
+    void close();
+
+    void beginSearch(quint32 searchId, const QString &fen);
+    void record(const SelectionRecord &record);
+
+    static bool read(const QString &fileName, QVector<SelectionSearch> *searches);
+
+private:
+    enum { Magic = 0x414c5354 /* ALST */, Version = 1 };
+    enum Tag : quint8 { SearchTag = 'S', BatchTag = 'B' };
+
+    QFile m_file;
+    QDataStream m_stream;
+};
+
+#endif // SELECTIONTRACE_H
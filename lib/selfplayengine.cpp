@@ -0,0 +1,276 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "selfplayengine.h"
+
+#include <QCoreApplication>
+#include <QDebug>
+
+#include "move.h"
+#include "notation.h"
+#include "options.h"
+#include "searchengine.h"
+
+#include <stdio.h>
+
+SelfPlayEngine::SelfPlayEngine(QObject *parent)
+    : QObject(parent),
+    m_random(std::random_device()()),
+    m_games(0),
+    m_started(0),
+    m_played(0),
+    m_nodes(0),
+    m_randomPlies(0),
+    m_maximumPlies(0),
+    m_busy(0),
+    m_finished(false)
+{
+}
+
+SelfPlayEngine::~SelfPlayEngine()
+{
+}
+
+bool SelfPlayEngine::run()
+{
+    Options *options = Options::globalInstance();
+    const QString openings = options->option("SelfPlayOpenings").value();
+    const QString output = options->option("SelfPlayOutput").value();
+    m_games = options->option("SelfPlayGames").value().toInt();
+    m_nodes = options->option("SelfPlayNodes").value().toInt();
+    m_randomPlies = options->option("SelfPlayRandomPlies").value().toInt();
+    m_maximumPlies = options->option("SelfPlayMaxPlies").value().toInt();
+    const int concurrency = qMin(m_games, options->option("SelfPlayConcurrency").value().toInt());
+
+    if (!openings.isEmpty()) {
+        QFile file(openings);
+        if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+            qCritical() << "Could not open" << openings << "for the openings";
+            return false;
+        }
+
+        // Either fens or epds of which only the position is used
+        QTextStream stream(&file);
+        while (!stream.atEnd()) {
+            const QString line = stream.readLine().trimmed();
+            if (line.isEmpty() || line.startsWith('#'))
+                continue;
+            const QStringList fields = line.simplified().split(' ');
+            if (fields.count() < 4)
+                continue;
+            QString fen = fields.at(0) + ' ' + fields.at(1) + ' ' + fields.at(2) + ' ' + fields.at(3);
+            bool isHalfMoveClock = false;
+            bool isFullMoveNumber = false;
+            if (fields.count() >= 6) {
+                fields.at(4).toInt(&isHalfMoveClock);
+                fields.at(5).toInt(&isFullMoveNumber);
+            }
+            if (isHalfMoveClock && isFullMoveNumber)
+                fen += ' ' + fields.at(4) + ' ' + fields.at(5);
+            else
+                fen += QLatin1String(" 0 1");
+            m_openings.append(fen);
+        }
+    }
+
+    bool opened = false;
+    if (output.isEmpty()) {
+        opened = m_outputFile.open(stdout, QIODevice::WriteOnly | QIODevice::Text);
+    } else {
+        m_outputFile.setFileName(output);
+        opened = m_outputFile.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Append);
+    }
+    if (!opened) {
+        qCritical() << "Could not open" << output << "for the games";
+        return false;
+    }
+    m_output.setDevice(&m_outputFile);
+
+    // The combiner batches across the games so a single gpu worker for each of them is enough
+    if (options->option("GPUWorkers").value().toInt() == 0)
+        options->setOption("GPUWorkers", QLatin1String("1"));
+    BatchCombiner::globalInstance()->setTarget(options->option("SelfPlayCombinedBatch").value().toInt(),
+        options->option("MaxBatchSize").value().toInt());
+
+    // Every game grows its tree in a share of the cache of its own bound to its thread, as the
+    // caches are not safe for several trees to grow at once
+    UciEngine::resetSharedState(true /*forSessions*/);
+    const quint64 cachePositions = Cache::positionsFromOptions() / quint64(qMax(1, concurrency));
+
+    for (int i = 0; i < concurrency; ++i) {
+        Session s;
+        s.thread = new QThread;
+        s.thread->setObjectName(QString("selfplay %0").arg(i));
+        s.session = new AnalyzeSession(i, cachePositions);
+        s.session->moveToThread(s.thread);
+        connect(s.thread, &QThread::finished, s.session, &QObject::deleteLater);
+        connect(s.session, &AnalyzeSession::analyzed, this, &SelfPlayEngine::analyzed);
+        s.thread->start();
+        m_sessions.append(s);
+    }
+
+    m_timer.start();
+    for (int i = 0; i < m_sessions.count(); ++i)
+        next(i);
+    if (!m_finished && m_sessions.isEmpty())
+        finish();
+    return true;
+}
+
+void SelfPlayEngine::startGame(Session *s)
+{
+    s->index = -1;
+    if (m_started == m_games)
+        return;
+
+    s->index = m_started++;
+    s->game = m_openings.isEmpty() ? StandaloneGame() : StandaloneGame(m_openings.at(s->index % m_openings.count()));
+    s->startFen = s->game.stateOfGameToFen();
+    s->moves.clear();
+    s->hashes.clear();
+    s->hashes.append(s->game.position().positionHash());
+
+    // Uniformly random moves out of the opening so that the games differ
+    Move moves[Game::Position::MaximumMoves];
+    for (int ply = 0; ply < m_randomPlies; ++ply) {
+        const int count = s->game.position().legalMoves(moves);
+        if (!count)
+            break;
+        std::uniform_int_distribution<int> distribution(0, count - 1);
+        s->game.makeMove(moves[distribution(m_random)]);
+        s->moves.append(Notation::moveToString(s->game.lastMove(), Chess::Computer));
+        if (!s->game.halfMoveClock())
+            s->hashes.clear();
+        s->hashes.append(s->game.position().positionHash());
+    }
+}
+
+bool SelfPlayEngine::isGameOver(const Session &s, QString *result, QString *termination) const
+{
+    const Game::Position &position = s.game.position();
+    const Chess::Army army = position.activeArmy();
+    if (!position.legalMoveCount()) {
+        const bool isChecked = position.isChecked(army);
+        *result = !isChecked ? QLatin1String("1/2-1/2") : army == Chess::White ? QLatin1String("0-1") : QLatin1String("1-0");
+        *termination = isChecked ? QLatin1String("checkmate") : QLatin1String("stalemate");
+    } else if (s.game.halfMoveClock() >= 100) {
+        *result = QLatin1String("1/2-1/2");
+        *termination = QLatin1String("fiftymoves");
+    } else if (s.hashes.count(s.hashes.last()) >= 3) {
+        *result = QLatin1String("1/2-1/2");
+        *termination = QLatin1String("repetition");
+    } else if (position.isDeadPosition()) {
+        *result = QLatin1String("1/2-1/2");
+        *termination = QLatin1String("material");
+    } else if (s.moves.count() >= m_maximumPlies) {
+        *result = QLatin1String("1/2-1/2");
+        *termination = QLatin1String("maxplies");
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void SelfPlayEngine::next(int session)
+{
+    if (m_finished)
+        return;
+
+    Session &s = m_sessions[session];
+    if (s.index == -1)
+        startGame(&s);
+
+    QString result;
+    QString termination;
+    while (s.index != -1 && isGameOver(s, &result, &termination)) {
+        write(s, result, termination);
+        startGame(&s);
+    }
+
+    if (s.index == -1) {
+        if (!m_busy)
+            finish();
+        return;
+    }
+
+    // The tree of the last move carries on as the position only adds a move to it
+    QString position = QLatin1String("fen ") + s.startFen;
+    if (!s.moves.isEmpty())
+        position += QLatin1String(" moves ") + s.moves.join(' ');
+    ++m_busy;
+    QMetaObject::invokeMethod(s.session, "analyze", Qt::QueuedConnection,
+        Q_ARG(QString, position), Q_ARG(int, m_nodes));
+}
+
+void SelfPlayEngine::analyzed(int session, const QString &bestMove, const SearchInfo &info)
+{
+    Q_UNUSED(info);
+    --m_busy;
+    Session &s = m_sessions[session];
+
+    bool ok = false;
+    const Move move = Notation::stringToMove(bestMove, Chess::Computer, &ok);
+    if (!ok || !s.game.makeMove(move)) {
+        qWarning() << "Abandoning game" << s.index << "at bad move" << bestMove;
+        write(s, QLatin1String("*"), QLatin1String("error"));
+        s.index = -1;
+        next(session);
+        return;
+    }
+
+    s.moves.append(bestMove);
+    if (!s.game.halfMoveClock())
+        s.hashes.clear();
+    s.hashes.append(s.game.position().positionHash());
+    next(session);
+}
+
+void SelfPlayEngine::write(const Session &s, const QString &result, const QString &termination)
+{
+    QString out;
+    QTextStream stream(&out);
+    stream << "{\"game\":" << s.index
+           << ",\"fen\":" << jsonString(s.startFen)
+           << ",\"result\":" << jsonString(result)
+           << ",\"termination\":" << jsonString(termination)
+           << ",\"plies\":" << s.moves.count()
+           << ",\"moves\":" << jsonString(s.moves.join(' '))
+           << "}";
+    m_output << out << "\n";
+    m_output.flush();
+
+    ++m_played;
+    const double hours = qMax(qint64(1), m_timer.elapsed()) / 3600000.0;
+    fprintf(stderr, "selfplay %d/%d games, %.1f games per hour\n", m_played, m_games, m_played / hours);
+}
+
+void SelfPlayEngine::finish()
+{
+    m_finished = true;
+    for (const Session &s : m_sessions) {
+        QMetaObject::invokeMethod(s.session, "quit", Qt::BlockingQueuedConnection);
+        s.thread->quit();
+        s.thread->wait();
+        delete s.thread;
+    }
+    m_sessions.clear();
+    m_output.flush();
+    QMetaObject::invokeMethod(QCoreApplication::instance(), "quit", Qt::QueuedConnection);
+}
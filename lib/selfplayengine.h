@@ -0,0 +1,84 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef SELFPLAYENGINE_H
+#define SELFPLAYENGINE_H
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QObject>
+#include <QTextStream>
+#include <QThread>
+#include <QVector>
+
+#include <random>
+
+#include "analyzeengine.h"
+#include "game.h"
+
+// Plays many games against itself at once, each a search to a small node budget for every move
+// on a session of its own, while the batch combiner evaluates the positions of all of them
+// together. Each game searches in an even share of the memory of the Cache or CacheMB options.
+// Writes one json line per finished game with its start, moves and result.
+class SelfPlayEngine : public QObject {
+    Q_OBJECT
+public:
+    SelfPlayEngine(QObject *parent);
+    ~SelfPlayEngine() override;
+
+    bool run(); // false when the openings or output could not be opened
+
+private Q_SLOTS:
+    void analyzed(int session, const QString &bestMove, const SearchInfo &info);
+
+private:
+    struct Session {
+        QThread *thread = nullptr;
+        AnalyzeSession *session = nullptr;
+        int index = -1; // of the game being played, none once they run out
+        QString startFen;
+        StandaloneGame game;
+        QStringList moves;
+        QVector<quint64> hashes; // of the positions since the last capture or pawn move
+    };
+
+    void startGame(Session *s);
+    void next(int session);
+    bool isGameOver(const Session &s, QString *result, QString *termination) const;
+    void write(const Session &s, const QString &result, const QString &termination);
+    void finish();
+
+    QFile m_outputFile;
+    QTextStream m_output;
+    QStringList m_openings;
+    std::mt19937 m_random;
+    int m_games;
+    int m_started;
+    int m_played;
+    int m_nodes;
+    int m_randomPlies;
+    int m_maximumPlies;
+    QVector<Session> m_sessions;
+    int m_busy;
+    bool m_finished;
+    QElapsedTimer m_timer;
+};
+
+#endif // SELFPLAYENGINE_H
@@ -0,0 +1,161 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "serverengine.h"
+
+#include <QCoreApplication>
+#include <QTextStream>
+
+#include "options.h"
+
+ServerSession::ServerSession(const QString &id, quint64 cachePositions, QObject *parent)
+    : QObject(parent),
+    m_id(id),
+    m_cachePositions(cachePositions),
+    m_engine(nullptr)
+{
+}
+
+ServerSession::~ServerSession()
+{
+    // Before our history and cache go away
+    delete m_engine;
+    m_engine = nullptr;
+    History::setThreadInstance(nullptr);
+    Cache::setThreadInstance(nullptr);
+}
+
+void ServerSession::readyRead(const QString &line)
+{
+    // The engine is made on our own thread once that is bound to our history and cache so that
+    // it and the threads it starts all see our game and grow only our tree
+    if (!m_engine) {
+        m_cache.reset(m_cachePositions);
+        History::setThreadInstance(&m_history);
+        Cache::setThreadInstance(&m_cache);
+        m_engine = new UciEngine(this, QString() /*debugFile*/);
+        m_engine->setSession(m_id + QLatin1String(" "));
+    }
+    m_engine->readyRead(line);
+}
+
+ServerEngine::ServerEngine(QObject *parent)
+    : QObject(parent),
+    m_maximumSessions(1),
+    m_cachePositions(0)
+{
+}
+
+ServerEngine::~ServerEngine()
+{
+    m_inputThread.quit();
+    m_inputThread.wait();
+}
+
+void ServerEngine::run()
+{
+    // Everything the sessions share is brought up once before any of them starts
+    UciEngine::resetSharedState(true /*forSessions*/);
+    m_maximumSessions = qMax(1, Options::globalInstance()->option("ServerSessions").value().toInt());
+    m_cachePositions = Cache::positionsFromOptions() / quint64(m_maximumSessions);
+
+    IOWorker *worker = new IOWorker(QString() /*debugFile*/);
+    worker->moveToThread(&m_inputThread);
+    connect(worker, &IOWorker::standardInput, this, &ServerEngine::readyRead);
+    connect(&m_inputThread, &QThread::started, worker, &IOWorker::run);
+    connect(&m_inputThread, &QThread::finished, worker, &QObject::deleteLater);
+    m_inputThread.setObjectName("io");
+    m_inputThread.start();
+}
+
+void ServerEngine::readyRead(const QString &line)
+{
+    qCInfo(UciInput).noquote() << line;
+
+    const int space = line.indexOf(' ');
+    const QString id = line.left(space);
+    const QString command = space == -1 ? QString() : line.mid(space + 1).trimmed();
+
+    bool isSession = false;
+    id.toUInt(&isSession);
+    if (!isSession) {
+        if (line == QLatin1String("quit")) {
+            quit();
+        } else if (line == QLatin1String("isready")) {
+            QString out;
+            QTextStream stream(&out);
+            stream << "readyok" << endl;
+            qCInfo(UciOutput).noquote() << out;
+        }
+        return;
+    }
+
+    if (command.isEmpty())
+        return;
+
+    if (!m_sessions.contains(id)) {
+        if (command == QLatin1String("quit"))
+            return;
+
+        // The sessions split the cache between them so one past the most would go beyond it
+        if (m_sessions.count() >= m_maximumSessions) {
+            QString out;
+            QTextStream stream(&out);
+            stream << id << " info string too many sessions are open" << endl;
+            qCInfo(UciOutput).noquote() << out;
+            return;
+        }
+
+        Session s;
+        s.thread = new QThread;
+        s.thread->setObjectName(QString("session %0").arg(id));
+        s.session = new ServerSession(id, m_cachePositions);
+        s.session->moveToThread(s.thread);
+        connect(s.thread, &QThread::finished, s.session, &QObject::deleteLater);
+        s.thread->start();
+        m_sessions.insert(id, s);
+    }
+
+    if (command == QLatin1String("quit")) {
+        closeSession(id);
+        return;
+    }
+
+    QMetaObject::invokeMethod(m_sessions.value(id).session, "readyRead", Qt::QueuedConnection,
+        Q_ARG(QString, command));
+}
+
+void ServerEngine::closeSession(const QString &id)
+{
+    // Waits for the session to stop searching before its thread and with it the session go away
+    const Session s = m_sessions.take(id);
+    QMetaObject::invokeMethod(s.session, "readyRead", Qt::BlockingQueuedConnection,
+        Q_ARG(QString, QLatin1String("quit")));
+    s.thread->quit();
+    s.thread->wait();
+    delete s.thread;
+}
+
+void ServerEngine::quit()
+{
+    for (const QString &id : m_sessions.keys())
+        closeSession(id);
+    QCoreApplication::instance()->quit();
+}
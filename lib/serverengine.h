@@ -0,0 +1,83 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef SERVERENGINE_H
+#define SERVERENGINE_H
+
+#include <QHash>
+#include <QObject>
+#include <QThread>
+
+#include "cache.h"
+#include "history.h"
+#include "uciengine.h"
+
+// One uci engine of the server with its own tree, cache and game history, living on a thread of
+// its own
+class ServerSession : public QObject {
+    Q_OBJECT
+public:
+    ServerSession(const QString &id, quint64 cachePositions, QObject *parent = nullptr);
+    ~ServerSession() override;
+
+public Q_SLOTS:
+    void readyRead(const QString &line);
+
+private:
+    QString m_id;
+    quint64 m_cachePositions;
+    History m_history;
+    Cache m_cache;
+    UciEngine *m_engine;
+};
+
+// Hosts many independent search sessions in one process so that they share the networks and the
+// tablebases. Up to ServerSessions may be open at once, each searching in that share of the cache
+// the Cache or CacheMB options size, as the caches are not safe for several trees to grow at once.
+// Every line of input starts with the number of the session it is for, which is created by its
+// first line, and every line of output starts with the number of the session it is from. Options
+// are only taken from the command line.
+class ServerEngine : public QObject {
+    Q_OBJECT
+public:
+    ServerEngine(QObject *parent);
+    ~ServerEngine() override;
+
+    void run();
+
+public Q_SLOTS:
+    void readyRead(const QString &line);
+
+private:
+    struct Session {
+        QThread *thread;
+        ServerSession *session;
+    };
+
+    void closeSession(const QString &id);
+    void quit();
+
+    QHash<QString, Session> m_sessions;
+    int m_maximumSessions;
+    quint64 m_cachePositions;
+    QThread m_inputThread;
+};
+
+#endif // SERVERENGINE_H
@@ -0,0 +1,136 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "stagetimes.h"
+
+#include <QTextStream>
+
+StageTimes::StageTimes()
+{
+    reset();
+}
+
+Q_GLOBAL_STATIC(StageTimes, s_stageTimes)
+StageTimes *StageTimes::globalInstance()
+{
+    return s_stageTimes();
+}
+
+int StageTimes::bucket(qint64 nsecs)
+{
+    // Four buckets for every power of two, the first four holding zero through three exactly
+    if (nsecs < 4)
+        return int(qMax(qint64(0), nsecs));
+    const int exponent = 63 - int(qCountLeadingZeroBits(quint64(nsecs)));
+    const int mantissa = int((nsecs >> (exponent - 2)) & 3);
+    return 4 * (exponent - 1) + mantissa;
+}
+
+qint64 StageTimes::lowerBound(int bucket)
+{
+    if (bucket < 4)
+        return bucket;
+    const int exponent = bucket / 4 + 1;
+    return qint64(4 + bucket % 4) << (exponent - 2);
+}
+
+void StageTimes::record(Stage stage, qint64 nsecs)
+{
+    m_counts[stage][bucket(nsecs)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void StageTimes::reset()
+{
+    for (int stage = 0; stage < Stages; ++stage) {
+        for (int i = 0; i < Buckets; ++i)
+            m_counts[stage][i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void StageTimes::add(const StageTimes &other)
+{
+    for (int stage = 0; stage < Stages; ++stage) {
+        for (int i = 0; i < Buckets; ++i)
+            m_counts[stage][i].fetch_add(other.m_counts[stage][i].load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+    }
+}
+
+quint64 StageTimes::count(Stage stage) const
+{
+    quint64 total = 0;
+    for (int i = 0; i < Buckets; ++i)
+        total += m_counts[stage][i].load(std::memory_order_relaxed);
+    return total;
+}
+
+qint64 StageTimes::percentile(Stage stage, double fraction) const
+{
+    const quint64 total = count(stage);
+    if (!total)
+        return 0;
+
+    const quint64 target = qMax(quint64(1), quint64(fraction * total + 0.5));
+    quint64 seen = 0;
+    for (int i = 0; i < Buckets; ++i) {
+        seen += m_counts[stage][i].load(std::memory_order_relaxed);
+        if (seen >= target)
+            return i + 1 < Buckets ? lowerBound(i + 1) : lowerBound(i);
+    }
+    return lowerBound(Buckets - 1);
+}
+
+QString StageTimes::toString() const
+{
+    QString out;
+    QTextStream stream(&out);
+    for (int i = 0; i < Stages; ++i) {
+        const Stage stage = Stage(i);
+        const quint64 n = count(stage);
+        if (!n)
+            continue;
+        if (!out.isEmpty())
+            stream << " ";
+        stream << stageName(stage) << " " << n << " "
+               << percentile(stage, 0.5) << "/"
+               << percentile(stage, 0.95) << "/"
+               << percentile(stage, 0.99);
+        stream.flush();
+    }
+    stream.flush();
+    return out;
+}
+
+const char *StageTimes::stageName(Stage stage)
+{
+    switch (stage) {
+    case Playout: return "playout";
+    case HandlePlayout: return "handlePlayout";
+    case GeneratePotentials: return "generatePotentials";
+    case Encode: return "encode";
+    case Evaluate: return "evaluate";
+    case SetPVals: return "setPVals";
+    case Minimax: return "minimax";
+    case QueueWait: return "queueWait";
+    case Stages: break;
+    }
+    Q_UNREACHABLE();
+    return "";
+}
@@ -0,0 +1,98 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef STAGETIMES_H
+#define STAGETIMES_H
+
+#include <QString>
+#include <QtGlobal>
+
+#include <atomic>
+#include <chrono>
+
+// Times the stages of the search pipeline when defined and compiles the timers away otherwise
+//#define USE_STAGE_TIMES
+
+// Wall time spent in each stage of the search pipeline, as histograms of quarter octaves of
+// nanoseconds that any thread records into without locking
+class StageTimes {
+public:
+    enum Stage {
+        Playout,
+        HandlePlayout,
+        GeneratePotentials,
+        Encode,
+        Evaluate,
+        SetPVals,
+        Minimax,
+        QueueWait,
+        Stages
+    };
+    enum { Buckets = 256 };
+
+    StageTimes();
+
+    static StageTimes *globalInstance(); // of the search running now
+
+    void record(Stage stage, qint64 nsecs);
+    void reset();
+    void add(const StageTimes &other);
+
+    quint64 count(Stage stage) const;
+    qint64 percentile(Stage stage, double fraction) const; // the upper bound of its bucket
+    // The count and p50/p95/p99 in nanoseconds of every stage that was recorded
+    QString toString() const;
+    static const char *stageName(Stage stage);
+
+private:
+    static int bucket(qint64 nsecs);
+    static qint64 lowerBound(int bucket);
+
+    std::atomic<quint64> m_counts[Stages][Buckets];
+};
+
+class StageTimer {
+public:
+    StageTimer(StageTimes::Stage stage)
+        : m_stage(stage),
+        m_start(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~StageTimer()
+    {
+        const auto elapsed = std::chrono::steady_clock::now() - m_start;
+        StageTimes::globalInstance()->record(m_stage,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+private:
+    StageTimes::Stage m_stage;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// Times the rest of the enclosing scope
+#if defined(USE_STAGE_TIMES)
+#define TIME_STAGE(stage) StageTimer stageTimer(StageTimes::stage)
+#else
+#define TIME_STAGE(stage)
+#endif
+
+#endif // STAGETIMES_H
@@ -24,6 +24,17 @@
 #include "fathom/tbprobe.h"
 
 #include <QDebug>
+#include <QDir>
+
+#if defined(Q_OS_UNIX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// How many pieces above the largest tables the root may have when the prefetch starts
+#define PREFETCH_DISTANCE 2
 
 class MyTB : public TB { };
 Q_GLOBAL_STATIC(MyTB, TBInstance)
@@ -33,21 +44,214 @@ TB* TB::globalInstance()
 }
 
 TB::TB()
-    : m_enabled(false)
+    : m_enabled(false),
+    m_mask(0),
+    m_hits(0),
+    m_misses(0),
+    m_preloadMode(PreloadOff),
+    m_prefetching(false)
 {
 }
 
 TB::~TB()
 {
+    releaseTables();
 }
 
 void TB::reset()
 {
+    releaseTables();
+
     // FIXME: Fathom does not reset this!!
     TB_LARGEST = 0;
     const QString path = Options::globalInstance()->option("SyzygyPath").value();
+#if defined(Q_OS_WIN)
+    m_paths = path.split(';');
+#else
+    m_paths = path.split(':');
+#endif
+    const QString preload = Options::globalInstance()->option("SyzygyPreload").value();
+    m_preloadMode = preload == QLatin1String("lock") ? PreloadLock :
+        preload == QLatin1String("willneed") ? PreloadWillNeed : PreloadOff;
     bool success = tb_init(path.toLatin1().constData());
     m_enabled = success && TB_LARGEST;
+
+    // The tables may have changed so start the cache afresh
+    quint64 size = Options::globalInstance()->option("TBCacheSize").value().toULongLong();
+    quint64 entries = 1;
+    while (entries * 2 <= size)
+        entries *= 2;
+    m_cache = std::vector<std::atomic<quint64>>(m_enabled && size ? size_t(entries) : 0);
+    m_mask = entries - 1;
+    m_hits = 0;
+    m_misses = 0;
+}
+
+MemoryUsage TB::cacheMemory() const
+{
+    // Allocated in full when the tables are found so every entry counts as used
+    MemoryUsage usage;
+    usage.reserved = m_cache.size() * sizeof(std::atomic<quint64>);
+    usage.used = usage.reserved;
+    usage.peak = usage.reserved;
+    return usage;
+}
+
+TB::Probe TB::cachedProbe(quint64 hash) const
+{
+    if (m_cache.empty())
+        return NotFound;
+
+    const quint64 entry = m_cache[size_t(hash & m_mask)].load(std::memory_order_relaxed);
+    if ((entry & ~quint64(3)) != (hash & ~quint64(3)))
+        return NotFound;
+    return Probe(entry & 3);
+}
+
+void TB::storeProbe(quint64 hash, Probe result) const
+{
+    if (m_cache.empty() || result == NotFound)
+        return;
+
+    m_cache[size_t(hash & m_mask)].store((hash & ~quint64(3)) | quint64(result), std::memory_order_relaxed);
+}
+
+static QString materialOfArmy(int queens, int rooks, int bishops, int knights, int pawns)
+{
+    return QLatin1String("K") + QString(queens, 'Q') + QString(rooks, 'R') + QString(bishops, 'B')
+        + QString(knights, 'N') + QString(pawns, 'P');
+}
+
+static int countOf(const Game::Position &p, Chess::Army army, Chess::PieceType piece)
+{
+    return (p.board(army) & p.board(piece)).count();
+}
+
+// Every material one army can reach by losing pieces or promoting pawns to queens, together
+// with how many pieces each has
+static QHash<QString, int> reachableMaterial(const Game::Position &p, Chess::Army army)
+{
+    const int queens = countOf(p, army, Chess::Queen);
+    const int rooks = countOf(p, army, Chess::Rook);
+    const int bishops = countOf(p, army, Chess::Bishop);
+    const int knights = countOf(p, army, Chess::Knight);
+    const int pawns = countOf(p, army, Chess::Pawn);
+
+    QHash<QString, int> material;
+    for (int pa = 0; pa <= pawns; ++pa)
+    for (int promoted = 0; promoted <= pawns - pa; ++promoted)
+    for (int q = 0; q <= queens + promoted; ++q)
+    for (int r = 0; r <= rooks; ++r)
+    for (int b = 0; b <= bishops; ++b)
+    for (int n = 0; n <= knights; ++n)
+        material.insert(materialOfArmy(q, r, b, n, pa), 1 + q + r + b + n + pa);
+    return material;
+}
+
+void TB::preload(const Game::Position &root)
+{
+    if (!m_enabled || m_preloadMode == PreloadOff)
+        return;
+
+    const int pieces = BitBoard(root.m_whitePositionBoard | root.m_blackPositionBoard).count();
+    if (pieces > int(TB_LARGEST) + PREFETCH_DISTANCE)
+        return;
+
+    // The files are named with either army first so both are tried
+    const QHash<QString, int> white = reachableMaterial(root, Chess::White);
+    const QHash<QString, int> black = reachableMaterial(root, Chess::Black);
+    QStringList tables;
+    {
+        QMutexLocker locker(&m_preloadMutex);
+        for (const QString &w : white.keys()) {
+            for (const QString &b : black.keys()) {
+                const int count = white.value(w) + black.value(b);
+                if (count < 3 || count > int(TB_LARGEST))
+                    continue;
+                const QStringList names = { w + QLatin1String("v") + b, b + QLatin1String("v") + w };
+                for (const QString &name : names) {
+                    if (!m_preloaded.contains(name) && !tables.contains(name))
+                        tables.append(name);
+                }
+            }
+        }
+    }
+
+    if (tables.isEmpty())
+        return;
+
+    // The first probes are about to happen so there is no point in going to the background,
+    // otherwise the search is not held up by a prefetch that is still going
+    if (pieces <= int(TB_LARGEST)) {
+        preloadTables(tables);
+    } else {
+        // Sessions of the server may get here at the same time and only one starts a prefetch
+        bool idle = false;
+        if (!m_prefetching.compare_exchange_strong(idle, true))
+            return;
+        if (m_prefetch.joinable())
+            m_prefetch.join();
+        m_prefetch = std::thread([this, tables]() {
+            preloadTables(tables);
+            m_prefetching = false;
+        });
+    }
+}
+
+void TB::preloadTables(const QStringList &tables)
+{
+    for (const QString &table : tables) {
+        Mapping mapping = { nullptr, 0 };
+#if defined(Q_OS_UNIX)
+        for (const QString &path : m_paths) {
+            if (path.isEmpty())
+                continue;
+            const QString file = QDir(path).filePath(table + QLatin1String(".rtbw"));
+            const int fd = open(file.toLocal8Bit().constData(), O_RDONLY);
+            if (fd == -1)
+                continue;
+
+            struct stat statbuf;
+            if (!fstat(fd, &statbuf) && statbuf.st_size > 0) {
+                void *data = mmap(nullptr, size_t(statbuf.st_size), PROT_READ, MAP_SHARED, fd, 0);
+                if (data != MAP_FAILED) {
+                    // Fathom maps the same file so the pages warmed or pinned here serve it
+                    mapping = { data, size_t(statbuf.st_size) };
+                    madvise(data, mapping.size, MADV_WILLNEED);
+                    if (m_preloadMode == PreloadLock && mlock(data, mapping.size))
+                        qWarning() << "Could not lock" << file << "in memory";
+                }
+            }
+            close(fd);
+            break;
+        }
+#endif
+        // A prefetch still going in the background may have got to the table first
+        QMutexLocker locker(&m_preloadMutex);
+        if (!m_preloaded.contains(table)) {
+            m_preloaded.insert(table, mapping);
+            continue;
+        }
+#if defined(Q_OS_UNIX)
+        if (mapping.data)
+            munmap(mapping.data, mapping.size);
+#endif
+    }
+}
+
+void TB::releaseTables()
+{
+    if (m_prefetch.joinable())
+        m_prefetch.join();
+
+    QMutexLocker locker(&m_preloadMutex);
+#if defined(Q_OS_UNIX)
+    for (const Mapping &mapping : m_preloaded.values()) {
+        if (mapping.data)
+            munmap(mapping.data, mapping.size);
+    }
+#endif
+    m_preloaded.clear();
 }
 
 TB::Probe wdlToProbeResult(unsigned wdl)
@@ -108,22 +312,31 @@ TB::Probe TB::probe(const Game &game, const Game::Position &p) const
     if (unsigned(BitBoard(p.m_whitePositionBoard | p.m_blackPositionBoard).count()) > TB_LARGEST)
         return NotFound;
 
+    const Probe cached = cachedProbe(p.positionHash());
+    if (cached != NotFound) {
+        m_hits.fetch_add(1, std::memory_order_relaxed);
+        return cached;
+    }
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+
     const quint8 enpassant = !p.m_enPassantTarget.isValid() ? 0 : p.m_enPassantTarget.data();
 
-    const unsigned result = tb_probe_wdl(
+    const unsigned wdl = tb_probe_wdl(
         p.m_whitePositionBoard.data(),
         p.m_blackPositionBoard.data(),
-        p.m_kingsBoard.data(),
-        p.m_queensBoard.data(),
-        p.m_rooksBoard.data(),
-        p.m_bishopsBoard.data(),
-        p.m_knightsBoard.data(),
-        p.m_pawnsBoard.data(),
+        p.board(Chess::King).data(),
+        p.board(Chess::Queen).data(),
+        p.board(Chess::Rook).data(),
+        p.board(Chess::Bishop).data(),
+        p.board(Chess::Knight).data(),
+        p.board(Chess::Pawn).data(),
         0 /*half move clock*/,
         0 /*castling rights*/,
         enpassant,
         p.m_activeArmy == Chess::White);
-    return wdlToProbeResult(result);
+    const Probe result = wdlToProbeResult(wdl);
+    storeProbe(p.positionHash(), result);
+    return result;
 }
 
 TB::Probe TB::probeDTZ(const Game &game, const Game::Position &p, Move *suggestedMove,
@@ -144,12 +357,12 @@ TB::Probe TB::probeDTZ(const Game &game, const Game::Position &p, Move *suggeste
     const unsigned result = tb_probe_root(
         p.m_whitePositionBoard.data(),
         p.m_blackPositionBoard.data(),
-        p.m_kingsBoard.data(),
-        p.m_queensBoard.data(),
-        p.m_rooksBoard.data(),
-        p.m_bishopsBoard.data(),
-        p.m_knightsBoard.data(),
-        p.m_pawnsBoard.data(),
+        p.board(Chess::King).data(),
+        p.board(Chess::Queen).data(),
+        p.board(Chess::Rook).data(),
+        p.board(Chess::Bishop).data(),
+        p.board(Chess::Knight).data(),
+        p.board(Chess::Pawn).data(),
         unsigned(game.halfMoveClock()),
         0 /*castling rights*/,
         enpassant,
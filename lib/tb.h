@@ -21,9 +21,17 @@
 #ifndef TB_H
 #define TB_H
 
+#include <QHash>
+#include <QMutex>
+#include <QStringList>
 #include <QtGlobal>
 
+#include <atomic>
+#include <thread>
+#include <vector>
+
 #include "game.h"
+#include "memoryreport.h"
 
 class TB {
 public:
@@ -43,10 +51,47 @@ public:
     Probe probe(const Game &game, const Game::Position &p) const;
     Probe probeDTZ(const Game &game, const Game::Position &p, Move *suggestedMove, int *dtz) const;
 
+    // Brings the wdl tables reachable from the root's material into memory ahead of the probes,
+    // right away once the root is in range and in the background while it is still approaching
+    void preload(const Game::Position &root);
+
+    // The wdl results already probed, shared between threads without a lock
+    quint64 cacheHits() const { return m_hits.load(std::memory_order_relaxed); }
+    quint64 cacheMisses() const { return m_misses.load(std::memory_order_relaxed); }
+    MemoryUsage cacheMemory() const;
+
 private:
     TB();
     ~TB();
+    Probe cachedProbe(quint64 hash) const;
+    void storeProbe(quint64 hash, Probe result) const;
+    void preloadTables(const QStringList &tables);
+    void releaseTables();
+
+    enum PreloadMode {
+        PreloadOff,
+        PreloadWillNeed,
+        PreloadLock
+    };
+
+    struct Mapping {
+        void *data;
+        size_t size;
+    };
+
     bool m_enabled;
+    // Each entry holds the position hash with its low two bits replaced by the result so a
+    // single word is read or written and an empty entry never matches
+    mutable std::vector<std::atomic<quint64>> m_cache;
+    quint64 m_mask;
+    mutable std::atomic<quint64> m_hits;
+    mutable std::atomic<quint64> m_misses;
+    PreloadMode m_preloadMode;
+    QStringList m_paths;
+    QMutex m_preloadMutex;
+    QHash<QString, Mapping> m_preloaded; // also holds the tables not found as null mappings
+    std::thread m_prefetch;
+    std::atomic<bool> m_prefetching;
     friend class MyTB;
 };
 
@@ -0,0 +1,177 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+
+#include "threadaffinity.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QStringList>
+
+#include <algorithm>
+
+#if !defined(NO_CUDA)
+#include "neural/loader.h"
+#endif
+
+#if defined(Q_OS_LINUX)
+#include <sched.h>
+#elif defined(Q_OS_WIN)
+#include <windows.h>
+#endif
+
+Q_GLOBAL_STATIC(ThreadAffinity, s_threadAffinity)
+ThreadAffinity *ThreadAffinity::globalInstance()
+{
+    return s_threadAffinity();
+}
+
+QVector<int> ThreadAffinity::cpus(const QString &list, int device)
+{
+    if (list.trimmed() == QLatin1String("gpu"))
+        return cpusLocalToDevice(device);
+    return parseCpuList(list);
+}
+
+QVector<int> ThreadAffinity::parseCpuList(const QString &list)
+{
+    QVector<int> result;
+    const QStringList ranges = list.split(',', QString::SkipEmptyParts);
+    for (const QString &range : ranges) {
+        const QStringList ends = range.trimmed().split('-');
+        bool firstOk = false;
+        bool lastOk = false;
+        const int first = ends.first().toInt(&firstOk);
+        const int last = ends.count() == 2 ? ends.last().toInt(&lastOk) : first;
+        if (ends.count() > 2 || !firstOk || (ends.count() == 2 && !lastOk) || first < 0 || last < first)
+            return QVector<int>();
+        for (int cpu = first; cpu <= last; ++cpu) {
+            if (!result.contains(cpu))
+                result.append(cpu);
+        }
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+QVector<int> ThreadAffinity::cpusLocalToDevice(int device)
+{
+#if defined(NO_CUDA) || !defined(Q_OS_LINUX)
+    Q_UNUSED(device);
+    return QVector<int>();
+#else
+    // The kernel lists the cpus of the NUMA node the PCIe root of the card hangs off
+    const QString busId = QString::fromStdString(lczero::cudaDeviceBusId(device)).toLower();
+    if (busId.isEmpty())
+        return QVector<int>();
+    QFile file(QString("/sys/bus/pci/devices/%0/local_cpulist").arg(busId));
+    if (!file.open(QIODevice::ReadOnly))
+        return QVector<int>();
+    return parseCpuList(QString::fromLatin1(file.readAll()).trimmed());
+#endif
+}
+
+QString ThreadAffinity::toCpuList(const QVector<int> &cpus)
+{
+    QStringList ranges;
+    for (int i = 0; i < cpus.count();) {
+        int j = i;
+        while (j + 1 < cpus.count() && cpus.at(j + 1) == cpus.at(j) + 1)
+            ++j;
+        ranges.append(i == j ? QString::number(cpus.at(i))
+            : QString("%0-%1").arg(cpus.at(i)).arg(cpus.at(j)));
+        i = j + 1;
+    }
+    return ranges.join(',');
+}
+
+QThread::Priority ThreadAffinity::priority(const QString &name)
+{
+    if (name == QLatin1String("idle"))
+        return QThread::IdlePriority;
+    if (name == QLatin1String("lowest"))
+        return QThread::LowestPriority;
+    if (name == QLatin1String("low"))
+        return QThread::LowPriority;
+    if (name == QLatin1String("normal"))
+        return QThread::NormalPriority;
+    if (name == QLatin1String("high"))
+        return QThread::HighPriority;
+    if (name == QLatin1String("highest"))
+        return QThread::HighestPriority;
+    if (name == QLatin1String("timecritical"))
+        return QThread::TimeCriticalPriority;
+    return QThread::InheritPriority;
+}
+
+static bool pinCurrentThread(const QVector<int> &cpus)
+{
+#if defined(Q_OS_LINUX)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    return !sched_setaffinity(0 /*calling thread*/, sizeof(set), &set);
+#elif defined(Q_OS_WIN)
+    DWORD_PTR mask = 0;
+    for (int cpu : cpus) {
+        if (cpu < int(sizeof(DWORD_PTR) * 8))
+            mask |= DWORD_PTR(1) << cpu;
+    }
+    return mask && SetThreadAffinityMask(GetCurrentThread(), mask);
+#else
+    Q_UNUSED(cpus);
+    return false;
+#endif
+}
+
+void ThreadAffinity::applyToCurrentThread(const QString &cpuList, const QString &priority, int device)
+{
+    QThread *thread = QThread::currentThread();
+    const QThread::Priority p = ThreadAffinity::priority(priority);
+    if (p != QThread::InheritPriority)
+        thread->setPriority(p);
+
+    const QVector<int> pinned = cpus(cpuList, device);
+    bool isPinned = false;
+    if (!pinned.isEmpty()) {
+        isPinned = pinCurrentThread(pinned);
+        if (!isPinned)
+            qWarning() << "Could not pin" << thread->objectName() << "to the cpus" << toCpuList(pinned);
+    } else if (!cpuList.isEmpty()) {
+        qWarning() << "No cpus to pin" << thread->objectName() << "to in" << cpuList;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    m_layout.insert(thread->objectName(), QString("cpus %0 priority %1")
+        .arg(isPinned ? toCpuList(pinned) : QLatin1String("any"))
+        .arg(p != QThread::InheritPriority ? priority : QLatin1String("inherit")));
+}
+
+QString ThreadAffinity::toString() const
+{
+    QMutexLocker locker(&m_mutex);
+    QStringList lines;
+    for (auto it = m_layout.constBegin(); it != m_layout.constEnd(); ++it)
+        lines.append(QString(it.key()).replace(' ', '_') + ' ' + it.value());
+    return lines.join('\n');
+}
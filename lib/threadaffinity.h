@@ -0,0 +1,58 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+
+#ifndef THREADAFFINITY_H
+#define THREADAFFINITY_H
+
+#include <QMap>
+#include <QMutex>
+#include <QString>
+#include <QThread>
+#include <QVector>
+
+// Pins the threads of the engine to sets of cpus and gives them their priority, keeping where
+// each of them went for "debug threads"
+class ThreadAffinity {
+public:
+    static ThreadAffinity *globalInstance();
+
+    // The cpus of a list like "0-3,8" or, for "gpu", those local to the GPU of the cuda device.
+    // Empty where the list does not parse or the cpus are not known.
+    static QVector<int> cpus(const QString &list, int device = 0);
+    static QVector<int> parseCpuList(const QString &list);
+    static QVector<int> cpusLocalToDevice(int device);
+    static QString toCpuList(const QVector<int> &cpus); // the shortest list that parses back
+
+    // By the names of the priority options
+    static QThread::Priority priority(const QString &name);
+
+    // Applies to the calling thread and records the layout under its object name. The cpus are
+    // left to the scheduler where the list is empty or pinning is not supported here.
+    void applyToCurrentThread(const QString &cpuList, const QString &priority, int device = 0);
+
+    QString toString() const; // a line of "name cpus priority" for every thread applied to
+
+private:
+    mutable QMutex m_mutex;
+    QMap<QString, QString> m_layout;
+};
+
+#endif // THREADAFFINITY_H
@@ -0,0 +1,62 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+// Named NVTX ranges around the phases of the search and the layers of the network so that nsys
+// lines them up with the kernels they launch. Defined by building with CONFIG+=nvtx, otherwise
+// the ranges compile away.
+#if defined(USE_NVTX)
+#include <nvToolsExt.h>
+
+#include <cstdio>
+
+class TraceRange {
+public:
+    TraceRange(const char *name)
+    {
+        nvtxRangePushA(name);
+    }
+
+    TraceRange(const char *name, unsigned long long id, int size)
+    {
+        char message[64];
+        snprintf(message, sizeof(message), "%s %llu size %d", name, id, size);
+        nvtxRangePushA(message);
+    }
+
+    ~TraceRange()
+    {
+        nvtxRangePop();
+    }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// Both cover the rest of the enclosing scope
+#define TRACE_RANGE(name) TraceRange TRACE_CONCAT(traceRange, __LINE__)(name)
+#define TRACE_BATCH(name, id, size) TraceRange TRACE_CONCAT(traceRange, __LINE__)(name, id, size)
+#else
+#define TRACE_RANGE(name)
+#define TRACE_BATCH(name, id, size)
+#endif
+
+#endif // TRACE_H
@@ -19,3 +19,426 @@
 */
 
 #include "tree.h"
+
+#include <QFile>
+#include <QHash>
+#include <QSaveFile>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// The records are written as they are laid out in memory, so a checkpoint is only read back by a
+// build that lays them out the same way
+namespace {
+
+const char s_magic[8] = { 'A', 'l', 'l', 'i', 'e', 'T', 'r', 'e' };
+enum { CheckpointVersion = 2 };
+
+struct CheckpointHeader {
+    char magic[8];
+    quint32 version;
+    quint16 gameBytes;
+    quint16 positionBytes;
+    quint16 potentialBytes;
+    quint16 padding;
+    quint64 rootPositionHash;
+    quint64 nodes;
+    quint64 positions;
+    quint64 potentials;
+};
+
+// Followed by the positions in the order the nodes first refer to them, then their potentials one
+// after the other and last the nodes in preorder, each with the number of its children
+struct PositionRecord {
+    char position[sizeof(Game::Position)];
+    float qValue;
+    quint32 visits;
+    float smallValue;
+    quint16 potentials;
+    quint16 sorted;
+    quint8 type;
+    quint8 evictionCredit;
+    quint8 isUnique;
+    quint8 hasSmallValue;
+};
+
+struct NodeRecord {
+    char game[sizeof(Game)];
+    quint32 position;
+    quint32 children;
+    quint32 visited;
+    float qValue;
+    float pValue;
+    float policySum;
+    float uCoeff;
+    quint8 potentialIndex;
+    quint8 gameCycles;
+    quint8 type;
+    quint8 context;
+    quint8 bestChild;
+    quint8 isDirty;
+    quint8 padding[2];
+};
+
+}
+
+bool Tree::compact()
+{
+    if (!m_root)
+        return false;
+
+    // Breadth first so the upper tree every descent goes through is packed together at the front
+    // and the children of a node, which are scored together, are next to each other. The links
+    // are kept as the handles the nodes will have, which is one more than their index.
+    struct Links {
+        quint32 parent;
+        quint32 firstChild;
+        quint32 nextSibling;
+    };
+    Cache &cache = *Cache::globalInstance();
+    std::vector<quint32> handles;
+    std::vector<Links> links;
+    handles.reserve(size_t(cache.used()));
+    links.reserve(size_t(cache.used()));
+    auto order = [&](quint32 rootHandle) {
+        handles.push_back(rootHandle);
+        links.push_back(Links { 0, 0, 0 });
+        for (size_t i = handles.size() - 1; i < handles.size(); ++i) {
+            quint32 previous = 0;
+            for (quint32 handle = cache.node(handles[i])->m_firstChild; handle;
+                handle = cache.node(handle)->m_nextSibling) {
+                const quint32 next = quint32(handles.size() + 1);
+                handles.push_back(handle);
+                links.push_back(Links { quint32(i + 1), 0, 0 });
+                if (previous)
+                    links[previous - 1].nextSibling = next;
+                else
+                    links[i].firstChild = next;
+                previous = next;
+            }
+        }
+    };
+
+    order(m_rootHandle);
+    const quint32 parkedRootHandle = quint32(handles.size() + 1);
+    if (m_parkedRoot)
+        order(m_parkedRootHandle);
+
+    if (quint64(handles.size()) != cache.used())
+        return false;
+
+    cache.compactNodes(&handles);
+    for (size_t i = 0; i < links.size(); ++i) {
+        Node *node = cache.node(quint32(i + 1));
+        node->m_parent = links[i].parent ? cache.node(links[i].parent) : nullptr;
+        node->m_firstChild = links[i].firstChild;
+        node->m_nextSibling = links[i].nextSibling;
+    }
+
+    m_rootHandle = 1;
+    m_root = cache.node(m_rootHandle);
+    if (m_parkedRoot) {
+        m_parkedRootHandle = parkedRootHandle;
+        m_parkedRoot = cache.node(m_parkedRootHandle);
+    }
+
+#if defined(DEBUG_RESUME)
+    int total = 0;
+    validateTree(m_root, &total);
+    if (m_parkedRoot)
+        validateTree(m_parkedRoot, &total);
+    Q_ASSERT(cache.used() == quint64(total));
+    qDebug() << "Compacted" << total << "reused nodes.";
+#endif
+    return true;
+}
+
+bool Tree::save(const QString &fileName, QString *error) const
+{
+    if (!m_root) {
+        *error = QLatin1String("there is no tree to save");
+        return false;
+    }
+
+    // Number the positions and gather the nodes in preorder, keeping the order of the children
+    Cache &cache = *Cache::globalInstance();
+    std::vector<const Node*> nodes;
+    std::vector<const Node::Position*> positions;
+    QHash<const Node::Position*, quint32> positionIndex;
+    quint64 potentials = 0;
+    std::vector<const Node*> stack;
+    stack.push_back(m_root);
+    while (!stack.empty()) {
+        const Node *node = stack.back();
+        stack.pop_back();
+        nodes.push_back(node);
+        if (!positionIndex.contains(node->m_position)) {
+            positionIndex.insert(node->m_position, quint32(positions.size()));
+            positions.push_back(node->m_position);
+            potentials += quint64(node->m_position->m_potentials.count());
+        }
+
+        const size_t first = stack.size();
+        for (quint32 handle = node->m_firstChild; handle; handle = cache.node(handle)->m_nextSibling)
+            stack.push_back(cache.node(handle));
+        std::reverse(stack.begin() + qint64(first), stack.end());
+    }
+
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        *error = file.errorString();
+        return false;
+    }
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, s_magic, sizeof(s_magic));
+    header.version = CheckpointVersion;
+    header.gameBytes = sizeof(Game);
+    header.positionBytes = sizeof(Game::Position);
+    header.potentialBytes = sizeof(Node::Potential);
+    header.rootPositionHash = m_root->m_position->position().positionHash();
+    header.nodes = nodes.size();
+    header.positions = positions.size();
+    header.potentials = potentials;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    for (const Node::Position *position : positions) {
+        PositionRecord record;
+        memset(&record, 0, sizeof(record));
+        memcpy(record.position, &position->m_position, sizeof(Game::Position));
+        record.qValue = position->m_qValue;
+        record.visits = position->m_visits;
+        record.potentials = quint16(position->m_potentials.count());
+        record.sorted = quint16(position->m_potentials.sorted());
+        record.hasSmallValue = position->m_potentials.hasSmallValue();
+        if (record.hasSmallValue)
+            record.smallValue = position->m_potentials.smallValue();
+        record.type = position->m_type;
+        record.evictionCredit = position->m_evictionCredit;
+        record.isUnique = position->m_isUnique;
+        file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    }
+
+    for (const Node::Position *position : positions) {
+        file.write(reinterpret_cast<const char*>(position->m_potentials.data()),
+            qint64(position->m_potentials.count()) * qint64(sizeof(Node::Potential)));
+    }
+
+    for (const Node *node : nodes) {
+        NodeRecord record;
+        memset(&record, 0, sizeof(record));
+        memcpy(record.game, &node->m_game, sizeof(Game));
+        record.position = positionIndex.value(node->m_position);
+        record.children = quint32(node->childCount());
+        record.visited = node->m_visited;
+        record.qValue = node->m_qValue;
+        record.pValue = node->m_pValue;
+        record.policySum = node->m_policySum;
+        record.uCoeff = node->m_uCoeff;
+        record.potentialIndex = node->m_potentialIndex;
+        record.gameCycles = node->m_gameCycles;
+        record.type = node->m_type;
+        record.context = node->m_context;
+        record.bestChild = node->m_bestChild;
+        record.isDirty = node->m_isDirty;
+        file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    }
+
+    if (!file.commit()) {
+        *error = file.errorString();
+        return false;
+    }
+    return true;
+}
+
+bool Tree::restore(const QString &fileName, QString *error)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        *error = file.errorString();
+        return false;
+    }
+
+    // Mapped rather than read so the records are built into the cache straight from the page cache
+    const qint64 size = file.size();
+    const uchar *data = size >= qint64(sizeof(CheckpointHeader)) ? file.map(0, size) : nullptr;
+    if (!data) {
+        *error = QLatin1String("the file is not a tree checkpoint");
+        return false;
+    }
+
+    CheckpointHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, s_magic, sizeof(s_magic)) || header.version != CheckpointVersion) {
+        *error = QLatin1String("the file is not a tree checkpoint");
+        return false;
+    }
+
+    if (header.gameBytes != sizeof(Game) || header.positionBytes != sizeof(Game::Position)
+        || header.potentialBytes != sizeof(Node::Potential)) {
+        *error = QLatin1String("the checkpoint was written by an incompatible build");
+        return false;
+    }
+
+    const quint64 expected = sizeof(CheckpointHeader) + header.positions * sizeof(PositionRecord)
+        + header.potentials * sizeof(Node::Potential) + header.nodes * sizeof(NodeRecord);
+    if (!header.nodes || quint64(size) != expected) {
+        *error = QLatin1String("the checkpoint is truncated");
+        return false;
+    }
+
+    const StandaloneGame rootGame = History::globalInstance()->currentGame();
+    if (header.rootPositionHash != rootGame.position().positionHash()) {
+        *error = QLatin1String("the checkpoint is of a different position");
+        return false;
+    }
+
+    Cache &cache = *Cache::globalInstance();
+    if (header.nodes > cache.size() - cache.used() + (m_root ? quint64(m_root->count()) + 1 : 0)) {
+        *error = QString("the checkpoint needs room for %0 nodes").arg(header.nodes);
+        return false;
+    }
+
+    clearRoot(false /*resumeIfPossible*/);
+
+    const PositionRecord *positionRecords = reinterpret_cast<const PositionRecord*>(data + sizeof(header));
+    const Node::Potential *potentialRecords = reinterpret_cast<const Node::Potential*>(positionRecords + header.positions);
+    const NodeRecord *nodeRecords = reinterpret_cast<const NodeRecord*>(potentialRecords + header.potentials);
+
+    // Where the potentials of each position begin
+    std::vector<quint64> potentialOffsets(size_t(header.positions));
+    quint64 offset = 0;
+    for (quint64 i = 0; i < header.positions; ++i) {
+        potentialOffsets[size_t(i)] = offset;
+        offset += positionRecords[i].potentials;
+    }
+    if (offset != header.potentials) {
+        *error = QLatin1String("the checkpoint is corrupt");
+        return false;
+    }
+
+    // The positions are made as the first node refers to them and are referenced right away, so
+    // that making the next one can never evict them
+    std::vector<Node::Position*> positions(size_t(header.positions), nullptr);
+
+    struct Pending {
+        Node *node;
+        quint32 remaining;
+        quint32 lastChild;
+    };
+    std::vector<Pending> stack;
+    bool ok = true;
+    for (quint64 i = 0; i < header.nodes && ok; ++i) {
+        const NodeRecord &record = nodeRecords[i];
+        while (!stack.empty() && !stack.back().remaining)
+            stack.pop_back();
+        if (i && stack.empty()) {
+            ok = false; // more nodes than the root has descendants
+            break;
+        }
+        if (record.position >= header.positions) {
+            ok = false;
+            break;
+        }
+
+        quint32 handle = 0;
+        Node *node = cache.newNode(&handle);
+        if (!node) {
+            ok = false;
+            break;
+        }
+
+        Node *parent = stack.empty() ? nullptr : stack.back().node;
+        if (parent) {
+            Game game;
+            memcpy(static_cast<void*>(&game), record.game, sizeof(Game));
+            node->initialize(parent, game);
+        } else {
+            node->initialize(nullptr, rootGame);
+        }
+
+        Node::Position *position = positions[record.position];
+        if (!position) {
+            const PositionRecord &p = positionRecords[record.position];
+            Game::Position gamePosition;
+            memcpy(static_cast<void*>(&gamePosition), p.position, sizeof(Game::Position));
+            const quint64 hash = gamePosition.positionHash();
+            if (!p.isUnique && cache.containsNodePosition(hash))
+                cache.nodePositionMakeUnique(hash);
+            position = cache.newNodePosition(hash, p.isUnique);
+            if (!position) {
+                cache.unlinkNode(handle);
+                ok = false;
+                break;
+            }
+            position->initialize(gamePosition);
+            position->m_qValue = p.qValue;
+            position->m_visits = p.visits;
+            position->m_type = Node::Type(p.type);
+            position->m_evictionCredit = p.evictionCredit;
+            const Node::Potential *potential = potentialRecords + potentialOffsets[record.position];
+            position->m_potentials.reserve(p.potentials, cache.potentialPool());
+            for (int j = 0; j < p.potentials; ++j)
+                position->m_potentials.append(potential[j]);
+            if (p.potentials) {
+                position->m_potentials.setSorted(p.sorted);
+                if (p.hasSmallValue)
+                    position->m_potentials.setSmallValue(p.smallValue);
+            }
+            positions[record.position] = position;
+        }
+        node->setPosition(position);
+
+        node->m_visited = record.visited;
+        node->m_qValue = record.qValue;
+        node->m_pValue = record.pValue;
+        node->m_policySum = record.policySum;
+        node->m_uCoeff = record.uCoeff;
+        node->m_potentialIndex = record.potentialIndex;
+        node->m_gameCycles = record.gameCycles;
+        node->m_type = Node::Type(record.type);
+        node->m_context = Node::Context(record.context);
+        node->m_bestChild = record.bestChild;
+        node->m_isDirty = record.isDirty;
+
+        // Linked straight after the last child rather than walking the list for every child
+        if (parent) {
+            Pending &pending = stack.back();
+            if (pending.lastChild)
+                cache.node(pending.lastChild)->m_nextSibling = handle;
+            else
+                parent->m_firstChild = handle;
+            pending.lastChild = handle;
+            --pending.remaining;
+        } else {
+            m_root = node;
+            m_rootHandle = handle;
+        }
+
+        if (record.children)
+            stack.push_back({ node, record.children, 0 });
+    }
+
+    while (ok && !stack.empty() && !stack.back().remaining)
+        stack.pop_back();
+
+    int total = 0;
+    if (ok && stack.empty()) {
+        m_root->setAsRootNode();
+        validateTree(m_root, &total);
+    }
+
+    if (!ok || !stack.empty() || quint64(total) != header.nodes) {
+        if (m_root)
+            cache.unlinkNode(m_rootHandle);
+        m_root = nullptr;
+        m_rootHandle = 0;
+        *error = QLatin1String("the checkpoint is corrupt or does not fit in the cache");
+        return false;
+    }
+
+    m_isRestored = true;
+    return true;
+}
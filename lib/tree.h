@@ -35,15 +35,39 @@ public:
 
     Node *embodiedRoot();
     void reset();
-    void clearRoot(bool resumeIfPossible = true);
+    // Keeping siblings parks the position the new root was reached from so that a different reply
+    // than the one pondered on can still resume from it
+    void clearRoot(bool resumeIfPossible = true, bool keepSiblings = false);
     static void validateTree(Node *node, int *total);
 
+    // Moves the nodes of the tree, which are scattered over the arena after it was reused, to the
+    // front of it breadth first. Only when the tree holds every node of the cache as otherwise
+    // the front is not ours to move into; returns whether it did.
+    bool compact();
+
+    // Checkpoints the tree under the root along with its positions and their potentials to a file
+    // of fixed size records, and restores it into the cache in place of our tree for a root at the
+    // same position. The restored root is kept by the next search of that position.
+    bool save(const QString &fileName, QString *error) const;
+    bool restore(const QString &fileName, QString *error);
+
 private:
+    void clearParkedRoot();
+    Node *findDescendant(Node *from, quint32 *handle, Node **parent, quint32 *parentHandle) const;
+
     Node *m_root;
+    quint32 m_rootHandle;
+    Node *m_parkedRoot;
+    quint32 m_parkedRootHandle;
+    bool m_isRestored;
 };
 
 inline Tree::Tree()
-    : m_root(nullptr)
+    : m_root(nullptr),
+    m_rootHandle(0),
+    m_parkedRoot(nullptr),
+    m_parkedRootHandle(0),
+    m_isRestored(false)
 {
 }
 
@@ -55,6 +79,20 @@ inline Tree::~Tree()
 inline void Tree::reset()
 {
     m_root = nullptr;
+    m_rootHandle = 0;
+    m_parkedRoot = nullptr;
+    m_parkedRootHandle = 0;
+    m_isRestored = false;
+}
+
+inline void Tree::clearParkedRoot()
+{
+    if (!m_parkedRoot)
+        return;
+
+    Cache::globalInstance()->unlinkNode(m_parkedRootHandle);
+    m_parkedRoot = nullptr;
+    m_parkedRootHandle = 0;
 }
 
 inline void Tree::validateTree(Node *node, int *total)
@@ -66,55 +104,135 @@ inline void Tree::validateTree(Node *node, int *total)
     Q_ASSERT(node->position());
     Q_ASSERT(node->position()->refs());
     Q_ASSERT(node->position()->visits());
-    const QVector<Node*> children = *node->children();
+    const QVector<Node*> children = node->children();
     for (Node *child : children)
         validateTree(child, total);
 }
 
-inline void Tree::clearRoot(bool resumeIfPossible)
+inline Node *Tree::findDescendant(Node *from, quint32 *handle, Node **parent, quint32 *parentHandle) const
+{
+    // Find where the position of the old root was played in the game history and walk the
+    // positions played since then down the tree, so any number of moves can be resumed
+    const QVector<StandaloneGame> games = History::globalInstance()->games();
+    const Game::Position &fromPosition = from->m_position->position();
+    int index = qMax(-1, games.count() - 2);
+    for (; index >= 0; --index) {
+        if (games.at(index).position().isSamePosition(fromPosition))
+            break;
+    }
+
+    // Not found means the old root is the starting position which the history does not hold
+    Cache &cache = *Cache::globalInstance();
+    Node *node = from;
+    quint32 nodeHandle = 0;
+    *parent = nullptr;
+    *parentHandle = 0;
+    for (++index; index < games.count(); ++index) {
+        const Game::Position &position = games.at(index).position();
+        Node *next = nullptr;
+        quint32 nextHandle = node->m_firstChild;
+        for (; nextHandle; nextHandle = next->m_nextSibling) {
+            next = cache.node(nextHandle);
+            if (next->m_position && next->m_position->position().isSamePosition(position))
+                break;
+        }
+
+        if (!nextHandle)
+            return nullptr;
+
+        *parent = node;
+        *parentHandle = nodeHandle;
+        node = next;
+        nodeHandle = nextHandle;
+    }
+
+    if (node == from || node->isTrueTerminal())
+        return nullptr;
+
+    *handle = nodeHandle;
+    return node;
+}
+
+inline void Tree::clearRoot(bool resumeIfPossible, bool keepSiblings)
 {
-    const StandaloneGame rootGame = History::globalInstance()->currentGame();
     Cache &cache = *Cache::globalInstance();
 
+    // A restored root is searched further where it was left rather than being resumed from
+    const bool isRestored = m_isRestored;
+    m_isRestored = false;
+    if (isRestored && m_root && resumeIfPossible && m_root->m_position->position().isSamePosition(
+            History::globalInstance()->currentGame().position())) {
+        return;
+    }
+
+    // Unlinking the old root frees only the discarded subtree; the nodes go back on the free list
+    // of the arena so nothing proportional to the size of the arena happens between moves
     if (m_root) {
         if (!resumeIfPossible) {
-            cache.unlinkNode(m_root);
+            cache.unlinkNode(m_rootHandle);
             m_root = nullptr;
+            m_rootHandle = 0;
+            clearParkedRoot();
         } else {
             // Attempt to resume root if possible
             bool foundResume = false;
-            const QVector<Node*> children = *m_root->children();
-            for (Node *child : children) {
-                const QVector<Node*> grandChildren = *child->children();
-                for (Node *grandChild : grandChildren) {
-                    if (grandChild->m_position->position().isSamePosition(rootGame.position()) && !grandChild->isTrueTerminal()) {
-                        grandChild->setAsRootNode();
-                        cache.unlinkNode(m_root);
-                        m_root = grandChild;
-                        foundResume = true;
-                        break;
+            quint32 handle = 0;
+            Node *parent = nullptr;
+            quint32 parentHandle = 0;
+            if (Node *resume = findDescendant(m_root, &handle, &parent, &parentHandle)) {
+                resume->setAsRootNode();
+                clearParkedRoot();
+                if (keepSiblings && parent == m_root) {
+                    m_parkedRoot = m_root;
+                    m_parkedRootHandle = m_rootHandle;
+                } else {
+                    if (keepSiblings && parent) {
+                        parent->setAsRootNode();
+                        m_parkedRoot = parent;
+                        m_parkedRootHandle = parentHandle;
                     }
+                    cache.unlinkNode(m_rootHandle);
+                }
+                m_root = resume;
+                m_rootHandle = handle;
+                foundResume = true;
+            }
+
+            // The opponent did not play the move we pondered on, but the reply might still be
+            // found from the position we parked
+            if (!foundResume && m_parkedRoot) {
+                if (Node *resume = findDescendant(m_parkedRoot, &handle, &parent, &parentHandle)) {
+                    resume->setAsRootNode();
+                    cache.unlinkNode(m_rootHandle);
+                    m_root = resume;
+                    m_rootHandle = handle;
+                    foundResume = true;
                 }
+                clearParkedRoot();
             }
+
             if (!foundResume) {
-                cache.unlinkNode(m_root);
+                cache.unlinkNode(m_rootHandle);
                 m_root = nullptr;
+                m_rootHandle = 0;
             }
         }
     }
 
-    // Resets the used/size of the node arena taking into account reused nodes
-    cache.resetNodes();
+    if (!keepSiblings)
+        clearParkedRoot();
 
 #if defined(DEBUG_RESUME)
     if (m_root) {
         int total = 0;
         validateTree(m_root, &total);
-        Q_ASSERT(cache.used() == total);
+        if (m_parkedRoot)
+            validateTree(m_parkedRoot, &total);
+        Q_ASSERT(cache.used() == quint64(total));
     } else {
         Q_ASSERT(!cache.used());
     }
-    const int sizeAfter = cache.used();
+    const quint64 sizeAfter = cache.used();
     if (sizeAfter)
         qDebug() << "Resume resulted in" << sizeAfter << "reused nodes.";
 #endif
@@ -127,9 +245,9 @@ inline Node *Tree::embodiedRoot()
     if (m_root)
         return m_root;
 
+    // Not asserting an empty cache as the trees of concurrent sessions share it
     Cache &cache = *Cache::globalInstance();
-    Q_ASSERT(!cache.used());
-    m_root = cache.newNode();
+    m_root = cache.newNode(&m_rootHandle);
     Q_ASSERT(m_root);
 
     Node::Position *rootPosition = nullptr;
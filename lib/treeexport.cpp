@@ -0,0 +1,183 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "treeexport.h"
+
+#include <QDataStream>
+#include <QFile>
+#include <QTextStream>
+
+#include "node.h"
+#include "notation.h"
+
+QString TreeExportNode::moveString() const
+{
+    const Move mv = TreeExport::unpackMove(move);
+    return mv.isValid() ? Notation::moveToString(mv, Chess::Computer) : QStringLiteral("start");
+}
+
+QString TreeExportNode::toString() const
+{
+    QString out;
+    QTextStream stream(&out);
+    stream.setRealNumberNotation(QTextStream::FixedNotation);
+    for (int i = 0; i < depth; ++i)
+        stream << qSetFieldWidth(7) << "      |";
+    stream << right << qSetFieldWidth(6) << moveString()
+        << qSetFieldWidth(4) << left << " n: " << qSetFieldWidth(4) << right << visits
+        << qSetFieldWidth(4) << left << " p: " << qSetFieldWidth(5) << qSetRealNumberPrecision(2) << right << pValue * 100 << qSetFieldWidth(1) << left << "%"
+        << qSetFieldWidth(4) << left << " q: " << qSetFieldWidth(8) << qSetRealNumberPrecision(5) << right << qValue
+        << qSetFieldWidth(4) << " v: " << qSetFieldWidth(7) << qSetRealNumberPrecision(4) << right << positionQValue
+        << qSetFieldWidth(4) << " t: " << qSetFieldWidth(2) << right << int(type);
+    for (const QPair<quint16, float> &potential : potentials) {
+        stream << qSetFieldWidth(0) << "\n";
+        for (int i = 0; i <= depth; ++i)
+            stream << qSetFieldWidth(7) << "      |";
+        stream << right << qSetFieldWidth(6) << Notation::moveToString(TreeExport::unpackMove(potential.first), Chess::Computer)
+            << qSetFieldWidth(4) << left << " p: " << qSetFieldWidth(5) << qSetRealNumberPrecision(2) << right << potential.second * 100 << qSetFieldWidth(1) << left << "%";
+    }
+    stream.flush();
+    return out;
+}
+
+quint16 TreeExport::packMove(const Move &move)
+{
+    // As the potentials keep them so castles stay king takes rook, a move never packs to zero
+    return move.isValid() ? Node::Potential::packMove(move) : 0;
+}
+
+Move TreeExport::unpackMove(quint16 move)
+{
+    return Node::Potential::unpackMove(move);
+}
+
+// Of the children with the visits asked for, those yet to be scored having nothing to show
+static const Node *nextIncluded(const Node *node, quint32 minimumVisits)
+{
+    while (node && node->visits() < qMax(quint32(1), minimumVisits))
+        node = node->nextSibling();
+    return node;
+}
+
+bool TreeExport::write(const Node *node, const QString &fileName, int depth, quint32 minimumVisits,
+    bool withPotentials, quint64 *written, QString *error)
+{
+    Q_ASSERT(node);
+    *written = 0;
+    if (!node->visits()) {
+        *error = QLatin1String("the node has not been scored");
+        return false;
+    }
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        *error = file.errorString();
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    stream << quint32(Magic) << quint32(Version) << quint8(withPotentials)
+           << node->game().stateOfGameToFen(&node->position()->position());
+
+    // Depth first through the links of the tree, climbing back up once a subtree is done
+    const Node *top = node;
+    int d = 0;
+    forever {
+        stream << quint16(d)
+               << packMove(node->game().lastMove())
+               << node->visits()
+               << node->qValue()
+               << node->pValue()
+               << node->positionQValue()
+               << quint8(node->type());
+        if (withPotentials) {
+            const Node::PotentialVector *potentials = node->position()->potentials();
+            const int index = node->m_potentialIndex;
+            stream << quint16(qMax(0, potentials->count() - index));
+            for (int i = index; i < potentials->count(); ++i)
+                stream << packMove(potentials->at(i).move()) << potentials->at(i).pValue();
+        }
+        ++(*written);
+
+        const Node *next = d < depth ? nextIncluded(node->firstChild(), minimumVisits) : nullptr;
+        if (next) {
+            ++d;
+        } else {
+            while (node != top && !(next = nextIncluded(node->nextSibling(), minimumVisits))) {
+                node = node->parent();
+                --d;
+            }
+        }
+        if (!next)
+            break;
+        node = next;
+    }
+
+    if (stream.status() != QDataStream::Ok || !file.flush()) {
+        *error = file.errorString();
+        return false;
+    }
+    return true;
+}
+
+bool TreeExport::read(const QString &fileName, QString *fen, QVector<TreeExportNode> *nodes)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    quint32 magic = 0;
+    quint32 version = 0;
+    quint8 withPotentials = 0;
+    stream >> magic >> version;
+    if (magic != Magic || version != Version)
+        return false;
+    stream >> withPotentials >> *fen;
+
+    while (!stream.atEnd()) {
+        TreeExportNode node;
+        stream >> node.depth
+               >> node.move
+               >> node.visits
+               >> node.qValue
+               >> node.pValue
+               >> node.positionQValue
+               >> node.type;
+        if (withPotentials) {
+            quint16 count = 0;
+            stream >> count;
+            node.potentials.resize(count);
+            for (int i = 0; i < count; ++i)
+                stream >> node.potentials[i].first >> node.potentials[i].second;
+        }
+
+        if (stream.status() != QDataStream::Ok)
+            return false;
+        if (nodes->isEmpty() ? node.depth : node.depth > nodes->last().depth + 1)
+            return false;
+        nodes->append(node);
+    }
+    return true;
+}
@@ -0,0 +1,66 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef TREEEXPORT_H
+#define TREEEXPORT_H
+
+#include <QPair>
+#include <QString>
+#include <QVector>
+#include <QtGlobal>
+
+#include "move.h"
+
+class Node;
+
+// One node of an exported tree as read back, depth first so each comes right after its parent
+struct TreeExportNode {
+    quint16 depth = 0;          // below the node the export began at
+    quint16 move = 0;           // packed by TreeExport, zero for the first node
+    quint32 visits = 0;
+    float qValue = 0.0f;
+    float pValue = 0.0f;
+    float positionQValue = 0.0f; // of the network or the exact score
+    quint8 type = 0;            // a Node::Type
+    QVector<QPair<quint16, float>> potentials; // moves not made into children with their policy
+
+    QString moveString() const;
+    QString toString() const; // indented by depth like the tree command
+};
+
+// A compact binary export of the subtree of a stopped search, so that the values and policy a
+// big tree ended up with can be looked into offline. It is written to the file as the tree is
+// walked through the parent and sibling links, which takes nothing from the heap per node.
+class TreeExport {
+public:
+    // Down to the depth and of the children with at least the visits, along with the potentials
+    // left on every node written if asked
+    static bool write(const Node *node, const QString &fileName, int depth, quint32 minimumVisits,
+        bool withPotentials, quint64 *written, QString *error);
+    static bool read(const QString &fileName, QString *fen, QVector<TreeExportNode> *nodes);
+
+    static quint16 packMove(const Move &move); // as a potential packs it, castles included
+    static Move unpackMove(quint16 move);
+
+private:
+    enum { Magic = 0x414c5458 /* ALTX */, Version = 2 };
+};
+
+#endif // TREEEXPORT_H
@@ -21,27 +21,36 @@
 #include "uciengine.h"
 
 #include <QCoreApplication>
-#include <QDateTime>
 #include <QDebug>
-#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
 #include <QStringList>
 #include <QTextStream>
 #include <QTimer>
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
 
 #include "cache.h"
 #include "chess.h"
 #include "clock.h"
+#include "debuglog.h"
 #include "game.h"
 #include "history.h"
+#include "memoryreport.h"
+#include "metrics.h"
 #include "nn.h"
 #include "notation.h"
 #include "options.h"
+#include "replay.h"
 #include "searchengine.h"
+#include "stagetimes.h"
 #include "tb.h"
-
-static bool s_firstLog = true;
+#include "threadaffinity.h"
+#include "tree.h"
+#include "treeexport.h"
 
 //#define DEBUG_TIME
 
@@ -158,28 +167,18 @@ void g_uciMessageHandler(QtMsgType type, const QMessageLogContext &context, cons
         fprintf(stderr, "%s", format.toLatin1().constData());
     }
 
-    const bool debugLog = Options::globalInstance()->option("DebugLog").value() == "true";
-    if (debugLog) {
-        QString logFilePath = QCoreApplication::applicationDirPath() +
-            QDir::separator() + QCoreApplication::applicationName() +
-            "_debug.log";
-        QFile file(logFilePath);
-
-        QIODevice::OpenMode mode = QIODevice::WriteOnly | QIODevice::Text | QIODevice::Append;
-        if (!file.open(mode))
-            return;
-
-        QTextStream log(&file);
-        if (s_firstLog)
-            log << "Output: log pid " << QCoreApplication::applicationPid() << " at "
-                << QDateTime::currentDateTime().toString() << "\n";
-        log << format;
-        s_firstLog = false;
+    // Written by the thread of the log, and right away before a fatal message aborts
+    DebugLog *log = DebugLog::globalInstance();
+    if (log && log->isEnabled()) {
+        log->append(format.toLocal8Bit());
+        if (type == QtFatalMsg)
+            log->flush();
     }
 }
 
 IOWorker::IOWorker(const QString &debugFile, QObject *parent)
-    : QObject(parent)
+    : QObject(parent),
+    m_replay(nullptr)
 {
     if (!debugFile.isEmpty()) {
         QFile file(debugFile);
@@ -191,12 +190,25 @@ IOWorker::IOWorker(const QString &debugFile, QObject *parent)
             file.close();
         }
     }
+
+    if (!m_debugLines.isEmpty() && Options::globalInstance()->contains("ReplayNodes")
+        && Options::globalInstance()->option("ReplayNodes").value() == "true") {
+        m_replay = new Replay;
+    }
+}
+
+IOWorker::~IOWorker()
+{
+    delete m_replay;
 }
 
 void IOWorker::startDebug()
 {
-    if (m_debugLines.isEmpty())
+    if (m_debugLines.isEmpty()) {
+        if (m_replay)
+            m_replay->finish();
         readyRead();
+    }
 
     QVector<QString> input;
 
@@ -216,6 +228,14 @@ void IOWorker::startDebug()
             isInputMode = true;
         }
 
+        // A search replayed for the nodes it searched takes its output from the log and is the
+        // last input before waiting on its bestmove
+        if (isInputMode && m_replay && line.startsWith(QLatin1String("go"))
+            && m_replay->rewriteGo(&line, &m_debugLines, &m_waitingOnOutput)) {
+            input.append(line);
+            break;
+        }
+
         if (isInputMode)
             input.append(line);
         else
@@ -224,6 +244,8 @@ void IOWorker::startDebug()
 
 
     for (QString line : input) {
+        if (m_replay && line == QLatin1String("quit"))
+            m_replay->finish();
         fprintf(stderr, "%s\n", line.toLatin1().constData());
         emit standardInput(line);
     }
@@ -251,6 +273,8 @@ void IOWorker::readyRead()
 
 void IOWorker::readyReadOutput(const QString &output)
 {
+    if (m_replay)
+        m_replay->readOutput(output);
     if ((output.startsWith("bestmove") && m_waitingOnOutput.startsWith("bestmove")) ||
         output == m_waitingOnOutput + "\n") {
         startDebug();
@@ -263,8 +287,13 @@ UciEngine::UciEngine(QObject *parent, const QString &debugFile)
     m_minBatchesForAverage(0),
     m_gameInitialized(false),
     m_pendingBestMove(false),
+    m_pondering(false),
     m_debugFile(debugFile),
     m_searchEngine(nullptr),
+    m_isSession(false),
+    m_sharedStateLoaded(false),
+    m_sharedStateDirty(false),
+    m_sharedStateUsed(false),
     m_clock(new Clock(this)),
     m_ioHandler(nullptr)
 {
@@ -276,6 +305,7 @@ UciEngine::UciEngine(QObject *parent, const QString &debugFile)
 
 UciEngine::~UciEngine()
 {
+    waitForSharedState();
     m_inputThread.quit();
     m_inputThread.wait();
 }
@@ -288,6 +318,13 @@ void UciEngine::readyRead(const QString &line)
         sendId();
         sendOptions();
         sendUciOk();
+
+        // Get a head start on the weights, tablebases and cache of the options given so far
+        if (!m_isSession && !m_sharedStateLoaded
+            && (QFileInfo::exists(Options::globalInstance()->option("WeightsFile").value())
+                || Options::globalInstance()->option("SyntheticNetwork").value() == "true")) {
+            startSharedState();
+        }
     } else if (line.startsWith("debug")) {
         QList<QString> debug = line.split(' ');
         if (debug.count() == 2) {
@@ -295,10 +332,15 @@ void UciEngine::readyRead(const QString &line)
                 SearchSettings::debugInfo = true;
             else if (debug.at(1) == "off")
                 SearchSettings::debugInfo = false;
+            else if (debug.at(1) == "memory")
+                sendMemoryReport();
+            else if (debug.at(1) == "threads")
+                sendThreadReport();
         } else {
             SearchSettings::debugInfo = true;
         }
     } else if (line == QLatin1Literal("isready")) {
+        ensureSharedState();
         sendReadyOk();
     } else if (line.startsWith("setoption")) {
         parseOption(line);
@@ -339,6 +381,16 @@ void UciEngine::readyRead(const QString &line)
     else if (line == QLatin1Literal("board")) {
         const StandaloneGame game = History::globalInstance()->currentGame();
         output(game.stateOfGameToFen() + "\n");
+    } else if (m_isSession && (line.startsWith("savetree ") || line.startsWith("loadtree ")
+            || line.startsWith("exporttree"))) {
+        // Sessions are driven by the clients of a server so they are not let at its files
+        output(QLatin1String("info string sessions can not read or write files\n"));
+    } else if (line.startsWith("savetree ") || line.startsWith("loadtree ")) {
+        checkpointTree(line.mid(9).trimmed(), line.startsWith("loadtree"));
+    } else if (line.startsWith("exporttree")) {
+        QStringList arguments = line.split(' ', QString::SkipEmptyParts);
+        arguments.pop_front();
+        exportTree(arguments, line.startsWith("exporttreep"));
     } else if (line.startsWith("tree")) {
         int depth = 1;
         QVector<QString> node;
@@ -449,6 +501,7 @@ void UciEngine::calculateRollingAverage()
         m_averageInfo.nps               = rollingAverage(m_averageInfo.nps, m_lastInfo.nps, n);
         m_averageInfo.rawnps            = rollingAverage(m_averageInfo.rawnps, m_lastInfo.rawnps, n);
         m_averageInfo.nnnps             = rollingAverage(m_averageInfo.nnnps, m_lastInfo.nnnps, n);
+        m_averageInfo.refinednnnps      = rollingAverage(m_averageInfo.refinednnnps, m_lastInfo.refinednnnps, n);
     }
 
     WorkerInfo &avgW = m_averageInfo.workerInfo;
@@ -458,12 +511,15 @@ void UciEngine::calculateRollingAverage()
     avgW.nodesVisited      = rollingAverage(avgW.nodesVisited, newW.nodesVisited, n);
     avgW.nodesTBHits       = rollingAverage(avgW.nodesTBHits, newW.nodesTBHits, n);
     avgW.nodesCacheHits    = rollingAverage(avgW.nodesCacheHits, newW.nodesCacheHits, n);
+    avgW.nodesPruned       = rollingAverage(avgW.nodesPruned, newW.nodesPruned, n);
+    avgW.nodesExactOrCached = rollingAverage(avgW.nodesExactOrCached, newW.nodesExactOrCached, n);
+    avgW.nodesRefined      = rollingAverage(avgW.nodesRefined, newW.nodesRefined, n);
 }
 
 void UciEngine::sendBestMove()
 {
-    // We don't have a best move yet!
-    if (m_lastInfo.bestMove.isEmpty()) {
+    // We don't have a best move yet or may not send it before the ponderhit or stop
+    if (m_lastInfo.bestMove.isEmpty() || m_pondering) {
         m_pendingBestMove = true;
         return;
     }
@@ -515,6 +571,9 @@ void UciEngine::sendBestMove()
 
     m_pendingBestMove = false;
 
+    if (m_lastInfo.workerInfo.numberOfBatches >= m_minBatchesForAverage)
+        m_clock->recordSpeed(m_lastInfo.rawnps, m_lastInfo.batchSize);
+
     calculateRollingAverage();
     if (Q_UNLIKELY(m_ioHandler))
         m_ioHandler->handleAverages(m_averageInfo);
@@ -531,6 +590,7 @@ void UciEngine::sendInfo(const SearchInfo &info, bool isPartial)
     // Otherwise begin updating info
     qint64 msecs = m_clock->elapsed();
     m_lastInfo.calculateSpeeds(msecs);
+    Metrics::globalInstance()->setSearchInfo(m_lastInfo);
 
     // Check if we are in extended mode and best has become most visited
     if (m_clock->isExtended() && m_lastInfo.bestIsMostVisited) {
@@ -550,6 +610,12 @@ void UciEngine::sendInfo(const SearchInfo &info, bool isPartial)
         return;
     }
 
+    m_lastInfo.batchSize = 0;
+    if (m_lastInfo.workerInfo.batchSizeSetpoint)
+        m_lastInfo.batchSize = m_lastInfo.workerInfo.batchSizeSetpoint;
+    else if (m_lastInfo.workerInfo.nodesEvaluated && m_lastInfo.workerInfo.numberOfBatches)
+        m_lastInfo.batchSize = m_lastInfo.workerInfo.nodesEvaluated / m_lastInfo.workerInfo.numberOfBatches;
+
     Q_ASSERT(!m_searchEngine->isStopped());
     m_clock->updateDeadline(m_lastInfo, isPartial);
 
@@ -560,16 +626,19 @@ void UciEngine::sendInfo(const SearchInfo &info, bool isPartial)
     // https://link.springer.com/chapter/10.1007/978-3-642-31866-5_4
     const bool hasTarget = m_lastInfo.workerInfo.hasTarget;
 
-    if (!hasTarget && !m_clock->isInfinite() && !m_clock->isMoveTime() && m_averageInfo.nodes > 0 && m_averageInfo.rawnps > 0) {
-        const qint64 timeToRemaining = m_clock->deadline() - msecs;
-        const quint32 e = qMax(quint32(1), quint32(timeToRemaining / 1000.0f * m_averageInfo.rawnps));
-        m_searchEngine->setEstimatedNodes(e);
+    // The visits left are predicted from the speed learned for this phase and batch size, or the
+    // average of the searches so far before there is one
+    if (!hasTarget && !m_clock->isInfinite() && !m_clock->isMoveTime()) {
+        quint32 nps = m_clock->expectedNps(m_lastInfo.batchSize);
+        if (!nps && m_averageInfo.nodes > 0)
+            nps = m_averageInfo.rawnps;
+        if (nps > 0) {
+            const qint64 timeToRemaining = m_clock->deadline() - msecs;
+            const quint32 e = qMax(quint32(1), quint32(timeToRemaining / 1000.0f * nps));
+            m_searchEngine->setEstimatedNodes(e);
+        }
     }
 
-    m_lastInfo.batchSize = 0;
-    if (m_lastInfo.workerInfo.nodesEvaluated && m_lastInfo.workerInfo.numberOfBatches)
-        m_lastInfo.batchSize = m_lastInfo.workerInfo.nodesEvaluated / m_lastInfo.workerInfo.numberOfBatches;
-
     if (Q_UNLIKELY(m_ioHandler))
         m_ioHandler->handleInfo(m_lastInfo, isPartial);
 
@@ -589,12 +658,34 @@ void UciEngine::sendInfo(const SearchInfo &info, bool isPartial)
                << " batchSize " << m_lastInfo.batchSize
                << " rawnps " << m_lastInfo.rawnps
                << " nnnps " << m_lastInfo.nnnps
+               << " refinednnnps " << m_lastInfo.refinednnnps
                << " efficiency " << m_lastInfo.workerInfo.nodesVisited / float(m_lastInfo.workerInfo.nodesEvaluated)
                << " nodesSearched " << m_lastInfo.workerInfo.nodesSearched
                << " nodesEvaluated " << m_lastInfo.workerInfo.nodesEvaluated
                << " nodesVisited " << m_lastInfo.workerInfo.nodesVisited
                << " nodesCacheHits " << m_lastInfo.workerInfo.nodesCacheHits
+               << " nodesPruned " << m_lastInfo.workerInfo.nodesPruned
+               << " nodesExactOrCached " << m_lastInfo.workerInfo.nodesExactOrCached
+               << " nodesRefined " << m_lastInfo.workerInfo.nodesRefined
+               << " nodesSpeculated " << m_lastInfo.workerInfo.nodesSpeculated
+               << " nodesSpeculatedUsed " << m_lastInfo.workerInfo.nodesSpeculatedUsed
+               << " nodesAbandoned " << m_lastInfo.workerInfo.nodesAbandoned
+               << " playoutCollisions " << m_lastInfo.workerInfo.playoutCollisions
+               << " batchesTryExhausted " << m_lastInfo.workerInfo.batchesTryExhausted
+               << " batchesVldExhausted " << m_lastInfo.workerInfo.batchesVldExhausted
+               << " batchFill " << m_lastInfo.workerInfo.batchFilled / float(qMax(quint64(1), m_lastInfo.workerInfo.batchTarget))
+               << " nnCacheHits " << NeuralNet::globalInstance()->cache()->hits()
+               << " nnCacheMisses " << NeuralNet::globalInstance()->cache()->misses()
+               << " nnStoreHits " << NeuralNet::globalInstance()->store()->hits()
+               << " nnStoreMisses " << NeuralNet::globalInstance()->store()->misses()
+               << " tbCacheHits " << TB::globalInstance()->cacheHits()
+               << " tbCacheMisses " << TB::globalInstance()->cacheMisses()
                << endl;
+#if defined(USE_STAGE_TIMES)
+        stream << "info string stageTimes "
+               << StageTimes::globalInstance()->toString()
+               << endl;
+#endif
     }
 
     const Game g = History::globalInstance()->currentGame();
@@ -636,13 +727,19 @@ void UciEngine::sendAverages()
            << " nps " << m_averageInfo.nps
            << " rawnps " << m_averageInfo.rawnps
            << " nnnps " << m_averageInfo.nnnps
+           << " refinednnnps " << m_averageInfo.refinednnnps
            << " batchSize " << m_averageInfo.batchSize
            << " efficiency " << m_averageInfo.workerInfo.nodesSearched / float(m_averageInfo.workerInfo.nodesEvaluated)
            << " nodesSearched " << m_averageInfo.workerInfo.nodesSearched
            << " nodesEvaluated " << m_averageInfo.workerInfo.nodesEvaluated
            << " nodesVisited " << m_averageInfo.workerInfo.nodesVisited
            << " nodesTBHits " << m_averageInfo.workerInfo.nodesTBHits
+           << " tbCacheHits " << TB::globalInstance()->cacheHits()
+           << " tbCacheMisses " << TB::globalInstance()->cacheMisses()
            << " nodesCacheHits " << m_averageInfo.workerInfo.nodesCacheHits
+           << " nodesPruned " << m_averageInfo.workerInfo.nodesPruned
+           << " nodesExactOrCached " << m_averageInfo.workerInfo.nodesExactOrCached
+           << " nodesRefined " << m_averageInfo.workerInfo.nodesRefined
            << endl;
     output(out);
 }
@@ -657,43 +754,227 @@ void UciEngine::sendOptions()
     output(out);
 }
 
+void UciEngine::sendMemoryReport()
+{
+    waitForSharedState(); // which is what allocates most of it
+    QString out;
+    QTextStream stream(&out);
+    const QStringList lines = MemoryReport::current().toString().split('\n');
+    for (const QString &line : lines)
+        stream << "info string memory " << line << "\n";
+    stream.flush();
+    out.chop(1);
+    output(out);
+}
+
+void UciEngine::sendThreadReport()
+{
+    QString out;
+    QTextStream stream(&out);
+    const QString layout = ThreadAffinity::globalInstance()->toString();
+    const QStringList lines = layout.split('\n', QString::SkipEmptyParts);
+    for (const QString &line : lines)
+        stream << "info string thread " << line << "\n";
+    stream.flush();
+    out.chop(1);
+    output(out);
+}
+
+void UciEngine::checkpointTree(const QString &fileName, bool restore)
+{
+    if (!m_searchEngine->isStopped()) {
+        output(QLatin1String("info string the tree can only be checkpointed while stopped"));
+        return;
+    }
+
+    // The tree lives in the cache so that has to be done loading first
+    ensureSharedState();
+
+    QElapsedTimer timer;
+    timer.start();
+    Tree *tree = m_searchEngine->tree();
+    QString error;
+    const bool ok = restore ? tree->restore(fileName, &error) : tree->save(fileName, &error);
+    if (!ok) {
+        output(QString("info string could not %0 the tree: %1").arg(restore ? "load" : "save").arg(error));
+        return;
+    }
+
+    const Node *root = tree->embodiedRoot();
+    output(QString("info string tree %0 with %1 nodes and %2 visits in %3 ms")
+        .arg(restore ? "loaded" : "saved").arg(root->count() + 1).arg(root->visits())
+        .arg(timer.elapsed()));
+}
+
+void UciEngine::exportTree(const QStringList &arguments, bool withPotentials)
+{
+    // The file, then the depth and the visits a child needs to be written, with all of the tree
+    // written by default
+    if (arguments.isEmpty()) {
+        output(QLatin1String("info string exporttree needs a file"));
+        return;
+    }
+    if (!m_searchEngine->isStopped()) {
+        output(QLatin1String("info string the tree can only be exported while stopped"));
+        return;
+    }
+
+    const Node *root = m_searchEngine->tree()->embodiedRoot();
+    if (!root) {
+        output(QLatin1String("info string there is no tree to export"));
+        return;
+    }
+
+    const int depth = arguments.count() > 1 ? arguments.at(1).toInt() : std::numeric_limits<int>::max();
+    const quint32 minimumVisits = arguments.count() > 2 ? arguments.at(2).toUInt() : 1;
+    QElapsedTimer timer;
+    timer.start();
+    quint64 written = 0;
+    QString error;
+    if (!TreeExport::write(root, arguments.first(), depth, minimumVisits, withPotentials, &written, &error)) {
+        output(QString("info string could not export the tree: %0").arg(error));
+        return;
+    }
+
+    output(QString("info string tree exported with %0 nodes in %1 ms").arg(written).arg(timer.elapsed()));
+}
+
 void UciEngine::uciNewGame()
 {
     //qDebug() << "uciNewGame";
     m_gameInitialized = true;
     m_pendingBestMove = false;
+    m_positionMoves.clear(); // the next position is set up from scratch
 
     m_clock->setExtraBudgetedTime(0.f);
+
+    // The tree is freed into the cache so that has to be done loading first
+    waitForSharedState();
+
+    // The cache of a session is not reset along with the shared state so our tree is freed
+    if (m_isSession)
+        m_searchEngine->tree()->clearRoot(false /*resumeIfPossible*/);
     m_searchEngine->reset();
-    Cache::globalInstance()->reset();
+
+    // A load no search has run on yet with the same options is as good as a new one
+    if (!m_isSession && (!m_sharedStateLoaded || m_sharedStateDirty || m_sharedStateUsed))
+        startSharedState();
+
+    // Don't average the nps unless we have at least two batches from each GPU
+    const int numberOfGPUCores = Options::globalInstance()->option("GPUCores").value().toInt();
+    m_minBatchesForAverage = numberOfGPUCores * 2;
+
+    ++m_averageInfo.games;
+}
+
+void UciEngine::resetSharedState(bool forSessions)
+{
+    readSearchSettings();
+    loadSharedState(!forSessions);
+}
+
+void UciEngine::readSearchSettings()
+{
     SearchSettings::debugInfo = Options::globalInstance()->option("DebugInfo").value() == "true";
     SearchSettings::chess960 = Options::globalInstance()->option("UCI_Chess960").value() == "true";
+    SearchSettings::pruneWhenFull = Options::globalInstance()->option("PruneWhenFull").value() == "true";
     SearchSettings::weightsFile = Options::globalInstance()->option("WeightsFile").value();
     SearchSettings::openingTimeFactor = Options::globalInstance()->option("OpeningTimeFactor").value().toDouble();
     SearchSettings::earlyExitFactor = Options::globalInstance()->option("EarlyExitFactor").value().toDouble();
-    Q_ASSERT(!SearchSettings::weightsFile.isEmpty());
+    Q_ASSERT(!SearchSettings::weightsFile.isEmpty()
+        || Options::globalInstance()->option("SyntheticNetwork").value() == "true");
+}
+
+// The small network is optional so without its file the large one goes on evaluating every leaf
+static void loadSmallNetwork(bool resetCache)
+{
+    NeuralNet *small = NeuralNet::smallInstance();
+    const QString weightsFile = Options::globalInstance()->option("SmallWeightsFile").value();
+    if (weightsFile.isEmpty() || !QFileInfo::exists(weightsFile)) {
+        if (!weightsFile.isEmpty())
+            qWarning() << "Could not load the small NN weights" << weightsFile;
+        small->unload();
+        return;
+    }
+
+    small->setWeights(weightsFile);
+    if (resetCache || !small->isLoaded())
+        small->reset();
+    else
+        small->loadNetworks();
+}
+
+void UciEngine::loadSharedState(bool withCache)
+{
+    // The first search would fault in the fresh cache page by page so that is done up front on
+    // threads of its own while the network and tablebases load
+    std::thread prefault;
+    if (withCache) {
+        // The main search worker grows its tree in the share of the cache the root shards leave it
+        const int shards = qMax(1, Options::globalInstance()->option("SearchShards").value().toInt());
+        Cache::globalInstance()->reset(Cache::positionsFromOptions() / quint64(shards));
+        prefault = std::thread([]() { Cache::globalInstance()->prefault(); });
+    }
     NeuralNet::globalInstance()->setWeights(SearchSettings::weightsFile);
     NeuralNet::globalInstance()->reset();
+    loadSmallNetwork(true /*resetCache*/);
+    TB::globalInstance()->reset();
+    if (prefault.joinable())
+        prefault.join();
+}
 
-    // Don't average the nps unless we have at least two batches from each GPU
-    const int numberOfGPUCores = Options::globalInstance()->option("GPUCores").value().toInt();
-    m_minBatchesForAverage = numberOfGPUCores * 2;
+void UciEngine::startSharedState()
+{
+    // Allocating a big cache, bringing up the networks and opening the tablebases take long
+    // enough for some guis to give up on us, so they run while we go on answering
+    waitForSharedState();
+    readSearchSettings();
+    m_sharedStateLoaded = true;
+    m_sharedStateDirty = false;
+    m_sharedStateUsed = false;
+    m_sharedStateLoader = std::thread(&UciEngine::loadSharedState, true /*withCache*/);
+}
 
-    TB::globalInstance()->reset();
-    ++m_averageInfo.games;
+void UciEngine::waitForSharedState()
+{
+    if (m_sharedStateLoader.joinable())
+        m_sharedStateLoader.join();
+}
+
+void UciEngine::ensureSharedState()
+{
+    // Once a game is going its tree lives in the cache so options only apply from the next game
+    if (m_sharedStateLoaded && m_sharedStateDirty && !m_gameInitialized)
+        startSharedState();
+    waitForSharedState();
 }
 
 void UciEngine::ponderHit()
 {
     //qDebug() << "ponderHit";
     Q_ASSERT(m_searchEngine && m_gameInitialized);
+    if (!m_pondering)
+        return;
+
+    // The opponent played the expected move so the search carries on, now under our clock
+    m_pondering = false;
     if (m_searchEngine)
         m_searchEngine->stopPonder();
+    startTheClock(m_ponderSearch);
+
+    if (m_pendingBestMove && !m_searchEngine->isStopped())
+        sendBestMove();
 }
 
 void UciEngine::stop()
 {
     //qDebug() << "stop";
+    // A stop while pondering means the opponent played something else
+    if (m_pondering) {
+        m_pondering = false;
+        m_searchEngine->stopPonder();
+    }
+
     if (m_clock->isActive() && !m_searchEngine->isStopped())
         sendBestMove();
 }
@@ -714,6 +995,12 @@ void UciEngine::stopRequested(bool earlyExit)
     Q_UNUSED(earlyExit);
 #endif
 
+    // The best move has to wait for the ponderhit
+    if (m_pondering) {
+        m_pendingBestMove = true;
+        return;
+    }
+
     //qDebug() << "stop";
     stop();
 }
@@ -728,28 +1015,43 @@ void UciEngine::quit()
         m_searchEngine->stopSearch();
         m_searchEngine->stopPonder();
     }
-    QCoreApplication::instance()->quit();
+    DebugLog::globalInstance()->flush();
+    if (!m_isSession)
+        QCoreApplication::instance()->quit();
 }
 
 void UciEngine::setPosition(const QString& position, const QVector<QString> &moves)
 {
-    History::globalInstance()->clear();
-
     QString fen = QLatin1String("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
     if (position != QLatin1String("startpos"))
         fen = position;
 
+    // Most guis send the whole game again with every move, so where the moves extend those of the
+    // last position only the new ones are played on top of the history
+    History *history = History::globalInstance();
+    int played = 0;
+    if (fen == m_positionFen && !m_positionMoves.isEmpty()
+        && moves.count() >= m_positionMoves.count()
+        && history->count() == m_positionMoves.count()
+        && std::equal(m_positionMoves.constBegin(), m_positionMoves.constEnd(), moves.constBegin())) {
+        played = m_positionMoves.count();
+    } else {
+        history->clear();
+    }
+
+    m_positionFen = fen;
+    m_positionMoves = moves;
+
     if (!moves.isEmpty()) {
-        StandaloneGame game(fen);
-        QVector<QString> movesMinusLast = moves;
-        for (QString move : movesMinusLast) {
-            Move mv = Notation::stringToMove(move, Chess::Computer);
+        StandaloneGame game = played ? history->currentGame() : StandaloneGame(fen);
+        for (int i = played; i < moves.count(); ++i) {
+            Move mv = Notation::stringToMove(moves.at(i), Chess::Computer);
             bool success = game.makeMove(mv);
-            History::globalInstance()->addGame(game);
+            history->addGame(game);
             Q_ASSERT(success);
         }
     } else {
-        History::globalInstance()->addGame(StandaloneGame(fen));
+        history->addGame(StandaloneGame(fen));
     }
 }
 
@@ -786,8 +1088,12 @@ void UciEngine::parseGo(const QString &line)
         }
     }
 
-    if (goLine.contains("ponder")) {
-        Q_ASSERT(m_searchEngine && m_gameInitialized);
+    // The position already has the expected reply played so we search it until ponderhit or stop
+    m_pondering = goLine.contains("ponder");
+    if (m_pondering) {
+        if (!m_gameInitialized)
+            uciNewGame();
+        Q_ASSERT(m_searchEngine);
         if (m_searchEngine)
             m_searchEngine->startPonder();
     }
@@ -808,6 +1114,12 @@ void UciEngine::parseGo(const QString &line)
 
 void UciEngine::parseOption(const QString &line)
 {
+    if (m_isSession) {
+        output(QLatin1String("info string options are shared by every session and are set when"
+                             " starting the server\n"));
+        return;
+    }
+
     QList<QString> optionLine = line.split(' ');
     if (optionLine.count() != 5)
         return;
@@ -824,6 +1136,20 @@ void UciEngine::parseOption(const QString &line)
 
     QString value = optionLine.at(4);
     Options::globalInstance()->setOption(name, value);
+    m_sharedStateDirty = true;
+
+    // Start bringing up the new network right away, it replaces the current one between searches
+    static const QVector<QString> networkOptions = { "WeightsFile", "SmallWeightsFile", "GPUCores", "Precision",
+        "UseTensorRT", "Int8CalibrationFile", "MaxBatchSize", "UseCustomWinograd", "Autotune",
+        "UseCudaGraphs", "UseCPU", "CPUThreads", "HybridCPUBatch", "NNServer", "NNServerComputations",
+        "SyntheticNetwork", "SyntheticLatency" };
+    if (m_gameInitialized && networkOptions.contains(name)) {
+        waitForSharedState();
+        SearchSettings::weightsFile = Options::globalInstance()->option("WeightsFile").value();
+        NeuralNet::globalInstance()->setWeights(SearchSettings::weightsFile);
+        NeuralNet::globalInstance()->loadNetworks();
+        loadSmallNetwork(false /*resetCache*/);
+    }
 }
 
 void UciEngine::go(const Search& s)
@@ -833,10 +1159,32 @@ void UciEngine::go(const Search& s)
     //qDebug() << "go";
     if (!m_gameInitialized)
         uciNewGame();
+    ensureSharedState();
+    m_sharedStateUsed = true;
+
+    // No search is running so this is where a network loaded in the background takes over
+    NeuralNet::globalInstance()->switchNetworks();
+    NeuralNet::smallInstance()->switchNetworks();
+
+    m_lastInfo = SearchInfo();
 
+    // Start the clock immediately, although a ponder search runs on an infinite one until the hit
+    if (m_pondering) {
+        m_ponderSearch = s;
+        Search ponder = s;
+        ponder.infinite = true;
+        startTheClock(ponder);
+    } else {
+        startTheClock(s);
+    }
+
+    startSearch(s);
+}
+
+void UciEngine::startTheClock(const Search &s)
+{
     const StandaloneGame currentGame = History::globalInstance()->currentGame();
     const Game::Position &p = currentGame.position();
-    // Start the clock immediately
     m_clock->setTime(Chess::White, s.wtime);
     m_clock->setTime(Chess::Black, s.btime);
     m_clock->setIncrement(Chess::White, s.winc);
@@ -846,10 +1194,10 @@ void UciEngine::go(const Search& s)
     m_clock->setMaterialScore(p.materialScore(Chess::White) + p.materialScore(Chess::Black));
     m_clock->setHalfMoveNumber(currentGame.halfMoveNumber());
     m_clock->resetExtension();
-    m_lastInfo = SearchInfo();
 
-    // Actually start the clock
+    // Actually start the clock and let the search stop itself at the same deadlines
     m_clock->startDeadline(p.activeArmy());
+    m_searchEngine->setDeadline(m_clock->timeToDeadline(), m_clock->timeToHardDeadline());
 #if defined(DEBUG_TIME)
     QString out;
     QTextStream stream(&out);
@@ -858,7 +1206,6 @@ void UciEngine::go(const Search& s)
            << endl;
     output(out);
 #endif
-    startSearch(s);
 }
 
 void UciEngine::input(const QString &in)
@@ -869,6 +1216,19 @@ void UciEngine::input(const QString &in)
 
 void UciEngine::output(const QString &out)
 {
+    if (Q_UNLIKELY(!m_outputPrefix.isEmpty())) {
+        // Every line is prefixed, which a trailing newline does not start
+        QString prefixed = out.endsWith('\n') ? out.left(out.size() - 1) : out;
+        prefixed.replace(QLatin1String("\n"), QLatin1String("\n") + m_outputPrefix);
+        prefixed.prepend(m_outputPrefix);
+        if (out.endsWith('\n'))
+            prefixed.append('\n');
+        if (Q_LIKELY(!m_ioHandler))
+            qCInfo(UciOutput).noquote() << prefixed;
+        emit sendOutput(prefixed);
+        return;
+    }
+
     if (Q_LIKELY(!m_ioHandler))
         qCInfo(UciOutput).noquote() << out;
     emit sendOutput(out);
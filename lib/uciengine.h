@@ -28,6 +28,8 @@
 #include <QSocketNotifier>
 #include <QCommandLineOption>
 
+#include <thread>
+
 #include "game.h"
 #include "searchengine.h"
 
@@ -35,6 +37,7 @@
 
 class Clock;
 class Move;
+class Replay;
 
 struct UciOption {
 public:
@@ -82,6 +85,7 @@ class IOWorker : public QObject {
     Q_OBJECT
 public:
     IOWorker(const QString &debugFile, QObject *parent = nullptr);
+    ~IOWorker();
 
     void startDebug();
 
@@ -96,6 +100,7 @@ Q_SIGNALS:
 private:
     QQueue<QString> m_debugLines;
     QString m_waitingOnOutput;
+    Replay *m_replay; // of the searches in the debug file for the nodes they searched
 };
 
 class IOHandler {
@@ -116,6 +121,14 @@ public:
 
     SearchEngine *searchEngine() const { return m_searchEngine; }
 
+    // A session of the server leaves the network and tablebases to the server and searches in
+    // the cache its thread is bound to, refuses options, only stops on quit and prefixes every
+    // line it outputs
+    void setSession(const QString &outputPrefix) { m_isSession = true; m_outputPrefix = outputPrefix; }
+    // The part of a new game the whole process shares, where sessions that search at once each
+    // bring a cache of their own the process wide one is left empty
+    static void resetSharedState(bool forSessions = false);
+
 public Q_SLOTS:
     void sendId();
     void sendUciOk();
@@ -124,6 +137,8 @@ public Q_SLOTS:
     void sendInfo(const SearchInfo &info, bool isPartial);
     void sendAverages();
     void sendOptions();
+    void sendMemoryReport(); // on "debug memory"
+    void sendThreadReport(); // on "debug threads"
     void uciNewGame();
     void ponderHit();
     void stop();
@@ -137,6 +152,7 @@ Q_SIGNALS:
     void sendOutput(const QString &output);
 
 private:
+    void startTheClock(const Search &s);
     void stopTheClock();
     void startSearch(const Search &s);
     void stopSearch();
@@ -145,6 +161,15 @@ private:
     void parseGo(const QString &move);
     void parseOption(const QString &option);
     void go(const Search &search);
+    void checkpointTree(const QString &fileName, bool restore); // on "savetree" and "loadtree"
+    void exportTree(const QStringList &arguments, bool withPotentials); // on "exporttree"
+
+    // The shared state loads in the background from a new game on and isready and go wait for it
+    void startSharedState();
+    void waitForSharedState();
+    void ensureSharedState(); // loads it again first where an option changed before a game
+    static void readSearchSettings();
+    static void loadSharedState(bool withCache);
 
     void input(const QString &in);
     void output(const QString &out);
@@ -156,9 +181,19 @@ private:
     SearchInfo m_lastInfo;
     bool m_gameInitialized;
     bool m_pendingBestMove;
+    bool m_pondering;
+    Search m_ponderSearch; // the clock to start on a ponderhit
+    QString m_positionFen;          // of the last position command, which the history holds
+    QVector<QString> m_positionMoves;
     QString m_debugFile;
     QVector<UciOption> m_options;
     SearchEngine *m_searchEngine;
+    bool m_isSession;
+    std::thread m_sharedStateLoader;
+    bool m_sharedStateLoaded;   // at least once
+    bool m_sharedStateDirty;    // an option was set since it was last loaded
+    bool m_sharedStateUsed;     // a search ran on it since it was last loaded
+    QString m_outputPrefix;
     QThread m_inputThread;
     Clock *m_clock;
     IOHandler *m_ioHandler;
@@ -0,0 +1,158 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#include "vectormath.h"
+
+#include "fastapprox/fastpow.h"
+
+#if defined(HAS_AVX2_DISPATCH)
+#include <immintrin.h>
+
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+
+// The same approximations as fastlog2 and fastpow2 of fastapprox for eight lanes
+AVX2_TARGET static inline __m256 fastlog2AVX2(__m256 x)
+{
+    const __m256i bits = _mm256_castps_si256(x);
+    const __m256 mantissa = _mm256_castsi256_ps(_mm256_or_si256(
+        _mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)), _mm256_set1_epi32(0x3f000000)));
+    __m256 y = _mm256_mul_ps(_mm256_cvtepi32_ps(bits), _mm256_set1_ps(1.1920928955078125e-7f));
+    y = _mm256_sub_ps(y, _mm256_set1_ps(124.22551499f));
+    y = _mm256_fnmadd_ps(_mm256_set1_ps(1.498030302f), mantissa, y);
+    return _mm256_sub_ps(y, _mm256_div_ps(_mm256_set1_ps(1.72587999f),
+        _mm256_add_ps(_mm256_set1_ps(0.3520887068f), mantissa)));
+}
+
+AVX2_TARGET static inline __m256 fastpow2AVX2(__m256 p)
+{
+    const __m256 offset = _mm256_and_ps(_mm256_cmp_ps(p, _mm256_setzero_ps(), _CMP_LT_OQ),
+        _mm256_set1_ps(1.0f));
+    const __m256 clipp = _mm256_max_ps(p, _mm256_set1_ps(-126.0f));
+    const __m256 w = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(clipp));
+    const __m256 z = _mm256_add_ps(_mm256_sub_ps(clipp, w), offset);
+    __m256 v = _mm256_add_ps(clipp, _mm256_set1_ps(121.2740575f));
+    v = _mm256_add_ps(v, _mm256_div_ps(_mm256_set1_ps(27.7280233f),
+        _mm256_sub_ps(_mm256_set1_ps(4.84252568f), z)));
+    v = _mm256_fnmadd_ps(_mm256_set1_ps(1.49012907f), z, v);
+    v = _mm256_mul_ps(_mm256_set1_ps(1 << 23), v);
+    return _mm256_castsi256_ps(_mm256_cvttps_epi32(v));
+}
+
+AVX2_TARGET static inline float horizontalSum(__m256 v)
+{
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+
+AVX2_TARGET static float powAndSumAVX2(float *values, int count, float power)
+{
+    const __m256 p = _mm256_set1_ps(power);
+    __m256 sum = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256 v = fastpow2AVX2(_mm256_mul_ps(p, fastlog2AVX2(_mm256_loadu_ps(values + i))));
+        _mm256_storeu_ps(values + i, v);
+        sum = _mm256_add_ps(sum, v);
+    }
+    float total = horizontalSum(sum);
+    for (; i < count; ++i) {
+        values[i] = fastpow(values[i], power);
+        total += values[i];
+    }
+    return total;
+}
+
+AVX2_TARGET static void scaleAVX2(float *values, int count, float factor)
+{
+    const __m256 f = _mm256_set1_ps(factor);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(values + i, _mm256_mul_ps(f, _mm256_loadu_ps(values + i)));
+    for (; i < count; ++i)
+        values[i] *= factor;
+}
+
+AVX2_TARGET static void uctScoresAVX2(const float *qValues, const float *pValues,
+    const float *denominators, int count, float uCoeff, float *scores)
+{
+    const __m256 u = _mm256_set1_ps(uCoeff);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256 uValues = _mm256_div_ps(_mm256_mul_ps(u, _mm256_loadu_ps(pValues + i)),
+            _mm256_loadu_ps(denominators + i));
+        _mm256_storeu_ps(scores + i, _mm256_add_ps(_mm256_loadu_ps(qValues + i), uValues));
+    }
+    for (; i < count; ++i)
+        scores[i] = qValues[i] + uCoeff * pValues[i] / denominators[i];
+}
+
+static bool detectAVX2()
+{
+    // Our static initialization may run ahead of that of the runtime which fills these in
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+static const bool s_useAVX2 = detectAVX2();
+#else
+static const bool s_useAVX2 = false;
+#endif
+
+bool VectorMath::usesAVX2()
+{
+    return s_useAVX2;
+}
+
+float VectorMath::powAndSum(float *values, int count, float power)
+{
+#if defined(HAS_AVX2_DISPATCH)
+    if (s_useAVX2)
+        return powAndSumAVX2(values, count, power);
+#endif
+    float total = 0;
+    for (int i = 0; i < count; ++i) {
+        values[i] = fastpow(values[i], power);
+        total += values[i];
+    }
+    return total;
+}
+
+void VectorMath::scale(float *values, int count, float factor)
+{
+#if defined(HAS_AVX2_DISPATCH)
+    if (s_useAVX2)
+        return scaleAVX2(values, count, factor);
+#endif
+    for (int i = 0; i < count; ++i)
+        values[i] *= factor;
+}
+
+void VectorMath::uctScores(const float *qValues, const float *pValues, const float *denominators,
+    int count, float uCoeff, float *scores)
+{
+#if defined(HAS_AVX2_DISPATCH)
+    if (s_useAVX2)
+        return uctScoresAVX2(qValues, pValues, denominators, count, uCoeff, scores);
+#endif
+    for (int i = 0; i < count; ++i)
+        scores[i] = qValues[i] + uCoeff * pValues[i] / denominators[i];
+}
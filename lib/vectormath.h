@@ -0,0 +1,46 @@
+/*
+  This file is part of Allie Chess.
+  Copyright (C) 2018, 2019 Adam Treat
+
+  Allie Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Allie Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Allie Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+*/
+
+#ifndef VECTORMATH_H
+#define VECTORMATH_H
+
+#include <QtGlobal>
+
+// AVX2 is used when the processor has it, which is decided at runtime like PEXT so that one binary
+// serves both kinds of hardware
+#if defined(Q_PROCESSOR_X86_64) && (defined(Q_CC_GNU) || defined(Q_CC_CLANG))
+#define HAS_AVX2_DISPATCH
+#endif
+
+// Array versions of the fastapprox functions and of the scoring of selection, running eight lanes
+// at once with AVX2 and otherwise one at a time in a loop the compiler vectorizes for the baseline
+namespace VectorMath {
+    bool usesAVX2();
+
+    // Raises every value to the power in place like fastpow does and returns their sum
+    float powAndSum(float *values, int count, float power);
+    void scale(float *values, int count, float factor);
+    // The score Node::uctFormula gives every child from its value, policy and visits plus virtual
+    // loss plus one
+    void uctScores(const float *qValues, const float *pValues, const float *denominators,
+        int count, float uCoeff, float *scores);
+}
+
+#endif // VECTORMATH_H
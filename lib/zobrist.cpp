@@ -20,49 +20,38 @@
 
 #include "zobrist.h"
 
-#include <QGlobalStatic>
-#include <random>
-
 using namespace Chess;
 
-class MyZobrist : public Zobrist { };
-Q_GLOBAL_STATIC(MyZobrist, zobristInstance)
-Zobrist *Zobrist::globalInstance()
+// Steele, Lea and Flood's splitmix64 which is simple enough to run at compile time
+static constexpr quint64 splitMix64(quint64 *state)
 {
-    return zobristInstance();
+    quint64 z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
 }
 
-Zobrist::Zobrist()
+static constexpr ZobristKeys generateKeys()
 {
     // Make the keys deterministic
-    std::default_random_engine generator(128612482);
-    std::uniform_int_distribution<quint64> distribution;
+    ZobristKeys keys = {};
+    quint64 state = 128612482;
 
     // https://en.wikipedia.org/wiki/Zobrist_hashing
     for (int i = 0; i < 64; ++i) {
-        QVector<quint64> keys;
-        for (int j = 0; j < 12; ++j) {
-            quint64 a = distribution(generator);
-            keys.append(a);
-            m_pieceKeys[i][j] = a;
-        }
+        for (int j = 0; j < 12; ++j)
+            keys.pieceKeys[i][j] = splitMix64(&state);
     }
 
-    // activearmy
-    m_otherKeys.append(distribution(generator));
-    // enpassant
-    m_otherKeys.append(distribution(generator));
-    // white kingside castle
-    m_otherKeys.append(distribution(generator));
-    // black kingside castle
-    m_otherKeys.append(distribution(generator));
-    // white queenside castle
-    m_otherKeys.append(distribution(generator));
-    // black queenside castle
-    m_otherKeys.append(distribution(generator));
+    // activearmy, enpassant, white and black kingside castle, white and black queenside castle
+    for (int i = 0; i < 6; ++i)
+        keys.otherKeys[i] = splitMix64(&state);
+    return keys;
 }
 
-quint64 Zobrist::hash(const Game::Position &position) const
+constexpr ZobristKeys Zobrist::s_keys = generateKeys();
+
+quint64 Zobrist::hash(const Game::Position &position)
 {
     quint64 h = 0;
 
@@ -72,7 +61,7 @@ quint64 Zobrist::hash(const Game::Position &position) const
         for (; sq != pieces.end(); ++sq) {
             int squareIndex = BitBoard::squareToIndex(*sq);
             int pieceIndex = position.board(White).testBit(squareIndex) ? 0 : 1;
-            h ^= m_pieceKeys[squareIndex][pieceIndex];
+            h ^= s_keys.pieceKeys[squareIndex][pieceIndex];
         }
     }
 
@@ -82,7 +71,7 @@ quint64 Zobrist::hash(const Game::Position &position) const
         for (; sq != pieces.end(); ++sq) {
             int squareIndex = BitBoard::squareToIndex(*sq);
             int pieceIndex = position.board(White).testBit(squareIndex) ? 2 : 3;
-            h ^= m_pieceKeys[squareIndex][pieceIndex];
+            h ^= s_keys.pieceKeys[squareIndex][pieceIndex];
         }
     }
 
@@ -92,7 +81,7 @@ quint64 Zobrist::hash(const Game::Position &position) const
         for (; sq != pieces.end(); ++sq) {
             int squareIndex = BitBoard::squareToIndex(*sq);
             int pieceIndex = position.board(White).testBit(squareIndex) ? 4 : 5;
-            h ^= m_pieceKeys[squareIndex][pieceIndex];
+            h ^= s_keys.pieceKeys[squareIndex][pieceIndex];
         }
     }
 
@@ -102,7 +91,7 @@ quint64 Zobrist::hash(const Game::Position &position) const
         for (; sq != pieces.end(); ++sq) {
             int squareIndex = BitBoard::squareToIndex(*sq);
             int pieceIndex = position.board(White).testBit(squareIndex) ? 6 : 7;
-            h ^= m_pieceKeys[squareIndex][pieceIndex];
+            h ^= s_keys.pieceKeys[squareIndex][pieceIndex];
         }
     }
 
@@ -112,7 +101,7 @@ quint64 Zobrist::hash(const Game::Position &position) const
         for (; sq != pieces.end(); ++sq) {
             int squareIndex = BitBoard::squareToIndex(*sq);
             int pieceIndex = position.board(White).testBit(squareIndex) ? 8 : 9;
-            h ^= m_pieceKeys[squareIndex][pieceIndex];
+            h ^= s_keys.pieceKeys[squareIndex][pieceIndex];
         }
     }
 
@@ -122,30 +111,30 @@ quint64 Zobrist::hash(const Game::Position &position) const
         for (; sq != pieces.end(); ++sq) {
             int squareIndex = BitBoard::squareToIndex(*sq);
             int pieceIndex = position.board(White).testBit(squareIndex) ? 10 : 11;
-            h ^= m_pieceKeys[squareIndex][pieceIndex];
+            h ^= s_keys.pieceKeys[squareIndex][pieceIndex];
         }
     }
 
     // activearmy
     if (position.activeArmy() == Black)
-        h ^= m_otherKeys[0];
+        h ^= s_keys.otherKeys[0];
     // enpassant
     if (position.enPassantTarget().isValid()) {
         Square sq = position.enPassantTarget();
-        h ^= quint64(sq.file()) ^ quint64(sq.rank()) ^ m_otherKeys[1];
+        h ^= quint64(sq.file()) ^ quint64(sq.rank()) ^ s_keys.otherKeys[1];
     }
     // white kingside castle
     if (position.isCastleAvailable(White, KingSide))
-        h ^= m_otherKeys[2];
+        h ^= s_keys.otherKeys[2];
     // black kingside castle
     if (position.isCastleAvailable(Black, KingSide))
-        h ^= m_otherKeys[3];
+        h ^= s_keys.otherKeys[3];
     // white queenside castle
     if (position.isCastleAvailable(White, QueenSide))
-        h ^= m_otherKeys[4];
+        h ^= s_keys.otherKeys[4];
     // black queenside castle
     if (position.isCastleAvailable(Black, QueenSide))
-        h ^= m_otherKeys[5];
+        h ^= s_keys.otherKeys[5];
 
     return h;
 }
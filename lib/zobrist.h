@@ -21,20 +21,35 @@
 #ifndef ZOBRIST_H
 #define ZOBRIST_H
 
-#include <QVector>
-
 #include "game.h"
 
+// The keys are produced by the compiler so they live in read only data
+struct ZobristKeys {
+    quint64 pieceKeys[64][12];
+    quint64 otherKeys[6];
+};
+
 class Zobrist {
 public:
-    static Zobrist *globalInstance();
-    quint64 hash(const Game::Position &position) const;
+    static quint64 hash(const Game::Position &position);
+
+    // The keys that make up the hash so it can be updated move by move
+    static inline quint64 pieceKey(int square, Chess::Army army, Chess::PieceType piece)
+    {
+        return s_keys.pieceKeys[square][(int(piece) - 1) * 2 + (army == Chess::White ? 0 : 1)];
+    }
+    static inline quint64 activeArmyKey() { return s_keys.otherKeys[0]; }
+    static inline quint64 enPassantKey(const Square &sq)
+    {
+        return quint64(sq.file()) ^ quint64(sq.rank()) ^ s_keys.otherKeys[1];
+    }
+    static inline quint64 castleKey(Chess::Army army, Chess::Castle castle)
+    {
+        return s_keys.otherKeys[castle == Chess::KingSide ? (army == Chess::White ? 2 : 3) : (army == Chess::White ? 4 : 5)];
+    }
 
 private:
-    Zobrist();
-    quint64 m_pieceKeys[64][12];
-    QVector<quint64> m_otherKeys;
-    friend class MyZobrist;
+    static const ZobristKeys s_keys;
 };
 
 #endif
@@ -25,15 +25,22 @@
 #include <stdio.h>
 #include <iostream>
 
+#include "analyzeengine.h"
 #include "benchmarkengine.h"
 #include "cache.h"
 #include "movegen.h"
 #include "nn.h"
+#include "nnserver.h"
 #include "options.h"
+#include "perftengine.h"
 #include "searchengine.h"
+#include "searchserver.h"
+#include "selectiontrace.h"
+#include "selfplayengine.h"
+#include "serverengine.h"
+#include "treeexport.h"
 #include "uciengine.h"
 #include "version.h"
-#include "zobrist.h"
 
 #define APP_NAME "Allie"
 
@@ -50,7 +57,15 @@ int main(int argc, char *argv[])
         UNKNOWN,
         UCI,
         BENCHMARK,
-        DEBUGFILE
+        DEBUGFILE,
+        PERFT,
+        SERVER,
+        ANALYZE,
+        SELFPLAY,
+        TRACE,
+        TREE,
+        NNSERVER,
+        SEARCHSERVER
     };
 
     QCommandLineParser parser;
@@ -63,7 +78,15 @@ int main(int argc, char *argv[])
     parser.addPositionalArgument("", "");
     parser.addPositionalArgument("mode", "uci\t\tRegular uci chess engine (default)\n\t"
                                          "benchmark\tBenchmarking mode\n\t"
-                                         "debugfile\tReplay a debug log file\n");
+                                         "debugfile\tReplay a debug log file\n\t"
+                                         "perft\t\tMove generator throughput for a fen and depth\n\t"
+                                         "server\t\tMany uci sessions sharing one process\n\t"
+                                         "analyze\t\tSearch every position of an epd or pgn file\n\t"
+                                         "selfplay\tPlay many games against itself at once\n\t"
+                                         "trace\t\tSummarize the searches of a selection trace file\n\t"
+                                         "tree\t\tPrint a tree written by the exporttree command\n\t"
+                                         "nnserver\tEvaluate positions for engines on other machines\n\t"
+                                         "searchserver\tSearch subtrees for engines on other machines\n");
 
     QCommandLineParser modeParser;
     modeParser.setApplicationDescription("mode");
@@ -94,6 +117,22 @@ int main(int argc, char *argv[])
         mode = BENCHMARK;
     } else if (modeString == QLatin1String("debugfile")) {
         mode = DEBUGFILE;
+    } else if (modeString == QLatin1String("perft")) {
+        mode = PERFT;
+    } else if (modeString == QLatin1String("server")) {
+        mode = SERVER;
+    } else if (modeString == QLatin1String("analyze")) {
+        mode = ANALYZE;
+    } else if (modeString == QLatin1String("selfplay")) {
+        mode = SELFPLAY;
+    } else if (modeString == QLatin1String("trace")) {
+        mode = TRACE;
+    } else if (modeString == QLatin1String("tree")) {
+        mode = TREE;
+    } else if (modeString == QLatin1String("nnserver")) {
+        mode = NNSERVER;
+    } else if (modeString == QLatin1String("searchserver")) {
+        mode = SEARCHSERVER;
     } else {
         // Assume uci as that is default way of interpreting mode
         mode = UCI;
@@ -109,14 +148,40 @@ int main(int argc, char *argv[])
     case DEBUGFILE:
         modeParser.addPositionalArgument("filepath", "\t<filepath>\tThe filepath of the debug file to load");
         [[fallthrough]];
+    case PERFT:
+    case SERVER:
+    case ANALYZE:
+    case SELFPLAY:
+    case NNSERVER:
+    case SEARCHSERVER:
     case UCI:
         {
+            if (mode == PERFT)
+                Options::globalInstance()->addPerftOptions();
+            if (mode == ANALYZE)
+                Options::globalInstance()->addAnalyzeOptions();
+            if (mode == SELFPLAY)
+                Options::globalInstance()->addSelfPlayOptions();
+            if (mode == DEBUGFILE)
+                Options::globalInstance()->addReplayOptions();
+            if (mode == SERVER)
+                Options::globalInstance()->addServerOptions();
+            if (mode == NNSERVER)
+                Options::globalInstance()->addNNServerOptions();
+            if (mode == SEARCHSERVER)
+                Options::globalInstance()->addSearchServerOptions();
             Options::globalInstance()->addRegularOptions();
             QVector<UciOption> options = Options::globalInstance()->options();
             for (UciOption o : options)
                 modeParser.addOption(o.commandLine());
             break;
         }
+    case TRACE:
+        modeParser.addPositionalArgument("filepath", "\t<filepath>\tThe filepath of the selection trace to read");
+        break;
+    case TREE:
+        modeParser.addPositionalArgument("filepath", "\t<filepath>\tThe filepath of the exported tree to read");
+        break;
     case UNKNOWN:
         break;
     default:
@@ -165,7 +230,31 @@ int main(int argc, char *argv[])
     QStringList modePositionalArgs = modeParser.positionalArguments();
     if (mode == DEBUGFILE && modePositionalArgs.count() == 1) {
             debugFile = modePositionalArgs.first();
-    } else if (mode == DEBUGFILE || !modePositionalArgs.isEmpty()) {
+    } else if (mode == TRACE && modePositionalArgs.count() == 1) {
+        // Replay the trace offline, one summary per search
+        QVector<SelectionSearch> searches;
+        const bool ok = SelectionTrace::read(modePositionalArgs.first(), &searches);
+        for (const SelectionSearch &search : searches)
+            std::cout << search.summary().toLatin1().constData() << std::endl;
+        if (!ok) {
+            std::cerr << "Could not read all of the selection trace" << std::endl;
+            return -1;
+        }
+        return 0;
+    } else if (mode == TREE && modePositionalArgs.count() == 1) {
+        // One line per node indented by its depth, like the tree command
+        QString fen;
+        QVector<TreeExportNode> nodes;
+        const bool ok = TreeExport::read(modePositionalArgs.first(), &fen, &nodes);
+        std::cout << "fen " << fen.toLatin1().constData() << std::endl;
+        for (const TreeExportNode &node : nodes)
+            std::cout << node.toString().toLatin1().constData() << std::endl;
+        if (!ok) {
+            std::cerr << "Could not read all of the exported tree" << std::endl;
+            return -1;
+        }
+        return 0;
+    } else if (mode == DEBUGFILE || mode == TRACE || mode == TREE || !modePositionalArgs.isEmpty()) {
         std::cerr << fullHelp.toLatin1().constData();
         return -1;
     }
@@ -181,13 +270,57 @@ int main(int argc, char *argv[])
         QString("%0").arg(__DATE__).toLatin1().constData(),
         QString("%0").arg(__TIME__).toLatin1().constData());
 
-    Zobrist::globalInstance();
     Movegen::globalInstance();
 
+    // Is this perft mode?
+    if (mode == PERFT) {
+        PerftEngine engine;
+        engine.run();
+        return 0;
+    }
+
+    // Is this server mode?
+    if (mode == SERVER) {
+        ServerEngine engine(&a);
+        engine.run();
+        return a.exec();
+    }
+
+    // Is this nn server mode?
+    if (mode == NNSERVER) {
+        NNServer server;
+        return server.run() ? 0 : -1;
+    }
+
+    // Is this search server mode?
+    if (mode == SEARCHSERVER) {
+        SearchServer server(&a);
+        if (!server.run())
+            return -1;
+        return a.exec();
+    }
+
+    // Is this analyze mode?
+    if (mode == ANALYZE) {
+        AnalyzeEngine engine(&a);
+        if (!engine.run())
+            return -1;
+        return a.exec();
+    }
+
+    // Is this self play mode?
+    if (mode == SELFPLAY) {
+        SelfPlayEngine engine(&a);
+        if (!engine.run())
+            return -1;
+        return a.exec();
+    }
+
     // Is this benchmark mode?
     if (mode == BENCHMARK) {
         BenchmarkEngine engine(&a);
-        engine.run();
+        if (!engine.run())
+            return -1;
         return a.exec();
     } else {
         UciEngine engine(&a, debugFile);
@@ -9,7 +9,7 @@ CONFIG += c++14 console
 include($$PWD/../lib/git.pri)
 
 !win32 {
-    QMAKE_CXXFLAGS += -march=native -ffast-math
+    QMAKE_CXXFLAGS += -msse4.2 -mpopcnt -ffast-math
 }
 
 CONFIG(release, debug|release) {
@@ -41,4 +41,4 @@ LIBS += -L$$OUT_PWD/../bin -lmargean
 include($$PWD/../lib/atomic.pri)
 include($$PWD/../lib/zlib.pri)
 include($$PWD/../lib/protobuf.pri)
-include($$PWD/../lib/cuda.pri)
+!cpuonly: include($$PWD/../lib/cuda.pri)
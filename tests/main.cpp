@@ -39,6 +39,7 @@ int main(int argc, char* argv[])
     a.setApplicationVersion(versionString());
 
     Options::globalInstance()->addRegularOptions();
+    Options::globalInstance()->addReplayOptions();
 
     int rc = 0;
     Tests tests;
@@ -23,9 +23,11 @@
 #include "cache.h"
 #include "game.h"
 #include "node.h"
+#include "notation.h"
 #include "tree.h"
 #include "options.h"
 #include "tests.h"
+#include "threadaffinity.h"
 
 void Tests::testBasicStructures()
 {
@@ -111,10 +113,50 @@ void Tests::testSizes()
     QCOMPARE(sizeof(Move),            ulong(4));
     QCOMPARE(sizeof(BitBoard),        ulong(8));
     QCOMPARE(sizeof(Game),            ulong(8));
-    QCOMPARE(sizeof(Node::Potential), ulong(8));
-    QCOMPARE(sizeof(Game::Position),  ulong(72));
+    QCOMPARE(sizeof(Node::Potential), ulong(4));
+    QCOMPARE(sizeof(Game::Position),  ulong(56));
     QCOMPARE(sizeof(Node),            ulong(64));
-    QCOMPARE(sizeof(Node::Position),  ulong(96));
+    QCOMPARE(sizeof(Node::Position),  ulong(80));
+}
+
+void Tests::testPackedPotential()
+{
+    // Every legal move comes back out of a potential as the move the position makes of it,
+    // castles and under promotions included
+    StandaloneGame game("r3k3/1P6/8/8/8/8/8/R3K2R w KQq - 0 1");
+    Move moves[Game::Position::MaximumMoves];
+    const int count = game.position().legalMoves(moves);
+    QVERIFY(count > 20);
+    int castles = 0;
+    int promotions = 0;
+    for (int i = 0; i < count; ++i) {
+        const Node::Potential potential(moves[i]);
+        QVERIFY(potential.isValid());
+        QVERIFY(!potential.hasPValue());
+        QCOMPARE(potential.pValue(), -2.0f);
+        QCOMPARE(potential.toString(), Notation::moveToString(moves[i], Chess::Computer));
+
+        Game::Position generated = game.position();
+        Game::Position packed = game.position();
+        Move generatedMove = moves[i];
+        Move packedMove = potential.move();
+        QVERIFY(generated.makeMove(&generatedMove));
+        QVERIFY(packed.makeMove(&packedMove));
+        QCOMPARE(packedMove.data(), generatedMove.data());
+        QVERIFY(packed.isSamePosition(generated));
+        castles += packedMove.isCastle() ? 1 : 0;
+        promotions += packedMove.promotion() != Chess::Unknown ? 1 : 0;
+    }
+    QCOMPARE(castles, 2);
+    QCOMPARE(promotions, 8);
+
+    // The policy is kept to within half a step of 16 bits
+    Node::Potential potential(moves[0]);
+    for (float pValue : { 0.0f, 1.0f / 3.0f, 0.5f, 1.0f }) {
+        potential.setPValue(pValue);
+        QVERIFY(potential.hasPValue());
+        QVERIFY(qAbs(potential.pValue() - pValue) <= 0.5f / 65534.0f);
+    }
 }
 
 void Tests::testCPFormula()
@@ -181,3 +223,16 @@ void Tests::testVLDFormula()
     }
 }
 
+void Tests::testCpuList()
+{
+    QCOMPARE(ThreadAffinity::parseCpuList("0-3,8"), QVector<int>({ 0, 1, 2, 3, 8 }));
+    QCOMPARE(ThreadAffinity::parseCpuList(" 5, 2-3 ,3"), QVector<int>({ 2, 3, 5 }));
+    QVERIFY(ThreadAffinity::parseCpuList("").isEmpty());
+    QVERIFY(ThreadAffinity::parseCpuList("3-1").isEmpty());
+    QVERIFY(ThreadAffinity::parseCpuList("1-").isEmpty());
+    QVERIFY(ThreadAffinity::parseCpuList("a").isEmpty());
+    QCOMPARE(ThreadAffinity::toCpuList({ 0, 1, 2, 3, 8, 10, 11 }), QString("0-3,8,10-11"));
+    QCOMPARE(ThreadAffinity::priority("timecritical"), QThread::TimeCriticalPriority);
+    QCOMPARE(ThreadAffinity::priority("inherit"), QThread::InheritPriority);
+}
+
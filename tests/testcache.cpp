@@ -20,10 +20,13 @@
 
 #include <QtCore>
 
+#include <thread>
+
 #include "cache.h"
 #include "game.h"
 #include "options.h"
 #include "nn.h"
+#include "nnremote.h"
 #include "tests.h"
 #include "tree.h"
 
@@ -54,12 +57,18 @@ inline void setUniqueFlag(CacheItem &item)
     Q_UNUSED(item)
 }
 
+inline bool spendEvictionCredit(CacheItem &item)
+{
+    Q_UNUSED(item)
+    return false;
+}
+
 void Tests::testBasicCache()
 {
     FixedSizeCache<CacheItem> cache;
     cache.reset(1);
-    QCOMPARE(cache.used(), 0);
-    QCOMPARE(cache.size(), 1);
+    QCOMPARE(cache.used(), quint64(0));
+    QCOMPARE(cache.size(), quint64(1));
 
     const quint64 id1 = 1;
     {
@@ -71,8 +80,8 @@ void Tests::testBasicCache()
         QCOMPARE(copyItem->id, item->id);
     }
 
-    QCOMPARE(cache.used(), 1);
-    QCOMPARE(cache.size(), 1);
+    QCOMPARE(cache.used(), quint64(1));
+    QCOMPARE(cache.size(), quint64(1));
     QVERIFY(qFuzzyCompare(cache.percentFull(0), 1.f));
 
     // Reuse previous
@@ -90,8 +99,8 @@ void Tests::testBasicCache()
     }
 
     // Should still be full
-    QCOMPARE(cache.used(), 1);
-    QCOMPARE(cache.size(), 1);
+    QCOMPARE(cache.used(), quint64(1));
+    QCOMPARE(cache.size(), quint64(1));
     QVERIFY(qFuzzyCompare(cache.percentFull(0), 1.f));
 
     // Manual unlink
@@ -101,14 +110,14 @@ void Tests::testBasicCache()
     }
 
     // Should be empty now
-    QCOMPARE(cache.used(), 0);
-    QCOMPARE(cache.size(), 1);
+    QCOMPARE(cache.used(), quint64(0));
+    QCOMPARE(cache.size(), quint64(1));
     QVERIFY(qFuzzyCompare(cache.percentFull(0), 0.f));
 
     // Reset to 5 items
     cache.reset(5);
-    QCOMPARE(cache.used(), 0);
-    QCOMPARE(cache.size(), 5);
+    QCOMPARE(cache.used(), quint64(0));
+    QCOMPARE(cache.size(), quint64(5));
 
     CacheItem *item1 = cache.newObject(1);
     item1->id = 1;
@@ -122,13 +131,13 @@ void Tests::testBasicCache()
     item5->id = 5;
 
     // Should be full
-    QCOMPARE(cache.used(), 5);
-    QCOMPARE(cache.size(), 5);
+    QCOMPARE(cache.used(), quint64(5));
+    QCOMPARE(cache.size(), quint64(5));
     QVERIFY(qFuzzyCompare(cache.percentFull(0), 1.f));
 
     // Unlink third item
     cache.unlink(item3->id);
-    QCOMPARE(cache.used(), 4);
+    QCOMPARE(cache.used(), quint64(4));
 
     // Check contents of hash... all items except third should be there
     QVERIFY(cache.contains(1));
@@ -142,13 +151,13 @@ void Tests::testBasicCache()
         CacheItem *item = cache.newObject(3);
         QCOMPARE(item3, item);
         QCOMPARE(item3->id, item->id);
-        QCOMPARE(cache.used(), 5);
+        QCOMPARE(cache.used(), quint64(5));
     }
 
     // Unlink second and fourth item
     cache.unlink(item2->id);
     cache.unlink(item4->id);
-    QCOMPARE(cache.used(), 3);
+    QCOMPARE(cache.used(), quint64(3));
 
     // Check contents of hash... all items except second and fourth should be there
     QVERIFY(cache.contains(1));
@@ -162,7 +171,7 @@ void Tests::testBasicCache()
         CacheItem *item = cache.newObject(4);
         QCOMPARE(item4, item);
         QCOMPARE(item4->id, item->id);
-        QCOMPARE(cache.used(), 4);
+        QCOMPARE(cache.used(), quint64(4));
     }
 
     // Check contents of hash... all items except second should be there
@@ -177,7 +186,7 @@ void Tests::testBasicCache()
         CacheItem *item = cache.newObject(2);
         QCOMPARE(item2, item);
         QCOMPARE(item2->id, item->id);
-        QCOMPARE(cache.used(), 5);
+        QCOMPARE(cache.used(), quint64(5));
     }
 
     // Check contents of cache... all items should be there
@@ -190,7 +199,7 @@ void Tests::testBasicCache()
     // Unlink first and fifth item
     cache.unlink(item1->id);
     cache.unlink(item5->id);
-    QCOMPARE(cache.used(), 3);
+    QCOMPARE(cache.used(), quint64(3));
 
     // Check contents of hash... all items except first and fifth should be there
     QVERIFY(!cache.contains(1));
@@ -204,7 +213,7 @@ void Tests::testBasicCache()
         CacheItem *item = cache.newObject(5);
         QCOMPARE(item5, item);
         QCOMPARE(item5->id, item->id);
-        QCOMPARE(cache.used(), 4);
+        QCOMPARE(cache.used(), quint64(4));
     }
 
     // Request a new item and should get first item back
@@ -212,7 +221,7 @@ void Tests::testBasicCache()
         CacheItem *item = cache.newObject(1);
         QCOMPARE(item1, item);
         QCOMPARE(item1->id, item->id);
-        QCOMPARE(cache.used(), 5);
+        QCOMPARE(cache.used(), quint64(5));
     }
 
     // Unlink all items
@@ -221,7 +230,7 @@ void Tests::testBasicCache()
     cache.unlink(item3->id);
     cache.unlink(item4->id);
     cache.unlink(item5->id);
-    QCOMPARE(cache.used(), 0);
+    QCOMPARE(cache.used(), quint64(0));
 
     // Check contents of cache... nothing should be there
     QVERIFY(!cache.contains(1));
@@ -243,11 +252,145 @@ void Tests::testBasicCache()
     item5->id = 5;
 
     // Should be full
-    QCOMPARE(cache.used(), 5);
-    QCOMPARE(cache.size(), 5);
+    QCOMPARE(cache.used(), quint64(5));
+    QCOMPARE(cache.size(), quint64(5));
     QVERIFY(qFuzzyCompare(cache.percentFull(0), 1.f));
 }
 
+void Tests::testCacheMemoryUsage()
+{
+    FixedSizeCache<CacheItem> cache;
+    cache.reset(4);
+    const MemoryUsage empty = cache.memoryUsage();
+    QVERIFY(empty.reserved >= empty.peak);
+
+    cache.newObject(1)->id = 1;
+    cache.newObject(2)->id = 2;
+    const MemoryUsage two = cache.memoryUsage();
+    QVERIFY(two.used > empty.used);
+    QCOMPARE(two.peak, two.used);
+    QVERIFY(two.reserved >= two.peak);
+
+    // Unlinking gives back the used bytes but not the peak
+    cache.unlink(2);
+    const MemoryUsage one = cache.memoryUsage();
+    QVERIFY(one.used < two.used);
+    QCOMPARE(one.peak, two.peak);
+}
+
+void Tests::testCachePrefault()
+{
+    // Two slabs of positions, the second of them partial
+    const quint64 positions = 70000;
+    FixedSizeCache<CacheItem> cache;
+    cache.reset(positions);
+    cache.newObject(1)->id = 1;
+    cache.newObject(2)->id = 2;
+
+    std::vector<CacheRegion> regions;
+    cache.allocateAll(&regions);
+    QCOMPARE(int(regions.size()), 3); // along with the table
+    quint64 bytes = 0;
+    for (const CacheRegion &region : regions)
+        bytes += region.bytes;
+    QCOMPARE(cache.memoryUsage().reserved, bytes);
+    QCOMPARE(prefaultRegions(regions, 3, QString(), 0), bytes);
+
+    // What already lived there is untouched and the cache fills the slabs allocated ahead of time
+    QCOMPARE(cache.object(1)->id, quint64(1));
+    QCOMPARE(cache.object(2)->id, quint64(2));
+    for (quint64 id = 3; id <= positions; ++id)
+        cache.newObject(id)->id = id;
+    QCOMPARE(cache.used(), positions);
+    QCOMPARE(cache.memoryUsage().reserved, bytes);
+    QCOMPARE(cache.object(positions)->id, positions);
+}
+
+void Tests::testShardedCache()
+{
+    ShardedCache<Node::Position> cache;
+    cache.reset(4096, 12);
+    QCOMPARE(cache.shards(), 8); // rounded down to a power of two
+    QCOMPARE(cache.size(), quint64(4096));
+
+    // Threads transposing into the same positions at once each end up with one of their own, as
+    // a position referenced but not yet scored is made unique, and find it in its shard after
+    const QVector<Game::Position> positions = {
+        StandaloneGame().position(),
+        StandaloneGame("4k3/8/8/8/8/1R6/8/4K3 b - - 0 40").position(),
+        StandaloneGame("3k4/8/8/8/8/1R6/8/4K3 w - - 1 41").position(),
+        StandaloneGame("8/8/8/8/8/8/6k1/4K2R w K - 0 1").position()
+    };
+    const int threads = 4;
+    const int rounds = 32;
+    QVector<QVector<Node::Position*>> acquired(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            for (int i = 0; i < rounds; ++i) {
+                const Game::Position &position = positions.at(i % positions.count());
+                Node::Position *p = cache.acquire(position.positionHash(), false /*makeUnique*/);
+                p->initialize(position);
+                acquired[t].append(p);
+            }
+        });
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+
+    QCOMPARE(cache.used(), quint64(threads * rounds));
+    for (const QVector<Node::Position*> &list : acquired) {
+        for (Node::Position *p : list) {
+            QCOMPARE(p->refs(), quint32(1));
+            QVERIFY(cache.contains(p->positionHash()));
+            cache.release(p);
+            QCOMPARE(p->refs(), quint32(0));
+        }
+    }
+}
+
+void Tests::testRemoteSampleEncoding()
+{
+    quint64 masks[lczero::kInputPlanes] = {};
+    float values[lczero::kInputPlanes] = {};
+    quint16 policyIndices[lczero::kPolicyIndicesStride] = { 3, 10, 200, 1857 };
+    masks[0] = 0xff00;
+    values[0] = 1.0f;
+    masks[104] = ~0ull;
+    values[104] = 0.5f;
+
+    QByteArray encoded;
+    NNRemote::encodeSample(masks, values, policyIndices, &encoded);
+    NNRemote::encodeSample(masks, values, policyIndices, &encoded);
+
+    // Only the planes with bits set are sent
+    QCOMPARE(encoded.size(), 2 * int(4 * sizeof(quint16) + 2 * sizeof(quint64)
+        + 2 * (sizeof(quint64) + sizeof(float))));
+
+    const char *data = encoded.constData();
+    const char *end = data + encoded.size();
+    for (int sample = 0; sample < 2; ++sample) {
+        quint64 decodedMasks[lczero::kInputPlanes];
+        float decodedValues[lczero::kInputPlanes];
+        quint16 decodedIndices[lczero::kPolicyIndicesStride];
+        QVERIFY(NNRemote::decodeSample(&data, end, decodedMasks, decodedValues, decodedIndices));
+        QCOMPARE(decodedIndices[0], quint16(3));
+        QCOMPARE(decodedIndices[3], quint16(1857));
+        QCOMPARE(decodedMasks[0], quint64(0xff00));
+        QCOMPARE(decodedMasks[1], quint64(0));
+        QCOMPARE(decodedMasks[104], ~0ull);
+        QCOMPARE(decodedValues[104], 0.5f);
+    }
+    QCOMPARE(data, end);
+
+    // A sample cut short is rejected
+    quint64 decodedMasks[lczero::kInputPlanes];
+    float decodedValues[lczero::kInputPlanes];
+    quint16 decodedIndices[lczero::kPolicyIndicesStride];
+    data = encoded.constData();
+    QVERIFY(!NNRemote::decodeSample(&data, data + 20, decodedMasks, decodedValues, decodedIndices));
+}
+
 void Tests::testStart(const StandaloneGame &start)
 {
     Tree tree;
@@ -257,7 +400,7 @@ void Tests::testStart(const StandaloneGame &start)
     QCOMPARE(start.position().positionHash(), root->position()->positionHash());
     root->generatePotentials();
 
-    QVector<Node::Potential> *potentials = root->m_position->potentials(); // not a copy
+    Node::PotentialVector *potentials = root->m_position->potentials(); // not a copy
     QCOMPARE(potentials->count(), 20);
     for (int i = 0; i < potentials->count(); ++i) {
         Node::Potential *potential = &((*potentials)[i]);
@@ -299,6 +442,90 @@ void Tests::testStartingPositionBlack()
     testStart(start);
 }
 
+void Tests::testPartialPotentialOrder()
+{
+    Tree tree;
+    Node *root = tree.embodiedRoot();
+    QVERIFY(root);
+    root->generatePotentials();
+
+    // Ties included so the order must come out the same as a full stable sort
+    Node::PotentialVector *potentials = root->m_position->potentials(); // not a copy
+    QCOMPARE(potentials->count(), 20);
+    QVector<Node::Potential> expected;
+    for (int i = 0; i < potentials->count(); ++i) {
+        (*potentials)[i].setPValue(float((i * 7) % 5) / 10.0f);
+        expected.append(potentials->at(i));
+    }
+    std::stable_sort(expected.begin(), expected.end(),
+        [](const Node::Potential &a, const Node::Potential &b) {
+        return a.pValue() > b.pValue();
+    });
+
+    Node::sortByPVals(*potentials, 2);
+    QCOMPARE(potentials->sorted(), 2);
+    for (int i = 0; i < 2; ++i)
+        QCOMPARE(potentials->at(i).toString(), expected.at(i).toString());
+
+    // Expanding children extends the order ahead of the index as it goes
+    for (int i = 0; i < potentials->count(); ++i) {
+        Node::NodeGenerationError error = Node::NoError;
+        Node *child = root->generateNextChild(Cache::globalInstance(), &error);
+        QVERIFY(child);
+        QCOMPARE(Notation::moveToString(child->m_game.lastMove(), Chess::Computer), expected.at(i).toString());
+        QCOMPARE(potentials->sorted(), qMin(i + 3, potentials->count()));
+    }
+}
+
+void Tests::testRefineEvaluation()
+{
+    Tree tree;
+    Node *root = tree.embodiedRoot();
+    QVERIFY(root);
+    root->generatePotentials();
+
+    // As the small network would have left it after two visits, one of them to the first child
+    Node::PotentialVector *potentials = root->m_position->potentials(); // not a copy
+    for (int i = 0; i < potentials->count(); ++i)
+        (*potentials)[i].setPValue(float(potentials->count() - i) / 1000.0f);
+    root->setPositionQValue(0.2f);
+    potentials->setSmallValue(0.2f);
+    QVERIFY(potentials->hasSmallValue());
+    QVERIFY(qAbs(potentials->smallValue() - 0.2f) < 0.0001f);
+    Node::sortByPVals(*potentials, 2);
+
+    Node::NodeGenerationError error = Node::NoError;
+    Node *first = root->generateNextChild(Cache::globalInstance(), &error);
+    Node *second = root->generateNextChild(Cache::globalInstance(), &error);
+    QVERIFY(first && second);
+    first->m_visited = 1;
+    first->m_qValue = -0.1f;
+    root->m_visited = 2;
+    root->m_qValue = 0.15f;
+    root->m_policySum = first->pValue();
+
+    // The large network likes the second child best and the last move made into no child yet
+    const QString firstMove = Notation::moveToString(first->m_game.lastMove(), Chess::Computer);
+    const QString secondMove = Notation::moveToString(second->m_game.lastMove(), Chess::Computer);
+    const QString lastMove = potentials->at(potentials->count() - 1).toString();
+    for (int i = 0; i < potentials->count(); ++i) {
+        const QString move = potentials->at(i).toString();
+        (*potentials)[i].setPValue(move == secondMove ? 0.5f : move == lastMove ? 0.3f : move == firstMove ? 0.1f : 0.005f);
+    }
+    root->refineEvaluation(0.6f);
+
+    QVERIFY(!potentials->hasSmallValue());
+    QVERIFY(qAbs(first->pValue() - 0.1f) < 0.0001f);
+    QVERIFY(qAbs(second->pValue() - 0.5f) < 0.0001f);
+    QVERIFY(qAbs(root->m_policySum - first->pValue()) < 0.0001f);
+    QVERIFY(qAbs(root->qValue() - 0.35f) < 0.0001f);
+    QCOMPARE(potentials->sorted(), 2);
+
+    Node *third = root->generateNextChild(Cache::globalInstance(), &error);
+    QVERIFY(third);
+    QCOMPARE(Notation::moveToString(third->m_game.lastMove(), Chess::Computer), lastMove);
+}
+
 void Tests::perft(int depth, Node *node, PerftResult *result)
 {
     if (!depth) {
@@ -319,7 +546,7 @@ void Tests::perft(int depth, Node *node, PerftResult *result)
     if (!node->checkMoveClockOrThreefold(node->position()->positionHash(), Cache::globalInstance()))
         node->generatePotentials();
 
-    QVector<Node::Potential> *potentials = node->m_position->potentials(); // not a copy
+    Node::PotentialVector *potentials = node->m_position->potentials(); // not a copy
     int nodes = potentials->count();
     for (int i = 0; i < nodes; ++i) {
         Node::Potential *potential = &((*potentials)[i]);
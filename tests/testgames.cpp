@@ -20,16 +20,28 @@
 
 #include <QtCore>
 
+#include <limits>
+#include <thread>
+
+#include "analyzeengine.h"
 #include "cache.h"
+#include "clock.h"
+#include "debuglog.h"
 #include "game.h"
 #include "history.h"
+#include "matesolver.h"
+#include "metrics.h"
 #include "nn.h"
 #include "node.h"
 #include "notation.h"
 #include "options.h"
+#include "replay.h"
 #include "searchengine.h"
+#include "selectiontrace.h"
+#include "stagetimes.h"
 #include "tests.h"
 #include "tree.h"
+#include "treeexport.h"
 #include "uciengine.h"
 
 void Tests::testCastlingAnd960()
@@ -412,6 +424,48 @@ void Tests::testSearchForMateInOne()
         || handler.lastInfo().score == QLatin1String("cp 25600"));
 }
 
+void Tests::testTranspositionGraph()
+{
+    StandaloneGame g;
+    Node node;
+    Node::Position position;
+    node.initialize(nullptr, g);
+    node.setPosition(&position);
+    position.initialize(g.position());
+
+    // A transposition has searched the position more than this node
+    position.setQValue(0.5f);
+    position.setVisits(10);
+    node.setQValue(0.1f);
+    QVERIFY(qFuzzyCompare(node.sharedQValue(), 0.1f));
+    SearchSettings::transpositionGraph = true;
+    QVERIFY(qFuzzyCompare(node.sharedQValue(), 0.5f));
+
+    // Values that depend on the path are kept
+    node.setContext(Node::GameCycleInTree);
+    QVERIFY(qFuzzyCompare(node.sharedQValue(), 0.1f));
+    SearchSettings::transpositionGraph = false;
+}
+
+void Tests::testMateSolver()
+{
+    // Back rank mate for the side to move
+    const StandaloneGame backRank("6k1/5ppp/8/8/8/8/8/R5K1 w - - 0 1");
+    QCOMPARE(MateSolver::solve(backRank, backRank.position(), 1), MateSolver::Mates);
+    QCOMPARE(MateSolver::solve(backRank, backRank.position(), 0), MateSolver::Unknown);
+
+    // The only move walks into a mate, which the other side to move gives right away
+    const StandaloneGame cornered("k7/7R/1K6/8/8/8/8/8 b - - 0 1");
+    QCOMPARE(MateSolver::solve(cornered, cornered.position(), 1), MateSolver::IsMated);
+    const StandaloneGame cornering("k7/7R/1K6/8/8/8/8/8 w - - 0 1");
+    QCOMPARE(MateSolver::solve(cornering, cornering.position(), 1), MateSolver::Mates);
+
+    // Nothing to prove without a forced mate, nor once the budget runs out
+    const StandaloneGame start;
+    QCOMPARE(MateSolver::solve(start, start.position(), 2), MateSolver::Unknown);
+    QCOMPARE(MateSolver::solve(cornered, cornered.position(), 1, 1), MateSolver::Unknown);
+}
+
 void Tests::testInstaMove()
 {
     const QLatin1String oneLegalMove = QLatin1String("position fen rnbqk2r/pppp1p1p/4pn1p/8/1bPP4/N7/PP2PPPP/R2QKBNR w KQkq - 3 5");
@@ -459,6 +513,220 @@ void Tests::testEarlyExit()
     QCOMPARE(handler.lastInfo().score, QLatin1String("mate 1"));
 }
 
+void Tests::testClockSpeedModel()
+{
+    Clock clock(nullptr);
+    QCOMPARE(clock.expectedNps(256), quint32(0));
+
+    // Learned for the opening and batch size it was recorded with
+    clock.setMaterialScore(78);
+    clock.recordSpeed(10000, 256);
+    QCOMPARE(clock.expectedNps(256), quint32(10000));
+    clock.recordSpeed(20000, 256);
+    QCOMPARE(clock.expectedNps(256), quint32(12000));
+
+    // Another batch size falls back on the closest one learned and another phase on the same one
+    QCOMPARE(clock.expectedNps(16), quint32(12000));
+    clock.recordSpeed(4000, 16);
+    QCOMPARE(clock.expectedNps(16), quint32(4000));
+    clock.setMaterialScore(10);
+    QCOMPARE(clock.expectedNps(16), quint32(4000));
+    clock.recordSpeed(2000, 16);
+    QCOMPARE(clock.expectedNps(16), quint32(2000));
+    QCOMPARE(clock.expectedNps(256), quint32(2000));
+}
+
+void Tests::testPonder()
+{
+    const QLatin1String oneLegalMove = QLatin1String("position fen rnbqk2r/pppp1p1p/4pn1p/8/1bPP4/N7/PP2PPPP/R2QKBNR w KQkq - 3 5");
+    UciEngine engine(this, QString());
+    UCIIOHandler handler(this);
+    engine.installIOHandler(&handler);
+
+    // Even an insta move has to wait for the ponderhit
+    QSignalSpy bestMoveSpy(&handler, &UCIIOHandler::receivedBestMove);
+    engine.readyRead(oneLegalMove);
+    engine.readyRead(QLatin1String("go ponder wtime 1000000 btime 1000000"));
+    QVERIFY(!bestMoveSpy.wait(1000));
+    engine.readyRead(QLatin1String("ponderhit"));
+    const bool receivedSignal = bestMoveSpy.isEmpty() ? bestMoveSpy.wait(1000000) : true;
+    if (!receivedSignal) {
+        QString message = QString("Did not receive signal for %1").arg(oneLegalMove);
+        QWARN(message.toLatin1().constData());
+        engine.readyRead(QLatin1String("stop"));
+    }
+    QVERIFY(receivedSignal);
+    QVERIFY2(handler.lastBestMove() == QLatin1String("d1d2"), QString("Result is %1")
+        .arg(handler.lastBestMove()).toLatin1().constData());
+}
+
+void Tests::testDeepTreeReuse()
+{
+    UciEngine engine(this, QString());
+    UCIIOHandler handler(this);
+    engine.installIOHandler(&handler);
+
+    QSignalSpy bestMoveSpy(&handler, &UCIIOHandler::receivedBestMove);
+    engine.readyRead(QLatin1String("position startpos"));
+    engine.readyRead(QLatin1String("go nodes 5000"));
+    const bool receivedSignal = bestMoveSpy.isEmpty() ? bestMoveSpy.wait(1000000) : true;
+    QVERIFY(receivedSignal);
+
+    // Resume more than a move pair down the principal variation
+    QVector<QString> pv = handler.lastInfo().pv.split(' ').toVector();
+    QVERIFY(pv.count() >= 3);
+    pv.resize(qMin(4, pv.count()));
+    engine.readyRead(QLatin1String("position startpos moves ") + pv.toList().join(' '));
+
+    Tree *tree = engine.searchEngine()->tree();
+    QVERIFY(tree);
+    tree->clearRoot();
+    Node *root = tree->embodiedRoot();
+    QVERIFY(root);
+    QVERIFY(root->visits() > 1);
+    QVERIFY(root->position()->position().isSamePosition(History::globalInstance()->currentGame().position()));
+
+    // Compacting moves the reused tree to the front of the arena and leaves it as it was
+    const quint32 visits = root->visits();
+    const int count = root->count();
+    const QString best = root->bestChild()->toString();
+    const quint64 used = Cache::globalInstance()->used();
+    QVERIFY(tree->compact());
+    root = tree->embodiedRoot();
+    QCOMPARE(root, Cache::globalInstance()->node(1));
+    QCOMPARE(Cache::globalInstance()->used(), used);
+    QCOMPARE(root->visits(), visits);
+    QCOMPARE(root->count(), count);
+    QCOMPARE(root->bestChild()->toString(), best);
+    QCOMPARE(root->bestChild()->parent(), root);
+}
+
+void Tests::testTreeCheckpoint()
+{
+    UciEngine engine(this, QString());
+    UCIIOHandler handler(this);
+    engine.installIOHandler(&handler);
+
+    QSignalSpy bestMoveSpy(&handler, &UCIIOHandler::receivedBestMove);
+    engine.readyRead(QLatin1String("position startpos"));
+    engine.readyRead(QLatin1String("go nodes 2000"));
+    const bool receivedSignal = bestMoveSpy.isEmpty() ? bestMoveSpy.wait(1000000) : true;
+    QVERIFY(receivedSignal);
+
+    Tree *tree = engine.searchEngine()->tree();
+    Node *root = tree->embodiedRoot();
+    const quint32 visits = root->visits();
+    const int count = root->count();
+    const int children = root->childCount();
+    const QString best = root->bestChild()->toString();
+    QVERIFY(count > 1);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString fileName = dir.filePath("tree.bin");
+    QString error;
+    QVERIFY2(tree->save(fileName, &error), qPrintable(error));
+
+    const quint64 usedBefore = Cache::globalInstance()->used();
+    tree->clearRoot(false /*resumeIfPossible*/);
+    QVERIFY(Cache::globalInstance()->used() < usedBefore);
+    QVERIFY2(tree->restore(fileName, &error), qPrintable(error));
+    QCOMPARE(Cache::globalInstance()->used(), usedBefore);
+
+    root = tree->embodiedRoot();
+    QCOMPARE(root->visits(), visits);
+    QCOMPARE(root->count(), count);
+    QCOMPARE(root->childCount(), children);
+    QCOMPARE(root->bestChild()->toString(), best);
+
+    // The next search of the same position goes on from the restored root
+    tree->clearRoot();
+    QCOMPARE(tree->embodiedRoot(), root);
+
+    // A checkpoint cut short is refused and leaves the tree alone
+    QFile file(fileName);
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QVERIFY(file.resize(file.size() - 1));
+    file.close();
+    QVERIFY(!tree->restore(fileName, &error));
+    QCOMPARE(tree->embodiedRoot(), root);
+}
+
+void Tests::testTreeExport()
+{
+    UciEngine engine(this, QString());
+    UCIIOHandler handler(this);
+    engine.installIOHandler(&handler);
+
+    QSignalSpy bestMoveSpy(&handler, &UCIIOHandler::receivedBestMove);
+    engine.readyRead(QLatin1String("position startpos"));
+    engine.readyRead(QLatin1String("go nodes 2000"));
+    const bool receivedSignal = bestMoveSpy.isEmpty() ? bestMoveSpy.wait(1000000) : true;
+    QVERIFY(receivedSignal);
+
+    const Node *root = engine.searchEngine()->tree()->embodiedRoot();
+    int scoredChildren = 0;
+    for (const Node *child = root->firstChild(); child; child = child->nextSibling())
+        scoredChildren += child->visits() ? 1 : 0;
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString fileName = dir.filePath("tree.export");
+    quint64 written = 0;
+    QString error;
+    QVERIFY2(TreeExport::write(root, fileName, 1, 1, true /*withPotentials*/, &written, &error), qPrintable(error));
+    QCOMPARE(written, quint64(1 + scoredChildren));
+
+    QString fen;
+    QVector<TreeExportNode> nodes;
+    QVERIFY(TreeExport::read(fileName, &fen, &nodes));
+    QCOMPARE(fen, QString("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"));
+    QCOMPARE(quint64(nodes.count()), written);
+    QCOMPARE(nodes.first().depth, quint16(0));
+    QCOMPARE(nodes.first().visits, root->visits());
+    QCOMPARE(nodes.first().moveString(), QString("start"));
+    QStringList moves;
+    for (int i = 1; i < nodes.count(); ++i) {
+        QCOMPARE(nodes.at(i).depth, quint16(1));
+        moves.append(nodes.at(i).moveString());
+    }
+    QVERIFY(moves.contains(Notation::moveToString(root->bestChild()->game().lastMove(), Chess::Computer)));
+
+    // The whole tree goes depth first with each node right after its parent
+    QVERIFY2(TreeExport::write(root, fileName, std::numeric_limits<int>::max(), 1,
+        false /*withPotentials*/, &written, &error), qPrintable(error));
+    nodes.clear();
+    QVERIFY(TreeExport::read(fileName, &fen, &nodes));
+    QVERIFY(nodes.count() > 1 + scoredChildren);
+    QCOMPARE(quint64(nodes.count()), written);
+    quint32 childVisits = 0;
+    for (const TreeExportNode &node : nodes)
+        childVisits += node.depth == 1 ? node.visits : 0;
+    QVERIFY(childVisits < root->visits());
+
+    // Castles come back as the king's two step rather than the king takes rook they are made as
+    bestMoveSpy.clear();
+    engine.readyRead(QLatin1String("ucinewgame"));
+    engine.readyRead(QLatin1String("position fen r3k2r/8/8/8/8/8/8/R3K2R w KQkq - 0 1"));
+    engine.readyRead(QLatin1String("go nodes 500"));
+    QVERIFY(bestMoveSpy.isEmpty() ? bestMoveSpy.wait(1000000) : true);
+    root = engine.searchEngine()->tree()->embodiedRoot();
+    QVERIFY2(TreeExport::write(root, fileName, 1, 1, true /*withPotentials*/, &written, &error), qPrintable(error));
+    nodes.clear();
+    QVERIFY(TreeExport::read(fileName, &fen, &nodes));
+    moves.clear();
+    for (int i = 0; i < nodes.count(); ++i) {
+        if (i)
+            moves.append(nodes.at(i).moveString());
+        for (const QPair<quint16, float> &potential : nodes.at(i).potentials)
+            moves.append(Notation::moveToString(TreeExport::unpackMove(potential.first), Chess::Computer));
+    }
+    QVERIFY(moves.contains(QLatin1String("e1g1")));
+    QVERIFY(moves.contains(QLatin1String("e1c1")));
+    QVERIFY(!moves.contains(QLatin1String("e1h1")));
+    QVERIFY(!moves.contains(QLatin1String("e1a1")));
+}
+
 void Tests::testHistory()
 {
     QLatin1String fen = QLatin1String("4k3/8/8/8/8/1R6/8/4K3 b - - 0 40");
@@ -507,6 +775,374 @@ void Tests::testHistory()
     QCOMPARE(lastNode->toString(), QLatin1String("b3a3 d7c7 a3a6 c7c8 a6a1 c8d7 f1g1 d7c6 a1a8 c6b7 a8d8 b7a7"));
 }
 
+void Tests::testSessionHistory()
+{
+    History::globalInstance()->clear();
+    History::globalInstance()->addGame(StandaloneGame());
+
+    // A thread bound to a history of its own sees and changes only that one
+    History session;
+    int sessionCount = -1;
+    bool sessionIsBound = false;
+    std::thread thread([&]() {
+        History::setThreadInstance(&session);
+        sessionIsBound = History::globalInstance() == &session;
+        History::globalInstance()->addGame(StandaloneGame("4k3/8/8/8/8/1R6/8/4K3 b - - 0 40"));
+        History::globalInstance()->addGame(StandaloneGame("3k4/8/8/8/8/1R6/8/4K3 w - - 1 41"));
+        sessionCount = History::globalInstance()->count();
+    });
+    thread.join();
+
+    QVERIFY(sessionIsBound);
+    QCOMPARE(sessionCount, 2);
+    QCOMPARE(session.count(), 2);
+    QCOMPARE(History::globalInstance()->count(), 1);
+    QVERIFY(History::globalInstance() != &session);
+    History::globalInstance()->clear();
+}
+
+void Tests::testConcurrentSessions()
+{
+    // Sessions searching at the same time each grow a tree in a cache of their own and leave the
+    // process wide one alone
+    UciEngine::resetSharedState(true /*forSessions*/);
+    const quint64 used = Cache::globalInstance()->used();
+    const QStringList positions = { QLatin1String("startpos"),
+        QLatin1String("fen r3k2r/8/8/8/8/8/8/R3K2R w KQkq - 0 1") };
+    QVector<QThread*> threads;
+    QVector<AnalyzeSession*> sessions;
+    QStringList bestMoves = { QString(), QString() };
+    for (int i = 0; i < positions.count(); ++i) {
+        QThread *thread = new QThread;
+        AnalyzeSession *session = new AnalyzeSession(i, Cache::positionsFromOptions());
+        session->moveToThread(thread);
+        connect(thread, &QThread::finished, session, &QObject::deleteLater);
+        connect(session, &AnalyzeSession::analyzed, this,
+            [&bestMoves](int s, const QString &bestMove, const SearchInfo &) {
+            bestMoves[s] = bestMove;
+        }, Qt::QueuedConnection);
+        thread->start();
+        threads.append(thread);
+        sessions.append(session);
+    }
+
+    for (int i = 0; i < sessions.count(); ++i) {
+        QMetaObject::invokeMethod(sessions.at(i), "analyze", Qt::QueuedConnection,
+            Q_ARG(QString, positions.at(i)), Q_ARG(int, 2000));
+    }
+    QTRY_VERIFY_WITH_TIMEOUT(!bestMoves.at(0).isEmpty() && !bestMoves.at(1).isEmpty(), 1000000);
+    QCOMPARE(Cache::globalInstance()->used(), used);
+
+    for (int i = 0; i < sessions.count(); ++i) {
+        QMetaObject::invokeMethod(sessions.at(i), "quit", Qt::BlockingQueuedConnection);
+        threads.at(i)->quit();
+        threads.at(i)->wait();
+        delete threads.at(i);
+    }
+}
+
+void Tests::testIncrementalPosition()
+{
+    UciEngine engine(this, QString());
+    UCIIOHandler handler(this);
+    engine.installIOHandler(&handler);
+
+    // Moves that extend the last position are played on top of the history the same way a fresh
+    // setup plays all of them, repetitions included
+    const QString moves = QLatin1String("g1f3 g8f6 f3g1 f6g8 g1f3 g8f6 f3g1 f6g8");
+    engine.readyRead(QLatin1String("position startpos moves ") + moves);
+    const QVector<StandaloneGame> fresh = History::globalInstance()->games();
+    QCOMPARE(fresh.count(), 8);
+
+    engine.readyRead(QLatin1String("position startpos"));
+    QStringList played;
+    for (const QString &move : moves.split(' ')) {
+        played.append(move);
+        engine.readyRead(QLatin1String("position startpos moves ") + played.join(' '));
+    }
+    const QVector<StandaloneGame> incremental = History::globalInstance()->games();
+    QCOMPARE(incremental.count(), fresh.count());
+    for (int i = 0; i < fresh.count(); ++i) {
+        QVERIFY(incremental.at(i).position().isSamePosition(fresh.at(i).position()));
+        QCOMPARE(incremental.at(i).repetitions(), fresh.at(i).repetitions());
+    }
+    QCOMPARE(incremental.last().repetitions(), 1);
+
+    // Anything else starts over
+    engine.readyRead(QLatin1String("position startpos moves d2d4"));
+    QCOMPARE(History::globalInstance()->count(), 1);
+    engine.readyRead(QLatin1String("position startpos"));
+    QCOMPARE(History::globalInstance()->count(), 1);
+    engine.readyRead(QLatin1String("position startpos moves d2d4 d7d5"));
+    QCOMPARE(History::globalInstance()->count(), 2);
+    History::globalInstance()->clear();
+}
+
+void Tests::testInfoSlot()
+{
+    InfoSlot slot;
+    InfoSnapshot snapshot;
+    quint64 sequence = 0;
+    QVERIFY(!slot.read(&snapshot, &sequence));
+
+    InfoSnapshot published;
+    published.depth = 7;
+    published.nodes = 12345;
+    published.pvLength = 1;
+    published.pv[0] = Notation::stringToMove("e2e4", Chess::Computer);
+    published.workerInfo.searchId = 3;
+    slot.publish(published);
+
+    // Read once and then nothing until the next publish
+    QVERIFY(slot.read(&snapshot, &sequence));
+    QCOMPARE(snapshot.depth, quint32(7));
+    QCOMPARE(snapshot.nodes, quint64(12345));
+    QCOMPARE(snapshot.workerInfo.searchId, quint32(3));
+    QCOMPARE(Notation::moveToString(snapshot.pv[0], Chess::Computer), QString("e2e4"));
+    QVERIFY(!slot.read(&snapshot, &sequence));
+
+    // A reader that falls behind only sees the latest
+    published.depth = 8;
+    slot.publish(published);
+    published.depth = 9;
+    slot.publish(published);
+    QVERIFY(slot.read(&snapshot, &sequence));
+    QCOMPARE(snapshot.depth, quint32(9));
+    QVERIFY(!slot.read(&snapshot, &sequence));
+}
+
+void Tests::testStageTimes()
+{
+    StageTimes times;
+    QCOMPARE(times.count(StageTimes::Encode), quint64(0));
+    QCOMPARE(times.percentile(StageTimes::Encode, 0.5), qint64(0));
+
+    for (int i = 0; i < 99; ++i)
+        times.record(StageTimes::Encode, 1000);
+    times.record(StageTimes::Encode, 1000000);
+    QCOMPARE(times.count(StageTimes::Encode), quint64(100));
+    QCOMPARE(times.count(StageTimes::Evaluate), quint64(0));
+
+    // Percentiles are the upper bounds of quarter octave buckets
+    const qint64 p50 = times.percentile(StageTimes::Encode, 0.5);
+    QVERIFY(p50 >= 1000 && p50 <= 1250);
+    QCOMPARE(times.percentile(StageTimes::Encode, 0.99), p50);
+    const qint64 p100 = times.percentile(StageTimes::Encode, 1.0);
+    QVERIFY(p100 >= 1000000 && p100 <= 1250000);
+    QVERIFY(times.toString().startsWith("encode 100 "));
+
+    StageTimes total;
+    total.add(times);
+    total.add(times);
+    QCOMPARE(total.count(StageTimes::Encode), quint64(200));
+    times.reset();
+    QCOMPARE(times.count(StageTimes::Encode), quint64(0));
+    QVERIFY(times.toString().isEmpty());
+}
+
+void Tests::testDebugLog()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString fileName = dir.filePath("debug.log");
+
+    DebugLog log;
+    log.setFilePath(fileName);
+    log.append("dropped while disabled\n");
+    log.setEnabled(true);
+    QVERIFY(log.isEnabled());
+
+    // More messages than the ring holds from several threads at once
+    const int threads = 4;
+    const int messages = DebugLog::Capacity;
+    std::vector<std::thread> writers;
+    for (int i = 0; i < threads; ++i) {
+        writers.emplace_back([&log, i]() {
+            for (int j = 0; j < messages; ++j)
+                log.append(QString("Debug: %0 %1\n").arg(i).arg(j).toLatin1());
+        });
+    }
+    for (std::thread &writer : writers)
+        writer.join();
+    log.flush();
+
+    QFile file(fileName);
+    QVERIFY(file.open(QIODevice::ReadOnly | QIODevice::Text));
+    const QStringList lines = QString(file.readAll()).split('\n', QString::SkipEmptyParts);
+    QCOMPARE(lines.count(), threads * messages + 1);
+    QVERIFY(lines.first().startsWith("Output: log pid "));
+
+    // Every thread's messages are whole and in the order it appended them
+    QVector<int> next(threads, 0);
+    for (int i = 1; i < lines.count(); ++i) {
+        const QStringList parts = lines.at(i).split(' ');
+        QCOMPARE(parts.count(), 3);
+        const int thread = parts.at(1).toInt();
+        QCOMPARE(parts.at(2).toInt(), next[thread]++);
+    }
+}
+
+void Tests::testMetrics()
+{
+    Metrics metrics;
+    SearchInfo info;
+    info.nps = 1234;
+    info.nodes = 5678;
+    metrics.setSearchInfo(info);
+
+    // Two batches overlapping on the first device and one on the second
+    metrics.beginEvaluation(0);
+    metrics.beginEvaluation(0);
+    metrics.endEvaluation(0, 3);
+    metrics.endEvaluation(0, 256);
+    metrics.beginEvaluation(1);
+    metrics.endEvaluation(1, 100000);
+
+    const QStringList lines = metrics.toString().split('\n', QString::SkipEmptyParts);
+    QVERIFY(lines.contains("allie_nps 1234"));
+    QVERIFY(lines.contains("allie_search_nodes 5678"));
+    QVERIFY(lines.contains("allie_gpu_batches_total{device=\"0\"} 2"));
+    QVERIFY(lines.contains("allie_gpu_positions_total{device=\"0\"} 259"));
+    QVERIFY(lines.contains("allie_gpu_batches_total{device=\"1\"} 1"));
+    QVERIFY(lines.contains("allie_nn_batch_positions_bucket{le=\"2\"} 0"));
+    QVERIFY(lines.contains("allie_nn_batch_positions_bucket{le=\"4\"} 1"));
+    QVERIFY(lines.contains("allie_nn_batch_positions_bucket{le=\"256\"} 2"));
+    QVERIFY(lines.contains("allie_nn_batch_positions_bucket{le=\"+Inf\"} 3"));
+    QVERIFY(lines.contains("allie_nn_batch_positions_count 3"));
+    QVERIFY(lines.contains("allie_queue_depth{queue=\"in\"} 0"));
+
+    // Every sample is a name with optional labels and a number
+    for (const QString &line : lines) {
+        if (line.startsWith('#'))
+            continue;
+        const QStringList parts = line.split(' ');
+        QCOMPARE(parts.count(), 2);
+        bool ok = false;
+        parts.at(1).toDouble(&ok);
+        QVERIFY(ok);
+    }
+}
+
+void Tests::testSyntheticNetwork()
+{
+    // The whole search runs without weights or gpus with every batch taking the latency given
+    const QString synthetic = Options::globalInstance()->option("SyntheticNetwork").value();
+    Options::globalInstance()->setOption("SyntheticNetwork", QLatin1Literal("true"));
+    Options::globalInstance()->setOption("SyntheticLatency", QLatin1Literal("100"));
+    const qint64 busy = Metrics::globalInstance()->busyNsecs(0);
+
+    UciEngine engine(this, QString());
+    UCIIOHandler handler(this);
+    engine.installIOHandler(&handler);
+
+    QSignalSpy bestMoveSpy(&handler, &UCIIOHandler::receivedBestMove);
+    engine.readyRead(QLatin1String("position startpos"));
+    engine.readyRead(QLatin1String("go nodes 2000"));
+    const bool receivedSignal = bestMoveSpy.isEmpty() ? bestMoveSpy.wait(1000000) : true;
+    if (!receivedSignal)
+        engine.readyRead(QLatin1String("stop"));
+
+    Options::globalInstance()->setOption("SyntheticNetwork", synthetic);
+    Options::globalInstance()->setOption("SyntheticLatency", QLatin1Literal("0"));
+
+    QVERIFY(receivedSignal);
+    QVERIFY(!handler.lastBestMove().isEmpty());
+    QVERIFY(handler.lastInfo().nodes > 1);
+    QVERIFY(!handler.lastInfo().pv.isEmpty());
+    QVERIFY(Metrics::globalInstance()->busyNsecs(0) - busy >= 100000);
+}
+
+void Tests::testSelectionTrace()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString fileName = dir.filePath("selection.trace");
+
+    SelectionRecord filled;
+    filled.target = 256;
+    filled.filled = 256;
+    filled.nsecs = 1000;
+    SelectionRecord tryLimit;
+    tryLimit.target = 256;
+    tryLimit.filled = 64;
+    tryLimit.collisions = 136;
+    tryLimit.vldSpent = 900;
+    tryLimit.exact = 3;
+    tryLimit.cached = 5;
+    tryLimit.nsecs = 5000;
+    tryLimit.exit = SelectionRecord::TryLimit;
+
+    // A second open appends to the same trace
+    SelectionTrace trace;
+    QVERIFY(trace.open(fileName));
+    trace.beginSearch(1, "8/8/8/8/8/8/8/K6k w - - 0 1");
+    trace.record(filled);
+    trace.close();
+    QVERIFY(trace.open(fileName));
+    trace.beginSearch(2, "8/8/8/8/8/8/8/K6k b - - 0 1");
+    trace.record(filled);
+    trace.record(tryLimit);
+    trace.close();
+
+    QVector<SelectionSearch> searches;
+    QVERIFY(SelectionTrace::read(fileName, &searches));
+    QCOMPARE(searches.count(), 2);
+    QCOMPARE(searches.at(0).searchId, quint32(1));
+    QCOMPARE(searches.at(0).batches.count(), 1);
+    QCOMPARE(searches.at(1).fen, QString("8/8/8/8/8/8/8/K6k b - - 0 1"));
+    QCOMPARE(searches.at(1).batches.count(), 2);
+    const SelectionRecord read = searches.at(1).batches.at(1);
+    QCOMPARE(read.filled, quint32(64));
+    QCOMPARE(read.collisions, quint32(136));
+    QCOMPARE(read.vldSpent, quint32(900));
+    QCOMPARE(read.exact, quint32(3));
+    QCOMPARE(read.cached, quint32(5));
+    QCOMPARE(read.nsecs, qint64(5000));
+    QCOMPARE(read.exit, SelectionRecord::TryLimit);
+    QVERIFY(qFuzzyCompare(read.fillRatio(), 0.25f));
+    QVERIFY(searches.at(1).summary().contains("exits filled 1 trylimit 1"));
+}
+
+void Tests::testReplay()
+{
+    QQueue<QString> lines;
+    lines << "Output: info depth 1 seldepth 1 nodes 10 nps 100 score cp 5 time 100 pv e2e4"
+          << "Input: stop"
+          << "Output: info isResume false batchSize 128 rawnps 900 nnnps 800"
+          << "info depth 3 seldepth 4 nodes 500 nps 1000 score cp 10 time 500 pv e2e4 e7e5"
+          << "Output: bestmove e2e4 ponder e7e5"
+          << "Input: position startpos moves e2e4 e7e5";
+
+    // The search is replayed for the nodes it ended up with and its logged output is taken
+    Replay replay;
+    QString go = "go wtime 1000 btime 1000 searchmoves e2e4 d2d4";
+    QString waiting;
+    QVERIFY(replay.rewriteGo(&go, &lines, &waiting));
+    QCOMPARE(go, QString("go nodes 500 searchmoves e2e4 d2d4"));
+    QCOMPARE(waiting, QString("bestmove"));
+    QCOMPARE(lines.count(), 1);
+
+    // A log cut short before the bestmove is left alone
+    QQueue<QString> cut;
+    cut << "Output: info depth 1 seldepth 1 nodes 10 nps 100 score cp 5 time 100 pv e2e4";
+    go = "go infinite";
+    QVERIFY(!replay.rewriteGo(&go, &cut, &waiting));
+    QCOMPARE(go, QString("go infinite"));
+    QCOMPARE(cut.count(), 1);
+
+    ReplayMove move;
+    QVERIFY(move.readOutput("info isResume false batchSize 128 rawnps 900 nnnps 800"));
+    QVERIFY(move.readOutput("info depth 3 seldepth 4 nodes 1000 nps 2000 score cp 10 time 500 pv e2e4"));
+    QVERIFY(!move.readOutput("bestmove e2e4"));
+    QCOMPARE(move.batchSize, quint32(128));
+    QCOMPARE(move.nodes, quint64(1000));
+    ReplayMove base;
+    base.nodes = 500;
+    base.time = 500;
+    base.nps = 1000;
+    QVERIFY(Replay::compare({ move }, { base }).contains("speedup 2"));
+}
+
 void Tests::testThreeFold()
 {
     History::globalInstance()->clear();
@@ -589,7 +1225,7 @@ void Tests::testThreeFold4()
     root->generatePotentials();
 
     bool found = false;
-    QVector<Node::Potential> *potentials = root->m_position->potentials(); // not a copy
+    Node::PotentialVector *potentials = root->m_position->potentials(); // not a copy
     QVERIFY(!potentials->isEmpty());
     for (int i = 0; i < potentials->count(); ++i) {
         // We get a non-const reference to the actual value and change it in place
@@ -608,6 +1244,41 @@ void Tests::testThreeFold4()
     QVERIFY(found);
 }
 
+void Tests::testThreeFoldInTree()
+{
+    History::globalInstance()->clear();
+
+    // The start position occurs once in the history and twice more down the tree
+    QVector<QString> moves = QString("g1f3 g8f6 f3g1 f6g8").split(" ").toVector();
+    StandaloneGame g;
+    History::globalInstance()->addGame(g);
+    for (QString mv : moves) {
+        Move move = Notation::stringToMove(mv, Chess::Computer);
+        bool success = g.makeMove(move);
+        QVERIFY(success);
+        History::globalInstance()->addGame(g);
+    }
+
+    Tree tree;
+    Node *root = tree.embodiedRoot();
+    QVERIFY(root);
+    QCOMPARE(root->repetitions(), 1);
+
+    Node *lastNode = root;
+    QVector<QString> nodeMoves = QString("b1c3 b8c6 c3b1 c6b8").split(" ").toVector();
+    for (QString move : nodeMoves) {
+        QVERIFY(!lastNode->isThreeFold());
+        Move mv = Notation::stringToMove(move, Chess::Computer);
+        Node::Potential *potential = lastNode->generatePotential(mv);
+        Node::NodeGenerationError error = Node::NoError;
+        lastNode = lastNode->generateNode(potential->move(), potential->pValue(), lastNode, Cache::globalInstance(), &error);
+        QVERIFY(lastNode);
+        lastNode->initializePosition(Cache::globalInstance());
+    }
+
+    QVERIFY(lastNode->isThreeFold());
+}
+
 void Tests::checkGame(const QString &fen, const QVector<QString> &mv)
 {
     QVector<QString> moves = mv;
@@ -825,6 +1496,77 @@ void Tests::testDoNotPropagateDrawnAsExact()
     QVERIFY(!b7b8->isExact());
 }
 
+void Tests::testIncrementalBackup()
+{
+    // Backing up only the paths from the scored leaves, or the subtrees on several threads, must
+    // agree with the full minimax pass
+    float rootQValue[3];
+    float childQValue[3];
+    quint32 rootVisits[3];
+    for (int pass = 0; pass < 3; ++pass) {
+        Cache::globalInstance()->reset();
+        History::globalInstance()->clear();
+        History::globalInstance()->addGame(StandaloneGame());
+
+        Tree tree;
+        Node *root = tree.embodiedRoot();
+        QVERIFY(root);
+        root->setPositionQValue(0.0f);
+        root->setQValueAndVisit();
+
+        Node *parent = root;
+        for (int depth = 0; depth < 2; ++depth) {
+            parent->generatePotentials();
+            Node::PotentialVector *potentials = parent->position()->potentials();
+            for (int i = 0; i < potentials->count(); ++i)
+                (*potentials)[i].setPValue(1.0f / potentials->count());
+
+            QVector<Node*> leaves;
+            while (parent->hasPotentials()) {
+                Node::NodeGenerationError error = Node::NoError;
+                Node *child = parent->generateNextChild(Cache::globalInstance(), &error);
+                QVERIFY(child);
+                QCOMPARE(Node::NoError, error);
+                child->initializePosition(Cache::globalInstance());
+                child->setPositionQValue(0.05f * (leaves.count() % 5) - 0.1f);
+                child->backPropagateDirty();
+                leaves.append(child);
+            }
+
+            WorkerInfo info;
+            if (pass == 1) {
+                Node::minimaxPaths(leaves, &info);
+            } else if (pass == 2) {
+                double newScores = 0;
+                quint32 newVisits = 0;
+                Node::minimaxConcurrently(root, &info, &newScores, &newVisits, 1 /*splitVisits*/,
+                    [](const std::function<void()> &job) {
+                        std::thread helper(job);
+                        job();
+                        helper.join();
+                    });
+                QCOMPARE(newVisits, quint32(leaves.count()));
+            } else {
+                double newScores = 0;
+                quint32 newVisits = 0;
+                Node::minimax(root, 0, &info, &newScores, &newVisits);
+            }
+            QVERIFY(!root->isDirty());
+            parent = parent->firstChild();
+        }
+
+        rootQValue[pass] = root->qValue();
+        childQValue[pass] = root->firstChild()->qValue();
+        rootVisits[pass] = root->visits();
+    }
+
+    for (int pass = 1; pass < 3; ++pass) {
+        QCOMPARE(rootQValue[0], rootQValue[pass]);
+        QCOMPARE(childQValue[0], childQValue[pass]);
+        QCOMPARE(rootVisits[0], rootVisits[pass]);
+    }
+}
+
 void Tests::testContext()
 {
     {
@@ -26,6 +26,8 @@
 #include "tests.h"
 
 #include "fastapprox/fastonebigheader.h"
+#include "node.h"
+#include "vectormath.h"
 
 #define USE_EXACT
 
@@ -121,3 +123,35 @@ void Tests::testFastPow()
         sum += fastpow(xd, yd);
 //    qDebug() << "fastpow elapsed" << timer.elapsed() << "error" << error;
 }
+
+void Tests::testVectorMath()
+{
+    // An odd count so both the lanes and the tail are checked against the scalar versions
+    const int count = 37;
+    float values[count];
+    float expected[count];
+    float qValues[count];
+    float denominators[count];
+    float scores[count];
+    float expectedTotal = 0;
+    for (int i = 0; i < count; ++i) {
+        values[i] = float(drand48());
+        expected[i] = fastpow(values[i], 0.6f);
+        expectedTotal += expected[i];
+        qValues[i] = float(-1.0 + 2.0 * drand48());
+        denominators[i] = float(1 + i);
+    }
+
+    const float total = VectorMath::powAndSum(values, count, 0.6f);
+    QVERIFY(qAbs(total - expectedTotal) < 1e-4f);
+    for (int i = 0; i < count; ++i)
+        QVERIFY(qAbs(values[i] - expected[i]) < 1e-5f);
+
+    VectorMath::scale(values, count, 1.0f / total);
+    for (int i = 0; i < count; ++i)
+        QVERIFY(qAbs(values[i] - expected[i] / total) < 1e-5f);
+
+    VectorMath::uctScores(qValues, values, denominators, count, 1.5f, scores);
+    for (int i = 0; i < count; ++i)
+        QVERIFY(qAbs(scores[i] - Node::uctFormula(qValues[i], 1.5f * values[i] / denominators[i])) < 1e-6f);
+}
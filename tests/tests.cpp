@@ -32,6 +32,10 @@ void Tests::initTestCase()
     Options::globalInstance()->setOption("SyzygyPath",
         QCoreApplication::applicationDirPath() + QDir::separator() + "../../syzygy/");
     Options::globalInstance()->setOption("Cache", QLatin1Literal("100000"));
+
+    // Without any weights to be found the searches run on the synthetic network
+    if (!QFileInfo::exists(Options::globalInstance()->option("WeightsFile").value()))
+        Options::globalInstance()->setOption("SyntheticNetwork", QLatin1Literal("true"));
 }
 
 void Tests::cleanupTestCase()
@@ -90,27 +90,53 @@ private slots:
     // TestBasics
     void testBasicStructures();
     void testSizes();
+    void testPackedPotential();
     void testCPFormula();
     void testVLDFormula();
+    void testCpuList();
 #if defined(RUN_PERFT)
     void testPerft();
 #endif
 
     // TestCache
     void testBasicCache();
+    void testCacheMemoryUsage();
+    void testCachePrefault();
+    void testShardedCache();
+    void testRemoteSampleEncoding();
     void testStartingPosition();
     void testStartingPositionBlack();
+    void testPartialPotentialOrder();
+    void testRefineEvaluation();
 
     // TestGames
     void testCastlingAnd960();
     void testSearchForMateInOne();
+    void testTranspositionGraph();
+    void testMateSolver();
     void testInstaMove();
     void testEarlyExit();
+    void testClockSpeedModel();
+    void testPonder();
+    void testDeepTreeReuse();
+    void testTreeCheckpoint();
+    void testTreeExport();
     void testHistory();
+    void testSessionHistory();
+    void testConcurrentSessions();
+    void testIncrementalPosition();
+    void testInfoSlot();
+    void testStageTimes();
+    void testDebugLog();
+    void testMetrics();
+    void testSyntheticNetwork();
+    void testSelectionTrace();
+    void testReplay();
     void testThreeFold();
     void testThreeFold2();
     void testThreeFold3();
     void testThreeFold4();
+    void testThreeFoldInTree();
     void testMateWithKRvK();
     void testMateWithKQvK();
     void testMateWithKBNvK();
@@ -118,6 +144,7 @@ private slots:
     void testMateWithKQQvK();
     void testTB();
     void testDoNotPropagateDrawnAsExact();
+    void testIncrementalBackup();
     void testContext();
 
     // Placed at the end because this turns off fathom and fathom is bugged
@@ -126,6 +153,7 @@ private slots:
     // TestMath
     void testFastLog();
     void testFastPow();
+    void testVectorMath();
 
 private:
     void checkGame(const QString &fen, const QVector<QString> &mv);
@@ -37,7 +37,7 @@ win32 {
     PRE_TARGETDEPS += $$PWD/../lib $$DESTDIR/margean.lib
 } else {
     PRE_TARGETDEPS += $$PWD/../lib $$DESTDIR/libmargean.a
-    QMAKE_CXXFLAGS += -march=native -ffast-math
+    QMAKE_CXXFLAGS += -msse4.2 -mpopcnt -ffast-math
 }
 
 LIBS += -L$$OUT_PWD/../bin -lmargean
@@ -45,4 +45,4 @@ LIBS += -L$$OUT_PWD/../bin -lmargean
 include($$PWD/../lib/atomic.pri)
 include($$PWD/../lib/zlib.pri)
 include($$PWD/../lib/protobuf.pri)
-include($$PWD/../lib/cuda.pri)
+!cpuonly: include($$PWD/../lib/cuda.pri)